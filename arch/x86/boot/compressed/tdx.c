@@ -74,4 +74,6 @@ void early_tdx_detect(void)
 	pio_ops.f_inb  = tdx_inb;
 	pio_ops.f_outb = tdx_outb;
 	pio_ops.f_outw = tdx_outw;
+
+	tdx_accept_level_init();
 }
@@ -9,6 +9,7 @@
 #include <linux/device.h>
 #include <linux/cc_platform.h>
 #include <linux/export.h>
+#include <linux/hashtable.h>
 #include <uapi/linux/virtio_ids.h>
 
 #include <asm/tdx.h>
@@ -86,6 +87,35 @@ static struct authorize_node allow_list[] = {
 	{ "platform", platform_allow_hids },
 };
 
+/*
+ * The allow lists above and on the command line, compiled at early_initcall
+ * so that a device lookup doesn't walk every node: exact PCI vendor:device
+ * ids are hashed, the few ids with wildcards are matched as a table, and the
+ * buses allowed as a whole are listed once.  Devices added before that use
+ * authorized_node_match() on the lists directly.
+ */
+#define PCI_ID_HASH_BITS		6
+#define PCI_ID_MAX			(ARRAY_SIZE(pci_allow_ids) + CMDLINE_MAX_NODES)
+
+struct pci_id_node {
+	struct hlist_node node;
+	u32 key;
+};
+
+static DEFINE_HASHTABLE(pci_id_hash, PCI_ID_HASH_BITS);
+static struct pci_id_node pci_id_nodes[PCI_ID_MAX];
+/* Zero terminated, for pci_match_id() */
+static struct pci_device_id pci_wild_ids[PCI_ID_MAX + 1];
+static const char *allow_all_buses[CMDLINE_MAX_NODES + ARRAY_SIZE(allow_list)];
+static int allow_all_buses_len;
+static bool allow_all;
+static bool filter_compiled __ro_after_init;
+
+static inline u32 pci_id_key(unsigned int vendor, unsigned int device)
+{
+	return vendor << 16 | (device & 0xffff);
+}
+
 static bool dev_is_acpi(struct device *dev)
 {
 	return !strcmp(dev_bus_name(dev), "acpi");
@@ -224,6 +254,133 @@ static __init int allowed_cmdline_setup(char *buf)
 }
 __setup("authorize_allow_devs=", allowed_cmdline_setup);
 
+static __init void compile_pci_ids(const struct pci_device_id *ids, int len,
+				   int *nr_hashed, int *nr_wild)
+{
+	const struct pci_device_id *id;
+	struct pci_id_node *n;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		id = &ids[i];
+		if (!id->vendor && !id->device && !id->subvendor &&
+		    !id->subdevice)
+			break;
+
+		if (id->vendor == PCI_ANY_ID || id->device == PCI_ANY_ID ||
+		    id->subvendor != PCI_ANY_ID ||
+		    id->subdevice != PCI_ANY_ID || id->class_mask) {
+			pci_wild_ids[(*nr_wild)++] = *id;
+			continue;
+		}
+
+		n = &pci_id_nodes[(*nr_hashed)++];
+		n->key = pci_id_key(id->vendor, id->device);
+		hash_add(pci_id_hash, &n->node, n->key);
+	}
+}
+
+static __init void compile_node(struct authorize_node *node, int *nr_hashed,
+				int *nr_wild)
+{
+	if (!node->dev_list) {
+		if (!strcmp(node->bus, "ALL"))
+			allow_all = true;
+		else
+			allow_all_buses[allow_all_buses_len++] = node->bus;
+		return;
+	}
+
+	/* ACPI and platform nodes match the built-in HID lists. */
+	if (!strcmp(node->bus, "pci"))
+		compile_pci_ids(node->dev_list, PCI_ID_MAX, nr_hashed, nr_wild);
+}
+
+static __init int tdx_filter_compile(void)
+{
+	int i, nr_hashed = 0, nr_wild = 0;
+
+	if (!cpu_feature_enabled(X86_FEATURE_TDX_GUEST))
+		return 0;
+
+	for (i = 0; i < ARRAY_SIZE(allow_list); i++)
+		compile_node(&allow_list[i], &nr_hashed, &nr_wild);
+
+	/* All command line PCI nodes share cmd_pci_ids, compile it once. */
+	for (i = 0; i < cmd_allowed_nodes_len; i++) {
+		if (!strcmp(cmd_allowed_nodes[i].bus, "pci") &&
+		    cmd_allowed_nodes[i].dev_list)
+			continue;
+		compile_node(&cmd_allowed_nodes[i], &nr_hashed, &nr_wild);
+	}
+	compile_pci_ids(cmd_pci_ids, cmd_pci_nodes_len, &nr_hashed, &nr_wild);
+
+	filter_compiled = true;
+
+	return 0;
+}
+early_initcall(tdx_filter_compile);
+
+static bool hid_match(struct device *dev, char **hids, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (!strncmp(hids[i], dev_name(dev), strlen(hids[i])))
+			return true;
+	}
+
+	return false;
+}
+
+static bool pci_dev_authorized(struct pci_dev *pdev)
+{
+	u32 key = pci_id_key(pdev->vendor, pdev->device);
+	struct pci_id_node *n;
+
+	hash_for_each_possible(pci_id_hash, n, node, key) {
+		if (n->key == key)
+			return true;
+	}
+
+	return pci_match_id(pci_wild_ids, pdev);
+}
+
+static bool compiled_dev_authorized(struct device *dev)
+{
+	int i;
+
+	if (allow_all)
+		return true;
+
+	for (i = 0; i < allow_all_buses_len; i++) {
+		if (!strcmp(allow_all_buses[i], dev->bus->name))
+			return true;
+	}
+
+	if (dev_is_pci(dev)) {
+		struct pci_dev *pdev = to_pci_dev(dev);
+
+		if (pci_dev_authorized(pdev))
+			return true;
+
+		/*
+		 * Prevent any config space accesses in initcalls.
+		 * No locking needed here because it's a fresh device.
+		 */
+		if (pci_pcie_type(pdev) != PCI_EXP_TYPE_ROOT_PORT)
+			pdev->error_state = pci_channel_io_perm_failure;
+	} else if (dev_is_acpi(dev)) {
+		return hid_match(dev, acpi_allow_hids,
+				 ARRAY_SIZE(acpi_allow_hids));
+	} else if (dev_is_platform(dev)) {
+		return hid_match(dev, platform_allow_hids,
+				 ARRAY_SIZE(platform_allow_hids));
+	}
+
+	return false;
+}
+
 bool dev_authorized_init(void)
 {
 	if (cpu_feature_enabled(X86_FEATURE_TDX_GUEST) &&
@@ -246,6 +403,9 @@ bool arch_dev_authorized(struct device *dev)
 	if (!dev->bus)
 		return dev->authorized;
 
+	if (filter_compiled)
+		return compiled_dev_authorized(dev);
+
 	/* Lookup arch allow list */
 	for (i = 0;  i < ARRAY_SIZE(allow_list); i++) {
 		if (authorized_node_match(dev, &allow_list[i]))
@@ -0,0 +1,421 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Guest side TDX micro-benchmarks, run by reading debugfs tdx/perf:
+ *
+ * - TDG.MEM.PAGE.ACCEPT throughput by page size, of memory converted to
+ *   shared and back to private with MapGPA
+ * - set_memory_decrypted() and set_memory_encrypted() cost by size
+ * - #VE round trips of CPUID, RDMSR and MMIO
+ * - GetQuote latency, from the TDVMCALL to the VMM's completion
+ * - TDG.VP.INFO and TDG.VP.VMCALL<GetTdVmCallInfo> cycles, with a histogram,
+ *   bucket N counting calls in [2^(N+6), 2^(N+7)) cycles
+ *
+ * Put side by side with the TD exit stats of the host, they tell whether a
+ * slowdown comes from the guest or from the host.
+ */
+
+#undef pr_fmt
+#define pr_fmt(fmt)     "tdx-perf: " fmt
+
+#include <linux/debugfs.h>
+#include <linux/delay.h>
+#include <linux/gfp.h>
+#include <linux/io.h>
+#include <linux/log2.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/seq_file.h>
+#include <linux/set_memory.h>
+#include <linux/slab.h>
+#include <uapi/linux/tdx-guest.h>
+
+#include <asm/apicdef.h>
+#include <asm/cacheflush.h>
+#include <asm/coco.h>
+#include <asm/io_apic.h>
+#include <asm/kvm_para.h>
+#include <asm/msr.h>
+#include <asm/tdx.h>
+
+/* 2M blocks converted and accepted per page size */
+#define TDX_PERF_ACCEPT_BLOCKS		16
+#define TDX_PERF_CONV_ITERS		64
+#define TDX_PERF_VE_ITERS		10000
+#define TDX_PERF_QUOTE_LEN		SZ_16K
+#define TDX_PERF_QUOTE_TIMEOUT_MS	30000
+#define TDX_PERF_TDCALL_ITERS		10000
+#define TDX_PERF_NR_BUCKETS		16
+#define TDX_PERF_BUCKET_SHIFT		7
+
+static DEFINE_MUTEX(tdx_perf_lock);
+
+static u64 tdx_perf_map_gpa(phys_addr_t start, size_t len, bool enc)
+{
+	if (!enc)
+		start |= cc_mkdec(0);
+
+	return _tdx_hypercall(TDVMCALL_MAP_GPA, start, len, 0, 0);
+}
+
+static u64 tdx_perf_accept(phys_addr_t start, size_t len, u8 page_size)
+{
+	struct tdx_module_args args;
+	size_t accept_size = page_size == TDX_PS_2M ? PMD_SIZE : PAGE_SIZE;
+	phys_addr_t addr;
+	u64 err;
+
+	for (addr = start; addr < start + len; addr += accept_size) {
+		args = (struct tdx_module_args) { .rcx = addr | page_size };
+		err = tdcall(TDG_MEM_PAGE_ACCEPT, &args);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+/*
+ * Give a free 2M block back to the VMM with MapGPA and take it back, so that
+ * it is pending, then time accepting it.  The block isn't accessed while
+ * shared, the direct map stays private, and it's private and accepted again
+ * at the end.  A block that fails half-way is leaked, as its state isn't
+ * known anymore.
+ */
+static int tdx_perf_accept_one(u8 page_size, u64 *ns)
+{
+	struct page *page;
+	phys_addr_t pa;
+	u64 start, err;
+
+	page = alloc_pages(GFP_KERNEL, PMD_SHIFT - PAGE_SHIFT);
+	if (!page)
+		return -ENOMEM;
+	pa = page_to_phys(page);
+
+	clflush_cache_range(page_address(page), PMD_SIZE);
+	if (tdx_perf_map_gpa(pa, PMD_SIZE, false) ||
+	    tdx_perf_map_gpa(pa, PMD_SIZE, true)) {
+		pr_warn("MapGPA failed, leaking 2M at %pa\n", &pa);
+		return -EIO;
+	}
+
+	start = ktime_get_ns();
+	err = tdx_perf_accept(pa, PMD_SIZE, page_size);
+	*ns += ktime_get_ns() - start;
+
+	/* The VMM may not back the block with a 2M page, accept it by 4K. */
+	if (err && page_size == TDX_PS_2M &&
+	    !tdx_perf_accept(pa, PMD_SIZE, TDX_PS_4K)) {
+		__free_pages(page, PMD_SHIFT - PAGE_SHIFT);
+		return -EOPNOTSUPP;
+	}
+	if (err) {
+		pr_warn("accept failed, err=%llx, leaking 2M at %pa\n", err, &pa);
+		return -EIO;
+	}
+
+	__free_pages(page, PMD_SHIFT - PAGE_SHIFT);
+	return 0;
+}
+
+static void tdx_perf_accept_run(struct seq_file *m)
+{
+	static const struct {
+		const char *name;
+		u8 page_size;
+		size_t accept_size;
+	} sizes[] = {
+		{ "4K", TDX_PS_4K, PAGE_SIZE },
+		{ "2M", TDX_PS_2M, PMD_SIZE },
+	};
+	u64 ns, calls;
+	int i, j, r = 0;
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		ns = 0;
+		for (j = 0; j < TDX_PERF_ACCEPT_BLOCKS; j++) {
+			r = tdx_perf_accept_one(sizes[i].page_size, &ns);
+			if (r)
+				break;
+		}
+		if (!j) {
+			seq_printf(m, "accept %s: failed, %d\n", sizes[i].name, r);
+			continue;
+		}
+
+		calls = j * (PMD_SIZE / sizes[i].accept_size);
+		seq_printf(m, "accept %s: %llu calls, %llu ns/call, %llu MiB/s\n",
+			   sizes[i].name, calls, ns / calls,
+			   div64_u64((u64)j * (PMD_SIZE >> 20) * NSEC_PER_SEC,
+				     max(ns, 1ULL)));
+	}
+}
+
+static void tdx_perf_conv_run(struct seq_file *m)
+{
+	static const unsigned int orders[] = { 0, 4, PMD_SHIFT - PAGE_SHIFT };
+	u64 dec_ns, enc_ns, start;
+	struct page *page;
+	unsigned long addr;
+	int i, j, npages;
+
+	for (i = 0; i < ARRAY_SIZE(orders); i++) {
+		npages = 1 << orders[i];
+		page = alloc_pages(GFP_KERNEL, orders[i]);
+		if (!page) {
+			seq_printf(m, "convert %luK: failed, %d\n",
+				   npages * PAGE_SIZE / SZ_1K, -ENOMEM);
+			continue;
+		}
+		addr = (unsigned long)page_address(page);
+
+		dec_ns = enc_ns = 0;
+		for (j = 0; j < TDX_PERF_CONV_ITERS; j++) {
+			start = ktime_get_ns();
+			if (set_memory_decrypted(addr, npages))
+				break;
+			dec_ns += ktime_get_ns() - start;
+
+			start = ktime_get_ns();
+			if (set_memory_encrypted(addr, npages))
+				break;
+			enc_ns += ktime_get_ns() - start;
+		}
+		if (j < TDX_PERF_CONV_ITERS) {
+			/* Leak the pages, they may be shared. */
+			seq_printf(m, "convert %luK: failed, %d\n",
+				   npages * PAGE_SIZE / SZ_1K, -EIO);
+			continue;
+		}
+
+		seq_printf(m, "convert %luK: to shared %llu ns, to private %llu ns\n",
+			   npages * PAGE_SIZE / SZ_1K, dec_ns / j, enc_ns / j);
+		__free_pages(page, orders[i]);
+	}
+}
+
+static u64 tdx_perf_ve_cpuid(void __iomem *unused)
+{
+	unsigned int eax = KVM_CPUID_SIGNATURE, ebx, ecx = 0, edx;
+
+	native_cpuid(&eax, &ebx, &ecx, &edx);
+	return eax;
+}
+
+static u64 tdx_perf_ve_rdmsr(void __iomem *unused)
+{
+	u64 val;
+	int err;
+
+	val = native_read_msr_safe(MSR_KVM_SYSTEM_TIME_NEW, &err);
+	return err ? 0 : val;
+}
+
+/* The IOAPIC index register, reading it has no side effect. */
+static u64 tdx_perf_ve_mmio(void __iomem *base)
+{
+	return readl(base);
+}
+
+static void tdx_perf_ve_run(struct seq_file *m)
+{
+	static const struct {
+		const char *name;
+		u64 (*fn)(void __iomem *base);
+	} ves[] = {
+		{ "cpuid", tdx_perf_ve_cpuid },
+		{ "rdmsr", tdx_perf_ve_rdmsr },
+		{ "mmio", tdx_perf_ve_mmio },
+	};
+	void __iomem *ioapic = NULL;
+	u64 start, ns;
+	int i, j;
+
+	if (nr_ioapics)
+		ioapic = ioremap(IO_APIC_DEFAULT_PHYS_BASE, PAGE_SIZE);
+
+	for (i = 0; i < ARRAY_SIZE(ves); i++) {
+		if (ves[i].fn == tdx_perf_ve_mmio && !ioapic) {
+			seq_printf(m, "#VE %s: no IOAPIC\n", ves[i].name);
+			continue;
+		}
+
+		start = ktime_get_ns();
+		for (j = 0; j < TDX_PERF_VE_ITERS; j++)
+			ves[i].fn(ioapic);
+		ns = ktime_get_ns() - start;
+
+		seq_printf(m, "#VE %s: %llu ns\n", ves[i].name,
+			   ns / TDX_PERF_VE_ITERS);
+	}
+
+	if (ioapic)
+		iounmap(ioapic);
+}
+
+static u64 tdx_perf_vp_info(void)
+{
+	struct tdx_module_args args = {};
+
+	return tdcall(TDG_VP_INFO, &args);
+}
+
+/* The TDVMCALL with the least work in the VMM, the round trip cost. */
+static u64 tdx_perf_vmcall(void)
+{
+	return _tdx_hypercall(TDVMCALL_GET_TD_VM_CALL_INFO, 0, 0, 0, 0);
+}
+
+static unsigned int tdx_perf_bucket(u64 cycles)
+{
+	unsigned int b;
+
+	if (cycles < BIT_ULL(TDX_PERF_BUCKET_SHIFT))
+		return 0;
+
+	b = ilog2(cycles) - (TDX_PERF_BUCKET_SHIFT - 1);
+	return min_t(unsigned int, b, TDX_PERF_NR_BUCKETS - 1);
+}
+
+static void tdx_perf_tdcall_run(struct seq_file *m)
+{
+	static const struct {
+		const char *name;
+		u64 (*fn)(void);
+	} calls[] = {
+		{ "TDG.VP.INFO", tdx_perf_vp_info },
+		{ "TDG.VP.VMCALL", tdx_perf_vmcall },
+	};
+	u64 hist[TDX_PERF_NR_BUCKETS];
+	u64 start, cycles, total, min_cycles, err;
+	int i, j;
+
+	for (i = 0; i < ARRAY_SIZE(calls); i++) {
+		memset(hist, 0, sizeof(hist));
+		min_cycles = U64_MAX;
+		total = 0;
+
+		for (j = 0; j < TDX_PERF_TDCALL_ITERS; j++) {
+			start = rdtsc_ordered();
+			err = calls[i].fn();
+			cycles = rdtsc_ordered() - start;
+			if (err)
+				break;
+
+			min_cycles = min(min_cycles, cycles);
+			total += cycles;
+			hist[tdx_perf_bucket(cycles)]++;
+		}
+		if (j < TDX_PERF_TDCALL_ITERS) {
+			seq_printf(m, "%s: failed, err=%llx\n", calls[i].name, err);
+			continue;
+		}
+
+		seq_printf(m, "%s: min %llu cycles, mean %llu cycles, hist",
+			   calls[i].name, min_cycles, total / j);
+		for (j = 0; j < TDX_PERF_NR_BUCKETS; j++)
+			seq_printf(m, " %llu", hist[j]);
+		seq_putc(m, '\n');
+	}
+}
+
+static void tdx_perf_quote_run(struct seq_file *m)
+{
+	int npages = TDX_PERF_QUOTE_LEN >> PAGE_SHIFT;
+	u8 reportdata[TDX_REPORTDATA_LEN] = {};
+	struct tdx_quote_hdr *hdr;
+	u64 start, ns;
+	u8 *tdreport;
+	void *buf;
+	int r;
+
+	tdreport = kzalloc(TDX_REPORT_LEN, GFP_KERNEL);
+	if (!tdreport) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	r = tdx_mcall_get_report0(reportdata, tdreport);
+	if (r)
+		goto out_report;
+
+	buf = alloc_pages_exact(TDX_PERF_QUOTE_LEN, GFP_KERNEL | __GFP_ZERO);
+	if (!buf) {
+		r = -ENOMEM;
+		goto out_report;
+	}
+
+	/* The contents don't survive the conversion, fill it afterwards. */
+	if (set_memory_decrypted((unsigned long)buf, npages)) {
+		/* Leak the pages, they may be shared. */
+		r = -EIO;
+		goto out_report;
+	}
+
+	hdr = buf;
+	memcpy(hdr->data, tdreport, TDX_REPORT_LEN);
+	hdr->version = 1;
+	hdr->status = 0;
+	hdr->in_len = TDX_REPORT_LEN;
+	hdr->out_len = 0;
+
+	start = ktime_get_ns();
+	if (tdx_hcall_get_quote(buf, TDX_PERF_QUOTE_LEN)) {
+		r = -EIO;
+		goto out_encrypt;
+	}
+
+	while (READ_ONCE(hdr->status) == GET_QUOTE_IN_FLIGHT) {
+		if (ktime_get_ns() - start >
+		    TDX_PERF_QUOTE_TIMEOUT_MS * NSEC_PER_MSEC) {
+			/* The VMM may still write the buffer, leak it. */
+			r = -ETIMEDOUT;
+			goto out_report;
+		}
+		usleep_range(100, 200);
+	}
+	ns = ktime_get_ns() - start;
+
+	if (hdr->status == GET_QUOTE_SUCCESS)
+		seq_printf(m, "GetQuote: %llu us, %u bytes\n", ns / NSEC_PER_USEC,
+			   hdr->out_len);
+	else
+		seq_printf(m, "GetQuote: failed, status %llx\n", hdr->status);
+
+out_encrypt:
+	if (set_memory_encrypted((unsigned long)buf, npages))
+		r = r ?: -EIO;
+	else
+		free_pages_exact(buf, TDX_PERF_QUOTE_LEN);
+out_report:
+	kfree(tdreport);
+out:
+	if (r)
+		seq_printf(m, "GetQuote: failed, %d\n", r);
+}
+
+static int tdx_perf_run_show(struct seq_file *m, void *v)
+{
+	mutex_lock(&tdx_perf_lock);
+	tdx_perf_accept_run(m);
+	tdx_perf_conv_run(m);
+	tdx_perf_ve_run(m);
+	tdx_perf_tdcall_run(m);
+	tdx_perf_quote_run(m);
+	mutex_unlock(&tdx_perf_lock);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(tdx_perf_run);
+
+static int __init tdx_perf_init(void)
+{
+	if (!cpu_feature_enabled(X86_FEATURE_TDX_GUEST))
+		return 0;
+
+	debugfs_create_file("perf", 0400, tdx_debugfs_dir, NULL,
+			    &tdx_perf_run_fops);
+
+	return 0;
+}
+late_initcall(tdx_perf_init);
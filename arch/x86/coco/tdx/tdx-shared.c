@@ -1,5 +1,13 @@
 #include <asm/tdx.h>
 #include <asm/pgtable.h>
+#include <uapi/asm/kvm_para.h>
+#include <uapi/asm/vmx.h>
+
+/*
+ * The largest page size the VMM maps private memory with.  Accepting a larger
+ * page only fails after an EPT violation round trip to the VMM, so don't try.
+ */
+static enum pg_level tdx_accept_max_level = PG_LEVEL_1G;
 
 static unsigned long try_accept_one(phys_addr_t start, unsigned long len,
 				    enum pg_level pg_level)
@@ -41,6 +49,75 @@ static unsigned long try_accept_one(phys_addr_t start, unsigned long len,
 	return accept_size;
 }
 
+/*
+ * The TDVMCALL_KVM_EXT_* of the VMM, or 0 if it isn't KVM.  The signature is
+ * read with Instruction.CPUID, as a CPUID #VE may not be handled yet.  KVM
+ * moves its leaves to 0x40000100 when it also exposes the Hyper-V ones.
+ */
+u64 tdx_kvm_ext(void)
+{
+	struct tdx_module_args args;
+	u32 base;
+
+	for (base = KVM_CPUID_SIGNATURE; base <= KVM_CPUID_SIGNATURE + 0x100;
+	     base += 0x100) {
+		args = (struct tdx_module_args) {
+			.r10 = TDX_HYPERCALL_STANDARD,
+			.r11 = hcall_func(EXIT_REASON_CPUID),
+			.r12 = base,
+		};
+		if (__tdx_hypercall(&args))
+			continue;
+
+		/* EBX, ECX and EDX hold KVM_SIGNATURE, "KVMKVMKVM\0\0\0". */
+		if ((u32)args.r13 == 0x4b4d564b && (u32)args.r14 == 0x564b4d56 &&
+		    (u32)args.r15 == 0x4d)
+			goto kvm;
+	}
+	return 0;
+
+kvm:
+	args = (struct tdx_module_args) {
+		.r10 = TDVMCALL_KVM_GET_EXT,
+	};
+	if (__tdx_hypercall(&args))
+		return 0;
+
+	return args.r11;
+}
+
+/* Called once at boot, before any memory is accepted. */
+void tdx_accept_level_init(void)
+{
+	struct tdx_module_args args = {
+		.r10 = TDVMCALL_KVM_ACCEPT_LEVEL,
+	};
+
+	if (!(tdx_kvm_ext() & TDVMCALL_KVM_EXT_ACCEPT_LEVEL))
+		return;
+
+	if (__tdx_hypercall(&args))
+		return;
+
+	switch (args.r11) {
+	case TDX_PS_4K:
+		tdx_accept_max_level = PG_LEVEL_4K;
+		break;
+	case TDX_PS_2M:
+		tdx_accept_max_level = PG_LEVEL_2M;
+		break;
+	}
+}
+
+/*
+ * The size of the largest page the VMM maps private memory with.  Accepting
+ * a part of such a page makes the VMM split its mapping for good.
+ */
+unsigned long tdx_accept_align(void)
+{
+	return page_level_size(tdx_accept_max_level);
+}
+
 bool tdx_accept_memory(phys_addr_t start, phys_addr_t end)
 {
 	/*
@@ -49,19 +126,20 @@ bool tdx_accept_memory(phys_addr_t start, phys_addr_t end)
 	 */
 	while (start < end) {
 		unsigned long len = end - start;
-		unsigned long accept_size;
+		unsigned long accept_size = 0;
+		enum pg_level level;
 
 		/*
 		 * Try larger accepts first. It gives chance to VMM to keep
 		 * 1G/2M Secure EPT entries where possible and speeds up
 		 * process by cutting number of hypercalls (if successful).
+		 * Start from the largest size the VMM maps with.
 		 */
-
-		accept_size = try_accept_one(start, len, PG_LEVEL_1G);
-		if (!accept_size)
-			accept_size = try_accept_one(start, len, PG_LEVEL_2M);
-		if (!accept_size)
-			accept_size = try_accept_one(start, len, PG_LEVEL_4K);
+		for (level = tdx_accept_max_level; level >= PG_LEVEL_4K; level--) {
+			accept_size = try_accept_one(start, len, level);
+			if (accept_size)
+				break;
+		}
 		if (!accept_size)
 			return false;
 		start += accept_size;
@@ -5,8 +5,11 @@
 #define pr_fmt(fmt)     "tdx: " fmt
 
 #include <linux/cpufeature.h>
+#include <linux/debugfs.h>
 #include <linux/export.h>
+#include <linux/hash.h>
 #include <linux/io.h>
+#include <linux/moduleparam.h>
 #include <linux/string.h>
 #include <linux/uaccess.h>
 #include <linux/interrupt.h>
@@ -15,13 +18,21 @@
 #include <linux/platform_device.h>
 #include <linux/pci.h>
 #include <linux/random.h>
+#include <linux/seq_file.h>
+#include <linux/sched/clock.h>
+#include <linux/sched/idle.h>
+#include <linux/set_memory.h>
 #include <linux/virtio_anchor.h>
+#include <linux/workqueue.h>
+#include <asm/apicdef.h>
+#include <asm/cmdline.h>
 #include <asm/coco.h>
 #include <asm/tdx.h>
 #include <asm/i8259.h>
 #include <asm/vmx.h>
 #include <asm/insn.h>
 #include <asm/insn-eval.h>
+#include <asm/kvm_para.h>
 #include <asm/pgtable.h>
 #include <asm/irqdomain.h>
 
@@ -55,9 +66,99 @@
 /* Caches TD Attributes from TDG.VP.INFO TDCALL */
 static u64 td_attr;
 
+/* KVM paravirt features and hints advertised by the VMM, read at boot. */
+static u32 tdx_kvm_features __ro_after_init;
+static u32 tdx_kvm_hints __ro_after_init;
+
 int tdx_notify_irq = -1;
 EXPORT_SYMBOL_GPL(tdx_notify_irq);
 
+/*
+ * Per-CPU count and TSC cycles of #VEs by exit reason, of TDVMCALLs by leaf
+ * and of TDCALLs by leaf, exposed in debugfs tdx/.  Off unless enabled
+ * through tdx/enable.
+ *
+ * TDVMCALL slots: exit reasons below 64 (Instruction.*), 64 + the low bits
+ * of the GHCI leaves (0x10000 and up) and the last slot for everything
+ * else, e.g. KVM hypercalls.
+ */
+enum {
+	TDX_STAT_VE,
+	TDX_STAT_TDVMCALL,
+	TDX_STAT_TDCALL,
+	TDX_STAT_NR,
+};
+
+#define TDX_STAT_NR_LEAVES	128
+#define TDX_STAT_GHCI_BASE	64
+
+struct tdx_stat {
+	u64 count;
+	u64 cycles;
+};
+
+static DEFINE_STATIC_KEY_FALSE(tdx_stats_key);
+static DEFINE_PER_CPU(struct tdx_stat [TDX_STAT_NR][TDX_STAT_NR_LEAVES],
+		      tdx_stats);
+
+static __always_inline u64 tdx_stat_start(void)
+{
+	return static_branch_unlikely(&tdx_stats_key) ? rdtsc_ordered() : 0;
+}
+
+static __always_inline void tdx_stat_account(int type, u64 leaf, u64 start)
+{
+	unsigned int i = min_t(u64, leaf, TDX_STAT_NR_LEAVES - 1);
+
+	if (!static_branch_unlikely(&tdx_stats_key) || !start)
+		return;
+
+	this_cpu_inc(tdx_stats[type][i].count);
+	this_cpu_add(tdx_stats[type][i].cycles, rdtsc_ordered() - start);
+}
+
+static __always_inline u64 tdx_stat_tdvmcall_slot(struct tdx_module_args *args)
+{
+	if (args->r10 != TDX_HYPERCALL_STANDARD)
+		return TDX_STAT_NR_LEAVES - 1;
+	if (args->r11 < TDX_STAT_GHCI_BASE)
+		return args->r11;
+	if (args->r11 >= TDVMCALL_GET_TD_VM_CALL_INFO &&
+	    args->r11 - TDVMCALL_GET_TD_VM_CALL_INFO <
+	    TDX_STAT_NR_LEAVES - 1 - TDX_STAT_GHCI_BASE)
+		return TDX_STAT_GHCI_BASE + args->r11 -
+		       TDVMCALL_GET_TD_VM_CALL_INFO;
+	return TDX_STAT_NR_LEAVES - 1;
+}
+
+/* Untraced, but accounted, version of __tdx_hypercall */
+static __always_inline u64 tdx_hypercall(struct tdx_module_args *args)
+{
+	u64 slot = tdx_stat_tdvmcall_slot(args);
+	u64 start = tdx_stat_start();
+	u64 err;
+
+	err = __tdx_hypercall(args);
+	tdx_stat_account(TDX_STAT_TDVMCALL, slot, start);
+
+	return err;
+}
+
+static __always_inline u64 tdx_hypercall_simple(u64 fn, u64 r12, u64 r13,
+						u64 r14, u64 r15)
+{
+	struct tdx_module_args args = {
+		.r10 = TDX_HYPERCALL_STANDARD,
+		.r11 = fn,
+		.r12 = r12,
+		.r13 = r13,
+		.r14 = r14,
+		.r15 = r15,
+	};
+
+	return tdx_hypercall(&args);
+}
+
 /* Traced version of __tdx_hypercall */
 static u64 __trace_tdx_hypercall(struct tdx_module_args *args)
 {
@@ -65,7 +166,7 @@ static u64 __trace_tdx_hypercall(struct tdx_module_args *args)
 
 	trace_tdx_hypercall_enter_rcuidle(args->r11, args->r12, args->r13,
 			args->r14, args->r15);
-	err = __tdx_hypercall(args);
+	err = tdx_hypercall(args);
 	trace_tdx_hypercall_exit_rcuidle(err, args->r11, args->r12,
 			args->r13, args->r14, args->r15);
 
@@ -76,13 +177,15 @@ static u64 __trace_tdx_hypercall(struct tdx_module_args *args)
 static u64 __trace_tdcall_ret(u64 fn, struct tdx_module_args *args)
 {
 	struct tdx_module_args dummy_out;
-	u64 err;
+	u64 start, err;
 
 	if (!args)
 		args = &dummy_out;
 
 	trace_tdx_module_call_enter_rcuidle(fn, args->rcx, args->rdx, args->r8, args->r9);
+	start = tdx_stat_start();
 	err = tdcall_ret(fn, args);
+	tdx_stat_account(TDX_STAT_TDCALL, fn & 0xff, start);
 	trace_tdx_module_call_exit_rcuidle(err, args->rcx, args->rdx,
 			args->r8, args->r9, args->r10, args->r11);
 
@@ -214,6 +317,20 @@ u64 tdx_mcall_verify_report(u8 *reportmac)
 }
 EXPORT_SYMBOL_GPL(tdx_mcall_verify_report);
 
+static atomic64_t tdx_rtmr_extend_seq = ATOMIC64_INIT(0);
+
+/**
+ * tdx_rtmr_seq() - Sequence count of RTMR extensions.
+ *
+ * A TDREPORT generated after reading a given count reflects the RTMRs as of
+ * at least that count; it's stale once the count has changed.
+ */
+u64 tdx_rtmr_seq(void)
+{
+	return atomic64_read(&tdx_rtmr_extend_seq);
+}
+EXPORT_SYMBOL_GPL(tdx_rtmr_seq);
+
 /**
  * tdx_mcall_extend_rtmr() - Wrapper to extend RTMR registers using
  *                           TDG.MR.RTMR.EXTEND TDCALL.
@@ -237,6 +354,8 @@ int tdx_mcall_extend_rtmr(u8 *data, u8 index)
 	u64 ret;
 
 	ret = tdcall(TDG_EXTEND_RTMR, &args);
+	/* Bumped after the TDCALL, see tdx_rtmr_seq(). */
+	atomic64_inc(&tdx_rtmr_extend_seq);
 	if (ret) {
 		if (TDCALL_RETURN_CODE(ret) == TDCALL_INVALID_OPERAND)
 			return -EINVAL;
@@ -279,7 +398,7 @@ int tdx_hcall_get_quote(void *tdquote, int size)
 	 * call, hence completion of this request will be notified to
 	 * the TD guest via a callback interrupt.
 	 */
-	return __tdx_hypercall(&args);
+	return tdx_hypercall(&args);
 }
 EXPORT_SYMBOL_GPL(tdx_hcall_get_quote);
 
@@ -407,15 +526,103 @@ static int handle_halt(struct ve_info *ve)
 	return ve_instr_len(ve);
 }
 
+/*
+ * Adaptive polling before TDVMCALL<Instruction.HLT>, as both the halt and the
+ * wakeup are full TD exits and entries, and a remote wakeup also costs the
+ * waker an ICR write exit, which polling with TIF_POLLING_NRFLAG set avoids.
+ * The window of each CPU grows from halt_poll_ns_start up to halt_poll_ns_max
+ * while the halts end within it, and shrinks when they are longer.
+ *
+ * halt_poll: 1 to poll, 0 not to, -1 to poll if the VMM says that the vCPUs
+ * have dedicated physical CPUs with KVM_HINTS_REALTIME.
+ */
+static int halt_poll = -1;
+module_param(halt_poll, int, 0644);
+static unsigned int halt_poll_ns_start = 10000;
+module_param(halt_poll_ns_start, uint, 0644);
+static unsigned int halt_poll_ns_max = 200000;
+module_param(halt_poll_ns_max, uint, 0644);
+
+static DEFINE_PER_CPU(unsigned int, tdx_halt_poll_ns);
+
+static __always_inline bool tdx_halt_poll_enabled(void)
+{
+	int poll = READ_ONCE(halt_poll);
+
+	if (poll < 0)
+		return tdx_kvm_hints & BIT(KVM_HINTS_REALTIME);
+	return poll;
+}
+
+/*
+ * Called and returns with IRQs disabled.  Returns true if woken up.  Inlined
+ * in tdx_safe_halt() as it runs in the noinstr cpuidle section.
+ */
+static __always_inline bool tdx_halt_poll(u64 start)
+{
+	unsigned int limit = this_cpu_read(tdx_halt_poll_ns);
+
+	if (!limit)
+		return false;
+
+	raw_local_irq_enable();
+	if (!current_set_polling_and_test()) {
+		while (!need_resched() && local_clock_noinstr() - start < limit)
+			cpu_relax();
+	}
+	raw_local_irq_disable();
+
+	return current_clr_polling_and_test();
+}
+
+static __always_inline void tdx_halt_poll_adjust(u64 block_ns)
+{
+	unsigned int poll_ns = this_cpu_read(tdx_halt_poll_ns);
+	unsigned int max_ns = READ_ONCE(halt_poll_ns_max);
+
+	if (block_ns > max_ns)
+		poll_ns /= 2;
+	else if (block_ns > poll_ns)
+		poll_ns = min(max(poll_ns * 2, READ_ONCE(halt_poll_ns_start)),
+			      max_ns);
+
+	this_cpu_write(tdx_halt_poll_ns, poll_ns);
+}
+
 void __cpuidle tdx_safe_halt(void)
 {
 	const bool irq_disabled = false;
+	bool poll = tdx_halt_poll_enabled();
+	u64 start = 0;
+
+	if (poll) {
+		start = local_clock_noinstr();
+		if (tdx_halt_poll(start))
+			return;
+	}
 
 	/*
 	 * Use WARN_ONCE() to report the failure.
 	 */
 	if (__halt(irq_disabled))
 		WARN_ONCE(1, "HLT instruction emulation failed\n");
+
+	if (poll)
+		tdx_halt_poll_adjust(local_clock_noinstr() - start);
+}
+
+/*
+ * safe_halt() for TDs, e.g. for the PV spinlock wait.  The HLT of "STI; HLT"
+ * raises the #VE with IRQs disabled, so handle_halt() would ask the VMM not to
+ * wake the vCPU up for IRQs.  No halt polling, the wakeup is a kick that does
+ * not raise an IRQ.  Called with IRQs disabled, returns with them enabled.
+ */
+void tdx_safe_halt_irq_enable(void)
+{
+	if (__halt(false))
+		WARN_ONCE(1, "HLT instruction emulation failed\n");
+
+	local_irq_enable();
 }
 
 static int read_msr(struct pt_regs *regs, struct ve_info *ve)
@@ -459,6 +666,35 @@ static int write_msr(struct pt_regs *regs, struct ve_info *ve)
 	return ve_instr_len(ve);
 }
 
+struct tdx_cpuid_regs {
+	u32 eax;
+	u32 ebx;
+	u32 ecx;
+	u32 edx;
+};
+
+/* Untraced TDVMCALL<Instruction.CPUID> with ECX == 0, usable at early boot. */
+static u64 tdx_hcall_cpuid(u32 leaf, struct tdx_cpuid_regs *r)
+{
+	struct tdx_module_args args = {
+		.r10 = TDX_HYPERCALL_STANDARD,
+		.r11 = hcall_func(EXIT_REASON_CPUID),
+		.r12 = leaf,
+		.r13 = 0,
+	};
+	u64 ret;
+
+	ret = tdx_hypercall(&args);
+	if (ret)
+		return ret;
+
+	r->eax = args.r12;
+	r->ebx = args.r13;
+	r->ecx = args.r14;
+	r->edx = args.r15;
+	return 0;
+}
+
 /*
  * TDX has context switched MSRs and emulated MSRs. The emulated MSRs
  * normally trigger a #VE, but that is expensive, which can be avoided
@@ -466,25 +702,107 @@ static int write_msr(struct pt_regs *regs, struct ve_info *ve)
  * because some MSRs are "context switched" and need WRMSR.
  *
  * The list for this is unfortunately quite long. To avoid maintaining
- * very long switch statements just do a fast path for the few critical
- * MSRs that need TDCALL, currently only TSC_DEADLINE.
+ * very long switch statements, only the frequently accessed emulated MSRs
+ * are listed in tdx_fast_msrs[].  The ones depending on a KVM paravirt
+ * feature are enabled at boot only if the VMM advertises the feature.
  *
  * More can be added as needed.
  *
  * The others will be handled by the #VE handler as needed.
  * See 18.1 "MSR virtualization" in the TDX Module EAS
  */
-static bool tdx_fast_tdcall_path_msr(unsigned int msr)
+#define TDX_FAST_MSR_READ	BIT(0)
+#define TDX_FAST_MSR_WRITE	BIT(1)
+#define TDX_FAST_MSR_NO_FEATURE	(-1)
+
+struct tdx_fast_msr {
+	u32 msr;
+	/* Required KVM_FEATURE_* bit, or TDX_FAST_MSR_NO_FEATURE. */
+	int kvm_feature;
+	/* Allowed TDX_FAST_MSR_* accesses. */
+	u8 allowed;
+	/* Enabled accesses, set at boot. */
+	u8 flags;
+};
+
+static struct tdx_fast_msr tdx_fast_msrs[] __ro_after_init = {
+	{ MSR_IA32_TSC_DEADLINE, TDX_FAST_MSR_NO_FEATURE,
+	  TDX_FAST_MSR_WRITE, TDX_FAST_MSR_WRITE },
+	{ APIC_BASE_MSR + (APIC_ICR >> 4), TDX_FAST_MSR_NO_FEATURE,
+	  TDX_FAST_MSR_WRITE, TDX_FAST_MSR_WRITE },
+	{ MSR_KVM_SYSTEM_TIME_NEW, KVM_FEATURE_CLOCKSOURCE2,
+	  TDX_FAST_MSR_READ | TDX_FAST_MSR_WRITE },
+	{ MSR_KVM_WALL_CLOCK_NEW, KVM_FEATURE_CLOCKSOURCE2,
+	  TDX_FAST_MSR_READ | TDX_FAST_MSR_WRITE },
+	{ MSR_KVM_STEAL_TIME, KVM_FEATURE_STEAL_TIME,
+	  TDX_FAST_MSR_READ | TDX_FAST_MSR_WRITE },
+	{ MSR_KVM_PV_EOI_EN, KVM_FEATURE_PV_EOI,
+	  TDX_FAST_MSR_READ | TDX_FAST_MSR_WRITE },
+};
+
+static void __init tdx_kvm_cpuid_init(void)
 {
-	switch (msr) {
-	case MSR_IA32_TSC_DEADLINE:
-		return true;
-	default:
-		return false;
+	struct tdx_cpuid_regs r;
+	u32 sig[3];
 
+	if (tdx_hcall_cpuid(KVM_CPUID_SIGNATURE, &r))
+		return;
+
+	sig[0] = r.ebx;
+	sig[1] = r.ecx;
+	sig[2] = r.edx;
+	if (memcmp(sig, KVM_SIGNATURE, sizeof(sig)) ||
+	    r.eax < KVM_CPUID_FEATURES ||
+	    tdx_hcall_cpuid(KVM_CPUID_FEATURES, &r))
+		return;
+
+	tdx_kvm_features = r.eax;
+	tdx_kvm_hints = r.edx;
+}
+
+static void __init tdx_fast_msr_init(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(tdx_fast_msrs); i++) {
+		struct tdx_fast_msr *m = &tdx_fast_msrs[i];
+
+		if (m->kvm_feature != TDX_FAST_MSR_NO_FEATURE &&
+		    (tdx_kvm_features & BIT(m->kvm_feature)))
+			m->flags = m->allowed;
 	}
 }
 
+static bool tdx_fast_tdcall_path_msr(unsigned int msr, u8 access)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(tdx_fast_msrs); i++) {
+		if (tdx_fast_msrs[i].msr == msr)
+			return tdx_fast_msrs[i].flags & access;
+	}
+
+	return false;
+}
+
+static u64 notrace tdx_read_msr(unsigned int msr)
+{
+	struct tdx_module_args args = {
+		.r10 = TDX_HYPERCALL_STANDARD,
+		.r11 = hcall_func(EXIT_REASON_MSR_READ),
+		.r12 = msr,
+	};
+
+	if (!tdx_fast_tdcall_path_msr(msr, TDX_FAST_MSR_READ))
+		return native_read_msr(msr);
+
+	/* Let the #VE path raise the fault on failure. */
+	if (tdx_hypercall(&args))
+		return native_read_msr(msr);
+
+	return args.r11;
+}
+
 static void notrace tdx_write_msr(unsigned int msr, u32 low, u32 high)
 {
 	struct tdx_module_args args = {
@@ -494,12 +812,65 @@ static void notrace tdx_write_msr(unsigned int msr, u32 low, u32 high)
 		.r13 = (u64)high << 32 | low,
 	};
 
-	if (tdx_fast_tdcall_path_msr(msr))
-		__tdx_hypercall(&args);
+	if (tdx_fast_tdcall_path_msr(msr, TDX_FAST_MSR_WRITE))
+		tdx_hypercall(&args);
 	else
 		native_write_msr(msr, low, high);
 }
 
+/*
+ * Opt-in cache of the hypervisor CPUID leaves, filled at boot with
+ * "tdx_cpuid_cache", so that repeated CPUIDs of them don't exit to the VMM.
+ * Only requests with ECX == 0 are served from it.  The cached values are never
+ * updated, so this is only correct if the VMM keeps the hypervisor leaves
+ * constant after boot, as KVM does once the vCPUs have run.
+ */
+#define TDX_CPUID_CACHE_BASE	0x40000000
+#define TDX_CPUID_CACHE_NR	0x100
+
+static struct tdx_cpuid_regs tdx_cpuid_cache[TDX_CPUID_CACHE_NR] __ro_after_init;
+static DECLARE_BITMAP(tdx_cpuid_cached, TDX_CPUID_CACHE_NR) __ro_after_init;
+
+static void __init tdx_cpuid_cache_init(void)
+{
+	u32 leaf, max_leaf;
+
+	if (!cmdline_find_option_bool(boot_command_line, "tdx_cpuid_cache"))
+		return;
+
+	max_leaf = TDX_CPUID_CACHE_BASE;
+	for (leaf = TDX_CPUID_CACHE_BASE; leaf <= max_leaf; leaf++) {
+		struct tdx_cpuid_regs *r = &tdx_cpuid_cache[leaf - TDX_CPUID_CACHE_BASE];
+
+		if (tdx_hcall_cpuid(leaf, r))
+			continue;
+
+		__set_bit(leaf - TDX_CPUID_CACHE_BASE, tdx_cpuid_cached);
+
+		/* The base leaf reports the maximum hypervisor leaf in EAX. */
+		if (leaf == TDX_CPUID_CACHE_BASE)
+			max_leaf = clamp(r->eax, TDX_CPUID_CACHE_BASE,
+					 TDX_CPUID_CACHE_BASE + TDX_CPUID_CACHE_NR - 1);
+	}
+}
+
+static bool tdx_cpuid_cache_lookup(struct pt_regs *regs)
+{
+	u32 idx = regs->ax - TDX_CPUID_CACHE_BASE;
+	struct tdx_cpuid_regs *r;
+
+	if (regs->cx || idx >= TDX_CPUID_CACHE_NR ||
+	    !test_bit(idx, tdx_cpuid_cached))
+		return false;
+
+	r = &tdx_cpuid_cache[idx];
+	regs->ax = r->eax;
+	regs->bx = r->ebx;
+	regs->cx = r->ecx;
+	regs->dx = r->edx;
+	return true;
+}
+
 static int handle_cpuid(struct pt_regs *regs, struct ve_info *ve)
 {
 	struct tdx_module_args args = {
@@ -550,6 +921,9 @@ static int handle_cpuid(struct pt_regs *regs, struct ve_info *ve)
 		return ve_instr_len(ve);
 	}
 
+	if (tdx_cpuid_cache_lookup(regs))
+		return ve_instr_len(ve);
+
 	/*
 	 * Emulate the CPUID instruction via a hypercall. More info about
 	 * ABI can be found in TDX Guest-Host-Communication Interface
@@ -591,8 +965,75 @@ static bool mmio_read(int size, unsigned long addr, unsigned long *val)
 
 static bool mmio_write(int size, unsigned long addr, unsigned long val)
 {
-	return !_tdx_hypercall(hcall_func(EXIT_REASON_EPT_VIOLATION), size,
-			       EPT_WRITE, addr, val);
+	return !tdx_hypercall_simple(hcall_func(EXIT_REASON_EPT_VIOLATION),
+				     size, EPT_WRITE, addr, val);
+}
+
+/*
+ * Per-CPU cache of the decoded MMIO instructions, keyed by RIP, to skip the
+ * decoding of drivers polling the same register.  Only kernel MMIO is handled,
+ * so no CR3 is needed in the key.  The entry is used only if the instruction
+ * bytes at RIP still match, which covers text patching and module reloads.
+ */
+#define TDX_MMIO_CACHE_BITS	4
+
+struct tdx_mmio_decode {
+	unsigned long ip;
+	u8 bytes[MAX_INSN_SIZE];
+	struct insn insn;
+	enum insn_mmio_type mmio;
+	int size;
+};
+
+static DEFINE_PER_CPU(struct tdx_mmio_decode,
+		      tdx_mmio_cache[1 << TDX_MMIO_CACHE_BITS]);
+
+/*
+ * Interrupts are disabled to not race with a nested #VE from an interrupt
+ * handler on this CPU.  NMIs don't use the cache.
+ */
+static bool tdx_mmio_cache_lookup(unsigned long ip, const char *buffer,
+				  struct insn *insn, enum insn_mmio_type *mmio,
+				  int *size)
+{
+	struct tdx_mmio_decode *d;
+	unsigned long flags;
+	bool hit;
+
+	if (in_nmi())
+		return false;
+
+	local_irq_save(flags);
+	d = this_cpu_ptr(&tdx_mmio_cache[hash_long(ip, TDX_MMIO_CACHE_BITS)]);
+	hit = d->ip == ip && !memcmp(d->bytes, buffer, d->insn.length);
+	if (hit) {
+		*insn = d->insn;
+		*mmio = d->mmio;
+		*size = d->size;
+	}
+	local_irq_restore(flags);
+
+	return hit;
+}
+
+static void tdx_mmio_cache_fill(unsigned long ip, const char *buffer,
+				struct insn *insn, enum insn_mmio_type mmio,
+				int size)
+{
+	struct tdx_mmio_decode *d;
+	unsigned long flags;
+
+	if (in_nmi())
+		return;
+
+	local_irq_save(flags);
+	d = this_cpu_ptr(&tdx_mmio_cache[hash_long(ip, TDX_MMIO_CACHE_BITS)]);
+	d->ip = ip;
+	memcpy(d->bytes, buffer, MAX_INSN_SIZE);
+	d->insn = *insn;
+	d->mmio = mmio;
+	d->size = size;
+	local_irq_restore(flags);
 }
 
 static int handle_mmio(struct pt_regs *regs, struct ve_info *ve)
@@ -611,12 +1052,16 @@ static int handle_mmio(struct pt_regs *regs, struct ve_info *ve)
 	if (copy_from_kernel_nofault(buffer, (void *)regs->ip, MAX_INSN_SIZE))
 		return -EFAULT;
 
-	if (insn_decode(&insn, buffer, MAX_INSN_SIZE, INSN_MODE_64))
-		return -EINVAL;
+	if (!tdx_mmio_cache_lookup(regs->ip, buffer, &insn, &mmio, &size)) {
+		if (insn_decode(&insn, buffer, MAX_INSN_SIZE, INSN_MODE_64))
+			return -EINVAL;
 
-	mmio = insn_decode_mmio(&insn, &size);
-	if (WARN_ON_ONCE(mmio == INSN_MMIO_DECODE_FAILED))
-		return -EINVAL;
+		mmio = insn_decode_mmio(&insn, &size);
+		if (WARN_ON_ONCE(mmio == INSN_MMIO_DECODE_FAILED))
+			return -EINVAL;
+
+		tdx_mmio_cache_fill(regs->ip, buffer, &insn, mmio, size);
+	}
 
 	if (mmio != INSN_MMIO_WRITE_IMM && mmio != INSN_MMIO_MOVS) {
 		reg = insn_get_modrm_reg_ptr(&insn, regs);
@@ -796,6 +1241,62 @@ static const struct iomap_mmio tdx_iomap_mmio = {
 	.iwriteq = tdx_mmio_writeq,
 };
 
+/*
+ * With "tdx_pv_mmio", the read*()/write*() accessors of asm/io.h issue the MMIO
+ * hypercall directly for the shared mappings, instead of taking a #VE and
+ * having handle_mmio() decode the instruction.  Accesses to private mappings,
+ * or that the VMM refuses, e.g. to shared RAM, fall back to the instruction.
+ */
+DEFINE_STATIC_KEY_FALSE(tdx_pv_mmio_key);
+EXPORT_SYMBOL(tdx_pv_mmio_key);
+
+static bool tdx_pv_mmio_gpa(int size, const volatile void __iomem *addr,
+			    unsigned long *gpa)
+{
+	unsigned long vaddr = (unsigned long)addr;
+	pte_t *pte;
+	int level;
+
+	/* Same as handle_mmio(), reject the accesses that split pages. */
+	if (vaddr / PAGE_SIZE != (vaddr + size - 1) / PAGE_SIZE)
+		return false;
+
+	pte = lookup_address(vaddr, &level);
+	if (!pte || !pte_present(*pte) || !(pte_val(*pte) & cc_mkdec(0)))
+		return false;
+
+	*gpa = (pte_pfn(*pte) << PAGE_SHIFT) + (vaddr & ~page_level_mask(level));
+	return true;
+}
+
+bool tdx_pv_mmio_read(int size, const volatile void __iomem *addr,
+		      unsigned long *val)
+{
+	unsigned long gpa;
+
+	*val = 0;
+	return tdx_pv_mmio_gpa(size, addr, &gpa) && mmio_read(size, gpa, val);
+}
+EXPORT_SYMBOL(tdx_pv_mmio_read);
+
+bool tdx_pv_mmio_write(int size, volatile void __iomem *addr, unsigned long val)
+{
+	unsigned long gpa;
+
+	return tdx_pv_mmio_gpa(size, addr, &gpa) && mmio_write(size, gpa, val);
+}
+EXPORT_SYMBOL(tdx_pv_mmio_write);
+
+static int __init tdx_pv_mmio_init(void)
+{
+	if (cpu_feature_enabled(X86_FEATURE_TDX_GUEST) &&
+	    cmdline_find_option_bool(boot_command_line, "tdx_pv_mmio"))
+		static_branch_enable(&tdx_pv_mmio_key);
+
+	return 0;
+}
+early_initcall(tdx_pv_mmio_init);
+
 static bool handle_in(struct pt_regs *regs, int size, int port)
 {
 	struct tdx_module_args args = {
@@ -841,9 +1342,117 @@ static bool handle_out(struct pt_regs *regs, int size, int port)
 	 * in TDX Guest-Host-Communication Interface (GHCI) section titled
 	 * "TDG.VP.VMCALL<Instruction.IO>".
 	 */
-	return !_tdx_hypercall(hcall_func(EXIT_REASON_IO_INSTRUCTION), size,
-			       PORT_WRITE, port, regs->ax & mask);
+	return !tdx_hypercall_simple(hcall_func(EXIT_REASON_IO_INSTRUCTION),
+				     size, PORT_WRITE, port, regs->ax & mask);
+}
+
+/*
+ * Port I/O with TDVMCALL<Instruction.IO> directly, without the #VE of IN/OUT,
+ * e.g. for the PCI configuration mechanism #1 where each access is two of
+ * them.  Ports denied by the filter read as all ones and ignore writes, like
+ * handle_in() and handle_out().  Returns false if the VMM failed the access.
+ */
+bool tdx_pv_pio_read(int size, u16 port, u32 *val)
+{
+	struct tdx_module_args args = {
+		.r10 = TDX_HYPERCALL_STANDARD,
+		.r11 = hcall_func(EXIT_REASON_IO_INSTRUCTION),
+		.r12 = size,
+		.r13 = PORT_READ,
+		.r14 = port,
+	};
+	u32 mask = GENMASK(BITS_PER_BYTE * size - 1, 0);
+
+	if (!tdx_allowed_port(port)) {
+		*val = mask;
+		return true;
+	}
+
+	if (__trace_tdx_hypercall(&args))
+		return false;
+
+	*val = args.r11 & mask;
+	return true;
+}
+EXPORT_SYMBOL_GPL(tdx_pv_pio_read);
+
+bool tdx_pv_pio_write(int size, u16 port, u32 val)
+{
+	u32 mask = GENMASK(BITS_PER_BYTE * size - 1, 0);
+
+	if (!tdx_allowed_port(port))
+		return true;
+
+	return !tdx_hypercall_simple(hcall_func(EXIT_REASON_IO_INSTRUCTION),
+				     size, PORT_WRITE, port, val & mask);
 }
+EXPORT_SYMBOL_GPL(tdx_pv_pio_write);
+
+/*
+ * String I/O, e.g. of the serial console, in one TDVMCALL_KVM_IO_STRING
+ * through a shared page per batch instead of one Instruction.IO per element,
+ * if the VMM supports TDVMCALL_KVM_EXT_IO_STRING.
+ */
+static void *tdx_io_string_buf;
+static DEFINE_RAW_SPINLOCK(tdx_io_string_lock);
+
+/* Returns the number of elements transferred, the caller does the rest. */
+unsigned long tdx_io_string(int size, bool in, u16 port, void *addr,
+			    unsigned long count)
+{
+	void *buf = READ_ONCE(tdx_io_string_buf);
+	unsigned long flags, done = 0, n;
+
+	if (!buf || in_nmi() || !tdx_allowed_port(port))
+		return 0;
+
+	raw_spin_lock_irqsave(&tdx_io_string_lock, flags);
+	while (done < count) {
+		struct tdx_module_args args = {
+			.r10 = TDVMCALL_KVM_IO_STRING,
+			.r11 = size,
+			.r12 = in ? PORT_READ : PORT_WRITE,
+			.r13 = port,
+			.r15 = cc_mkdec(__pa(buf)),
+		};
+
+		n = min(count - done, PAGE_SIZE / size);
+		args.r14 = n;
+		if (!in)
+			memcpy(buf, addr + done * size, n * size);
+		if (__trace_tdx_hypercall(&args))
+			break;
+		if (in)
+			memcpy(addr + done * size, buf, n * size);
+		done += n;
+	}
+	raw_spin_unlock_irqrestore(&tdx_io_string_lock, flags);
+
+	return done;
+}
+EXPORT_SYMBOL(tdx_io_string);
+
+static int __init tdx_io_string_init(void)
+{
+	unsigned long buf;
+
+	if (!cpu_feature_enabled(X86_FEATURE_TDX_GUEST))
+		return 0;
+
+	if (!(tdx_kvm_ext() & TDVMCALL_KVM_EXT_IO_STRING))
+		return 0;
+
+	buf = get_zeroed_page(GFP_KERNEL);
+	if (!buf)
+		return 0;
+	/* The page may be partially converted on failure, leak it. */
+	if (set_memory_decrypted(buf, 1))
+		return 0;
+
+	WRITE_ONCE(tdx_io_string_buf, (void *)buf);
+	return 0;
+}
+arch_initcall(tdx_io_string_init);
 
 /*
  * Emulate I/O using hypercall.
@@ -876,6 +1485,17 @@ static int handle_io(struct pt_regs *regs, struct ve_info *ve)
 	return ve_instr_len(ve);
 }
 
+static DEFINE_STATIC_KEY_FALSE(tdx_ve_fast_key);
+
+static int __init tdx_ve_fast_init(void)
+{
+	if (cpu_feature_enabled(X86_FEATURE_TDX_GUEST) &&
+	    cmdline_find_option_bool(boot_command_line, "tdx_ve_fast"))
+		static_branch_enable(&tdx_ve_fast_key);
+	return 0;
+}
+early_initcall(tdx_ve_fast_init);
+
 /*
  * Early #VE exception handler. Only handles a subset of port I/O.
  * Intended only for earlyprintk. If failed, return false.
@@ -916,8 +1536,21 @@ void tdx_get_ve_info(struct ve_info *ve)
 	 *
 	 * Note, the TDX module treats virtual NMIs as inhibited if the #VE
 	 * valid flag is set. It means that NMI=>#VE will not result in a #DF.
+	 *
+	 * With "tdx_ve_fast", skip the tracepoints: they are the only code
+	 * run before the TDCALL, which can't be skipped as it's what clears
+	 * the valid flag.  The #VE itself is still traced once handled.
 	 */
-	tdcall_ret_with_trace(TDG_VP_VEINFO_GET, &args);
+	if (static_branch_unlikely(&tdx_ve_fast_key)) {
+		u64 start = tdx_stat_start();
+
+		if (tdcall_ret(TDG_VP_VEINFO_GET, &args))
+			panic("TDCALL %d failed (Buggy TDX module!)\n",
+			      TDG_VP_VEINFO_GET);
+		tdx_stat_account(TDX_STAT_TDCALL, TDG_VP_VEINFO_GET, start);
+	} else {
+		tdcall_ret_with_trace(TDG_VP_VEINFO_GET, &args);
+	}
 
 	/* Transfer the output parameters */
 	ve->exit_reason = args.rcx;
@@ -986,12 +1619,14 @@ static int virt_exception_kernel(struct pt_regs *regs, struct ve_info *ve)
 
 bool tdx_handle_virt_exception(struct pt_regs *regs, struct ve_info *ve)
 {
+	u64 start = tdx_stat_start();
 	int insn_len;
 
 	if (user_mode(regs))
 		insn_len = virt_exception_user(regs, ve);
 	else
 		insn_len = virt_exception_kernel(regs, ve);
+	tdx_stat_account(TDX_STAT_VE, ve->exit_reason, start);
 	if (insn_len < 0)
 		return false;
 
@@ -1012,6 +1647,98 @@ bool tdx_handle_virt_exception(struct pt_regs *regs, struct ve_info *ve)
 	return true;
 }
 
+static int tdx_stats_enable_get(void *data, u64 *val)
+{
+	*val = static_key_enabled(&tdx_stats_key);
+	return 0;
+}
+
+static int tdx_stats_enable_set(void *data, u64 val)
+{
+	if (val)
+		static_branch_enable(&tdx_stats_key);
+	else
+		static_branch_disable(&tdx_stats_key);
+	return 0;
+}
+
+DEFINE_DEBUGFS_ATTRIBUTE(tdx_stats_enable_fops, tdx_stats_enable_get,
+			 tdx_stats_enable_set, "%llu\n");
+
+static int tdx_stats_reset_set(void *data, u64 val)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(&tdx_stats, cpu), 0,
+		       sizeof(tdx_stats));
+	return 0;
+}
+
+DEFINE_DEBUGFS_ATTRIBUTE(tdx_stats_reset_fops, NULL, tdx_stats_reset_set,
+			 "%llu\n");
+
+static u64 tdx_stat_leaf(int type, int slot)
+{
+	if (type != TDX_STAT_TDVMCALL || slot < TDX_STAT_GHCI_BASE)
+		return slot;
+	if (slot == TDX_STAT_NR_LEAVES - 1)
+		return U64_MAX;
+	return TDVMCALL_GET_TD_VM_CALL_INFO + slot - TDX_STAT_GHCI_BASE;
+}
+
+static int tdx_stats_show(struct seq_file *m, void *v)
+{
+	int type = (long)m->private;
+	struct tdx_stat *p;
+	u64 count, cycles;
+	int i, cpu;
+
+	seq_puts(m, "leaf count cycles\n");
+	for (i = 0; i < TDX_STAT_NR_LEAVES; i++) {
+		count = cycles = 0;
+		for_each_possible_cpu(cpu) {
+			p = &per_cpu(tdx_stats, cpu)[type][i];
+			count += READ_ONCE(p->count);
+			cycles += READ_ONCE(p->cycles);
+		}
+		if (!count)
+			continue;
+
+		if (tdx_stat_leaf(type, i) == U64_MAX)
+			seq_puts(m, "other");
+		else
+			seq_printf(m, "%#llx", tdx_stat_leaf(type, i));
+		seq_printf(m, " %llu %llu\n", count, cycles);
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(tdx_stats);
+
+struct dentry *tdx_debugfs_dir;
+
+/* Before the late_initcall of tdx-perf.c that adds its files to tdx/. */
+static int __init tdx_stats_debugfs_init(void)
+{
+	struct dentry *dir;
+
+	if (!cpu_feature_enabled(X86_FEATURE_TDX_GUEST))
+		return 0;
+
+	dir = debugfs_create_dir("tdx", NULL);
+	tdx_debugfs_dir = dir;
+	debugfs_create_file("enable", 0600, dir, NULL, &tdx_stats_enable_fops);
+	debugfs_create_file("reset", 0200, dir, NULL, &tdx_stats_reset_fops);
+	debugfs_create_file("ve", 0400, dir, (void *)TDX_STAT_VE,
+			    &tdx_stats_fops);
+	debugfs_create_file("tdvmcall", 0400, dir, (void *)TDX_STAT_TDVMCALL,
+			    &tdx_stats_fops);
+	debugfs_create_file("tdcall", 0400, dir, (void *)TDX_STAT_TDCALL,
+			    &tdx_stats_fops);
+	return 0;
+}
+device_initcall(tdx_stats_debugfs_init);
+
 static bool tdx_tlb_flush_required(bool private)
 {
 	/*
@@ -1041,6 +1768,121 @@ static bool tdx_cache_flush_required(void)
 	return true;
 }
 
+/*
+ * Accepting a large range is split into 1G aligned chunks, accepted by up to
+ * TDX_ACCEPT_MAX_WORKERS works in parallel.  1G chunks keep the 1G accepts,
+ * and so the 1G Secure EPT entries, possible.
+ */
+#define TDX_ACCEPT_CHUNK		PUD_SIZE
+#define TDX_ACCEPT_PARALLEL_MIN		(2 * TDX_ACCEPT_CHUNK)
+#define TDX_ACCEPT_MAX_WORKERS		8U
+
+struct tdx_accept_parallel {
+	phys_addr_t start;
+	phys_addr_t end;
+	atomic_long_t next;
+	atomic_t failed;
+};
+
+struct tdx_accept_work {
+	struct work_struct work;
+	struct tdx_accept_parallel *ap;
+};
+
+static void tdx_accept_workfn(struct work_struct *work)
+{
+	struct tdx_accept_parallel *ap =
+		container_of(work, struct tdx_accept_work, work)->ap;
+	phys_addr_t start, end;
+
+	while (!atomic_read(&ap->failed)) {
+		start = ALIGN_DOWN(ap->start, TDX_ACCEPT_CHUNK) +
+			atomic_long_fetch_inc(&ap->next) * TDX_ACCEPT_CHUNK;
+		if (start >= ap->end)
+			break;
+
+		end = min(start + TDX_ACCEPT_CHUNK, ap->end);
+		start = max(start, ap->start);
+		if (!tdx_accept_memory(start, end))
+			atomic_set(&ap->failed, 1);
+	}
+}
+
+bool tdx_accept_memory_parallel(phys_addr_t start, phys_addr_t end)
+{
+	struct tdx_accept_work works[TDX_ACCEPT_MAX_WORKERS];
+	struct tdx_accept_parallel ap = {
+		.start = start,
+		.end = end,
+		.next = ATOMIC_LONG_INIT(0),
+		.failed = ATOMIC_INIT(0),
+	};
+	unsigned long nr_chunks;
+	int i, nr;
+
+	/*
+	 * The caller may sleep, deciding so is up to it: preemptible() can't
+	 * tell, e.g. under a spinlock_t on PREEMPT_RT.  Workers aren't
+	 * available early though.
+	 */
+	might_sleep();
+	if (end - start < TDX_ACCEPT_PARALLEL_MIN ||
+	    system_state != SYSTEM_RUNNING)
+		return tdx_accept_memory(start, end);
+
+	nr_chunks = DIV_ROUND_UP(end - ALIGN_DOWN(start, TDX_ACCEPT_CHUNK),
+				 TDX_ACCEPT_CHUNK);
+	nr = min_t(unsigned long, nr_chunks,
+		   min(num_online_cpus(), TDX_ACCEPT_MAX_WORKERS));
+
+	for (i = 0; i < nr; i++) {
+		INIT_WORK_ONSTACK(&works[i].work, tdx_accept_workfn);
+		works[i].ap = &ap;
+		queue_work(system_unbound_wq, &works[i].work);
+	}
+	for (i = 0; i < nr; i++) {
+		flush_work(&works[i].work);
+		destroy_work_on_stack(&works[i].work);
+	}
+
+	return !atomic_read(&ap.failed);
+}
+
+/*
+ * The VMM may convert part of the range and ask to retry the rest, returning
+ * the GPA to resume from in R11.  Give up if it doesn't make progress.
+ */
+static bool tdx_map_gpa(phys_addr_t start, phys_addr_t end)
+{
+	const int max_retries_per_page = 3;
+	int retry_count = 0;
+
+	while (retry_count < max_retries_per_page) {
+		struct tdx_module_args args = {
+			.r10 = TDX_HYPERCALL_STANDARD,
+			.r11 = TDVMCALL_MAP_GPA,
+			.r12 = start,
+			.r13 = end - start,
+		};
+		u64 ret = tdx_hypercall(&args);
+
+		if (ret != TDVMCALL_STATUS_RETRY)
+			return !ret;
+
+		if (args.r11 < start || args.r11 >= end)
+			return false;
+
+		if (args.r11 == start) {
+			retry_count++;
+		} else {
+			start = args.r11;
+			retry_count = 0;
+		}
+	}
+
+	return false;
+}
+
 /*
  * Inform the VMM of the guest's intent for this physical page: shared with
  * the VMM or private to the guest.  The VMM is expected to change its mapping
@@ -1062,12 +1904,12 @@ static bool tdx_enc_status_changed(unsigned long vaddr, int numpages, bool enc)
 	 * can be found in TDX Guest-Host-Communication Interface (GHCI),
 	 * section "TDG.VP.VMCALL<MapGPA>"
 	 */
-	if (_tdx_hypercall(TDVMCALL_MAP_GPA, start, end - start, 0, 0))
+	if (!tdx_map_gpa(start, end))
 		return false;
 
 	/* shared->private conversion requires memory to be accepted before use */
 	if (enc)
-		return tdx_accept_memory(start, end);
+		return tdx_accept_memory_parallel(start, end);
 
 	return true;
 }
@@ -1144,11 +1986,18 @@ void __init tdx_early_init(void)
 	/* Set restricted memory access for virtio. */
 	virtio_set_mem_acc_cb(virtio_require_restricted_mem_acc);
 
+	tdx_kvm_cpuid_init();
+	tdx_fast_msr_init();
+	pv_ops.cpu.read_msr = tdx_read_msr;
 	pv_ops.cpu.write_msr = tdx_write_msr;
 
 	tdx_parse_tdinfo(&cc_mask);
 	cc_set_mask(cc_mask);
 
+	tdx_accept_level_init();
+
+	tdx_cpuid_cache_init();
+
 	/* Kernel does not use NOTIFY_ENABLES and does not need random #VEs */
 	tdcall_ret_with_trace(TDG_VM_WR, &args);
 
@@ -1185,17 +2034,6 @@ void __init tdx_early_init(void)
 	x86_platform.guest.enc_cache_flush_required  = tdx_cache_flush_required;
 	x86_platform.guest.enc_tlb_flush_required    = tdx_tlb_flush_required;
 
-	/*
-	 * TDX intercepts the RDMSR to read the X2APIC ID in the parallel
-	 * bringup low level code. That raises #VE which cannot be handled
-	 * there.
-	 *
-	 * Intel-TDX has a secure RDMSR hypercall, but that needs to be
-	 * implemented seperately in the low level startup ASM code.
-	 * Until that is in place, disable parallel bringup for TDX.
-	 */
-	x86_cpuinit.parallel_bringup = false;
-
 	legacy_pic = &null_legacy_pic;
 
 	pci_disable_early();
@@ -1266,45 +2104,6 @@ static int __init tdx_arch_init(void)
 }
 arch_initcall(tdx_arch_init);
 
-/**
- * tdx_alloc_event_irq() - Allocate an IRQ for event notification from
- * 			   the VMM to the TDX Guest.
- *
- * Return IRQ on success or errno on failure.
- *
- */
-int tdx_alloc_event_irq(void)
-{
-	struct irq_alloc_info info;
-	int irq;
-
-	if (!cpu_feature_enabled(X86_FEATURE_TDX_GUEST))
-		return -ENODEV;
-
-	init_irq_alloc_info(&info, NULL);
-
-	irq = irq_domain_alloc_irqs(x86_vector_domain, 1, NUMA_NO_NODE, &info);
-	if (irq <= 0) {
-		pr_err("Event notification IRQ allocation failed %d\n", irq);
-		return -EIO;
-	}
-
-	irq_set_handler(irq, handle_edge_irq);
-
-	return irq;
-}
-EXPORT_SYMBOL_GPL(tdx_alloc_event_irq);
-
-/**
- * tdx_free_event_irq() - Free the event IRQ.
- *
- */
-void tdx_free_event_irq(int irq)
-{
-	irq_domain_free_irqs(irq, 1);
-}
-EXPORT_SYMBOL_GPL(tdx_free_event_irq);
-
 static struct platform_device tpm_device = {
 	.name = "tpm",
 	.id = -1,
@@ -4185,6 +4185,21 @@ void intel_pmu_save(void)
 	struct cpu_hw_events *cpuc = this_cpu_ptr(&cpu_hw_events);
 	int idx;
 
+	/*
+	 * Nothing is counting, so there is no count to update and nothing to
+	 * reprogram after the TD.  The MSRs reset across the TD entry/exit
+	 * come back at initial values, i.e. with all counters disabled, which
+	 * is what perf expects with no active event.  The next event added is
+	 * programmed in a perf_pmu_disable()/enable() section anyway, and the
+	 * tags are still bumped so that it is fully reprogrammed.
+	 */
+	cpuc->pmu_saved = !bitmap_empty(cpuc->active_mask, X86_PMC_IDX_MAX);
+	if (!cpuc->pmu_saved) {
+		for (idx = 0; idx < X86_PMC_IDX_MAX; idx++)
+			++cpuc->tags[idx];
+		return;
+	}
+
 	perf_pmu_disable(x86_get_pmu(smp_processor_id()));
 
 	for (idx = 0; idx < X86_PMC_IDX_MAX; idx++) {
@@ -4208,6 +4223,9 @@ void intel_pmu_restore(void)
 	struct cpu_hw_events *cpuc = this_cpu_ptr(&cpu_hw_events);
 	int idx;
 
+	if (!cpuc->pmu_saved)
+		return;
+
 	for_each_set_bit(idx, (unsigned long *)&cpuc->active_mask, X86_PMC_IDX_MAX) {
 		struct perf_event *event = cpuc->events[idx];
 
@@ -343,6 +343,8 @@ struct cpu_hw_events {
 	struct pmu			*pmu;
 
 	u64				saved_fixed_ctr_ctrl;
+	/* intel_pmu_save() found counters to save */
+	bool				pmu_saved;
 };
 
 #define __EVENT_CONSTRAINT_RANGE(c, e, n, m, w, o, f) {	\
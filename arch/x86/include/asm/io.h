@@ -43,14 +43,59 @@
 #include <asm/pgtable_types.h>
 #include <asm/shared/io.h>
 
+/* Direct MMIO hypercalls in TD guests, see arch/x86/coco/tdx/tdx.c */
+#if defined(CONFIG_INTEL_TDX_GUEST) && !defined(__DISABLE_EXPORTS)
+#include <linux/jump_label.h>
+
+DECLARE_STATIC_KEY_FALSE(tdx_pv_mmio_key);
+bool tdx_pv_mmio_read(int size, const volatile void __iomem *addr,
+		      unsigned long *val);
+bool tdx_pv_mmio_write(int size, volatile void __iomem *addr, unsigned long val);
+#define tdx_pv_mmio()	static_branch_unlikely(&tdx_pv_mmio_key)
+unsigned long tdx_io_string(int size, bool in, u16 port, void *addr,
+			    unsigned long count);
+bool tdx_pv_pio_read(int size, u16 port, u32 *val);
+bool tdx_pv_pio_write(int size, u16 port, u32 val);
+#else
+#define tdx_pv_mmio()	false
+static inline bool tdx_pv_mmio_read(int size, const volatile void __iomem *addr,
+				    unsigned long *val)
+{
+	return false;
+}
+static inline bool tdx_pv_mmio_write(int size, volatile void __iomem *addr,
+				     unsigned long val)
+{
+	return false;
+}
+static inline unsigned long tdx_io_string(int size, bool in, u16 port,
+					  void *addr, unsigned long count)
+{
+	return 0;
+}
+static inline bool tdx_pv_pio_read(int size, u16 port, u32 *val)
+{
+	return false;
+}
+static inline bool tdx_pv_pio_write(int size, u16 port, u32 val)
+{
+	return false;
+}
+#endif
+
 #define build_mmio_read(name, size, type, reg, barrier) \
 static inline type name(const volatile void __iomem *addr) \
-{ type ret; asm volatile("mov" size " %1,%0":reg (ret) \
+{ type ret; unsigned long pv; \
+if (tdx_pv_mmio() && tdx_pv_mmio_read(sizeof(type), addr, &pv)) \
+	return pv; \
+asm volatile("mov" size " %1,%0":reg (ret) \
 :"m" (*(volatile type __force *)addr) barrier); return ret; }
 
 #define build_mmio_write(name, size, type, reg, barrier) \
 static inline void name(type val, volatile void __iomem *addr) \
-{ asm volatile("mov" size " %0,%1": :reg (val), \
+{ if (tdx_pv_mmio() && tdx_pv_mmio_write(sizeof(type), addr, val)) \
+	return; \
+asm volatile("mov" size " %0,%1": :reg (val), \
 "m" (*(volatile type __force *)addr) barrier); }
 
 build_mmio_read(readb, "b", unsigned char, "=q", :"memory")
@@ -259,7 +304,11 @@ static inline type in##bwl##_p(u16 port)				\
 static inline void outs##bwl(u16 port, const void *addr, unsigned long count) \
 {									\
 	if (cc_platform_has(CC_ATTR_GUEST_UNROLL_STRING_IO)) {		\
-		type *value = (type *)addr;				\
+		unsigned long done = tdx_io_string(sizeof(type), false,	\
+						   port, (void *)addr,	\
+						   count);		\
+		type *value = (type *)addr + done;			\
+		count -= done;						\
 		while (count) {						\
 			out##bwl(*value, port);				\
 			value++;					\
@@ -275,7 +324,10 @@ static inline void outs##bwl(u16 port, const void *addr, unsigned long count) \
 static inline void ins##bwl(u16 port, void *addr, unsigned long count)	\
 {									\
 	if (cc_platform_has(CC_ATTR_GUEST_UNROLL_STRING_IO)) {		\
-		type *value = (type *)addr;				\
+		unsigned long done = tdx_io_string(sizeof(type), true,	\
+						   port, addr, count);	\
+		type *value = (type *)addr + done;			\
+		count -= done;						\
 		while (count) {						\
 			*value = in##bwl(port);				\
 			value++;					\
@@ -30,9 +30,11 @@ KVM_X86_OP(vm_init)
 KVM_X86_OP_OPTIONAL(flush_shadow_all_private)
 KVM_X86_OP_OPTIONAL(vm_destroy)
 KVM_X86_OP_OPTIONAL(vm_free)
+KVM_X86_OP_OPTIONAL(vm_create_debugfs)
 KVM_X86_OP_OPTIONAL_RET0(vcpu_precreate)
 KVM_X86_OP(vcpu_create)
 KVM_X86_OP(vcpu_free)
+KVM_X86_OP_OPTIONAL(vcpu_create_debugfs)
 KVM_X86_OP(vcpu_reset)
 KVM_X86_OP(prepare_switch_to_guest)
 KVM_X86_OP(vcpu_load)
@@ -112,10 +114,11 @@ KVM_X86_OP_OPTIONAL(set_private_spte)
 KVM_X86_OP_OPTIONAL(remove_private_spte)
 KVM_X86_OP_OPTIONAL(zap_private_spte)
 KVM_X86_OP_OPTIONAL(unzap_private_spte)
+KVM_X86_OP_OPTIONAL(relocate_private_spte)
 KVM_X86_OP_OPTIONAL(drop_private_spte)
 KVM_X86_OP_OPTIONAL(write_block_private_pages)
 KVM_X86_OP_OPTIONAL(import_private_pages)
-KVM_X86_OP_OPTIONAL(restore_private_page)
+KVM_X86_OP_OPTIONAL(restore_private_pages)
 KVM_X86_OP(has_wbinvd_exit)
 KVM_X86_OP(get_l2_tsc_offset)
 KVM_X86_OP(get_l2_tsc_multiplier)
@@ -921,7 +921,7 @@ struct kvm_vcpu_arch {
 		u8 preempted;
 		u64 msr_val;
 		u64 last_steal;
-		struct gfn_to_hva_cache cache;
+		struct gfn_to_pfn_cache cache;
 	} st;
 
 	u64 l1_tsc_offset;
@@ -1488,6 +1488,13 @@ struct kvm_arch {
 	 */
 	spinlock_t tdp_mmu_pages_lock;
 	struct workqueue_struct *tdp_mmu_zap_wq;
+
+	/*
+	 * Serialize the updates of private SPTEs in the same Secure-EPT page
+	 * when the MMU lock is held in read mode, hashed by that page.
+	 */
+#define KVM_TDP_MMU_SEPT_LOCK_BITS	6
+	spinlock_t tdp_mmu_sept_locks[1 << KVM_TDP_MMU_SEPT_LOCK_BITS];
 #endif /* CONFIG_X86_64 */
 
 	/*
@@ -1562,6 +1569,15 @@ struct kvm_vm_stat {
 	u64 nx_lpage_splits;
 	u64 max_mmu_page_hash_collisions;
 	u64 max_mmu_rmap_size;
+	/* Private pages by SEAMCALL, TDH.MEM.PAGE.REMOVE includes huge pages. */
+	atomic64_t tdx_page_aug;
+	atomic64_t tdx_page_add;
+	atomic64_t tdx_page_remove;
+	/* Time spent reclaiming and clearing the pages of tdx_reclaim_batch. */
+	atomic64_t tdx_reclaim_ns;
+	/* Pages write blocked and unblocked for live migration. */
+	atomic64_t tdx_blockw_pages;
+	atomic64_t tdx_unblockw_pages;
 };
 
 struct kvm_vcpu_stat {
@@ -1601,6 +1617,10 @@ struct kvm_vcpu_stat {
 	u64 preemption_other;
 	u64 guest_mode;
 	u64 notify_window_exits;
+	/* TDX: TDH.VP.ENTER retried on contention, MapGPA and GetQuote. */
+	u64 tdx_vp_enter_retries;
+	u64 tdx_map_gpa_pages;
+	u64 tdx_get_quote;
 };
 
 struct x86_instruction_info;
@@ -1648,11 +1668,13 @@ struct kvm_x86_ops {
 	void (*flush_shadow_all_private)(struct kvm *kvm);
 	void (*vm_destroy)(struct kvm *kvm);
 	void (*vm_free)(struct kvm *kvm);
+	void (*vm_create_debugfs)(struct kvm *kvm);
 
 	/* Create, but do not attach this VCPU */
 	int (*vcpu_precreate)(struct kvm *kvm);
 	int (*vcpu_create)(struct kvm_vcpu *vcpu);
 	void (*vcpu_free)(struct kvm_vcpu *vcpu);
+	void (*vcpu_create_debugfs)(struct kvm_vcpu *vcpu, struct dentry *dentry);
 	void (*vcpu_reset)(struct kvm_vcpu *vcpu, bool init_event);
 
 	void (*prepare_switch_to_guest)(struct kvm_vcpu *vcpu);
@@ -1771,12 +1793,16 @@ struct kvm_x86_ops {
 				    kvm_pfn_t pfn);
 	int (*zap_private_spte)(struct kvm *kvm, gfn_t gfn, enum pg_level level);
 	int (*unzap_private_spte)(struct kvm *kvm, gfn_t gfn, enum pg_level level);
+	int (*relocate_private_spte)(struct kvm *kvm, gfn_t gfn,
+				     enum pg_level level, kvm_pfn_t old_pfn,
+				     kvm_pfn_t new_pfn);
 	void (*write_block_private_pages)(struct kvm *kvm, gfn_t *gfns,
 					  uint32_t num);
 	void (*write_unblock_private_page)(struct kvm *kvm, gfn_t gfn, int level);
 	int (*import_private_pages)(struct kvm *kvm, uint64_t *sptes,
 				    uint64_t npages, void *opaque);
-	int (*restore_private_page)(struct kvm *kvm, gfn_t gfn);
+	int (*restore_private_pages)(struct kvm *kvm, gfn_t *gfns, uint32_t num,
+				     unsigned long *failed);
 
 	/*
 	 * The following five operations are only for legacy MMU.
@@ -1999,6 +2025,8 @@ void kvm_zap_gfn_range(struct kvm *kvm, gfn_t gfn_start, gfn_t gfn_end);
 #ifdef CONFIG_INTEL_TDX_HOST
 int kvm_mmu_is_page_private(struct kvm *kvm, struct kvm_memory_slot *memslot,
 			    gfn_t gfn, bool *is_private);
+bool kvm_mmu_gfn_has_private_leaf(struct kvm *kvm,
+				  struct kvm_memory_slot *memslot, gfn_t gfn);
 #endif
 
 int load_pdptrs(struct kvm_vcpu *vcpu, unsigned long cr3);
@@ -2216,6 +2244,7 @@ unsigned long __kvm_emulate_hypercall(struct kvm_vcpu *vcpu, unsigned long nr,
 				      unsigned long a2, unsigned long a3,
 				      int op_64_bit, int cpl);
 int kvm_emulate_hypercall(struct kvm_vcpu *vcpu);
+void kvm_pv_kick_cpu_op(struct kvm *kvm, int apicid);
 
 int kvm_mmu_page_fault(struct kvm_vcpu *vcpu, gpa_t cr2_or_gpa, u64 error_code,
 		       void *insn, int insn_len);
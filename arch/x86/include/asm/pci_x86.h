@@ -10,6 +10,9 @@
 #include <linux/ioport.h>
 #include <linux/spinlock.h>
 
+#include <asm/cpufeature.h>
+#include <asm/io.h>
+
 #undef DEBUG
 
 #ifdef DEBUG
@@ -199,39 +202,64 @@ extern struct list_head pci_mmcfg_list;
  * Guide (BKDG) For AMD Family 10h Processors", rev. 3.48, sec 2.11.1,
  * "MMIO Configuration Coding Requirements".
  */
+/*
+ * In TD guests, the MMCONFIG area is always emulated by the VMM: access it
+ * with the MMIO hypercall directly instead of taking a #VE for each access,
+ * as enumeration does thousands of them.
+ */
+#define tdx_mmio_config()	cpu_feature_enabled(X86_FEATURE_TDX_GUEST)
+
 static inline unsigned char mmio_config_readb(void __iomem *pos)
 {
+	unsigned long pv;
 	u8 val;
+
+	if (tdx_mmio_config() && tdx_pv_mmio_read(1, pos, &pv))
+		return pv;
 	asm volatile("movb (%1),%%al" : "=a" (val) : "r" (pos));
 	return val;
 }
 
 static inline unsigned short mmio_config_readw(void __iomem *pos)
 {
+	unsigned long pv;
 	u16 val;
+
+	if (tdx_mmio_config() && tdx_pv_mmio_read(2, pos, &pv))
+		return pv;
 	asm volatile("movw (%1),%%ax" : "=a" (val) : "r" (pos));
 	return val;
 }
 
 static inline unsigned int mmio_config_readl(void __iomem *pos)
 {
+	unsigned long pv;
 	u32 val;
+
+	if (tdx_mmio_config() && tdx_pv_mmio_read(4, pos, &pv))
+		return pv;
 	asm volatile("movl (%1),%%eax" : "=a" (val) : "r" (pos));
 	return val;
 }
 
 static inline void mmio_config_writeb(void __iomem *pos, u8 val)
 {
+	if (tdx_mmio_config() && tdx_pv_mmio_write(1, pos, val))
+		return;
 	asm volatile("movb %%al,(%1)" : : "a" (val), "r" (pos) : "memory");
 }
 
 static inline void mmio_config_writew(void __iomem *pos, u16 val)
 {
+	if (tdx_mmio_config() && tdx_pv_mmio_write(2, pos, val))
+		return;
 	asm volatile("movw %%ax,(%1)" : : "a" (val), "r" (pos) : "memory");
 }
 
 static inline void mmio_config_writel(void __iomem *pos, u32 val)
 {
+	if (tdx_mmio_config() && tdx_pv_mmio_write(4, pos, val))
+		return;
 	asm volatile("movl %%eax,(%1)" : : "a" (val), "r" (pos) : "memory");
 }
 
@@ -24,11 +24,38 @@
 #define TDCS_NOTIFY_ENABLES		0x9100000000000010
 
 /* TDX hypercall Leaf IDs */
+#define TDVMCALL_GET_TD_VM_CALL_INFO	0x10000
 #define TDVMCALL_MAP_GPA		0x10001
 #define TDVMCALL_GET_QUOTE		0x10002
 #define TDVMCALL_REPORT_FATAL_ERROR	0x10003
 #define TDVMCALL_SETUP_NOTIFY_INTR	0x10004
 
+/* TDVMCALL status codes */
+#define TDVMCALL_STATUS_RETRY		1
+
+/* KVM extensions, reported in R11 by TDVMCALL_KVM_GET_EXT */
+#define TDVMCALL_KVM_EXT_IO_STRING	BIT_ULL(0)
+#define TDVMCALL_KVM_EXT_ACCEPT_LEVEL	BIT_ULL(1)
+
+/*
+ * KVM vendor-specific TDVMCALL leaves (R10), out of the range of the KVM
+ * hypercall numbers that share the R10 != 0 space.  Other VMMs may give the
+ * same leaves another meaning, so they are only used once the VMM is known to
+ * be KVM, see tdx_kvm_ext().
+ *
+ * TDVMCALL_KVM_GET_EXT: R11 returns the TDVMCALL_KVM_EXT_* of the VMM.
+ *
+ * TDVMCALL_KVM_IO_STRING, if TDVMCALL_KVM_EXT_IO_STRING: transfer R14
+ * elements of size R11 from/to port R13 (R12: direction as Instruction.IO)
+ * through the shared buffer at GPA R15.
+ *
+ * TDVMCALL_KVM_ACCEPT_LEVEL, if TDVMCALL_KVM_EXT_ACCEPT_LEVEL: R11 returns the
+ * largest TDX_PS_* the VMM maps private memory with.
+ */
+#define TDVMCALL_KVM_GET_EXT		0x4b564d00
+#define TDVMCALL_KVM_IO_STRING		0x4b564d01
+#define TDVMCALL_KVM_ACCEPT_LEVEL	0x4b564d02
+
 /*
  * Bitmasks of exposed registers (with VMM).
  */
@@ -169,7 +196,10 @@ static inline u64 _tdx_hypercall(u64 fn, u64 r12, u64 r13, u64 r14, u64 r15)
 /* Called from __tdx_hypercall() for unrecoverable failure */
 void __tdx_hypercall_failed(void);
 
+u64 tdx_kvm_ext(void);
+void tdx_accept_level_init(void);
 bool tdx_accept_memory(phys_addr_t start, phys_addr_t end);
+unsigned long tdx_accept_align(void);
 
 /*
  * The TDG.VP.VMCALL-Instruction-execution sub-functions are defined
@@ -58,6 +58,10 @@ struct ve_info {
 
 extern int tdx_notify_irq;
 
+struct dentry;
+/* debugfs tdx/, for the guest stats and benchmarks */
+extern struct dentry *tdx_debugfs_dir;
+
 void __init tdx_early_init(void);
 bool tdx_debug_enabled(void);
 
@@ -68,6 +72,7 @@ void __init tdx_filter_init(void);
 bool tdx_handle_virt_exception(struct pt_regs *regs, struct ve_info *ve);
 
 void tdx_safe_halt(void);
+void tdx_safe_halt_irq_enable(void);
 
 bool tdx_early_handle_ve(struct pt_regs *regs);
 
@@ -79,19 +84,25 @@ u64 tdx_mcall_verify_report(u8 *reportmac);
 
 int tdx_mcall_extend_rtmr(u8 *data, u8 index);
 
-int tdx_hcall_get_quote(void *tdquote, int size);
+u64 tdx_rtmr_seq(void);
 
-int tdx_alloc_event_irq(void);
+int tdx_hcall_get_quote(void *tdquote, int size);
 
-void tdx_free_event_irq(int);
+bool tdx_accept_memory_parallel(phys_addr_t start, phys_addr_t end);
 
 #else
 
 static inline void tdx_early_init(void) { };
 static inline void tdx_safe_halt(void) { };
+static inline void tdx_safe_halt_irq_enable(void) { };
 static inline void tdx_filter_init(void) { };
 
 static inline bool tdx_early_handle_ve(struct pt_regs *regs) { return false; }
+static inline bool tdx_accept_memory_parallel(phys_addr_t start,
+					      phys_addr_t end)
+{
+	return false;
+}
 
 #endif /* CONFIG_INTEL_TDX_GUEST */
 
@@ -111,6 +122,10 @@ static inline long tdx_kvm_hypercall(unsigned int nr, unsigned long p1,
 u64 __seamcall(u64 fn, struct tdx_module_args *args);
 u64 __seamcall_ret(u64 fn, struct tdx_module_args *args);
 u64 __seamcall_saved_ret(u64 fn, struct tdx_module_args *args);
+u64 __seamcall_saved_out_ret(u64 fn, struct tdx_module_args *args);
+u64 __seamcall_lean(u64 fn, u64 rcx, u64 rdx, u64 r8);
+u64 __seamcall_lean_ret(u64 fn, u64 rcx, u64 rdx, u64 r8,
+			struct tdx_module_args *args);
 
 #define DEBUGCONFIG_TRACE_ALL		0
 #define DEBUGCONFIG_TRACE_WARN		1
@@ -180,8 +195,12 @@ struct tdsysinfo_struct {
 const struct tdsysinfo_struct *tdx_get_sysinfo(void);
 bool platform_tdx_enabled(void);
 int tdx_enable(void);
+int tdx_module_update(int (*install)(void *data), void *data);
+unsigned int tdx_module_generation(void);
 void tdx_reset_memory(void);
 bool tdx_is_private_mem(unsigned long phys);
+void tdx_track_private_pages(unsigned long phys, unsigned long size);
+void tdx_untrack_private_pages(unsigned long phys, unsigned long size);
 
 /*
  * Key id globally used by TDX module: TDX module maps TDR with this TDX global
@@ -199,13 +218,27 @@ int __init tdx_init(void);
 static inline u64 __seamcall(u64 fn, struct tdx_module_args *args) { return TDX_SEAMCALL_UD; }
 static inline u64 __seamcall_ret(u64 fn, struct tdx_module_args *args) { return TDX_SEAMCALL_UD; }
 static inline u64 __seamcall_saved_ret(u64 fn, struct tdx_module_args *args) { return TDX_SEAMCALL_UD; }
+static inline u64 __seamcall_saved_out_ret(u64 fn, struct tdx_module_args *args) { return TDX_SEAMCALL_UD; }
+static inline u64 __seamcall_lean(u64 fn, u64 rcx, u64 rdx, u64 r8) { return TDX_SEAMCALL_UD; }
+static inline u64 __seamcall_lean_ret(u64 fn, u64 rcx, u64 rdx, u64 r8,
+				      struct tdx_module_args *args)
+{
+	return TDX_SEAMCALL_UD;
+}
 
 struct tdsysinfo_struct;
 static inline const struct tdsysinfo_struct *tdx_get_sysinfo(void) { return NULL; }
 static inline bool platform_tdx_enabled(void) { return false; }
 static inline int tdx_enable(void)  { return -ENODEV; }
+static inline int tdx_module_update(int (*install)(void *data), void *data)
+{
+	return -ENODEV;
+}
+static inline unsigned int tdx_module_generation(void) { return 0; }
 static inline void tdx_reset_memory(void) { }
 static inline bool tdx_is_private_mem(unsigned long phys) { return false; }
+static inline void tdx_track_private_pages(unsigned long phys, unsigned long size) { }
+static inline void tdx_untrack_private_pages(unsigned long phys, unsigned long size) { }
 static inline u32 tdx_get_nr_guest_keyids(void) { return 0; }
 static inline int tdx_guest_keyid_alloc(void) { return -EOPNOTSUPP; }
 static inline void tdx_guest_keyid_free(int keyid) { }
@@ -213,5 +246,30 @@ static inline bool tdx_is_enabled(void) { return false };
 static inline int __init tdx_init(void) { return 0; }
 #endif	/* CONFIG_INTEL_TDX_HOST */
 
+#if defined(CONFIG_INTEL_TDX_HOST) && defined(CONFIG_DEBUG_FS)
+#include <linux/jump_label.h>
+#include <linux/sched/clock.h>
+
+/* SEAMCALL profiling, see arch/x86/virt/vmx/tdx/tdx_prof.c */
+DECLARE_STATIC_KEY_FALSE(tdx_seamcall_prof_key);
+void __tdx_seamcall_prof(u64 fn, u64 ns, u64 ret);
+
+static inline u64 tdx_seamcall_prof_start(void)
+{
+	if (static_branch_unlikely(&tdx_seamcall_prof_key))
+		return local_clock();
+	return 0;
+}
+
+static inline void tdx_seamcall_prof_end(u64 fn, u64 start, u64 ret)
+{
+	if (static_branch_unlikely(&tdx_seamcall_prof_key) && start)
+		__tdx_seamcall_prof(fn, local_clock() - start, ret);
+}
+#else
+static inline u64 tdx_seamcall_prof_start(void) { return 0; }
+static inline void tdx_seamcall_prof_end(u64 fn, u64 start, u64 ret) { }
+#endif
+
 #endif /* !__ASSEMBLY__ */
 #endif /* _ASM_X86_TDX_H */
@@ -19,6 +19,29 @@ static inline void arch_accept_memory(phys_addr_t start, phys_addr_t end)
 	}
 }
 
+/*
+ * Accept memory plugged after boot.  Unlike arch_accept_memory(), the caller
+ * may sleep and the memory needn't be described by the unaccepted table.
+ */
+static inline void arch_accept_hotplug_memory(phys_addr_t start, phys_addr_t end)
+{
+	if (cpu_feature_enabled(X86_FEATURE_TDX_GUEST)) {
+		/* In parallel if large. */
+		if (!tdx_accept_memory_parallel(start, end))
+			panic("TDX: Failed to accept memory\n");
+	} else if (cc_platform_has(CC_ATTR_GUEST_SEV_SNP)) {
+		snp_accept_memory(start, end);
+	}
+}
+
+/* The size of the blocks to accept whole, to keep the huge mappings. */
+static inline unsigned long arch_accept_memory_align(void)
+{
+	if (cpu_feature_enabled(X86_FEATURE_TDX_GUEST))
+		return tdx_accept_align();
+	return PAGE_SIZE;
+}
+
 static inline void arch_unaccept_memory(phys_addr_t start, phys_addr_t end)
 {
 	set_memory_decrypted((unsigned long)__va(start), (end - start) >> PAGE_SHIFT);
@@ -591,6 +591,17 @@ enum kvm_tdx_cmd_id {
 	KVM_TDX_MIG_IMPORT_STATE_VP,
 	KVM_TDX_MIG_EXPORT_ABORT,
 	KVM_TDX_MIG_IMPORT_END,
+	KVM_TDX_PREFAULT_MEMORY,
+	KVM_TDX_MIG_EXPORT_MEM_ASYNC,
+	KVM_TDX_MIG_EXPORT_MEM_RESULT,
+	KVM_TDX_MIG_GET_EPOCH_STATS,
+	KVM_TDX_MIG_SET_THROTTLE,
+	KVM_TDX_MIG_POSTCOPY_START,
+	KVM_TDX_MIG_POSTCOPY_RESOLVE,
+	KVM_TDX_INIT_VCPUS,
+	KVM_TDX_GET_EVENT_RING,
+	KVM_TDX_MIG_GET_SCHED,
+	KVM_TDX_SERVTD_SET_DOORBELL,
 
 	KVM_TDX_CMD_NR_MAX,
 };
@@ -679,6 +690,69 @@ struct kvm_tdx_init_mem_region {
 	__u64 nr_pages;
 };
 
+/*
+ * KVM_TDX_PREFAULT_MEMORY: On return, @gpa and @nr_pages are updated to the
+ * range which hasn't been mapped yet.
+ */
+struct kvm_tdx_prefault_memory {
+	__u64 gpa;
+	__u64 nr_pages;
+};
+
+/*
+ * KVM_TDX_INIT_VCPUS: KVM_TDX_INIT_VCPU of all the created vCPUs that aren't
+ * initialized yet, in parallel.  @data is the RCX of every vCPU, as @data of
+ * KVM_TDX_INIT_VCPU.  On error, some vCPUs may be initialized.
+ */
+
+/*
+ * KVM_TDX_GET_EVENT_RING: @data is the number of records of the ring of
+ * Secure-EPT events, a power of 2 from 64 to 1M, or 0 to share the ring
+ * already created.  Returns an fd to mmap() the ring read-only, struct
+ * kvm_tdx_event_ring followed by the records.
+ *
+ * Record n is at events[n % nr_events].  Read its @seq, copy it, then read
+ * @seq again after a read barrier: the copy is valid only if both reads are
+ * n + 1.  KVM_TDX_EVENT_SEQ_BUSY is set while a record is being written,
+ * retry it.  A larger @seq, busy or not, means the reader has been lapped and
+ * record n is lost, including when it changes while copying.
+ */
+#define KVM_TDX_EVENT_SEQ_BUSY	(1ULL << 63)
+
+#define KVM_TDX_EVENT_AUG	0
+#define KVM_TDX_EVENT_ADD	1
+#define KVM_TDX_EVENT_REMOVE	2
+#define KVM_TDX_EVENT_BLOCK	3
+#define KVM_TDX_EVENT_TRACK	4
+#define KVM_TDX_EVENT_DEMOTE	5
+#define KVM_TDX_EVENT_PROMOTE	6
+/*
+ * A MapGPA converted in the kernel, see KVM_MEM_KERNEL_CONVERT: @gfn is the
+ * first GFN of the range, @pfn the number of pages, @level 1 if the range
+ * became private and 0 if it became shared.
+ */
+#define KVM_TDX_EVENT_MAP_GPA	7
+
+struct kvm_tdx_event {
+	__u64 seq;
+	/* CLOCK_MONOTONIC */
+	__u64 time_ns;
+	__u64 gfn;
+	__u64 pfn;
+	__u8  type;
+	/* PG_LEVEL_*, 0 for KVM_TDX_EVENT_TRACK */
+	__u8  level;
+	__u16 pad;
+	__u32 cpu;
+	__u64 reserved[3];
+};
+
+struct kvm_tdx_event_ring {
+	__u64 nr_events;
+	__u64 reserved[511];
+	struct kvm_tdx_event events[];
+};
+
 struct kvm_rw_memory {
 	/* This can be GPA or HVA */
 	__u64 addr;
@@ -713,6 +787,26 @@ struct kvm_tdx_servtd {
 	};
 };
 
+/*
+ * KVM_TDX_SERVTD_SET_DOORBELL: issued on the user TD once bound to a servtd of
+ * @type.  A write to @usertd_gpa by the user TD raises @servtd_vector on the
+ * vCPU of the servtd with APIC ID @servtd_apic_id, and a write to @servtd_gpa
+ * by the servtd raises @usertd_vector on the user TD, e.g. the vectors they
+ * set up with TDG.VP.VMCALL<SetupEventNotifyInterrupt>.  Neither GPA may be
+ * backed by a memslot.  Meant for channels over memory shared by the two TDs,
+ * i.e. host pages mapped by both VMMs in the shared GPA space of their TD.
+ */
+struct kvm_tdx_servtd_doorbell {
+	__u16 type;
+	__u16 pad[3];
+	__u64 usertd_gpa;
+	__u64 servtd_gpa;
+	__u32 usertd_vector;
+	__u32 usertd_apic_id;
+	__u32 servtd_vector;
+	__u32 servtd_apic_id;
+};
+
 struct kvm_tdx_set_migration_info {
 #define KVM_TDX_SET_MIGRATION_INFO_VERSION	0
 	__u8  version;
@@ -739,6 +833,57 @@ struct kvm_dev_tdx_mig_attr {
 	__u32 max_migs;
 };
 
+/* KVM_TDX_MIG_EXPORT_MEM_ASYNC */
+struct kvm_tdx_mig_export_mem_async {
+	/* Number of GPA list entries to export */
+	__u64 npages;
+	/* eventfd signaled when the export completes */
+	__s32 eventfd;
+	/* Host CPU to run the export on, -1 for any */
+	__s32 cpu;
+};
+
+/* KVM_TDX_MIG_GET_EPOCH_STATS: stats of the last completed migration epoch */
+struct kvm_tdx_mig_epoch_stats {
+	/* Number of completed epochs, i.e. KVM_TDX_MIG_EXPORT_TRACK calls */
+	__u64 epoch;
+	__u64 duration_ns;
+	/* Pages write blocked with TDH.EXPORT.BLOCKW */
+	__u64 pages_blocked;
+	/* Blocked pages written again by the TD, i.e. write unblocked */
+	__u64 pages_redirtied;
+	/* Pages exported with TDH.EXPORT.MEM */
+	__u64 pages_exported;
+};
+
+/*
+ * KVM_TDX_MIG_GET_SCHED: how to split the migration bandwidth between the
+ * private memory, exported via the streams, and the shared memory, sent by
+ * userspace from the dirty log, based on the last completed epoch.
+ */
+struct kvm_tdx_mig_sched {
+	/* In: pages still to be sent in the current pass */
+	__u64 private_pending;
+	__u64 shared_pending;
+	/* Out: write faults on dirty logged shared memory in the last epoch */
+	__u64 shared_pages_dirtied;
+	/* Out: share of the bandwidth for private memory, in per mille */
+	__u32 private_permille;
+	__u32 padding;
+};
+
+/*
+ * KVM_TDX_MIG_SET_THROTTLE: delay in microseconds for a vCPU each time it write
+ * unblocks a page, 0 to disable.
+ */
+#define KVM_TDX_MIG_THROTTLE_US_MAX	10000
+
+/*
+ * Host CPU the stream is used on, set before KVM_DEV_TDX_MIG_ATTR.  The stream
+ * buffers are allocated on the NUMA node of the CPU.
+ */
+#define KVM_DEV_TDX_MIG_ATTR_CPU	0x2
+
 #define TDX_MIG_STREAM_MBMD_MAP_OFFSET		0
 #define TDX_MIG_STREAM_GPA_LIST_MAP_OFFSET	1
 #define TDX_MIG_STREAM_MAC_LIST_MAP_OFFSET	2
@@ -41,6 +41,7 @@
 /* Add more as needed */
 #define KVM_FEATURES_TRUSTED		 \
 	(BIT(KVM_FEATURE_NOP_IO_DELAY) | \
+	 BIT(KVM_FEATURE_PV_UNHALT)    | \
 	 BIT(KVM_FEATURE_PV_SEND_IPI)  | \
 	 BIT(KVM_FEATURE_MSI_EXT_DEST_ID))
 
@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+#ifndef _UAPI_ASM_X86_TDX_H
+#define _UAPI_ASM_X86_TDX_H
+
+#include <linux/types.h>
+
+/*
+ * Layout of /sys/firmware/tdx/tdx_module/metadata/sysinfo, for userspace to
+ * read all of the TDX module metadata at once, by read() or mmap().  Filled
+ * once after TDH.SYS.INFO.  Fields are only appended; @size covers the ones
+ * present.
+ */
+#define TDX_SYSINFO_BLOB_VERSION		1
+#define TDX_SYSINFO_BLOB_TDSYSINFO_SIZE		1024
+
+struct tdx_sysinfo_blob {
+	__u32	version;
+	__u32	size;
+	__u32	nr_guest_keyids;
+	__u32	reserved;
+	/* TDSYSINFO_STRUCT as returned by TDH.SYS.INFO */
+	__u8	tdsysinfo[TDX_SYSINFO_BLOB_TDSYSINFO_SIZE];
+} __attribute__((packed));
+
+#endif /* _UAPI_ASM_X86_TDX_H */
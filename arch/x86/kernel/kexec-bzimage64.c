@@ -184,6 +184,18 @@ setup_efi_state(struct boot_params *params, unsigned long params_load_addr,
 	struct efi_info *current_ei = &boot_params.efi_info;
 	struct efi_info *ei = &params->efi_info;
 
+	/*
+	 * The new kernel finds the unaccepted memory bitmap, which tracks what
+	 * this kernel accepted already, through the EFI config tables.  Without
+	 * them, it would take unaccepted memory as accepted.
+	 */
+	if (!efi_enabled(EFI_RUNTIME_SERVICES) &&
+	    IS_ENABLED(CONFIG_UNACCEPTED_MEMORY) &&
+	    efi.unaccepted != EFI_INVALID_TABLE_ADDR) {
+		pr_err("Can't pass the unaccepted memory table without EFI runtime services\n");
+		return -EOPNOTSUPP;
+	}
+
 	if (!efi_enabled(EFI_RUNTIME_SERVICES))
 		return 0;
 
@@ -291,8 +303,10 @@ setup_boot_parameters(struct kimage *image, struct boot_params *params,
 
 #ifdef CONFIG_EFI
 	/* Setup EFI state */
-	setup_efi_state(params, params_load_addr, efi_map_offset, efi_map_sz,
-			setup_data_offset);
+	ret = setup_efi_state(params, params_load_addr, efi_map_offset,
+			      efi_map_sz, setup_data_offset);
+	if (ret)
+		return ret;
 	setup_data_offset += sizeof(struct setup_data) +
 			sizeof(struct efi_setup_data);
 #endif
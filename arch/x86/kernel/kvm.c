@@ -42,6 +42,7 @@
 #include <asm/ptrace.h>
 #include <asm/reboot.h>
 #include <asm/svm.h>
+#include <asm/tdx.h>
 #include <asm/e820/api.h>
 
 DEFINE_STATIC_KEY_FALSE(kvm_async_pf_enabled);
@@ -1062,10 +1063,12 @@ static void kvm_wait(u8 *ptr, u8 val)
 		local_irq_disable();
 
 		/* safe_halt() will enable IRQ */
-		if (READ_ONCE(*ptr) == val)
-			safe_halt();
-		else
+		if (READ_ONCE(*ptr) != val)
 			local_irq_enable();
+		else if (cpu_feature_enabled(X86_FEATURE_TDX_GUEST))
+			tdx_safe_halt_irq_enable();
+		else
+			safe_halt();
 	}
 }
 
@@ -959,6 +959,11 @@ void select_idle_routine(const struct cpuinfo_x86 *c)
 		pr_info("using AMD E400 aware idle routine\n");
 		static_call_update(x86_idle, amd_e400_idle);
 	} else if (prefer_mwait_c1_over_halt(c)) {
+		/*
+		 * A TD only enumerates MWAIT if the VMM disabled MWAIT exits
+		 * (KVM_X86_DISABLE_EXITS_MWAIT), e.g. for vCPUs on dedicated
+		 * cores; MWAIT then idles without the TD exit of HLT.
+		 */
 		pr_info("using mwait in idle threads\n");
 		static_call_update(x86_idle, mwait_idle);
 	} else if (cpu_feature_enabled(X86_FEATURE_TDX_GUEST)) {
@@ -1179,7 +1179,11 @@ bool __init arch_cpuhp_init_parallel_bringup(void)
 		return false;
 	}
 
-	smpboot_control = STARTUP_READ_APICID;
+	/* Reading the APIC ID raises a #VE in a TD, see head_64.S. */
+	if (cpu_feature_enabled(X86_FEATURE_TDX_GUEST))
+		smpboot_control = STARTUP_APICID_TDVMCALL;
+	else
+		smpboot_control = STARTUP_READ_APICID;
 	pr_debug("Parallel CPU startup enabled: 0x%08x\n", smpboot_control);
 	return true;
 }
@@ -76,6 +76,8 @@ void kvm_arch_create_vcpu_debugfs(struct kvm_vcpu *vcpu, struct dentry *debugfs_
 				    debugfs_dentry, vcpu,
 				    &vcpu_tsc_scaling_frac_fops);
 	}
+
+	static_call_cond(kvm_x86_vcpu_create_debugfs)(vcpu, debugfs_dentry);
 }
 
 /*
@@ -192,5 +194,6 @@ int kvm_arch_create_vm_debugfs(struct kvm *kvm)
 {
 	debugfs_create_file("mmu_rmaps_stat", 0644, kvm->debugfs_dentry, kvm,
 			    &mmu_rmaps_stat_fops);
+	static_call_cond(kvm_x86_vm_create_debugfs)(kvm);
 	return 0;
 }
@@ -876,6 +876,7 @@ int kvm_pv_send_ipi(struct kvm *kvm, unsigned long ipi_bitmap_low,
 	rcu_read_unlock();
 	return count;
 }
+EXPORT_SYMBOL_GPL(kvm_pv_send_ipi);
 
 static int pv_eoi_put_user(struct kvm_vcpu *vcpu, u8 val)
 {
@@ -184,6 +184,7 @@ static inline void kvm_mmu_refresh_passthrough_bits(struct kvm_vcpu *vcpu,
 
 int kvm_mmu_map_tdp_page(struct kvm_vcpu *vcpu, gpa_t gpa, u64 error_code,
 			 int max_level, bool nonleaf);
+void kvm_mmu_promote_private_page(struct kvm_vcpu *vcpu, gpa_t gpa);
 
 int kvm_tdp_mmu_restore_private_pages(struct kvm *kvm);
 
@@ -285,6 +286,17 @@ static inline bool kvm_memslots_have_rmaps(struct kvm *kvm)
 	return !tdp_mmu_enabled || kvm_shadow_root_allocated(kvm);
 }
 
+/*
+ * Whether dirty logging of @kvm uses the CPU's dirty log, i.e. PML.  The
+ * VMCS of a TD is owned by the TDX module, which doesn't enable PML, so the
+ * shared EPT of TDs is dirty logged by write protection.
+ */
+static inline bool kvm_has_cpu_dirty_log(struct kvm *kvm)
+{
+	return kvm_x86_ops.cpu_dirty_log_size &&
+	       kvm->arch.vm_type != KVM_X86_TDX_VM;
+}
+
 static inline gfn_t gfn_to_index(gfn_t gfn, gfn_t base_gfn, int level)
 {
 	/* KVM_HPAGE_GFN_SHIFT(PG_LEVEL_4K) must be 0. */
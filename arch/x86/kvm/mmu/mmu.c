@@ -700,8 +700,15 @@ static int mmu_topup_memory_caches(struct kvm_vcpu *vcpu, bool maybe_indirect)
 		struct kvm_mmu_memory_cache *mc = &vcpu->arch.mmu_private_spt_cache;
 		int start, end, i;
 
+		/*
+		 * A fault links at most one Secure-EPT page per level.  Unlike
+		 * the mirror pages, these can't be shared with the rest of the
+		 * host, so don't let every vCPU of a large TD hoard a full
+		 * cache of them.
+		 */
 		start = kvm_mmu_memory_cache_nr_free_objects(mc);
-		r = kvm_mmu_topup_memory_cache(mc, PT64_ROOT_MAX_LEVEL);
+		r = __kvm_mmu_topup_memory_cache(mc, PT64_ROOT_MAX_LEVEL,
+						 PT64_ROOT_MAX_LEVEL);
 		end = kvm_mmu_memory_cache_nr_free_objects(mc);
 		for (i = start; i < end; i++)
 			kvm_mmu_split_direct_map(virt_to_page(mc->objects[i]));
@@ -1434,7 +1441,7 @@ void kvm_arch_mmu_enable_log_dirty_pt_masked(struct kvm *kvm,
 	}
 
 	/* Now handle 4K PTEs.  */
-	if (kvm_x86_ops.cpu_dirty_log_size)
+	if (kvm_has_cpu_dirty_log(kvm))
 		kvm_mmu_clear_dirty_pt_masked(kvm, slot, gfn_offset, mask);
 	else
 		kvm_mmu_write_protect_pt_masked(kvm, slot, gfn_offset, mask);
@@ -4730,6 +4737,10 @@ static bool kvm_arch_setup_async_pf(struct kvm_vcpu *vcpu,
 	arch.cr3 = kvm_mmu_get_guest_pgd(vcpu, vcpu->arch.mmu);
 	arch.error_code = fault->error_code & PFERR_GUEST_ENC_MASK;
 
+	if (fault->is_private)
+		return kvm_setup_async_pf_private(vcpu, fault->addr, fault->gfn,
+						  &arch);
+
 	return kvm_setup_async_pf(vcpu, fault->addr,
 				  kvm_vcpu_gfn_to_hva(vcpu, fault->gfn), &arch);
 }
@@ -4787,11 +4798,33 @@ static int kvm_do_memory_fault_exit(struct kvm_vcpu *vcpu,
 static int kvm_faultin_pfn_private(struct kvm_vcpu *vcpu,
 				   struct kvm_page_fault *fault)
 {
-	int max_order, r;
+	int max_order, r = -EAGAIN;
 	u8 max_level;
 
-	r = kvm_gmem_get_pfn(vcpu->kvm, fault->slot, fault->gfn, &fault->pfn,
-			     &max_order);
+	/*
+	 * Don't block the vCPU on a page that is being populated.  Protected
+	 * guests can't take a paravirtual async #PF, but the vCPU is put in
+	 * an artificial halt state until the page is ready, waking up for
+	 * interrupts so that the guest can schedule another task meanwhile.
+	 */
+	if (!fault->prefetch && kvm_can_do_async_pf(vcpu)) {
+		r = kvm_gmem_get_pfn_nowait(vcpu->kvm, fault->slot, fault->gfn,
+					    &fault->pfn, &max_order);
+		if (r == -EAGAIN) {
+			trace_kvm_try_async_get_page(fault->addr, fault->gfn);
+			if (kvm_find_async_pf_gfn(vcpu, fault->gfn)) {
+				trace_kvm_async_pf_repeated_fault(fault->addr, fault->gfn);
+				kvm_make_request(KVM_REQ_APF_HALT, vcpu);
+				return RET_PF_RETRY;
+			} else if (kvm_arch_setup_async_pf(vcpu, fault)) {
+				return RET_PF_RETRY;
+			}
+		}
+	}
+
+	if (r == -EAGAIN)
+		r = kvm_gmem_get_pfn(vcpu->kvm, fault->slot, fault->gfn,
+				     &fault->pfn, &max_order);
 	if (r)
 		return r;
 
@@ -5122,8 +5155,9 @@ int kvm_tdp_page_fault(struct kvm_vcpu *vcpu, struct kvm_page_fault *fault)
 	return direct_page_fault(vcpu, fault);
 }
 
-int kvm_mmu_map_tdp_page(struct kvm_vcpu *vcpu, gpa_t gpa, u64 error_code,
-			 int max_level, bool nonleaf)
+static int __kvm_mmu_map_tdp_page(struct kvm_vcpu *vcpu, gpa_t gpa,
+				  u64 error_code, int max_level, bool nonleaf,
+				  bool promote)
 {
 	int r;
 	struct kvm_page_fault fault = (struct kvm_page_fault) {
@@ -5139,6 +5173,7 @@ int kvm_mmu_map_tdp_page(struct kvm_vcpu *vcpu, gpa_t gpa, u64 error_code,
 		.is_private = error_code & PFERR_GUEST_ENC_MASK,
 		.nx_huge_page_workaround_enabled = is_nx_huge_page_enabled(vcpu->kvm),
 		.nonleaf = nonleaf,
+		.promote = promote,
 	};
 
 	WARN_ON_ONCE(!vcpu->arch.mmu->root_role.direct);
@@ -5191,29 +5226,42 @@ int kvm_mmu_map_tdp_page(struct kvm_vcpu *vcpu, gpa_t gpa, u64 error_code,
 		return -EIO;
 	}
 }
+
+int kvm_mmu_map_tdp_page(struct kvm_vcpu *vcpu, gpa_t gpa, u64 error_code,
+			 int max_level, bool nonleaf)
+{
+	return __kvm_mmu_map_tdp_page(vcpu, gpa, error_code, max_level,
+				      nonleaf, false);
+}
 EXPORT_SYMBOL_GPL(kvm_mmu_map_tdp_page);
 
+/*
+ * Map the private 2M range at @gpa with a 2M page if its 4K pages are all
+ * present, e.g. after they were imported one by one on migration.  Best
+ * effort, the range stays mapped either way.  A successful merge asks for a
+ * retry, so nothing tells the two apart but the promote accounting.
+ */
+void kvm_mmu_promote_private_page(struct kvm_vcpu *vcpu, gpa_t gpa)
+{
+	__kvm_mmu_map_tdp_page(vcpu, gpa & KVM_HPAGE_MASK(PG_LEVEL_2M),
+			       PFERR_WRITE_MASK | PFERR_GUEST_ENC_MASK,
+			       PG_LEVEL_2M, false, true);
+}
+EXPORT_SYMBOL_GPL(kvm_mmu_promote_private_page);
+
 static int kvm_slot_prealloc_set_mem_attributes(struct kvm *kvm,
 						struct kvm_gfn_range *gfn_range)
 {
-	int i, r;
-	void *entry;
 	gfn_t start = gfn_range->start;
 	gfn_t end = gfn_range->end;
 	unsigned long attributes = gfn_range->arg.attributes;
+	int r;
 
-	for (i = start; i < end; i++) {
-		r = xa_reserve(&kvm->mem_attr_array, i, GFP_KERNEL_ACCOUNT);
-		if (r)
-			return r;
-	}
+	r = kvm_reserve_mem_attributes(kvm, start, end, attributes);
+	if (r)
+		return r;
 
-	entry = attributes ? xa_mk_value(attributes) : NULL;
-	for (i = start; i < end; i++) {
-		r = xa_err(xa_store(&kvm->mem_attr_array, i, entry,
-				    GFP_KERNEL_ACCOUNT));
-		KVM_BUG_ON(r, kvm);
-	}
+	kvm_store_mem_attributes(kvm, start, end, attributes);
 
 	kvm_arch_post_set_memory_attributes(kvm, gfn_range);
 
@@ -5236,12 +5284,25 @@ kvm_slot_prealloc_private_pages(struct kvm *kvm,
 		.only_shared = false,
 		.may_block = true,
 	};
+	struct kvm_mem_attr_range range = {
+		.start = gfn_range.start,
+		.end = gfn_range.end,
+	};
 	gpa_t gpa = gfn_to_gpa(memslot->base_gfn);
 	uint64_t error_code = PFERR_WRITE_MASK | PFERR_GUEST_ENC_MASK;
 
 	if (mutex_lock_killable(&vcpu->mutex))
 		return -EINTR;
 
+	/*
+	 * Exclude memslot changes and attribute changes of the range, e.g.
+	 * MapGPAs, as kvm_vm_set_mem_attributes() does, until the attributes
+	 * are set back.  Taken before kvm->srcu, memslot changes synchronize
+	 * SRCU with mem_attr_rwsem held.
+	 */
+	down_read(&kvm->mem_attr_rwsem);
+	kvm_mem_attr_range_lock(kvm, &range);
+
 	vcpu_load(vcpu);
 	idx = srcu_read_lock(&kvm->srcu);
 
@@ -5249,9 +5310,11 @@ kvm_slot_prealloc_private_pages(struct kvm *kvm,
 
 	ret = kvm_slot_prealloc_set_mem_attributes(kvm, &gfn_range);
 	if (ret)
-		return ret;
+		goto out;
 
 	while (npages) {
+		unsigned long step = 1;
+
 		if (signal_pending(current)) {
 			ret = -ERESTARTSYS;
 			break;
@@ -5268,17 +5331,29 @@ kvm_slot_prealloc_private_pages(struct kvm *kvm,
 			break;
 		}
 
-		gpa += PAGE_SIZE;
-		npages--;
+		/*
+		 * Without the leaf, a single walk populates the whole last
+		 * level table, i.e. all the 4K pages of the 2M range.
+		 */
+		if (nonleaf)
+			step = min_t(unsigned long, npages,
+				     KVM_PAGES_PER_HPAGE(PG_LEVEL_2M) -
+				     (gpa_to_gfn(gpa) & (KVM_PAGES_PER_HPAGE(PG_LEVEL_2M) - 1)));
+
+		gpa += step << PAGE_SHIFT;
+		npages -= step;
 	}
 	if (!ret) {
 		gfn_range.arg.attributes = 0;
 		ret = kvm_slot_prealloc_set_mem_attributes(kvm, &gfn_range);
 	}
 
+out:
 	srcu_read_unlock(&kvm->srcu, idx);
 	vcpu_put(vcpu);
 
+	kvm_mem_attr_range_unlock(kvm, &range);
+	up_read(&kvm->mem_attr_rwsem);
 	mutex_unlock(&vcpu->mutex);
 
 	return ret;
@@ -8136,38 +8211,6 @@ static void hugepage_set_mixed(struct kvm_memory_slot *slot, gfn_t gfn,
 	lpage_info_slot(gfn, slot, level)->disallow_lpage |= KVM_LPAGE_MIXED_FLAG;
 }
 
-static bool range_has_attrs(struct kvm *kvm, gfn_t start, gfn_t end,
-			    unsigned long attrs)
-{
-	XA_STATE(xas, &kvm->mem_attr_array, start);
-	unsigned long index;
-	bool has_attrs;
-	void *entry;
-
-	rcu_read_lock();
-
-	if (!attrs) {
-		has_attrs = !xas_find(&xas, end);
-		goto out;
-	}
-
-	has_attrs = true;
-	for (index = start; index < end; index++) {
-		do {
-			entry = xas_next(&xas);
-		} while (xas_retry(&xas, entry));
-
-		if (xas.xa_index != index || xa_to_value(entry) != attrs) {
-			has_attrs = false;
-			break;
-		}
-	}
-
-out:
-	rcu_read_unlock();
-	return has_attrs;
-}
-
 static bool hugepage_has_attrs(struct kvm *kvm, struct kvm_memory_slot *slot,
 			       gfn_t gfn, int level, unsigned long attrs)
 {
@@ -8175,7 +8218,7 @@ static bool hugepage_has_attrs(struct kvm *kvm, struct kvm_memory_slot *slot,
 	const unsigned long end = start + KVM_PAGES_PER_HPAGE(level);
 
 	if (level == PG_LEVEL_2M)
-		return range_has_attrs(kvm, start, end, attrs);
+		return kvm_range_has_memory_attributes(kvm, start, end, attrs);
 
 	for (gfn = start; gfn < end; gfn += KVM_PAGES_PER_HPAGE(level - 1)) {
 		if (kvm_hugepage_test_mixed(slot, gfn, level - 1) ||
@@ -8284,6 +8327,40 @@ void kvm_mmu_init_memslot_memory_attributes(struct kvm *kvm,
 }
 #endif
 
+#ifdef CONFIG_KVM_PRIVATE_MEM
+/*
+ * TDH.MEM.PAGE.AUG and TDH.MEM.PAGE.ADD initialize the whole private page with
+ * the TD's key, and the page is cleared by tdx_clear_page() when it's
+ * reclaimed from the TD.
+ */
+bool kvm_arch_gmem_needs_clear(struct kvm *kvm)
+{
+	return kvm->arch.vm_type != KVM_X86_TDX_VM;
+}
+
+bool kvm_arch_gmem_relocatable(struct kvm *kvm)
+{
+	return tdp_mmu_enabled && kvm->arch.vm_type == KVM_X86_TDX_VM &&
+	       kvm_x86_ops.relocate_private_spte;
+}
+
+int kvm_arch_gmem_relocate(struct kvm *kvm, struct kvm_memory_slot *slot,
+			   gfn_t gfn, kvm_pfn_t old_pfn, kvm_pfn_t new_pfn)
+{
+	int r;
+
+	if (!kvm_arch_gmem_relocatable(kvm))
+		return -EOPNOTSUPP;
+
+	write_lock(&kvm->mmu_lock);
+	r = kvm_tdp_mmu_relocate_private_spte(kvm, slot->as_id, gfn, old_pfn,
+					      new_pfn);
+	write_unlock(&kvm->mmu_lock);
+
+	return r;
+}
+#endif
+
 #ifdef CONFIG_INTEL_TDX_HOST
 /*
  * return -EINVAL if no rmap entry, because we can't decide the
@@ -8320,4 +8397,21 @@ int kvm_mmu_is_page_private(struct kvm *kvm,
 	return ret;
 }
 EXPORT_SYMBOL(kvm_mmu_is_page_private);
+
+/*
+ * Unlike kvm_mmu_is_page_private(), a blocked or frozen private leaf counts as
+ * mapped.  Caller should hold the kvm srcu and kvm mmu lock.
+ */
+bool kvm_mmu_gfn_has_private_leaf(struct kvm *kvm,
+				  struct kvm_memory_slot *memslot, gfn_t gfn)
+{
+	bool is_private;
+
+	if (tdp_mmu_enabled)
+		return kvm_tdp_mmu_gfn_has_private_leaf(kvm, memslot, gfn);
+
+	return !kvm_mmu_is_page_private(kvm, memslot, gfn, &is_private) &&
+	       is_private;
+}
+EXPORT_SYMBOL(kvm_mmu_gfn_has_private_leaf);
 #endif
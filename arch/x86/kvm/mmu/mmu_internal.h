@@ -363,6 +363,8 @@ struct kvm_page_fault {
 	bool huge_page_disallowed;
 
 	bool nonleaf;
+	/* Merge the present 4K pages of the range into the requested level. */
+	bool promote;
 
 	/*
 	 * Maximum page size that can be created for this fault; input to
@@ -8,6 +8,8 @@
 #include "tdp_mmu.h"
 #include "spte.h"
 
+#include <linux/hash.h>
+
 #include <asm/cmpxchg.h>
 #include <trace/events/kvm.h>
 
@@ -15,6 +17,7 @@
 int kvm_mmu_init_tdp_mmu(struct kvm *kvm)
 {
 	struct workqueue_struct *wq;
+	int i;
 
 	wq = alloc_workqueue("kvm", WQ_UNBOUND|WQ_MEM_RECLAIM|WQ_CPU_INTENSIVE, 0);
 	if (!wq)
@@ -22,6 +25,8 @@ int kvm_mmu_init_tdp_mmu(struct kvm *kvm)
 
 	INIT_LIST_HEAD(&kvm->arch.tdp_mmu_roots);
 	spin_lock_init(&kvm->arch.tdp_mmu_pages_lock);
+	for (i = 0; i < ARRAY_SIZE(kvm->arch.tdp_mmu_sept_locks); i++)
+		spin_lock_init(&kvm->arch.tdp_mmu_sept_locks[i]);
 	kvm->arch.tdp_mmu_zap_wq = wq;
 #ifdef CONFIG_INTEL_TDX_HOST_DEBUG_MEMORY_CORRUPT
 	mutex_init(&kvm->arch.private_spt_for_split_lock);
@@ -772,13 +777,13 @@ static void handle_changed_spte(struct kvm *kvm, int as_id, gfn_t gfn,
 }
 
 static int private_spte_change_flags(struct kvm *kvm, gfn_t gfn, u64 old_spte,
-				     u64 new_spte, int level)
+				     u64 new_spte, int level, bool defer_blockw)
 {
 	bool was_writable = is_writable_pte(old_spte);
 	bool is_writable = is_writable_pte(new_spte);
 
-	/* Write block. TODO: Optimize with batching */
-	if (was_writable && !is_writable) {
+	/* Write block, unless the caller batches it, see wrprot_gfn_range(). */
+	if (was_writable && !is_writable && !defer_blockw) {
 		/* Sanity check: should be 4KB only */
 		KVM_BUG_ON(level != PG_LEVEL_4K, kvm);
 		static_call(kvm_x86_write_block_private_pages)(kvm,
@@ -791,9 +796,26 @@ static int private_spte_change_flags(struct kvm *kvm, gfn_t gfn, u64 old_spte,
 	return 0;
 }
 
+/*
+ * TDH.MEM.PAGE.AUG and TDH.MEM.SEPT.ADD lock the Secure-EPT entries they
+ * update and fail with TDX_OPERAND_BUSY when another vCPU updates the same
+ * Secure-EPT page, which tdx_seamcall() then retries in a busy loop.  With the
+ * MMU lock held for read, make such faults wait on a lock of the Secure-EPT
+ * page holding the entry instead, i.e. of the range mapped by the parent
+ * entry.  Faults on other pages still run in parallel.
+ */
+static spinlock_t *tdp_mmu_sept_lock(struct kvm *kvm, gfn_t gfn, int level)
+{
+	gfn_t table = gfn & ~(KVM_PAGES_PER_HPAGE(level + 1) - 1);
+
+	return &kvm->arch.tdp_mmu_sept_locks[hash_64(table | level,
+						     KVM_TDP_MMU_SEPT_LOCK_BITS)];
+}
+
 static int __must_check __set_private_spte_present(struct kvm *kvm, tdp_ptep_t sptep,
 						   gfn_t gfn, u64 old_spte,
-						   u64 new_spte, int level)
+						   u64 new_spte, int level,
+						   bool defer_blockw)
 {
 	bool was_private_zapped = is_private_zapped_spte(old_spte);
 	bool is_private_zapped = is_private_zapped_spte(new_spte);
@@ -806,6 +828,7 @@ static int __must_check __set_private_spte_present(struct kvm *kvm, tdp_ptep_t s
 	kvm_pfn_t old_pfn = spte_to_pfn(old_spte);
 	kvm_pfn_t new_pfn = spte_to_pfn(new_spte);
 	void *private_spt;
+	spinlock_t *lock;
 	int ret = 0;
 
 	lockdep_assert_held(&kvm->mmu_lock);
@@ -871,13 +894,20 @@ static int __must_check __set_private_spte_present(struct kvm *kvm, tdp_ptep_t s
 	} else if (is_leaf) {
 		if (was_present)
 			return private_spte_change_flags(kvm, gfn, old_spte,
-							 new_spte, level);
+							 new_spte, level,
+							 defer_blockw);
 
+		lock = tdp_mmu_sept_lock(kvm, gfn, level);
+		spin_lock(lock);
 		ret = static_call(kvm_x86_set_private_spte)(kvm, gfn, level, new_pfn);
+		spin_unlock(lock);
 	} else {
 		private_spt = get_private_spt(gfn, new_spte, level);
 		KVM_BUG_ON(!private_spt, kvm);
+		lock = tdp_mmu_sept_lock(kvm, gfn, level);
+		spin_lock(lock);
 		ret = static_call(kvm_x86_link_private_spt)(kvm, gfn, level, private_spt);
+		spin_unlock(lock);
 	}
 
 	return ret;
@@ -885,7 +915,8 @@ static int __must_check __set_private_spte_present(struct kvm *kvm, tdp_ptep_t s
 
 static int __must_check set_private_spte_present(struct kvm *kvm, tdp_ptep_t sptep,
 						 gfn_t gfn, u64 old_spte,
-						 u64 new_spte, int level)
+						 u64 new_spte, int level,
+						 bool defer_blockw)
 {
 	int ret;
 
@@ -902,7 +933,8 @@ static int __must_check set_private_spte_present(struct kvm *kvm, tdp_ptep_t spt
 	if (!try_cmpxchg64(sptep, &old_spte, REMOVED_SPTE))
 		return -EBUSY;
 
-	ret = __set_private_spte_present(kvm, sptep, gfn, old_spte, new_spte, level);
+	ret = __set_private_spte_present(kvm, sptep, gfn, old_spte, new_spte,
+					 level, defer_blockw);
 	if (ret)
 		__kvm_tdp_mmu_write_spte(sptep, old_spte);
 	else
@@ -926,10 +958,14 @@ static int __must_check set_private_spte_present(struct kvm *kvm, tdp_ptep_t spt
  * * -EBUSY - If the SPTE cannot be set. In this case this function will have
  *            no side-effects other than setting iter->old_spte to the last
  *            known value of the spte.
+ *
+ * With @defer_blockw, write protecting a private page doesn't issue
+ * TDH.EXPORT.BLOCKW, the caller blocks the page itself.
  */
-static inline int __must_check tdp_mmu_set_spte_atomic(struct kvm *kvm,
-						       struct tdp_iter *iter,
-						       u64 new_spte)
+static inline int __must_check __tdp_mmu_set_spte_atomic(struct kvm *kvm,
+							 struct tdp_iter *iter,
+							 u64 new_spte,
+							 bool defer_blockw)
 {
 	u64 *sptep = rcu_dereference(iter->sptep);
 	bool freezed = false;
@@ -956,7 +992,8 @@ static inline int __must_check tdp_mmu_set_spte_atomic(struct kvm *kvm,
 			 * stats.
 			 */
 			ret = set_private_spte_present(kvm, iter->sptep, iter->gfn,
-						       iter->old_spte, new_spte, iter->level);
+						       iter->old_spte, new_spte, iter->level,
+						       defer_blockw);
 			if (ret)
 				return ret;
 		} else {
@@ -988,6 +1025,13 @@ static inline int __must_check tdp_mmu_set_spte_atomic(struct kvm *kvm,
 	return 0;
 }
 
+static inline int __must_check tdp_mmu_set_spte_atomic(struct kvm *kvm,
+						       struct tdp_iter *iter,
+						       u64 new_spte)
+{
+	return __tdp_mmu_set_spte_atomic(kvm, iter, new_spte, false);
+}
+
 static u64 __private_zapped_spte(u64 old_spte)
 {
 	return SHADOW_NONPRESENT_VALUE | SPTE_PRIVATE_ZAPPED |
@@ -1072,7 +1116,7 @@ static u64 tdp_mmu_set_spte(struct kvm *kvm, int as_id, tdp_ptep_t sptep,
 		lockdep_assert_held_write(&kvm->mmu_lock);
 		/* Because write spin lock is held, no race.  It should success. */
 		KVM_BUG_ON(__set_private_spte_present(kvm, sptep, gfn, old_spte,
-						      new_spte, level), kvm);
+						      new_spte, level, false), kvm);
 	}
 
 	role = sptep_to_sp(sptep)->role;
@@ -1230,60 +1274,88 @@ static void tdp_mmu_zap_root(struct kvm *kvm, struct kvm_mmu_page *root,
 	rcu_read_unlock();
 }
 
-static int tdp_mmu_restore_private_page(struct kvm *kvm, gfn_t gfn,
-					u64 *sptep, u64 old_spte,
-					u64 new_spte, int level)
+#define TDP_MMU_RESTORE_BATCH	64
+
+/*
+ * Restore a batch of private pages with one TDH.EXPORT.RESTORE.  A page the
+ * TDX module doesn't restore, i.e. one that wasn't exported, is only write
+ * unblocked if it was blocked.
+ */
+static int tdp_mmu_restore_private_batch(struct kvm *kvm, gfn_t *gfns,
+					 unsigned long *blocked, uint32_t num)
 {
-	int ret;
+	DECLARE_BITMAP(failed, TDP_MMU_RESTORE_BATCH);
+	int i, ret;
 
-	kvm_tdp_mmu_write_spte(sptep, old_spte, new_spte, level);
-	ret = static_call(kvm_x86_restore_private_page)(kvm, gfn);
-	if (ret == -EPERM && is_shadow_present_pte(old_spte) &&
-	    !is_writable_pte(old_spte)) {
-		kvm_write_unblock_private_page(kvm, gfn, level);
-		ret = 0;
-	}
+	bitmap_zero(failed, TDP_MMU_RESTORE_BATCH);
+	ret = static_call(kvm_x86_restore_private_pages)(kvm, gfns, num, failed);
+	if (ret)
+		return ret;
+
+	bitmap_and(failed, failed, blocked, num);
+	for_each_set_bit(i, failed, num)
+		kvm_write_unblock_private_page(kvm, gfns[i], PG_LEVEL_4K);
 
+	bitmap_zero(blocked, TDP_MMU_RESTORE_BATCH);
 	return 0;
 }
 
 static int tdp_mmu_restore_private_pages(struct kvm *kvm,
 					 struct kvm_mmu_page *root)
 {
-	struct tdp_iter iter;
-	u64 old_spte, new_spte, *sptep;
+	DECLARE_BITMAP(blocked, TDP_MMU_RESTORE_BATCH);
+	gfn_t gfns[TDP_MMU_RESTORE_BATCH];
 	gfn_t end = tdp_mmu_max_gfn_exclusive();
-	gfn_t start = 0;
-	gfn_t gfn;
+	uint32_t nr = 0;
+	struct tdp_iter iter;
 	int ret = 0;
 
-	for_each_tdp_pte_min_level(iter, root, PG_LEVEL_4K, start, end) {
+	bitmap_zero(blocked, TDP_MMU_RESTORE_BATCH);
+
+	rcu_read_lock();
+
+	for_each_tdp_pte_min_level(iter, root, PG_LEVEL_4K, 0, end) {
+		if (nr && (need_resched() || rwlock_needbreak(&kvm->mmu_lock))) {
+			ret = tdp_mmu_restore_private_batch(kvm, gfns, blocked, nr);
+			nr = 0;
+			if (ret)
+				break;
+		}
+
 		if (tdp_mmu_iter_cond_resched(kvm, &iter, false, false))
 			continue;
 
-		if (iter.level > PG_LEVEL_4K)
+		if (iter.level > PG_LEVEL_4K ||
+		    !is_shadow_present_pte(iter.old_spte))
 			continue;
 
-		old_spte = iter.old_spte;
-		sptep = iter.sptep;
-		gfn = iter.gfn;
-
 		/* Restored sptes should always be writable */
-		new_spte = old_spte | PT_WRITABLE_MASK;
-		ret = tdp_mmu_restore_private_page(kvm, gfn, sptep,
-						   old_spte, new_spte,
-						   iter.level);
-		if (ret)
-			break;
+		kvm_tdp_mmu_write_spte(iter.sptep, iter.old_spte,
+				       iter.old_spte | PT_WRITABLE_MASK,
+				       iter.level);
+		if (!is_writable_pte(iter.old_spte))
+			__set_bit(nr, blocked);
+		gfns[nr++] = iter.gfn;
+
+		if (nr == TDP_MMU_RESTORE_BATCH) {
+			ret = tdp_mmu_restore_private_batch(kvm, gfns, blocked, nr);
+			nr = 0;
+			if (ret)
+				break;
+		}
 	}
 
+	if (nr && !ret)
+		ret = tdp_mmu_restore_private_batch(kvm, gfns, blocked, nr);
+
+	rcu_read_unlock();
 	return ret;
 }
 
 int kvm_tdp_mmu_restore_private_pages(struct kvm *kvm)
 {
 	struct kvm_mmu_page *root;
-	int i, ret;
+	int i, ret = 0;
 
 	write_lock(&kvm->mmu_lock);
 
@@ -1303,6 +1375,56 @@ int kvm_tdp_mmu_restore_private_pages(struct kvm *kvm)
 }
 EXPORT_SYMBOL_GPL(kvm_tdp_mmu_restore_private_pages);
 
+/*
+ * Move the private page mapped at @gfn from @old_pfn to @new_pfn, e.g. for
+ * compaction.  Returns -ENOENT if @gfn doesn't map @old_pfn, i.e. the TD
+ * doesn't own the page, and -EBUSY if the page can't be moved now.
+ */
+int kvm_tdp_mmu_relocate_private_spte(struct kvm *kvm, int as_id, gfn_t gfn,
+				      kvm_pfn_t old_pfn, kvm_pfn_t new_pfn)
+{
+	struct kvm_mmu_page *root;
+	struct tdp_iter iter;
+	u64 new_spte;
+	int ret;
+
+	lockdep_assert_held_write(&kvm->mmu_lock);
+
+	gfn = kvm_gfn_to_private(kvm, gfn);
+	for_each_tdp_mmu_root(kvm, root, as_id) {
+		if (!is_private_sp(root) || root->role.invalid)
+			continue;
+
+		tdp_root_for_each_pte(iter, root, gfn, gfn + 1) {
+			/* A blocked page is still owned by the TD. */
+			if (is_private_zapped_spte(iter.old_spte))
+				return -EBUSY;
+
+			if (!is_shadow_present_pte(iter.old_spte) ||
+			    !is_last_spte(iter.old_spte, iter.level))
+				continue;
+
+			if (iter.level != PG_LEVEL_4K)
+				return -EBUSY;
+			if (spte_to_pfn(iter.old_spte) != old_pfn)
+				return -ENOENT;
+
+			ret = static_call(kvm_x86_relocate_private_spte)(kvm, gfn,
+					iter.level, old_pfn, new_pfn);
+			if (ret)
+				return ret;
+
+			/* The private side already points at @new_pfn. */
+			new_spte = (iter.old_spte & ~SPTE_BASE_ADDR_MASK) |
+				   pfn_to_hpa(new_pfn);
+			kvm_tdp_mmu_write_spte(iter.sptep, iter.old_spte,
+					       new_spte, iter.level);
+			return 0;
+		}
+	}
+	return -ENOENT;
+}
+
 bool kvm_tdp_mmu_zap_sp(struct kvm *kvm, struct kvm_mmu_page *sp)
 {
 	u64 old_spte;
@@ -1345,13 +1467,49 @@ static int tdp_mmu_split_huge_page(struct kvm *kvm, struct tdp_iter *iter,
  * the caller must ensure it does not supply too large a GFN range, or the
  * operation can cause a soft lockup.
  */
+/*
+ * Removing a private leaf requires it to be blocked and the TLBs to be tracked
+ * first.  Doing both for each leaf costs a TDH.MEM.TRACK, including the IPIs to
+ * and the wait for all vCPUs, per page.  Instead, tdp_mmu_zap_leafs() blocks a
+ * batch of leaves, i.e. makes them private zapped, and removes them together
+ * after a single TLB flush.
+ */
+#define TDP_MMU_ZAP_PRIVATE_BATCH	64
+
+static void tdp_mmu_remove_private_batch(struct kvm *kvm, tdp_ptep_t *batch,
+					 int nr)
+{
+	struct kvm_mmu_page *sp;
+	u64 *sptep;
+	gfn_t gfn;
+	int i;
+
+	if (!nr)
+		return;
+
+	kvm_flush_remote_tlbs(kvm);
+
+	for (i = 0; i < nr; i++) {
+		sptep = rcu_dereference(batch[i]);
+		sp = sptep_to_sp(sptep);
+		gfn = sp->gfn + spte_index(sptep) *
+			KVM_PAGES_PER_HPAGE(sp->role.level);
+
+		tdp_mmu_set_spte(kvm, kvm_mmu_page_as_id(sp), batch[i],
+				 kvm_tdp_mmu_read_spte(batch[i]),
+				 SHADOW_NONPRESENT_VALUE, gfn, sp->role.level);
+	}
+}
+
 static bool tdp_mmu_zap_leafs(struct kvm *kvm, struct kvm_mmu_page *root,
 			      gfn_t start, gfn_t end, bool can_yield, bool flush,
 			      enum tdp_zap_private zap_private)
 {
+	tdp_ptep_t remove_batch[TDP_MMU_ZAP_PRIVATE_BATCH];
 	bool is_private = is_private_sp(root);
 	struct kvm_mmu_page *split_sp = NULL;
 	struct tdp_iter iter;
+	int nr_remove = 0;
 	u64 new_spte;
 
 	end = min(end, tdp_mmu_max_gfn_exclusive());
@@ -1373,6 +1531,13 @@ static bool tdp_mmu_zap_leafs(struct kvm *kvm, struct kvm_mmu_page *root,
 	rcu_read_lock();
 
 	for_each_tdp_pte_min_level(iter, root, PG_LEVEL_4K, start, end) {
+		/* Don't leave the batch blocked across yielding. */
+		if (nr_remove && can_yield &&
+		    (need_resched() || rwlock_needbreak(&kvm->mmu_lock))) {
+			tdp_mmu_remove_private_batch(kvm, remove_batch, nr_remove);
+			nr_remove = 0;
+		}
+
 		if (can_yield &&
 		    tdp_mmu_iter_cond_resched(kvm, &iter, flush, false)) {
 			flush = false;
@@ -1402,6 +1567,9 @@ static bool tdp_mmu_zap_leafs(struct kvm *kvm, struct kvm_mmu_page *root,
 			    (gfn & mask) < start ||
 			    end < (gfn & mask) + KVM_PAGES_PER_HPAGE(iter.level)) {
 				WARN_ON_ONCE(!can_yield);
+				tdp_mmu_remove_private_batch(kvm, remove_batch,
+							     nr_remove);
+				nr_remove = 0;
 				if (split_sp) {
 					sp = split_sp;
 					split_sp = NULL;
@@ -1438,6 +1606,20 @@ static bool tdp_mmu_zap_leafs(struct kvm *kvm, struct kvm_mmu_page *root,
 		    is_private_zapped_spte(iter.old_spte))
 			continue;
 
+		if (zap_private == ZAP_PRIVATE_REMOVE &&
+		    is_private && is_shadow_present_pte(iter.old_spte)) {
+			tdp_mmu_iter_set_spte(kvm, &iter,
+					      private_zapped_spte(kvm, &iter));
+			remove_batch[nr_remove++] = iter.sptep;
+			if (nr_remove == TDP_MMU_ZAP_PRIVATE_BATCH) {
+				tdp_mmu_remove_private_batch(kvm, remove_batch,
+							     nr_remove);
+				nr_remove = 0;
+			}
+			flush = true;
+			continue;
+		}
+
 		if (zap_private == ZAP_PRIVATE_REMOVE)
 			new_spte = SHADOW_NONPRESENT_VALUE;
 		else
@@ -1446,6 +1628,8 @@ static bool tdp_mmu_zap_leafs(struct kvm *kvm, struct kvm_mmu_page *root,
 		flush = true;
 	}
 
+	tdp_mmu_remove_private_batch(kvm, remove_batch, nr_remove);
+
 	rcu_read_unlock();
 
 	if (split_sp) {
@@ -1651,7 +1835,7 @@ static int tdp_mmu_merge_private_spt(struct kvm_vcpu *vcpu,
 			 * again with the expectation for other vcpu to accept
 			 * this page.
 			 */
-			if (child_iter.gfn == fault->gfn) {
+			if (child_iter.gfn == fault->gfn && !fault->promote) {
 				if (!ret)
 					ret = -EAGAIN;
 			}
@@ -1873,6 +2057,28 @@ static int tdp_mmu_unzap_large_spte(struct kvm_vcpu *vcpu, struct kvm_page_fault
 	return RET_PF_CONTINUE;
 }
 
+/*
+ * A private SPTE stays frozen for the duration of a single SEAMCALL, e.g. the
+ * TDH.MEM.PAGE.AUG of a vCPU faulting on the same GFN while the guest accepts
+ * its memory on all vCPUs at boot.  Waiting for it is far cheaper than going
+ * back to the guest only to take the same EPT violation again.
+ */
+#define TDP_MMU_FROZEN_SPTE_SPINS	1000
+
+static bool tdp_mmu_wait_frozen_spte(struct tdp_iter *iter)
+{
+	int i;
+
+	for (i = 0; i < TDP_MMU_FROZEN_SPTE_SPINS; i++) {
+		cpu_relax();
+		iter->old_spte = kvm_tdp_mmu_read_spte(iter->sptep);
+		if (!is_removed_spte(iter->old_spte))
+			return true;
+	}
+
+	return false;
+}
+
 /*
  * Handle a TDP page fault (NPT/EPT violation/misconfiguration) by installing
  * page tables and SPTEs to translate the faulting guest physical address.
@@ -1908,17 +2114,21 @@ int kvm_tdp_mmu_map(struct kvm_vcpu *vcpu, struct kvm_page_fault *fault)
 		int r;
 
 		KVM_BUG_ON(is_private_sptep(iter.sptep) != is_private, vcpu->kvm);
-		if (fault->nx_huge_page_workaround_enabled ||
-		    kvm_gfn_shared_mask(vcpu->kvm))
-			disallowed_hugepage_adjust(fault, iter.old_spte, iter.level);
 
 		/*
 		 * If SPTE has been frozen by another thread, just give up and
 		 * retry, avoiding unnecessary page table allocation and free.
+		 * A frozen private SPTE is waited for briefly instead, the goal
+		 * level is then adjusted to the SPTE it was replaced with.
 		 */
-		if (is_removed_spte(iter.old_spte))
+		if (is_removed_spte(iter.old_spte) &&
+		    (!is_private || !tdp_mmu_wait_frozen_spte(&iter)))
 			goto retry;
 
+		if (fault->nx_huge_page_workaround_enabled ||
+		    kvm_gfn_shared_mask(vcpu->kvm))
+			disallowed_hugepage_adjust(fault, iter.old_spte, iter.level);
+
 		if (iter.level == fault->goal_level)
 			goto map_target_level;
 
@@ -2170,9 +2380,13 @@ bool kvm_tdp_mmu_set_spte_gfn(struct kvm *kvm, struct kvm_gfn_range *range)
  * [start, end). Returns true if an SPTE has been changed and the TLBs need to
  * be flushed.
  */
+#define TDP_MMU_BLOCKW_BATCH	64
+
 static bool wrprot_gfn_range(struct kvm *kvm, struct kvm_mmu_page *root,
 			     gfn_t start, gfn_t end, int min_level)
 {
+	gfn_t blockw_gfns[TDP_MMU_BLOCKW_BATCH];
+	uint32_t nr_blockw = 0;
 	struct tdp_iter iter;
 	u64 new_spte;
 	bool spte_set = false;
@@ -2183,6 +2397,14 @@ static bool wrprot_gfn_range(struct kvm *kvm, struct kvm_mmu_page *root,
 
 	for_each_tdp_pte_min_level(iter, root, min_level, start, end) {
 retry:
+		/* Don't leave private pages unblocked across yielding. */
+		if (nr_blockw &&
+		    (need_resched() || rwlock_needbreak(&kvm->mmu_lock))) {
+			static_call(kvm_x86_write_block_private_pages)(kvm,
+							blockw_gfns, nr_blockw);
+			nr_blockw = 0;
+		}
+
 		if (tdp_mmu_iter_cond_resched(kvm, &iter, false, true))
 			continue;
 
@@ -2193,12 +2415,37 @@ static bool wrprot_gfn_range(struct kvm *kvm, struct kvm_mmu_page *root,
 
 		new_spte = iter.old_spte & ~PT_WRITABLE_MASK;
 
+		/*
+		 * Write block private 4K pages in batches instead of one
+		 * TDH.EXPORT.BLOCKW per page from tdp_mmu_set_spte_atomic().
+		 * The guest can still write to the pages until the batch is
+		 * blocked, which is fine as they are exported only after this
+		 * function returns.
+		 */
+		if (is_private_sptep(iter.sptep) && iter.level == PG_LEVEL_4K) {
+			if (__tdp_mmu_set_spte_atomic(kvm, &iter, new_spte, true))
+				goto retry;
+
+			blockw_gfns[nr_blockw++] = iter.gfn;
+			if (nr_blockw == TDP_MMU_BLOCKW_BATCH) {
+				static_call(kvm_x86_write_block_private_pages)(kvm,
+							blockw_gfns, nr_blockw);
+				nr_blockw = 0;
+			}
+			spte_set = true;
+			continue;
+		}
+
 		if (tdp_mmu_set_spte_atomic(kvm, &iter, new_spte))
 			goto retry;
 
 		spte_set = true;
 	}
 
+	if (nr_blockw)
+		static_call(kvm_x86_write_block_private_pages)(kvm, blockw_gfns,
+							       nr_blockw);
+
 	rcu_read_unlock();
 	return spte_set;
 }
@@ -2512,6 +2759,8 @@ static void clear_dirty_pt_masked(struct kvm *kvm, struct kvm_mmu_page *root,
 {
 	u64 dbit = (wrprot || !kvm_ad_enabled()) ? PT_WRITABLE_MASK :
 						   shadow_dirty_mask;
+	gfn_t blockw_gfns[BITS_PER_LONG];
+	uint32_t nr_blockw = 0;
 	struct tdp_iter iter;
 
 	lockdep_assert_held_write(&kvm->mmu_lock);
@@ -2536,8 +2785,7 @@ static void clear_dirty_pt_masked(struct kvm *kvm, struct kvm_mmu_page *root,
 			continue;
 
 		if (is_private_sptep(iter.sptep))
-			static_call(kvm_x86_write_block_private_pages)(kvm,
-							(gfn_t *)&iter.gfn, 1);
+			blockw_gfns[nr_blockw++] = iter.gfn;
 
 		iter.old_spte = tdp_mmu_clear_spte_bits(iter.sptep,
 							iter.old_spte, dbit,
@@ -2549,6 +2797,15 @@ static void clear_dirty_pt_masked(struct kvm *kvm, struct kvm_mmu_page *root,
 		kvm_set_pfn_dirty(spte_to_pfn(iter.old_spte));
 	}
 
+	/*
+	 * Write block the private pages of the mask with one batch instead of
+	 * one TDH.EXPORT.BLOCKW per page, e.g. on dirty ring reset.  mmu_lock
+	 * is held for write, so nothing can write unblock them in between.
+	 */
+	if (nr_blockw)
+		static_call(kvm_x86_write_block_private_pages)(kvm, blockw_gfns,
+							       nr_blockw);
+
 	rcu_read_unlock();
 }
 
@@ -2578,6 +2835,77 @@ void kvm_tdp_mmu_clear_dirty_pt_masked(struct kvm *kvm,
 		clear_dirty_pt_masked(kvm, root, gfn, mask, wrprot);
 }
 
+/*
+ * Zapping a collapsible private SPTE would remove all the pages below it from
+ * the TD, to be AUGed and accepted again one by one.  Instead, block the 2M
+ * Secure-EPT entry and merge its 4K pages in place with TDH.MEM.PAGE.PROMOTE,
+ * like tdp_mmu_merge_private_spt() does on a fault.  Only done if the 4K
+ * SPTEs map a 2M gmem folio in order with the same attributes, otherwise the
+ * range stays mapped as is.
+ */
+static void tdp_mmu_promote_private_spt(struct kvm *kvm, struct tdp_iter *iter)
+{
+	u64 ignored = shadow_accessed_mask | shadow_dirty_mask;
+	u64 *sptep = rcu_dereference(iter->sptep);
+	u64 old_spte = iter->old_spte;
+	struct kvm_mmu_page *child_sp;
+	u64 child_spte, new_spte;
+	tdp_ptep_t child_pt;
+	int i;
+
+	if (iter->level != PG_LEVEL_2M || is_nx_huge_page_enabled(kvm))
+		return;
+
+	child_pt = spte_to_child_pt(old_spte, iter->level);
+	child_sp = sptep_to_sp(rcu_dereference(child_pt));
+
+	new_spte = kvm_tdp_mmu_read_spte(child_pt);
+	if (!is_shadow_present_pte(new_spte) ||
+	    !IS_ALIGNED(spte_to_pfn(new_spte), KVM_PAGES_PER_HPAGE(PG_LEVEL_2M)) ||
+	    folio_nr_pages(page_folio(pfn_to_page(spte_to_pfn(new_spte)))) <
+	    KVM_PAGES_PER_HPAGE(PG_LEVEL_2M))
+		return;
+
+	for (i = 1; i < SPTE_ENT_PER_PAGE; i++) {
+		child_spte = kvm_tdp_mmu_read_spte(child_pt + i);
+		if (!is_shadow_present_pte(child_spte) ||
+		    (child_spte & ~ignored) !=
+		    ((new_spte + ((u64)i << PAGE_SHIFT)) & ~ignored))
+			return;
+	}
+	new_spte |= PT_PAGE_SIZE_MASK;
+
+	/* Keep faults off the range while its Secure-EPT entry changes. */
+	if (!try_cmpxchg64(sptep, &iter->old_spte, REMOVED_SPTE))
+		return;
+
+	if (static_call(kvm_x86_zap_private_spte)(kvm, iter->gfn, iter->level))
+		goto out;
+	kvm_flush_remote_tlbs_range(kvm, iter->gfn,
+				    KVM_PAGES_PER_HPAGE(iter->level));
+
+	if (static_call(kvm_x86_merge_private_spt)(kvm, iter->gfn, iter->level,
+						   kvm_mmu_private_spt(child_sp))) {
+		/* E.g. some pages are still pending, keep the 4K mappings. */
+		if (static_call(kvm_x86_unzap_private_spte)(kvm, iter->gfn,
+							    iter->level))
+			old_spte = __private_zapped_spte(old_spte);
+		goto out;
+	}
+
+	iter->old_spte = new_spte;
+	__kvm_tdp_mmu_write_spte(sptep, new_spte);
+
+	/* The Secure-EPT page was freed by kvm_x86_merge_private_spt(). */
+	tdp_unaccount_mmu_page(kvm, child_sp);
+	call_rcu(&child_sp->rcu_head, tdp_mmu_free_sp_rcu_callback);
+	return;
+
+out:
+	iter->old_spte = old_spte;
+	__kvm_tdp_mmu_write_spte(sptep, old_spte);
+}
+
 static void zap_collapsible_spte_range(struct kvm *kvm,
 				       struct kvm_mmu_page *root,
 				       const struct kvm_memory_slot *slot)
@@ -2616,6 +2944,12 @@ static void zap_collapsible_spte_range(struct kvm *kvm,
 		if (iter.gfn < start || iter.gfn >= end)
 			continue;
 
+		if (is_private_sptep(rcu_dereference(iter.sptep))) {
+			if (iter.gfn + KVM_PAGES_PER_HPAGE(iter.level) <= end)
+				tdp_mmu_promote_private_spt(kvm, &iter);
+			continue;
+		}
+
 		max_mapping_level = kvm_mmu_max_mapping_level(kvm, slot,
 							      iter.gfn, PG_LEVEL_NUM, false);
 		if (max_mapping_level < iter.level)
@@ -2883,5 +3217,41 @@ int kvm_tdp_mmu_is_page_private(struct kvm *kvm, struct kvm_memory_slot *memslot
 
 	return ret;
 }
+
+/*
+ * Return true if the private root has a leaf for @gfn, also if it is blocked
+ * (private zapped) or frozen by a concurrent change: the TD still owns the page
+ * behind it.  Caller should hold the kvm srcu and kvm mmu lock.
+ */
+bool kvm_tdp_mmu_gfn_has_private_leaf(struct kvm *kvm,
+				      struct kvm_memory_slot *memslot,
+				      gfn_t gfn)
+{
+	struct kvm_mmu_page *root;
+	struct tdp_iter iter;
+	bool ret = false;
+
+	gfn = kvm_gfn_to_private(kvm, gfn);
+
+	rcu_read_lock();
+	for_each_tdp_mmu_root(kvm, root, memslot->as_id) {
+		if (root->role.invalid || !is_private_sp(root))
+			continue;
+
+		tdp_root_for_each_pte(iter, root, gfn, gfn + 1) {
+			if (is_removed_spte(iter.old_spte) ||
+			    is_private_zapped_spte(iter.old_spte) ||
+			    (is_shadow_present_pte(iter.old_spte) &&
+			     is_last_spte(iter.old_spte, iter.level))) {
+				ret = true;
+				goto exit;
+			}
+		}
+	}
+exit:
+	rcu_read_unlock();
+
+	return ret;
+}
 EXPORT_SYMBOL_GPL(kvm_tdp_mmu_is_page_private);
 #endif
@@ -66,6 +66,8 @@ void kvm_tdp_mmu_try_split_huge_pages(struct kvm *kvm,
 				      int target_level, bool shared);
 
 int kvm_tdp_mmu_restore_private_pages(struct kvm *kvm);
+int kvm_tdp_mmu_relocate_private_spte(struct kvm *kvm, int as_id, gfn_t gfn,
+				      kvm_pfn_t old_pfn, kvm_pfn_t new_pfn);
 
 static inline void kvm_tdp_mmu_walk_lockless_begin(void)
 {
@@ -98,12 +100,21 @@ static inline bool is_tdp_mmu_page(struct kvm_mmu_page *sp) { return false; }
 #ifdef CONFIG_INTEL_TDX_HOST
 int kvm_tdp_mmu_is_page_private(struct kvm *kvm, struct kvm_memory_slot *memslot,
 				gfn_t gfn, bool *is_private);
+bool kvm_tdp_mmu_gfn_has_private_leaf(struct kvm *kvm,
+				      struct kvm_memory_slot *memslot,
+				      gfn_t gfn);
 #else
 static inline int kvm_tdp_mmu_is_page_private(struct kvm *kvm, struct kvm_memory_slot *memslot,
 					      gfn_t gfn, bool *is_private)
 {
 	return -EOPNOTSUPP;
 }
+static inline bool kvm_tdp_mmu_gfn_has_private_leaf(struct kvm *kvm,
+						    struct kvm_memory_slot *memslot,
+						    gfn_t gfn)
+{
+	return false;
+}
 #endif
 
 #endif /* __KVM_X86_MMU_TDP_MMU_H */
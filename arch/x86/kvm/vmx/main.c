@@ -13,6 +13,10 @@
 static bool enable_tdx __ro_after_init;
 module_param_named(tdx, enable_tdx, bool, 0444);
 
+#ifdef CONFIG_INTEL_TDX_HOST
+DEFINE_STATIC_KEY_FALSE(__kvm_has_tdx);
+#endif
+
 bool vt_is_vm_type_supported(unsigned long type)
 {
 	return __kvm_is_vm_type_supported(type) ||
@@ -50,10 +54,6 @@ __init int vt_hardware_setup(void)
 {
 	int ret;
 
-	/* Need to be set before vmx_hardware setup */
-	if (enable_tdx)
-		enable_pml = false;
-
 	ret = vmx_hardware_setup();
 	if (ret)
 		return ret;
@@ -86,6 +86,9 @@ __init int vt_hardware_setup(void)
 	enable_tdx = enable_tdx && !tdx_hardware_setup(&vt_x86_ops);
 
 	if (enable_tdx) {
+#ifdef CONFIG_INTEL_TDX_HOST
+		static_branch_enable(&__kvm_has_tdx);
+#endif
 		vt_x86_ops.flush_remote_tlbs = vt_flush_remote_tlbs;
 		vt_x86_ops.flush_remote_tlbs_range = vt_flush_remote_tlbs_range;
 	} else
@@ -137,6 +140,12 @@ void vt_vm_free(struct kvm *kvm)
 		tdx_vm_free(kvm);
 }
 
+void vt_vm_create_debugfs(struct kvm *kvm)
+{
+	if (is_td(kvm))
+		tdx_vm_create_debugfs(kvm);
+}
+
 int vt_vcpu_precreate(struct kvm *kvm)
 {
 	if (is_td(kvm))
@@ -163,6 +172,12 @@ void vt_vcpu_free(struct kvm_vcpu *vcpu)
 	vmx_vcpu_free(vcpu);
 }
 
+void vt_vcpu_create_debugfs(struct kvm_vcpu *vcpu, struct dentry *dentry)
+{
+	if (is_td_vcpu(vcpu))
+		tdx_vcpu_create_debugfs(vcpu, dentry);
+}
+
 void vt_vcpu_reset(struct kvm_vcpu *vcpu, bool init_event)
 {
 	if (is_td_vcpu(vcpu)) {
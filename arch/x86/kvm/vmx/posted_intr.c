@@ -222,8 +222,14 @@ void vmx_vcpu_pi_put(struct kvm_vcpu *vcpu)
 	if (!vmx_needs_pi_wakeup(vcpu))
 		return;
 
+	/*
+	 * Like a VMX vCPU halted with interrupts blocked, a TD vCPU halted
+	 * with interrupts disabled isn't woken by interrupts, e.g. the ones
+	 * posted by VT-d for assigned devices.
+	 */
 	if (kvm_vcpu_is_blocking(vcpu) &&
-	    (is_td_vcpu(vcpu) || !vmx_interrupt_blocked(vcpu)))
+	    (is_td_vcpu(vcpu) ? !tdx_interrupt_disabled_hlt(vcpu) :
+				!vmx_interrupt_blocked(vcpu)))
 		pi_enable_wakeup_handler(vcpu);
 
 	/*
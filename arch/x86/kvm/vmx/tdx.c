@@ -1,5 +1,11 @@
 // SPDX-License-Identifier: GPL-2.0
+#include <linux/anon_inodes.h>
+#include <linux/btf_ids.h>
 #include <linux/cpu.h>
+#include <linux/debugfs.h>
+#include <linux/error-injection.h>
+#include <linux/kthread.h>
+#include <linux/memcontrol.h>
 #include <linux/mmu_context.h>
 #include <linux/misc_cgroup.h>
 
@@ -7,9 +13,12 @@
 #include <asm/tdx.h>
 #include <asm/vmx.h>
 
+#include <kvm/iodev.h>
+
 #include "capabilities.h"
 #include "x86_ops.h"
 #include "common.h"
+#include "irq.h"
 #include "mmu.h"
 #include "tdx.h"
 #include "vmx.h"
@@ -75,18 +84,46 @@ static struct tdx_info tdx_info __ro_after_init;
  * TDH.MNG.KEY.RECLAIMID, TDH.MNG.KEY.FREEID etc) tries to acquire a global lock
  * internally in TDX module.  If failed, TDX_OPERAND_BUSY is returned without
  * spinning or waiting due to a constraint on execution time.  It's caller's
- * responsibility to avoid race (or retry on TDX_OPERAND_BUSY).  Use this mutex
- * to avoid race in TDX module because the kernel knows better about scheduling.
+ * responsibility to avoid race (or retry on TDX_OPERAND_BUSY).
+ *
+ * TDH.MNG.CREATE, TDH.MNG.VPFLUSHDONE and TDH.MNG.KEY.FREEID hold that lock
+ * only briefly and operate on their own TD, so they take tdx_kot_lock for read
+ * and rely on the TDX_OPERAND_BUSY retry of tdx_seamcall() among themselves.
+ * TDH.PHYMEM.CACHE.WB holds it for the duration of the writeback, so it takes
+ * tdx_kot_lock for write to keep the others from spinning.
+ */
+static DECLARE_RWSEM(tdx_kot_lock);
+/*
+ * Per-package lock for TDH.MNG.KEY.CONFIG and TDH.PHYMEM.CACHE.WB, which
+ * operate on the memory controller of the package and return TDX_OPERAND_BUSY
+ * on concurrent operations.
  */
-static DEFINE_MUTEX(tdx_lock);
 static struct mutex *tdx_mng_key_config_lock;
 static atomic_t nr_configured_hkid;
 
+/*
+ * HKIDs of destroyed TDs between the start of tdx_mmu_release_hkid() and their
+ * free or leak, and the number of such reclaims ended so far.  TD creation
+ * waits on tdx_hkid_reclaim_wq for them, see tdx_hkid_alloc().
+ */
+static atomic_t nr_reclaiming_hkid;
+static atomic_t nr_reclaimed_hkid;
+static DECLARE_WAIT_QUEUE_HEAD(tdx_hkid_reclaim_wq);
+
+/*
+ * How long TD creation waits in total for the HKIDs being reclaimed.  It holds
+ * kvm->lock meanwhile, keep it short.
+ */
+#define TDX_HKID_RECLAIM_TIMEOUT	HZ
+
 /*
  * A per-CPU list of TD vCPUs associated with a given CPU.  Used when a CPU
  * is brought down to invoke TDH_VP_FLUSH on the approapriate TD vCPUS.
  * Protected by interrupt mask.  This list is manipulated in process context
  * of vcpu and IPI callback.  See tdx_flush_vp_on_cpu().
+ *
+ * A vCPU is added to the list of the CPU of its first SEAMCALL after being
+ * flushed, not of the CPU it's loaded on, see tdx_associate_vp().
  */
 static DEFINE_PER_CPU(struct list_head, associated_tdvcpus);
 
@@ -212,17 +249,28 @@ struct tdvmcall_service_migtd {
 	uint8_t data[0];
 };
 
+/* Serializes binding and unbinding of all user TDs and servtds. */
+static DEFINE_MUTEX(tdx_servtd_binding_lock);
+
+static int tdx_servtd_doorbell_replace(struct kvm *kvm,
+				       struct tdx_servtd_doorbell **old,
+				       struct tdx_servtd_doorbell *db);
+
+/* Marks the entries of usertd_binding_slots waiting for pre-migration. */
+#define TDX_BINDING_SLOT_PREMIG_WAIT_MARK	XA_MARK_1
+
+/* Release, the servtd reads the slot once it sees the state. */
 static inline void
 tdx_binding_slot_set_state(struct tdx_binding_slot *slot,
 			   enum tdx_binding_slot_state state)
 {
-	slot->state = state;
+	smp_store_release(&slot->state, state);
 }
 
 static inline enum tdx_binding_slot_state
 tdx_binding_slot_get_state(struct tdx_binding_slot *slot)
 {
-	return slot->state;
+	return smp_load_acquire(&slot->state);
 }
 
 /*
@@ -306,13 +354,104 @@ static inline bool is_td_created(struct kvm_tdx *kvm_tdx)
 	return kvm_tdx->tdr_pa;
 }
 
+/*
+ * The reclaim of the HKID is over, either freed or leaked.  A leaked HKID keeps
+ * its charge, but TD creation mustn't wait for it anymore.
+ */
+static void tdx_hkid_end_reclaim(struct kvm_tdx *kvm_tdx)
+{
+	if (!kvm_tdx->hkid_reclaiming)
+		return;
+
+	kvm_tdx->hkid_reclaiming = false;
+	atomic_dec(&nr_reclaiming_hkid);
+	atomic_inc(&nr_reclaimed_hkid);
+	wake_up_all(&tdx_hkid_reclaim_wq);
+}
+
 static inline void tdx_hkid_free(struct kvm_tdx *kvm_tdx)
 {
 	tdx_guest_keyid_free(kvm_tdx->hkid);
 	kvm_tdx->hkid = 0;
-	misc_cg_uncharge(MISC_CG_RES_TDX, kvm_tdx->misc_cg, 1);
+	misc_cg_uncharge(kvm_tdx->misc_cg_res, kvm_tdx->misc_cg, 1);
 	put_misc_cg(kvm_tdx->misc_cg);
 	kvm_tdx->misc_cg = NULL;
+
+	tdx_hkid_end_reclaim(kvm_tdx);
+}
+
+/*
+ * Hand the charge of the HKID of a TD being destroyed over from "tdx" to
+ * "tdx_reclaim" for the cache writeback and TDH.MNG.KEY.FREEID, so a TD
+ * restarted in the same cgroup isn't refused meanwhile.  misc.current then
+ * shows the HKIDs in use and those pending reclaim separately.
+ */
+static void tdx_hkid_start_reclaim(struct kvm_tdx *kvm_tdx)
+{
+	if (kvm_tdx->hkid_reclaiming)
+		return;
+
+	kvm_tdx->hkid_reclaiming = true;
+	atomic_inc(&nr_reclaiming_hkid);
+
+	/* Only fails if a "tdx_reclaim" limit is set, keep the charge then. */
+	if (misc_cg_try_charge(MISC_CG_RES_TDX_RECLAIM, kvm_tdx->misc_cg, 1))
+		return;
+
+	misc_cg_uncharge(MISC_CG_RES_TDX, kvm_tdx->misc_cg, 1);
+	kvm_tdx->misc_cg_res = MISC_CG_RES_TDX_RECLAIM;
+}
+
+static int __tdx_hkid_alloc(struct kvm_tdx *kvm_tdx)
+{
+	struct misc_cg *misc_cg = get_current_misc_cg();
+	int ret;
+
+	ret = misc_cg_try_charge(MISC_CG_RES_TDX, misc_cg, 1);
+	if (ret) {
+		put_misc_cg(misc_cg);
+		return ret;
+	}
+
+	ret = tdx_guest_keyid_alloc();
+	if (ret < 0) {
+		misc_cg_uncharge(MISC_CG_RES_TDX, misc_cg, 1);
+		put_misc_cg(misc_cg);
+		return ret;
+	}
+
+	kvm_tdx->hkid = ret;
+	kvm_tdx->misc_cg = misc_cg;
+	kvm_tdx->misc_cg_res = MISC_CG_RES_TDX;
+	return 0;
+}
+
+/*
+ * The charge of the HKIDs being reclaimed was handed over already, but their
+ * keys may still be taken, or the cgroup limit be reached for a moment
+ * before the handover.  Wait for the reclaim rather than failing with -EBUSY
+ * or -ENOSPC if any is in progress.
+ */
+static int tdx_hkid_alloc(struct kvm_tdx *kvm_tdx)
+{
+	long t = TDX_HKID_RECLAIM_TIMEOUT;
+	int reclaimed;
+	int ret;
+
+	for (;;) {
+		reclaimed = atomic_read(&nr_reclaimed_hkid);
+		ret = __tdx_hkid_alloc(kvm_tdx);
+		if ((ret != -EBUSY && ret != -ENOSPC) ||
+		    !atomic_read(&nr_reclaiming_hkid))
+			return ret;
+
+		t = wait_event_interruptible_timeout(tdx_hkid_reclaim_wq,
+				atomic_read(&nr_reclaimed_hkid) != reclaimed, t);
+		if (t < 0)
+			return t;
+		if (!t)
+			return ret;
+	}
 }
 
 static inline bool is_hkid_assigned(struct kvm_tdx *kvm_tdx)
@@ -332,13 +471,13 @@ static inline void tdx_disassociate_vp(struct kvm_vcpu *vcpu)
 	list_del(&to_tdx(vcpu)->cpu_list);
 
 	/*
-	 * Ensure tdx->cpu_list is updated is before setting vcpu->cpu to -1,
-	 * otherwise, a different CPU can see vcpu->cpu = -1 and add the vCPU
+	 * Ensure tdx->cpu_list is updated is before setting assoc_cpu to -1,
+	 * otherwise, a different CPU can see assoc_cpu = -1 and add the vCPU
 	 * to its list before its deleted from this CPUs list.
 	 */
 	smp_wmb();
 
-	vcpu->cpu = -1;
+	WRITE_ONCE(to_tdx(vcpu)->assoc_cpu, -1);
 }
 
 static void tdx_disassociate_vp_arg(void *vcpu)
@@ -348,7 +487,7 @@ static void tdx_disassociate_vp_arg(void *vcpu)
 
 static void tdx_disassociate_vp_on_cpu(struct kvm_vcpu *vcpu)
 {
-	int cpu = vcpu->cpu;
+	int cpu = to_tdx(vcpu)->assoc_cpu;
 
 	if (unlikely(cpu == -1))
 		return;
@@ -378,10 +517,257 @@ static void tdx_clear_page(unsigned long page_pa, int size)
 	 * from seeing potentially poisoned cache.
 	 */
 	__mb();
+
+	tdx_untrack_private_pages(page_pa, size);
 }
 
-static int __tdx_reclaim_page(hpa_t pa, enum pg_level level,
-			      bool do_wb, u16 hkid)
+/*
+ * Clearing the reclaimed pages of a large TD with MOVDIR64B takes seconds and
+ * stalls the thread destroying the TD.  Instead, hand the pages to a per-node
+ * work item that clears them in the background.  The pages are pinned until
+ * they are cleared, so that they can't be reused with the stale KeyID.
+ */
+struct tdx_clear_item {
+	struct llist_node node;
+	kvm_pfn_t pfn;
+	unsigned long nr_pages;
+};
+
+struct tdx_clear_queue {
+	struct llist_head items;
+	struct work_struct work;
+};
+
+static bool __read_mostly tdx_async_clear = true;
+module_param_named(tdx_async_clear, tdx_async_clear, bool, 0444);
+
+static struct workqueue_struct *tdx_clear_wq;
+static struct tdx_clear_queue *tdx_clear_queues;
+
+static void tdx_clear_work(struct work_struct *work)
+{
+	struct tdx_clear_queue *q = container_of(work, struct tdx_clear_queue, work);
+	struct tdx_clear_item *item, *tmp;
+	struct llist_node *items;
+	unsigned long i;
+
+	items = llist_reverse_order(llist_del_all(&q->items));
+	llist_for_each_entry_safe(item, tmp, items, node) {
+		tdx_clear_page(pfn_to_hpa(item->pfn), item->nr_pages << PAGE_SHIFT);
+		for (i = 0; i < item->nr_pages; i++)
+			put_page(pfn_to_page(item->pfn + i));
+		kfree(item);
+		cond_resched();
+	}
+}
+
+/*
+ * Clear the pages and drop the caller's reference to them.  The caller must
+ * hold one reference to each page, e.g. the allocation itself for TD control
+ * pages, which is handed over to the clearing work.
+ */
+static void tdx_clear_and_put_pages(hpa_t pa, unsigned long size)
+{
+	unsigned long nr_pages = size >> PAGE_SHIFT;
+	kvm_pfn_t pfn = PHYS_PFN(pa);
+	struct tdx_clear_item *item = NULL;
+	struct tdx_clear_queue *q;
+	unsigned long i;
+	int nid;
+
+	if (tdx_clear_wq)
+		item = kmalloc(sizeof(*item), GFP_NOWAIT | __GFP_NOWARN);
+	if (!item) {
+		tdx_clear_page(pa, size);
+		for (i = 0; i < nr_pages; i++)
+			put_page(pfn_to_page(pfn + i));
+		return;
+	}
+
+	item->pfn = pfn;
+	item->nr_pages = nr_pages;
+
+	nid = pfn_to_nid(pfn);
+	q = &tdx_clear_queues[nid];
+	if (llist_add(&item->node, &q->items))
+		queue_work_node(nid, tdx_clear_wq, &q->work);
+}
+
+/* Clear the pages asynchronously, pinning them until they are cleared. */
+static void tdx_clear_page_async(hpa_t pa, unsigned long size)
+{
+	kvm_pfn_t pfn = PHYS_PFN(pa);
+	unsigned long i;
+
+	if (!tdx_clear_wq) {
+		tdx_clear_page(pa, size);
+		return;
+	}
+
+	for (i = 0; i < size >> PAGE_SHIFT; i++)
+		get_page(pfn_to_page(pfn + i));
+	tdx_clear_and_put_pages(pa, size);
+}
+
+static int tdx_clear_queues_init(void)
+{
+	int nid;
+
+	if (!tdx_async_clear)
+		return 0;
+
+	tdx_clear_queues = kcalloc(nr_node_ids, sizeof(*tdx_clear_queues),
+				   GFP_KERNEL);
+	if (!tdx_clear_queues)
+		return -ENOMEM;
+
+	for_each_node(nid) {
+		init_llist_head(&tdx_clear_queues[nid].items);
+		INIT_WORK(&tdx_clear_queues[nid].work, tdx_clear_work);
+	}
+
+	tdx_clear_wq = alloc_workqueue("kvm_tdx_clear", WQ_UNBOUND, 0);
+	if (!tdx_clear_wq) {
+		kfree(tdx_clear_queues);
+		tdx_clear_queues = NULL;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void tdx_clear_queues_exit(void)
+{
+	/* destroy_workqueue() drains the pending clearing. */
+	if (tdx_clear_wq)
+		destroy_workqueue(tdx_clear_wq);
+	tdx_clear_wq = NULL;
+	kfree(tdx_clear_queues);
+	tdx_clear_queues = NULL;
+}
+
+/*
+ * Per-node pools of pages for TDR, TDCS, TDVPR and TDVPX, so that a burst of
+ * TD and vCPU creation doesn't go to the page allocator for each control
+ * page.  The pages need no clearing as the TDX module initializes them when
+ * they are added.  A pool is refilled in the background when it drops below
+ * half of tdx_page_pool_size pages.  The pooled pages are allocated by the
+ * refill work, so they aren't charged to the memcg of the TD.  0 disables
+ * the pools.
+ */
+struct tdx_page_pool {
+	spinlock_t lock;
+	struct list_head pages;
+	unsigned int nr;
+	struct work_struct refill;
+};
+
+static unsigned int __read_mostly tdx_page_pool_size;
+module_param_named(tdx_page_pool_size, tdx_page_pool_size, uint, 0444);
+
+static struct tdx_page_pool *tdx_page_pools;
+
+static void tdx_page_pool_refill(struct work_struct *work)
+{
+	struct tdx_page_pool *pool = container_of(work, struct tdx_page_pool,
+						  refill);
+	int nid = pool - tdx_page_pools;
+	struct page *page;
+
+	while (READ_ONCE(pool->nr) < tdx_page_pool_size) {
+		page = alloc_pages_node(nid, GFP_KERNEL | __GFP_THISNODE |
+					__GFP_NOWARN, 0);
+		if (!page)
+			break;
+
+		spin_lock(&pool->lock);
+		list_add(&page->lru, &pool->pages);
+		pool->nr++;
+		spin_unlock(&pool->lock);
+		cond_resched();
+	}
+}
+
+/* Same as __get_free_page(GFP_KERNEL_ACCOUNT), but from the local pool. */
+static unsigned long tdx_alloc_ctrl_page(void)
+{
+	struct tdx_page_pool *pool;
+	struct page *page;
+	bool refill;
+	int nid;
+
+	if (!tdx_page_pools)
+		return __get_free_page(GFP_KERNEL_ACCOUNT);
+
+	nid = numa_mem_id();
+	pool = &tdx_page_pools[nid];
+	spin_lock(&pool->lock);
+	page = list_first_entry_or_null(&pool->pages, struct page, lru);
+	if (page) {
+		list_del(&page->lru);
+		pool->nr--;
+	}
+	refill = pool->nr < tdx_page_pool_size / 2;
+	spin_unlock(&pool->lock);
+
+	if (refill)
+		queue_work_node(nid, system_unbound_wq, &pool->refill);
+
+	if (!page)
+		return __get_free_page(GFP_KERNEL_ACCOUNT);
+
+	return (unsigned long)page_address(page);
+}
+
+static void tdx_page_pools_init(void)
+{
+	int nid;
+
+	if (!tdx_page_pool_size)
+		return;
+
+	tdx_page_pools = kcalloc(nr_node_ids, sizeof(*tdx_page_pools),
+				 GFP_KERNEL);
+	if (!tdx_page_pools) {
+		pr_warn("failed to allocate the control page pools\n");
+		return;
+	}
+
+	for_each_node(nid) {
+		spin_lock_init(&tdx_page_pools[nid].lock);
+		INIT_LIST_HEAD(&tdx_page_pools[nid].pages);
+		INIT_WORK(&tdx_page_pools[nid].refill, tdx_page_pool_refill);
+	}
+
+	for_each_node_state(nid, N_MEMORY)
+		queue_work_node(nid, system_unbound_wq,
+				&tdx_page_pools[nid].refill);
+}
+
+static void tdx_page_pools_exit(void)
+{
+	struct tdx_page_pool *pool;
+	struct page *page, *tmp;
+	int nid;
+
+	if (!tdx_page_pools)
+		return;
+
+	for_each_node(nid) {
+		pool = &tdx_page_pools[nid];
+		cancel_work_sync(&pool->refill);
+		list_for_each_entry_safe(page, tmp, &pool->pages, lru) {
+			list_del(&page->lru);
+			__free_page(page);
+		}
+	}
+	kfree(tdx_page_pools);
+	tdx_page_pools = NULL;
+}
+
+/* Reclaim the page from the TDX module without clearing it. */
+static int tdx_reclaim_page_noclear(hpa_t pa, enum pg_level level,
+				    bool do_wb, u16 hkid)
 {
 	struct tdx_module_args out;
 	u64 err;
@@ -406,10 +792,19 @@ static int __tdx_reclaim_page(hpa_t pa, enum pg_level level,
 	}
 
 	tdx_set_page_present_level(pa, level);
-	tdx_clear_page(pa, KVM_HPAGE_SIZE(level));
 	return 0;
 }
 
+static int __tdx_reclaim_page(hpa_t pa, enum pg_level level,
+			      bool do_wb, u16 hkid)
+{
+	int r = tdx_reclaim_page_noclear(pa, level, do_wb, hkid);
+
+	if (!r)
+		tdx_clear_page(pa, KVM_HPAGE_SIZE(level));
+	return r;
+}
+
 static int tdx_reclaim_page(hpa_t pa, bool do_wb, u16 hkid)
 {
 	int r = __tdx_reclaim_page(pa, PG_LEVEL_4K, do_wb, hkid);
@@ -429,7 +824,7 @@ static void tdx_reclaim_td_page(unsigned long td_page_pa)
 	 * was already flushed by TDH.PHYMEM.CACHE.WB before here, So
 	 * cache doesn't need to be flushed again.
 	 */
-	if (tdx_reclaim_page(td_page_pa, false, 0))
+	if (tdx_reclaim_page_noclear(td_page_pa, PG_LEVEL_4K, false, 0))
 		/*
 		 * Leak the page on failure:
 		 * tdx_reclaim_page() returns an error if and only if there's an
@@ -440,7 +835,177 @@ static void tdx_reclaim_td_page(unsigned long td_page_pa)
 		 * No log here as tdx_reclaim_page() already did.
 		 */
 		return;
-	free_page((unsigned long)__va(td_page_pa));
+
+	/* The clearing work frees the page. */
+	tdx_clear_and_put_pages(td_page_pa, PAGE_SIZE);
+}
+
+/*
+ * Once the HKID of a TD is freed, its private and Secure-EPT pages only need
+ * TDH.PHYMEM.PAGE.RECLAIM and clearing.  Instead of doing both page by page in
+ * the TDP MMU walk tearing the TD down, gather the pages into batches which
+ * the work items of tdx_clear_wq reclaim and clear on many CPUs in parallel.
+ * Each batch holds a reference to its pages until they are cleared.  The TDR
+ * can only be reclaimed after all the other pages, see
+ * tdx_reclaim_batch_drain().
+ */
+#define TDX_RECLAIM_BATCH_NR	240
+
+/*
+ * Reclaim the batches of a TD in a kthread of its own, in the cgroups of the
+ * process that created the TD, instead of tdx_clear_wq.  The CPU time of the
+ * teardown is then charged to the TD's owner, at the cost of reclaiming on a
+ * single CPU.
+ */
+static bool __read_mostly tdx_reclaim_in_cgroup;
+module_param_named(tdx_reclaim_in_cgroup, tdx_reclaim_in_cgroup, bool, 0444);
+
+struct tdx_reclaim_batch {
+	struct work_struct work;
+	struct kthread_work kwork;
+	struct kvm_tdx *kvm_tdx;
+	int nr;
+	struct {
+		kvm_pfn_t pfn;
+		enum pg_level level;
+	} pages[TDX_RECLAIM_BATCH_NR];
+};
+
+static void __tdx_reclaim_batch(struct tdx_reclaim_batch *batch)
+{
+	struct kvm_tdx *kvm_tdx = batch->kvm_tdx;
+	u64 start = ktime_get_ns();
+	unsigned long j;
+	int i;
+
+	for (i = 0; i < batch->nr; i++) {
+		kvm_pfn_t pfn = batch->pages[i].pfn;
+		enum pg_level level = batch->pages[i].level;
+
+		/* Leak the pages on failure, see tdx_reclaim_td_page(). */
+		if (tdx_reclaim_page_noclear(pfn_to_hpa(pfn), level, false, 0))
+			continue;
+
+		tdx_clear_page(pfn_to_hpa(pfn), KVM_HPAGE_SIZE(level));
+		for (j = 0; j < KVM_PAGES_PER_HPAGE(level); j++)
+			put_page(pfn_to_page(pfn + j));
+		cond_resched();
+	}
+	kfree(batch);
+
+	atomic64_add(ktime_get_ns() - start, &kvm_tdx->kvm.stat.tdx_reclaim_ns);
+	if (atomic_dec_and_test(&kvm_tdx->nr_reclaim_batches))
+		wake_up_var(&kvm_tdx->nr_reclaim_batches);
+}
+
+static void tdx_reclaim_batch_work(struct work_struct *work)
+{
+	__tdx_reclaim_batch(container_of(work, struct tdx_reclaim_batch, work));
+}
+
+static void tdx_reclaim_batch_kwork(struct kthread_work *work)
+{
+	__tdx_reclaim_batch(container_of(work, struct tdx_reclaim_batch, kwork));
+}
+
+static void tdx_reclaim_batch_queue(struct kvm_tdx *kvm_tdx,
+				    struct tdx_reclaim_batch *batch)
+{
+	atomic_inc(&kvm_tdx->nr_reclaim_batches);
+	if (kvm_tdx->reclaim_task)
+		kthread_queue_work(&kvm_tdx->reclaim_worker, &batch->kwork);
+	else
+		queue_work_node(pfn_to_nid(batch->pages[0].pfn), tdx_clear_wq,
+				&batch->work);
+}
+
+static int tdx_reclaim_worker_fn(struct kvm *kvm, uintptr_t data)
+{
+	return kthread_worker_fn(&to_kvm_tdx(kvm)->reclaim_worker);
+}
+
+static int tdx_reclaim_worker_create(struct kvm_tdx *kvm_tdx)
+{
+	int ret;
+
+	if (!tdx_reclaim_in_cgroup || !tdx_clear_wq)
+		return 0;
+
+	kthread_init_worker(&kvm_tdx->reclaim_worker);
+	ret = kvm_vm_create_worker_thread(&kvm_tdx->kvm, tdx_reclaim_worker_fn,
+					  0, "kvm-tdx-reclaim",
+					  &kvm_tdx->reclaim_task);
+	if (!ret)
+		kthread_unpark(kvm_tdx->reclaim_task);
+
+	return ret;
+}
+
+static void tdx_reclaim_worker_destroy(struct kvm_tdx *kvm_tdx)
+{
+	if (!kvm_tdx->reclaim_task)
+		return;
+
+	kthread_flush_worker(&kvm_tdx->reclaim_worker);
+	kthread_stop(kvm_tdx->reclaim_task);
+	/* Any later batch, e.g. after a failed KVM_TDX_INIT_VM, uses the wq. */
+	kvm_tdx->reclaim_task = NULL;
+}
+
+/*
+ * Hand a page and the caller's reference to it over to the batch, false if
+ * the caller has to reclaim the page itself.  Called under mmu_lock.
+ */
+static bool tdx_reclaim_batch_add(struct kvm_tdx *kvm_tdx, kvm_pfn_t pfn,
+				  enum pg_level level)
+{
+	struct tdx_reclaim_batch *batch;
+
+	if (!tdx_clear_wq)
+		return false;
+
+	spin_lock(&kvm_tdx->reclaim_lock);
+	batch = kvm_tdx->reclaim_batch;
+	if (!batch) {
+		batch = kmalloc(sizeof(*batch), GFP_NOWAIT | __GFP_NOWARN);
+		if (!batch) {
+			spin_unlock(&kvm_tdx->reclaim_lock);
+			return false;
+		}
+		INIT_WORK(&batch->work, tdx_reclaim_batch_work);
+		kthread_init_work(&batch->kwork, tdx_reclaim_batch_kwork);
+		batch->kvm_tdx = kvm_tdx;
+		batch->nr = 0;
+		kvm_tdx->reclaim_batch = batch;
+	}
+
+	batch->pages[batch->nr].pfn = pfn;
+	batch->pages[batch->nr].level = level;
+	if (++batch->nr == TDX_RECLAIM_BATCH_NR)
+		kvm_tdx->reclaim_batch = NULL;
+	else
+		batch = NULL;
+	spin_unlock(&kvm_tdx->reclaim_lock);
+
+	if (batch)
+		tdx_reclaim_batch_queue(kvm_tdx, batch);
+	return true;
+}
+
+static void tdx_reclaim_batch_drain(struct kvm_tdx *kvm_tdx)
+{
+	struct tdx_reclaim_batch *batch;
+
+	spin_lock(&kvm_tdx->reclaim_lock);
+	batch = kvm_tdx->reclaim_batch;
+	kvm_tdx->reclaim_batch = NULL;
+	spin_unlock(&kvm_tdx->reclaim_lock);
+
+	if (batch)
+		tdx_reclaim_batch_queue(kvm_tdx, batch);
+
+	wait_var_event(&kvm_tdx->nr_reclaim_batches,
+		       !atomic_read(&kvm_tdx->nr_reclaim_batches));
 }
 
 struct tdx_flush_vp_arg {
@@ -458,7 +1023,7 @@ static void tdx_flush_vp(void *arg_)
 	lockdep_assert_irqs_disabled();
 
 	/* Task migration can race with CPU offlining. */
-	if (unlikely(vcpu->cpu != raw_smp_processor_id()))
+	if (unlikely(to_tdx(vcpu)->assoc_cpu != raw_smp_processor_id()))
 		return;
 
 	/*
@@ -493,7 +1058,7 @@ static void tdx_flush_vp_on_cpu(struct kvm_vcpu *vcpu)
 	struct tdx_flush_vp_arg arg = {
 		.vcpu = vcpu,
 	};
-	int cpu = vcpu->cpu;
+	int cpu = to_tdx(vcpu)->assoc_cpu;
 
 	if (unlikely(cpu == -1))
 		return;
@@ -501,10 +1066,68 @@ static void tdx_flush_vp_on_cpu(struct kvm_vcpu *vcpu)
 	smp_call_function_single(cpu, tdx_flush_vp, &arg, 1);
 	if (WARN_ON_ONCE(arg.err)) {
 		pr_err("cpu: %d ", cpu);
-		pr_tdx_error(TDH_VP_FLUSH, arg.err, NULL);
+		kvm_pr_tdx_error(vcpu->kvm, TDH_VP_FLUSH, arg.err, NULL);
 	}
 }
 
+struct tdx_flush_vps_arg {
+	struct kvm *kvm;
+	atomic64_t err;
+};
+
+static void tdx_flush_vps_local(void *arg_)
+{
+	struct list_head *tdvcpus = this_cpu_ptr(&associated_tdvcpus);
+	struct tdx_flush_vps_arg *arg = arg_;
+	struct tdx_flush_vp_arg vp_arg;
+	struct vcpu_tdx *tdx, *tmp;
+
+	/* Safe variant needed as tdx_disassociate_vp() deletes the entry. */
+	list_for_each_entry_safe(tdx, tmp, tdvcpus, cpu_list) {
+		if (tdx->vcpu.kvm != arg->kvm)
+			continue;
+
+		vp_arg.vcpu = &tdx->vcpu;
+		tdx_flush_vp(&vp_arg);
+		if (vp_arg.err)
+			atomic64_cmpxchg(&arg->err, 0, vp_arg.err);
+	}
+}
+
+/*
+ * Flush all the vCPUs of @kvm, none of which may run, with one IPI per CPU
+ * they are associated with, on all those CPUs in parallel rather than one
+ * vCPU after another.
+ */
+static void tdx_flush_vps(struct kvm *kvm)
+{
+	struct tdx_flush_vps_arg arg = {
+		.kvm = kvm,
+		.err = ATOMIC64_INIT(0),
+	};
+	struct kvm_vcpu *vcpu;
+	cpumask_var_t cpus;
+	unsigned long i;
+	int cpu;
+
+	if (!zalloc_cpumask_var(&cpus, GFP_KERNEL)) {
+		kvm_for_each_vcpu(i, vcpu, kvm)
+			tdx_flush_vp_on_cpu(vcpu);
+		return;
+	}
+
+	kvm_for_each_vcpu(i, vcpu, kvm) {
+		cpu = READ_ONCE(to_tdx(vcpu)->assoc_cpu);
+		if (cpu != -1)
+			cpumask_set_cpu(cpu, cpus);
+	}
+	on_each_cpu_mask(cpus, tdx_flush_vps_local, &arg, true);
+	free_cpumask_var(cpus);
+
+	if (WARN_ON_ONCE(atomic64_read(&arg.err)))
+		kvm_pr_tdx_error(kvm, TDH_VP_FLUSH, atomic64_read(&arg.err), NULL);
+}
+
 void tdx_hardware_disable(void)
 {
 	int cpu = raw_smp_processor_id();
@@ -543,108 +1166,219 @@ static int tdx_do_tdh_phymem_cache_wb(void *param)
 	return 0;
 }
 
+struct tdx_pkg_work {
+	struct work_struct work;
+	int (*fn)(void *param);
+	void *param;
+	int ret;
+};
+
+static void tdx_pkg_workfn(struct work_struct *work)
+{
+	struct tdx_pkg_work *pw = container_of(work, struct tdx_pkg_work, work);
+	int pkg = topology_logical_package_id(smp_processor_id());
+
+	mutex_lock(&tdx_mng_key_config_lock[pkg]);
+	pw->ret = pw->fn(pw->param);
+	mutex_unlock(&tdx_mng_key_config_lock[pkg]);
+}
+
+/*
+ * Run @fn on one online CPU of each package in parallel, under the lock of the
+ * package, and return the first error.  The caller must hold cpus_read_lock().
+ */
+static int tdx_on_each_package(int (*fn)(void *param), void *param)
+{
+	struct tdx_pkg_work *works;
+	cpumask_var_t packages;
+	int max_pkgs, pkg, cpu;
+	int ret = 0;
+
+	lockdep_assert_cpus_held();
+
+	max_pkgs = topology_max_packages();
+	works = kcalloc(max_pkgs, sizeof(*works), GFP_KERNEL);
+	if (!works)
+		return -ENOMEM;
+	if (!zalloc_cpumask_var(&packages, GFP_KERNEL)) {
+		kfree(works);
+		return -ENOMEM;
+	}
+
+	for_each_online_cpu(cpu) {
+		pkg = topology_logical_package_id(cpu);
+		if (cpumask_test_and_set_cpu(pkg, packages))
+			continue;
+
+		INIT_WORK(&works[pkg].work, tdx_pkg_workfn);
+		works[pkg].fn = fn;
+		works[pkg].param = param;
+		queue_work_on(cpu, system_highpri_wq, &works[pkg].work);
+	}
+	for (pkg = 0; pkg < max_pkgs; pkg++) {
+		if (!cpumask_test_cpu(pkg, packages))
+			continue;
+
+		flush_work(&works[pkg].work);
+		if (works[pkg].ret && !ret)
+			ret = works[pkg].ret;
+	}
+
+	free_cpumask_var(packages);
+	kfree(works);
+	return ret;
+}
+
+/*
+ * TDH.PHYMEM.CACHE.WB writes back the cache of all the HKIDs whose TDs have
+ * done TDH.MNG.VPFLUSHDONE, not only the HKID of the TD being destroyed.  An
+ * epoch of writebacks on all packages that starts after VPFLUSHDONE covers the
+ * TD.  Let TDs destroyed concurrently share one epoch, which is started only
+ * if no epoch started after the caller's VPFLUSHDONE has completed yet.
+ */
+static DEFINE_MUTEX(tdx_cache_wb_lock);
+static u64 tdx_cache_wb_started;
+static u64 tdx_cache_wb_done;
+
+static int __tdx_cache_wb_all_packages(void)
+{
+	int ret;
+
+	/*
+	 * Issue the writebacks on all packages in parallel.  tdx_kot_lock is
+	 * held for write to avoid TDX_OPERAND_BUSY with the other SEAMCALLs
+	 * taking the TDX module global lock, e.g. TDH.MNG.CREATE and
+	 * TDH.MNG.KEY.FREEID.  The writeback on a package is serialized with
+	 * TDH.MNG.KEY.CONFIG on it by the per-package lock.
+	 */
+	cpus_read_lock();
+	down_write(&tdx_kot_lock);
+	ret = tdx_on_each_package(tdx_do_tdh_phymem_cache_wb, NULL);
+	up_write(&tdx_kot_lock);
+	cpus_read_unlock();
+
+	return ret;
+}
+
+static int tdx_cache_wb_all_packages(void)
+{
+	/* Any epoch after the current one starts after VPFLUSHDONE. */
+	u64 target = READ_ONCE(tdx_cache_wb_started) + 1;
+	int ret = 0;
+
+	mutex_lock(&tdx_cache_wb_lock);
+	if (tdx_cache_wb_done < target) {
+		u64 epoch = ++tdx_cache_wb_started;
+
+		ret = __tdx_cache_wb_all_packages();
+		if (!ret)
+			tdx_cache_wb_done = epoch;
+	}
+	mutex_unlock(&tdx_cache_wb_lock);
+
+	return ret;
+}
+
 void tdx_mmu_release_hkid(struct kvm *kvm)
 {
 	struct kvm_tdx *kvm_tdx = to_kvm_tdx(kvm);
-	cpumask_var_t packages;
-	bool cpumask_allocated;
 	struct kvm_vcpu *vcpu;
 	unsigned long j;
 	u64 err;
 	int ret;
-	int i;
 
+	/*
+	 * The TD's own lock orders TDH.MNG.VPFLUSHDONE, the cache writeback and
+	 * TDH.MNG.KEY.FREEID of this TD.  Other TDs release their HKIDs in
+	 * parallel.
+	 */
+	mutex_lock(&kvm_tdx->hkid_lock);
 	if (!is_hkid_assigned(kvm_tdx))
-		return;
+		goto out;
 
 	if (!is_td_created(kvm_tdx))
 		goto free_hkid;
 
+	tdx_hkid_start_reclaim(kvm_tdx);
+
 	kvm_for_each_vcpu(j, vcpu, kvm)
 		tdx_flush_vp_on_cpu(vcpu);
 
-	mutex_lock(&tdx_lock);
+	down_read(&tdx_kot_lock);
 	err = tdh_mng_vpflushdone(kvm_tdx->tdr_pa);
-	mutex_unlock(&tdx_lock);
+	up_read(&tdx_kot_lock);
 	if (WARN_ON_ONCE(err)) {
-		pr_tdx_error(TDH_MNG_VPFLUSHDONE, err, NULL);
+		kvm_pr_tdx_error(kvm, TDH_MNG_VPFLUSHDONE, err, NULL);
 		pr_err("tdh_mng_vpflushdone failed. HKID %d is leaked.\n",
 			kvm_tdx->hkid);
-		return;
+		goto leak;
 	}
 
-	cpumask_allocated = zalloc_cpumask_var(&packages, GFP_KERNEL);
-	cpus_read_lock();
-	for_each_online_cpu(i) {
-		if (cpumask_allocated &&
-			cpumask_test_and_set_cpu(topology_physical_package_id(i),
-						packages))
-			continue;
-
-		/*
-		 * We can destroy multiple the guest TDs simultaneously.
-		 * Prevent tdh_phymem_cache_wb from returning TDX_BUSY by
-		 * serialization.
-		 */
-		mutex_lock(&tdx_lock);
-		ret = smp_call_on_cpu(i, tdx_do_tdh_phymem_cache_wb, NULL, 1);
-		mutex_unlock(&tdx_lock);
-		if (ret)
-			break;
+	ret = tdx_cache_wb_all_packages();
+	if (ret) {
+		pr_err("tdh_phymem_cache_wb failed. HKID %d is leaked.\n",
+			kvm_tdx->hkid);
+		goto leak;
 	}
-	cpus_read_unlock();
-	free_cpumask_var(packages);
 
-	mutex_lock(&tdx_lock);
+	down_read(&tdx_kot_lock);
 	err = tdh_mng_key_freeid(kvm_tdx->tdr_pa);
-	mutex_unlock(&tdx_lock);
+	up_read(&tdx_kot_lock);
 	if (WARN_ON_ONCE(err)) {
-		pr_tdx_error(TDH_MNG_KEY_FREEID, err, NULL);
+		kvm_pr_tdx_error(kvm, TDH_MNG_KEY_FREEID, err, NULL);
 		pr_err("tdh_mng_key_freeid failed. HKID %d is leaked.\n",
 			kvm_tdx->hkid);
-		return;
+		goto leak;
 	} else
 		atomic_dec(&nr_configured_hkid);
 
 free_hkid:
 	tdx_hkid_free(kvm_tdx);
+out:
+	mutex_unlock(&kvm_tdx->hkid_lock);
+	return;
+
+leak:
+	tdx_hkid_end_reclaim(kvm_tdx);
+	mutex_unlock(&kvm_tdx->hkid_lock);
 }
 
 static void tdx_binding_slots_cleanup(struct kvm_tdx *kvm_tdx)
 {
 	struct tdx_binding_slot *slot;
 	struct kvm_tdx *servtd_tdx;
-	uint16_t req_id;
+	bool bound = false;
+	unsigned long idx;
 	int i;
 
+	mutex_lock(&tdx_servtd_binding_lock);
+
 	/* Being a user TD, disconnect from the related servtds */
 	for (i = 0; i < KVM_TDX_SERVTD_TYPE_MAX; i++) {
 		slot = &kvm_tdx->binding_slots[i];
 		servtd_tdx = slot->servtd_tdx;
 		if (!servtd_tdx)
 			continue;
-		spin_lock(&servtd_tdx->binding_slot_lock);
-		req_id = slot->req_id;
+
 		/*
 		 * Sanity check: servtd should have the slot pointer
 		 * to this slot.
 		 */
-		if (servtd_tdx->usertd_binding_slots[req_id] != slot) {
-			pr_err("%s: unexpected slot %d pointer\n",
-				__func__, i);
-				continue;
-		}
-		servtd_tdx->usertd_binding_slots[req_id] = NULL;
-		spin_unlock(&servtd_tdx->binding_slot_lock);
+		if (xa_cmpxchg(&servtd_tdx->usertd_binding_slots, slot->req_id,
+			       slot, NULL, 0) != slot)
+			pr_err("%s: unexpected slot %d pointer\n", __func__, i);
+		/*
+		 * The servtd outlives the slot, take its doorbell off the bus.
+		 * No-op if the servtd's buses are already gone with it.
+		 */
+		tdx_servtd_doorbell_replace(&servtd_tdx->kvm,
+					    &slot->servtd_doorbell, NULL);
+		slot->servtd_tdx = NULL;
+		bound = true;
 	}
 
 	/* Being a service TD, disconnect from the related user TDs */
-	spin_lock(&kvm_tdx->binding_slot_lock);
-	for (i = 0; i < SERVTD_SLOTS_MAX; i++) {
-		slot = kvm_tdx->usertd_binding_slots[i];
-		if (!slot)
-			continue;
-
+	xa_for_each(&kvm_tdx->usertd_binding_slots, idx, slot) {
 		/*
 		 * Only need to NULL the servtd_tdx field. Other fileds are
 		 * still valid for later migration process to reference, e.g.
@@ -659,8 +1393,20 @@ static void tdx_binding_slots_cleanup(struct kvm_tdx *kvm_tdx)
 		 * destination.
 		 */
 		slot->servtd_tdx = NULL;
+		/* Freed with the MMIO bus of this servtd. */
+		slot->servtd_doorbell = NULL;
+		bound = true;
 	}
-	spin_unlock(&kvm_tdx->binding_slot_lock);
+	xa_destroy(&kvm_tdx->usertd_binding_slots);
+
+	mutex_unlock(&tdx_servtd_binding_lock);
+
+	/*
+	 * The servtds may still be looking at the slots of this user TD, or the
+	 * user TDs ringing the doorbell of this servtd.
+	 */
+	if (bound)
+		synchronize_rcu();
 }
 
 static void tdx_vm_free_tdcs(struct kvm_tdx *kvm_tdx)
@@ -709,11 +1455,16 @@ void __tdx_vm_free(struct kvm *kvm)
 {
 	struct kvm_tdx *kvm_tdx = to_kvm_tdx(kvm);
 
+	/* The kvm_tdx is freed even if teardown failed, unbind it. */
+	tdx_binding_slots_cleanup(kvm_tdx);
+
 	/* Can't reclaim or free TD pages if teardown failed. */
 	if (is_hkid_assigned(kvm_tdx))
 		return;
 
-	tdx_binding_slots_cleanup(kvm_tdx);
+	/* The TDR is reclaimed last. */
+	tdx_reclaim_batch_drain(kvm_tdx);
+
 	tdx_mig_state_destroy(kvm_tdx);
 
 	tdx_vm_free_tdcs(kvm_tdx);
@@ -725,23 +1476,30 @@ void __tdx_vm_free(struct kvm *kvm)
 
 void tdx_vm_free(struct kvm *kvm)
 {
+	struct tdx_vm_stat *stat = &to_kvm_tdx(kvm)->stat;
+
+	kvfree(to_kvm_tdx(kvm)->debug_mem_buf);
+	vfree(to_kvm_tdx(kvm)->event_ring);
 	__tdx_vm_free(kvm);
-#ifdef CONFIG_KVM_TDX_ACCOUNT_PRIVATE_PAGES
-	if (WARN_ON_ONCE(atomic64_read(&to_kvm_tdx(kvm)->ctl_pages) ||
-			 atomic64_read(&to_kvm_tdx(kvm)->sept_pages[PG_LEVEL_512G - PG_LEVEL_4K]) ||
-			 atomic64_read(&to_kvm_tdx(kvm)->sept_pages[PG_LEVEL_1G - PG_LEVEL_4K]) ||
-			 atomic64_read(&to_kvm_tdx(kvm)->sept_pages[PG_LEVEL_2M - PG_LEVEL_4K]) ||
-			 atomic64_read(&to_kvm_tdx(kvm)->sept_pages[PG_LEVEL_4K - PG_LEVEL_4K]) ||
-			 atomic64_read(&to_kvm_tdx(kvm)->td_pages))) {
-		pr_warn_ratelimited("control %lld sept 512G %lld 1G %lld 2M %lld 4K %lld td %lld pages are left\n",
-				    atomic64_read(&to_kvm_tdx(kvm)->ctl_pages),
-				    atomic64_read(&to_kvm_tdx(kvm)->sept_pages[PG_LEVEL_512G - PG_LEVEL_4K]),
-				    atomic64_read(&to_kvm_tdx(kvm)->sept_pages[PG_LEVEL_1G - PG_LEVEL_4K]),
-				    atomic64_read(&to_kvm_tdx(kvm)->sept_pages[PG_LEVEL_2M - PG_LEVEL_4K]),
-				    atomic64_read(&to_kvm_tdx(kvm)->sept_pages[PG_LEVEL_4K - PG_LEVEL_4K]),
-				    atomic64_read(&to_kvm_tdx(kvm)->td_pages));
+	tdx_reclaim_worker_destroy(to_kvm_tdx(kvm));
+	if (WARN_ON_ONCE(atomic64_read(&stat->ctl_pages) ||
+			 atomic64_read(&stat->sept_pages_512g) ||
+			 atomic64_read(&stat->sept_pages_1g) ||
+			 atomic64_read(&stat->sept_pages_2m) ||
+			 atomic64_read(&stat->sept_pages_4k) ||
+			 atomic64_read(&stat->private_1g) ||
+			 atomic64_read(&stat->private_2m) ||
+			 atomic64_read(&stat->private_4k))) {
+		pr_warn_ratelimited("control %lld sept 512G %lld 1G %lld 2M %lld 4K %lld private 1G %lld 2M %lld 4K %lld pages are left\n",
+				    atomic64_read(&stat->ctl_pages),
+				    atomic64_read(&stat->sept_pages_512g),
+				    atomic64_read(&stat->sept_pages_1g),
+				    atomic64_read(&stat->sept_pages_2m),
+				    atomic64_read(&stat->sept_pages_4k),
+				    atomic64_read(&stat->private_1g),
+				    atomic64_read(&stat->private_2m),
+				    atomic64_read(&stat->private_4k));
 	}
-#endif
 }
 
 static int tdx_do_tdh_mng_key_config(void *param)
@@ -788,6 +1546,11 @@ int tdx_vm_init(struct kvm *kvm)
 	kvm->arch.tdp_max_page_level = PG_LEVEL_2M;
 
 	smp_store_release(&kvm_tdx->has_range_blocked, false);
+	spin_lock_init(&kvm_tdx->track_lock);
+	spin_lock_init(&kvm_tdx->reclaim_lock);
+	mutex_init(&kvm_tdx->hkid_lock);
+	mutex_init(&kvm_tdx->vp_init_lock);
+	mutex_init(&kvm_tdx->debug_mem_lock);
 
 	/*
 	 * This function initializes only KVM software construct.  It doesn't
@@ -801,8 +1564,8 @@ int tdx_vm_init(struct kvm *kvm)
 	 */
 	kvm->max_vcpus = min(kvm->max_vcpus, TDX_MAX_VCPUS);
 
-	spin_lock_init(&kvm_tdx->binding_slot_lock);
-	return 0;
+	xa_init_flags(&kvm_tdx->usertd_binding_slots, XA_FLAGS_ALLOC);
+	return tdx_reclaim_worker_create(kvm_tdx);
 }
 
 u8 tdx_get_mt_mask(struct kvm_vcpu *vcpu, gfn_t gfn, bool is_mmio)
@@ -837,6 +1600,11 @@ int tdx_vcpu_create(struct kvm_vcpu *vcpu)
 	fpstate_set_confidential(&vcpu->arch.guest_fpu);
 	vcpu->arch.apic->guest_apic_protected = true;
 	INIT_LIST_HEAD(&tdx->pi_wakeup_list);
+	tdx->assoc_cpu = -1;
+	kvm_gpc_init(&tdx->servbuf_gpc[TDVMCALL_SERVBUF_CMD], vcpu->kvm, vcpu,
+		     KVM_HOST_USES_PFN);
+	kvm_gpc_init(&tdx->servbuf_gpc[TDVMCALL_SERVBUF_RESP], vcpu->kvm, vcpu,
+		     KVM_HOST_USES_PFN);
 
 	vcpu->arch.efer = EFER_SCE | EFER_LME | EFER_LMA | EFER_NX;
 
@@ -868,7 +1636,7 @@ int tdx_vcpu_check_cpuid(struct kvm_vcpu *vcpu, struct kvm_cpuid_entry2 *e2, int
 {
 	struct kvm_tdx *kvm_tdx = to_kvm_tdx(vcpu->kvm);
 	const struct tdsysinfo_struct *tdsysinfo;
-	int i;
+	int i, j = 0;
 
 	tdsysinfo = tdx_get_sysinfo();
 	if (!tdsysinfo)
@@ -878,16 +1646,24 @@ int tdx_vcpu_check_cpuid(struct kvm_vcpu *vcpu, struct kvm_cpuid_entry2 *e2, int
 	 * Simple check that new cpuid is consistent with created one.
 	 * For simplicity, only trivial check.  Don't try comprehensive checks
 	 * with the cpuid virtualization table in the TDX module spec.
+	 *
+	 * kvm_tdx->cpuid is in the order of the CPUID configs, see
+	 * setup_tdparams_cpuids(), walk it along instead of searching it for
+	 * each config of each vCPU.
 	 */
 	for (i = 0; i < tdsysinfo->num_cpuid_config; i++) {
 		const struct tdx_cpuid_config *config = &tdsysinfo->cpuid_configs[i];
 		u32 index = config->sub_leaf == TDX_CPUID_NO_SUBLEAF ? 0 : config->sub_leaf;
-		const struct kvm_cpuid_entry2 *old =
-			kvm_find_cpuid_entry2(kvm_tdx->cpuid, kvm_tdx->cpuid_nent,
-					      config->leaf, index);
+		const struct kvm_cpuid_entry2 *old = NULL;
 		const struct kvm_cpuid_entry2 *new = kvm_find_cpuid_entry2(e2, nent,
 									   config->leaf, index);
 
+		if (j < kvm_tdx->cpuid_nent)
+			old = kvm_find_cpuid_entry2(&kvm_tdx->cpuid[j], 1,
+						    config->leaf, index);
+		if (old)
+			j++;
+
 		if (!!old != !!new)
 			return -EINVAL;
 		if (!old && !new)
@@ -904,27 +1680,45 @@ int tdx_vcpu_check_cpuid(struct kvm_vcpu *vcpu, struct kvm_cpuid_entry2 *e2, int
 
 static void tdx_add_vcpu_association(struct vcpu_tdx *tdx, int cpu)
 {
-	local_irq_disable();
+	unsigned long flags;
+
+	local_irq_save(flags);
 	/*
 	 * Pairs with the smp_wmb() in tdx_disassociate_vp() to ensure
-	 * vcpu->cpu is read before tdx->cpu_list.
+	 * assoc_cpu is read before tdx->cpu_list.
 	 */
 	smp_rmb();
 
 	list_add(&tdx->cpu_list, &per_cpu(associated_tdvcpus, cpu));
-	local_irq_enable();
+	WRITE_ONCE(tdx->assoc_cpu, cpu);
+	local_irq_restore(flags);
+}
+
+void tdx_associate_vp(struct vcpu_tdx *tdx)
+{
+	lockdep_assert_preemption_disabled();
+
+	/* tdx_vcpu_load() flushes the VP from the CPU it was running on. */
+	if (WARN_ON_ONCE(tdx->assoc_cpu != -1))
+		return;
+
+	tdx_add_vcpu_association(tdx, raw_smp_processor_id());
 }
 
+/*
+ * Flush the VP only from the CPU that has it associated.  The new CPU takes
+ * it on its first SEAMCALL, so a vCPU thread moved again before that, e.g.
+ * woken from halt and blocking again, costs no IPI nor TDH.VP.FLUSH.
+ */
 void tdx_vcpu_load(struct kvm_vcpu *vcpu, int cpu)
 {
 	struct vcpu_tdx *tdx = to_tdx(vcpu);
 
 	vmx_vcpu_pi_load(vcpu, cpu);
-	if (vcpu->cpu == cpu)
+	if (tdx->assoc_cpu == cpu || tdx->assoc_cpu == -1)
 		return;
 
 	tdx_flush_vp_on_cpu(vcpu);
-	tdx_add_vcpu_association(tdx, cpu);
 }
 
 bool tdx_protected_apic_has_interrupt(struct kvm_vcpu *vcpu)
@@ -954,17 +1748,29 @@ bool tdx_protected_apic_has_interrupt(struct kvm_vcpu *vcpu)
 	 *    matter)
 	 * - It forwards the TDExit nevertheless, to a clueless hypervisor that
 	 *   has no way to glean either RVI or PPR.
+	 *
+	 * Only interrupts posted before the last TD entry or during the run
+	 * that ended with the HLT can be in RVI like this, see
+	 * tdx_vcpu_run().  Older ones either were delivered in that run or
+	 * stay pending behind EFLAGS.IF=0 and are reported by the query below,
+	 * so they don't cost a spurious TD entry.
 	 */
-	if (xchg(&tdx->buggy_hlt_workaround, 0))
+	if (xchg(&tdx->buggy_hlt_entry, 0) |
+	    xchg(&tdx->buggy_hlt_workaround, 0))
 		return true;
 
 	/*
 	 * This is needed for device assignment. Interrupts can arrive from
 	 * the assigned devices.  Because tdx.buggy_hlt_workaround can't be set
-	 * by VMM, use TDX SEAMCALL to query pending interrupts.
+	 * by VMM, use TDX SEAMCALL to query pending interrupts.  Query once per
+	 * TD exit, halt-polling checks this repeatedly while RVI can't change.
 	 */
-	details.full = td_state_non_arch_read64(tdx, TD_VCPU_STATE_DETAILS_NON_ARCH);
-	return !!details.vmxip;
+	if (!tdx->vmxip_valid) {
+		details.full = td_state_non_arch_read64(tdx, TD_VCPU_STATE_DETAILS_NON_ARCH);
+		tdx->vmxip = details.vmxip;
+		tdx->vmxip_valid = true;
+	}
+	return tdx->vmxip;
 }
 
 void tdx_prepare_switch_to_guest(struct kvm_vcpu *vcpu)
@@ -1044,14 +1850,18 @@ void tdx_vcpu_free(struct kvm_vcpu *vcpu)
 	struct vcpu_tdx *tdx = to_tdx(vcpu);
 
 	/*
-	 * When destroying VM, kvm_unload_vcpu_mmu() calls vcpu_load() for every
-	 * vcpu after they already disassociated from the per cpu list by
-	 * tdx_mmu_release_hkid().  So we need to disassociate them again,
-	 * otherwise the freed vcpu data will be accessed when do
-	 * list_{del,add}() on associated_tdvcpus list later.
+	 * When destroying VM, kvm_unload_vcpu_mmu() loads every vcpu after
+	 * they already disassociated from the per cpu list by
+	 * tdx_mmu_release_hkid(), and a SEAMCALL on the vcpu associates it
+	 * again.  So we need to disassociate them again, otherwise the freed
+	 * vcpu data will be accessed when do list_{del,add}() on
+	 * associated_tdvcpus list later.
 	 */
 	tdx_disassociate_vp_on_cpu(vcpu);
-	WARN_ON_ONCE(vcpu->cpu != -1);
+	WARN_ON_ONCE(tdx->assoc_cpu != -1);
+
+	kvm_gpc_deactivate(&tdx->servbuf_gpc[TDVMCALL_SERVBUF_CMD]);
+	kvm_gpc_deactivate(&tdx->servbuf_gpc[TDVMCALL_SERVBUF_RESP]);
 
 	/*
 	 * This methods can be called when vcpu allocation/initialization
@@ -1154,6 +1964,26 @@ static void tdx_restore_host_xsave_state(struct kvm_vcpu *vcpu)
 		write_pkru(vcpu->arch.host_pkru);
 }
 
+#define TDX_DEBUG_DIRTY_RFLAGS		BIT(0)
+#define TDX_DEBUG_DIRTY_DR7		BIT(1)
+#define TDX_DEBUG_DIRTY_EXCEPTION_BITMAP	BIT(2)
+
+/*
+ * Single stepping and breakpoints of a debug TD update RFLAGS.TF, DR7 and the
+ * exception bitmap a few times per TD exit, each a TDH.VP.WR.  Write them back
+ * once, right before the TD entry.
+ */
+static void tdx_flush_debug_state(struct vcpu_tdx *tdx)
+{
+	if (tdx->debug_dirty & TDX_DEBUG_DIRTY_RFLAGS)
+		td_vmcs_write64(tdx, GUEST_RFLAGS, tdx->rflags);
+	if (tdx->debug_dirty & TDX_DEBUG_DIRTY_DR7)
+		td_vmcs_write64(tdx, GUEST_DR7, tdx->dr7);
+	if (tdx->debug_dirty & TDX_DEBUG_DIRTY_EXCEPTION_BITMAP)
+		td_vmcs_write32(tdx, EXCEPTION_BITMAP, tdx->exception_bitmap);
+	tdx->debug_dirty = 0;
+}
+
 static void tdx_reset_regs_cache(struct kvm_vcpu *vcpu)
 {
 	vcpu->arch.regs_avail = 0;
@@ -1209,86 +2039,505 @@ static void tdx_switch_perf_msrs(struct kvm_vcpu *vcpu)
 			}
 			break;
 
-		default:
-			WARN_ONCE(1, "Cannot switch msrs other than IA32_PERF_GLOBAL_CTRL");
-		}
+		default:
+			WARN_ONCE(1, "Cannot switch msrs other than IA32_PERF_GLOBAL_CTRL");
+		}
+	}
+}
+
+static noinstr void tdx_vcpu_enter_exit(struct vcpu_tdx *tdx)
+{
+	u64 err, retries = 0;
+
+	/*
+	 * Avoid section mismatch with to_tdx() with KVM_VM_BUG().  The caller
+	 * should call to_tdx().
+	 */
+	struct kvm_vcpu *vcpu = &tdx->vcpu;
+
+	guest_state_enter_irqoff();
+
+	/*
+	 * struct tdx_module_args and struct kvm_vcpu_arch::args must be same
+	 * layout to use __seamcall_saved_ret().
+	 */
+#define WORD_SIZE	(BITS_PER_LONG / 8)
+#define BUG_ON_ARG_OFFSET(arg_reg, vcpu_reg)				\
+	BUILD_BUG_ON(offsetof(struct tdx_module_args, arg_reg) !=	\
+		     VCPU_REGS_ ## vcpu_reg * WORD_SIZE);
+
+	BUG_ON_ARG_OFFSET(rax_unused, RAX);
+	BUG_ON_ARG_OFFSET(rcx, RCX);
+	BUG_ON_ARG_OFFSET(rdx, RDX);
+	BUG_ON_ARG_OFFSET(rbx, RBX);
+	BUG_ON_ARG_OFFSET(rsp_unused, RSP);
+	BUG_ON_ARG_OFFSET(rbp_unused, RBP);
+	BUG_ON_ARG_OFFSET(rsi, RSI);
+	BUG_ON_ARG_OFFSET(rdi, RDI);
+	BUG_ON_ARG_OFFSET(r8, R8);
+	BUG_ON_ARG_OFFSET(r9, R9);
+	BUG_ON_ARG_OFFSET(r10, R10);
+	BUG_ON_ARG_OFFSET(r11, R11);
+	BUG_ON_ARG_OFFSET(r12, R12);
+	BUG_ON_ARG_OFFSET(r13, R13);
+	BUG_ON_ARG_OFFSET(r14, R14);
+	BUG_ON_ARG_OFFSET(r15, R15);
+
+#undef BUG_ON_ARG_OFFSET
+#undef WORD_SIZE
+
+	/*
+	 * The TDX module takes the GPRs from the VMM only when resuming the TD
+	 * from TDG.VP.VMCALL, i.e. tdvmcall.regs_mask != 0.  Otherwise only
+	 * RCX(TDVPR) is input, skip loading the rest.  The outputs are always
+	 * stored because the next exit can be TDG.VP.VMCALL.
+	 */
+	vcpu->arch.regs[VCPU_REGS_RCX] = tdx->tdvpr_pa;
+	do {
+		if (tdx->tdvmcall.regs_mask)
+			tdx->exit_reason.full = __seamcall_saved_ret(TDH_VP_ENTER,
+								     (struct tdx_module_args*)vcpu->arch.regs);
+		else
+			tdx->exit_reason.full = __seamcall_saved_out_ret(TDH_VP_ENTER,
+									 (struct tdx_module_args*)vcpu->arch.regs);
+		err = seamcall_masked_status(tdx->exit_reason.full);
+		if (retries++ > TDX_SEAMCALL_RETRY_MAX) {
+			KVM_BUG_ON(err, vcpu->kvm);
+			pr_tdx_error(TDH_VP_ENTER, err, NULL);
+			break;
+		}
+	} while (err == TDX_OPERAND_BUSY ||
+		 err == TDX_OPERAND_BUSY_HOST_PRIORITY);
+	WARN_ON_ONCE(!kvm_rebooting &&
+		     (tdx->exit_reason.full & TDX_SW_ERROR) == TDX_SW_ERROR);
+
+	if ((u16)tdx->exit_reason.basic == EXIT_REASON_EXCEPTION_NMI &&
+	    is_nmi(tdexit_intr_info(vcpu))) {
+		kvm_before_interrupt(vcpu, KVM_HANDLING_NMI);
+		vmx_do_nmi_irqoff();
+		kvm_after_interrupt(vcpu);
+	}
+	guest_state_exit_irqoff();
+}
+
+/*
+ * Fast path for TDG.VP.VMCALL<#VE.RequestMMIO> writes to wildcard ioeventfds,
+ * e.g. virtio doorbells, and to coalesced MMIO zones, with IRQs disabled.
+ * Other devices on KVM_MMIO_BUS, e.g. IOAPIC, may need to send IPIs and wait,
+ * leave them to tdx_emulate_mmio().
+ */
+static fastpath_t tdx_handle_fastpath_mmio(struct kvm_vcpu *vcpu)
+{
+	fastpath_t ret = EXIT_FASTPATH_NONE;
+	struct kvm_memory_slot *slot;
+	unsigned long val;
+	int size, idx;
+	gpa_t gpa;
+
+	if (tdvmcall_a1_read(vcpu) != 1)
+		return EXIT_FASTPATH_NONE;
+
+	size = tdvmcall_a0_read(vcpu);
+	gpa = tdvmcall_a2_read(vcpu) & ~gfn_to_gpa(kvm_gfn_shared_mask(vcpu->kvm));
+	val = tdvmcall_a3_read(vcpu);
+	if (size != 1 && size != 2 && size != 4 && size != 8)
+		return EXIT_FASTPATH_NONE;
+	if (((gpa + size - 1) ^ gpa) & PAGE_MASK)
+		return EXIT_FASTPATH_NONE;
+
+	idx = srcu_read_lock(&vcpu->kvm->srcu);
+	slot = kvm_vcpu_gfn_to_memslot(vcpu, gpa_to_gfn(gpa));
+	if (slot && !(slot->flags & KVM_MEMSLOT_INVALID))
+		goto out;
+
+	if (!kvm_ioeventfd_signal(vcpu->kvm, KVM_FAST_MMIO_BUS, gpa, 0) ||
+	    !kvm_io_bus_write(vcpu, KVM_FAST_MMIO_BUS, gpa, 0, NULL)) {
+		trace_kvm_fast_mmio(gpa);
+		ret = EXIT_FASTPATH_REENTER_GUEST;
+	} else if (!kvm_ioeventfd_signal(vcpu->kvm, KVM_MMIO_BUS, gpa, size) ||
+		   !kvm_io_bus_write_coalesced(vcpu, KVM_MMIO_BUS, gpa, size,
+					       &val)) {
+		trace_kvm_mmio(KVM_TRACE_MMIO_WRITE, size, gpa, &val);
+		ret = EXIT_FASTPATH_REENTER_GUEST;
+	}
+	if (ret == EXIT_FASTPATH_REENTER_GUEST)
+		tdvmcall_set_return_code(vcpu, TDG_VP_VMCALL_SUCCESS);
+out:
+	srcu_read_unlock(&vcpu->kvm->srcu, idx);
+
+	return ret;
+}
+
+/*
+ * Fast path for TDG.VP.VMCALL<Instruction.IO> writes to coalesced PIO zones,
+ * e.g. of an emulated UART, with IRQs disabled.
+ */
+static fastpath_t tdx_handle_fastpath_io(struct kvm_vcpu *vcpu)
+{
+	fastpath_t ret = EXIT_FASTPATH_NONE;
+	unsigned long val;
+	unsigned int port;
+	int size, idx;
+
+	if (tdvmcall_a1_read(vcpu) != 1)
+		return EXIT_FASTPATH_NONE;
+
+	size = tdvmcall_a0_read(vcpu);
+	port = tdvmcall_a2_read(vcpu);
+	val = tdvmcall_a3_read(vcpu);
+	if (size != 1 && size != 2 && size != 4)
+		return EXIT_FASTPATH_NONE;
+
+	idx = srcu_read_lock(&vcpu->kvm->srcu);
+	if (!kvm_io_bus_write_coalesced(vcpu, KVM_PIO_BUS, port, size, &val)) {
+		++vcpu->stat.io_exits;
+		trace_kvm_pio(KVM_PIO_OUT, port, size, 1, &val);
+		tdvmcall_set_return_code(vcpu, TDG_VP_VMCALL_SUCCESS);
+		ret = EXIT_FASTPATH_REENTER_GUEST;
+	}
+	srcu_read_unlock(&vcpu->kvm->srcu, idx);
+
+	return ret;
+}
+
+/*
+ * Fast path for TDG.VP.VMCALL<HLT> with interrupts enabled in the guest, i.e.
+ * STI; HLT, when an interrupt has been posted but not yet notified to the TD.
+ * Blocking would only wake the vCPU up right away, re-enter the TD instead,
+ * tdx_vcpu_run() sends the notification.  Only the outstanding notification
+ * is checked: an interrupt the TDX module already took into the virtual APIC
+ * may be blocked by PPR, and re-entering for it would spin on HLT.
+ */
+static fastpath_t tdx_handle_fastpath_hlt(struct kvm_vcpu *vcpu)
+{
+	if (tdvmcall_a0_read(vcpu) || !pi_test_on(&to_tdx(vcpu)->pi_desc))
+		return EXIT_FASTPATH_NONE;
+
+	++vcpu->stat.halt_exits;
+	tdvmcall_set_return_code(vcpu, TDG_VP_VMCALL_SUCCESS);
+	return EXIT_FASTPATH_REENTER_GUEST;
+}
+
+/*
+ * Fast path for TDG.VP.VMCALL<Instruction.WRMSR> of the TSC deadline and the
+ * x2APIC ICR, see __handle_fastpath_set_msr_irqoff().
+ */
+static fastpath_t tdx_handle_fastpath_wrmsr(struct kvm_vcpu *vcpu)
+{
+	u32 index = tdvmcall_a0_read(vcpu);
+	fastpath_t ret;
+
+	/* Leave filtered MSRs to tdx_emulate_wrmsr(), for the error path. */
+	if (!kvm_msr_allowed(vcpu, index, KVM_MSR_FILTER_WRITE))
+		return EXIT_FASTPATH_NONE;
+
+	ret = __handle_fastpath_set_msr_irqoff(vcpu, index,
+					       tdvmcall_a1_read(vcpu));
+	if (ret != EXIT_FASTPATH_NONE)
+		tdvmcall_set_return_code(vcpu, TDG_VP_VMCALL_SUCCESS);
+
+	return ret;
+}
+
+/*
+ * Fast path for the KVM_HC_SEND_IPI hypercall, which a TD uses to send an IPI
+ * to a whole cluster of vCPUs with one TD exit instead of one x2APIC ICR write
+ * exit per destination.  Like the ICR fast path, deliver without re-enabling
+ * IRQs and let the caller handle any request for the sending vCPU.
+ */
+static fastpath_t tdx_handle_fastpath_send_ipi(struct kvm_vcpu *vcpu)
+{
+	int ret;
+
+	if (!guest_pv_has(vcpu, KVM_FEATURE_PV_SEND_IPI))
+		return EXIT_FASTPATH_NONE;
+
+	++vcpu->stat.hypercalls;
+	ret = kvm_pv_send_ipi(vcpu->kvm, kvm_r11_read(vcpu), kvm_r12_read(vcpu),
+			      kvm_r13_read(vcpu), kvm_r14_read(vcpu), true);
+	tdvmcall_set_return_code(vcpu, ret);
+
+	return EXIT_FASTPATH_EXIT_HANDLED;
+}
+
+/*
+ * Fast path for the PV spinlock KVM_HC_KICK_CPU and for KVM_HC_SCHED_YIELD.
+ * The directed yield to the lock holder can't be done with IRQs disabled, so
+ * take the fast path only if there is nothing to yield to on this CPU, which
+ * leaves just the kick of the waiter.  No yield is attempted, so
+ * directed_yield_attempted isn't counted.
+ */
+static fastpath_t tdx_handle_fastpath_kick_cpu(struct kvm_vcpu *vcpu,
+					       unsigned long nr)
+{
+	unsigned int feature = nr == KVM_HC_KICK_CPU ? KVM_FEATURE_PV_UNHALT :
+						       KVM_FEATURE_PV_SCHED_YIELD;
+
+	if (!guest_pv_has(vcpu, feature) || !single_task_running())
+		return EXIT_FASTPATH_NONE;
+
+	if (nr == KVM_HC_KICK_CPU)
+		kvm_pv_kick_cpu_op(vcpu->kvm, kvm_r12_read(vcpu));
+	++vcpu->stat.hypercalls;
+	tdvmcall_set_return_code(vcpu, 0);
+
+	return EXIT_FASTPATH_REENTER_GUEST;
+}
+
+static fastpath_t tdx_handle_fastpath_vmcall(struct kvm_vcpu *vcpu)
+{
+	switch (tdvmcall_exit_type(vcpu)) {
+	case 0:
+		break;
+	case KVM_HC_SEND_IPI:
+		return tdx_handle_fastpath_send_ipi(vcpu);
+	case KVM_HC_KICK_CPU:
+	case KVM_HC_SCHED_YIELD:
+		return tdx_handle_fastpath_kick_cpu(vcpu, tdvmcall_exit_type(vcpu));
+	default:
+		return EXIT_FASTPATH_NONE;
+	}
+
+	switch (tdvmcall_leaf(vcpu)) {
+	case EXIT_REASON_HLT:
+		return tdx_handle_fastpath_hlt(vcpu);
+	case EXIT_REASON_EPT_VIOLATION:
+		return tdx_handle_fastpath_mmio(vcpu);
+	case EXIT_REASON_IO_INSTRUCTION:
+		return tdx_handle_fastpath_io(vcpu);
+	case EXIT_REASON_MSR_WRITE:
+		return tdx_handle_fastpath_wrmsr(vcpu);
+	default:
+		return EXIT_FASTPATH_NONE;
+	}
+}
+
+static fastpath_t tdx_exit_handlers_fastpath(struct kvm_vcpu *vcpu)
+{
+	/* Debug TD reads GPRs with SEAMCALL, don't bother. */
+	if (is_debug_td(vcpu))
+		return EXIT_FASTPATH_NONE;
+
+	/* No status bits, e.g. bus lock detected, need to be handled. */
+	switch (to_tdx(vcpu)->exit_reason.full) {
+	case EXIT_REASON_TDCALL:
+		return tdx_handle_fastpath_vmcall(vcpu);
+	default:
+		return EXIT_FASTPATH_NONE;
+	}
+}
+
+static enum tdx_exit_hist_type tdx_exit_hist_type(struct kvm_vcpu *vcpu)
+{
+	union tdx_exit_reason exit_reason = to_tdx(vcpu)->exit_reason;
+
+	if (exit_reason.non_recoverable || exit_reason.error)
+		return TDX_EXIT_HIST_OTHER;
+
+	switch (exit_reason.basic) {
+	case EXIT_REASON_EPT_VIOLATION:
+		return TDX_EXIT_HIST_EPT_VIOLATION;
+	case EXIT_REASON_EXTERNAL_INTERRUPT:
+		return TDX_EXIT_HIST_INTERRUPT;
+	case EXIT_REASON_EXCEPTION_NMI:
+		return TDX_EXIT_HIST_EXCEPTION_NMI;
+	case EXIT_REASON_TDCALL:
+		break;
+	default:
+		return TDX_EXIT_HIST_OTHER;
+	}
+
+	if (tdvmcall_exit_type(vcpu))
+		return TDX_EXIT_HIST_VMCALL_OTHER;
+
+	switch (tdvmcall_leaf(vcpu)) {
+	case EXIT_REASON_CPUID:
+		return TDX_EXIT_HIST_VMCALL_CPUID;
+	case EXIT_REASON_HLT:
+		return TDX_EXIT_HIST_VMCALL_HLT;
+	case EXIT_REASON_IO_INSTRUCTION:
+		return TDX_EXIT_HIST_VMCALL_IO;
+	case EXIT_REASON_EPT_VIOLATION:
+		return TDX_EXIT_HIST_VMCALL_MMIO;
+	case EXIT_REASON_MSR_READ:
+	case EXIT_REASON_MSR_WRITE:
+		return TDX_EXIT_HIST_VMCALL_MSR;
+	case TDG_VP_VMCALL_MAP_GPA:
+		return TDX_EXIT_HIST_VMCALL_MAP_GPA;
+	case TDG_VP_VMCALL_GET_QUOTE:
+		return TDX_EXIT_HIST_VMCALL_GET_QUOTE;
+	case TDG_VP_VMCALL_SERVICE:
+		return TDX_EXIT_HIST_VMCALL_SERVICE;
+	default:
+		return TDX_EXIT_HIST_VMCALL_OTHER;
+	}
+}
+
+/*
+ * Pick the histogram for the TD exit.  The time from the TD exit to the next
+ * TD entry, including the exit to the user space VMM if any, is accounted to
+ * it on the next TD entry.
+ */
+static u64 *tdx_exit_hist(struct kvm_vcpu *vcpu)
+{
+	return to_tdx(vcpu)->stat.exit_hist[tdx_exit_hist_type(vcpu)];
+}
+
+static const char * const tdx_exit_hist_names[TDX_EXIT_NR_HIST] = {
+	[TDX_EXIT_HIST_EPT_VIOLATION] = "ept_violation",
+	[TDX_EXIT_HIST_INTERRUPT] = "interrupt",
+	[TDX_EXIT_HIST_EXCEPTION_NMI] = "exception_nmi",
+	[TDX_EXIT_HIST_VMCALL_CPUID] = "vmcall_cpuid",
+	[TDX_EXIT_HIST_VMCALL_HLT] = "vmcall_hlt",
+	[TDX_EXIT_HIST_VMCALL_IO] = "vmcall_io",
+	[TDX_EXIT_HIST_VMCALL_MMIO] = "vmcall_mmio",
+	[TDX_EXIT_HIST_VMCALL_MSR] = "vmcall_msr",
+	[TDX_EXIT_HIST_VMCALL_MAP_GPA] = "vmcall_map_gpa",
+	[TDX_EXIT_HIST_VMCALL_GET_QUOTE] = "vmcall_get_quote",
+	[TDX_EXIT_HIST_VMCALL_SERVICE] = "vmcall_service",
+	[TDX_EXIT_HIST_VMCALL_OTHER] = "vmcall_other",
+	[TDX_EXIT_HIST_OTHER] = "other",
+};
+
+/*
+ * One "name value" line per statistic.  A histogram is one line of its
+ * TDX_EXIT_HIST_COUNT buckets, bucket i counting the values in [2^(i-1), 2^i).
+ */
+static int tdx_vcpu_stats_show(struct seq_file *m, void *v)
+{
+	struct tdx_vcpu_stat *stat = &to_tdx((struct kvm_vcpu *)m->private)->stat;
+	int i, j;
+
+	seq_printf(m, "exit_irq_timer %llu\n", READ_ONCE(stat->exit_irq_timer));
+	seq_printf(m, "exit_irq_ipi %llu\n", READ_ONCE(stat->exit_irq_ipi));
+	seq_printf(m, "exit_irq_posted %llu\n", READ_ONCE(stat->exit_irq_posted));
+	seq_printf(m, "exit_irq_other %llu\n", READ_ONCE(stat->exit_irq_other));
+	for (i = 0; i < TDX_EXIT_NR_HIST; i++) {
+		seq_printf(m, "exit_%s_hist", tdx_exit_hist_names[i]);
+		for (j = 0; j < TDX_EXIT_HIST_COUNT; j++)
+			seq_printf(m, " %llu", READ_ONCE(stat->exit_hist[i][j]));
+		seq_putc(m, '\n');
 	}
+	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(tdx_vcpu_stats);
 
-static noinstr void tdx_vcpu_enter_exit(struct vcpu_tdx *tdx)
+void tdx_vcpu_create_debugfs(struct kvm_vcpu *vcpu, struct dentry *dentry)
 {
-	u64 err, retries = 0;
+	debugfs_create_file("tdx_stats", 0444, dentry, vcpu,
+			    &tdx_vcpu_stats_fops);
+}
 
-	/*
-	 * Avoid section mismatch with to_tdx() with KVM_VM_BUG().  The caller
-	 * should call to_tdx().
-	 */
-	struct kvm_vcpu *vcpu = &tdx->vcpu;
+static enum tdx_seamcall_stat_leaf tdx_seamcall_stat_leaf(u64 op)
+{
+	switch (op & 0xFFFF) {
+	case TDH_VP_ENTER:
+		return TDX_SEAMCALL_STAT_VP_ENTER;
+	case TDH_MEM_RANGE_UNBLOCK:
+		return TDX_SEAMCALL_STAT_MEM_RANGE_UNBLOCK;
+	case TDH_EXPORT_BLOCKW:
+		return TDX_SEAMCALL_STAT_EXPORT_BLOCKW;
+	case TDH_EXPORT_UNBLOCKW:
+		return TDX_SEAMCALL_STAT_EXPORT_UNBLOCKW;
+	case TDH_EXPORT_MEM:
+		return TDX_SEAMCALL_STAT_EXPORT_MEM;
+	case TDH_IMPORT_MEM:
+		return TDX_SEAMCALL_STAT_IMPORT_MEM;
+	default:
+		return TDX_SEAMCALL_STAT_OTHER;
+	}
+}
 
-	guest_state_enter_irqoff();
+/*
+ * Count the SEAMCALL @op of the TD @kvm failed with @error_code, by the leaf
+ * of @op and the class of @error_code, in the TDX stats of @kvm.  Busy
+ * and retried outcomes are counted as well as the ones KVM gives up on, so
+ * that the contention shows before it ends up in KVM_BUG_ON().
+ */
+void tdx_seamcall_stat(struct kvm *kvm, u64 op, u64 error_code)
+{
+	struct tdx_vm_stat *vm_stat = &to_kvm_tdx(kvm)->stat;
+	atomic64_t *stat;
 
-	/*
-	 * struct tdx_module_args and struct kvm_vcpu_arch::args must be same
-	 * layout to use __seamcall_saved_ret().
-	 */
-#define WORD_SIZE	(BITS_PER_LONG / 8)
-#define BUG_ON_ARG_OFFSET(arg_reg, vcpu_reg)				\
-	BUILD_BUG_ON(offsetof(struct tdx_module_args, arg_reg) !=	\
-		     VCPU_REGS_ ## vcpu_reg * WORD_SIZE);
+	switch (seamcall_masked_status(error_code)) {
+	case TDX_SUCCESS:
+		return;
+	case TDX_OPERAND_BUSY:
+	case TDX_OPERAND_BUSY_HOST_PRIORITY:
+		stat = vm_stat->seamcall_busy;
+		break;
+	case TDX_TLB_TRACKING_NOT_DONE:
+		stat = vm_stat->seamcall_tlb_not_done;
+		break;
+	case TDX_INTERRUPTED_RESUMABLE:
+		stat = vm_stat->seamcall_interrupted;
+		break;
+	default:
+		stat = vm_stat->seamcall_error;
+		break;
+	}
 
-	BUG_ON_ARG_OFFSET(rax_unused, RAX);
-	BUG_ON_ARG_OFFSET(rcx, RCX);
-	BUG_ON_ARG_OFFSET(rdx, RDX);
-	BUG_ON_ARG_OFFSET(rbx, RBX);
-	BUG_ON_ARG_OFFSET(rsp_unused, RSP);
-	BUG_ON_ARG_OFFSET(rbp_unused, RBP);
-	BUG_ON_ARG_OFFSET(rsi, RSI);
-	BUG_ON_ARG_OFFSET(rdi, RDI);
-	BUG_ON_ARG_OFFSET(r8, R8);
-	BUG_ON_ARG_OFFSET(r9, R9);
-	BUG_ON_ARG_OFFSET(r10, R10);
-	BUG_ON_ARG_OFFSET(r11, R11);
-	BUG_ON_ARG_OFFSET(r12, R12);
-	BUG_ON_ARG_OFFSET(r13, R13);
-	BUG_ON_ARG_OFFSET(r14, R14);
-	BUG_ON_ARG_OFFSET(r15, R15);
+	atomic64_inc(&stat[tdx_seamcall_stat_leaf(op)]);
+}
 
-#undef BUG_ON_ARG_OFFSET
-#undef WORD_SIZE
+static const char * const tdx_seamcall_stat_names[TDX_SEAMCALL_STAT_LEAVES] = {
+	[TDX_SEAMCALL_STAT_VP_ENTER] = "vp_enter",
+	[TDX_SEAMCALL_STAT_MEM_RANGE_UNBLOCK] = "mem_range_unblock",
+	[TDX_SEAMCALL_STAT_EXPORT_BLOCKW] = "export_blockw",
+	[TDX_SEAMCALL_STAT_EXPORT_UNBLOCKW] = "export_unblockw",
+	[TDX_SEAMCALL_STAT_EXPORT_MEM] = "export_mem",
+	[TDX_SEAMCALL_STAT_IMPORT_MEM] = "import_mem",
+	[TDX_SEAMCALL_STAT_OTHER] = "other",
+};
 
-	/*
-	 * TODO: micro optimization:
-	 * copyin/copyout registers only if (tdx->tdvmvall.regs_mask != 0)
-	 * which means TDG.VP.VMCALL.
-	 */
-	vcpu->arch.regs[VCPU_REGS_RCX] = tdx->tdvpr_pa;
-	do {
-		tdx->exit_reason.full = __seamcall_saved_ret(TDH_VP_ENTER,
-							     (struct tdx_module_args*)vcpu->arch.regs);
-		err = seamcall_masked_status(tdx->exit_reason.full);
-		if (retries++ > TDX_SEAMCALL_RETRY_MAX) {
-			KVM_BUG_ON(err, vcpu->kvm);
-			pr_tdx_error(TDH_VP_ENTER, err, NULL);
-			break;
-		}
-	} while (err == TDX_OPERAND_BUSY ||
-		 err == TDX_OPERAND_BUSY_HOST_PRIORITY);
-	WARN_ON_ONCE(!kvm_rebooting &&
-		     (tdx->exit_reason.full & TDX_SW_ERROR) == TDX_SW_ERROR);
+/*
+ * Like tdx_vcpu_stats_show(), one "name value" line per statistic.  The
+ * SEAMCALL failures are seamcall_<class>_<leaf>, e.g. seamcall_busy_vp_enter.
+ */
+static int tdx_vm_stats_show(struct seq_file *m, void *v)
+{
+	struct tdx_vm_stat *stat = &to_kvm_tdx((struct kvm *)m->private)->stat;
+	int i;
 
-	if ((u16)tdx->exit_reason.basic == EXIT_REASON_EXCEPTION_NMI &&
-	    is_nmi(tdexit_intr_info(vcpu))) {
-		kvm_before_interrupt(vcpu, KVM_HANDLING_NMI);
-		vmx_do_nmi_irqoff();
-		kvm_after_interrupt(vcpu);
+	seq_printf(m, "track_issued %llu\n", READ_ONCE(stat->track_issued));
+	seq_printf(m, "track_coalesced %lld\n",
+		   atomic64_read(&stat->track_coalesced));
+	seq_printf(m, "ctl_pages %lld\n", atomic64_read(&stat->ctl_pages));
+	seq_printf(m, "sept_pages_4k %lld\n", atomic64_read(&stat->sept_pages_4k));
+	seq_printf(m, "sept_pages_2m %lld\n", atomic64_read(&stat->sept_pages_2m));
+	seq_printf(m, "sept_pages_1g %lld\n", atomic64_read(&stat->sept_pages_1g));
+	seq_printf(m, "sept_pages_512g %lld\n",
+		   atomic64_read(&stat->sept_pages_512g));
+	seq_printf(m, "private_4k %lld\n", atomic64_read(&stat->private_4k));
+	seq_printf(m, "private_2m %lld\n", atomic64_read(&stat->private_2m));
+	seq_printf(m, "private_1g %lld\n", atomic64_read(&stat->private_1g));
+	for (i = 0; i < TDX_SEAMCALL_STAT_LEAVES; i++) {
+		const char *leaf = tdx_seamcall_stat_names[i];
+
+		seq_printf(m, "seamcall_busy_%s %lld\n", leaf,
+			   atomic64_read(&stat->seamcall_busy[i]));
+		seq_printf(m, "seamcall_tlb_not_done_%s %lld\n", leaf,
+			   atomic64_read(&stat->seamcall_tlb_not_done[i]));
+		seq_printf(m, "seamcall_interrupted_%s %lld\n", leaf,
+			   atomic64_read(&stat->seamcall_interrupted[i]));
+		seq_printf(m, "seamcall_error_%s %lld\n", leaf,
+			   atomic64_read(&stat->seamcall_error[i]));
 	}
-	guest_state_exit_irqoff();
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(tdx_vm_stats);
+
+void tdx_vm_create_debugfs(struct kvm *kvm)
+{
+	debugfs_create_file("tdx_stats", 0444, kvm->debugfs_dentry, kvm,
+			    &tdx_vm_stats_fops);
 }
 
 fastpath_t tdx_vcpu_run(struct kvm_vcpu *vcpu)
 {
 	struct kvm_tdx *kvm_tdx = to_kvm_tdx(vcpu->kvm);
 	struct vcpu_tdx *tdx = to_tdx(vcpu);
+	fastpath_t ret;
 
 	if (unlikely(!tdx->initialized))
 		return -EINVAL;
@@ -1314,6 +2563,7 @@ fastpath_t tdx_vcpu_run(struct kvm_vcpu *vcpu)
 		 */
 		if (vcpu->guest_debug & KVM_GUESTDBG_SINGLESTEP)
 			tdx_set_interrupt_shadow(vcpu, 0);
+		tdx_flush_debug_state(tdx);
 	}
 
 	/*
@@ -1326,7 +2576,7 @@ fastpath_t tdx_vcpu_run(struct kvm_vcpu *vcpu)
 	if (!(kvm_tdx->attributes & TDX_TD_ATTRIBUTE_PERFMON) &&
 		td_profile_allowed(kvm_tdx))
 		tdx_switch_perf_msrs(vcpu);
-	if (kvm_tdx->attributes & XFEATURE_MASK_LBR)
+	if (kvm_tdx->xfam & XFEATURE_MASK_LBR)
 		intel_pmu_lbr_xsaves();
 
 	/*
@@ -1337,9 +2587,26 @@ fastpath_t tdx_vcpu_run(struct kvm_vcpu *vcpu)
 		/* TODO: use apic_write()=static_call(apic_call_write)() */
 		apic->write(APIC_LVTPC, TDX_GUEST_PMI_VECTOR);
 
+	if (tdx->exit_hist)
+		kvm_stats_log_hist_update(tdx->exit_hist, TDX_EXIT_HIST_COUNT,
+					  ktime_get_ns() - tdx->exit_ns);
+
+	/* Age the interrupts posted so far, see tdx_protected_apic_has_interrupt(). */
+	tdx->buggy_hlt_entry = xchg(&tdx->buggy_hlt_workaround, 0);
+	tdx->vmxip_valid = false;
+
+	tdx_track_vp_association(tdx);
 	tdx_vcpu_enter_exit(tdx);
 
-	tdx_user_return_update_cache(vcpu);
+	tdx->exit_ns = ktime_get_ns();
+	/*
+	 * TDH.VP.ENTER clobbers the user-return MSRs with the same values on
+	 * every exit.  Nothing can restore them in between fastpath re-entries,
+	 * neither a return to user space nor another vCPU on this CPU, as IRQs
+	 * stay disabled, so the cache only needs an update on the first exit.
+	 */
+	if (!tdx->fastpath_reenter)
+		tdx_user_return_update_cache(vcpu);
 
 	/*
 	 * This is safe only when host PMU is disabled, e.g.
@@ -1353,7 +2620,7 @@ fastpath_t tdx_vcpu_run(struct kvm_vcpu *vcpu)
 	tdx_restore_host_xsave_state(vcpu);
 	tdx->host_state_need_restore = true;
 
-	if (kvm_tdx->attributes & XFEATURE_MASK_LBR)
+	if (kvm_tdx->xfam & XFEATURE_MASK_LBR)
 		intel_pmu_lbr_xrstors();
 	/*
 	 * See the comments above for intel_pmu_save() for why
@@ -1372,17 +2639,23 @@ fastpath_t tdx_vcpu_run(struct kvm_vcpu *vcpu)
 		tdx->tdvmcall.rcx = kvm_rcx_read(vcpu);
 	else
 		tdx->tdvmcall.rcx = 0;
+	tdx->exit_hist = tdx_exit_hist(vcpu);
 
 	trace_kvm_exit(vcpu, KVM_ISA_VMX);
 
 	tdx_complete_interrupts(vcpu);
 
-	if (is_debug_td(vcpu))
+	if (is_debug_td(vcpu)) {
 		tdx_reset_regs_cache(vcpu);
-	else
+		/* The TD can write DR7 only without MOV DR exiting. */
+		if (vcpu->arch.switch_db_regs & KVM_DEBUGREG_WONT_EXIT)
+			tdx->dr7_valid = false;
+	} else
 		vcpu->arch.regs_avail &= ~VMX_REGS_LAZY_LOAD_SET;
 
-	return EXIT_FASTPATH_NONE;
+	ret = tdx_exit_handlers_fastpath(vcpu);
+	tdx->fastpath_reenter = ret == EXIT_FASTPATH_REENTER_GUEST;
+	return ret;
 }
 
 void tdx_inject_nmi(struct kvm_vcpu *vcpu)
@@ -1391,15 +2664,47 @@ void tdx_inject_nmi(struct kvm_vcpu *vcpu)
 	td_management_write8(to_tdx(vcpu), TD_VCPU_PEND_NMI, 1);
 }
 
+/*
+ * Every host interrupt exits the TD, and such an exit costs much more than a
+ * VM exit.  Account them by the kind of vector, to tell the host tick and
+ * the IPIs from device interrupts, e.g. to check that a vCPU isolated on a
+ * nohz_full CPU really runs without the tick.  On such a CPU, the generic
+ * guest entry already puts RCU in an extended quiescent state and switches
+ * the time accounting for the time in the TD, see guest_state_enter_irqoff().
+ */
+static void tdx_account_exit_irq(struct kvm_vcpu *vcpu, u32 intr_info)
+{
+	switch (intr_info & INTR_INFO_VECTOR_MASK) {
+	case LOCAL_TIMER_VECTOR:
+		++to_tdx(vcpu)->stat.exit_irq_timer;
+		break;
+	case RESCHEDULE_VECTOR:
+	case CALL_FUNCTION_VECTOR:
+	case CALL_FUNCTION_SINGLE_VECTOR:
+	case IRQ_WORK_VECTOR:
+		++to_tdx(vcpu)->stat.exit_irq_ipi;
+		break;
+	case POSTED_INTR_VECTOR:
+	case POSTED_INTR_WAKEUP_VECTOR:
+	case POSTED_INTR_NESTED_VECTOR:
+		++to_tdx(vcpu)->stat.exit_irq_posted;
+		break;
+	default:
+		++to_tdx(vcpu)->stat.exit_irq_other;
+		break;
+	}
+}
+
 void tdx_handle_exit_irqoff(struct kvm_vcpu *vcpu)
 {
 	struct vcpu_tdx *tdx = to_tdx(vcpu);
 	u16 exit_reason = tdx->exit_reason.basic;
 
-	if (exit_reason == EXIT_REASON_EXTERNAL_INTERRUPT)
+	if (exit_reason == EXIT_REASON_EXTERNAL_INTERRUPT) {
+		tdx_account_exit_irq(vcpu, tdexit_intr_info(vcpu));
 		vmx_handle_external_interrupt_irqoff(vcpu,
 						     tdexit_intr_info(vcpu));
-	else if (exit_reason == EXIT_REASON_EXCEPTION_NMI) {
+	} else if (exit_reason == EXIT_REASON_EXCEPTION_NMI) {
 		kvm_before_interrupt(vcpu, KVM_HANDLING_NMI);
 		vmx_handle_exception_irqoff(vcpu, tdexit_intr_info(vcpu));
 		kvm_after_interrupt(vcpu);
@@ -1435,6 +2740,15 @@ static bool tdx_kvm_use_dr(struct kvm_vcpu *vcpu)
 		  (KVM_GUESTDBG_USE_HW_BP | KVM_GUESTDBG_SINGLESTEP));
 }
 
+static unsigned long tdx_get_dr7(struct vcpu_tdx *tdx)
+{
+	if (!tdx->dr7_valid) {
+		tdx->dr7 = td_vmcs_read64(tdx, GUEST_DR7);
+		tdx->dr7_valid = true;
+	}
+	return tdx->dr7;
+}
+
 static int tdx_handle_exception(struct kvm_vcpu *vcpu)
 {
 	u32 intr_info = tdexit_intr_info(vcpu);
@@ -1461,7 +2775,7 @@ static int tdx_handle_exception(struct kvm_vcpu *vcpu)
 		}
 
 		vcpu->run->debug.arch.dr6 = dr6 | DR6_ACTIVE_LOW;
-		vcpu->run->debug.arch.dr7 = td_vmcs_read64(tdx, GUEST_DR7);
+		vcpu->run->debug.arch.dr7 = tdx_get_dr7(tdx);
 	}
 		fallthrough;
 	case BP_VECTOR:
@@ -1488,7 +2802,9 @@ void tdx_set_dr7(struct kvm_vcpu *vcpu, unsigned long val)
 	if (!is_debug_td(vcpu) || !tdx->initialized)
 		return;
 
-	td_vmcs_write64(tdx, GUEST_DR7, val);
+	tdx->dr7 = val;
+	tdx->dr7_valid = true;
+	tdx->debug_dirty |= TDX_DEBUG_DIRTY_DR7;
 }
 
 static void tdx_emulate_inject_bp_begin(struct kvm_vcpu *vcpu)
@@ -1591,10 +2907,23 @@ static int tdx_emulate_vmcall(struct kvm_vcpu *vcpu)
 	return 1;
 }
 
+/* Remember where a MapGPA answered, by KVM or user space, resumes. */
+static void tdx_map_gpa_done(struct kvm_vcpu *vcpu)
+{
+	struct vcpu_tdx *tdx = to_tdx(vcpu);
+
+	if (kvm_r10_read(vcpu) != TDG_VP_VMCALL_RETRY)
+		return;
+
+	tdx->map_gpa_next = kvm_r11_read(vcpu);
+	tdx->map_gpa_retry = true;
+}
+
 static int tdx_complete_vp_vmcall(struct kvm_vcpu *vcpu)
 {
 	struct kvm_tdx_vmcall *tdx_vmcall = &vcpu->run->tdx.u.vmcall;
 	__u64 reg_mask = kvm_rcx_read(vcpu);
+	bool map_gpa = tdvmcall_leaf(vcpu) == TDG_VP_VMCALL_MAP_GPA;
 
 #define COPY_REG(MASK, REG)							\
 	do {									\
@@ -1618,6 +2947,9 @@ static int tdx_complete_vp_vmcall(struct kvm_vcpu *vcpu)
 
 #undef COPY_REG
 
+	if (map_gpa)
+		tdx_map_gpa_done(vcpu);
+
 	return 1;
 }
 
@@ -1663,6 +2995,99 @@ static int tdx_vp_vmcall_to_user(struct kvm_vcpu *vcpu)
 	return 0;
 }
 
+__diag_push();
+__diag_ignore_all("-Wmissing-prototypes",
+		  "Global functions as their definitions will be in kvm_intel BTF");
+
+/*
+ * Hook for BPF_MODIFY_RETURN programs, called for the TDVMCALLs that KVM would
+ * exit to user space for, see tdx_vp_vmcall_to_kernel().  A program may answer
+ * the TDVMCALL itself, setting the output registers with
+ * bpf_kvm_tdx_vmcall_write_reg(), and return true for KVM to resume the TD
+ * right away, or return false to exit to user space, e.g. after counting it.
+ */
+noinline bool tdx_vmcall_filter(struct kvm_vcpu *vcpu, u64 leaf)
+{
+	return false;
+}
+ALLOW_ERROR_INJECTION(tdx_vmcall_filter, TRUE);
+
+/*
+ * bpf_kvm_tdx_vmcall_read_reg - Read a register of the TDVMCALL being filtered
+ *
+ * @vcpu	- The vCPU passed to tdx_vmcall_filter()
+ * @reg		- enum kvm_reg of a GPR, e.g. VCPU_REGS_R12
+ */
+__bpf_kfunc u64 bpf_kvm_tdx_vmcall_read_reg(struct kvm_vcpu *vcpu, u32 reg)
+{
+	if (!is_td_vcpu(vcpu) || !to_tdx(vcpu)->in_vmcall_filter ||
+	    reg >= VCPU_REGS_RIP)
+		return 0;
+
+	return kvm_register_read_raw(vcpu, reg);
+}
+
+/*
+ * bpf_kvm_tdx_vmcall_write_reg - Set an output register of the TDVMCALL
+ *
+ * Only valid from a program attached to tdx_vmcall_filter(), for the vCPU it
+ * was called for.  R10 is the TDVMCALL status code.  Returns 0 on success.
+ *
+ * @vcpu	- The vCPU passed to tdx_vmcall_filter()
+ * @reg		- enum kvm_reg of a GPR other than RSP, e.g. VCPU_REGS_R10
+ * @val		- The value written
+ */
+__bpf_kfunc int bpf_kvm_tdx_vmcall_write_reg(struct kvm_vcpu *vcpu, u32 reg, u64 val)
+{
+	if (!is_td_vcpu(vcpu) || !to_tdx(vcpu)->in_vmcall_filter ||
+	    reg >= VCPU_REGS_RIP || reg == VCPU_REGS_RSP)
+		return -EINVAL;
+
+	kvm_register_write_raw(vcpu, reg, val);
+	return 0;
+}
+
+__diag_pop()
+
+BTF_SET8_START(tdx_vmcall_kfunc_ids)
+BTF_ID_FLAGS(func, bpf_kvm_tdx_vmcall_read_reg, KF_TRUSTED_ARGS)
+BTF_ID_FLAGS(func, bpf_kvm_tdx_vmcall_write_reg, KF_TRUSTED_ARGS)
+BTF_SET8_END(tdx_vmcall_kfunc_ids)
+
+static const struct btf_kfunc_id_set tdx_vmcall_kfunc_set = {
+	.owner = THIS_MODULE,
+	.set   = &tdx_vmcall_kfunc_ids,
+};
+
+static bool tdx_vmcall_filter_run(struct kvm_vcpu *vcpu)
+{
+	struct vcpu_tdx *tdx = to_tdx(vcpu);
+	bool handled;
+
+	tdx->in_vmcall_filter = true;
+	handled = tdx_vmcall_filter(vcpu, tdvmcall_leaf(vcpu));
+	tdx->in_vmcall_filter = false;
+
+	return handled;
+}
+
+/*
+ * Give a TDVMCALL that KVM doesn't handle to the BPF hook before exiting to
+ * user space for it.  Return true if it was handled.
+ */
+static bool tdx_vp_vmcall_to_kernel(struct kvm_vcpu *vcpu)
+{
+	/*
+	 * User space converts the memory for MapGPA, and tracks the quote
+	 * buffer for GetQuote, they aren't for BPF to answer.
+	 */
+	if (tdvmcall_leaf(vcpu) == TDG_VP_VMCALL_MAP_GPA ||
+	    tdvmcall_leaf(vcpu) == TDG_VP_VMCALL_GET_QUOTE)
+		return false;
+
+	return tdx_vmcall_filter_run(vcpu);
+}
+
 static int tdx_emulate_cpuid(struct kvm_vcpu *vcpu)
 {
 	u32 eax, ebx, ecx, edx;
@@ -1712,6 +3137,84 @@ static int tdx_complete_pio_in(struct kvm_vcpu *vcpu)
 	return 1;
 }
 
+static int tdx_complete_pio_in_string(struct kvm_vcpu *vcpu)
+{
+	gpa_t gpa = tdvmcall_a3_read(vcpu) &
+		    ~gfn_to_gpa(kvm_gfn_shared_mask(vcpu->kvm));
+	unsigned int len = vcpu->arch.pio.size * vcpu->arch.pio.count;
+
+	vcpu->arch.pio.count = 0;
+	if (kvm_vcpu_write_guest(vcpu, gpa, vcpu->arch.pio_data, len))
+		tdvmcall_set_return_code(vcpu, TDG_VP_VMCALL_INVALID_OPERAND);
+	else
+		tdvmcall_set_return_code(vcpu, TDG_VP_VMCALL_SUCCESS);
+
+	return 1;
+}
+
+/*
+ * TDVMCALL_KVM_IO_STRING: R14 elements of size R11 from/to port R13, through
+ * the shared page at GPA R15.  The data of IN is gathered in pio_data, by both
+ * the in-kernel devices and userspace, and copied to the guest at once.
+ */
+static int tdx_emulate_io_string(struct kvm_vcpu *vcpu)
+{
+	struct x86_emulate_ctxt *ctxt = vcpu->arch.emulate_ctxt;
+	gpa_t shared = gfn_to_gpa(kvm_gfn_shared_mask(vcpu->kvm));
+	int size = kvm_r11_read(vcpu);
+	u64 dir = tdvmcall_a0_read(vcpu);
+	unsigned int port = tdvmcall_a1_read(vcpu);
+	unsigned long count = tdvmcall_a2_read(vcpu);
+	gpa_t gpa = tdvmcall_a3_read(vcpu);
+	unsigned int len;
+	bool write;
+	void *buf;
+	int ret;
+
+	++vcpu->stat.io_exits;
+
+	if ((size != 1 && size != 2 && size != 4) || (dir & ~1ULL) ||
+	    !count || count > PAGE_SIZE / size || !(gpa & shared))
+		goto invalid;
+	write = dir;
+	len = count * size;
+	gpa &= ~shared;
+	if (((gpa + len - 1) ^ gpa) & PAGE_MASK)
+		goto invalid;
+
+	if (write) {
+		buf = kmalloc(len, GFP_KERNEL_ACCOUNT);
+		if (!buf)
+			return -ENOMEM;
+		if (kvm_vcpu_read_guest(vcpu, gpa, buf, len)) {
+			kfree(buf);
+			goto invalid;
+		}
+		ret = ctxt->ops->pio_out_emulated(ctxt, size, port, buf, count);
+		kfree(buf);
+
+		/* No need for a complete_userspace_io callback. */
+		vcpu->arch.pio.count = 0;
+		tdvmcall_set_return_code(vcpu, TDG_VP_VMCALL_SUCCESS);
+		return ret;
+	}
+
+	ret = ctxt->ops->pio_in_emulated(ctxt, size, port, vcpu->arch.pio_data,
+					 count);
+	if (!ret) {
+		vcpu->arch.complete_userspace_io = tdx_complete_pio_in_string;
+		return 0;
+	}
+	if (kvm_vcpu_write_guest(vcpu, gpa, vcpu->arch.pio_data, len))
+		goto invalid;
+	tdvmcall_set_return_code(vcpu, TDG_VP_VMCALL_SUCCESS);
+	return 1;
+
+invalid:
+	tdvmcall_set_return_code(vcpu, TDG_VP_VMCALL_INVALID_OPERAND);
+	return 1;
+}
+
 static int tdx_emulate_io(struct kvm_vcpu *vcpu)
 {
 	struct x86_emulate_ctxt *ctxt = vcpu->arch.emulate_ctxt;
@@ -1773,6 +3276,7 @@ static inline int tdx_mmio_write(struct kvm_vcpu *vcpu, gpa_t gpa, int size,
 				 unsigned long val)
 {
 	if (kvm_iodevice_write(vcpu, &vcpu->arch.apic->dev, gpa, size, &val) &&
+	    kvm_ioeventfd_signal(vcpu->kvm, KVM_MMIO_BUS, gpa, size) &&
 	    kvm_io_bus_write(vcpu, KVM_MMIO_BUS, gpa, size, &val))
 		return -EOPNOTSUPP;
 
@@ -1822,7 +3326,8 @@ static int tdx_emulate_mmio(struct kvm_vcpu *vcpu)
 	if (slot && !(slot->flags & KVM_MEMSLOT_INVALID))
 		goto error;
 
-	if (!kvm_io_bus_write(vcpu, KVM_FAST_MMIO_BUS, gpa, 0, NULL)) {
+	if (!kvm_ioeventfd_signal(vcpu->kvm, KVM_FAST_MMIO_BUS, gpa, 0) ||
+	    !kvm_io_bus_write(vcpu, KVM_FAST_MMIO_BUS, gpa, 0, NULL)) {
 		trace_kvm_fast_mmio(gpa);
 		return 1;
 	}
@@ -1910,60 +3415,68 @@ static int tdx_get_td_vm_call_info(struct kvm_vcpu *vcpu)
 	return 1;
 }
 
-static struct tdvmcall_service *tdvmcall_servbuf_alloc(struct kvm_vcpu *vcpu,
-						       gpa_t gpa)
+static bool tdvmcall_servbuf_check(struct gfn_to_pfn_cache *gpc, gpa_t gpa)
 {
-	uint32_t length;
-	gfn_t gfn = gpa_to_gfn(gpa);
-	struct tdvmcall_service __user *g_buf, *h_buf;
+	read_lock(&gpc->lock);
+	if (gpc->gpa == gpa && kvm_gpc_check(gpc, PAGE_SIZE))
+		return true;
+	read_unlock(&gpc->lock);
 
-	if (!PAGE_ALIGNED(gpa)) {
-		pr_err("%s: gpa=%llx not page aligned\n", __func__, gpa);
-		return NULL;
-	}
+	return false;
+}
 
-	g_buf = (struct tdvmcall_service *)kvm_vcpu_gfn_to_hva(vcpu, gfn);
-	if (kvm_is_error_hva((unsigned long)g_buf)) {
-		pr_err("%s: Not a valid buf\n", __func__);
-		return NULL;
-	}
-	if (g_buf && get_user(length, &g_buf->length)) {
-		pr_err("%s: failed to get length\n", __func__);
-		return NULL;
-	}
+static void tdvmcall_servbuf_unmap(struct kvm_vcpu *vcpu)
+{
+	struct vcpu_tdx *tdx = to_tdx(vcpu);
 
-	if (!length) {
-		pr_err("%s: length being 0 isn't valid\n", __func__);
-		return NULL;
-	}
+	read_unlock(&tdx->servbuf_gpc[TDVMCALL_SERVBUF_RESP].lock);
+	read_unlock(&tdx->servbuf_gpc[TDVMCALL_SERVBUF_CMD].lock);
+}
 
-	/* The status field by default is TDX_VMCALL_SERVICE_S_RETURNED */
-	h_buf = kzalloc(max_t(size_t, length, PAGE_SIZE), GFP_KERNEL_ACCOUNT);
-	if (!h_buf)
-		return NULL;
+/*
+ * Map the first page of the cmd and resp bufs of TDG.VP.VMCALL<Service> in
+ * place, the commands handled by KVM don't go beyond it.  The mappings are
+ * cached by the per-vCPU pfncaches, as the guest usually reuses its bufs.
+ *
+ * On success, the bufs are accessible until tdvmcall_servbuf_unmap(), which
+ * can't sleep in between.  The bufs are shared with the guest, each field
+ * must be read once, and nothing read from them may index host memory.
+ */
+static int tdvmcall_servbuf_map(struct kvm_vcpu *vcpu, gpa_t cmd_gpa,
+				gpa_t resp_gpa)
+{
+	struct vcpu_tdx *tdx = to_tdx(vcpu);
+	struct gfn_to_pfn_cache *gpc;
+	gpa_t gpa;
+	int r;
 
-	if (copy_from_user(h_buf, g_buf, length)) {
-		pr_err("%s: failed to copy\n", __func__);
-		kfree(h_buf);
-		return NULL;
+	if (!PAGE_ALIGNED(cmd_gpa) || !PAGE_ALIGNED(resp_gpa)) {
+		pr_err("%s: cmd=%llx or resp=%llx not page aligned\n",
+		       __func__, cmd_gpa, resp_gpa);
+		return -EINVAL;
 	}
 
-	return h_buf;
-}
-
-static void tdvmcall_status_copy_and_free(struct tdvmcall_service *h_buf,
-					  struct kvm_vcpu *vcpu, gpa_t gpa)
-{
-	gfn_t gfn;
-	struct tdvmcall_service __user *g_buf;
+	for (;;) {
+		gpc = &tdx->servbuf_gpc[TDVMCALL_SERVBUF_CMD];
+		gpa = cmd_gpa;
+		if (tdvmcall_servbuf_check(gpc, gpa)) {
+			gpc = &tdx->servbuf_gpc[TDVMCALL_SERVBUF_RESP];
+			gpa = resp_gpa;
+			if (tdvmcall_servbuf_check(gpc, gpa))
+				return 0;
+			read_unlock(&tdx->servbuf_gpc[TDVMCALL_SERVBUF_CMD].lock);
+		}
 
-	gfn = gpa_to_gfn(gpa);
-	g_buf = (struct tdvmcall_service *)kvm_vcpu_gfn_to_hva(vcpu, gfn);
-	if (copy_to_user(g_buf, h_buf, h_buf->length)) {
-		/* Guest sees TDVMCALL_SERVICE_S_RSVD in status */
-		pr_err("%s: failed to update the guest buffer\n", __func__);
+		/* A new buf of the guest, or the cached mapping got invalidated */
+		if (gpc->gpa != gpa || !gpc->active)
+			r = kvm_gpc_activate(gpc, gpa, PAGE_SIZE);
+		else
+			r = kvm_gpc_refresh(gpc, PAGE_SIZE);
+		if (r) {
+			pr_err("%s: Not a valid buf, gpa=%llx\n", __func__, gpa);
+			return r;
+		}
 	}
-	kfree(h_buf);
 }
 
 static enum tdvmcall_service_id tdvmcall_get_service_id(guid_t guid)
@@ -2078,37 +3591,81 @@ static int migtd_start_migration(struct tdvmcall_service_migtd *resp_migtd,
 	return len;
 }
 
+/* Claim the request of @slot, against the other vCPUs of the servtd. */
 static bool tdx_binding_slot_premig_wait(struct tdx_binding_slot *slot)
 {
-	if (slot->state == TDX_BINDING_SLOT_STATE_PREMIG_WAIT) {
-		slot->state = TDX_BINDING_SLOT_STATE_PREMIG_PROGRESS;
-		return true;
+	return cmpxchg(&slot->state, TDX_BINDING_SLOT_STATE_PREMIG_WAIT,
+		       TDX_BINDING_SLOT_STATE_PREMIG_PROGRESS) ==
+	       TDX_BINDING_SLOT_STATE_PREMIG_WAIT;
+}
+
+/* The next slot waiting for pre-migration from *@idx on, wrapping around */
+static struct tdx_binding_slot *tdx_servtd_next_request(struct kvm_tdx *tdx,
+							unsigned long *idx)
+{
+	struct tdx_binding_slot *slot;
+	unsigned long start = *idx;
+
+	slot = xa_find(&tdx->usertd_binding_slots, idx, ULONG_MAX,
+		       TDX_BINDING_SLOT_PREMIG_WAIT_MARK);
+	if (!slot && start) {
+		*idx = 0;
+		slot = xa_find(&tdx->usertd_binding_slots, idx, start - 1,
+			       TDX_BINDING_SLOT_PREMIG_WAIT_MARK);
 	}
 
-	return false;
+	return slot;
 }
 
+static void tdx_notify_servtd(struct kvm_tdx *tdx);
+
+/*
+ * The user TDs requesting to start migration are served round robin from
+ * migtd_req_next, so that one can't starve the others.  If more requests are
+ * pending, another halted MigTD vCPU is woken up to take the next one, so
+ * that the requests are handled concurrently.
+ *
+ * The pending requests are found by their mark in usertd_binding_slots, the
+ * cost doesn't depend on the number of user TDs bound.  Clearing the mark and
+ * looking for more are atomic against tdx_set_migration_info() adding one,
+ * under the xa_lock, so that each request is either seen here or notified.
+ */
 static int migtd_wait_for_request(struct kvm_tdx *tdx,
 				  struct tdvmcall_service_migtd *resp_migtd)
 {
-	struct tdx_binding_slot *slot;
-	int i, len = sizeof(struct tdvmcall_service_migtd);
-
-	spin_lock(&tdx->binding_slot_lock);
-	for (i = 0; i < SERVTD_SLOTS_MAX; i++) {
-		slot = tdx->usertd_binding_slots[i];
-		if (slot && tdx_binding_slot_premig_wait(slot))
+	struct xarray *slots = &tdx->usertd_binding_slots;
+	int len = sizeof(struct tdvmcall_service_migtd);
+	struct tdx_binding_slot *slot = NULL, *s;
+	unsigned long idx;
+	bool more = false;
+
+	rcu_read_lock();
+	idx = READ_ONCE(tdx->migtd_req_next);
+	while ((s = tdx_servtd_next_request(tdx, &idx))) {
+		xa_lock(slots);
+		__xa_clear_mark(slots, idx, TDX_BINDING_SLOT_PREMIG_WAIT_MARK);
+		more = xa_marked(slots, TDX_BINDING_SLOT_PREMIG_WAIT_MARK);
+		xa_unlock(slots);
+
+		if (tdx_binding_slot_premig_wait(s)) {
+			slot = s;
 			break;
+		}
 	}
-	spin_unlock(&tdx->binding_slot_lock);
 
 	/* No one requested to start migration */
-	if (i == SERVTD_SLOTS_MAX) {
+	if (!slot) {
+		rcu_read_unlock();
 		resp_migtd->operation = TDVMCALL_SERVICE_MIGTD_OP_NOOP;
 		return len;
 	}
 
-	len += migtd_start_migration(resp_migtd, slot, i);
+	WRITE_ONCE(tdx->migtd_req_next, idx + 1);
+	len += migtd_start_migration(resp_migtd, slot, idx);
+	rcu_read_unlock();
+
+	if (more)
+		tdx_notify_servtd(tdx);
 
 	return len;
 }
@@ -2119,32 +3676,32 @@ static void migtd_report_status_for_start_mig(struct kvm_tdx *tdx,
 	uint64_t req_id = *(uint64_t *)cmd_migtd->data;
 	struct tdx_binding_slot *slot;
 	enum tdx_binding_slot_state state;
+	bool succ;
 
-	spin_lock(&tdx->binding_slot_lock);
-	slot = tdx->usertd_binding_slots[req_id];
-	/* Not bounded any more, e.g. the user TD is destroyed */
-	if (!slot)
-		goto out_unlock;
+	succ = cmd_migtd->status == TDVMCALL_SERVICE_MIGTD_STATUS_SUCC;
+	state = succ ? TDX_BINDING_SLOT_STATE_PREMIG_DONE :
+		       TDX_BINDING_SLOT_STATE_BOUND;
 
-	state = tdx_binding_slot_get_state(slot);
-	/* Sanity check if the state is unexpected */
-	if (state != TDX_BINDING_SLOT_STATE_PREMIG_PROGRESS)
+	rcu_read_lock();
+	slot = xa_load(&tdx->usertd_binding_slots, req_id);
+	/*
+	 * Not bounded any more, e.g. the user TD is destroyed, or sanity check
+	 * if the state is unexpected.
+	 */
+	if (!slot ||
+	    cmpxchg(&slot->state, TDX_BINDING_SLOT_STATE_PREMIG_PROGRESS,
+		    state) != TDX_BINDING_SLOT_STATE_PREMIG_PROGRESS)
 		goto out_unlock;
 
-	if (cmd_migtd->status != TDVMCALL_SERVICE_MIGTD_STATUS_SUCC) {
+	if (!succ)
 		pr_err("%s: pre-migration failed, state=%x\n",
 			__func__, cmd_migtd->status);
-		state = TDX_BINDING_SLOT_STATE_BOUND;
-	} else {
-		state = TDX_BINDING_SLOT_STATE_PREMIG_DONE;
+	else
 		pr_info("Pre-migration is done, userspace pid=%d\n",
 			tdx->kvm.userspace_pid);
-	}
-
-	tdx_binding_slot_set_state(slot, state);
 
 out_unlock:
-	spin_unlock(&tdx->binding_slot_lock);
+	rcu_read_unlock();
 }
 
 /*
@@ -2181,6 +3738,11 @@ static bool tdx_handle_service_migtd(struct kvm_tdx *tdx,
 		(struct tdvmcall_service_migtd *)resp_hdr->data;
 	uint32_t status, len = 0;
 
+	/* The resp is written in place, in the page mapped. */
+	BUILD_BUG_ON(sizeof(struct tdvmcall_service) +
+		     sizeof(struct tdvmcall_service_migtd) +
+		     sizeof(struct migtd_all_info) > PAGE_SIZE);
+
 	resp_migtd->cmd = cmd_migtd->cmd;
 
 	switch (cmd_migtd->cmd) {
@@ -2236,6 +3798,7 @@ static int tdx_handle_service(struct kvm_vcpu *vcpu)
 	gpa_t resp_gpa = tdvmcall_a1_read(vcpu) &
 			~gfn_to_gpa(kvm_gfn_shared_mask(kvm));
 	uint64_t nvector = tdvmcall_a2_read(vcpu);
+	struct gfn_to_pfn_cache *resp_gpc;
 	struct tdvmcall_service *cmd_buf, *resp_buf;
 	enum tdvmcall_service_id service_id;
 	bool need_block = false;
@@ -2244,18 +3807,26 @@ static int tdx_handle_service(struct kvm_vcpu *vcpu)
 	    kvm_mem_is_private(kvm, gpa_to_gfn(resp_gpa))) {
 		pr_warn("%s: cmd or resp buffer is private\n", __func__);
 		tdvmcall_set_return_code(vcpu, TDG_VP_VMCALL_INVALID_OPERAND);
-		goto err_cmd;
+		return 1;
 	}
 
-	cmd_buf = tdvmcall_servbuf_alloc(vcpu, cmd_gpa);
-	if (!cmd_buf)
-		goto err_cmd;
-	resp_buf = tdvmcall_servbuf_alloc(vcpu, resp_gpa);
-	if (!resp_buf)
-		goto err_status;
-	resp_buf->length = sizeof(struct tdvmcall_service);
+	if (tdvmcall_servbuf_map(vcpu, cmd_gpa, resp_gpa))
+		return 1;
+	cmd_buf = to_tdx(vcpu)->servbuf_gpc[TDVMCALL_SERVBUF_CMD].khva;
+	resp_gpc = &to_tdx(vcpu)->servbuf_gpc[TDVMCALL_SERVBUF_RESP];
+	resp_buf = resp_gpc->khva;
+
+	if (!READ_ONCE(cmd_buf->length) || !READ_ONCE(resp_buf->length)) {
+		pr_err("%s: length being 0 isn't valid\n", __func__);
+		goto out_unmap;
+	}
 
 	service_id = tdvmcall_get_service_id(cmd_buf->guid);
+	if (service_id == TDVMCALL_SERVICE_ID_VTPM ||
+	    service_id == TDVMCALL_SERVICE_ID_VTPMTD)
+		goto userspace;
+
+	resp_buf->length = sizeof(struct tdvmcall_service);
 	switch (service_id) {
 	case TDVMCALL_SERVICE_ID_QUERY:
 		if (nvector)
@@ -2267,39 +3838,69 @@ static int tdx_handle_service(struct kvm_vcpu *vcpu)
 			goto err_vector;
 		need_block = tdx_handle_service_migtd(tdx, cmd_buf, resp_buf);
 		break;
-	case TDVMCALL_SERVICE_ID_VTPM:
-	case TDVMCALL_SERVICE_ID_VTPMTD:
-		goto userspace;
 	default:
 		resp_buf->status = TDVMCALL_SERVICE_S_UNSUPP;
 		pr_warn("%s: unsupported service type\n", __func__);
 	}
 
-	/* Update the guest status buf and free the host buf */
-	tdvmcall_status_copy_and_free(resp_buf, vcpu, resp_gpa);
-err_status:
-	kfree(cmd_buf);
+	/* The guest status buf is updated in place */
+	mark_page_dirty_in_slot(kvm, resp_gpc->memslot, gpa_to_gfn(resp_gpa));
+	tdvmcall_servbuf_unmap(vcpu);
 	if (need_block && !nvector)
 		return kvm_emulate_halt_noskip(vcpu);
 
-err_cmd:
 	return 1;
 err_vector:
-	kfree(cmd_buf);
-	kfree(resp_buf);
 	pr_warn("%s: interrupt not supported, nvector %lld\n",
 		__func__, nvector);
+out_unmap:
+	tdvmcall_servbuf_unmap(vcpu);
 	return 1;
 userspace:
-	kfree(cmd_buf);
-	kfree(resp_buf);
+	tdvmcall_servbuf_unmap(vcpu);
 	return tdx_vp_vmcall_to_user(vcpu);
 }
 
+static bool tdx_map_gpa(struct kvm_vcpu *vcpu);
+
+/*
+ * A MapGPA retried after TDG_VP_VMCALL_RETRY resumes from the GPA in R11 but
+ * keeps the end of the original range, count its pages only the first time.
+ * A new MapGPA of the same range is counted again.
+ */
+static void tdx_map_gpa_stat(struct kvm_vcpu *vcpu)
+{
+	struct vcpu_tdx *tdx = to_tdx(vcpu);
+	gpa_t gpa = tdvmcall_a0_read(vcpu);
+	u64 size = tdvmcall_a1_read(vcpu);
+	bool retry;
+
+	retry = tdx->map_gpa_retry && gpa == tdx->map_gpa_next &&
+		gpa + size == tdx->map_gpa_end;
+	tdx->map_gpa_retry = false;
+	tdx->map_gpa_end = gpa + size;
+	if (!retry)
+		vcpu->stat.tdx_map_gpa_pages += size >> PAGE_SHIFT;
+}
+
 static int handle_tdvmcall(struct kvm_vcpu *vcpu)
 {
 	int r;
 
+	if (tdvmcall_exit_type(vcpu) == TDVMCALL_KVM_GET_EXT) {
+		tdvmcall_set_return_code(vcpu, TDG_VP_VMCALL_SUCCESS);
+		kvm_r11_write(vcpu, TDVMCALL_KVM_EXT_IO_STRING |
+				    TDVMCALL_KVM_EXT_ACCEPT_LEVEL);
+		return 1;
+	}
+	if (tdvmcall_exit_type(vcpu) == TDVMCALL_KVM_IO_STRING)
+		return tdx_emulate_io_string(vcpu);
+	if (tdvmcall_exit_type(vcpu) == TDVMCALL_KVM_ACCEPT_LEVEL) {
+		tdvmcall_set_return_code(vcpu, TDG_VP_VMCALL_SUCCESS);
+		kvm_r11_write(vcpu,
+			pg_level_to_tdx_sept_level(vcpu->kvm->arch.tdp_max_page_level));
+		return 1;
+	}
 	if (tdvmcall_exit_type(vcpu))
 		return tdx_emulate_vmcall(vcpu);
 
@@ -2342,8 +3943,23 @@ static int handle_tdvmcall(struct kvm_vcpu *vcpu)
 		 * TDG_VP_VMCALL_REPORT_FATAL_ERROR, TDG_VP_VMCALL_MAP_GPA,
 		 * TDG_VP_VMCALL_SETUP_EVENT_NOTIFY_INTERRUPT, and
 		 * TDG_VP_VMCALL_GET_QUOTE.
+		 *
+		 * Unless a BPF program answers it, see tdx_vmcall_filter().
 		 */
-		r = tdx_vp_vmcall_to_user(vcpu);
+		if (tdvmcall_leaf(vcpu) == TDG_VP_VMCALL_MAP_GPA)
+			tdx_map_gpa_stat(vcpu);
+		else if (tdvmcall_leaf(vcpu) == TDG_VP_VMCALL_GET_QUOTE)
+			++vcpu->stat.tdx_get_quote;
+
+		if (tdvmcall_leaf(vcpu) == TDG_VP_VMCALL_MAP_GPA &&
+		    tdx_map_gpa(vcpu)) {
+			tdx_map_gpa_done(vcpu);
+			r = 1;
+		} else if (tdx_vp_vmcall_to_kernel(vcpu)) {
+			r = 1;
+		} else {
+			r = tdx_vp_vmcall_to_user(vcpu);
+		}
 		break;
 	}
 
@@ -2367,6 +3983,201 @@ void tdx_load_mmu_pgd(struct kvm_vcpu *vcpu, hpa_t root_hpa, int pgd_level)
 	td_vmcs_write64(to_tdx(vcpu), SHARED_EPT_POINTER, root_hpa & PAGE_MASK);
 }
 
+#define TDX_EVENT_RING_MIN	64
+#define TDX_EVENT_RING_MAX	(1 << 20)
+
+static void __tdx_event(struct kvm_tdx *kvm_tdx,
+			struct kvm_tdx_event_ring *ring, u8 type, gfn_t gfn,
+			kvm_pfn_t pfn, enum pg_level level)
+{
+	struct kvm_tdx_event *e;
+	u64 n, seq;
+
+	/* Don't leave the record busy for the producers spinning on it. */
+	preempt_disable();
+	n = atomic64_fetch_inc(&kvm_tdx->event_head);
+	e = &ring->events[n & (ring->nr_events - 1)];
+
+	/*
+	 * Producers a lap apart share the record: wait for the one of an
+	 * earlier lap to finish writing it, and drop this event if one of a
+	 * later lap got it first, readers see its larger @seq as lapped.
+	 * Marking the record busy invalidates it for the readers before it's
+	 * overwritten, the cmpxchg orders it before the writes.
+	 */
+	for (;;) {
+		seq = READ_ONCE(e->seq);
+		if ((seq & ~KVM_TDX_EVENT_SEQ_BUSY) > n)
+			goto out;
+		if (!(seq & KVM_TDX_EVENT_SEQ_BUSY) &&
+		    try_cmpxchg64(&e->seq, &seq, (n + 1) | KVM_TDX_EVENT_SEQ_BUSY))
+			break;
+		cpu_relax();
+	}
+
+	e->time_ns = ktime_get_ns();
+	e->gfn = gfn;
+	e->pfn = pfn;
+	e->type = type;
+	e->level = level;
+	e->cpu = raw_smp_processor_id();
+	smp_store_release(&e->seq, n + 1);
+out:
+	preempt_enable();
+}
+
+/*
+ * Lightweight alternative to the kvm_tdx_* tracepoints for production hosts:
+ * fixed-size records in a ring mmap()ed by userspace, see
+ * KVM_TDX_GET_EVENT_RING.  Producers reserve records with an atomic counter
+ * and readers check the sequence number of each, neither side takes a lock.
+ */
+static __always_inline void tdx_event(struct kvm *kvm, u8 type, gfn_t gfn,
+				      kvm_pfn_t pfn, enum pg_level level)
+{
+	struct kvm_tdx *kvm_tdx = to_kvm_tdx(kvm);
+	struct kvm_tdx_event_ring *ring = READ_ONCE(kvm_tdx->event_ring);
+
+	if (unlikely(ring))
+		__tdx_event(kvm_tdx, ring, type, gfn, pfn, level);
+}
+
+/* Pages of a MapGPA converted before checking for a reschedule or signal. */
+#define TDX_MAP_GPA_CHUNK	(SZ_2M >> PAGE_SHIFT)
+
+static bool tdx_map_gpa_in_kernel(struct kvm *kvm, gfn_t start, gfn_t end)
+{
+	struct kvm_memslot_iter iter;
+	gfn_t gfn = start;
+
+	kvm_for_each_memslot_in_gfn_range(&iter, kvm_memslots(kvm), start, end) {
+		if (iter.slot->base_gfn > gfn ||
+		    !(iter.slot->flags & KVM_MEM_KERNEL_CONVERT))
+			return false;
+		gfn = iter.slot->base_gfn + iter.slot->npages;
+	}
+	return gfn >= end;
+}
+
+/*
+ * Convert the range of a MapGPA in the kernel if all of it is in memslots
+ * that allow it, instead of a round trip through the userspace VMM and
+ * KVM_SET_MEMORY_ATTRIBUTES.  Userspace learns about the conversions from the
+ * event ring.  Big ranges are done in chunks and, if the vCPU has to yield,
+ * the guest is told to retry from where the conversion stopped, as the GHCI
+ * allows.  Returns false to leave the MapGPA to userspace.
+ */
+static bool tdx_map_gpa(struct kvm_vcpu *vcpu)
+{
+	struct kvm *kvm = vcpu->kvm;
+	gpa_t shared_bit = gfn_to_gpa(kvm_gfn_shared_mask(kvm));
+	gpa_t gpa = tdvmcall_a0_read(vcpu);
+	u64 size = tdvmcall_a1_read(vcpu);
+	unsigned long attrs;
+	gfn_t start, end, next;
+	int r = 0;
+
+	if (!PAGE_ALIGNED(gpa) || !PAGE_ALIGNED(size) || !size ||
+	    gpa + size < gpa || gpa + size > shared_bit << 1 ||
+	    (gpa & shared_bit) != ((gpa + size - 1) & shared_bit))
+		return false;
+
+	start = gpa_to_gfn(gpa & ~shared_bit);
+	end = start + (size >> PAGE_SHIFT);
+	attrs = (gpa & shared_bit) ? 0 : KVM_MEMORY_ATTRIBUTE_PRIVATE;
+
+	if (!tdx_map_gpa_in_kernel(kvm, start, end))
+		return false;
+
+	kvm_vcpu_srcu_read_unlock(vcpu);
+	for (next = start; next < end; ) {
+		gfn_t chunk_end = min(end, ALIGN(next + 1, TDX_MAP_GPA_CHUNK));
+
+		r = kvm_vm_set_mem_attributes(kvm, attrs, next, chunk_end);
+		if (r)
+			break;
+
+		tdx_event(kvm, KVM_TDX_EVENT_MAP_GPA, next, chunk_end - next,
+			  !!attrs);
+		next = chunk_end;
+
+		if (next < end && (need_resched() || signal_pending(current)))
+			break;
+	}
+	kvm_vcpu_srcu_read_lock(vcpu);
+
+	if (r) {
+		tdvmcall_set_return_code(vcpu, TDG_VP_VMCALL_INVALID_OPERAND);
+	} else if (next < end) {
+		tdvmcall_set_return_code(vcpu, TDG_VP_VMCALL_RETRY);
+		tdvmcall_set_return_val(vcpu, gfn_to_gpa(next) |
+					      (gpa & shared_bit));
+	} else {
+		tdvmcall_set_return_code(vcpu, TDG_VP_VMCALL_SUCCESS);
+	}
+	return true;
+}
+
+static int tdx_event_ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct kvm *kvm = file->private_data;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	vm_flags_clear(vma, VM_MAYWRITE);
+	return remap_vmalloc_range(vma, to_kvm_tdx(kvm)->event_ring,
+				   vma->vm_pgoff);
+}
+
+static int tdx_event_ring_release(struct inode *inode, struct file *file)
+{
+	kvm_put_kvm(file->private_data);
+	return 0;
+}
+
+static const struct file_operations tdx_event_ring_fops = {
+	.mmap = tdx_event_ring_mmap,
+	.release = tdx_event_ring_release,
+	.llseek = noop_llseek,
+};
+
+static int tdx_get_event_ring(struct kvm *kvm, struct kvm_tdx_cmd *cmd)
+{
+	struct kvm_tdx *kvm_tdx = to_kvm_tdx(kvm);
+	struct kvm_tdx_event_ring *ring = kvm_tdx->event_ring;
+	u64 nr = cmd->data;
+	int fd;
+
+	if (cmd->flags)
+		return -EINVAL;
+
+	/* The ring lives until the TD is freed, the fds only reference it. */
+	if (!ring) {
+		if (nr < TDX_EVENT_RING_MIN || nr > TDX_EVENT_RING_MAX ||
+		    !is_power_of_2(nr))
+			return -EINVAL;
+
+		ring = vmalloc_user(struct_size(ring, events, nr));
+		if (!ring)
+			return -ENOMEM;
+		ring->nr_events = nr;
+
+		/* Pairs with READ_ONCE() in tdx_event(). */
+		smp_store_release(&kvm_tdx->event_ring, ring);
+	} else if (nr && nr != ring->nr_events) {
+		return -EEXIST;
+	}
+
+	kvm_get_kvm(kvm);
+	fd = anon_inode_getfd("kvm-tdx-events", &tdx_event_ring_fops, kvm,
+			      O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		kvm_put_kvm_no_destroy(kvm);
+
+	return fd;
+}
+
 static void tdx_measure_page(struct kvm_tdx *kvm_tdx, hpa_t gpa, int size)
 {
 	struct tdx_module_args out;
@@ -2378,7 +4189,7 @@ static void tdx_measure_page(struct kvm_tdx *kvm_tdx, hpa_t gpa, int size)
 	for (i = 0; i < size; i += TDX_EXTENDMR_CHUNKSIZE) {
 		err = tdh_mr_extend(kvm_tdx->tdr_pa, gpa + i, &out);
 		if (KVM_BUG_ON(err, &kvm_tdx->kvm)) {
-			pr_tdx_error(TDH_MR_EXTEND, err, &out);
+			kvm_pr_tdx_error(&kvm_tdx->kvm, TDH_MR_EXTEND, err, &out);
 			break;
 		}
 	}
@@ -2402,7 +4213,6 @@ static int tdx_sept_set_private_spte(struct kvm *kvm, gfn_t gfn,
 	gpa_t gpa = gfn_to_gpa(gfn);
 	struct tdx_module_args out;
 	hpa_t source_pa;
-	bool measure;
 	u64 err;
 	int i;
 
@@ -2411,12 +4221,9 @@ static int tdx_sept_set_private_spte(struct kvm *kvm, gfn_t gfn,
 		return 0;
 
 	/*
-	 * Because restricted mem doesn't support page migration with
-	 * a_ops->migrate_page (yet), no callback isn't triggered for KVM on
-	 * page migration.  Until restricted mem supports page migration,
-	 * prevent page migration.
-	 * TODO: Once restricted mem introduces callback on page migration,
-	 * implement it and remove get_page/put_page().
+	 * Pin the page while the TDX module owns it, so that it isn't freed or
+	 * reused with the stale KeyID.  guest_memfd migrates a mapped page
+	 * only via tdx_sept_relocate_private_spte(), which moves the pin.
 	 */
 	for (i = 0; i < KVM_PAGES_PER_HPAGE(level); i++)
 		get_page(pfn_to_page(pfn + i));
@@ -2432,7 +4239,7 @@ static int tdx_sept_set_private_spte(struct kvm *kvm, gfn_t gfn,
 			 */
 			err = tdh_mem_sept_rd(kvm_tdx->tdr_pa, gpa, tdx_level, &out);
 			if (KVM_BUG_ON(err, kvm)) {
-				pr_tdx_error(TDH_MEM_SEPT_RD, err, &out);
+				kvm_pr_tdx_error(kvm, TDH_MEM_SEPT_RD, err, &out);
 				tdx_unpin(kvm, gfn, pfn, level);
 				return -EIO;
 			}
@@ -2472,12 +4279,14 @@ static int tdx_sept_set_private_spte(struct kvm *kvm, gfn_t gfn,
 			}
 		}
 		if (KVM_BUG_ON(err, kvm)) {
-			pr_tdx_error(TDH_MEM_PAGE_AUG, err, &out);
+			kvm_pr_tdx_error(kvm, TDH_MEM_PAGE_AUG, err, &out);
 			tdx_unpin(kvm, gfn, pfn, level);
 			return -EIO;
 		}
+		atomic64_inc(&kvm->stat.tdx_page_aug);
 		tdx_account_td_pages(kvm, level);
 		trace_kvm_tdx_page_add(kvm_tdx->tdr_pa, gfn, pfn, level);
+		tdx_event(kvm, KVM_TDX_EVENT_AUG, gfn, pfn, level);
 		return 0;
 	}
 
@@ -2502,21 +4311,22 @@ static int tdx_sept_set_private_spte(struct kvm *kvm, gfn_t gfn,
 		return -EINVAL;
 	}
 
-	source_pa = kvm_tdx->source_pa & ~KVM_TDX_MEASURE_MEMORY_REGION;
-	measure = kvm_tdx->source_pa & KVM_TDX_MEASURE_MEMORY_REGION;
+	/* The page is measured by tdx_init_mem_region(), out of mmu_lock. */
+	source_pa = kvm_tdx->source_pa;
 	kvm_tdx->source_pa = INVALID_PAGE;
 
 	err = tdh_mem_page_add(kvm_tdx->tdr_pa, gpa, tdx_level, hpa,
 			       source_pa, &out);
 	if (KVM_BUG_ON(err, kvm)) {
-		pr_tdx_error(TDH_MEM_PAGE_ADD, err, &out);
+		kvm_pr_tdx_error(kvm, TDH_MEM_PAGE_ADD, err, &out);
 		tdx_unpin(kvm, gfn, pfn, level);
 		return -EIO;
-	} else if (measure)
-		tdx_measure_page(kvm_tdx, gpa, KVM_HPAGE_SIZE(level));
+	}
 
+	atomic64_inc(&kvm->stat.tdx_page_add);
 	tdx_account_td_pages(kvm, level);
 	trace_kvm_tdx_page_add(kvm_tdx->tdr_pa, gfn, pfn, level);
+	tdx_event(kvm, KVM_TDX_EVENT_ADD, gfn, pfn, level);
 	return 0;
 }
 
@@ -2535,15 +4345,23 @@ static int tdx_sept_drop_private_spte(struct kvm *kvm, gfn_t gfn,
 	if (unlikely(!is_hkid_assigned(kvm_tdx))) {
 		/*
 		 * The HKID assigned to this TD was already freed and cache
-		 * was already flushed. We don't have to flush again.
+		 * was already flushed. We don't have to flush again.  The
+		 * batch takes the pin over.
 		 */
-		err = __tdx_reclaim_page(hpa, level, false, 0);
+		if (tdx_reclaim_batch_add(kvm_tdx, pfn, level)) {
+			err = 0;
+		} else {
+			err = tdx_reclaim_page_noclear(hpa, level, false, 0);
+			if (!err) {
+				tdx_clear_page_async(hpa, KVM_HPAGE_SIZE(level));
+				tdx_unpin(kvm, gfn, pfn, level);
+			}
+		}
 		if (!err) {
-			tdx_set_page_present_level(hpa, level);
-			tdx_unpin(kvm, gfn, pfn, level);
 			tdx_unaccount_td_pages(kvm, level);
 			trace_kvm_tdx_page_remove(kvm_tdx->tdr_pa, gfn, pfn,
 						  level);
+			tdx_event(kvm, KVM_TDX_EVENT_REMOVE, gfn, pfn, level);
 		}
 		return 0;
 	}
@@ -2558,9 +4376,10 @@ static int tdx_sept_drop_private_spte(struct kvm *kvm, gfn_t gfn,
 	 */
 	err = tdh_mem_page_remove(kvm_tdx->tdr_pa, gpa, tdx_level, &out);
 	if (KVM_BUG_ON(err, kvm)) {
-		pr_tdx_error(TDH_MEM_PAGE_REMOVE, err, &out);
+		kvm_pr_tdx_error(kvm, TDH_MEM_PAGE_REMOVE, err, &out);
 		return -EIO;
 	}
+	atomic64_inc(&kvm->stat.tdx_page_remove);
 
 	tdx_set_page_present_level(hpa, level);
 	for (i = 0; i < KVM_PAGES_PER_HPAGE(level); i++) {
@@ -2569,6 +4388,7 @@ static int tdx_sept_drop_private_spte(struct kvm *kvm, gfn_t gfn,
 	}
 	tdx_unaccount_td_pages(kvm, level);
 	trace_kvm_tdx_page_remove(kvm_tdx->tdr_pa, gfn, pfn, level);
+	tdx_event(kvm, KVM_TDX_EVENT_REMOVE, gfn, pfn, level);
 	return r;
 }
 
@@ -2586,7 +4406,7 @@ static int tdx_sept_link_private_spt(struct kvm *kvm, gfn_t gfn,
 	if (unlikely(err == (TDX_EPT_ENTRY_NOT_FREE | TDX_OPERAND_ID_RCX))) {
 		err = tdh_mem_sept_rd(kvm_tdx->tdr_pa, gpa, tdx_level, &out);
 		if (KVM_BUG_ON(err, kvm)) {
-			pr_tdx_error(TDH_MEM_SEPT_RD, err, &out);
+			kvm_pr_tdx_error(kvm, TDH_MEM_SEPT_RD, err, &out);
 			return -EIO;
 		}
 		err = TDX_EPT_ENTRY_STATE_INCORRECT | TDX_OPERAND_ID_RCX;
@@ -2606,7 +4426,7 @@ static int tdx_sept_link_private_spt(struct kvm *kvm, gfn_t gfn,
 			return -EAGAIN;
 	}
 	if (KVM_BUG_ON(err, kvm)) {
-		pr_tdx_error(TDH_MEM_SEPT_ADD, err, &out);
+		kvm_pr_tdx_error(kvm, TDH_MEM_SEPT_ADD, err, &out);
 		return -EIO;
 	}
 
@@ -2629,13 +4449,15 @@ static int tdx_sept_split_private_spt(struct kvm *kvm, gfn_t gfn,
 	/* See comment in tdx_sept_set_private_spte() */
 	err = tdh_mem_page_demote(kvm_tdx->tdr_pa, gpa, tdx_level, hpa, &out);
 	if (KVM_BUG_ON(err, kvm)) {
-		pr_tdx_error(TDH_MEM_PAGE_DEMOTE, err, &out);
+		kvm_pr_tdx_error(kvm, TDH_MEM_PAGE_DEMOTE, err, &out);
 		trace_kvm_tdx_page_demote(kvm_tdx->tdr_pa, gfn, hpa >> PAGE_SHIFT, level, -EIO);
 		return -EIO;
 	}
 
 	tdx_account_sept_page(kvm, level - 1);
+	tdx_account_td_pages_demote(kvm, level);
 	trace_kvm_tdx_page_demote(kvm_tdx->tdr_pa, gfn, hpa >> PAGE_SHIFT, level, 0);
+	tdx_event(kvm, KVM_TDX_EVENT_DEMOTE, gfn, hpa >> PAGE_SHIFT, level);
 	return 0;
 }
 
@@ -2661,7 +4483,7 @@ static int tdx_sept_merge_private_spt(struct kvm *kvm, gfn_t gfn,
 		return -EAGAIN;
 	}
 	if (KVM_BUG_ON(err, kvm)) {
-		pr_tdx_error(TDH_MEM_PAGE_PROMOTE, err, &out);
+		kvm_pr_tdx_error(kvm, TDH_MEM_PAGE_PROMOTE, err, &out);
 		trace_kvm_tdx_page_promote(kvm_tdx->tdr_pa, gfn,
 					   __pa(private_spt) >> PAGE_SHIFT, level, -EIO);
 		return -EIO;
@@ -2675,7 +4497,7 @@ static int tdx_sept_merge_private_spt(struct kvm *kvm, gfn_t gfn,
 	err = tdh_phymem_page_wbinvd(set_hkid_to_hpa(__pa(private_spt),
                                  to_kvm_tdx(kvm)->hkid));
 	if (WARN_ON_ONCE(err)) {
-		pr_tdx_error(TDH_PHYMEM_PAGE_WBINVD, err, NULL);
+		kvm_pr_tdx_error(kvm, TDH_PHYMEM_PAGE_WBINVD, err, NULL);
 		trace_kvm_tdx_page_promote(kvm_tdx->tdr_pa, gfn,
 					   __pa(private_spt) >> PAGE_SHIFT, level, -EIO);
 		return -EIO;
@@ -2684,8 +4506,11 @@ static int tdx_sept_merge_private_spt(struct kvm *kvm, gfn_t gfn,
 	tdx_set_page_present(__pa(private_spt));
 	tdx_clear_page(__pa(private_spt), PAGE_SIZE);
 	tdx_unaccount_sept_page(kvm, level - 1);
+	tdx_account_td_pages_promote(kvm, level);
 	trace_kvm_tdx_page_promote(kvm_tdx->tdr_pa, gfn,
 				   __pa(private_spt) >> PAGE_SHIFT, level, 0);
+	tdx_event(kvm, KVM_TDX_EVENT_PROMOTE, gfn,
+		  __pa(private_spt) >> PAGE_SHIFT, level);
 	return 0;
 }
 
@@ -2707,11 +4532,12 @@ static int tdx_sept_zap_private_spte(struct kvm *kvm, gfn_t gfn,
 		return -EAGAIN;
 
 	if (KVM_BUG_ON(err, kvm)) {
-		pr_tdx_error(TDH_MEM_RANGE_BLOCK, err, &out);
+		kvm_pr_tdx_error(kvm, TDH_MEM_RANGE_BLOCK, err, &out);
 		return -EIO;
 	}
 
 	smp_store_release(&kvm_tdx->has_range_blocked, true);
+	tdx_event(kvm, KVM_TDX_EVENT_BLOCK, gfn, 0, level);
 	return 0;
 }
 
@@ -2728,18 +4554,13 @@ static int tdx_sept_zap_private_spte(struct kvm *kvm, gfn_t gfn,
  *   epoch counter.  If the local epoch counter is older than the global epoch
  *   counter, update the local epoch counter and flushes TLB.
  */
-static void tdx_track(struct kvm *kvm)
+static void __tdx_track(struct kvm *kvm)
 {
 	struct kvm_tdx *kvm_tdx = to_kvm_tdx(kvm);
 	struct kvm_vcpu *vcpu;
 	unsigned long i;
 	u64 err;
 
-	KVM_BUG_ON(!is_hkid_assigned(kvm_tdx), kvm);
-	/* If TD isn't finalized, it's before any vcpu running. */
-	if (unlikely(!is_td_finalized(kvm_tdx)))
-		return;
-
 	/*
 	 * tdx_flush_tlb() waits for this function to issue TDH.MEM.TRACK() by
 	 * the counter.  The counter is used instead of bool because multiple
@@ -2760,6 +4581,7 @@ static void tdx_track(struct kvm *kvm)
 	 * retry.
 	 */
 	err = tdh_mem_track(kvm_tdx->tdr_pa);
+	tdx_event(kvm, KVM_TDX_EVENT_TRACK, 0, 0, PG_LEVEL_NONE);
 
 	/* Release remote vcpu waiting for TDH.MEM.TRACK in tdx_flush_tlb(). */
 	atomic_dec(&kvm_tdx->tdh_mem_track);
@@ -2786,8 +4608,50 @@ static void tdx_track(struct kvm *kvm)
 	atomic_dec(&kvm_tdx->doing_track);
 
 	if (KVM_BUG_ON(err, kvm))
-		pr_tdx_error(TDH_MEM_TRACK, err, NULL);
+		kvm_pr_tdx_error(kvm, TDH_MEM_TRACK, err, NULL);
+
+}
+
+/*
+ * Batch TLB tracking of concurrent callers, e.g. vcpus zapping ranges under
+ * the read lock of mmu_lock.  A track epoch which starts after the caller has
+ * blocked its range covers the range.  If such an epoch has already completed
+ * while waiting for the in-flight one, the caller doesn't need its own epoch.
+ */
+static void tdx_track(struct kvm *kvm)
+{
+	struct kvm_tdx *kvm_tdx = to_kvm_tdx(kvm);
+	u64 target;
+
+	KVM_BUG_ON(!is_hkid_assigned(kvm_tdx), kvm);
+	/* If TD isn't finalized, it's before any vcpu running. */
+	if (unlikely(!is_td_finalized(kvm_tdx)))
+		return;
+
+	/* Pairs with smp_store_release() of track_started below. */
+	target = smp_load_acquire(&kvm_tdx->track_started) + 1;
+	for (;;) {
+		if (smp_load_acquire(&kvm_tdx->track_done) >= target)
+			break;
 
+		if (spin_trylock(&kvm_tdx->track_lock)) {
+			if (kvm_tdx->track_done < target) {
+				u64 epoch = kvm_tdx->track_started + 1;
+
+				smp_store_release(&kvm_tdx->track_started, epoch);
+				__tdx_track(kvm);
+				smp_store_release(&kvm_tdx->track_done, epoch);
+				/* Non-atomic stat, serialized by track_lock. */
+				kvm_tdx->stat.track_issued++;
+				spin_unlock(&kvm_tdx->track_lock);
+				return;
+			}
+			spin_unlock(&kvm_tdx->track_lock);
+			break;
+		}
+		cpu_relax();
+	}
+	atomic64_inc(&kvm_tdx->stat.track_coalesced);
 }
 
 static int tdx_sept_unzap_private_spte(struct kvm *kvm, gfn_t gfn,
@@ -2801,6 +4665,7 @@ static int tdx_sept_unzap_private_spte(struct kvm *kvm, gfn_t gfn,
 
 	do {
 		err = tdh_mem_range_unblock(kvm_tdx->tdr_pa, gpa, tdx_level, &out);
+		tdx_seamcall_stat(kvm, TDH_MEM_RANGE_UNBLOCK, err);
 
 		/*
 		 * tdh_mem_range_block() is accompanied with tdx_track() via kvm
@@ -2828,6 +4693,54 @@ static int tdx_sept_unzap_private_spte(struct kvm *kvm, gfn_t gfn,
 	return 0;
 }
 
+/*
+ * Move a mapped private page to @new_pfn, moving KVM's reference to it along.
+ * TDH.MEM.PAGE.RELOCATE requires the page to be blocked and tracked, and maps
+ * the new page on success.  The old page is freed by the TDX module and is
+ * flushed and cleared like any reclaimed page.
+ */
+static int tdx_sept_relocate_private_spte(struct kvm *kvm, gfn_t gfn,
+					  enum pg_level level,
+					  kvm_pfn_t old_pfn, kvm_pfn_t new_pfn)
+{
+	struct kvm_tdx *kvm_tdx = to_kvm_tdx(kvm);
+	hpa_t old_hpa = pfn_to_hpa(old_pfn);
+	hpa_t new_hpa = pfn_to_hpa(new_pfn);
+	gpa_t gpa = gfn_to_gpa(gfn);
+	struct tdx_module_args out;
+	u64 err;
+	int r;
+
+	if (level != PG_LEVEL_4K || !is_hkid_assigned(kvm_tdx) ||
+	    !is_td_finalized(kvm_tdx))
+		return -EBUSY;
+
+	r = tdx_sept_zap_private_spte(kvm, gfn, level);
+	if (r)
+		return r == -EAGAIN ? -EBUSY : r;
+	tdx_track(kvm);
+
+	err = tdh_mem_page_relocate(kvm_tdx->tdr_pa, gpa, new_hpa, &out);
+	if (unlikely(err)) {
+		kvm_pr_tdx_error(kvm, TDH_MEM_PAGE_RELOCATE, err, &out);
+		r = tdx_sept_unzap_private_spte(kvm, gfn, level);
+		return r ? r : -EBUSY;
+	}
+
+	get_page(pfn_to_page(new_pfn));
+	tdx_set_page_np(new_hpa);
+
+	err = tdh_phymem_page_wbinvd(set_hkid_to_hpa(old_hpa, (u16)kvm_tdx->hkid));
+	if (KVM_BUG_ON(err, kvm)) {
+		kvm_pr_tdx_error(kvm, TDH_PHYMEM_PAGE_WBINVD, err, NULL);
+		/* Leak the page as cache might be in-coherent. */
+		return 0;
+	}
+	tdx_clear_page(old_hpa, PAGE_SIZE);
+	put_page(pfn_to_page(old_pfn));
+	return 0;
+}
+
 static int tdx_sept_free_private_spt(struct kvm *kvm, gfn_t gfn,
 				     enum pg_level level, void *private_spt)
 {
@@ -2843,9 +4756,16 @@ static int tdx_sept_free_private_spt(struct kvm *kvm, gfn_t gfn,
 	 * already flushed. We don't have to flush again.
 	 */
 	if (!is_hkid_assigned(kvm_tdx)) {
-		int r;
-
-		r = tdx_reclaim_page(__pa(private_spt), false, 0);
+		struct page *page = virt_to_page(private_spt);
+		int r = 0;
+
+		/* The caller frees the page, the batch takes its own reference. */
+		get_page(page);
+		if (!tdx_reclaim_batch_add(kvm_tdx, page_to_pfn(page),
+					   PG_LEVEL_4K)) {
+			put_page(page);
+			r = tdx_reclaim_page(__pa(private_spt), false, 0);
+		}
 		if (!r) {
 			tdx_unaccount_sept_page(kvm, level);
 			trace_kvm_tdx_sept_remove(kvm_tdx->tdr_pa, gfn,
@@ -2868,7 +4788,7 @@ static int tdx_sept_free_private_spt(struct kvm *kvm, gfn_t gfn,
 		err = tdh_mem_range_block(kvm_tdx->tdr_pa, parent_gpa,
 					  parent_tdx_level, &out);
 		if (KVM_BUG_ON(err, kvm)) {
-			pr_tdx_error(TDH_MEM_RANGE_BLOCK, err, &out);
+			kvm_pr_tdx_error(kvm, TDH_MEM_RANGE_BLOCK, err, &out);
 			return -EIO;
 		}
 	}
@@ -2878,7 +4798,7 @@ static int tdx_sept_free_private_spt(struct kvm *kvm, gfn_t gfn,
 	err = tdh_mem_sept_remove(kvm_tdx->tdr_pa, parent_gpa,
 				  parent_tdx_level, &out);
 	if (KVM_BUG_ON(err, kvm)) {
-		pr_tdx_error(TDH_MEM_SEPT_REMOVE, err, &out);
+		kvm_pr_tdx_error(kvm, TDH_MEM_SEPT_REMOVE, err, &out);
 		return -EIO;
 	}
 	tdx_unaccount_sept_page(kvm, level);
@@ -2886,7 +4806,7 @@ static int tdx_sept_free_private_spt(struct kvm *kvm, gfn_t gfn,
 	err = tdh_phymem_page_wbinvd(set_hkid_to_hpa(__pa(private_spt),
 						     kvm_tdx->hkid));
 	if (WARN_ON_ONCE(err)) {
-		pr_tdx_error(TDH_PHYMEM_PAGE_WBINVD, err, NULL);
+		kvm_pr_tdx_error(kvm, TDH_PHYMEM_PAGE_WBINVD, err, NULL);
 		return -EIO;
 	}
 	tdx_set_page_present(__pa(private_spt));
@@ -2937,17 +4857,67 @@ void tdx_deliver_interrupt(struct kvm_lapic *apic, int delivery_mode,
 	struct kvm_vcpu *vcpu = apic->vcpu;
 	struct vcpu_tdx *tdx = to_tdx(vcpu);
 
-	/* See comment in tdx_protected_apic_has_interrupt(). */
-	tdx->buggy_hlt_workaround = 1;
+	/*
+	 * See comment in tdx_protected_apic_has_interrupt().  Avoid dirtying
+	 * the cache line for every one of a burst of interrupts, e.g. MSIs of
+	 * a multi-queue NIC targeting this vCPU.
+	 */
+	if (!READ_ONCE(tdx->buggy_hlt_workaround))
+		WRITE_ONCE(tdx->buggy_hlt_workaround, 1);
 	/* TDX supports only posted interrupt.  No lapic emulation. */
 	__vmx_deliver_posted_interrupt(vcpu, &tdx->pi_desc, vector);
 }
 
+static unsigned int __read_mostly tdx_fault_around = 16;
+module_param_named(tdx_fault_around, tdx_fault_around, uint, 0644);
+
+/*
+ * After a 4K EPT violation of the guest accepting a page, also AUG the next
+ * pages of the 2M range that are private and already populated in gmem, so
+ * that accepting pages in sequence, e.g. lazy acceptance or clearing a new
+ * heap, doesn't take one exit per page.  The pages are only added pending,
+ * the guest can't use them before accepting them.  Best effort, stop at the
+ * first page that can't be mapped.
+ */
+static void tdx_fault_around_accept(struct kvm_vcpu *vcpu, gpa_t gpa)
+{
+	struct tdx_mig_state *mig_state = to_kvm_tdx(vcpu->kvm)->mig_state;
+	gfn_t gfn = gpa_to_gfn(gpa) & ~kvm_gfn_shared_mask(vcpu->kvm);
+	struct kvm_memory_slot *slot;
+	unsigned long nr, i;
+
+	/* Postcopy pages must be faulted in one by one through userspace. */
+	if (mig_state && READ_ONCE(mig_state->postcopy))
+		return;
+
+	nr = min_t(unsigned long, READ_ONCE(tdx_fault_around),
+		   KVM_PAGES_PER_HPAGE(PG_LEVEL_2M) - 1 -
+		   (gfn & (KVM_PAGES_PER_HPAGE(PG_LEVEL_2M) - 1)));
+	if (!nr)
+		return;
+
+	slot = kvm_vcpu_gfn_to_memslot(vcpu, gfn + 1);
+	if (!slot || !kvm_slot_can_be_private(slot))
+		return;
+
+	nr = kvm_gmem_nr_populated(slot, gfn + 1, nr);
+	for (i = 1; i <= nr; i++) {
+		if (!kvm_mem_is_private(vcpu->kvm, gfn + i))
+			break;
+
+		if (kvm_mmu_map_tdp_page(vcpu, gfn_to_gpa(gfn + i),
+					 PFERR_WRITE_MASK | PFERR_GUEST_ENC_MASK,
+					 PG_LEVEL_4K, false))
+			break;
+	}
+}
+
 static int tdx_handle_ept_violation(struct kvm_vcpu *vcpu)
 {
 	union tdx_ext_exit_qualification ext_exit_qual;
 	unsigned long exit_qual;
 	int err_page_level = 0;
+	int ret;
 
 	ext_exit_qual.full = tdexit_ext_exit_qual(vcpu);
 
@@ -2973,6 +4943,9 @@ static int tdx_handle_ept_violation(struct kvm_vcpu *vcpu)
 		 */
 		exit_qual = tdexit_exit_qual(vcpu) & (~VMX_EPT_RWX_MASK);
 		exit_qual |= EPT_VIOLATION_ACC_WRITE;
+
+		if (unlikely(tdx_mig_postcopy_fault(vcpu, tdexit_gpa(vcpu))))
+			return 0;
 	} else {
 		exit_qual = tdexit_exit_qual(vcpu);
 		if (exit_qual & EPT_VIOLATION_ACC_INSTR) {
@@ -2983,10 +4956,19 @@ static int tdx_handle_ept_violation(struct kvm_vcpu *vcpu)
 			vcpu->run->ex.error_code = exit_qual;
 			return 0;
 		}
+
+		if (exit_qual & EPT_VIOLATION_ACC_WRITE)
+			tdx_mig_shared_write_fault(vcpu);
 	}
 
 	trace_kvm_page_fault(vcpu, tdexit_gpa(vcpu), exit_qual);
-	return __vmx_handle_ept_violation(vcpu, tdexit_gpa(vcpu), exit_qual, err_page_level);
+	ret = __vmx_handle_ept_violation(vcpu, tdexit_gpa(vcpu), exit_qual, err_page_level);
+
+	if (ret > 0 && err_page_level == PG_LEVEL_4K &&
+	    kvm_is_private_gpa(vcpu->kvm, tdexit_gpa(vcpu)))
+		tdx_fault_around_accept(vcpu, tdexit_gpa(vcpu));
+
+	return ret;
 }
 
 static int tdx_handle_ept_misconfig(struct kvm_vcpu *vcpu)
@@ -3027,7 +5009,7 @@ static int tdx_handle_dr_exit(struct kvm_vcpu *vcpu)
 		return kvm_complete_insn_gp(vcpu, 0);
 	}
 
-	dr7 = td_vmcs_read64(to_tdx(vcpu), GUEST_DR7);
+	dr7 = tdx_get_dr7(to_tdx(vcpu));
 	if (dr7 & DR7_GD) {
 		/*
 		 * DR VMEXIT takes precedence over the debug trap,see 25.1.3 in
@@ -3100,15 +5082,21 @@ static int __tdx_handle_exit(struct kvm_vcpu *vcpu, fastpath_t fastpath)
 	union tdx_exit_reason exit_reason = to_tdx(vcpu)->exit_reason;
 
 	/* See the comment of tdh_sept_seamcall(). */
-	if (unlikely(exit_reason.full == (TDX_OPERAND_BUSY | TDX_OPERAND_ID_SEPT)))
+	if (unlikely(exit_reason.full == (TDX_OPERAND_BUSY | TDX_OPERAND_ID_SEPT))) {
+		tdx_seamcall_stat(vcpu->kvm, TDH_VP_ENTER, exit_reason.full);
+		++vcpu->stat.tdx_vp_enter_retries;
 		return 1;
+	}
 
 	/*
 	 * TDH.VP.ENTRY checks TD EPOCH which contend with TDH.MEM.TRACK and
 	 * vcpu TDH.VP.ENTER.
 	 */
-	if (unlikely(exit_reason.full == (TDX_OPERAND_BUSY | TDX_OPERAND_ID_TD_EPOCH)))
+	if (unlikely(exit_reason.full == (TDX_OPERAND_BUSY | TDX_OPERAND_ID_TD_EPOCH))) {
+		tdx_seamcall_stat(vcpu->kvm, TDH_VP_ENTER, exit_reason.full);
+		++vcpu->stat.tdx_vp_enter_retries;
 		return 1;
+	}
 
 	if (unlikely(exit_reason.full == (TDX_INCONSISTENT_MSR | MSR_IA32_TSX_CTRL))) {
 		pr_err_once("TDX module is outdated. Use v1.0.3 or newer.\n");
@@ -3162,7 +5150,8 @@ static int __tdx_handle_exit(struct kvm_vcpu *vcpu, fastpath_t fastpath)
 		return 0;
 	}
 
-	WARN_ON_ONCE(fastpath != EXIT_FASTPATH_NONE);
+	if (fastpath != EXIT_FASTPATH_NONE)
+		return 1;
 
 	switch (exit_reason.basic) {
 	case EXIT_REASON_EXCEPTION_NMI:
@@ -3207,7 +5196,14 @@ static int __tdx_handle_exit(struct kvm_vcpu *vcpu, fastpath_t fastpath)
 
 int tdx_handle_exit(struct kvm_vcpu *vcpu, fastpath_t exit_fastpath)
 {
-	int ret = __tdx_handle_exit(vcpu, exit_fastpath);
+	int ret;
+
+	/* The run loop may stop after a fastpath exit, e.g. on a request. */
+	to_tdx(vcpu)->fastpath_reenter = false;
+	ret = __tdx_handle_exit(vcpu, exit_fastpath);
+
+	if (unlikely(to_tdx(vcpu)->mig_throttle))
+		tdx_mig_throttle(vcpu);
 
 	/* Exit to user space when bus-lock was detected in the guest TD. */
 	if (unlikely(to_tdx(vcpu)->exit_reason.bus_lock_detected)) {
@@ -3425,7 +5421,60 @@ int tdx_get_cpl(struct kvm_vcpu *vcpu)
 	if (!to_tdx(vcpu)->initialized)
 		return 0;
 
-	return VMX_AR_DPL(td_vmcs_read32(to_tdx(vcpu), GUEST_SS_AR_BYTES));
+	return VMX_AR_DPL(tdx_read_guest_seg_ar(to_tdx(vcpu), VCPU_SREG_SS));
+}
+
+#define TDX_SEG_CACHE_IDT	(8 * SEG_FIELD_NR)
+#define TDX_SEG_CACHE_GDT	(TDX_SEG_CACHE_IDT + 1)
+
+static bool tdx_segment_cache_test_set(struct vcpu_tdx *tdx, unsigned int bit)
+{
+	u64 mask = BIT_ULL(bit);
+	bool ret;
+
+	if (!kvm_register_is_available(&tdx->vcpu, VCPU_EXREG_SEGMENTS)) {
+		kvm_register_mark_available(&tdx->vcpu, VCPU_EXREG_SEGMENTS);
+		tdx->segment_cache.bitmask = 0;
+	}
+	ret = tdx->segment_cache.bitmask & mask;
+	tdx->segment_cache.bitmask |= mask;
+	return ret;
+}
+
+static u16 tdx_read_guest_seg_selector(struct vcpu_tdx *tdx, int seg)
+{
+	u16 *p = &tdx->segment_cache.seg[seg].selector;
+
+	if (!tdx_segment_cache_test_set(tdx, seg * SEG_FIELD_NR + SEG_FIELD_SEL))
+		*p = td_vmcs_read16(tdx, kvm_vmx_segment_fields[seg].selector);
+	return *p;
+}
+
+static unsigned long tdx_read_guest_seg_base(struct vcpu_tdx *tdx, int seg)
+{
+	unsigned long *p = &tdx->segment_cache.seg[seg].base;
+
+	if (!tdx_segment_cache_test_set(tdx, seg * SEG_FIELD_NR + SEG_FIELD_BASE))
+		*p = td_vmcs_read64(tdx, kvm_vmx_segment_fields[seg].base);
+	return *p;
+}
+
+static u32 tdx_read_guest_seg_limit(struct vcpu_tdx *tdx, int seg)
+{
+	u32 *p = &tdx->segment_cache.seg[seg].limit;
+
+	if (!tdx_segment_cache_test_set(tdx, seg * SEG_FIELD_NR + SEG_FIELD_LIMIT))
+		*p = td_vmcs_read32(tdx, kvm_vmx_segment_fields[seg].limit);
+	return *p;
+}
+
+static u32 tdx_read_guest_seg_ar(struct vcpu_tdx *tdx, int seg)
+{
+	u32 *p = &tdx->segment_cache.seg[seg].ar;
+
+	if (!tdx_segment_cache_test_set(tdx, seg * SEG_FIELD_NR + SEG_FIELD_AR))
+		*p = td_vmcs_read32(tdx, kvm_vmx_segment_fields[seg].ar_bytes);
+	return *p;
 }
 
 void tdx_cache_reg(struct kvm_vcpu *vcpu, enum kvm_reg reg)
@@ -3497,10 +5546,16 @@ void tdx_cache_reg(struct kvm_vcpu *vcpu, enum kvm_reg reg)
 
 unsigned long tdx_get_rflags(struct kvm_vcpu *vcpu)
 {
+	struct vcpu_tdx *tdx = to_tdx(vcpu);
+
 	if (!is_debug_td(vcpu))
 		return 0;
 
-	return td_vmcs_read64(to_tdx(vcpu), GUEST_RFLAGS);
+	if (!kvm_register_is_available(vcpu, VCPU_EXREG_RFLAGS)) {
+		kvm_register_mark_available(vcpu, VCPU_EXREG_RFLAGS);
+		tdx->rflags = td_vmcs_read64(tdx, GUEST_RFLAGS);
+	}
+	return tdx->rflags;
 }
 
 unsigned long tdx_get_cr2(struct kvm_vcpu *vcpu)
@@ -3531,7 +5586,7 @@ bool tdx_get_if_flag(struct kvm_vcpu *vcpu)
 	if (!is_debug_td(vcpu))
 		return 0;
 
-	return td_vmcs_read64(to_tdx(vcpu), GUEST_RFLAGS) & X86_EFLAGS_IF;
+	return tdx_get_rflags(vcpu) & X86_EFLAGS_IF;
 }
 
 void tdx_set_rflags(struct kvm_vcpu *vcpu, unsigned long rflags)
@@ -3549,7 +5604,9 @@ void tdx_set_rflags(struct kvm_vcpu *vcpu, unsigned long rflags)
 	if (!tdx->initialized)
 		return;
 
-	td_vmcs_write64(tdx, GUEST_RFLAGS, rflags);
+	kvm_register_mark_available(vcpu, VCPU_EXREG_RFLAGS);
+	tdx->rflags = rflags;
+	tdx->debug_dirty |= TDX_DEBUG_DIRTY_RFLAGS;
 }
 
 u64 tdx_get_segment_base(struct kvm_vcpu *vcpu, int seg)
@@ -3557,7 +5614,7 @@ u64 tdx_get_segment_base(struct kvm_vcpu *vcpu, int seg)
 	if (!is_debug_td(vcpu))
 		return 0;
 
-	return td_vmcs_read64(to_tdx(vcpu), kvm_vmx_segment_fields[seg].base);
+	return tdx_read_guest_seg_base(to_tdx(vcpu), seg);
 }
 
 void tdx_get_segment(struct kvm_vcpu *vcpu, struct kvm_segment *var, int seg)
@@ -3570,10 +5627,10 @@ void tdx_get_segment(struct kvm_vcpu *vcpu, struct kvm_segment *var, int seg)
 		return;
 	}
 
-	var->base = td_vmcs_read64(tdx, kvm_vmx_segment_fields[seg].base);
-	var->limit = td_vmcs_read32(tdx, kvm_vmx_segment_fields[seg].limit);
-	var->selector = td_vmcs_read16(tdx, kvm_vmx_segment_fields[seg].selector);
-	ar = td_vmcs_read32(tdx, kvm_vmx_segment_fields[seg].ar_bytes);
+	var->base = tdx_read_guest_seg_base(tdx, seg);
+	var->limit = tdx_read_guest_seg_limit(tdx, seg);
+	var->selector = tdx_read_guest_seg_selector(tdx, seg);
+	ar = tdx_read_guest_seg_ar(tdx, seg);
 
 	vmx_decode_ar_bytes(var, ar);
 }
@@ -3586,50 +5643,67 @@ void tdx_get_cs_db_l_bits(struct kvm_vcpu *vcpu, int *db, int *l)
 	if (KVM_BUG_ON(!is_debug_td(vcpu), vcpu->kvm))
 		return;
 
-	ar = td_vmcs_read32(to_tdx(vcpu),
-			    kvm_vmx_segment_fields[VCPU_SREG_CS].ar_bytes);
+	ar = tdx_read_guest_seg_ar(to_tdx(vcpu), VCPU_SREG_CS);
 	*db = (ar >> 14) & 1;
 	*l = (ar >> 13) & 1;
 }
 
 void tdx_get_idt(struct kvm_vcpu *vcpu, struct desc_ptr *dt)
 {
+	struct vcpu_tdx *tdx = to_tdx(vcpu);
+
 	if (!is_debug_td(vcpu)) {
 		memset(dt, 0, sizeof(*dt));
 		return;
 	}
 
-	dt->size = td_vmcs_read32(to_tdx(vcpu), GUEST_IDTR_LIMIT);
-	dt->address = td_vmcs_read64(to_tdx(vcpu), GUEST_IDTR_BASE);
+	if (!tdx_segment_cache_test_set(tdx, TDX_SEG_CACHE_IDT)) {
+		tdx->segment_cache.idt.size = td_vmcs_read32(tdx, GUEST_IDTR_LIMIT);
+		tdx->segment_cache.idt.address = td_vmcs_read64(tdx, GUEST_IDTR_BASE);
+	}
+	*dt = tdx->segment_cache.idt;
 }
 
 void tdx_set_idt(struct kvm_vcpu *vcpu, struct desc_ptr *dt)
 {
+	struct vcpu_tdx *tdx = to_tdx(vcpu);
+
 	if (!is_debug_td(vcpu))
 		return;
 
-	td_vmcs_write32(to_tdx(vcpu), GUEST_IDTR_LIMIT,  dt->size);
-	td_vmcs_write64(to_tdx(vcpu), GUEST_IDTR_BASE, dt->address);
+	td_vmcs_write32(tdx, GUEST_IDTR_LIMIT,  dt->size);
+	td_vmcs_write64(tdx, GUEST_IDTR_BASE, dt->address);
+	tdx_segment_cache_test_set(tdx, TDX_SEG_CACHE_IDT);
+	tdx->segment_cache.idt = *dt;
 }
 
 void tdx_get_gdt(struct kvm_vcpu *vcpu, struct desc_ptr *dt)
 {
+	struct vcpu_tdx *tdx = to_tdx(vcpu);
+
 	if (!is_debug_td(vcpu)) {
 		memset(dt, 0, sizeof(*dt));
 		return;
 	}
 
-	dt->size = td_vmcs_read32(to_tdx(vcpu), GUEST_GDTR_LIMIT);
-	dt->address = td_vmcs_read64(to_tdx(vcpu), GUEST_GDTR_BASE);
+	if (!tdx_segment_cache_test_set(tdx, TDX_SEG_CACHE_GDT)) {
+		tdx->segment_cache.gdt.size = td_vmcs_read32(tdx, GUEST_GDTR_LIMIT);
+		tdx->segment_cache.gdt.address = td_vmcs_read64(tdx, GUEST_GDTR_BASE);
+	}
+	*dt = tdx->segment_cache.gdt;
 }
 
 void tdx_set_gdt(struct kvm_vcpu *vcpu, struct desc_ptr *dt)
 {
+	struct vcpu_tdx *tdx = to_tdx(vcpu);
+
 	if (!is_debug_td(vcpu))
 		return;
 
-	td_vmcs_write32(to_tdx(vcpu), GUEST_GDTR_LIMIT, dt->size);
-	td_vmcs_write64(to_tdx(vcpu), GUEST_GDTR_BASE, dt->address);
+	td_vmcs_write32(tdx, GUEST_GDTR_LIMIT, dt->size);
+	td_vmcs_write64(tdx, GUEST_GDTR_BASE, dt->address);
+	tdx_segment_cache_test_set(tdx, TDX_SEG_CACHE_GDT);
+	tdx->segment_cache.gdt = *dt;
 }
 void tdx_inject_exception(struct kvm_vcpu *vcpu)
 {
@@ -3760,7 +5834,7 @@ void tdx_sync_dirty_debug_regs(struct kvm_vcpu *vcpu)
 	vcpu->arch.dr6 = td_state_read64(tdx_vcpu, TD_VCPU_DR6);
 	tdx_vcpu->dr6 = vcpu->arch.dr6;
 
-	vcpu->arch.dr7 = td_vmcs_read64(to_tdx(vcpu), GUEST_DR7);
+	vcpu->arch.dr7 = tdx_get_dr7(tdx_vcpu);
 
 	vcpu->arch.switch_db_regs &= ~KVM_DEBUGREG_WONT_EXIT;
 	td_vmcs_setbit32(tdx_vcpu,
@@ -3777,7 +5851,12 @@ void tdx_update_exception_bitmap(struct kvm_vcpu *vcpu)
 	if (!is_debug_td(vcpu) || !tdx->initialized)
 		return;
 
-	eb = td_vmcs_read32(tdx, EXCEPTION_BITMAP);
+	/* Only KVM writes the exception bitmap, read it once. */
+	if (!tdx->exception_bitmap_valid) {
+		tdx->exception_bitmap = td_vmcs_read32(tdx, EXCEPTION_BITMAP);
+		tdx->exception_bitmap_valid = true;
+	}
+	eb = tdx->exception_bitmap;
 	new_eb = eb & ~((1u << DB_VECTOR) | (1u << BP_VECTOR));
 
 	/*
@@ -3790,27 +5869,83 @@ void tdx_update_exception_bitmap(struct kvm_vcpu *vcpu)
 	if (tdx_kvm_use_dr(vcpu) || tdx->emulate_inject_bp)
 		new_eb |= (1u << DB_VECTOR);
 
-	if (vcpu->guest_debug & KVM_GUESTDBG_USE_SW_BP)
-		new_eb |= (1u << BP_VECTOR);
+	if (vcpu->guest_debug & KVM_GUESTDBG_USE_SW_BP)
+		new_eb |= (1u << BP_VECTOR);
+
+	/*
+	 * Notice for nested support:
+	 * No nested supporting due to TDX module doesn't
+	 * support it so far, we should consult
+	 * vmx_update_exception_bitmap() when nested support
+	 * become ready in future.
+	 */
+
+	if (new_eb != eb) {
+		tdx->exception_bitmap = new_eb;
+		tdx->debug_dirty |= TDX_DEBUG_DIRTY_EXCEPTION_BITMAP;
+	}
+}
+
+/*
+ * KVM_TDX_CAPABILITIES result, built from the TDX module's info on first use
+ * and rebuilt when a TD-preserving module update changed it.  Protected by
+ * tdx_caps_lock.
+ */
+static struct kvm_tdx_capabilities *tdx_caps;
+static unsigned int tdx_caps_gen;
+static DEFINE_MUTEX(tdx_caps_lock);
+
+static int tdx_caps_update(void)
+{
+	const struct tdsysinfo_struct *tdsysinfo;
+	struct kvm_tdx_capabilities *caps;
+	unsigned int gen;
+
+	lockdep_assert_held(&tdx_caps_lock);
+
+	gen = tdx_module_generation();
+	if (tdx_caps && tdx_caps_gen == gen)
+		return 0;
+
+	tdsysinfo = tdx_get_sysinfo();
+	if (!tdsysinfo)
+		return -EOPNOTSUPP;
 
 	/*
-	 * Notice for nested support:
-	 * No nested supporting due to TDX module doesn't
-	 * support it so far, we should consult
-	 * vmx_update_exception_bitmap() when nested support
-	 * become ready in future.
+	 * tdx_info sizes the TDCS/TDVPS pages of all TDs, including the ones
+	 * the updated module imported from the old one.  A TD-preserving
+	 * update can't change them.
 	 */
+	WARN_ON_ONCE(tdsysinfo->tdcs_base_size / PAGE_SIZE != tdx_info.nr_tdcs_pages ||
+		     tdsysinfo->tdvps_base_size / PAGE_SIZE - 1 != tdx_info.nr_tdvpx_pages);
+
+	caps = kzalloc(struct_size(caps, cpuid_configs,
+				   tdsysinfo->num_cpuid_config), GFP_KERNEL);
+	if (!caps)
+		return -ENOMEM;
 
-	if (new_eb != eb)
-		td_vmcs_write32(tdx, EXCEPTION_BITMAP, new_eb);
+	caps->attrs_fixed0 = tdsysinfo->attributes_fixed0;
+	caps->attrs_fixed1 = tdsysinfo->attributes_fixed1;
+	caps->xfam_fixed0 = tdsysinfo->xfam_fixed0;
+	caps->xfam_fixed1 = tdsysinfo->xfam_fixed1;
+	caps->supported_gpaw = TDX_CAP_GPAW_48 |
+		((kvm_get_shadow_phys_bits() >= 52 &&
+		  cpu_has_vmx_ept_5levels()) ? TDX_CAP_GPAW_52 : 0);
+	caps->nr_cpuid_configs = tdsysinfo->num_cpuid_config;
+	memcpy(caps->cpuid_configs, tdsysinfo->cpuid_configs,
+	       tdsysinfo->num_cpuid_config * sizeof(struct tdx_cpuid_config));
+
+	kfree(tdx_caps);
+	tdx_caps = caps;
+	tdx_caps_gen = gen;
+	return 0;
 }
 
 static int tdx_get_capabilities(struct kvm_tdx_cmd *cmd)
 {
 	struct kvm_tdx_capabilities __user *user_caps;
-	const struct tdsysinfo_struct *tdsysinfo;
-	struct kvm_tdx_capabilities *caps = NULL;
-	int ret = 0;
+	u32 nr_cpuid_configs;
+	int ret;
 
 	BUILD_BUG_ON(sizeof(struct kvm_tdx_cpuid_config) !=
 		     sizeof(struct tdx_cpuid_config));
@@ -3818,50 +5953,27 @@ static int tdx_get_capabilities(struct kvm_tdx_cmd *cmd)
 	if (cmd->flags)
 		return -EINVAL;
 
-	tdsysinfo = tdx_get_sysinfo();
-	if (!tdsysinfo)
-		return -EOPNOTSUPP;
-
-	caps = kmalloc(sizeof(*caps), GFP_KERNEL);
-	if (!caps)
-		return -ENOMEM;
-
+	/* Only nr_cpuid_configs is an input, don't copy in the whole struct. */
 	user_caps = (void __user *)cmd->data;
-	if (copy_from_user(caps, user_caps, sizeof(*caps))) {
-		ret = -EFAULT;
+	if (get_user(nr_cpuid_configs, &user_caps->nr_cpuid_configs))
+		return -EFAULT;
+
+	mutex_lock(&tdx_caps_lock);
+	ret = tdx_caps_update();
+	if (ret)
 		goto out;
-	}
 
-	if (caps->nr_cpuid_configs < tdsysinfo->num_cpuid_config) {
+	if (nr_cpuid_configs < tdx_caps->nr_cpuid_configs) {
 		ret = -E2BIG;
 		goto out;
 	}
 
-	*caps = (struct kvm_tdx_capabilities) {
-		.attrs_fixed0 = tdsysinfo->attributes_fixed0,
-		.attrs_fixed1 = tdsysinfo->attributes_fixed1,
-		.xfam_fixed0 = tdsysinfo->xfam_fixed0,
-		.xfam_fixed1 = tdsysinfo->xfam_fixed1,
-		.supported_gpaw = TDX_CAP_GPAW_48 |
-		(kvm_get_shadow_phys_bits() >= 52 &&
-		 cpu_has_vmx_ept_5levels()) ? TDX_CAP_GPAW_52 : 0,
-		.nr_cpuid_configs = tdsysinfo->num_cpuid_config,
-		.padding = 0,
-	};
-
-	if (copy_to_user(user_caps, caps, sizeof(*caps))) {
-		ret = -EFAULT;
-		goto out;
-	}
-	if (copy_to_user(user_caps->cpuid_configs, &tdsysinfo->cpuid_configs,
-			 tdsysinfo->num_cpuid_config *
-			 sizeof(struct tdx_cpuid_config))) {
+	if (copy_to_user(user_caps, tdx_caps,
+			 struct_size(tdx_caps, cpuid_configs,
+				     tdx_caps->nr_cpuid_configs)))
 		ret = -EFAULT;
-	}
-
 out:
-	/* kfree() accepts NULL. */
-	kfree(caps);
+	mutex_unlock(&tdx_caps_lock);
 	return ret;
 }
 
@@ -4068,16 +6180,11 @@ static int __tdx_td_init(struct kvm *kvm, struct td_params *td_params,
 	u64 err;
 
 	*seamcall_err = 0;
-	ret = tdx_guest_keyid_alloc();
-	if (ret < 0)
-		return ret;
-	kvm_tdx->hkid = ret;
-	kvm_tdx->misc_cg = get_current_misc_cg();
-	ret = misc_cg_try_charge(MISC_CG_RES_TDX, kvm_tdx->misc_cg, 1);
+	ret = tdx_hkid_alloc(kvm_tdx);
 	if (ret)
-		goto free_hkid;
+		return ret;
 
-	va = __get_free_page(GFP_KERNEL_ACCOUNT);
+	va = tdx_alloc_ctrl_page();
 	if (!va)
 		goto free_hkid;
 	tdr_pa = __pa(va);
@@ -4087,7 +6194,7 @@ static int __tdx_td_init(struct kvm *kvm, struct td_params *td_params,
 	if (!tdcs_pa)
 		goto free_tdr;
 	for (i = 0; i < tdx_info.nr_tdcs_pages; i++) {
-		va = __get_free_page(GFP_KERNEL_ACCOUNT);
+		va = tdx_alloc_ctrl_page();
 		if (!va)
 			goto free_tdcs;
 		tdcs_pa[i] = __pa(va);
@@ -4103,9 +6210,9 @@ static int __tdx_td_init(struct kvm *kvm, struct td_params *td_params,
 	 * program all packages for host key id.  Check it.
 	 */
 	for_each_present_cpu(i)
-		cpumask_set_cpu(topology_physical_package_id(i), packages);
+		cpumask_set_cpu(topology_logical_package_id(i), packages);
 	for_each_online_cpu(i)
-		cpumask_clear_cpu(topology_physical_package_id(i), packages);
+		cpumask_clear_cpu(topology_logical_package_id(i), packages);
 	if (!cpumask_empty(packages)) {
 		ret = -EIO;
 		/*
@@ -4129,42 +6236,32 @@ static int __tdx_td_init(struct kvm *kvm, struct td_params *td_params,
 	 * APIs to acquire the lock of KOT:
 	 * TDH.MNG.CREATE, TDH.MNG.KEY.FREEID, TDH.MNG.VPFLUSHDONE, and
 	 * TDH.PHYMEM.CACHE.WB.
+	 *
+	 * Only TDH.PHYMEM.CACHE.WB holds it long, see tdx_kot_lock.
 	 */
-	mutex_lock(&tdx_lock);
+	down_read(&tdx_kot_lock);
 	err = tdh_mng_create(tdr_pa, kvm_tdx->hkid);
-	mutex_unlock(&tdx_lock);
+	up_read(&tdx_kot_lock);
 	if (err == TDX_RND_NO_ENTROPY) {
 		ret = -EAGAIN;
 		goto free_packages;
 	}
 	if (WARN_ON_ONCE(err)) {
-		pr_tdx_error(TDH_MNG_CREATE, err, NULL);
+		kvm_pr_tdx_error(kvm, TDH_MNG_CREATE, err, NULL);
 		ret = -EIO;
 		goto free_packages;
 	}
 	kvm_tdx->tdr_pa = tdr_pa;
 	tdx_account_ctl_page(kvm);
 
-	for_each_online_cpu(i) {
-		int pkg = topology_physical_package_id(i);
-
-		if (cpumask_test_and_set_cpu(pkg, packages))
-			continue;
-
-		/*
-		 * Program the memory controller in the package with an
-		 * encryption key associated to a TDX private host key id
-		 * assigned to this TDR.  Concurrent operations on same memory
-		 * controller results in TDX_OPERAND_BUSY.  Avoid this race by
-		 * mutex.
-		 */
-		mutex_lock(&tdx_mng_key_config_lock[pkg]);
-		ret = smp_call_on_cpu(i, tdx_do_tdh_mng_key_config,
-				      &kvm_tdx->tdr_pa, true);
-		mutex_unlock(&tdx_mng_key_config_lock[pkg]);
-		if (ret)
-			break;
-	}
+	/*
+	 * Program the memory controller in each package with an encryption key
+	 * associated to a TDX private host key id assigned to this TDR, on all
+	 * packages in parallel.  Concurrent operations on same memory
+	 * controller results in TDX_OPERAND_BUSY.  Avoid this race by the
+	 * per-package mutex.
+	 */
+	ret = tdx_on_each_package(tdx_do_tdh_mng_key_config, &kvm_tdx->tdr_pa);
 	if (!ret)
 		atomic_inc(&nr_configured_hkid);
 	cpus_read_unlock();
@@ -4183,7 +6280,7 @@ static int __tdx_td_init(struct kvm *kvm, struct td_params *td_params,
 			goto teardown;
 		}
 		if (WARN_ON_ONCE(err)) {
-			pr_tdx_error(TDH_MNG_ADDCX, err, NULL);
+			kvm_pr_tdx_error(kvm, TDH_MNG_ADDCX, err, NULL);
 			ret = -EIO;
 			goto teardown;
 		}
@@ -4204,7 +6301,7 @@ static int __tdx_td_init(struct kvm *kvm, struct td_params *td_params,
 			ret = -EINVAL;
 			goto teardown;
 		} else if (WARN_ON_ONCE(err)) {
-			pr_tdx_error(TDH_MNG_INIT, err, &out);
+			kvm_pr_tdx_error(kvm, TDH_MNG_INIT, err, &out);
 			ret = -EIO;
 			goto teardown;
 		}
@@ -4377,52 +6474,69 @@ void tdx_flush_tlb_current(struct kvm_vcpu *vcpu)
 	tdx_track(vcpu->kvm);
 }
 
-void tdx_gmem_invalidate(struct kvm *kvm, kvm_pfn_t start, kvm_pfn_t end)
+/*
+ * TDH.PHYMEM.PAGE.WBINVD takes a single 4K page, so a 2M chunk costs 512 of
+ * them.
+ */
+static void tdx_wbinvd_private_chunk(struct kvm *kvm, hpa_t pa, hpa_t size)
 {
-	struct kvm_tdx *kvm_tdx = to_kvm_tdx(kvm);
-	hpa_t s = pfn_to_hpa(start);
-	hpa_t e = pfn_to_hpa(end);
-	hpa_t pa;
-
-	if (is_hkid_assigned(kvm_tdx)) {
-		hpa_t s_hkid = set_hkid_to_hpa(s, (u16)kvm_tdx->hkid);
-		hpa_t e_hkid = set_hkid_to_hpa(e, (u16)kvm_tdx->hkid);
-		u64 err;
-
-		for (pa = s_hkid; pa < e_hkid; pa += PAGE_SIZE) {
-			err = tdh_phymem_page_wbinvd(pa);
-			if (KVM_BUG_ON(err, kvm)) {
-				hpa_t tmp;
+	u16 hkid = (u16)to_kvm_tdx(kvm)->hkid;
+	hpa_t i;
+	u64 err;
 
-				pr_tdx_error(TDH_PHYMEM_PAGE_WBINVD, err, NULL);
-				/* Leak the page as cache might be in-coherent. */
-				tmp = pa & ((1ULL << boot_cpu_data.x86_phys_bits) - 1);
-				get_page(pfn_to_page(PHYS_PFN(tmp)));
-			}
+	for (i = 0; i < size; i += PAGE_SIZE) {
+		err = tdh_phymem_page_wbinvd(set_hkid_to_hpa(pa + i, hkid));
+		if (KVM_BUG_ON(err, kvm)) {
+			kvm_pr_tdx_error(kvm, TDH_PHYMEM_PAGE_WBINVD, err, NULL);
+			/* Leak the page as cache might be in-coherent. */
+			get_page(pfn_to_page(PHYS_PFN(pa + i)));
 		}
 	}
+}
 
-	pa = s;
-	while (pa < e) {
-		const hpa_t hpage_size = KVM_HPAGE_SIZE(PG_LEVEL_2M);
-		hpa_t size = PAGE_SIZE;
+/*
+ * Called per guest_memfd folio, e.g. once a private to shared conversion
+ * punched a hole.  Write back and clear the range in 2M chunks, handing each
+ * chunk to the background clearing as soon as it's written back, so that the
+ * clearing of a chunk overlaps with the write back of the next one.  The
+ * clearing work picks up all the chunks queued meanwhile, i.e. batches the
+ * clearing of back to back conversions.
+ */
+void tdx_gmem_invalidate(struct kvm *kvm, kvm_pfn_t start, kvm_pfn_t end)
+{
+	const hpa_t hpage_size = KVM_HPAGE_SIZE(PG_LEVEL_2M);
+	bool hkid_assigned = is_hkid_assigned(to_kvm_tdx(kvm));
+	hpa_t pa = pfn_to_hpa(start);
+	hpa_t e = pfn_to_hpa(end);
+	hpa_t size;
 
-		if (!(pa % hpage_size) && pa + hpage_size <= end)
-			size = hpage_size;
+	while (pa < e) {
+		size = min(ALIGN(pa + 1, hpage_size), e) - pa;
+		if (hkid_assigned)
+			tdx_wbinvd_private_chunk(kvm, pa, size);
+		tdx_clear_page_async(pa, size);
 
-		tdx_clear_page(pa, size);
 		pa += size;
+		if (pa < e)
+			cond_resched();
 	}
 }
 
 #define TDX_SEPT_PFERR	(PFERR_WRITE_MASK | PFERR_GUEST_ENC_MASK)
 
+/*
+ * Number of source pages pinned at once by KVM_TDX_INIT_MEM_REGION.  A batch
+ * never crosses a 2M boundary of the GPA, so that it is covered by a single
+ * last level Secure-EPT page table.
+ */
+#define TDX_INIT_MEM_REGION_BATCH	PTRS_PER_PMD
+
 static int tdx_init_mem_region(struct kvm *kvm, struct kvm_tdx_cmd *cmd)
 {
 	struct kvm_tdx *kvm_tdx = to_kvm_tdx(kvm);
 	struct kvm_tdx_init_mem_region region;
 	struct kvm_vcpu *vcpu;
-	struct page *page;
+	struct page **pages;
 	u64 error_code;
 	int idx, ret = 0;
 	bool added = false;
@@ -4451,16 +6565,32 @@ static int tdx_init_mem_region(struct kvm *kvm, struct kvm_tdx_cmd *cmd)
 	    !kvm_is_private_gpa(kvm, region.gpa + (region.nr_pages << PAGE_SHIFT)))
 		return -EINVAL;
 
+	pages = kcalloc(TDX_INIT_MEM_REGION_BATCH, sizeof(*pages),
+			GFP_KERNEL_ACCOUNT);
+	if (!pages)
+		return -ENOMEM;
+
 	vcpu = kvm_get_vcpu(kvm, 0);
-	if (mutex_lock_killable(&vcpu->mutex))
+	if (mutex_lock_killable(&vcpu->mutex)) {
+		kfree(pages);
 		return -EINTR;
+	}
 
 	vcpu_load(vcpu);
 	idx = srcu_read_lock(&kvm->srcu);
 
 	kvm_mmu_reload(vcpu);
 
+	/*
+	 * TDH.MEM.PAGE.ADD supports only 4K page.  The TDP MMU merges the 4K
+	 * mappings into a large page (TDH.MEM.PAGE.PROMOTE) once the TD runs.
+	 */
+	error_code = TDX_SEPT_PFERR;
+	error_code |= (PG_LEVEL_4K << PFERR_LEVEL_START_BIT) & PFERR_LEVEL_MASK;
+
 	while (region.nr_pages) {
+		int nr_pages, nr_pinned, i;
+
 		if (signal_pending(current)) {
 			ret = -ERESTARTSYS;
 			break;
@@ -4469,38 +6599,59 @@ static int tdx_init_mem_region(struct kvm *kvm, struct kvm_tdx_cmd *cmd)
 		if (need_resched())
 			cond_resched();
 
-		/* Pin the source page. */
-		ret = get_user_pages_fast(region.source_addr, 1, 0, &page);
+		/* Pin the source pages up to the next 2M boundary of the GPA. */
+		nr_pages = TDX_INIT_MEM_REGION_BATCH -
+			(gpa_to_gfn(region.gpa) & (TDX_INIT_MEM_REGION_BATCH - 1));
+		nr_pages = min_t(u64, nr_pages, region.nr_pages);
+		ret = get_user_pages_fast(region.source_addr, nr_pages, 0, pages);
 		if (ret < 0)
 			break;
-		if (ret != 1) {
+		if (!ret) {
 			ret = -ENOMEM;
 			break;
 		}
+		nr_pinned = ret;
+		ret = 0;
 
-		kvm_tdx->source_pa = pfn_to_hpa(page_to_pfn(page)) |
-				     (cmd->flags & KVM_TDX_MEASURE_MEMORY_REGION);
+		/*
+		 * The pages are added (and measured) in GPA order, as the TD
+		 * measurement depends on the order of TDH.MEM.PAGE.ADD and
+		 * TDH.MR.EXTEND.  The TDX module serializes both on the TD, so
+		 * they can't overlap either.  But the 16 TDH.MR.EXTEND of a
+		 * page are issued here rather than in the fault path, so that
+		 * mmu_lock is held for TDH.MEM.PAGE.ADD only.
+		 */
+		for (i = 0; i < nr_pinned; i++) {
+			kvm_tdx->source_pa = pfn_to_hpa(page_to_pfn(pages[i]));
+
+			ret = kvm_mmu_map_tdp_page(vcpu, region.gpa, error_code,
+						   PG_LEVEL_4K, false);
+			if (ret)
+				break;
+
+			/* Measure only if the page was just added. */
+			if (kvm_tdx->source_pa == INVALID_PAGE &&
+			    (cmd->flags & KVM_TDX_MEASURE_MEMORY_REGION))
+				tdx_measure_page(kvm_tdx, region.gpa, PAGE_SIZE);
+			kvm_tdx->source_pa = INVALID_PAGE;
+
+			region.source_addr += PAGE_SIZE;
+			region.gpa += PAGE_SIZE;
+			region.nr_pages--;
+			added = true;
+		}
 
-		/* TODO: large page support. */
-		error_code = TDX_SEPT_PFERR;
-		error_code |= (PG_LEVEL_4K << PFERR_LEVEL_START_BIT) &
-			PFERR_LEVEL_MASK;
-		ret = kvm_mmu_map_tdp_page(vcpu, region.gpa, error_code,
-					   PG_LEVEL_4K, false);
-		put_page(page);
+		for (i = 0; i < nr_pinned; i++)
+			put_page(pages[i]);
 		if (ret)
 			break;
-
-		region.source_addr += PAGE_SIZE;
-		region.gpa += PAGE_SIZE;
-		region.nr_pages--;
-		added = true;
 	}
 
 	srcu_read_unlock(&kvm->srcu, idx);
 	vcpu_put(vcpu);
 
 	mutex_unlock(&vcpu->mutex);
+	kfree(pages);
 
 	if (added && region.nr_pages > 0)
 		ret = -EAGAIN;
@@ -4520,7 +6671,7 @@ static int tdx_td_finalizemr(struct kvm *kvm)
 
 	err = tdh_mr_finalize(kvm_tdx->tdr_pa);
 	if (WARN_ON_ONCE(err)) {
-		pr_tdx_error(TDH_MR_FINALIZE, err, NULL);
+		kvm_pr_tdx_error(kvm, TDH_MR_FINALIZE, err, NULL);
 		return -EIO;
 	}
 
@@ -4604,7 +6755,7 @@ static int tdx_servtd_do_bind(struct kvm_tdx *usertd_tdx,
 			      servtd->type,
 			      &out);
 	if (KVM_BUG_ON(err, &usertd_tdx->kvm)) {
-		pr_tdx_error(TDH_SERVTD_BIND, err, &out);
+		kvm_pr_tdx_error(&usertd_tdx->kvm, TDH_SERVTD_BIND, err, &out);
 		return -EIO;
 	}
 
@@ -4618,33 +6769,37 @@ static int tdx_servtd_do_bind(struct kvm_tdx *usertd_tdx,
 static int tdx_servtd_add_binding_slot(struct kvm_tdx *servtd_tdx,
 				       struct tdx_binding_slot *slot)
 {
-	int i, ret = 0;
+	u32 req_id;
+	int ret;
 
-	spin_lock(&servtd_tdx->binding_slot_lock);
-	for (i = 0; i < SERVTD_SLOTS_MAX; i++) {
-		if (slot == servtd_tdx->usertd_binding_slots[i])
-			goto out_unlock;
+	lockdep_assert_held(&tdx_servtd_binding_lock);
 
-		if (!servtd_tdx->usertd_binding_slots[i])
-			break;
-	}
+	if (slot->servtd_tdx == servtd_tdx)
+		return 0;
 
 	/*
-	 * Unlikely. The arrary should be big enough to have an
-	 * entry for each TD on the same host to add its binding
-	 * slot.
+	 * Bound to another servtd instance before, e.g. a new MigTD.  The
+	 * doorbells stop ringing, they are set up again for the new one.
 	 */
-	if (i == SERVTD_SLOTS_MAX) {
-		ret = -EBUSY;
-		goto out_unlock;
+	if (slot->servtd_tdx) {
+		tdx_servtd_doorbell_replace(&slot->servtd_tdx->kvm,
+					    &slot->servtd_doorbell, NULL);
+		xa_erase(&slot->servtd_tdx->usertd_binding_slots, slot->req_id);
 	}
+	slot->servtd_tdx = NULL;
+
+	/*
+	 * Unlikely to be full. There should be an entry for each TD on the
+	 * same host to add its binding slot.
+	 */
+	ret = xa_alloc(&servtd_tdx->usertd_binding_slots, &req_id, slot,
+		       XA_LIMIT(0, SERVTD_SLOTS_MAX - 1), GFP_KERNEL_ACCOUNT);
+	if (ret)
+		return ret;
 
-	servtd_tdx->usertd_binding_slots[i] = slot;
 	slot->servtd_tdx = servtd_tdx;
-	slot->req_id = i;
-out_unlock:
-	spin_unlock(&servtd_tdx->binding_slot_lock);
-	return ret;
+	slot->req_id = req_id;
+	return 0;
 }
 
 static int tdx_servtd_bind(struct kvm *usertd_kvm, struct kvm_tdx_cmd *cmd)
@@ -4678,14 +6833,212 @@ static int tdx_servtd_bind(struct kvm *usertd_kvm, struct kvm_tdx_cmd *cmd)
 	slot_id = servtd.type;
 	slot = &usertd_tdx->binding_slots[slot_id];
 
+	mutex_lock(&tdx_servtd_binding_lock);
 	ret = tdx_servtd_do_bind(usertd_tdx, servtd_tdx, &servtd, slot);
-	if (ret)
-		return ret;
+	if (!ret)
+		ret = tdx_servtd_add_binding_slot(servtd_tdx, slot);
+	mutex_unlock(&tdx_servtd_binding_lock);
+
+	return ret;
+}
+
+/*
+ * A doorbell is rung by a write to its GPA in the TD owning its MMIO bus, and
+ * raises an interrupt in the other TD of the binding.  The user TD rings the
+ * servtd as long as the slot is still bound to the same servtd, the servtd
+ * rings the user TD as long as the slot is still in its usertd_binding_slots.
+ * Either way, the peer can't be freed before a grace period, see
+ * tdx_binding_slots_cleanup().
+ */
+struct tdx_servtd_doorbell {
+	struct kvm_io_device dev;
+	gpa_t gpa;
+	struct tdx_binding_slot *slot;
+	/* The servtd for the doorbell of the user TD, NULL for the servtd's */
+	struct kvm_tdx *servtd_tdx;
+	u32 req_id;
+	u16 type;
+	struct kvm_lapic_irq irq;
+};
+
+static struct tdx_servtd_doorbell *to_doorbell(struct kvm_io_device *dev)
+{
+	return container_of(dev, struct tdx_servtd_doorbell, dev);
+}
+
+static struct kvm_tdx *tdx_servtd_doorbell_peer(struct kvm_tdx *kvm_tdx,
+						struct tdx_servtd_doorbell *db)
+{
+	struct tdx_binding_slot *slot = db->slot;
+
+	if (db->servtd_tdx)
+		return READ_ONCE(slot->servtd_tdx) == db->servtd_tdx ?
+		       db->servtd_tdx : NULL;
+
+	if (xa_load(&kvm_tdx->usertd_binding_slots, db->req_id) != slot)
+		return NULL;
 
-	return tdx_servtd_add_binding_slot(servtd_tdx, slot);
+	return container_of(slot - db->type, struct kvm_tdx, binding_slots[0]);
+}
+
+static int tdx_servtd_doorbell_write(struct kvm_vcpu *vcpu,
+				     struct kvm_io_device *dev, gpa_t addr,
+				     int len, const void *val)
+{
+	struct tdx_servtd_doorbell *db = to_doorbell(dev);
+	struct kvm_tdx *peer;
+	struct kvm *kvm;
+
+	if (addr != db->gpa)
+		return -EOPNOTSUPP;
+
+	rcu_read_lock();
+	peer = tdx_servtd_doorbell_peer(to_kvm_tdx(vcpu->kvm), db);
+	/* Not while the peer is being destroyed, its vCPUs may be gone. */
+	kvm = peer && kvm_get_kvm_safe(&peer->kvm) ? &peer->kvm : NULL;
+	rcu_read_unlock();
+
+	if (kvm) {
+		kvm_irq_delivery_to_apic(kvm, NULL, &db->irq, NULL);
+		kvm_put_kvm(kvm);
+	}
+
+	return 0;
+}
+
+static void tdx_servtd_doorbell_destructor(struct kvm_io_device *dev)
+{
+	kfree(to_doorbell(dev));
+}
+
+static const struct kvm_io_device_ops tdx_servtd_doorbell_ops = {
+	.write = tdx_servtd_doorbell_write,
+	.destructor = tdx_servtd_doorbell_destructor,
+};
+
+static struct tdx_servtd_doorbell *
+tdx_servtd_doorbell_alloc(struct tdx_binding_slot *slot, u16 type, gpa_t gpa,
+			  u32 vector, u32 apic_id)
+{
+	struct tdx_servtd_doorbell *db;
+
+	db = kzalloc(sizeof(*db), GFP_KERNEL_ACCOUNT);
+	if (!db)
+		return NULL;
+
+	kvm_iodevice_init(&db->dev, &tdx_servtd_doorbell_ops);
+	db->gpa = gpa;
+	db->slot = slot;
+	db->req_id = slot->req_id;
+	db->type = type;
+	db->irq.vector = vector;
+	db->irq.delivery_mode = APIC_DM_FIXED;
+	db->irq.dest_mode = APIC_DEST_PHYSICAL;
+	db->irq.trig_mode = APIC_EDGE_TRIG;
+	db->irq.shorthand = APIC_DEST_NOSHORT;
+	db->irq.dest_id = apic_id;
+
+	return db;
+}
+
+/* Replace the doorbell *@old of @kvm by @db, NULL to only remove it. */
+static int tdx_servtd_doorbell_replace(struct kvm *kvm,
+				       struct tdx_servtd_doorbell **old,
+				       struct tdx_servtd_doorbell *db)
+{
+	int ret = 0;
+
+	mutex_lock(&kvm->slots_lock);
+	if (*old)
+		kvm_io_bus_unregister_dev(kvm, KVM_MMIO_BUS, &(*old)->dev);
+	*old = NULL;
+	if (db) {
+		ret = kvm_io_bus_register_dev(kvm, KVM_MMIO_BUS, db->gpa,
+					      sizeof(u64), &db->dev);
+		if (!ret)
+			*old = db;
+	}
+	mutex_unlock(&kvm->slots_lock);
+
+	return ret;
+}
+
+static int tdx_servtd_set_doorbell(struct kvm *usertd_kvm,
+				   struct kvm_tdx_cmd *cmd)
+{
+	struct kvm_tdx *usertd_tdx = to_kvm_tdx(usertd_kvm);
+	struct tdx_servtd_doorbell *usertd_db, *servtd_db;
+	struct kvm_tdx_servtd_doorbell doorbell;
+	struct tdx_binding_slot *slot;
+	struct kvm_tdx *servtd_tdx;
+	int ret;
+
+	if (cmd->flags)
+		return -EINVAL;
+
+	if (copy_from_user(&doorbell, (void __user *)cmd->data,
+			   sizeof(doorbell)))
+		return -EFAULT;
+
+	if (doorbell.type >= KVM_TDX_SERVTD_TYPE_MAX ||
+	    memchr_inv(doorbell.pad, 0, sizeof(doorbell.pad)) ||
+	    doorbell.usertd_vector < FIRST_EXTERNAL_VECTOR ||
+	    doorbell.usertd_vector > 0xff ||
+	    doorbell.servtd_vector < FIRST_EXTERNAL_VECTOR ||
+	    doorbell.servtd_vector > 0xff)
+		return -EINVAL;
+
+	slot = &usertd_tdx->binding_slots[doorbell.type];
+
+	mutex_lock(&tdx_servtd_binding_lock);
+	servtd_tdx = slot->servtd_tdx;
+	if (!servtd_tdx) {
+		ret = -ENOENT;
+		goto out_unlock;
+	}
+
+	usertd_db = tdx_servtd_doorbell_alloc(slot, doorbell.type,
+					      doorbell.usertd_gpa,
+					      doorbell.servtd_vector,
+					      doorbell.servtd_apic_id);
+	servtd_db = tdx_servtd_doorbell_alloc(slot, doorbell.type,
+					      doorbell.servtd_gpa,
+					      doorbell.usertd_vector,
+					      doorbell.usertd_apic_id);
+	if (!usertd_db || !servtd_db) {
+		kfree(usertd_db);
+		kfree(servtd_db);
+		ret = -ENOMEM;
+		goto out_unlock;
+	}
+	usertd_db->servtd_tdx = servtd_tdx;
+
+	ret = tdx_servtd_doorbell_replace(usertd_kvm, &slot->usertd_doorbell,
+					  usertd_db);
+	if (ret) {
+		kfree(usertd_db);
+		kfree(servtd_db);
+		goto out_unlock;
+	}
+
+	ret = tdx_servtd_doorbell_replace(&servtd_tdx->kvm,
+					  &slot->servtd_doorbell, servtd_db);
+	if (ret) {
+		kfree(servtd_db);
+		tdx_servtd_doorbell_replace(usertd_kvm, &slot->usertd_doorbell,
+					    NULL);
+	}
 
+out_unlock:
+	mutex_unlock(&tdx_servtd_binding_lock);
+	return ret;
 }
 
+/*
+ * Wake up one halted vCPU of the servtd to take the request.  The woken vCPU
+ * wakes up the next one if more requests are pending, instead of all the
+ * vCPUs racing for a single request.
+ */
 static void tdx_notify_servtd(struct kvm_tdx *tdx)
 {
 	struct kvm *kvm;
@@ -4694,9 +7047,10 @@ static void tdx_notify_servtd(struct kvm_tdx *tdx)
 
 	kvm = &tdx->kvm;
 	kvm_for_each_vcpu(i, vcpu, kvm) {
-		if (vcpu->arch.mp_state == KVM_MP_STATE_HALTED) {
-			vcpu->arch.mp_state = KVM_MP_STATE_RUNNABLE;
+		if (cmpxchg(&vcpu->arch.mp_state, KVM_MP_STATE_HALTED,
+			    KVM_MP_STATE_RUNNABLE) == KVM_MP_STATE_HALTED) {
 			kvm_vcpu_kick(vcpu);
+			break;
 		}
 	}
 }
@@ -4717,6 +7071,8 @@ static int tdx_set_migration_info(struct kvm *kvm,
 	struct kvm_tdx_set_migration_info info;
 	struct tdx_binding_slot *slot;
 	struct tdx_binding_slot_migtd *migtd_data;
+	struct xarray *slots;
+	bool pending;
 
 	if (copy_from_user(&info, (void __user *)cmd->data,
 			   sizeof(struct kvm_tdx_set_migration_info)))
@@ -4727,20 +7083,31 @@ static int tdx_set_migration_info(struct kvm *kvm,
 		return -EINVAL;
 
 	slot = &usertd_tdx->binding_slots[KVM_TDX_SERVTD_TYPE_MIGTD];
+	mutex_lock(&tdx_servtd_binding_lock);
 	servtd_tdx = slot->servtd_tdx;
-	if (!servtd_tdx)
+	if (!servtd_tdx) {
+		mutex_unlock(&tdx_servtd_binding_lock);
 		return -ENOENT;
+	}
 
 	migtd_data = &slot->migtd_data;
-	spin_lock(&servtd_tdx->binding_slot_lock);
-
 	migtd_data->vsock_port = info.vsock_port;
 	migtd_data->is_src = info.is_src;
 	tdx_binding_slot_set_state(slot, TDX_BINDING_SLOT_STATE_PREMIG_WAIT);
 
-	spin_unlock(&servtd_tdx->binding_slot_lock);
-
-	tdx_notify_servtd(servtd_tdx);
+	/*
+	 * Batch the notifications: if requests are pending already, the MigTD
+	 * vCPU taking the next one wakes up another for this one.
+	 */
+	slots = &servtd_tdx->usertd_binding_slots;
+	xa_lock(slots);
+	pending = xa_marked(slots, TDX_BINDING_SLOT_PREMIG_WAIT_MARK);
+	__xa_set_mark(slots, slot->req_id, TDX_BINDING_SLOT_PREMIG_WAIT_MARK);
+	xa_unlock(slots);
+
+	if (!pending)
+		tdx_notify_servtd(servtd_tdx);
+	mutex_unlock(&tdx_servtd_binding_lock);
 	return 0;
 }
 
@@ -4773,6 +7140,8 @@ static int tdx_get_migration_info(struct kvm *kvm,
 	return 0;
 }
 
+static int tdx_init_vcpus(struct kvm *kvm, struct kvm_tdx_cmd *cmd);
+
 int tdx_vm_ioctl(struct kvm *kvm, void __user *argp)
 {
 	struct kvm_tdx_cmd tdx_cmd;
@@ -4804,12 +7173,21 @@ int tdx_vm_ioctl(struct kvm *kvm, void __user *argp)
 	case KVM_TDX_SERVTD_BIND:
 		r = tdx_servtd_bind(kvm, &tdx_cmd);
 		break;
+	case KVM_TDX_SERVTD_SET_DOORBELL:
+		r = tdx_servtd_set_doorbell(kvm, &tdx_cmd);
+		break;
 	case KVM_TDX_SET_MIGRATION_INFO:
 		r = tdx_set_migration_info(kvm, &tdx_cmd);
 		break;
 	case KVM_TDX_GET_MIGRATION_INFO:
 		r = tdx_get_migration_info(kvm, &tdx_cmd);
 		break;
+	case KVM_TDX_INIT_VCPUS:
+		r = tdx_init_vcpus(kvm, &tdx_cmd);
+		break;
+	case KVM_TDX_GET_EVENT_RING:
+		r = tdx_get_event_ring(kvm, &tdx_cmd);
+		break;
 	default:
 		r = -EINVAL;
 		goto out;
@@ -4828,31 +7206,35 @@ static int tdx_td_vcpu_setup(struct kvm_vcpu *vcpu)
 	struct kvm_tdx *kvm_tdx = to_kvm_tdx(vcpu->kvm);
 	struct vcpu_tdx *tdx = to_tdx(vcpu);
 	unsigned long *tdvpx_pa = tdx->tdvpx_pa;
-	int i;
+	int i, ret = 0;
 	u64 err;
 
+	mutex_lock(&kvm_tdx->vp_init_lock);
 	err = tdh_vp_create(kvm_tdx->tdr_pa, tdx->tdvpr_pa);
 	if (KVM_BUG_ON(err, vcpu->kvm)) {
-		pr_tdx_error(TDH_VP_CREATE, err, NULL);
-		return -EIO;
+		kvm_pr_tdx_error(vcpu->kvm, TDH_VP_CREATE, err, NULL);
+		ret = -EIO;
+		goto out;
 	}
 	tdx_account_ctl_page(vcpu->kvm);
 
 	for (i = 0; i < tdx_info.nr_tdvpx_pages; i++) {
 		err = tdh_vp_addcx(tdx->tdvpr_pa, tdvpx_pa[i]);
 		if (KVM_BUG_ON(err, vcpu->kvm)) {
-			pr_tdx_error(TDH_VP_ADDCX, err, NULL);
+			kvm_pr_tdx_error(vcpu->kvm, TDH_VP_ADDCX, err, NULL);
 			for (; i < tdx_info.nr_tdvpx_pages; i++) {
 				free_page((unsigned long)__va(tdvpx_pa[i]));
 				tdvpx_pa[i] = 0;
 			}
 			/* vcpu_free method frees TDVPX and TDR donated to TDX */
-			return -EIO;
+			ret = -EIO;
+			goto out;
 		}
 		tdx_account_ctl_page(vcpu->kvm);
 	}
-
-	return 0;
+out:
+	mutex_unlock(&kvm_tdx->vp_init_lock);
+	return ret;
 }
 
 /* VMM can pass one 64bit auxiliary data to vcpu via RCX for guest BIOS. */
@@ -4873,7 +7255,7 @@ static int tdx_td_vcpu_init(struct kvm_vcpu *vcpu, u64 vcpu_rcx)
 	 * vcpu_free method frees allocated pages.  Avoid partial setup so
 	 * that the method can't handle it.
 	 */
-	va = __get_free_page(GFP_KERNEL_ACCOUNT);
+	va = tdx_alloc_ctrl_page();
 	if (!va)
 		return -ENOMEM;
 	tdvpr_pa = __pa(va);
@@ -4885,7 +7267,7 @@ static int tdx_td_vcpu_init(struct kvm_vcpu *vcpu, u64 vcpu_rcx)
 		goto free_tdvpr;
 	}
 	for (i = 0; i < tdx_info.nr_tdvpx_pages; i++) {
-		va = __get_free_page(GFP_KERNEL_ACCOUNT);
+		va = tdx_alloc_ctrl_page();
 		if (!va) {
 			ret = -ENOMEM;
 			goto free_tdvpx;
@@ -4911,11 +7293,17 @@ static int tdx_td_vcpu_init(struct kvm_vcpu *vcpu, u64 vcpu_rcx)
 	if (ret)
 		goto free_tdvpx;
 
+	mutex_lock(&kvm_tdx->vp_init_lock);
+	preempt_disable();
+	tdx_track_vp_association(tdx);
 	err = tdh_vp_init(tdx->tdvpr_pa, vcpu_rcx);
+	preempt_enable();
+	mutex_unlock(&kvm_tdx->vp_init_lock);
 	if (KVM_BUG_ON(err, vcpu->kvm)) {
-		pr_tdx_error(TDH_VP_INIT, err, NULL);
+		kvm_pr_tdx_error(vcpu->kvm, TDH_VP_INIT, err, NULL);
 		return -EIO;
 	}
+	tdx_clear_state_cache(vcpu);
 
 	return 0;
 
@@ -4943,9 +7331,13 @@ static int tdx_vcpu_init_mtrr(struct kvm_vcpu *vcpu)
 
 	/*
 	 * To avoid confusion with reporting VNCT = 0, explicitly disable
-	 * vaiale-range reisters.
+	 * vaiale-range reisters.  A new vCPU has them all disabled already,
+	 * only write the ones the VMM enabled.
 	 */
 	for (i = 0; i < KVM_NR_VAR_MTRR; i++) {
+		if (!(vcpu->arch.mtrr_state.var_ranges[i].mask & MTRR_PHYSMASK_V))
+			continue;
+
 		/* phymask */
 		msr = (struct msr_data) {
 			.host_initiated = true,
@@ -5025,29 +7417,96 @@ static void tdx_td_vcpu_post_init(struct vcpu_tdx *tdx)
 	tdx->initialized = true;
 }
 
-int tdx_vcpu_ioctl(struct kvm_vcpu *vcpu, void __user *argp)
+/*
+ * Map the private GPA range with TDH.MEM.PAGE.AUG ahead of the guest
+ * accessing it.  The vcpu is used only for its MMU context, so that userspace
+ * can prefault disjoint ranges in parallel with one thread per vcpu.
+ */
+static int tdx_vcpu_prefault_memory(struct kvm_vcpu *vcpu,
+				    struct kvm_tdx_cmd *cmd)
 {
-	struct msr_data apic_base_msr;
 	struct kvm_tdx *kvm_tdx = to_kvm_tdx(vcpu->kvm);
-	struct vcpu_tdx *tdx = to_tdx(vcpu);
-	struct kvm_tdx_cmd cmd;
-	int ret;
+	struct kvm_tdx_prefault_memory range;
+	struct kvm *kvm = vcpu->kvm;
+	gpa_t start, end;
+	int idx, ret = 0;
+	bool added = false;
+
+	/* TDH.MEM.PAGE.AUG is allowed only after the TD is finalized. */
+	if (!is_hkid_assigned(kvm_tdx) || !is_td_finalized(kvm_tdx))
+		return -EINVAL;
+
+	if (cmd->flags)
+		return -EINVAL;
+
+	if (copy_from_user(&range, (void __user *)cmd->data, sizeof(range)))
+		return -EFAULT;
+
+	if (!IS_ALIGNED(range.gpa, PAGE_SIZE) ||
+	    !range.nr_pages ||
+	    range.nr_pages & GENMASK_ULL(63, 63 - PAGE_SHIFT) ||
+	    range.gpa + (range.nr_pages << PAGE_SHIFT) <= range.gpa ||
+	    !kvm_is_private_gpa(kvm, range.gpa) ||
+	    !kvm_is_private_gpa(kvm, range.gpa + (range.nr_pages << PAGE_SHIFT)))
+		return -EINVAL;
+
+	start = range.gpa;
+	end = range.gpa + (range.nr_pages << PAGE_SHIFT);
+
+	idx = srcu_read_lock(&kvm->srcu);
+	kvm_mmu_reload(vcpu);
+
+	while (range.nr_pages) {
+		gpa_t hpage_gpa = ALIGN_DOWN(range.gpa, KVM_HPAGE_SIZE(PG_LEVEL_2M));
+		int max_level = PG_LEVEL_4K;
+		u64 error_code;
+
+		if (signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+
+		if (need_resched())
+			cond_resched();
+
+		/*
+		 * Use the largest page size within the range.  The following
+		 * 4K steps within the large page are spurious faults.
+		 */
+		if (hpage_gpa >= start &&
+		    hpage_gpa + KVM_HPAGE_SIZE(PG_LEVEL_2M) <= end)
+			max_level = PG_LEVEL_2M;
+
+		error_code = TDX_SEPT_PFERR;
+		error_code |= (max_level << PFERR_LEVEL_START_BIT) & PFERR_LEVEL_MASK;
+		ret = kvm_mmu_map_tdp_page(vcpu, range.gpa, error_code, max_level,
+					   false);
+		if (ret == -EAGAIN)
+			continue;
+		if (ret)
+			break;
 
-	if (tdx->initialized)
-		return -EINVAL;
+		range.gpa += PAGE_SIZE;
+		range.nr_pages--;
+		added = true;
+	}
 
-	if (!is_hkid_assigned(kvm_tdx) || is_td_finalized(kvm_tdx))
-		return -EINVAL;
+	srcu_read_unlock(&kvm->srcu, idx);
 
-	if (copy_from_user(&cmd, argp, sizeof(cmd)))
-		return -EFAULT;
+	if (added && range.nr_pages > 0)
+		ret = -EAGAIN;
+	if (copy_to_user((void __user *)cmd->data, &range, sizeof(range)))
+		ret = -EFAULT;
 
-	if (cmd.error)
-		return -EINVAL;
+	return ret;
+}
 
-	/* Currently only KVM_TDX_INTI_VCPU is defined for vcpu operation. */
-	if (cmd.flags || cmd.id != KVM_TDX_INIT_VCPU)
-		return -EINVAL;
+/* KVM_TDX_INIT_VCPU, the vCPU is loaded. */
+static int tdx_vcpu_init(struct kvm_vcpu *vcpu, u64 vcpu_rcx)
+{
+	struct kvm_tdx *kvm_tdx = to_kvm_tdx(vcpu->kvm);
+	struct msr_data apic_base_msr;
+	int ret;
 
 	/*
 	 * As TDX requires X2APIC, set local apic mode to X2APIC.  User space
@@ -5066,17 +7525,128 @@ int tdx_vcpu_ioctl(struct kvm_vcpu *vcpu, void __user *argp)
 	if (ret)
 		return ret;
 
-	ret = tdx_td_vcpu_init(vcpu, (u64)cmd.data);
+	ret = tdx_td_vcpu_init(vcpu, vcpu_rcx);
 	if (ret)
 		return ret;
 
 	if (!kvm_tdx->td_initialized)
 		return 0;
 
-	tdx_td_vcpu_post_init(tdx);
+	tdx_td_vcpu_post_init(to_tdx(vcpu));
 	return 0;
 }
 
+struct tdx_init_vcpu_work {
+	struct work_struct work;
+	struct kvm_vcpu *vcpu;
+	struct mem_cgroup *memcg;
+	u64 vcpu_rcx;
+	int ret;
+};
+
+static void tdx_init_vcpu_workfn(struct work_struct *work)
+{
+	struct tdx_init_vcpu_work *w =
+		container_of(work, struct tdx_init_vcpu_work, work);
+	struct kvm_vcpu *vcpu = w->vcpu;
+	struct mem_cgroup *old_memcg;
+
+	/*
+	 * The ioctl holds kvm->lock, which vCPU ioctls may wait for with
+	 * vcpu->mutex held.  Don't wait for it in turn.
+	 */
+	if (!mutex_trylock(&vcpu->mutex)) {
+		w->ret = -EBUSY;
+		return;
+	}
+
+	/* Charge the vCPU to the VMM, not to the worker. */
+	old_memcg = set_active_memcg(w->memcg);
+	vcpu_load(vcpu);
+	w->ret = to_tdx(vcpu)->initialized ? 0 :
+		 tdx_vcpu_init(vcpu, w->vcpu_rcx);
+	vcpu_put(vcpu);
+	set_active_memcg(old_memcg);
+	mutex_unlock(&vcpu->mutex);
+}
+
+/*
+ * Run KVM_TDX_INIT_VCPU on all the vCPUs at once from workers, instead of
+ * the VMM issuing it for one vCPU after another, e.g. to bring up large TDs.
+ * The SEAMCALLs on the TDR are serialized by vp_init_lock, the page
+ * allocations and the CPUID/MSR/MTRR setup run in parallel.
+ */
+static int tdx_init_vcpus(struct kvm *kvm, struct kvm_tdx_cmd *cmd)
+{
+	struct kvm_tdx *kvm_tdx = to_kvm_tdx(kvm);
+	struct tdx_init_vcpu_work *works;
+	struct mem_cgroup *memcg;
+	struct kvm_vcpu *vcpu;
+	unsigned long i, nr;
+	int ret = 0;
+
+	if (cmd->flags)
+		return -EINVAL;
+
+	if (!is_hkid_assigned(kvm_tdx) || is_td_finalized(kvm_tdx))
+		return -EINVAL;
+
+	nr = atomic_read(&kvm->online_vcpus);
+	works = kvcalloc(nr, sizeof(*works), GFP_KERNEL_ACCOUNT);
+	if (!works)
+		return -ENOMEM;
+
+	memcg = get_mem_cgroup_from_mm(current->mm);
+	kvm_for_each_vcpu(i, vcpu, kvm) {
+		if (i >= nr)
+			break;
+		INIT_WORK(&works[i].work, tdx_init_vcpu_workfn);
+		works[i].vcpu = vcpu;
+		works[i].memcg = memcg;
+		works[i].vcpu_rcx = cmd->data;
+		queue_work(system_unbound_wq, &works[i].work);
+	}
+	for (i = 0; i < nr; i++) {
+		flush_work(&works[i].work);
+		if (!ret)
+			ret = works[i].ret;
+	}
+	mem_cgroup_put(memcg);
+	kvfree(works);
+
+	return ret;
+}
+
+int tdx_vcpu_ioctl(struct kvm_vcpu *vcpu, void __user *argp)
+{
+	struct kvm_tdx *kvm_tdx = to_kvm_tdx(vcpu->kvm);
+	struct vcpu_tdx *tdx = to_tdx(vcpu);
+	struct kvm_tdx_cmd cmd;
+
+	if (copy_from_user(&cmd, argp, sizeof(cmd)))
+		return -EFAULT;
+
+	if (cmd.error)
+		return -EINVAL;
+
+	if (cmd.id == KVM_TDX_PREFAULT_MEMORY) {
+		if (!tdx->initialized)
+			return -EINVAL;
+		return tdx_vcpu_prefault_memory(vcpu, &cmd);
+	}
+
+	if (tdx->initialized)
+		return -EINVAL;
+
+	if (!is_hkid_assigned(kvm_tdx) || is_td_finalized(kvm_tdx))
+		return -EINVAL;
+
+	if (cmd.flags || cmd.id != KVM_TDX_INIT_VCPU)
+		return -EINVAL;
+
+	return tdx_vcpu_init(vcpu, (u64)cmd.data);
+}
+
 static void tdx_guest_pmi_handler(void)
 {
 	struct kvm_vcpu *vcpu;
@@ -5306,11 +7876,13 @@ static int tdx_access_guest_memory(struct kvm *kvm,
 		u32 len = 0;
 
 		ret = 0;
-		for (done_len = 0; done_len < access_len && !ret;
-		     done_len += len)
+		for (done_len = 0; done_len < access_len; done_len += len) {
 			ret = operator->p_accessor(kvm, gpa + done_len,
 						   access_len - done_len,
 						   &len, buf + done_len);
+			if (ret)
+				break;
+		}
 	} else {
 		ret = operator->s_accessor(memslot,
 					   gpa_to_gfn(gpa), buf,
@@ -5328,64 +7900,106 @@ static int tdx_access_guest_memory(struct kvm *kvm,
 	return ret;
 }
 
+/*
+ * Size of the per-TD bounce buffer.  User memory is copied in and out once per
+ * buffer rather than once per page, the guest is still accessed page by page.
+ */
+#define TDX_DEBUG_MEM_BUF_SIZE	(16 * PAGE_SIZE)
+
+/* Access up to TDX_DEBUG_MEM_BUF_SIZE bytes at @gpa through @kbuf. */
+static int tdx_access_guest_memory_batch(struct kvm *kvm, gpa_t gpa,
+					 void *kbuf, u32 batch_len,
+					 u32 *completed_len,
+					 struct tdx_guest_memory_operator *operator)
+{
+	u32 done = 0;
+	int ret = 0;
+
+	while (done < batch_len) {
+		u32 done_len;
+		u32 access_len = min_t(u32, batch_len - done,
+				       PAGE_SIZE - offset_in_page(gpa + done));
+
+		cond_resched();
+		if (signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+
+		ret = tdx_access_guest_memory(kvm, gpa + done, kbuf + done,
+					      access_len, &done_len, operator);
+		done += done_len;
+		if (ret)
+			break;
+	}
+
+	*completed_len = done;
+	return ret;
+}
+
 static int tdx_read_write_memory(struct kvm *kvm, gpa_t gpa, u64 len,
 				 u64 *complete_len, void __user *buf,
 				 struct tdx_guest_memory_operator *operator)
 {
+	struct kvm_tdx *kvm_tdx = to_kvm_tdx(kvm);
 	void *tmp_buf;
 	u64 complete;
 	gpa_t gpa_end;
 	int ret = 0;
 
+	complete = 0;
 	if (!operator) {
-		complete = 0;
 		ret = -EFAULT;
 		goto exit;
 	}
 
-	tmp_buf = (void *)__get_free_page(GFP_KERNEL);
+	if (mutex_lock_killable(&kvm_tdx->debug_mem_lock)) {
+		ret = -EINTR;
+		goto exit;
+	}
+
+	if (!kvm_tdx->debug_mem_buf)
+		kvm_tdx->debug_mem_buf = kvmalloc(TDX_DEBUG_MEM_BUF_SIZE,
+						  GFP_KERNEL_ACCOUNT);
+	tmp_buf = kvm_tdx->debug_mem_buf;
 	if (!tmp_buf) {
-		if (complete_len)
-			*complete_len = 0;
-		return -ENOMEM;
+		ret = -ENOMEM;
+		goto exit_unlock;
 	}
 
-	complete = 0;
 	gpa_end = gpa + len;
 	while (gpa < gpa_end) {
 		u32 done_len;
-		u32 access_len = min(len - complete,
-				 (u64)(PAGE_SIZE - offset_in_page(gpa)));
+		u32 batch_len = min_t(u64, len - complete,
+				      TDX_DEBUG_MEM_BUF_SIZE);
 
-		cond_resched();
-		if (signal_pending(current)) {
-			ret = -EINTR;
-			break;
-		}
-
-		ret = tdx_access_guest_memory_prepare(buf, tmp_buf, access_len,
+		ret = tdx_access_guest_memory_prepare(buf, tmp_buf, batch_len,
 						      operator);
 		if (ret)
 			break;
 
-		ret = tdx_access_guest_memory(kvm, gpa,
-					      tmp_buf, access_len,
-					      &done_len, operator);
-		if (ret)
-			break;
+		ret = tdx_access_guest_memory_batch(kvm, gpa, tmp_buf,
+						    batch_len, &done_len,
+						    operator);
 
-		ret = tdx_access_guest_memory_finish(buf, tmp_buf, done_len,
-						     operator);
-		if (ret)
+		/* Hand out what was read before a failure, too. */
+		if (done_len &&
+		    tdx_access_guest_memory_finish(buf, tmp_buf, done_len,
+						   operator)) {
+			ret = -EFAULT;
 			break;
+		}
 
 		buf += done_len;
 		complete += done_len;
 		gpa += done_len;
+		if (ret)
+			break;
 	}
 
-	free_page((u64)tmp_buf);
- exit:
+exit_unlock:
+	mutex_unlock(&kvm_tdx->debug_mem_lock);
+exit:
 	if (complete_len)
 		*complete_len = complete;
 	return ret;
@@ -5426,7 +8040,7 @@ static int read_private_memory(struct kvm *kvm, gpa_t addr, u64 *val)
 
 	err = tdh_mem_rd(to_kvm_tdx(kvm)->tdr_pa, addr, &tdx_ret);
 	if (WARN_ON_ONCE(err)) {
-		pr_tdx_error(TDH_MEM_RD, err, NULL);
+		kvm_pr_tdx_error(kvm, TDH_MEM_RD, err, NULL);
 		return -EIO;
 	}
 
@@ -5507,7 +8121,7 @@ static int write_private_memory(struct kvm *kvm, gpa_t addr, u64 *val)
 
 	err = tdh_mem_wr(to_kvm_tdx(kvm)->tdr_pa, addr, *val, &tdx_ret);
 	if (WARN_ON_ONCE(err)) {
-		pr_tdx_error(TDH_MEM_WR, err, NULL);
+		kvm_pr_tdx_error(kvm, TDH_MEM_WR, err, NULL);
 		return -EIO;
 	}
 
@@ -5632,9 +8246,12 @@ int __init tdx_hardware_setup(struct kvm_x86_ops *x86_ops)
 	 * The left private keys is the available keys for launching guest TDs.
 	 * The total number of available keys for TDs is (tdx_num_keyid - 1).
 	 */
-	if (misc_cg_set_capacity(MISC_CG_RES_TDX, tdx_get_nr_guest_keyids() - 1))
+	if (misc_cg_set_capacity(MISC_CG_RES_TDX, tdx_get_nr_guest_keyids() - 1) ||
+	    misc_cg_set_capacity(MISC_CG_RES_TDX_RECLAIM,
+				 tdx_get_nr_guest_keyids() - 1))
 		return -EINVAL;
 
+	/* Indexed by topology_logical_package_id(), dense unlike physical IDs. */
 	max_pkgs = topology_max_packages();
 	tdx_mng_key_config_lock = kcalloc(max_pkgs, sizeof(*tdx_mng_key_config_lock),
 				   GFP_KERNEL);
@@ -5649,6 +8266,12 @@ int __init tdx_hardware_setup(struct kvm_x86_ops *x86_ops)
 	if (r)
 		goto out;
 
+	r = tdx_clear_queues_init();
+	if (r)
+		goto out;
+
+	tdx_page_pools_init();
+
 	x86_ops->link_private_spt = tdx_sept_link_private_spt;
 	x86_ops->free_private_spt = tdx_sept_free_private_spt;
 	x86_ops->split_private_spt = tdx_sept_split_private_spt;
@@ -5657,18 +8280,23 @@ int __init tdx_hardware_setup(struct kvm_x86_ops *x86_ops)
 	x86_ops->remove_private_spte = tdx_sept_remove_private_spte;
 	x86_ops->zap_private_spte = tdx_sept_zap_private_spte;
 	x86_ops->unzap_private_spte = tdx_sept_unzap_private_spte;
+	x86_ops->relocate_private_spte = tdx_sept_relocate_private_spte;
 	x86_ops->drop_private_spte = tdx_sept_drop_private_spte;
 	x86_ops->mem_enc_read_memory = tdx_read_guest_memory;
 	x86_ops->mem_enc_write_memory = tdx_write_guest_memory;
 	x86_ops->write_block_private_pages = tdx_write_block_private_pages;
 	x86_ops->write_unblock_private_page = tdx_write_unblock_private_page;
 	x86_ops->import_private_pages = tdx_mig_stream_import_private_pages;
-	x86_ops->restore_private_page = tdx_restore_private_page;
+	x86_ops->restore_private_pages = tdx_restore_private_pages;
 	kvm_set_tdx_guest_pmi_handler(tdx_guest_pmi_handler);
 
 	mce_register_decode_chain(&tdx_mce_nb);
 	intel_reserve_lbr_buffers();
 
+	/* TDVMCALLs are still handled without BPF, don't fail for it. */
+	if (register_btf_kfunc_id_set(BPF_PROG_TYPE_TRACING, &tdx_vmcall_kfunc_set))
+		pr_warn("Failed to register the TDVMCALL kfuncs\n");
+
 	r = kvm_tdx_mig_stream_ops_init();
 	if (r) {
 		pr_err("%s: failed to init tdx mig, %d\n", __func__, r);
@@ -5682,25 +8310,29 @@ int __init tdx_hardware_setup(struct kvm_x86_ops *x86_ops)
 	kfree(tdx_mng_key_config_lock);
 	tdx_mng_key_config_lock = NULL;
 	misc_cg_set_capacity(MISC_CG_RES_TDX, 0);
+	misc_cg_set_capacity(MISC_CG_RES_TDX_RECLAIM, 0);
 	return r;
 }
 
 void tdx_hardware_unsetup(void)
 {
 	kvm_tdx_mig_stream_ops_exit();
+	tdx_clear_queues_exit();
+	tdx_page_pools_exit();
 	intel_release_lbr_buffers();
 	mce_unregister_decode_chain(&tdx_mce_nb);
 	/* kfree accepts NULL. */
 	kfree(tdx_mng_key_config_lock);
 	misc_cg_set_capacity(MISC_CG_RES_TDX, 0);
+	misc_cg_set_capacity(MISC_CG_RES_TDX_RECLAIM, 0);
 	kvm_set_tdx_guest_pmi_handler(NULL);
+	kfree(tdx_caps);
+	tdx_caps = NULL;
 }
 
 int tdx_offline_cpu(void)
 {
 	int curr_cpu = smp_processor_id();
-	cpumask_var_t packages;
-	int ret = 0;
 	int i;
 
 	/* No TD is running.  Allow any cpu to be offline. */
@@ -5711,27 +8343,26 @@ int tdx_offline_cpu(void)
 	 * In order to reclaim TDX HKID, (i.e. when deleting guest TD), need to
 	 * call TDH.PHYMEM.PAGE.WBINVD on all packages to program all memory
 	 * controller with pconfig.  If we have active TDX HKID, refuse to
-	 * offline the last online cpu.
+	 * offline the last online cpu.  Only the siblings of the package need
+	 * looking at, not all the online cpus.
+	 *
+	 * The TD vCPUs associated with this cpu don't prevent it from going
+	 * offline: tdx_hardware_disable() flushes them and they associate with
+	 * the cpu of their next SEAMCALL.
 	 */
-	if (!zalloc_cpumask_var(&packages, GFP_KERNEL))
-		return -ENOMEM;
-	for_each_online_cpu(i) {
+	for_each_cpu_and(i, topology_core_cpumask(curr_cpu), cpu_online_mask) {
 		if (i != curr_cpu)
-			cpumask_set_cpu(topology_physical_package_id(i), packages);
+			return 0;
 	}
-	/* Check if this cpu is the last online cpu of this package. */
-	if (!cpumask_test_cpu(topology_physical_package_id(curr_cpu), packages))
-		ret = -EBUSY;
-	free_cpumask_var(packages);
-	if (ret)
-		/*
-		 * Because it's hard for human operator to understand the
-		 * reason, warn it.
-		 */
+
+	/*
+	 * Because it's hard for human operator to understand the reason, warn
+	 * it.
+	 */
 #define MSG_ALLPKG_ONLINE \
 	"TDX requires all packages to have an online CPU. Delete all TDs in order to offline all CPUs of a package.\n"
-		pr_warn_ratelimited(MSG_ALLPKG_ONLINE);
-	return ret;
+	pr_warn_ratelimited(MSG_ALLPKG_ONLINE);
+	return -EBUSY;
 }
 
 static __always_inline bool tdx_guest(struct kvm *kvm)
@@ -5749,93 +8380,124 @@ static __always_inline bool tdx_guest(struct kvm *kvm)
 	     memslot_iter_1 = rb_next(memslot_iter_1),                \
 	    memslot_iter_2 = rb_next(memslot_iter_2))
 
-static int tdx_migrate_from(struct kvm *dst, struct kvm *src)
+/*
+ * The memslots of @dst must match the ones of @src, with the private ones
+ * bound to the same ranges of the same guest_memfd files.
+ */
+static int tdx_migrate_check_memslots(struct kvm_memslots *src_slots,
+				      struct kvm_memslots *dst_slots)
 {
 	struct rb_node *src_memslot_iter, *dst_memslot_iter;
-	struct vcpu_tdx *dst_tdx_vcpu, *src_tdx_vcpu;
-	struct kvm_memslots *src_slots, *dst_slots;
-	struct kvm_vcpu *dst_vcpu, *src_vcpu;
-	struct kvm_tdx *src_tdx, *dst_tdx;
-	unsigned long i, j;
-	int ret;
+	struct kvm_memory_slot *src_slot, *dst_slot;
 
-	src_tdx = to_kvm_tdx(src);
-	dst_tdx = to_kvm_tdx(dst);
+	for_each_memslot_pair(src_slots, dst_slots, src_memslot_iter,
+			      dst_memslot_iter) {
+		src_slot = container_of(src_memslot_iter, struct kvm_memory_slot,
+					gfn_node[src_slots->node_idx]);
+		dst_slot = container_of(dst_memslot_iter, struct kvm_memory_slot,
+					gfn_node[dst_slots->node_idx]);
 
-	src_slots = __kvm_memslots(src, 0);
-	dst_slots = __kvm_memslots(dst, 0);
+		if (src_slot->base_gfn != dst_slot->base_gfn ||
+		    src_slot->npages != dst_slot->npages ||
+		    src_slot->flags != dst_slot->flags)
+			goto mismatch;
 
-	ret = -EINVAL;
+		if (!(src_slot->flags & KVM_MEM_PRIVATE))
+			continue;
 
-	if (!src_tdx->finalized) {
-		pr_warn("Cannot migrate from a non finalized VM\n");
-		goto abort;
+		if (src_slot->gmem.file->f_inode != dst_slot->gmem.file->f_inode) {
+			pr_warn("Private memslots points to different restricted files\n");
+			return -EINVAL;
+		}
+
+		if (src_slot->gmem.pgoff != dst_slot->gmem.pgoff) {
+			pr_warn("Private memslots points to the restricted file at different offsets\n");
+			return -EINVAL;
+		}
 	}
 
-	// Traverse both memslots in gfn order and compare them
-	for_each_memslot_pair(src_slots, dst_slots, src_memslot_iter, dst_memslot_iter) {
-		struct kvm_memory_slot *src_slot, *dst_slot;
+	if (!src_memslot_iter && !dst_memslot_iter)
+		return 0;
 
-		src_slot =
-			container_of(src_memslot_iter, struct kvm_memory_slot,
-				     gfn_node[src_slots->node_idx]);
-		dst_slot =
-			container_of(src_memslot_iter, struct kvm_memory_slot,
-				     gfn_node[dst_slots->node_idx]);
+mismatch:
+	pr_warn("Cannot migrate between VMs with different memory slots configurations\n");
+	return -EINVAL;
+}
 
-		if (src_slot->base_gfn != dst_slot->base_gfn ||
-		    src_slot->npages != dst_slot->npages) {
-			pr_warn("Cannot migrate between VMs with different memory slots configurations\n");
-			goto abort;
-		}
+/* Hand the large page tracking of all memslots over to @dst. */
+static void tdx_migrate_memslots(struct kvm_memslots *src_slots,
+				 struct kvm_memslots *dst_slots)
+{
+	struct rb_node *src_memslot_iter, *dst_memslot_iter;
+	struct kvm_memory_slot *src_slot, *dst_slot;
+	unsigned long ugfn;
+	int i, level;
 
-		if (src_slot->flags != dst_slot->flags) {
-			pr_warn("Cannot migrate between VMs with different memory slots configurations\n");
-			goto abort;
-		}
+	for_each_memslot_pair(src_slots, dst_slots, src_memslot_iter,
+			      dst_memslot_iter) {
+		src_slot = container_of(src_memslot_iter, struct kvm_memory_slot,
+					gfn_node[src_slots->node_idx]);
+		dst_slot = container_of(dst_memslot_iter, struct kvm_memory_slot,
+					gfn_node[dst_slots->node_idx]);
 
-		if (src_slot->flags & KVM_MEM_PRIVATE) {
-			rcu_read_lock();
-			if (src_slot->gmem.file->f_inode->i_ino !=
-			    dst_slot->gmem.file->f_inode->i_ino) {
-				pr_warn("Private memslots points to different restricted files\n");
-				rcu_read_unlock();
-				goto abort;
-			}
+		for (i = 1; i < KVM_NR_PAGE_SIZES; ++i) {
+			level = i + 1;
 
-			if (src_slot->gmem.pgoff != dst_slot->gmem.pgoff) {
-				pr_warn("Private memslots points to the restricted file at different offsets\n");
-				rcu_read_unlock();
-				goto abort;
-			}
-			rcu_read_unlock();
+			/*
+			 * If the gfn and userspace address are not aligned wrt each other, then
+			 * large page support should already be disabled at this level.
+			 */
+			ugfn = dst_slot->userspace_addr >> PAGE_SHIFT;
+			if ((dst_slot->base_gfn ^ ugfn) & (KVM_PAGES_PER_HPAGE(level) - 1))
+				continue;
+
+			/* The src VM frees the ones of @dst along with itself. */
+			swap(dst_slot->arch.lpage_info[i - 1],
+			     src_slot->arch.lpage_info[i - 1]);
 		}
 	}
+}
+
+static int tdx_migrate_from(struct kvm *dst, struct kvm *src)
+{
+	struct vcpu_tdx *dst_tdx_vcpu, *src_tdx_vcpu;
+	struct kvm_vcpu *dst_vcpu, *src_vcpu;
+	struct kvm_tdx *src_tdx, *dst_tdx;
+	unsigned long i;
+	int ret;
+
+	src_tdx = to_kvm_tdx(src);
+	dst_tdx = to_kvm_tdx(dst);
+
+	if (!src_tdx->finalized) {
+		pr_warn("Cannot migrate from a non finalized VM\n");
+		return -EINVAL;
+	}
 
-	if (src_memslot_iter || dst_memslot_iter) {
-		pr_warn("Cannot migrate between VMs with different memory slots configurations\n");
-		goto abort;
+	if (atomic_read(&dst->online_vcpus) != atomic_read(&src->online_vcpus)) {
+		pr_warn("Cannot migrate between VMs with different numbers of vCPUs\n");
+		return -EINVAL;
 	}
 
+	ret = tdx_migrate_check_memslots(__kvm_memslots(src, 0),
+					 __kvm_memslots(dst, 0));
+	if (ret)
+		return ret;
+
+	/*
+	 * Hand the TD pages over as they are.  The arrays of their PAs move with
+	 * them, nothing is copied or allocated, and so nothing can fail midway.
+	 */
 	dst_tdx->hkid = src_tdx->hkid;
 	dst_tdx->tdr_pa = src_tdx->tdr_pa;
-
-	dst_tdx->tdcs_pa = kcalloc(tdx_info.nr_tdcs_pages, sizeof(*dst_tdx->tdcs_pa),
-			  GFP_KERNEL_ACCOUNT | __GFP_ZERO);
-	if (!dst_tdx->tdcs_pa) {
-		ret = -ENOMEM;
-		goto late_abort;
-	}
-	memcpy(dst_tdx->tdcs_pa, src_tdx->tdcs_pa,
-	       tdx_info.nr_tdcs_pages * sizeof(*dst_tdx->tdcs_pa));
+	dst_tdx->tdcs_pa = src_tdx->tdcs_pa;
 
 	dst_tdx->tsc_offset = src_tdx->tsc_offset;
 	dst_tdx->attributes = src_tdx->attributes;
 	dst_tdx->xfam = src_tdx->xfam;
 	dst_tdx->kvm.arch.gfn_shared_mask = src_tdx->kvm.arch.gfn_shared_mask;
 
-	kvm_for_each_vcpu(i, src_vcpu, src)
-		tdx_flush_vp_on_cpu(src_vcpu);
+	tdx_flush_vps(src);
 
 	/* Copy per-vCPU state */
 	kvm_for_each_vcpu(i, src_vcpu, src) {
@@ -5849,69 +8511,35 @@ static int tdx_migrate_from(struct kvm *dst, struct kvm *src)
 		       NR_VCPU_REGS * sizeof(src_vcpu->arch.regs[0]));
 		dst_vcpu->arch.regs_avail = src_vcpu->arch.regs_avail;
 		dst_vcpu->arch.regs_dirty = src_vcpu->arch.regs_dirty;
+		tdx_clear_state_cache(dst_vcpu);
 
 		dst_vcpu->arch.tsc_offset = dst_tdx->tsc_offset;
 
 		dst_tdx_vcpu->interrupt_disabled_hlt = src_tdx_vcpu->interrupt_disabled_hlt;
 		dst_tdx_vcpu->buggy_hlt_workaround = src_tdx_vcpu->buggy_hlt_workaround;
+		dst_tdx_vcpu->buggy_hlt_entry = src_tdx_vcpu->buggy_hlt_entry;
 
 		dst_tdx_vcpu->tdvpr_pa = src_tdx_vcpu->tdvpr_pa;
-		dst_tdx_vcpu->tdvpx_pa = kcalloc(tdx_info.nr_tdvpx_pages,
-						 sizeof(*dst_tdx_vcpu->tdvpx_pa),
-						 GFP_KERNEL_ACCOUNT);
-		if (!dst_tdx_vcpu->tdvpx_pa) {
-			ret = -ENOMEM;
-			vcpu_put(dst_vcpu);
-			goto late_abort;
-		}
-		memcpy(dst_tdx_vcpu->tdvpx_pa, src_tdx_vcpu->tdvpx_pa,
-		       tdx_info.nr_tdvpx_pages * sizeof(*dst_tdx_vcpu->tdvpx_pa));
+		dst_tdx_vcpu->tdvpx_pa = src_tdx_vcpu->tdvpx_pa;
+		src_tdx_vcpu->tdvpr_pa = 0;
+		src_tdx_vcpu->tdvpx_pa = NULL;
 
 		td_vmcs_write64(dst_tdx_vcpu, POSTED_INTR_DESC_ADDR, __pa(&dst_tdx_vcpu->pi_desc));
 
-		/* Copy private EPT tables */
+		/*
+		 * The first vCPU takes the private root of the whole TD, the
+		 * others only get a reference to it.
+		 */
 		if (kvm_mmu_move_private_pages_from(dst_vcpu, src_vcpu)) {
 			ret = -EINVAL;
 			vcpu_put(dst_vcpu);
 			goto late_abort;
 		}
 
-		for (j = 0; j < tdx_info.nr_tdvpx_pages; j++)
-			src_tdx_vcpu->tdvpx_pa[j] = 0;
-
-		src_tdx_vcpu->tdvpr_pa = 0;
-
 		vcpu_put(dst_vcpu);
 	}
 
-	for_each_memslot_pair(src_slots, dst_slots, src_memslot_iter,
-			      dst_memslot_iter) {
-		struct kvm_memory_slot *src_slot, *dst_slot;
-
-		src_slot = container_of(src_memslot_iter,
-					struct kvm_memory_slot,
-					gfn_node[src_slots->node_idx]);
-		dst_slot = container_of(src_memslot_iter,
-					struct kvm_memory_slot,
-					gfn_node[dst_slots->node_idx]);
-
-		for (i = 1; i < KVM_NR_PAGE_SIZES; ++i) {
-			unsigned long ugfn;
-			int level = i + 1;
-
-			/*
-			 * If the gfn and userspace address are not aligned wrt each other, then
-			 * large page support should already be disabled at this level.
-			 */
-			ugfn = dst_slot->userspace_addr >> PAGE_SHIFT;
-			if ((dst_slot->base_gfn ^ ugfn) & (KVM_PAGES_PER_HPAGE(level) - 1))
-				continue;
-
-			dst_slot->arch.lpage_info[i - 1] =
-				src_slot->arch.lpage_info[i - 1];
-			src_slot->arch.lpage_info[i - 1] = NULL;
-		}
-	}
+	tdx_migrate_memslots(__kvm_memslots(src, 0), __kvm_memslots(dst, 0));
 
 	dst->mem_attr_array.xa_head = src->mem_attr_array.xa_head;
 	src->mem_attr_array.xa_head = NULL;
@@ -5921,20 +8549,32 @@ static int tdx_migrate_from(struct kvm *dst, struct kvm *src)
 	/* Clear source VM to avoid freeing the hkid and pages on VM put */
 	src_tdx->hkid = -1;
 	src_tdx->tdr_pa = 0;
-	for (i = 0; i < tdx_info.nr_tdcs_pages; i++)
-		src_tdx->tdcs_pa[i] = 0;
+	src_tdx->tdcs_pa = NULL;
 
 	return 0;
 
 late_abort:
-	/* If we aborted after the state transfer already started, the src VM
-	 * is no longer valid.
+	/*
+	 * The vCPUs are split between the two VMs, neither can run the TD
+	 * anymore.  The src VM keeps the TD pages, including the TDVPR and TDVPX
+	 * pages of the vCPUs already moved, so that they are reclaimed with it.
+	 * @dst only drops its references to them.
 	 */
 	kvm_vm_dead(src);
+	kvm_for_each_vcpu(i, src_vcpu, src) {
+		src_tdx_vcpu = to_tdx(src_vcpu);
+		dst_tdx_vcpu = to_tdx(kvm_get_vcpu(dst, i));
+		if (!dst_tdx_vcpu->tdvpr_pa)
+			break;
 
-abort:
+		src_tdx_vcpu->tdvpr_pa = dst_tdx_vcpu->tdvpr_pa;
+		src_tdx_vcpu->tdvpx_pa = dst_tdx_vcpu->tdvpx_pa;
+		dst_tdx_vcpu->tdvpr_pa = 0;
+		dst_tdx_vcpu->tdvpx_pa = NULL;
+	}
 	dst_tdx->hkid = -1;
 	dst_tdx->tdr_pa = 0;
+	dst_tdx->tdcs_pa = NULL;
 
 	return ret;
 }
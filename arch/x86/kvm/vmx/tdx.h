@@ -4,6 +4,8 @@
 
 #ifdef CONFIG_INTEL_TDX_HOST
 
+#include <linux/misc_cgroup.h>
+
 #include "posted_intr.h"
 #include "pmu_intel.h"
 #include "tdx_ops.h"
@@ -47,20 +49,115 @@ struct tdx_binding_slot {
 	 * Futher type specific data can be added with union.
 	 */
 	struct tdx_binding_slot_migtd migtd_data;
+	/*
+	 * Doorbells of the user TD to the servtd and of the servtd to the user
+	 * TD, see KVM_TDX_SERVTD_SET_DOORBELL.
+	 */
+	struct tdx_servtd_doorbell *usertd_doorbell;
+	struct tdx_servtd_doorbell *servtd_doorbell;
+};
+
+/* TD exits with a latency histogram of their own, see tdx_exit_hist(). */
+enum tdx_exit_hist_type {
+	TDX_EXIT_HIST_EPT_VIOLATION,
+	TDX_EXIT_HIST_INTERRUPT,
+	TDX_EXIT_HIST_EXCEPTION_NMI,
+	TDX_EXIT_HIST_VMCALL_CPUID,
+	TDX_EXIT_HIST_VMCALL_HLT,
+	TDX_EXIT_HIST_VMCALL_IO,
+	TDX_EXIT_HIST_VMCALL_MMIO,
+	TDX_EXIT_HIST_VMCALL_MSR,
+	TDX_EXIT_HIST_VMCALL_MAP_GPA,
+	TDX_EXIT_HIST_VMCALL_GET_QUOTE,
+	TDX_EXIT_HIST_VMCALL_SERVICE,
+	TDX_EXIT_HIST_VMCALL_OTHER,
+	TDX_EXIT_HIST_OTHER,
+	TDX_EXIT_NR_HIST,
+};
+
+#define TDX_EXIT_HIST_COUNT	32
+
+/*
+ * Statistics of a TD vCPU that only make sense for TDX, in the tdx_stats
+ * debugfs file of the vCPU rather than in the binary stats of all vCPUs.
+ */
+struct tdx_vcpu_stat {
+	/* TD exits on host interrupts, by kind of vector. */
+	u64 exit_irq_timer;
+	u64 exit_irq_ipi;
+	u64 exit_irq_posted;
+	u64 exit_irq_other;
+	/* log2 histograms of ns from TD exit to the next TD entry. */
+	u64 exit_hist[TDX_EXIT_NR_HIST][TDX_EXIT_HIST_COUNT];
+};
+
+/*
+ * SEAMCALL leaves with counters of their own in the TDX stats of a TD, i.e.
+ * the ones KVM retries on contention.  All the other leaves share the last.
+ */
+enum tdx_seamcall_stat_leaf {
+	TDX_SEAMCALL_STAT_VP_ENTER,
+	TDX_SEAMCALL_STAT_MEM_RANGE_UNBLOCK,
+	TDX_SEAMCALL_STAT_EXPORT_BLOCKW,
+	TDX_SEAMCALL_STAT_EXPORT_UNBLOCKW,
+	TDX_SEAMCALL_STAT_EXPORT_MEM,
+	TDX_SEAMCALL_STAT_IMPORT_MEM,
+	TDX_SEAMCALL_STAT_OTHER,
+	TDX_SEAMCALL_STAT_LEAVES,
+};
+
+/*
+ * Statistics of a TD that only make sense for TDX, in the tdx_stats debugfs
+ * file of the VM rather than in the binary stats of all VMs.
+ */
+struct tdx_vm_stat {
+	/* TDH.MEM.TRACK issued, and tdx_track() covered by another's. */
+	u64 track_issued;
+	atomic64_t track_coalesced;
+	/* TDX control pages, i.e. TDR, TDCS and TDVPR/TDCX pages. */
+	atomic64_t ctl_pages;
+	/* Secure-EPT pages, by the level of the mappings they hold. */
+	union {
+		struct {
+			atomic64_t sept_pages_4k;
+			atomic64_t sept_pages_2m;
+			atomic64_t sept_pages_1g;
+			atomic64_t sept_pages_512g;
+		};
+		atomic64_t sept_pages[PG_LEVEL_NUM - PG_LEVEL_4K];
+	};
+	/* Private pages mapped in the Secure-EPT, by mapping level. */
+	union {
+		struct {
+			atomic64_t private_4k;
+			atomic64_t private_2m;
+			atomic64_t private_1g;
+		};
+		atomic64_t private[KVM_NR_PAGE_SIZES];
+	};
+	/*
+	 * SEAMCALLs of the TD that failed, by enum tdx_seamcall_stat_leaf and
+	 * by class of error, including the ones retried.  See
+	 * tdx_seamcall_stat().
+	 */
+	atomic64_t seamcall_busy[TDX_SEAMCALL_STAT_LEAVES];
+	atomic64_t seamcall_tlb_not_done[TDX_SEAMCALL_STAT_LEAVES];
+	atomic64_t seamcall_interrupted[TDX_SEAMCALL_STAT_LEAVES];
+	atomic64_t seamcall_error[TDX_SEAMCALL_STAT_LEAVES];
 };
 
-#define SERVTD_SLOTS_MAX 32
+/* Max number of user TDs bound to a servtd, i.e. of req_ids */
+#define SERVTD_SLOTS_MAX 1024
 struct kvm_tdx {
 	struct kvm kvm;
 
+	/* Read-mostly, used on TD entry/exit and by every SEAMCALL. */
 	unsigned long tdr_pa;
-	unsigned long *tdcs_pa;
-
 	u64 attributes;
 	u64 xfam;
 	int hkid;
-	struct misc_cg *misc_cg;
-
+	bool td_initialized;
+	bool finalized;
 	/*
 	 * Used on each TD-exit, see tdx_user_return_update_cache().
 	 * TSX_CTRL value on TD exit
@@ -68,18 +165,46 @@ struct kvm_tdx {
 	 * - preserved if guest TSX disabled
 	 */
 	bool tsx_supported;
-
-	hpa_t source_pa;
-
-	bool td_initialized;
-	bool finalized;
-	atomic_t tdh_mem_track;
-
 	u64 tsc_offset;
+	/* Ring of Secure-EPT events, NULL unless requested, see tdx_event(). */
+	struct kvm_tdx_event_ring *event_ring;
 
-	/* TDP MMU */
-	bool has_range_blocked;
+	/*
+	 * TDP MMU.  Written by the vCPUs zapping or flushing, keep them away
+	 * from the read-mostly fields above.
+	 */
+	bool has_range_blocked ____cacheline_aligned_in_smp;
+	atomic_t tdh_mem_track;
 	atomic_t doing_track;
+	/* Epochs of TDH.MEM.TRACK to batch concurrent tdx_track(). */
+	spinlock_t track_lock;
+	u64 track_started;
+	u64 track_done;
+	atomic64_t event_head;
+
+	unsigned long *tdcs_pa ____cacheline_aligned_in_smp;
+	/* Pages reclaimed after the HKID is freed, see tdx_reclaim_batch_add(). */
+	spinlock_t reclaim_lock;
+	struct tdx_reclaim_batch *reclaim_batch;
+	atomic_t nr_reclaim_batches;
+	/* Runs the batches in the cgroups of the TD, see tdx_reclaim_in_cgroup. */
+	struct kthread_worker reclaim_worker;
+	struct task_struct *reclaim_task;
+
+	/* Serializes the release of hkid, see tdx_mmu_release_hkid(). */
+	struct mutex hkid_lock;
+	/*
+	 * Serializes TDH.VP.CREATE, TDH.VP.ADDCX and TDH.VP.INIT, which lock
+	 * the TDR/TDCS and fail with TDX_OPERAND_BUSY when the vCPUs are
+	 * initialized in parallel, see tdx_init_vcpus().
+	 */
+	struct mutex vp_init_lock;
+	struct misc_cg *misc_cg;
+	/* "tdx", or "tdx_reclaim" once destroyed, see tdx_hkid_start_reclaim(). */
+	enum misc_res_type misc_cg_res;
+	bool hkid_reclaiming;
+
+	hpa_t source_pa;
 
 	/*
 	 * For KVM_SET_CPUID to check consistency. Remember the one passed to
@@ -90,11 +215,12 @@ struct kvm_tdx {
 
 	atomic_t migration_in_progress;
 
-#ifdef CONFIG_KVM_TDX_ACCOUNT_PRIVATE_PAGES
-	atomic64_t ctl_pages;
-	atomic64_t sept_pages[PG_LEVEL_NUM - PG_LEVEL_4K];
-	atomic64_t td_pages;
-#endif
+	/*
+	 * Bounce buffer of the debug TD memory accesses, allocated on first
+	 * use and kept for the lifetime of the TD.
+	 */
+	struct mutex debug_mem_lock;
+	void *debug_mem_buf;
 
 	/*
 	 * Pointer to an array of tdx binding slots. Each servtd type has one
@@ -106,29 +232,21 @@ struct kvm_tdx {
 
 	/*
 	 * Used when being a servtd. A servtd can be bound to multiple user
-	 * TDs. Each entry in the array is a pointer to the user TD's binding
-	 * slot.
-	 */
-	struct tdx_binding_slot *usertd_binding_slots[SERVTD_SLOTS_MAX];
-
-	/*
-	 * The lock is on the servtd side, so when a user TD needs to lock,
-	 * it should lock the one from the service TD that it has bound to,
-	 * e.g. tdx_binding_slot->servtd_tdx->binding_slot_lock.
-	 *
-	 * The lock is used for two synchronization puporses:
-	 * #1 insertion and removal of a binding slot to the
-	 *    usertd_binding_slots array by different user TDs;
-	 * #2 read and write to the fields of a binding slot.
+	 * TDs. Each entry is a pointer to the user TD's binding slot, indexed
+	 * by its req_id, and marked while the user TD waits for pre-migration.
 	 *
-	 * In theory, #1 and #2 are two independent synchronization usages
-	 * and can use two separate locks. But those operations are neither
-	 * frequent nor in performance critical path, so simply use one lock
-	 * for the two purposes.
+	 * Binding and unbinding, on either side, are serialized by
+	 * tdx_servtd_binding_lock.  The servtd looks the slots up under RCU
+	 * and moves them between pre-migration states with cmpxchg(), see
+	 * migtd_wait_for_request().
 	 */
-	spinlock_t binding_slot_lock;
+	struct xarray usertd_binding_slots;
+	/* Next req_id to check for a migration request */
+	unsigned long migtd_req_next;
 
 	struct tdx_mig_state *mig_state;
+
+	struct tdx_vm_stat stat;
 };
 
 union tdx_exit_reason {
@@ -172,11 +290,23 @@ struct vcpu_tdx {
 	struct list_head pi_wakeup_list;
 	/* Until here same layout to struct vcpu_pi. */
 
-	unsigned long tdvpr_pa;
-	unsigned long *tdvpx_pa;
-
-	struct list_head cpu_list;
+	/*
+	 * Interrupts were posted during the current run, or before the last TD
+	 * entry, see tdx_protected_apic_has_interrupt().  Written by the
+	 * interrupt senders, like pi_desc.
+	 */
+	unsigned int buggy_hlt_workaround;
+	unsigned int buggy_hlt_entry;
+	bool interrupt_disabled_hlt;
+	/*
+	 * TD_VCPU_STATE_DETAILS_NON_ARCH.VMXIP since the last TD exit.  RVI only
+	 * changes while the TD runs, interrupts posted meanwhile stay in the PID.
+	 */
+	bool vmxip_valid;
+	bool vmxip;
 
+	/* Hot on each TD entry and exit. */
+	unsigned long tdvpr_pa ____cacheline_aligned;
 	union {
 		struct {
 			union {
@@ -196,17 +326,63 @@ struct vcpu_tdx {
 	u64 exit_gpa;
 	u32 exit_intr_info;
 
-	bool initialized;
-
 	bool host_state_need_save;
 	bool host_state_need_restore;
+	/*
+	 * The last TD exit was handled in the fastpath and re-entered with IRQs
+	 * still disabled, so the user-return MSR cache of this CPU is up to date.
+	 */
+	bool fastpath_reenter;
+	/* In tdx_vmcall_filter(), its BPF programs may set the outputs. */
+	bool in_vmcall_filter;
 	bool emulate_inject_bp;
+	/* Throttle on the exit as the vCPU write unblocked a page */
+	bool mig_throttle;
+
+	/* Histogram in stat for the last TD exit and its timestamp. */
+	u64 *exit_hist;
+	u64 exit_ns;
+	/*
+	 * MapGPA in progress: the end of its range and, if it was answered
+	 * with TDG_VP_VMCALL_RETRY, the GPA to resume from.  The retries of a
+	 * MapGPA aren't counted again, see tdx_map_gpa_stat().
+	 */
+	gpa_t map_gpa_next;
+	gpa_t map_gpa_end;
+	bool map_gpa_retry;
 
 	u64 msr_host_kernel_gs_base;
 	u64 guest_perf_global_ctrl;
 
-	bool interrupt_disabled_hlt;
-	unsigned int buggy_hlt_workaround;
+	/* Cold, used on vCPU creation, teardown and migration. */
+	unsigned long *tdvpx_pa ____cacheline_aligned;
+	/* The CPU the VP is associated with, on its cpu_list, or -1. */
+	int assoc_cpu;
+	struct list_head cpu_list;
+	bool initialized;
+
+	/* Mappings of the TDG.VP.VMCALL<Service> cmd and resp bufs */
+#define TDVMCALL_SERVBUF_CMD	0
+#define TDVMCALL_SERVBUF_RESP	1
+	struct gfn_to_pfn_cache servbuf_gpc[2];
+
+	/*
+	 * Fields of a debug TD read or written since the last TD exit, like
+	 * vcpu_vmx::segment_cache, to spend one TDH.VP.RD per field and exit.
+	 * Valid while VCPU_EXREG_SEGMENTS and VCPU_EXREG_RFLAGS are available.
+	 */
+	struct {
+		u64 bitmask; /* 4 bits per segment, then IDTR and GDTR */
+		struct {
+			u16 selector;
+			unsigned long base;
+			u32 limit;
+			u32 ar;
+		} seg[8];
+		struct desc_ptr idt;
+		struct desc_ptr gdt;
+	} segment_cache;
+	unsigned long rflags;
 
 	/*
 	 * Dummy to make pmu_intel not corrupt memory.
@@ -215,14 +391,37 @@ struct vcpu_tdx {
 	struct lbr_desc lbr_desc;
 
 	unsigned long dr6;
+
+	/*
+	 * Debug TD state cached from the TD VMCS, written back once on the next
+	 * TD entry, see tdx_flush_debug_state().
+	 */
+	u8 debug_dirty;
+	bool dr7_valid;
+	bool exception_bitmap_valid;
+	u32 exception_bitmap;
+	unsigned long dr7;
+
+	struct tdx_vcpu_stat stat;
 };
 
-static inline bool is_td(struct kvm *kvm)
+DECLARE_STATIC_KEY_FALSE(__kvm_has_tdx);
+
+/*
+ * Enabled once TDX is set up, so that on hosts without TDX the VM type checks
+ * of the vt_* dispatch and of the entry/exit paths are patched out.
+ */
+static __always_inline bool kvm_has_tdx(void)
 {
-	return kvm->arch.vm_type == KVM_X86_TDX_VM;
+	return static_branch_unlikely(&__kvm_has_tdx);
 }
 
-static inline bool is_td_vcpu(struct kvm_vcpu *vcpu)
+static __always_inline bool is_td(struct kvm *kvm)
+{
+	return kvm_has_tdx() && kvm->arch.vm_type == KVM_X86_TDX_VM;
+}
+
+static __always_inline bool is_td_vcpu(struct kvm_vcpu *vcpu)
 {
 	return is_td(vcpu->kvm);
 }
@@ -238,57 +437,70 @@ static inline struct kvm_tdx *to_kvm_tdx(struct kvm *kvm)
 	return container_of(kvm, struct kvm_tdx, kvm);
 }
 
+/*
+ * The host memory of a TD is accounted in its TDX stats: control pages,
+ * Secure-EPT pages by level, and private mappings by level.  The memcg of the
+ * VMM is charged for the pages themselves, these tell what they are for.
+ */
 static inline void tdx_account_ctl_page(struct kvm *kvm)
 {
-#ifdef CONFIG_KVM_TDX_ACCOUNT_PRIVATE_PAGES
-	atomic64_inc(&to_kvm_tdx(kvm)->ctl_pages);
-#endif
+	atomic64_inc(&to_kvm_tdx(kvm)->stat.ctl_pages);
 }
 
 static inline void tdx_unaccount_ctl_page(struct kvm *kvm)
 {
-#ifdef CONFIG_KVM_TDX_ACCOUNT_PRIVATE_PAGES
-	WARN_ON_ONCE(atomic64_dec_return(&to_kvm_tdx(kvm)->ctl_pages) < 0);
-#endif
+	WARN_ON_ONCE(atomic64_dec_return(&to_kvm_tdx(kvm)->stat.ctl_pages) < 0);
 }
 
 static inline void tdx_account_sept_page(struct kvm *kvm, enum pg_level level)
 {
-#ifdef CONFIG_KVM_TDX_ACCOUNT_PRIVATE_PAGES
 	WARN_ON_ONCE(level >= PG_LEVEL_NUM);
 	WARN_ON_ONCE(level < PG_LEVEL_4K);
-	atomic64_inc(&to_kvm_tdx(kvm)->sept_pages[level - PG_LEVEL_4K]);
-#endif
+	atomic64_inc(&to_kvm_tdx(kvm)->stat.sept_pages[level - PG_LEVEL_4K]);
 }
 
-static inline void tdx_unaccount_sept_page(struct kvm * kvm, enum pg_level level)
+static inline void tdx_unaccount_sept_page(struct kvm *kvm, enum pg_level level)
 {
-#ifdef CONFIG_KVM_TDX_ACCOUNT_PRIVATE_PAGES
 	WARN_ON_ONCE(level >= PG_LEVEL_NUM);
 	WARN_ON_ONCE(level < PG_LEVEL_4K);
-	WARN_ON_ONCE(atomic64_dec_return(&to_kvm_tdx(kvm)->sept_pages[level - PG_LEVEL_4K]) < 0);
-#endif
+	WARN_ON_ONCE(atomic64_dec_return(&to_kvm_tdx(kvm)->stat.sept_pages[level - PG_LEVEL_4K]) < 0);
 }
 
 static inline void tdx_account_td_pages(struct kvm *kvm,
 					     enum pg_level level)
 {
-#ifdef CONFIG_KVM_TDX_ACCOUNT_PRIVATE_PAGES
-	WARN_ON_ONCE(level >= PG_LEVEL_NUM);
+	WARN_ON_ONCE(level > KVM_MAX_HUGEPAGE_LEVEL);
 	WARN_ON_ONCE(level < PG_LEVEL_4K);
-	atomic64_add(KVM_PAGES_PER_HPAGE(level), &to_kvm_tdx(kvm)->td_pages);
-#endif
+	atomic64_inc(&to_kvm_tdx(kvm)->stat.private[level - PG_LEVEL_4K]);
 }
 
 static inline void tdx_unaccount_td_pages(struct kvm *kvm,
 					       enum pg_level level)
 {
-#ifdef CONFIG_KVM_TDX_ACCOUNT_PRIVATE_PAGES
-	WARN_ON_ONCE(level >= PG_LEVEL_NUM);
+	WARN_ON_ONCE(level > KVM_MAX_HUGEPAGE_LEVEL);
 	WARN_ON_ONCE(level < PG_LEVEL_4K);
-	WARN_ON_ONCE(atomic64_sub_return(KVM_PAGES_PER_HPAGE(level),
-					 &to_kvm_tdx(kvm)->td_pages) < 0);
-#endif
+	WARN_ON_ONCE(atomic64_dec_return(&to_kvm_tdx(kvm)->stat.private[level - PG_LEVEL_4K]) < 0);
+}
+
+#define TDX_PAGES_PER_DEMOTE(level)					\
+	(KVM_PAGES_PER_HPAGE(level) / KVM_PAGES_PER_HPAGE((level) - 1))
+
+/* A mapping at @level was demoted to 512 mappings at @level - 1. */
+static inline void tdx_account_td_pages_demote(struct kvm *kvm,
+						    enum pg_level level)
+{
+	tdx_unaccount_td_pages(kvm, level);
+	atomic64_add(TDX_PAGES_PER_DEMOTE(level),
+		     &to_kvm_tdx(kvm)->stat.private[level - 1 - PG_LEVEL_4K]);
+}
+
+/* 512 mappings at @level - 1 were promoted to one at @level. */
+static inline void tdx_account_td_pages_promote(struct kvm *kvm,
+						     enum pg_level level)
+{
+	WARN_ON_ONCE(atomic64_sub_return(TDX_PAGES_PER_DEMOTE(level),
+					 &to_kvm_tdx(kvm)->stat.private[level - 1 - PG_LEVEL_4K]) < 0);
+	tdx_account_td_pages(kvm, level);
 }
 
 static inline struct vcpu_tdx *to_tdx(struct kvm_vcpu *vcpu)
@@ -297,6 +509,25 @@ static inline struct vcpu_tdx *to_tdx(struct kvm_vcpu *vcpu)
 	return container_of(vcpu, struct vcpu_tdx, vcpu);
 }
 
+/*
+ * KVM can't read RFLAGS.IF of a TD vCPU, the guest tells whether it halts
+ * with interrupts disabled on TDG.VP.VMCALL<HLT>.
+ */
+static inline bool tdx_interrupt_disabled_hlt(struct kvm_vcpu *vcpu)
+{
+	return to_tdx(vcpu)->interrupt_disabled_hlt;
+}
+
+/* The TDVPS changed under KVM, e.g. by TDH.VP.INIT or a state import. */
+static inline void tdx_clear_state_cache(struct kvm_vcpu *vcpu)
+{
+	unsigned long *avail = (unsigned long *)&vcpu->arch.regs_avail;
+
+	__clear_bit(VCPU_EXREG_SEGMENTS, avail);
+	__clear_bit(VCPU_EXREG_RFLAGS, avail);
+	to_tdx(vcpu)->vmxip_valid = false;
+}
+
 static __always_inline void tdvps_vmcs_check(u32 field, u8 bits)
 {
 #define VMCS_ENC_ACCESS_TYPE_MASK	0x1UL
@@ -341,6 +572,19 @@ static __always_inline void tdvps_state_non_arch_check(u64 field, u8 bits) {}
 static __always_inline void tdvps_management_check(u64 field, u8 bits) {}
 static __always_inline void tdvps_state_check(u64 field, u8 bits) {}
 
+void tdx_associate_vp(struct vcpu_tdx *tdx);
+
+/*
+ * The TDX module associates a flushed VP with the CPU of the first SEAMCALL
+ * on it.  Track that CPU, to flush the VP there when it's loaded on another
+ * one.  Preemption must be disabled until the SEAMCALL is done.
+ */
+static __always_inline void tdx_track_vp_association(struct vcpu_tdx *tdx)
+{
+	if (unlikely(tdx->assoc_cpu != raw_smp_processor_id()))
+		tdx_associate_vp(tdx);
+}
+
 #define TDX_BUILD_TDVPS_ACCESSORS(bits, uclass, lclass)				\
 static __always_inline u##bits td_##lclass##_read##bits(struct vcpu_tdx *tdx,	\
 							u32 field)		\
@@ -349,7 +593,10 @@ static __always_inline u##bits td_##lclass##_read##bits(struct vcpu_tdx *tdx,	\
 	u64 err;								\
 										\
 	tdvps_##lclass##_check(field, bits);					\
+	preempt_disable();							\
+	tdx_track_vp_association(tdx);						\
 	err = tdh_vp_rd(tdx->tdvpr_pa, TDVPS_##uclass(field), &out);		\
+	preempt_enable();							\
 	if (KVM_BUG_ON(err, tdx->vcpu.kvm)) {					\
 		pr_err("TDH_VP_RD["#uclass".0x%x] failed: 0x%llx\n",		\
 		       field, err);						\
@@ -364,8 +611,11 @@ static __always_inline void td_##lclass##_write##bits(struct vcpu_tdx *tdx,	\
 	u64 err;								\
 										\
 	tdvps_##lclass##_check(field, bits);					\
+	preempt_disable();							\
+	tdx_track_vp_association(tdx);						\
 	err = tdh_vp_wr(tdx->tdvpr_pa, TDVPS_##uclass(field), val,		\
 		      GENMASK_ULL(bits - 1, 0), &out);				\
+	preempt_enable();							\
 	if (KVM_BUG_ON(err, tdx->vcpu.kvm))					\
 		pr_err("TDH_VP_WR["#uclass".0x%x] = 0x%llx failed: 0x%llx\n",	\
 		       field, (u64)val, err);					\
@@ -377,7 +627,10 @@ static __always_inline void td_##lclass##_setbit##bits(struct vcpu_tdx *tdx,	\
 	u64 err;								\
 										\
 	tdvps_##lclass##_check(field, bits);					\
+	preempt_disable();							\
+	tdx_track_vp_association(tdx);						\
 	err = tdh_vp_wr(tdx->tdvpr_pa, TDVPS_##uclass(field), bit, bit, &out);	\
+	preempt_enable();							\
 	if (KVM_BUG_ON(err, tdx->vcpu.kvm))					\
 		pr_err("TDH_VP_WR["#uclass".0x%x] |= 0x%llx failed: 0x%llx\n",	\
 		       field, bit, err);					\
@@ -389,7 +642,10 @@ static __always_inline void td_##lclass##_clearbit##bits(struct vcpu_tdx *tdx,	\
 	u64 err;								\
 										\
 	tdvps_##lclass##_check(field, bits);					\
+	preempt_disable();							\
+	tdx_track_vp_association(tdx);						\
 	err = tdh_vp_wr(tdx->tdvpr_pa, TDVPS_##uclass(field), 0, bit, &out);	\
+	preempt_enable();							\
 	if (KVM_BUG_ON(err, tdx->vcpu.kvm))					\
 		pr_err("TDH_VP_WR["#uclass".0x%x] &= ~0x%llx failed: 0x%llx\n",	\
 		       field, bit,  err);					\
@@ -432,11 +688,13 @@ struct vcpu_tdx {
 	struct kvm_vcpu	vcpu;
 };
 
+static inline bool kvm_has_tdx(void) { return false; }
 static inline bool is_td(struct kvm *kvm) { return false; }
 static inline bool is_td_vcpu(struct kvm_vcpu *vcpu) { return false; }
 static inline bool is_debug_td(struct kvm_vcpu *vcpu) { return false; }
 static inline struct kvm_tdx *to_kvm_tdx(struct kvm *kvm) { return NULL; }
 static inline struct vcpu_tdx *to_tdx(struct kvm_vcpu *vcpu) { return NULL; }
+static inline bool tdx_interrupt_disabled_hlt(struct kvm_vcpu *vcpu) { return false; }
 #endif /* CONFIG_INTEL_TDX_HOST */
 
 #endif /* __KVM_X86_TDX_H */
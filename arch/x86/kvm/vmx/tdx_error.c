@@ -3,6 +3,7 @@
 
 #include <linux/kernel.h>
 #include <linux/bug.h>
+#include <linux/kvm_host.h>
 
 #include "tdx_ops.h"
 
@@ -306,3 +307,10 @@ void pr_tdx_error(u64 op, u64 error_code, const struct tdx_module_args *out)
 		break;
 	}
 }
+
+void kvm_pr_tdx_error(struct kvm *kvm, u64 op, u64 error_code,
+		      const struct tdx_module_args *out)
+{
+	tdx_seamcall_stat(kvm, op, error_code);
+	pr_tdx_error(op, error_code, out);
+}
@@ -1,5 +1,6 @@
 // SPDX-License-Identifier: GPL-2.0
 #include <linux/anon_inodes.h>
+#include <linux/eventfd.h>
 #include <linux/kvm_host.h>
 
 struct tdx_mig_mbmd_data {
@@ -148,7 +149,10 @@ union tdx_mig_stream_info {
 };
 
 struct tdx_mig_stream {
+	struct kvm_tdx *kvm_tdx;
 	uint16_t idx;
+	/* Host CPU the stream is used on, -1 for any */
+	int cpu;
 	uint32_t buf_list_pages;
 	struct tdx_mig_mbmd mbmd;
 	/* List of buffers to export/import the TD private memory data */
@@ -161,10 +165,7 @@ struct tdx_mig_stream {
 	struct tdx_mig_mac_list mac_list[2];
 	/* List of TD private pages */
 	struct tdx_mig_buf_list td_buf_list;
-	/*
-	 * List of buffers grabbed either from the private_fd allocated pages
-	 * for in-place import or from mem_buf_list for non-in-place import.
-	 */
+	/* List of buffers grabbed from mem_buf_list to import from */
 	struct tdx_mig_buf_list import_mem_buf_list;
 	gfn_t import_gfns[TDX_MIG_GPA_LIST_MAX_ENTRIES];
 	uint64_t import_sptes[TDX_MIG_GPA_LIST_MAX_ENTRIES];
@@ -174,6 +175,16 @@ struct tdx_mig_stream {
 	 * Support up to 512 pages in a batch.
 	 */
 	uint64_t first_time_import_bitmap[8];
+
+	/* Serializes the ioctls of the stream */
+	struct mutex lock;
+
+	/* Asynchronous TDH.EXPORT.MEM, see tdx_mig_stream_export_mem_async() */
+	struct work_struct export_work;
+	struct eventfd_ctx *export_eventfd;
+	uint64_t export_npages;
+	int64_t export_ret;
+	bool export_pending;
 };
 
 struct tdx_mig_state {
@@ -191,8 +202,32 @@ struct tdx_mig_state {
 	struct tdx_mig_stream backward_stream;
 	hpa_t backward_migsc_paddr;
 	bool bugged;
-	/* Index of the next vCPU to export the state */
-	uint32_t vcpu_export_next_idx;
+	/*
+	 * The vCPUs whose state is exported or being exported, claimed by the
+	 * streams so that the vCPUs can be exported on all of them concurrently.
+	 */
+	DECLARE_BITMAP(vcpu_exported, KVM_MAX_VCPUS);
+	/* Asynchronous TDH.EXPORT.MEMs in flight, see tdx_mig_flush_exports() */
+	atomic_t exports_pending;
+	wait_queue_head_t exports_wq;
+
+	/* Counters of the current epoch, see tdx_mig_export_track() */
+	atomic64_t epoch_pages_blocked;
+	atomic64_t epoch_pages_redirtied;
+	atomic64_t epoch_pages_exported;
+	atomic64_t epoch_shared_dirtied;
+	u64 epoch_start_ns;
+	struct kvm_tdx_mig_epoch_stats last_epoch;
+	u64 last_epoch_shared_dirtied;
+	/* Delay of vCPUs on write unblock to make a write heavy TD converge */
+	uint32_t throttle_us;
+
+	/* The destination TD runs while the private pages are imported */
+	bool postcopy;
+	/* GFNs not present on the source TD, i.e. to be added on fault */
+	struct xarray postcopy_resolved;
+	/* Number of 4K pages imported per 2M range, to promote at the end */
+	struct xarray import_2m_pages;
 };
 
 struct tdx_mig_capabilities {
@@ -285,15 +320,13 @@ static void tdx_write_block_private_pages(struct kvm *kvm, gfn_t *gfns,
 	uint64_t err;
 
 	for (start = 0; start < num; start += blockw_num) {
-		if (num > max_num)
-			blockw_num = max_num;
-		else
-			blockw_num = num;
+		blockw_num = min(num - start, max_num);
 
 		tdx_mig_gpa_list_init(gpa_list, gfns + start, blockw_num);
 		do {
 			err = tdh_export_blockw(kvm_tdx->tdr_pa,
 						gpa_list->info.val, &out);
+			tdx_seamcall_stat(&kvm_tdx->kvm, TDH_EXPORT_BLOCKW, err);
 			if (seamcall_masked_status(err) ==
 						TDX_INTERRUPTED_RESUMABLE)
 				gpa_list->info.val = out.rcx;
@@ -308,6 +341,9 @@ static void tdx_write_block_private_pages(struct kvm *kvm, gfn_t *gfns,
 		}
 	}
 
+	atomic64_add(num, &kvm_tdx->mig_state->epoch_pages_blocked);
+	atomic64_add(num, &kvm->stat.tdx_blockw_pages);
+
 	/* Request for tdx_track as the W bit gets removed */
 	smp_store_release(&kvm_tdx->has_range_blocked, true);
 }
@@ -327,15 +363,33 @@ static void tdx_write_unblock_private_page(struct kvm *kvm,
 		.gfn = gfn,
 		.rsvd2 = 0,
 	};
+	struct kvm_vcpu *vcpu;
 	uint64_t err;
 
-	tdx_track(kvm);
+	atomic64_inc(&kvm_tdx->mig_state->epoch_pages_redirtied);
+	/* Throttled in tdx_handle_exit(), not in the page fault path. */
+	vcpu = kvm_get_running_vcpu();
+	if (vcpu && READ_ONCE(kvm_tdx->mig_state->throttle_us))
+		to_tdx(vcpu)->mig_throttle = true;
 
+	/*
+	 * TDH.EXPORT.UNBLOCKW needs a TLB tracking since the page was write
+	 * blocked.  After a BLOCKW round, one TDH.MEM.TRACK covers the write
+	 * faults on all the blocked pages, so track only when the TDX module
+	 * asks for it instead of on every write fault.
+	 */
 	err = tdh_export_unblockw(kvm_tdx->tdr_pa, ept_info.val, &out);
+	if (seamcall_masked_status(err) == TDX_TLB_TRACKING_NOT_DONE) {
+		tdx_seamcall_stat(kvm, TDH_EXPORT_UNBLOCKW, err);
+		tdx_track(kvm);
+		err = tdh_export_unblockw(kvm_tdx->tdr_pa, ept_info.val, &out);
+	}
 	if (err != TDX_SUCCESS) {
 		kvm_tdx->mig_state->bugged = true;
 		pr_err("%s failed, err=%llx, gfn=%llx\n", __func__, err, gfn);
+		return;
 	}
+	atomic64_add(KVM_PAGES_PER_HPAGE(level), &kvm->stat.tdx_unblockw_pages);
 }
 
 static void tdx_mig_stream_get_tdx_mig_attr(struct tdx_mig_stream *stream,
@@ -450,9 +504,9 @@ static int tdx_mig_stream_buf_list_alloc(struct tdx_mig_buf_list *buf_list)
 }
 
 static int tdx_mig_stream_buf_list_setup(struct tdx_mig_buf_list *buf_list,
-					 uint32_t npages)
+					 uint32_t npages, int nid)
 {
-	int i;
+	int i, order;
 	struct page *page;
 
 	if (!npages) {
@@ -463,8 +517,25 @@ static int tdx_mig_stream_buf_list_setup(struct tdx_mig_buf_list *buf_list,
 	if (tdx_mig_stream_buf_list_alloc(buf_list))
 		return -ENOMEM;
 
+	/*
+	 * Take the buffers from one physically contiguous chunk, i.e. a 2M
+	 * page for a full list, if there's one.  split_page() keeps each of
+	 * them a separately refcounted 4K page for the mmap() and cleanup.
+	 */
+	order = get_order(npages * PAGE_SIZE);
+	page = alloc_pages_node(nid, GFP_KERNEL_ACCOUNT | __GFP_ZERO |
+				__GFP_NOWARN | __GFP_NORETRY, order);
+	if (page) {
+		split_page(page, order);
+		for (i = 0; i < npages; i++)
+			buf_list->entries[i].pfn = page_to_pfn(page + i);
+		for (; i < (1 << order); i++)
+			__free_page(page + i);
+		goto out;
+	}
+
 	for (i = 0; i < npages; i++) {
-		page = alloc_page(GFP_KERNEL_ACCOUNT | __GFP_ZERO);
+		page = alloc_pages_node(nid, GFP_KERNEL_ACCOUNT | __GFP_ZERO, 0);
 		if (!page) {
 			tdx_mig_stream_buf_list_cleanup(buf_list);
 			return -ENOMEM;
@@ -472,6 +543,7 @@ static int tdx_mig_stream_buf_list_setup(struct tdx_mig_buf_list *buf_list,
 		buf_list->entries[i].pfn = page_to_pfn(page);
 	}
 
+out:
 	/* Mark unused entries as invalid */
 	for (i = npages; i < 512; i++)
 		buf_list->entries[i].invalid = true;
@@ -540,7 +612,9 @@ static int tdx_mig_stream_setup(struct tdx_mig_stream *stream, bool is_src)
 		goto err_mbmd;
 
 	ret = tdx_mig_stream_buf_list_setup(&stream->mem_buf_list,
-					    stream->buf_list_pages);
+					    stream->buf_list_pages,
+					    stream->cpu < 0 ? NUMA_NO_NODE :
+					    cpu_to_node(stream->cpu));
 	if (ret)
 		goto err_mem_buf_list;
 
@@ -558,14 +632,13 @@ static int tdx_mig_stream_setup(struct tdx_mig_stream *stream, bool is_src)
 	if (ret)
 		goto err_mac_list0;
 	/*
-	 * The 2nd mac list is needed only when the buf list uses more than
-	 * 256 entries
+	 * The 2nd mac list is used only when the buf list uses more than 256
+	 * entries.  Allocate it anyway so that the whole mmap() range of the
+	 * stream can be registered at once, e.g. as one RDMA memory region.
 	 */
-	if (stream->buf_list_pages > 256) {
-		ret = tdx_mig_stream_mac_list_setup(&stream->mac_list[1]);
-		if (ret)
-			goto err_mac_list1;
-	}
+	ret = tdx_mig_stream_mac_list_setup(&stream->mac_list[1]);
+	if (ret)
+		goto err_mac_list1;
 
 	/* The lists used by the destination TD only */
 	if (!is_src) {
@@ -624,6 +697,23 @@ static int tdx_mig_stream_set_attr(struct kvm_device *dev,
 					   tdx_is_migration_source(kvm_tdx));
 		break;
 	}
+	case KVM_DEV_TDX_MIG_ATTR_CPU: {
+		int cpu;
+
+		/* The buffers have been allocated. */
+		if (stream->mem_buf_list.entries)
+			return -EBUSY;
+
+		if (get_user(cpu, (int __user *)uaddr))
+			return -EFAULT;
+
+		if (cpu != -1 && (cpu < 0 || cpu >= nr_cpu_ids || !cpu_possible(cpu)))
+			return -EINVAL;
+
+		stream->cpu = cpu;
+		ret = 0;
+		break;
+	}
 	default:
 		return -EINVAL;
 	}
@@ -682,9 +772,27 @@ static const struct vm_operations_struct tdx_mig_stream_ops = {
 	.fault = tdx_mig_stream_fault,
 };
 
+/*
+ * The buffer pages are mapped as is, so userspace can send the exported data
+ * straight from the mapping, e.g. with MSG_ZEROCOPY or by registering it as
+ * io_uring fixed buffers.  It must not export to the stream again until those
+ * sends have completed.  A private mapping would send or fill CoW copies of
+ * the pages, so only shared mappings are allowed.
+ *
+ * The pages are ordinary unmovable kernel pages, so the mapping can also be
+ * pinned long term, e.g. registered as an RDMA memory region covering the
+ * MBMD, GPA list, MAC lists and buffers, and RDMA written to the import
+ * buffers of the destination stream.  The same rule applies: the next
+ * export or import on the stream must wait for the work completions.  A
+ * pin outlives the stream harmlessly, its pages are only freed on unpin.
+ */
 static int tdx_mig_stream_mmap(struct kvm_device *dev,
 			       struct vm_area_struct *vma)
 {
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
 	vma->vm_ops = &tdx_mig_stream_ops;
 
 	return 0;
@@ -705,6 +813,7 @@ static int tdx_mig_export_state_immutable(struct kvm_tdx *kvm_tdx,
 						 page_list->info.val,
 						 stream_info.val,
 						 &out);
+		tdx_seamcall_stat(&kvm_tdx->kvm, TDH_EXPORT_STATE_IMMUTABLE, err);
 		if (seamcall_masked_status(err) == TDX_INTERRUPTED_RESUMABLE)
 			stream_info.resume = 1;
 	} while (seamcall_masked_status(err) == TDX_INTERRUPTED_RESUMABLE);
@@ -741,6 +850,7 @@ static int tdx_mig_import_state_immutable(struct kvm_tdx *kvm_tdx,
 						 page_list->info.val,
 						 stream_info.val,
 						 &out);
+		tdx_seamcall_stat(&kvm_tdx->kvm, TDH_IMPORT_STATE_IMMUTABLE, err);
 		if (seamcall_masked_status(err) == TDX_INTERRUPTED_RESUMABLE)
 			stream_info.resume = 1;
 	} while (seamcall_masked_status(err) == TDX_INTERRUPTED_RESUMABLE);
@@ -789,32 +899,61 @@ static void tdx_mig_handle_export_mem_error(struct kvm *kvm,
 	}
 }
 
-static int64_t tdx_mig_stream_export_mem(struct kvm_tdx *kvm_tdx,
-					 struct tdx_mig_stream *stream,
-					 uint64_t __user *data)
+/*
+ * The exported pages are ciphertext, so nothing about their contents is known
+ * to KVM.  But a GFN without a private leaf in the S-EPT, e.g. never added or
+ * converted to shared, has no private page to export.  A blocked or frozen
+ * leaf still has one and is exported.  Turn those entries
+ * into NOPs so that no migration buffer is spent on them.  The GPA list is
+ * shared with userspace, which sees the updated operation.  Cancelling a page
+ * exported earlier is left to userspace with GPA_LIST_OP_CANCEL.
+ */
+static void tdx_mig_gpa_list_skip_unmapped(struct kvm *kvm,
+					   struct tdx_mig_gpa_list *gpa_list,
+					   uint64_t npages)
+{
+	union tdx_mig_gpa_list_entry *entry;
+	struct kvm_memory_slot *slot;
+	uint64_t i;
+
+	read_lock(&kvm->mmu_lock);
+	for (i = 0; i < npages; i++) {
+		entry = &gpa_list->entries[i];
+		if (entry->operation != GPA_LIST_OP_EXPORT)
+			continue;
+
+		slot = gfn_to_memslot(kvm, (gfn_t)entry->gfn);
+		if (!slot || !kvm_slot_can_be_private(slot))
+			continue;
+
+		if (!kvm_mmu_gfn_has_private_leaf(kvm, slot, (gfn_t)entry->gfn))
+			entry->operation = GPA_LIST_OP_NOP;
+	}
+	read_unlock(&kvm->mmu_lock);
+}
+
+/* Returns the number of exported pages or a negative error code. */
+static int64_t __tdx_mig_stream_export_mem(struct kvm_tdx *kvm_tdx,
+					   struct tdx_mig_stream *stream,
+					   uint64_t npages)
 {
 	struct tdx_mig_state *mig_state = kvm_tdx->mig_state;
 	struct tdx_mig_gpa_list *gpa_list = &stream->gpa_list;
 	struct tdx_mig_buf_list *mem_buf_list = &stream->mem_buf_list;
 	union tdx_mig_stream_info stream_info = {.val = 0};
 	struct tdx_module_args out;
-	uint64_t npages, err;
+	uint64_t err;
 
 	if (mig_state->bugged)
 		return -EBADF;
 
-	if (copy_from_user(&npages, (void __user *)data, sizeof(uint64_t)))
-		return -EFAULT;
-
-	if (npages > stream->buf_list_pages)
-		return -EINVAL;
-
 	/*
 	 * The gpa list page is shared to userspace to fill GPAs directly.
 	 * Only need to update the gpa_list info fields here.
 	 */
 	gpa_list->info.first_entry = 0;
 	gpa_list->info.last_entry = npages - 1;
+	tdx_mig_gpa_list_skip_unmapped(&kvm_tdx->kvm, gpa_list, npages);
 	tdx_mig_buf_list_set_valid(&stream->mem_buf_list, npages);
 
 	stream_info.index = stream->idx;
@@ -827,6 +966,7 @@ static int64_t tdx_mig_stream_export_mem(struct kvm_tdx *kvm_tdx,
 				     stream->mac_list[1].hpa,
 				     stream_info.val,
 				     &out);
+		tdx_seamcall_stat(&kvm_tdx->kvm, TDH_EXPORT_MEM, err);
 		if (seamcall_masked_status(err) == TDX_INTERRUPTED_RESUMABLE) {
 			stream_info.resume = 1;
 			/* Update the gpa_list_info (mainly first_entry) */
@@ -843,18 +983,155 @@ static int64_t tdx_mig_stream_export_mem(struct kvm_tdx *kvm_tdx,
 		 * 1 for GPA list and 1 for MAC list
 		 * TODO: Improve by checking GPA list entries
 		 */
-		out.rdx = out.rdx - 2;
-		if (copy_to_user(data, &out.rdx, sizeof(uint64_t)))
-			return -EFAULT;
-	} else {
-		pr_err("%s: err=%llx, gfn=%llx\n",
-			__func__, err, (uint64_t)gpa_list->entries[0].gfn);
-		return -EIO;
+		atomic64_add(out.rdx - 2, &mig_state->epoch_pages_exported);
+		return out.rdx - 2;
+	}
+
+	pr_err("%s: err=%llx, gfn=%llx\n",
+		__func__, err, (uint64_t)gpa_list->entries[0].gfn);
+	return -EIO;
+}
+
+static int tdx_mig_stream_export_mem(struct kvm_tdx *kvm_tdx,
+				     struct tdx_mig_stream *stream,
+				     uint64_t __user *data)
+{
+	uint64_t npages;
+	int64_t ret;
+	int idx;
+
+	if (copy_from_user(&npages, (void __user *)data, sizeof(uint64_t)))
+		return -EFAULT;
+
+	if (npages > stream->buf_list_pages)
+		return -EINVAL;
+
+	idx = srcu_read_lock(&kvm_tdx->kvm.srcu);
+	ret = __tdx_mig_stream_export_mem(kvm_tdx, stream, npages);
+	srcu_read_unlock(&kvm_tdx->kvm.srcu, idx);
+	if (ret < 0)
+		return ret;
+
+	npages = ret;
+	if (copy_to_user(data, &npages, sizeof(uint64_t)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static struct workqueue_struct *tdx_mig_wq;
+
+static void tdx_mig_stream_export_mem_work(struct work_struct *work)
+{
+	struct tdx_mig_stream *stream = container_of(work,
+						     struct tdx_mig_stream,
+						     export_work);
+	struct kvm *kvm = &stream->kvm_tdx->kvm;
+	int idx;
+
+	/* The GPA list entries are checked against the memslots. */
+	idx = srcu_read_lock(&kvm->srcu);
+	stream->export_ret = __tdx_mig_stream_export_mem(stream->kvm_tdx,
+							 stream,
+							 stream->export_npages);
+	srcu_read_unlock(&kvm->srcu, idx);
+
+	/* Pairs with smp_load_acquire() in tdx_mig_stream_export_mem_result() */
+	smp_store_release(&stream->export_pending, false);
+	eventfd_signal(stream->export_eventfd, 1);
+
+	if (atomic_dec_and_test(&stream->kvm_tdx->mig_state->exports_pending))
+		wake_up_all(&stream->kvm_tdx->mig_state->exports_wq);
+}
+
+/*
+ * Wait for the asynchronous exports of all the streams, which run against the
+ * TD state that VM-level commands, e.g. track, pause and abort, change.
+ */
+static void tdx_mig_flush_exports(struct tdx_mig_state *mig_state)
+{
+	wait_event(mig_state->exports_wq,
+		   !atomic_read(&mig_state->exports_pending));
+}
+
+/*
+ * Kick TDH.EXPORT.MEM on a workqueue, optionally on a given host CPU, and
+ * return to userspace right away.  The completion is signaled on the eventfd
+ * and the result is read with KVM_TDX_MIG_EXPORT_MEM_RESULT.  With N streams
+ * and two streams per host CPU, userspace can consume the buffers of one
+ * stream while the other one is exported.
+ */
+static int tdx_mig_stream_export_mem_async(struct kvm_tdx *kvm_tdx,
+					   struct tdx_mig_stream *stream,
+					   void __user *data)
+{
+	struct kvm_tdx_mig_export_mem_async args;
+	struct eventfd_ctx *eventfd;
+	bool queued;
+
+	if (copy_from_user(&args, data, sizeof(args)))
+		return -EFAULT;
+
+	if (!args.npages || args.npages > stream->buf_list_pages)
+		return -EINVAL;
+
+	if (args.cpu != -1 &&
+	    (args.cpu < 0 || args.cpu >= nr_cpu_ids || !cpu_online(args.cpu)))
+		return -EINVAL;
+
+	lockdep_assert_held(&stream->lock);
+	if (READ_ONCE(stream->export_pending))
+		return -EBUSY;
+
+	/* The previous work may still be signaling the eventfd put below. */
+	flush_work(&stream->export_work);
+
+	eventfd = eventfd_ctx_fdget(args.eventfd);
+	if (IS_ERR(eventfd))
+		return PTR_ERR(eventfd);
+	if (stream->export_eventfd)
+		eventfd_ctx_put(stream->export_eventfd);
+	stream->export_eventfd = eventfd;
+
+	stream->export_npages = args.npages;
+	stream->export_ret = 0;
+	atomic_inc(&kvm_tdx->mig_state->exports_pending);
+	WRITE_ONCE(stream->export_pending, true);
+	if (args.cpu == -1 && stream->cpu >= 0 && cpu_online(stream->cpu))
+		args.cpu = stream->cpu;
+	if (args.cpu == -1)
+		queued = queue_work(tdx_mig_wq, &stream->export_work);
+	else
+		queued = queue_work_on(args.cpu, tdx_mig_wq,
+				       &stream->export_work);
+	if (WARN_ON_ONCE(!queued)) {
+		WRITE_ONCE(stream->export_pending, false);
+		if (atomic_dec_and_test(&kvm_tdx->mig_state->exports_pending))
+			wake_up_all(&kvm_tdx->mig_state->exports_wq);
+		return -EBUSY;
 	}
 
 	return 0;
 }
 
+static int tdx_mig_stream_export_mem_result(struct tdx_mig_stream *stream,
+					    uint64_t __user *data)
+{
+	uint64_t npages;
+
+	if (smp_load_acquire(&stream->export_pending))
+		return -EBUSY;
+
+	if (stream->export_ret < 0)
+		return stream->export_ret;
+
+	npages = stream->export_ret;
+	if (copy_to_user(data, &npages, sizeof(uint64_t)))
+		return -EFAULT;
+
+	return 0;
+}
+
 static bool gpa_skip_import(union tdx_mig_gpa_list_entry *entry)
 {
 	return entry->operation == GPA_LIST_OP_NOP;
@@ -865,14 +1142,6 @@ static bool gpa_cancel_import(union tdx_mig_gpa_list_entry *entry)
 	return entry->operation == GPA_LIST_OP_CANCEL;
 }
 
-static void tdx_mig_mem_buf_copy(kvm_pfn_t to_pfn, kvm_pfn_t from_pfn)
-{
-	void *to_va =  __va(to_pfn << PAGE_SHIFT);
-	void *from_va = __va(from_pfn << PAGE_SHIFT);
-
-	memcpy(to_va, from_va, PAGE_SIZE);
-}
-
 static int import_mem_buf_init(struct kvm *kvm,
 			       uint64_t *sptes,
 			       uint64_t npages,
@@ -897,29 +1166,21 @@ static int import_mem_buf_init(struct kvm *kvm,
 		gpa_list_entry = &gpa_list->entries[i];
 		pfn = (sptes[i] & TDX_SPTE_PFN_MASK) >> PAGE_SHIFT;
 		import_mem_buf_entries[i].invalid = false;
-		if (test_bit_le(i, first_time_import_bitmap)) {
-			if (gpa_list_entry->operation != GPA_LIST_OP_EXPORT) {
-				pr_err("%s: unexpected, entry->operation=%d\n",
-					__func__, gpa_list_entry->operation);
-				return -EINVAL;
-			}
-			 /*
-			  * First time import: copy data from shared memory to
-			  * the restricted memory page that will be used as the
-			  * TD private page with in-place import. According to
-			  * the TDX ABI spec, the restricted mem page's pfn
-			  * needs to be set to the related mem_buf_list entry
-			  * for in-place import.
-			  */
-			tdx_mig_mem_buf_copy(pfn,
-					(kvm_pfn_t)mem_buf_entries[i].pfn);
-			import_mem_buf_entries[i].pfn = pfn;
-			td_buf_entries[i].invalid = true;
-		} else {
-			import_mem_buf_entries[i].pfn = mem_buf_entries[i].pfn;
-			td_buf_entries[i].pfn = pfn;
-			td_buf_entries[i].invalid = false;
+		if (test_bit_le(i, first_time_import_bitmap) &&
+		    gpa_list_entry->operation != GPA_LIST_OP_EXPORT) {
+			pr_err("%s: unexpected, entry->operation=%d\n",
+				__func__, gpa_list_entry->operation);
+			return -EINVAL;
 		}
+		/*
+		 * Import from the buffer page filled by userspace via mmap
+		 * directly into the restricted memory page, i.e. not in-place
+		 * import, also for the first time import.  This avoids copying
+		 * the data to the restricted memory page first.
+		 */
+		import_mem_buf_entries[i].pfn = mem_buf_entries[i].pfn;
+		td_buf_entries[i].pfn = pfn;
+		td_buf_entries[i].invalid = false;
 	}
 
 	/*
@@ -940,6 +1201,25 @@ static int import_mem_buf_init(struct kvm *kvm,
 	return 0;
 }
 
+/*
+ * Pages are imported by 4K, count them per 2M range so that the ranges
+ * imported whole can be promoted once the import is done.  Only used as a
+ * hint, a failed update just leaves the range at 4K.
+ */
+static void tdx_mig_import_2m_pages_add(struct tdx_mig_state *mig_state,
+					gfn_t gfn, long delta)
+{
+	unsigned long index = gfn >> KVM_HPAGE_GFN_SHIFT(PG_LEVEL_2M);
+	struct xarray *xa = &mig_state->import_2m_pages;
+	unsigned long nr;
+
+	xa_lock(xa);
+	nr = xa_to_value(xa_load(xa, index)) + delta;
+	__xa_store(xa, index, nr ? xa_mk_value(nr) : NULL,
+		   GFP_NOWAIT | __GFP_ACCOUNT);
+	xa_unlock(xa);
+}
+
 static int tdx_mig_stream_import_private_pages(struct kvm *kvm,
 					       uint64_t *sptes,
 					       uint64_t npages,
@@ -950,7 +1230,7 @@ static int tdx_mig_stream_import_private_pages(struct kvm *kvm,
 	struct tdx_mig_gpa_list *gpa_list = &stream->gpa_list;
 	union tdx_mig_stream_info stream_info = {.val = 0};
 	struct tdx_module_args out;
-	uint64_t err;
+	uint64_t err, i;
 	int ret;
 
 	ret = import_mem_buf_init(kvm, sptes, npages, gpa_list,
@@ -972,6 +1252,7 @@ static int tdx_mig_stream_import_private_pages(struct kvm *kvm,
 				     stream->td_buf_list.hpa,
 				     stream_info.val,
 				     &out);
+		tdx_seamcall_stat(&kvm_tdx->kvm, TDH_IMPORT_MEM, err);
 		if (seamcall_masked_status(err) == TDX_INTERRUPTED_RESUMABLE) {
 			stream_info.resume = 1;
 			gpa_list->info.val = out.rcx;
@@ -985,6 +1266,23 @@ static int tdx_mig_stream_import_private_pages(struct kvm *kvm,
 		return -EIO;
 	}
 
+	for (i = 0; i < npages; i++) {
+		if (sptes[i]) {
+			tdx_track_private_pages(
+				pfn_to_hpa(stream->td_buf_list.entries[i].pfn),
+				PAGE_SIZE);
+			if (test_bit_le(i, stream->first_time_import_bitmap)) {
+				tdx_account_td_pages(kvm, PG_LEVEL_4K);
+				tdx_mig_import_2m_pages_add(kvm_tdx->mig_state,
+							    gpa_list->entries[i].gfn, 1);
+			}
+		} else if (gpa_cancel_import(&gpa_list->entries[i])) {
+			tdx_unaccount_td_pages(kvm, PG_LEVEL_4K);
+			tdx_mig_import_2m_pages_add(kvm_tdx->mig_state,
+						    gpa_list->entries[i].gfn, -1);
+		}
+	}
+
 	return 0;
 }
 
@@ -1034,6 +1332,29 @@ static int tdx_mig_stream_import_mem(struct kvm_tdx *kvm_tdx,
 					    stream);
 }
 
+/*
+ * An epoch ends with TDH.EXPORT.TRACK.  Save the counters of the ending epoch
+ * for KVM_TDX_MIG_GET_EPOCH_STATS, so that userspace can tell from the dirty
+ * rate vs. the export throughput whether pre-copy converges, and throttle
+ * the TD or switch to post-copy otherwise.
+ */
+static void tdx_mig_epoch_stats_update(struct tdx_mig_state *mig_state)
+{
+	struct kvm_tdx_mig_epoch_stats *last = &mig_state->last_epoch;
+	u64 now = ktime_get_ns();
+
+	last->epoch++;
+	last->duration_ns = now - mig_state->epoch_start_ns;
+	last->pages_blocked = atomic64_xchg(&mig_state->epoch_pages_blocked, 0);
+	last->pages_redirtied =
+		atomic64_xchg(&mig_state->epoch_pages_redirtied, 0);
+	last->pages_exported =
+		atomic64_xchg(&mig_state->epoch_pages_exported, 0);
+	mig_state->last_epoch_shared_dirtied =
+		atomic64_xchg(&mig_state->epoch_shared_dirtied, 0);
+	mig_state->epoch_start_ns = now;
+}
+
 static int tdx_mig_export_track(struct kvm_tdx *kvm_tdx,
 				struct tdx_mig_stream *stream,
 				uint64_t __user *data)
@@ -1056,9 +1377,99 @@ static int tdx_mig_export_track(struct kvm_tdx *kvm_tdx,
 		return -EIO;
 	}
 
+	tdx_mig_epoch_stats_update(kvm_tdx->mig_state);
+	return 0;
+}
+
+static int tdx_mig_get_epoch_stats(struct kvm_tdx *kvm_tdx,
+				   void __user *data)
+{
+	struct tdx_mig_state *mig_state = kvm_tdx->mig_state;
+
+	if (copy_to_user(data, &mig_state->last_epoch,
+			 sizeof(mig_state->last_epoch)))
+		return -EFAULT;
+
 	return 0;
 }
 
+/*
+ * Count the shared memory dirtied by the TD in the same epochs as the private
+ * memory.  With dirty logging, the first write to a shared page after its
+ * dirty bit is cleared faults like the first write to a write blocked private
+ * page does, see tdx_write_unblock_private_page().
+ */
+static void tdx_mig_shared_write_fault(struct kvm_vcpu *vcpu)
+{
+	struct tdx_mig_state *mig_state = to_kvm_tdx(vcpu->kvm)->mig_state;
+
+	if (mig_state && atomic_read(&vcpu->kvm->nr_memslots_dirty_logging))
+		atomic64_inc(&mig_state->epoch_shared_dirtied);
+}
+
+/*
+ * Both kinds of memory have to be sent until what's left converges, and each
+ * epoch adds what the TD dirtied meanwhile.  Weigh each by its pending pages
+ * plus the pages it got dirtied in the last epoch, so that neither the side
+ * with the bigger backlog nor the one dirtied faster starves the other and
+ * both drain at the same time, which minimizes the total time and leaves the
+ * least for the stop-and-copy phase.
+ */
+static int tdx_mig_get_sched(struct kvm_tdx *kvm_tdx, void __user *data)
+{
+	struct tdx_mig_state *mig_state = kvm_tdx->mig_state;
+	struct kvm_tdx_mig_sched sched;
+	u64 private, shared;
+
+	if (copy_from_user(&sched, data, sizeof(sched)))
+		return -EFAULT;
+
+	if (sched.padding)
+		return -EINVAL;
+
+	sched.shared_pages_dirtied = mig_state->last_epoch_shared_dirtied;
+	private = sched.private_pending + mig_state->last_epoch.pages_redirtied;
+	shared = sched.shared_pending + sched.shared_pages_dirtied;
+	if (private + shared < private)
+		return -EINVAL;
+
+	if (private + shared)
+		sched.private_permille = mul_u64_u64_div_u64(private, 1000,
+							     private + shared);
+	else
+		sched.private_permille = 500;
+
+	if (copy_to_user(data, &sched, sizeof(sched)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static int tdx_mig_set_throttle(struct kvm_tdx *kvm_tdx,
+				uint64_t __user *data)
+{
+	uint64_t throttle_us;
+
+	if (copy_from_user(&throttle_us, data, sizeof(uint64_t)))
+		return -EFAULT;
+
+	if (throttle_us > KVM_TDX_MIG_THROTTLE_US_MAX)
+		return -EINVAL;
+
+	WRITE_ONCE(kvm_tdx->mig_state->throttle_us, throttle_us);
+	return 0;
+}
+
+static void tdx_mig_throttle(struct kvm_vcpu *vcpu)
+{
+	struct tdx_mig_state *mig_state = to_kvm_tdx(vcpu->kvm)->mig_state;
+	uint32_t throttle_us = READ_ONCE(mig_state->throttle_us);
+
+	to_tdx(vcpu)->mig_throttle = false;
+	if (throttle_us)
+		fsleep(throttle_us);
+}
+
 static inline bool
 tdx_mig_epoch_is_start_token(struct tdx_mig_mbmd_data *data)
 {
@@ -1118,6 +1529,7 @@ static int tdx_mig_export_state_td(struct kvm_tdx *kvm_tdx,
 					  stream->page_list.info.val,
 					  stream_info.val,
 					  &out);
+		tdx_seamcall_stat(&kvm_tdx->kvm, TDH_EXPORT_STATE_TD, err);
 		if (seamcall_masked_status(err) == TDX_INTERRUPTED_RESUMABLE)
 			stream_info.resume = 1;
 	} while (seamcall_masked_status(err) == TDX_INTERRUPTED_RESUMABLE);
@@ -1152,6 +1564,7 @@ static int tdx_mig_import_state_td(struct kvm_tdx *kvm_tdx,
 					  page_list->info.val,
 					  stream_info.val,
 					  &out);
+		tdx_seamcall_stat(&kvm_tdx->kvm, TDH_IMPORT_STATE_TD, err);
 		if (seamcall_masked_status(err) == TDX_INTERRUPTED_RESUMABLE)
 			stream_info.resume = 1;
 	} while (seamcall_masked_status(err) == TDX_INTERRUPTED_RESUMABLE);
@@ -1165,6 +1578,11 @@ static int tdx_mig_import_state_td(struct kvm_tdx *kvm_tdx,
 	return 0;
 }
 
+/*
+ * Export the state of the next vCPU not claimed by another stream.  Streams
+ * run TDH.EXPORT.STATE.VP on different vCPUs concurrently, so userspace can
+ * spread the vCPUs over all the streams of the session.
+ */
 static int tdx_mig_export_state_vp(struct kvm_tdx *kvm_tdx,
 				   struct tdx_mig_stream *stream,
 				   uint64_t __user *data)
@@ -1176,17 +1594,17 @@ static int tdx_mig_export_state_vp(struct kvm_tdx *kvm_tdx,
 	union tdx_mig_stream_info stream_info = {.val = 0};
 	struct tdx_module_args out;
 	uint64_t err;
-	int cpu;
+	int cpu, idx, nr_vcpus = atomic_read(&kvm->online_vcpus);
 
-	if (mig_state->vcpu_export_next_idx >=
-	    atomic_read(&kvm->online_vcpus)) {
-		pr_err("%s: vcpu_export_next_idx %d >= online_vcpus %d\n",
-			__func__, mig_state->vcpu_export_next_idx,
-			atomic_read(&kvm->online_vcpus));
-		return -EINVAL;
-	}
+	do {
+		idx = find_first_zero_bit(mig_state->vcpu_exported, nr_vcpus);
+		if (idx >= nr_vcpus) {
+			pr_err("%s: all %d vcpus exported\n", __func__, nr_vcpus);
+			return -EINVAL;
+		}
+	} while (test_and_set_bit(idx, mig_state->vcpu_exported));
 
-	vcpu = kvm_get_vcpu(kvm, mig_state->vcpu_export_next_idx);
+	vcpu = kvm_get_vcpu(kvm, idx);
 	vcpu_tdx = to_tdx(vcpu);
 	tdx_flush_vp_on_cpu(vcpu);
 	cpu = get_cpu();
@@ -1198,22 +1616,24 @@ static int tdx_mig_export_state_vp(struct kvm_tdx *kvm_tdx,
 					  stream->page_list.info.val,
 					  stream_info.val,
 					  &out);
+		tdx_seamcall_stat(&kvm_tdx->kvm, TDH_EXPORT_STATE_VP, err);
 		if (seamcall_masked_status(err) == TDX_INTERRUPTED_RESUMABLE)
 			stream_info.resume = 1;
 	} while (seamcall_masked_status(err) == TDX_INTERRUPTED_RESUMABLE);
 
-	if (err == TDX_SUCCESS) {
-		mig_state->vcpu_export_next_idx++;
-		if (copy_to_user(data, &out.rdx, sizeof(uint64_t)))
-			return -EFAULT;
-	} else {
+	if (err != TDX_SUCCESS) {
+		put_cpu();
+		/* Release the vCPU so that the export can be retried */
+		clear_bit(idx, mig_state->vcpu_exported);
 		pr_err("%s: failed, err=%llx\n", __func__, err);
 		return -EIO;
 	}
 	tdx_add_vcpu_association(vcpu_tdx, cpu);
-	vcpu->cpu = cpu;
 	put_cpu();
 
+	if (copy_to_user(data, &out.rdx, sizeof(uint64_t)))
+		return -EFAULT;
+
 	return 0;
 }
 
@@ -1237,8 +1657,14 @@ static int tdx_mig_import_state_vp(struct kvm_tdx *kvm_tdx,
 	if (copy_from_user(&npages, (void __user *)data, sizeof(uint64_t)))
 		return -EFAULT;
 
+	/*
+	 * The vCPUs may be imported on all the streams concurrently, each
+	 * stream routed to the vCPU its MBMD is for.
+	 */
 	vcpu_idx = tdx_mig_mbmd_get_vcpu_idx(stream->mbmd.data);
 	vcpu = kvm_get_vcpu(&kvm_tdx->kvm, vcpu_idx);
+	if (!vcpu)
+		return -EINVAL;
 	vcpu_tdx = to_tdx(vcpu);
 
 	page_list->info.last_entry = npages - 1;
@@ -1254,6 +1680,7 @@ static int tdx_mig_import_state_vp(struct kvm_tdx *kvm_tdx,
 					  page_list->info.val,
 					  stream_info.val,
 					  &out);
+		tdx_seamcall_stat(&kvm_tdx->kvm, TDH_IMPORT_STATE_VP, err);
 		if (seamcall_masked_status(err) == TDX_INTERRUPTED_RESUMABLE)
 			stream_info.resume = 1;
 	} while (seamcall_masked_status(err) == TDX_INTERRUPTED_RESUMABLE);
@@ -1265,25 +1692,35 @@ static int tdx_mig_import_state_vp(struct kvm_tdx *kvm_tdx,
 	}
 
 	tdx_add_vcpu_association(vcpu_tdx, cpu);
-	vcpu->cpu = cpu;
 	put_cpu();
 
+	tdx_clear_state_cache(vcpu);
 	tdx_td_vcpu_post_init(vcpu_tdx);
 	return 0;
 }
 
-static int tdx_restore_private_page(struct kvm *kvm, gfn_t gfn)
+/*
+ * Restore up to a GPA list of exported pages with one TDH.EXPORT.RESTORE.
+ * The entries the TDX module didn't restore are set in @failed.
+ */
+static int tdx_restore_private_pages(struct kvm *kvm, gfn_t *gfns,
+				     uint32_t num, unsigned long *failed)
 {
 	uint64_t err;
 	struct tdx_module_args out;
 	struct kvm_tdx *kvm_tdx = to_kvm_tdx(kvm);
 	struct tdx_mig_stream *stream = kvm_tdx->mig_state->default_stream;
 	struct tdx_mig_gpa_list *gpa_list = &stream->gpa_list;
+	uint32_t i;
+
+	if (WARN_ON_ONCE(!num || num > TDX_MIG_GPA_LIST_MAX_ENTRIES))
+		return -EINVAL;
 
-	tdx_mig_gpa_list_init(gpa_list, &gfn, 1);
+	tdx_mig_gpa_list_init(gpa_list, gfns, num);
 	do {
 		err = tdh_export_restore(kvm_tdx->tdr_pa,
 					 gpa_list->info.val, &out);
+		tdx_seamcall_stat(&kvm_tdx->kvm, TDH_EXPORT_RESTORE, err);
 		if (seamcall_masked_status(err) == TDX_INTERRUPTED_RESUMABLE)
 			gpa_list->info.val = out.rcx;
 	} while (seamcall_masked_status(err) == TDX_INTERRUPTED_RESUMABLE);
@@ -1292,8 +1729,11 @@ static int tdx_restore_private_page(struct kvm *kvm, gfn_t gfn)
 		pr_err("%s failed, err=%llx, gfn=%lx\n",
 			__func__, err, (long)gpa_list->entries[0].gfn);
 		return -EIO;
-	} else if (gpa_list->entries[0].status != GPA_LIST_S_SUCCESS) {
-		return -EPERM;
+	}
+
+	for (i = 0; i < num; i++) {
+		if (gpa_list->entries[i].status != GPA_LIST_S_SUCCESS)
+			__set_bit(i, failed);
 	}
 
 	return 0;
@@ -1312,6 +1752,135 @@ static int tdx_mig_export_abort(struct kvm_tdx *kvm_tdx,
 	return kvm_tdp_mmu_restore_private_pages(&kvm_tdx->kvm);
 }
 
+/*
+ * Post-copy: the destination TD is resumed after TDH.IMPORT.COMMIT, and the
+ * private pages not migrated yet are fetched on demand.  A TD fault on a
+ * private GPA that isn't mapped exits to userspace with
+ * KVM_MEMORY_EXIT_FLAG_POSTCOPY.  Userspace then imports the page with
+ * KVM_TDX_MIG_IMPORT_MEM on a stream, or resolves it with
+ * KVM_TDX_MIG_POSTCOPY_RESOLVE if the source TD doesn't have the page, and
+ * resumes the vCPU.
+ */
+static bool tdx_mig_postcopy_fault(struct kvm_vcpu *vcpu, gpa_t gpa)
+{
+	struct tdx_mig_state *mig_state = to_kvm_tdx(vcpu->kvm)->mig_state;
+	gfn_t gfn = gpa_to_gfn(gpa);
+	struct kvm_memory_slot *slot;
+	bool is_private;
+	int r;
+
+	if (!mig_state || !READ_ONCE(mig_state->postcopy))
+		return false;
+
+	if (xa_load(&mig_state->postcopy_resolved, gfn))
+		return false;
+
+	slot = kvm_vcpu_gfn_to_memslot(vcpu, gfn);
+	if (!slot || !kvm_slot_can_be_private(slot))
+		return false;
+
+	read_lock(&vcpu->kvm->mmu_lock);
+	r = kvm_mmu_is_page_private(vcpu->kvm, slot, gfn, &is_private);
+	read_unlock(&vcpu->kvm->mmu_lock);
+	/* Mapped, e.g. write blocked. */
+	if (!r)
+		return false;
+
+	vcpu->run->exit_reason = KVM_EXIT_MEMORY_FAULT;
+	vcpu->run->memory.flags = KVM_MEMORY_EXIT_FLAG_PRIVATE |
+				  KVM_MEMORY_EXIT_FLAG_POSTCOPY;
+	vcpu->run->memory.gpa = gfn_to_gpa(gfn);
+	vcpu->run->memory.size = PAGE_SIZE;
+	return true;
+}
+
+static int tdx_mig_postcopy_start(struct kvm_tdx *kvm_tdx)
+{
+	struct tdx_mig_state *mig_state = kvm_tdx->mig_state;
+
+	/* The TD can run only after TDH.IMPORT.COMMIT. */
+	if (tdx_is_migration_source(kvm_tdx) || !kvm_tdx->finalized)
+		return -EINVAL;
+
+	WRITE_ONCE(mig_state->postcopy, true);
+	return 0;
+}
+
+static int tdx_mig_postcopy_resolve(struct kvm_tdx *kvm_tdx,
+				    uint64_t __user *data)
+{
+	struct tdx_mig_state *mig_state = kvm_tdx->mig_state;
+	uint64_t gpa;
+
+	if (!READ_ONCE(mig_state->postcopy))
+		return -EINVAL;
+
+	if (copy_from_user(&gpa, data, sizeof(uint64_t)))
+		return -EFAULT;
+
+	return xa_err(xa_store(&mig_state->postcopy_resolved, gpa_to_gfn(gpa),
+			       xa_mk_value(1), GFP_KERNEL_ACCOUNT));
+}
+
+static void tdx_mig_postcopy_end(struct tdx_mig_state *mig_state)
+{
+	WRITE_ONCE(mig_state->postcopy, false);
+	xa_destroy(&mig_state->postcopy_resolved);
+}
+
+/*
+ * The source may have mapped the TD memory with 2M pages, but the import is by
+ * 4K.  Promote back the 2M ranges whose pages were all imported, through a
+ * vCPU as the preallocation of the page tables on import does.  With post-copy
+ * the vCPUs may be running, only take one that is idle and skip otherwise.
+ */
+static void tdx_mig_promote_imported(struct kvm_tdx *kvm_tdx)
+{
+	struct tdx_mig_state *mig_state = kvm_tdx->mig_state;
+	struct kvm *kvm = &kvm_tdx->kvm;
+	struct kvm_vcpu *vcpu = NULL, *v;
+	unsigned long index, i;
+	void *entry;
+	gfn_t gfn;
+	int idx;
+
+	kvm_for_each_vcpu(i, v, kvm) {
+		if (mutex_trylock(&v->mutex)) {
+			vcpu = v;
+			break;
+		}
+	}
+	if (!vcpu)
+		goto out;
+
+	vcpu_load(vcpu);
+	idx = srcu_read_lock(&kvm->srcu);
+	kvm_mmu_reload(vcpu);
+
+	xa_for_each(&mig_state->import_2m_pages, index, entry) {
+		if (xa_to_value(entry) != KVM_PAGES_PER_HPAGE(PG_LEVEL_2M))
+			continue;
+
+		gfn = index << KVM_HPAGE_GFN_SHIFT(PG_LEVEL_2M);
+		if (!kvm_range_has_memory_attributes(kvm, gfn,
+				gfn + KVM_PAGES_PER_HPAGE(PG_LEVEL_2M),
+				KVM_MEMORY_ATTRIBUTE_PRIVATE))
+			continue;
+
+		kvm_mmu_promote_private_page(vcpu, gfn_to_gpa(gfn));
+
+		if (fatal_signal_pending(current))
+			break;
+		cond_resched();
+	}
+
+	srcu_read_unlock(&kvm->srcu, idx);
+	vcpu_put(vcpu);
+	mutex_unlock(&vcpu->mutex);
+out:
+	xa_destroy(&mig_state->import_2m_pages);
+}
+
 static int tdx_mig_import_end(struct kvm_tdx *kvm_tdx)
 {
 	uint64_t err;
@@ -1322,6 +1891,10 @@ static int tdx_mig_import_end(struct kvm_tdx *kvm_tdx)
 		return -EIO;
 	}
 
+	/* All the private pages have been imported. */
+	tdx_mig_postcopy_end(kvm_tdx->mig_state);
+	tdx_mig_promote_imported(kvm_tdx);
+
 	pr_info("migration flow is done, userspace pid %d\n",
 		kvm_tdx->kvm.userspace_pid);
 
@@ -1340,6 +1913,25 @@ static long tdx_mig_stream_ioctl(struct kvm_device *dev, unsigned int ioctl,
 	if (copy_from_user(&tdx_cmd, argp, sizeof(struct kvm_tdx_cmd)))
 		return -EFAULT;
 
+	mutex_lock(&stream->lock);
+
+	/* The stream buffers are owned by the pending asynchronous export. */
+	if (READ_ONCE(stream->export_pending) &&
+	    tdx_cmd.id != KVM_TDX_MIG_EXPORT_MEM_RESULT) {
+		r = -EBUSY;
+		goto out;
+	}
+
+	switch (tdx_cmd.id) {
+	case KVM_TDX_MIG_EXPORT_TRACK:
+	case KVM_TDX_MIG_EXPORT_PAUSE:
+	case KVM_TDX_MIG_EXPORT_STATE_TD:
+	case KVM_TDX_MIG_EXPORT_ABORT:
+	case KVM_TDX_MIG_POSTCOPY_START:
+		tdx_mig_flush_exports(kvm_tdx->mig_state);
+		break;
+	}
+
 	switch (tdx_cmd.id) {
 	case KVM_TDX_MIG_EXPORT_STATE_IMMUTABLE:
 		r = tdx_mig_export_state_immutable(kvm_tdx, stream,
@@ -1353,6 +1945,14 @@ static long tdx_mig_stream_ioctl(struct kvm_device *dev, unsigned int ioctl,
 		r = tdx_mig_stream_export_mem(kvm_tdx, stream,
 					(uint64_t __user *)tdx_cmd.data);
 		break;
+	case KVM_TDX_MIG_EXPORT_MEM_ASYNC:
+		r = tdx_mig_stream_export_mem_async(kvm_tdx, stream,
+					(void __user *)tdx_cmd.data);
+		break;
+	case KVM_TDX_MIG_EXPORT_MEM_RESULT:
+		r = tdx_mig_stream_export_mem_result(stream,
+					(uint64_t __user *)tdx_cmd.data);
+		break;
 	case KVM_TDX_MIG_IMPORT_MEM:
 		r = tdx_mig_stream_import_mem(kvm_tdx, stream,
 					(uint64_t __user *)tdx_cmd.data);
@@ -1367,6 +1967,16 @@ static long tdx_mig_stream_ioctl(struct kvm_device *dev, unsigned int ioctl,
 	case KVM_TDX_MIG_EXPORT_PAUSE:
 		r = tdx_mig_export_pause(kvm_tdx);
 		break;
+	case KVM_TDX_MIG_GET_EPOCH_STATS:
+		r = tdx_mig_get_epoch_stats(kvm_tdx, (void __user *)tdx_cmd.data);
+		break;
+	case KVM_TDX_MIG_GET_SCHED:
+		r = tdx_mig_get_sched(kvm_tdx, (void __user *)tdx_cmd.data);
+		break;
+	case KVM_TDX_MIG_SET_THROTTLE:
+		r = tdx_mig_set_throttle(kvm_tdx,
+					(uint64_t __user *)tdx_cmd.data);
+		break;
 	case KVM_TDX_MIG_EXPORT_STATE_TD:
 		r = tdx_mig_export_state_td(kvm_tdx, stream,
 					(uint64_t __user *)tdx_cmd.data);
@@ -1390,10 +2000,19 @@ static long tdx_mig_stream_ioctl(struct kvm_device *dev, unsigned int ioctl,
 	case KVM_TDX_MIG_IMPORT_END:
 		r = tdx_mig_import_end(kvm_tdx);
 		break;
+	case KVM_TDX_MIG_POSTCOPY_START:
+		r = tdx_mig_postcopy_start(kvm_tdx);
+		break;
+	case KVM_TDX_MIG_POSTCOPY_RESOLVE:
+		r = tdx_mig_postcopy_resolve(kvm_tdx,
+					(uint64_t __user *)tdx_cmd.data);
+		break;
 	default:
 		r = -EINVAL;
 	}
 
+out:
+	mutex_unlock(&stream->lock);
 	return r;
 }
 
@@ -1422,7 +2041,7 @@ static int tdx_mig_do_stream_create(struct kvm_tdx *kvm_tdx,
 
 	err = tdh_mig_stream_create(kvm_tdx->tdr_pa, migsc_pa);
 	if (WARN_ON_ONCE(err)) {
-		pr_tdx_error(TDH_MIG_STREAM_CREATE, err, &out);
+		kvm_pr_tdx_error(&kvm_tdx->kvm, TDH_MIG_STREAM_CREATE, err, &out);
 		free_page(migsc_va);
 		return -EIO;
 	}
@@ -1441,6 +2060,14 @@ static int tdx_mig_session_init(struct kvm_tdx *kvm_tdx)
 				     &mig_state->backward_migsc_paddr))
 		return -EIO;
 
+	memset(&mig_state->last_epoch, 0, sizeof(mig_state->last_epoch));
+	atomic64_set(&mig_state->epoch_pages_blocked, 0);
+	atomic64_set(&mig_state->epoch_pages_redirtied, 0);
+	atomic64_set(&mig_state->epoch_pages_exported, 0);
+	atomic64_set(&mig_state->epoch_shared_dirtied, 0);
+	mig_state->last_epoch_shared_dirtied = 0;
+	mig_state->epoch_start_ns = ktime_get_ns();
+
 	if (tdx_is_migration_source(kvm_tdx))
 		ret = tdx_mig_stream_gpa_list_setup(blockw_gpa_list);
 
@@ -1467,7 +2094,11 @@ static int tdx_mig_stream_create(struct kvm_device *dev, u32 type)
 		return -ENOMEM;
 
 	dev->private = stream;
+	stream->kvm_tdx = kvm_tdx;
+	stream->cpu = -1;
+	mutex_init(&stream->lock);
 	stream->idx = atomic_inc_return(&mig_state->streams_created) - 1;
+	INIT_WORK(&stream->export_work, tdx_mig_stream_export_mem_work);
 
 	if (!stream->idx) {
 		ret = tdx_mig_session_init(kvm_tdx);
@@ -1498,6 +2129,10 @@ static void tdx_mig_stream_release(struct kvm_device *dev)
 	struct tdx_mig_state *mig_state = kvm_tdx->mig_state;
 	struct tdx_mig_stream *stream = dev->private;
 
+	flush_work(&stream->export_work);
+	if (stream->export_eventfd)
+		eventfd_ctx_put(stream->export_eventfd);
+
 	atomic_dec(&mig_state->streams_created);
 	free_page((unsigned long)stream->mbmd.data);
 	tdx_mig_stream_buf_list_cleanup(&stream->mem_buf_list);
@@ -1538,6 +2173,9 @@ static int tdx_mig_state_create(struct kvm_tdx *kvm_tdx)
 	}
 
 	mig_state->migsc_paddrs = migsc_paddrs;
+	xa_init(&mig_state->postcopy_resolved);
+	xa_init(&mig_state->import_2m_pages);
+	init_waitqueue_head(&mig_state->exports_wq);
 	kvm_tdx->mig_state = mig_state;
 	return 0;
 }
@@ -1562,6 +2200,8 @@ static void tdx_mig_state_destroy(struct kvm_tdx *kvm_tdx)
 	if (mig_state->backward_migsc_paddr)
 		tdx_reclaim_td_page(mig_state->backward_migsc_paddr);
 
+	tdx_mig_postcopy_end(mig_state);
+	xa_destroy(&mig_state->import_2m_pages);
 	kfree(mig_state);
 	kvm_tdx->mig_state = NULL;
 }
@@ -1578,11 +2218,27 @@ static struct kvm_device_ops kvm_tdx_mig_stream_ops = {
 
 static int kvm_tdx_mig_stream_ops_init(void)
 {
-	return kvm_register_device_ops(&kvm_tdx_mig_stream_ops,
-				       KVM_DEV_TYPE_TDX_MIG_STREAM);
+	int r;
+
+	tdx_mig_wq = alloc_workqueue("kvm_tdx_mig", WQ_CPU_INTENSIVE, 0);
+	if (!tdx_mig_wq)
+		return -ENOMEM;
+
+	r = kvm_register_device_ops(&kvm_tdx_mig_stream_ops,
+				    KVM_DEV_TYPE_TDX_MIG_STREAM);
+	if (r) {
+		destroy_workqueue(tdx_mig_wq);
+		tdx_mig_wq = NULL;
+	}
+
+	return r;
 }
 
 static void kvm_tdx_mig_stream_ops_exit(void)
 {
 	kvm_unregister_device_ops(KVM_DEV_TYPE_TDX_MIG_STREAM);
+	if (tdx_mig_wq) {
+		destroy_workqueue(tdx_mig_wq);
+		tdx_mig_wq = NULL;
+	}
 }
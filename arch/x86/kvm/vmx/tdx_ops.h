@@ -23,10 +23,24 @@ static inline u64 __tdx_seamcall(u64 op, u64 rcx, u64 rdx, u64 r8, u64 r9,
 			         u64 r10, u64 r11, u64 r12, u64 r13, u64 r14,
 				 struct tdx_module_args *out, bool need_saved)
 {
-	u64 ret, retries = 0;
+	u64 ret, retries = 0, prof;
 
 	do {
-		if (out) {
+		prof = tdx_seamcall_prof_start();
+		/*
+		 * The hot leafs (TDH.MEM.PAGE.AUG, TDH.MEM.TRACK, TDH.VP.RD...)
+		 * take no more than RCX/RDX/R8.  Only take the lean entry when
+		 * the unused registers are constant zeros, so that the choice
+		 * is per leaf at compile time, never from runtime values.
+		 */
+		if (!need_saved && __builtin_constant_p(r9) && !r9 &&
+		    __builtin_constant_p(r10) && !r10 &&
+		    __builtin_constant_p(r11) && !r11) {
+			if (out)
+				ret = __seamcall_lean_ret(op, rcx, rdx, r8, out);
+			else
+				ret = __seamcall_lean(op, rcx, rdx, r8);
+		} else if (out) {
 			*out = (struct tdx_module_args) {
 				.rcx = rcx,
 				.rdx = rdx,
@@ -59,6 +73,7 @@ static inline u64 __tdx_seamcall(u64 op, u64 rcx, u64 rdx, u64 r8, u64 r9,
 			};
 			ret = __seamcall(op, &args);
 		}
+		tdx_seamcall_prof_end(op, prof, ret);
 		if (unlikely(ret == TDX_SEAMCALL_UD)) {
 			/*
 			 * SEAMCALLs fail with TDX_SEAMCALL_UD returned when VMX is off.
@@ -101,6 +116,9 @@ static inline u64 tdx_seamcall_saved(u64 op, u64 rcx, u64 rdx, u64 r8, u64 r9,
 
 #ifdef CONFIG_INTEL_TDX_HOST
 void pr_tdx_error(u64 op, u64 error_code, const struct tdx_module_args *out);
+void tdx_seamcall_stat(struct kvm *kvm, u64 op, u64 error_code);
+void kvm_pr_tdx_error(struct kvm *kvm, u64 op, u64 error_code,
+		      const struct tdx_module_args *out);
 #endif
 
 static inline enum pg_level tdx_sept_level_to_pg_level(int tdx_level)
@@ -113,8 +131,14 @@ static inline void tdx_clflush_page(hpa_t addr, enum pg_level level)
 	clflush_cache_range(__va(addr), KVM_HPAGE_SIZE(level));
 }
 
+/*
+ * Called once the TDX module took the page(s), so also record them for
+ * clearing on kexec, see tdx_track_private_pages().
+ */
 static inline void tdx_set_page_np(hpa_t addr)
 {
+	tdx_track_private_pages(addr, PAGE_SIZE);
+
 	if (!IS_ENABLED(CONFIG_INTEL_TDX_HOST_DEBUG_MEMORY_CORRUPT))
 		return;
 
@@ -131,6 +155,8 @@ static inline void tdx_set_page_np_level(hpa_t addr, int tdx_level)
 	enum pg_level pg_level = tdx_sept_level_to_pg_level(tdx_level);
 	int i;
 
+	tdx_track_private_pages(addr, KVM_HPAGE_SIZE(pg_level));
+
 	if (!IS_ENABLED(CONFIG_INTEL_TDX_HOST_DEBUG_MEMORY_CORRUPT))
 		return;
 
@@ -435,8 +461,12 @@ static inline u64 tdh_servtd_bind(hpa_t servtd_tdr,
 
 static inline u64 tdh_mig_stream_create(hpa_t tdr, hpa_t migsc)
 {
-	return tdx_seamcall(TDH_MIG_STREAM_CREATE, migsc, tdr, 0, 0, 0, 0,
-			    NULL);
+	u64 r;
+
+	r = tdx_seamcall(TDH_MIG_STREAM_CREATE, migsc, tdr, 0, 0, 0, 0, NULL);
+	if (!r)
+		tdx_track_private_pages(migsc, PAGE_SIZE);
+	return r;
 }
 
 static inline u64 tdh_export_blockw(hpa_t tdr,
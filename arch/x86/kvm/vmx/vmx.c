@@ -8055,10 +8055,12 @@ struct kvm_x86_ops vt_x86_ops __initdata = {
 	.flush_shadow_all_private = vt_flush_shadow_all_private,
 	.vm_destroy = vt_vm_destroy,
 	.vm_free = vt_vm_free,
+	.vm_create_debugfs = vt_vm_create_debugfs,
 
 	.vcpu_precreate = vt_vcpu_precreate,
 	.vcpu_create = vt_vcpu_create,
 	.vcpu_free = vt_vcpu_free,
+	.vcpu_create_debugfs = vt_vcpu_create_debugfs,
 	.vcpu_reset = vt_vcpu_reset,
 
 	.prepare_switch_to_guest = vt_prepare_switch_to_guest,
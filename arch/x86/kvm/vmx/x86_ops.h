@@ -144,11 +144,13 @@ int tdx_vm_enable_cap(struct kvm *kvm, struct kvm_enable_cap *cap);
 int tdx_vm_init(struct kvm *kvm);
 void tdx_mmu_release_hkid(struct kvm *kvm);
 void tdx_vm_free(struct kvm *kvm);
+void tdx_vm_create_debugfs(struct kvm *kvm);
 
 int tdx_vm_ioctl(struct kvm *kvm, void __user *argp);
 
 int tdx_vcpu_create(struct kvm_vcpu *vcpu);
 void tdx_vcpu_free(struct kvm_vcpu *vcpu);
+void tdx_vcpu_create_debugfs(struct kvm_vcpu *vcpu, struct dentry *dentry);
 void tdx_vcpu_reset(struct kvm_vcpu *vcpu, bool init_event);
 fastpath_t tdx_vcpu_run(struct kvm_vcpu *vcpu);
 void tdx_prepare_switch_to_guest(struct kvm_vcpu *vcpu);
@@ -219,11 +221,13 @@ static inline int tdx_vm_enable_cap(struct kvm *kvm, struct kvm_enable_cap *cap)
 static inline int tdx_vm_init(struct kvm *kvm) { return -EOPNOTSUPP; }
 static inline void tdx_mmu_release_hkid(struct kvm *kvm) {}
 static inline void tdx_vm_free(struct kvm *kvm) {}
+static inline void tdx_vm_create_debugfs(struct kvm *kvm) {}
 
 static inline int tdx_vm_ioctl(struct kvm *kvm, void __user *argp) { return -EOPNOTSUPP; }
 
 static inline int tdx_vcpu_create(struct kvm_vcpu *vcpu) { return -EOPNOTSUPP; }
 static inline void tdx_vcpu_free(struct kvm_vcpu *vcpu) {}
+static inline void tdx_vcpu_create_debugfs(struct kvm_vcpu *vcpu, struct dentry *dentry) {}
 static inline void tdx_vcpu_reset(struct kvm_vcpu *vcpu, bool init_event) {}
 static inline fastpath_t tdx_vcpu_run(struct kvm_vcpu *vcpu) { return EXIT_FASTPATH_NONE; }
 static inline void tdx_prepare_switch_to_guest(struct kvm_vcpu *vcpu) {}
@@ -313,10 +317,12 @@ int vt_vm_init(struct kvm *kvm);
 void vt_flush_shadow_all_private(struct kvm *kvm);
 void vt_vm_destroy(struct kvm *kvm);
 void vt_vm_free(struct kvm *kvm);
+void vt_vm_create_debugfs(struct kvm *kvm);
 
 int vt_vcpu_precreate(struct kvm *kvm);
 int vt_vcpu_create(struct kvm_vcpu *vcpu);
 void vt_vcpu_free(struct kvm_vcpu *vcpu);
+void vt_vcpu_create_debugfs(struct kvm_vcpu *vcpu, struct dentry *dentry);
 void vt_vcpu_reset(struct kvm_vcpu *vcpu, bool init_event);
 
 void vt_prepare_switch_to_guest(struct kvm_vcpu *vcpu);
@@ -254,7 +254,13 @@ const struct _kvm_stats_desc kvm_vm_stats_desc[] = {
 	STATS_DESC_ICOUNTER(VM, pages_1g),
 	STATS_DESC_ICOUNTER(VM, nx_lpage_splits),
 	STATS_DESC_PCOUNTER(VM, max_mmu_rmap_size),
-	STATS_DESC_PCOUNTER(VM, max_mmu_page_hash_collisions)
+	STATS_DESC_PCOUNTER(VM, max_mmu_page_hash_collisions),
+	STATS_DESC_COUNTER(VM, tdx_page_aug),
+	STATS_DESC_COUNTER(VM, tdx_page_add),
+	STATS_DESC_COUNTER(VM, tdx_page_remove),
+	STATS_DESC_TIME_NSEC(VM, tdx_reclaim_ns),
+	STATS_DESC_COUNTER(VM, tdx_blockw_pages),
+	STATS_DESC_COUNTER(VM, tdx_unblockw_pages),
 };
 
 const struct kvm_stats_header kvm_vm_stats_header = {
@@ -302,6 +308,9 @@ const struct _kvm_stats_desc kvm_vcpu_stats_desc[] = {
 	STATS_DESC_COUNTER(VCPU, preemption_other),
 	STATS_DESC_IBOOLEAN(VCPU, guest_mode),
 	STATS_DESC_COUNTER(VCPU, notify_window_exits),
+	STATS_DESC_COUNTER(VCPU, tdx_vp_enter_retries),
+	STATS_DESC_COUNTER(VCPU, tdx_map_gpa_pages),
+	STATS_DESC_COUNTER(VCPU, tdx_get_quote),
 };
 
 const struct kvm_stats_header kvm_vcpu_stats_header = {
@@ -2193,28 +2202,25 @@ static int handle_fastpath_set_tscdeadline(struct kvm_vcpu *vcpu, u64 data)
 	return 0;
 }
 
-fastpath_t handle_fastpath_set_msr_irqoff(struct kvm_vcpu *vcpu)
+/*
+ * Handle the write of @data to @msr in the fast path, without skipping the
+ * instruction, for vendor code that doesn't exit on WRMSR itself, e.g. TDX.
+ */
+fastpath_t __handle_fastpath_set_msr_irqoff(struct kvm_vcpu *vcpu, u32 msr,
+					    u64 data)
 {
-	u32 msr = kvm_rcx_read(vcpu);
-	u64 data;
 	fastpath_t ret = EXIT_FASTPATH_NONE;
 
 	kvm_vcpu_srcu_read_lock(vcpu);
 
 	switch (msr) {
 	case APIC_BASE_MSR + (APIC_ICR >> 4):
-		data = kvm_read_edx_eax(vcpu);
-		if (!handle_fastpath_set_x2apic_icr_irqoff(vcpu, data)) {
-			kvm_skip_emulated_instruction(vcpu);
+		if (!handle_fastpath_set_x2apic_icr_irqoff(vcpu, data))
 			ret = EXIT_FASTPATH_EXIT_HANDLED;
-		}
 		break;
 	case MSR_IA32_TSC_DEADLINE:
-		data = kvm_read_edx_eax(vcpu);
-		if (!handle_fastpath_set_tscdeadline(vcpu, data)) {
-			kvm_skip_emulated_instruction(vcpu);
+		if (!handle_fastpath_set_tscdeadline(vcpu, data))
 			ret = EXIT_FASTPATH_REENTER_GUEST;
-		}
 		break;
 	default:
 		break;
@@ -2227,6 +2233,19 @@ fastpath_t handle_fastpath_set_msr_irqoff(struct kvm_vcpu *vcpu)
 
 	return ret;
 }
+EXPORT_SYMBOL_GPL(__handle_fastpath_set_msr_irqoff);
+
+fastpath_t handle_fastpath_set_msr_irqoff(struct kvm_vcpu *vcpu)
+{
+	fastpath_t ret;
+
+	ret = __handle_fastpath_set_msr_irqoff(vcpu, kvm_rcx_read(vcpu),
+					       kvm_read_edx_eax(vcpu));
+	if (ret != EXIT_FASTPATH_NONE)
+		kvm_skip_emulated_instruction(vcpu);
+
+	return ret;
+}
 EXPORT_SYMBOL_GPL(handle_fastpath_set_msr_irqoff);
 
 /*
@@ -3534,10 +3553,11 @@ EXPORT_SYMBOL_GPL(kvm_service_local_tlb_flush_requests);
 
 static void record_steal_time(struct kvm_vcpu *vcpu)
 {
-	struct gfn_to_hva_cache *ghc = &vcpu->arch.st.cache;
-	struct kvm_steal_time __user *st;
-	struct kvm_memslots *slots;
-	gpa_t gpa = vcpu->arch.st.msr_val & KVM_STEAL_VALID_BITS;
+	struct gfn_to_pfn_cache *gpc = &vcpu->arch.st.cache;
+	struct kvm_steal_time *st;
+	bool flush = false;
+	unsigned long flags;
+	u8 st_preempted;
 	u64 steal;
 	u32 version;
 
@@ -3552,82 +3572,61 @@ static void record_steal_time(struct kvm_vcpu *vcpu)
 	if (WARN_ON_ONCE(current->mm != vcpu->kvm->mm))
 		return;
 
-	slots = kvm_memslots(vcpu->kvm);
+	/* We rely on the fact that it fits in a single page. */
+	BUILD_BUG_ON((sizeof(*st) - 1) & KVM_STEAL_VALID_BITS);
 
-	if (unlikely(slots->generation != ghc->generation ||
-		     gpa != ghc->gpa ||
-		     kvm_is_error_hva(ghc->hva) || !ghc->memslot)) {
-		/* We rely on the fact that it fits in a single page. */
-		BUILD_BUG_ON((sizeof(*st) - 1) & KVM_STEAL_VALID_BITS);
+	read_lock_irqsave(&gpc->lock, flags);
+	while (!kvm_gpc_check(gpc, sizeof(*st))) {
+		read_unlock_irqrestore(&gpc->lock, flags);
 
-		if (kvm_gfn_to_hva_cache_init(vcpu->kvm, ghc, gpa, sizeof(*st)) ||
-		    kvm_is_error_hva(ghc->hva) || !ghc->memslot)
+		if (kvm_gpc_refresh(gpc, sizeof(*st)))
 			return;
+
+		read_lock_irqsave(&gpc->lock, flags);
 	}
 
-	st = (struct kvm_steal_time __user *)ghc->hva;
+	st = gpc->khva;
 	/*
 	 * Doing a TLB flush here, on the guest's behalf, can avoid
 	 * expensive IPIs.
 	 */
 	if (guest_pv_has(vcpu, KVM_FEATURE_PV_TLB_FLUSH)) {
-		u8 st_preempted = 0;
-		int err = -EFAULT;
-
-		if (!user_access_begin(st, sizeof(*st)))
-			return;
-
-		asm volatile("1: xchgb %0, %2\n"
-			     "xor %1, %1\n"
-			     "2:\n"
-			     _ASM_EXTABLE_UA(1b, 2b)
-			     : "+q" (st_preempted),
-			       "+&r" (err),
-			       "+m" (st->preempted));
-		if (err)
-			goto out;
-
-		user_access_end();
-
-		vcpu->arch.st.preempted = 0;
+		st_preempted = xchg(&st->preempted, 0);
 
 		trace_kvm_pv_tlb_flush(vcpu->vcpu_id,
 				       st_preempted & KVM_VCPU_FLUSH_TLB);
-		if (st_preempted & KVM_VCPU_FLUSH_TLB)
-			kvm_vcpu_flush_tlb_guest(vcpu);
-
-		if (!user_access_begin(st, sizeof(*st)))
-			goto dirty;
+		/* The flush may sleep, do it once the lock is dropped. */
+		flush = st_preempted & KVM_VCPU_FLUSH_TLB;
 	} else {
-		if (!user_access_begin(st, sizeof(*st)))
-			return;
-
-		unsafe_put_user(0, &st->preempted, out);
-		vcpu->arch.st.preempted = 0;
+		WRITE_ONCE(st->preempted, 0);
 	}
+	vcpu->arch.st.preempted = 0;
 
-	unsafe_get_user(version, &st->version, out);
+	version = READ_ONCE(st->version);
 	if (version & 1)
 		version += 1;  /* first time write, random junk */
 
 	version += 1;
-	unsafe_put_user(version, &st->version, out);
+	WRITE_ONCE(st->version, version);
 
 	smp_wmb();
 
-	unsafe_get_user(steal, &st->steal, out);
+	steal = READ_ONCE(st->steal);
 	steal += current->sched_info.run_delay -
 		vcpu->arch.st.last_steal;
 	vcpu->arch.st.last_steal = current->sched_info.run_delay;
-	unsafe_put_user(steal, &st->steal, out);
+	WRITE_ONCE(st->steal, steal);
+
+	smp_wmb();
 
 	version += 1;
-	unsafe_put_user(version, &st->version, out);
+	WRITE_ONCE(st->version, version);
 
- out:
-	user_access_end();
- dirty:
-	mark_page_dirty_in_slot(vcpu->kvm, ghc->memslot, gpa_to_gfn(ghc->gpa));
+	mark_page_dirty_in_slot(vcpu->kvm, gpc->memslot, gpa_to_gfn(gpc->gpa));
+	read_unlock_irqrestore(&gpc->lock, flags);
+
+	if (flush)
+		kvm_vcpu_flush_tlb_guest(vcpu);
 }
 
 static bool kvm_is_msr_to_save(u32 msr_index)
@@ -3887,9 +3886,16 @@ int kvm_set_msr_common(struct kvm_vcpu *vcpu, struct msr_data *msr_info)
 
 		vcpu->arch.st.msr_val = data;
 
-		if (!(data & KVM_MSR_ENABLED))
+		if (!(data & KVM_MSR_ENABLED)) {
+			kvm_gpc_deactivate(&vcpu->arch.st.cache);
 			break;
+		}
 
+		/* A TD may use the shared alias of the GPA, which isn't in a memslot. */
+		kvm_gpc_activate(&vcpu->arch.st.cache,
+				 (data & KVM_STEAL_VALID_BITS) &
+				 ~gfn_to_gpa(kvm_gfn_shared_mask(vcpu->kvm)),
+				 sizeof(struct kvm_steal_time));
 		kvm_make_request(KVM_REQ_STEAL_UPDATE, vcpu);
 
 		break;
@@ -4926,11 +4932,9 @@ void kvm_arch_vcpu_load(struct kvm_vcpu *vcpu, int cpu)
 
 static void kvm_steal_time_set_preempted(struct kvm_vcpu *vcpu)
 {
-	struct gfn_to_hva_cache *ghc = &vcpu->arch.st.cache;
-	struct kvm_steal_time __user *st;
-	struct kvm_memslots *slots;
-	static const u8 preempted = KVM_VCPU_PREEMPTED;
-	gpa_t gpa = vcpu->arch.st.msr_val & KVM_STEAL_VALID_BITS;
+	struct gfn_to_pfn_cache *gpc = &vcpu->arch.st.cache;
+	struct kvm_steal_time *st;
+	unsigned long flags;
 
 	/*
 	 * The vCPU can be marked preempted if and only if the VM-Exit was on
@@ -4955,20 +4959,20 @@ static void kvm_steal_time_set_preempted(struct kvm_vcpu *vcpu)
 	if (unlikely(current->mm != vcpu->kvm->mm))
 		return;
 
-	slots = kvm_memslots(vcpu->kvm);
-
-	if (unlikely(slots->generation != ghc->generation ||
-		     gpa != ghc->gpa ||
-		     kvm_is_error_hva(ghc->hva) || !ghc->memslot))
-		return;
-
-	st = (struct kvm_steal_time __user *)ghc->hva;
-	BUILD_BUG_ON(sizeof(st->preempted) != sizeof(preempted));
-
-	if (!copy_to_user_nofault(&st->preempted, &preempted, sizeof(preempted)))
+	/*
+	 * The cache can't be refreshed here, it may sleep.  It's refreshed by
+	 * record_steal_time() on the next entry.
+	 */
+	read_lock_irqsave(&gpc->lock, flags);
+	if (kvm_gpc_check(gpc, sizeof(*st))) {
+		st = gpc->khva;
+		WRITE_ONCE(st->preempted, KVM_VCPU_PREEMPTED);
 		vcpu->arch.st.preempted = KVM_VCPU_PREEMPTED;
 
-	mark_page_dirty_in_slot(vcpu->kvm, ghc->memslot, gpa_to_gfn(ghc->gpa));
+		mark_page_dirty_in_slot(vcpu->kvm, gpc->memslot,
+					gpa_to_gfn(gpc->gpa));
+	}
+	read_unlock_irqrestore(&gpc->lock, flags);
 }
 
 void kvm_arch_vcpu_put(struct kvm_vcpu *vcpu)
@@ -9814,7 +9818,7 @@ static int kvm_pv_clock_pairing(struct kvm_vcpu *vcpu, gpa_t paddr,
  *
  * @apicid - apicid of vcpu to be kicked.
  */
-static void kvm_pv_kick_cpu_op(struct kvm *kvm, int apicid)
+void kvm_pv_kick_cpu_op(struct kvm *kvm, int apicid)
 {
 	/*
 	 * All other fields are unused for APIC_DM_REMRD, but may be consumed by
@@ -9829,6 +9833,7 @@ static void kvm_pv_kick_cpu_op(struct kvm *kvm, int apicid)
 
 	kvm_irq_delivery_to_apic(kvm, NULL, &lapic_irq, NULL);
 }
+EXPORT_SYMBOL_GPL(kvm_pv_kick_cpu_op);
 
 bool kvm_apicv_activated(struct kvm *kvm)
 {
@@ -11996,6 +12001,7 @@ int kvm_arch_vcpu_create(struct kvm_vcpu *vcpu)
 	vcpu->arch.regs_dirty = ~0;
 
 	kvm_gpc_init(&vcpu->arch.pv_time, vcpu->kvm, vcpu, KVM_HOST_USES_PFN);
+	kvm_gpc_init(&vcpu->arch.st.cache, vcpu->kvm, vcpu, KVM_HOST_USES_PFN);
 
 	if (!irqchip_in_kernel(vcpu->kvm) || kvm_vcpu_is_reset_bsp(vcpu))
 		vcpu->arch.mp_state = KVM_MP_STATE_RUNNABLE;
@@ -12129,6 +12135,7 @@ void kvm_arch_vcpu_destroy(struct kvm_vcpu *vcpu)
 	int idx;
 
 	kvmclock_reset(vcpu);
+	kvm_gpc_deactivate(&vcpu->arch.st.cache);
 
 	static_call(kvm_x86_vcpu_free)(vcpu);
 
@@ -12201,6 +12208,7 @@ void kvm_vcpu_reset(struct kvm_vcpu *vcpu, bool init_event)
 	vcpu->arch.apf.msr_en_val = 0;
 	vcpu->arch.apf.msr_int_val = 0;
 	vcpu->arch.st.msr_val = 0;
+	kvm_gpc_deactivate(&vcpu->arch.st.cache);
 
 	kvmclock_reset(vcpu);
 
@@ -12801,10 +12809,19 @@ int kvm_arch_prepare_memory_region(struct kvm *kvm,
 	 * KVM doesn't support moving memslots when there are external page
 	 * trackers attached to the VM, i.e. if KVMGT is in use.
 	 */
-	if (change == KVM_MR_MOVE && kvm_page_track_has_external_user(kvm))
+	if ((change == KVM_MR_MOVE || change == KVM_MR_RESIZE) &&
+	    kvm_page_track_has_external_user(kvm))
 		return -EINVAL;
 
-	if (change == KVM_MR_CREATE || change == KVM_MR_MOVE) {
+	/*
+	 * A resized slot keeps its existing mappings, which must not be
+	 * referenced by the old slot's rmaps as those are not carried over.
+	 */
+	if (change == KVM_MR_RESIZE && kvm_memslots_have_rmaps(kvm))
+		return -EINVAL;
+
+	if (change == KVM_MR_CREATE || change == KVM_MR_MOVE ||
+	    change == KVM_MR_RESIZE) {
 		if ((new->base_gfn + new->npages - 1) > kvm_mmu_max_gfn())
 			return -EINVAL;
 
@@ -12824,7 +12841,7 @@ static void kvm_mmu_update_cpu_dirty_logging(struct kvm *kvm, bool enable)
 {
 	int nr_slots;
 
-	if (!kvm_x86_ops.cpu_dirty_log_size)
+	if (!kvm_has_cpu_dirty_log(kvm))
 		return;
 
 	nr_slots = atomic_read(&kvm->nr_memslots_dirty_logging);
@@ -12896,14 +12913,25 @@ static void kvm_mmu_slot_apply_flags(struct kvm *kvm,
 		/*
 		 * Initially-all-set does not require write protecting any page,
 		 * because they're all assumed to be dirty.
+		 *
+		 * Huge pages are then split on the first CLEAR_DIRTY_LOG of
+		 * each range, with mmu_lock held for write.  Splitting a
+		 * private huge page of a TD takes a block, a TLB tracking and
+		 * a TDH.MEM.PAGE.DEMOTE, so a migration would start with
+		 * vCPUs stalling on the lock.  Split TDs up front instead,
+		 * with mmu_lock held for read, while vCPUs keep running.
 		 */
-		if (kvm_dirty_log_manual_protect_and_init_set(kvm))
+		if (kvm_dirty_log_manual_protect_and_init_set(kvm)) {
+			if (READ_ONCE(eager_page_split) && kvm_gfn_shared_mask(kvm))
+				kvm_mmu_slot_try_split_huge_pages(kvm, new,
+								  PG_LEVEL_4K);
 			return;
+		}
 
 		if (READ_ONCE(eager_page_split))
 			kvm_mmu_slot_try_split_huge_pages(kvm, new, PG_LEVEL_4K);
 
-		if (kvm_x86_ops.cpu_dirty_log_size) {
+		if (kvm_has_cpu_dirty_log(kvm)) {
 			kvm_mmu_slot_leaf_clear_dirty(kvm, new);
 			kvm_mmu_slot_remove_write_access(kvm, new, PG_LEVEL_2M);
 		} else {
@@ -12965,7 +12993,8 @@ void kvm_arch_commit_memory_region(struct kvm *kvm,
 		kvm_page_track_delete_slot(kvm, old);
 
 	if (!kvm->arch.n_requested_mmu_pages &&
-	    (change == KVM_MR_CREATE || change == KVM_MR_DELETE)) {
+	    (change == KVM_MR_CREATE || change == KVM_MR_DELETE ||
+	     change == KVM_MR_RESIZE)) {
 		unsigned long nr_mmu_pages;
 
 		nr_mmu_pages = kvm->nr_memslot_pages / KVM_MEMSLOT_PAGES_TO_MMU_PAGES_RATIO;
@@ -12976,7 +13005,7 @@ void kvm_arch_commit_memory_region(struct kvm *kvm,
 	kvm_mmu_slot_apply_flags(kvm, old, new, change);
 
 	/* Free the arrays associated with the old memslot. */
-	if (change == KVM_MR_MOVE)
+	if (change == KVM_MR_MOVE || change == KVM_MR_RESIZE)
 		kvm_arch_free_memslot(kvm, old);
 
 	/*
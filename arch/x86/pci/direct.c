@@ -14,6 +14,47 @@
  * accesses.
  */
 
+/*
+ * In TD guests, issue the port I/O hypercalls directly instead of taking a
+ * #VE for each IN and OUT of an access.
+ */
+static inline u32 pci_conf1_in(int len, u16 port)
+{
+	u32 val;
+
+	if (cpu_feature_enabled(X86_FEATURE_TDX_GUEST) &&
+	    tdx_pv_pio_read(len, port, &val))
+		return val;
+
+	switch (len) {
+	case 1:
+		return inb(port);
+	case 2:
+		return inw(port);
+	default:
+		return inl(port);
+	}
+}
+
+static inline void pci_conf1_out(int len, u16 port, u32 val)
+{
+	if (cpu_feature_enabled(X86_FEATURE_TDX_GUEST) &&
+	    tdx_pv_pio_write(len, port, val))
+		return;
+
+	switch (len) {
+	case 1:
+		outb((u8)val, port);
+		break;
+	case 2:
+		outw((u16)val, port);
+		break;
+	default:
+		outl(val, port);
+		break;
+	}
+}
+
 #define PCI_CONF1_ADDRESS(bus, devfn, reg) \
 	(0x80000000 | ((reg & 0xF00) << 16) | (bus << 16) \
 	| (devfn << 8) | (reg & 0xFC))
@@ -30,17 +71,17 @@ static int pci_conf1_read(unsigned int seg, unsigned int bus,
 
 	raw_spin_lock_irqsave(&pci_config_lock, flags);
 
-	outl(PCI_CONF1_ADDRESS(bus, devfn, reg), 0xCF8);
+	pci_conf1_out(4, 0xCF8, PCI_CONF1_ADDRESS(bus, devfn, reg));
 
 	switch (len) {
 	case 1:
-		*value = inb(0xCFC + (reg & 3));
+		*value = pci_conf1_in(1, 0xCFC + (reg & 3));
 		break;
 	case 2:
-		*value = inw(0xCFC + (reg & 2));
+		*value = pci_conf1_in(2, 0xCFC + (reg & 2));
 		break;
 	case 4:
-		*value = inl(0xCFC);
+		*value = pci_conf1_in(4, 0xCFC);
 		break;
 	}
 
@@ -59,17 +100,17 @@ static int pci_conf1_write(unsigned int seg, unsigned int bus,
 
 	raw_spin_lock_irqsave(&pci_config_lock, flags);
 
-	outl(PCI_CONF1_ADDRESS(bus, devfn, reg), 0xCF8);
+	pci_conf1_out(4, 0xCF8, PCI_CONF1_ADDRESS(bus, devfn, reg));
 
 	switch (len) {
 	case 1:
-		outb((u8)value, 0xCFC + (reg & 3));
+		pci_conf1_out(1, 0xCFC + (reg & 3), value);
 		break;
 	case 2:
-		outw((u16)value, 0xCFC + (reg & 2));
+		pci_conf1_out(2, 0xCFC + (reg & 2), value);
 		break;
 	case 4:
-		outl((u32)value, 0xCFC);
+		pci_conf1_out(4, 0xCFC, value);
 		break;
 	}
 
@@ -20,6 +20,7 @@
 #include <linux/list.h>
 #include <linux/slab.h>
 #include <linux/memblock.h>
+#include <linux/mm.h>
 #include <linux/memory.h>
 #include <linux/minmax.h>
 #include <linux/sizes.h>
@@ -28,11 +29,18 @@
 #include <linux/sort.h>
 #include <linux/log2.h>
 #include <linux/reboot.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/nmi.h>
+#include <linux/stop_machine.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include <asm/msr-index.h>
 #include <asm/msr.h>
 #include <asm/page.h>
 #include <asm/special_insns.h>
 #include <asm/tdx.h>
+#include <uapi/asm/tdx.h>
 #include <asm/set_memory.h>
 #include <asm/vmx.h>
 #include "tdx.h"
@@ -54,6 +62,8 @@ static DEFINE_PER_CPU(bool, tdx_lp_initialized);
 
 static enum tdx_module_status_t tdx_module_status;
 static DEFINE_MUTEX(tdx_module_lock);
+/* init_tdx_module() is in progress, readable without tdx_module_lock */
+static bool tdx_module_initializing;
 
 /* All TDX-usable memory regions.  Protected by mem_hotplug_lock. */
 static LIST_HEAD(tdx_memlist);
@@ -62,6 +72,23 @@ static struct tdmr_info_list tdx_tdmr_list;
 
 static atomic_t tdx_may_has_private_mem;
 
+/*
+ * Bitmap of the pages, by PFN, that may hold TDX private data, i.e. have
+ * been given to the TDX module and not cleared yet.  Only needed with the
+ * partial write machine check erratum, to clear exactly those pages on
+ * kexec.  1 bit per 4K page of the TDMRs, i.e. a fraction of the PAMT.
+ */
+static unsigned long *tdx_private_pages;
+static unsigned long tdx_private_pages_nr;
+
+/* PAMT ranges of all TDMRs sorted by base, for is_pamt_page() */
+struct tdx_pamt_range {
+	unsigned long base;
+	unsigned long end;
+};
+static struct tdx_pamt_range *tdx_pamt_ranges;
+static int tdx_nr_pamt_ranges;
+
 u32 tdx_get_nr_guest_keyids(void)
 {
 	return tdx_nr_guest_keyids;
@@ -142,12 +169,14 @@ EXPORT_SYMBOL_GPL(tdx_guest_keyid_free);
  */
 static int __always_unused seamcall(u64 fn, struct tdx_module_args *args)
 {
-	u64 sret;
+	u64 sret, prof;
 	int cpu;
 
 	/* Need a stable CPU id for printing error message */
 	cpu = get_cpu();
+	prof = tdx_seamcall_prof_start();
 	sret = __seamcall_ret(fn, args);
+	tdx_seamcall_prof_end(fn, prof, sret);
 	put_cpu();
 
 	switch (sret) {
@@ -258,6 +287,20 @@ static int tdx_cpu_enable(unsigned int cpu)
 	return ret;
 }
 
+/*
+ * CPU hotplug online callback.  Until the TDX module is initialized, leave
+ * TDH.SYS.LP.INIT to tdx_enable(), which does it on all CPUs in parallel
+ * instead of one at a time in the serialized part of CPU bring-up.  The
+ * module status can't change here as tdx_enable() holds cpus_read_lock().
+ */
+static int tdx_cpu_online(unsigned int cpu)
+{
+	if (tdx_module_status != TDX_MODULE_INITIALIZED)
+		return 0;
+
+	return tdx_cpu_enable(cpu);
+}
+
 static void print_cmrs(struct cmr_info *cmr_array, int nr_cmrs)
 {
 	int i;
@@ -830,6 +873,135 @@ static unsigned long tdmrs_count_pamt_kb(struct tdmr_info_list *tdmr_list)
 	return pamt_size / 1024;
 }
 
+static int tdx_pamt_range_cmp(const void *a, const void *b)
+{
+	const struct tdx_pamt_range *ra = a, *rb = b;
+
+	if (ra->base < rb->base)
+		return -1;
+	return ra->base > rb->base;
+}
+
+/*
+ * Build the sorted PAMT ranges.  On failure is_pamt_page() keeps walking
+ * the TDMRs.
+ */
+static void tdx_pamt_ranges_init(struct tdmr_info_list *tdmr_list)
+{
+	struct tdx_pamt_range *ranges;
+	unsigned long base, size;
+	int i, nr = 0;
+
+	ranges = kcalloc(tdmr_list->nr_consumed_tdmrs, sizeof(*ranges),
+			 GFP_KERNEL);
+	if (!ranges)
+		return;
+
+	for (i = 0; i < tdmr_list->nr_consumed_tdmrs; i++) {
+		tdmr_get_pamt(tdmr_entry(tdmr_list, i), &base, &size);
+		if (!size)
+			continue;
+		ranges[nr].base = base;
+		ranges[nr].end = base + size;
+		nr++;
+	}
+	sort(ranges, nr, sizeof(*ranges), tdx_pamt_range_cmp, NULL);
+
+	tdx_nr_pamt_ranges = nr;
+	tdx_pamt_ranges = ranges;
+}
+
+static void tdx_private_pages_init(struct tdmr_info_list *tdmr_list)
+{
+	struct tdmr_info *last;
+
+	if (!boot_cpu_has_bug(X86_BUG_TDX_PW_MCE))
+		return;
+
+	last = tdmr_entry(tdmr_list, tdmr_list->nr_consumed_tdmrs - 1);
+	tdx_private_pages_nr = PHYS_PFN(tdmr_end(last));
+	tdx_private_pages = vzalloc(BITS_TO_LONGS(tdx_private_pages_nr) *
+				    sizeof(unsigned long));
+	if (!tdx_private_pages)
+		pr_warn("no private page tracking, kexec won't clear TD pages\n");
+}
+
+/*
+ * Set or clear the bits of [@pfn, @pfn + @nr).  Other ranges can be updated
+ * concurrently, so the words shared with them are updated with atomic bitops.
+ * The words in between only hold bits of this range.
+ */
+static void tdx_private_pages_update(unsigned long pfn, unsigned long nr,
+				     bool set)
+{
+	unsigned long end = pfn + nr;
+
+	for (; pfn < end && !IS_ALIGNED(pfn, BITS_PER_LONG); pfn++)
+		set ? set_bit(pfn, tdx_private_pages) :
+		      clear_bit(pfn, tdx_private_pages);
+	for (; pfn + BITS_PER_LONG <= end; pfn += BITS_PER_LONG)
+		WRITE_ONCE(tdx_private_pages[BIT_WORD(pfn)], set ? ~0UL : 0);
+	for (; pfn < end; pfn++)
+		set ? set_bit(pfn, tdx_private_pages) :
+		      clear_bit(pfn, tdx_private_pages);
+}
+
+/*
+ * tdx_track_private_pages - Record that a page range was given to the TDX module
+ *
+ * Called once the TDX module took the pages, e.g. by TDH.MEM.PAGE.AUG or
+ * TDH.MNG.ADDCX.  Lock-free and safe in any context.
+ */
+void tdx_track_private_pages(unsigned long phys, unsigned long size)
+{
+	unsigned long pfn = PHYS_PFN(phys);
+
+	if (!tdx_private_pages ||
+	    WARN_ON_ONCE(pfn + (size >> PAGE_SHIFT) > tdx_private_pages_nr))
+		return;
+
+	tdx_private_pages_update(pfn, size >> PAGE_SHIFT, true);
+}
+EXPORT_SYMBOL_GPL(tdx_track_private_pages);
+
+/*
+ * tdx_untrack_private_pages - Record that a page range no longer holds TDX data
+ *
+ * Called once the pages have been cleared with MOVDIR64B after reclaiming
+ * them from the TDX module.
+ */
+void tdx_untrack_private_pages(unsigned long phys, unsigned long size)
+{
+	unsigned long pfn = PHYS_PFN(phys);
+
+	if (!tdx_private_pages || pfn >= tdx_private_pages_nr)
+		return;
+
+	tdx_private_pages_update(pfn,
+				 min(size >> PAGE_SHIFT, tdx_private_pages_nr - pfn),
+				 false);
+}
+EXPORT_SYMBOL_GPL(tdx_untrack_private_pages);
+
+/* Clear the tracked private pages, in runs of contiguous pages. */
+static void tdx_reset_private_pages(void)
+{
+	unsigned long start, end = 0;
+
+	if (!tdx_private_pages)
+		return;
+
+	for (;;) {
+		start = find_next_bit(tdx_private_pages, tdx_private_pages_nr,
+				      end);
+		if (start >= tdx_private_pages_nr)
+			break;
+		end = find_next_zero_bit(tdx_private_pages,
+					 tdx_private_pages_nr, start);
+		reset_tdx_pages(PFN_PHYS(start), PFN_PHYS(end - start));
+	}
+}
+
 static int tdmr_add_rsvd_area(struct tdmr_info *tdmr, int *p_idx, u64 addr,
 			      u64 size, u16 max_reserved_per_tdmr)
 {
@@ -1143,8 +1315,13 @@ static int config_global_keyid(void)
 	return ret;
 }
 
+/* Progress of init_tdmrs(), for sysfs */
+static atomic64_t tdmr_init_done_bytes;
+static u64 tdmr_init_total_bytes;
+
 static int init_tdmr(struct tdmr_info *tdmr)
 {
+	u64 cur = tdmr->base;
 	u64 next;
 
 	/*
@@ -1167,6 +1344,9 @@ static int init_tdmr(struct tdmr_info *tdmr)
 		 * should be retried.
 		 */
 		next = args.rdx;
+		atomic64_add(min(next, tdmr_end(tdmr)) - cur,
+			     &tdmr_init_done_bytes);
+		cur = min(next, tdmr_end(tdmr));
 		cond_resched();
 		/* Keep making SEAMCALLs until the TDMR is done */
 	} while (next < tdmr->base + tdmr->size);
@@ -1174,28 +1354,93 @@ static int init_tdmr(struct tdmr_info *tdmr)
 	return 0;
 }
 
+struct tdmr_init_work {
+	struct work_struct work;
+	struct tdmr_info *tdmr;
+	int nid;
+	int ret;
+};
+
+static void init_tdmr_work(struct work_struct *work)
+{
+	struct tdmr_init_work *w = container_of(work, struct tdmr_init_work,
+						work);
+
+	w->ret = init_tdmr(w->tdmr);
+}
+
+/*
+ * Pick a CPU to initialize the TDMR: spread the TDMRs of a node over the
+ * online CPUs of the node, and over all online CPUs for a node without any.
+ */
+static int tdmr_init_cpu(struct tdmr_init_work *works, int i)
+{
+	const struct cpumask *mask = cpumask_of_node(works[i].nid);
+	unsigned int n = 0, weight;
+	int j;
+
+	for (j = 0; j < i; j++)
+		n += works[j].nid == works[i].nid;
+
+	weight = cpumask_weight_and(mask, cpu_online_mask);
+	if (!weight)
+		return cpumask_nth(i % num_online_cpus(), cpu_online_mask);
+
+	return cpumask_nth_and(n % weight, mask, cpu_online_mask);
+}
+
+/*
+ * This operation is costly.  The TDX module allows TDH.SYS.TDMR.INIT on
+ * different TDMRs concurrently, so initialize each TDMR on a CPU local to
+ * the memory it covers, in parallel.  All the CPUs are online and have VMX
+ * enabled, as the caller holds the CPU hotplug lock.
+ */
 static int init_tdmrs(struct tdmr_info_list *tdmr_list)
 {
-	int i;
+	struct tdmr_init_work *works;
+	int i, ret = 0;
+
+	lockdep_assert_cpus_held();
+
+	tdmr_init_total_bytes = 0;
+	atomic64_set(&tdmr_init_done_bytes, 0);
+	for (i = 0; i < tdmr_list->nr_consumed_tdmrs; i++)
+		tdmr_init_total_bytes += tdmr_entry(tdmr_list, i)->size;
+
+	works = kcalloc(tdmr_list->nr_consumed_tdmrs, sizeof(*works),
+			GFP_KERNEL);
+	if (!works) {
+		/* Fall back to initialize the TDMRs one after another. */
+		for (i = 0; i < tdmr_list->nr_consumed_tdmrs; i++) {
+			ret = init_tdmr(tdmr_entry(tdmr_list, i));
+			if (ret)
+				return ret;
+		}
+		return 0;
+	}
 
-	/*
-	 * This operation is costly.  It can be parallelized,
-	 * but keep it simple for now.
-	 */
 	for (i = 0; i < tdmr_list->nr_consumed_tdmrs; i++) {
-		int ret;
+		works[i].tdmr = tdmr_entry(tdmr_list, i);
+		works[i].nid = tdmr_get_nid(works[i].tdmr, &tdx_memlist);
+		INIT_WORK(&works[i].work, init_tdmr_work);
+		queue_work_on(tdmr_init_cpu(works, i), system_long_wq,
+			      &works[i].work);
+	}
 
-		ret = init_tdmr(tdmr_entry(tdmr_list, i));
-		if (ret)
-			return ret;
+	for (i = 0; i < tdmr_list->nr_consumed_tdmrs; i++) {
+		flush_work(&works[i].work);
+		if (works[i].ret && !ret)
+			ret = works[i].ret;
 	}
 
-	return 0;
+	kfree(works);
+	return ret;
 }
 
 static int init_tdx_module(void)
 {
 	struct cmr_info *cmr_array;
+	u64 start;
 	int ret;
 
 	/*
@@ -1279,18 +1524,27 @@ static int init_tdx_module(void)
 	atomic_inc_return(&tdx_may_has_private_mem);
 
 	/* Config the key of global KeyID on all packages */
+	start = ktime_get_ns();
 	ret = config_global_keyid();
 	if (ret)
 		goto out_reset_pamts;
+	pr_info("global KeyID configuration took %llu us.\n",
+		(ktime_get_ns() - start) / NSEC_PER_USEC);
 
 	/* Initialize TDMRs to complete the TDX module initialization */
+	start = ktime_get_ns();
 	ret = init_tdmrs(&tdx_tdmr_list);
 	if (ret)
 		goto out_reset_pamts;
+	pr_info("TDMR initialization took %llu us.\n",
+		(ktime_get_ns() - start) / NSEC_PER_USEC);
 
 	pr_info("%lu KBs allocated for PAMT.\n",
 			tdmrs_count_pamt_kb(&tdx_tdmr_list));
 
+	tdx_pamt_ranges_init(&tdx_tdmr_list);
+	tdx_private_pages_init(&tdx_tdmr_list);
+
 	/*
 	 * @tdx_memlist is written here and read at memory hotplug time.
 	 * Lock out memory hotplug code while building it.
@@ -1337,26 +1591,52 @@ static int init_tdx_module(void)
 	return ret;
 }
 
-static bool verify_all_cpus_enabled_tdx(void)
+static void tdx_cpu_enable_ipi(void *failed)
 {
-	int cpu;
+	int cpu = smp_processor_id();
 
-	for_each_online_cpu(cpu) {
-		if (!per_cpu(tdx_lp_initialized, cpu)) {
-			pr_err("CPU %d didn't enable TDX\n", cpu);
-			return false;
-		}
+	if (tdx_cpu_enable(cpu))
+		cpumask_set_cpu(cpu, failed);
+}
+
+/*
+ * Do TDH.SYS.LP.INIT on all online CPUs which haven't done it yet.  It can
+ * run on all LPs concurrently, so IPI them all at once.
+ */
+static int tdx_enable_all_cpus(void)
+{
+	cpumask_var_t failed;
+	u64 start;
+	int ret = 0;
+
+	lockdep_assert_cpus_held();
+
+	if (!zalloc_cpumask_var(&failed, GFP_KERNEL))
+		return -ENOMEM;
+
+	start = ktime_get_ns();
+	on_each_cpu(tdx_cpu_enable_ipi, failed, true);
+
+	if (!cpumask_empty(failed)) {
+		pr_err("CPUs failed to enable TDX: %*pbl\n",
+		       cpumask_pr_args(failed));
+		ret = -ENODEV;
+	} else {
+		pr_info("LP initialization took %llu us.\n",
+			(ktime_get_ns() - start) / NSEC_PER_USEC);
 	}
 
-	return true;
+	free_cpumask_var(failed);
+	return ret;
 }
 
 static int __tdx_enable(void)
 {
 	int ret;
 
-	if (unlikely(!verify_all_cpus_enabled_tdx()))
-		return -ENODEV;
+	ret = tdx_enable_all_cpus();
+	if (ret)
+		return ret;
 
 	ret = init_tdx_module();
 	if (ret) {
@@ -1406,7 +1686,9 @@ int tdx_enable(void)
 			pr_warn("all present CPUs should be online.\n");
 			ret = -EINVAL;
 		} else {
+			WRITE_ONCE(tdx_module_initializing, true);
 			ret = __tdx_enable();
+			WRITE_ONCE(tdx_module_initializing, false);
 		}
 
 		cpu_vmxop_put_all();
@@ -1428,6 +1710,223 @@ int tdx_enable(void)
 }
 EXPORT_SYMBOL_GPL(tdx_enable);
 
+/* How long the last TD-preserving update stopped all CPUs, i.e. all TDs */
+static u64 tdx_update_pause_ns;
+/* Bumped by each TD-preserving update, see tdx_module_generation(). */
+static unsigned int tdx_module_gen;
+
+enum tdx_update_stage {
+	TDX_UPDATE_SHUTDOWN,
+	TDX_UPDATE_INSTALL,
+	TDX_UPDATE_GLOBAL_INIT,
+	TDX_UPDATE_LP_INIT,
+	TDX_UPDATE_IMPORT,
+	TDX_UPDATE_NR_STAGES,
+};
+
+struct tdx_update_data {
+	int (*install)(void *data);
+	void *data;
+	/* SEAMLDR.INSTALL runs on one LP at a time. */
+	raw_spinlock_t install_lock;
+	/* CPUs done with a stage, over all the stages so far */
+	atomic_t nr_done;
+	/* The old module was shut down, TDs are lost if a later stage fails */
+	bool shut_down;
+	int ret;
+};
+
+static int tdx_update_shutdown(struct tdx_update_data *d)
+{
+	struct tdx_module_args args = {
+		.rdx = TDX_MD_MODULE_HV,
+	};
+	int ret;
+
+	/* A module without handoff data can't preserve TDs over an update. */
+	if (seamcall(TDH_SYS_RD, &args))
+		return -EOPNOTSUPP;
+
+	args = (struct tdx_module_args) {
+		.rcx = args.r8,
+	};
+	ret = seamcall(TDH_SYS_SHUTDOWN, &args);
+	if (ret)
+		return ret;
+
+	d->shut_down = true;
+	tdx_global_initialized = false;
+	return 0;
+}
+
+/* Import the state of the old module, then refresh its TDSYSINFO_STRUCT. */
+static int tdx_update_import(void)
+{
+	struct tdx_module_args args = {};
+	int ret;
+
+	ret = seamcall(TDH_SYS_UPDATE, &args);
+	if (ret)
+		return ret;
+
+	args = (struct tdx_module_args) {
+		.rcx = __pa(sysinfo),
+		.rdx = TDSYSINFO_STRUCT_SIZE,
+		.r8 = __pa(sysinfo) + PAGE_SIZE / 2,
+		.r9 = MAX_CMRS,
+	};
+	return seamcall(TDH_SYS_INFO, &args);
+}
+
+static int tdx_update_stage(struct tdx_update_data *d, int stage, bool lead)
+{
+	int ret = 0;
+
+	switch (stage) {
+	case TDX_UPDATE_SHUTDOWN:
+		if (lead)
+			ret = tdx_update_shutdown(d);
+		break;
+	case TDX_UPDATE_INSTALL:
+		__this_cpu_write(tdx_lp_initialized, false);
+		raw_spin_lock(&d->install_lock);
+		ret = d->install(d->data);
+		raw_spin_unlock(&d->install_lock);
+		break;
+	case TDX_UPDATE_GLOBAL_INIT:
+		if (lead)
+			ret = init_module_global();
+		break;
+	case TDX_UPDATE_LP_INIT:
+		ret = tdx_cpu_enable(smp_processor_id());
+		break;
+	case TDX_UPDATE_IMPORT:
+		if (lead)
+			ret = tdx_update_import();
+		break;
+	}
+
+	return ret;
+}
+
+/*
+ * Run the stages in lockstep on all CPUs.  Once a stage fails anywhere, the
+ * following ones are skipped everywhere.
+ */
+static int tdx_update_cpu(void *data)
+{
+	struct tdx_update_data *d = data;
+	bool lead = smp_processor_id() == cpumask_first(cpu_online_mask);
+	unsigned int nr_cpus = num_online_cpus();
+	int stage, ret;
+	bool vmxop;
+
+	ret = cpu_vmxop_get();
+	vmxop = !ret;
+	if (ret)
+		WRITE_ONCE(d->ret, ret);
+
+	for (stage = 0; stage < TDX_UPDATE_NR_STAGES; stage++) {
+		if (!READ_ONCE(d->ret)) {
+			ret = tdx_update_stage(d, stage, lead);
+			if (ret)
+				WRITE_ONCE(d->ret, ret);
+		}
+
+		atomic_inc(&d->nr_done);
+		while (atomic_read(&d->nr_done) < (stage + 1) * nr_cpus) {
+			touch_nmi_watchdog();
+			cpu_relax();
+		}
+	}
+
+	if (vmxop)
+		cpu_vmxop_put();
+	return 0;
+}
+
+/**
+ * tdx_module_update - Update the TDX module without tearing down TDs
+ *
+ * @install:	installs the new module on the local CPU, e.g. with
+ *		SEAMLDR.INSTALL of the P-SEAMLDR
+ * @data:	argument of @install
+ *
+ * Shut down the TDX module, install the new one on all CPUs, initialize it
+ * and make it import the state of the old one, i.e. all TDs and their vCPUs
+ * as they were.  All CPUs are stopped meanwhile, so no SEAMCALL is in flight
+ * and no vCPU is in a TD.  That is the pause of all TDs, reported by sysfs
+ * tdx_module/update_pause_us.
+ *
+ * The TDX module is left in error if it fails after the old module is shut
+ * down, a reboot is needed to run TDs again.
+ *
+ * Return 0 if the new module runs the TDs, otherwise error.
+ */
+int tdx_module_update(int (*install)(void *data), void *data)
+{
+	struct tdx_update_data d = {
+		.install = install,
+		.data = data,
+		.install_lock = __RAW_SPIN_LOCK_UNLOCKED(d.install_lock),
+		.nr_done = ATOMIC_INIT(0),
+	};
+	u64 start;
+	int ret;
+
+	mutex_lock(&tdx_module_lock);
+	if (tdx_module_status != TDX_MODULE_INITIALIZED) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	cpus_read_lock();
+	/* Like initialization, the update needs TDH.SYS.LP.INIT on all LPs. */
+	if (!cpumask_equal(cpu_online_mask, cpu_present_mask)) {
+		pr_warn("all present CPUs should be online.\n");
+		ret = -EINVAL;
+		goto out_unlock;
+	}
+
+	start = ktime_get_ns();
+	stop_machine_cpuslocked(tdx_update_cpu, &d, cpu_online_mask);
+	tdx_update_pause_ns = ktime_get_ns() - start;
+	ret = d.ret;
+
+	if (ret && d.shut_down) {
+		pr_err("module update failed (%d), all TDs are lost.\n", ret);
+		tdx_module_status = TDX_MODULE_ERROR;
+	} else if (ret) {
+		pr_err("module update failed (%d), still running the old module.\n",
+		       ret);
+	} else {
+		pr_info("module updated to %u.%u build %u, TDs paused for %llu us.\n",
+			sysinfo->major_version, sysinfo->minor_version,
+			sysinfo->build_num, tdx_update_pause_ns / NSEC_PER_USEC);
+		WRITE_ONCE(tdx_module_gen, tdx_module_gen + 1);
+	}
+
+out_unlock:
+	cpus_read_unlock();
+out:
+	mutex_unlock(&tdx_module_lock);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(tdx_module_update);
+
+/**
+ * tdx_module_generation - Generation of the running TDX module
+ *
+ * The generation changes whenever tdx_module_update() installs a new module,
+ * i.e. whenever tdx_get_sysinfo() may have changed.  Users caching info
+ * derived from it compare the generation to know when to rebuild.
+ */
+unsigned int tdx_module_generation(void)
+{
+	return READ_ONCE(tdx_module_gen);
+}
+EXPORT_SYMBOL_GPL(tdx_module_generation);
+
 /*
  * Convert TDX private pages back to normal on platforms with
  * "partial write machine check" erratum.
@@ -1466,23 +1965,18 @@ void tdx_reset_memory(void)
 	 * One solution could be just converting all memory pages, but
 	 * this may bring non-trivial latency on large memory systems
 	 * (especially when the number of TDX private pages is small).
-	 * So even with this temporary solution, eventually the kernel
-	 * should only convert TDX private pages.
-	 *
-	 * Also, not all pages are mapped as writable in direct mapping,
-	 * thus it's problematic to do so.  It can be done by switching
-	 * to the identical mapping table for kexec() or a new page table
-	 * which maps all pages as writable, but the complexity looks
-	 * overkill.
 	 *
-	 * Thus instead of doing something dramatic to convert all pages,
-	 * only convert PAMTs as for now TDX private pages can only be
-	 * PAMT.
+	 * Instead, KVM records the pages it gives to the TDX module, and
+	 * the ones it has cleared after reclaiming, in @tdx_private_pages.
+	 * Convert the PAMTs and exactly the pages recorded there.  A stale
+	 * bit, e.g. of a page another CPU was clearing when it stopped,
+	 * only costs an extra clearing.
 	 *
 	 * All other cpus are already dead.  TDMRs/PAMTs are stable when
 	 * @tdx_may_has_private_mem reads true.
 	 */
 	tdmrs_reset_pamt_all(&tdx_tdmr_list);
+	tdx_reset_private_pages();
 }
 
 static bool is_pamt_page(unsigned long phys)
@@ -1505,6 +1999,22 @@ static bool is_pamt_page(unsigned long phys)
 	if (tdx_module_status != TDX_MODULE_INITIALIZED)
 		return false;
 
+	/* Binary search the sorted, non-overlapping PAMT ranges. */
+	if (tdx_pamt_ranges) {
+		int lo = 0, hi = tdx_nr_pamt_ranges - 1, mid;
+
+		while (lo <= hi) {
+			mid = lo + (hi - lo) / 2;
+			if (phys < tdx_pamt_ranges[mid].base)
+				hi = mid - 1;
+			else if (phys >= tdx_pamt_ranges[mid].end)
+				lo = mid + 1;
+			else
+				return true;
+		}
+		return false;
+	}
+
 	for (i = 0; i < tdmr_list->nr_consumed_tdmrs; i++) {
 		unsigned long base, size;
 
@@ -1536,6 +2046,19 @@ bool tdx_is_private_mem(unsigned long phys)
 	if (!platform_tdx_enabled())
 		return false;
 
+	/*
+	 * With the private page tracking, all the pages KVM gives to the TDX
+	 * module and hasn't cleared yet are known, so no SEAMCALL is needed.
+	 */
+	if (tdx_private_pages && tdx_module_status == TDX_MODULE_INITIALIZED) {
+		unsigned long pfn = PHYS_PFN(phys);
+
+		if (pfn < tdx_private_pages_nr &&
+		    test_bit(pfn, tdx_private_pages))
+			return true;
+		return is_pamt_page(phys);
+	}
+
 	/* Get page type from the TDX module */
 	sret = __seamcall_ret(TDH_PHYMEM_PAGE_RDMD, &args);
 	/*
@@ -1726,13 +2249,55 @@ int __init tdx_init(void)
 	}
 
 	err = cpuhp_setup_state_nocalls(CPUHP_AP_X86_INTEL_TDX_ONLINE,
-			"x86/tdx:online", tdx_cpu_enable, NULL);
+			"x86/tdx:online", tdx_cpu_online, NULL);
 	if (err)
 		pr_err("Failed to register CPU hotplug callback: %d\n", err);
 
 	return err;
 }
 
+/*
+ * With "tdx_async_init", initialize the TDX module in a kthread once all CPUs
+ * are up, instead of when KVM first calls tdx_enable().  The boot doesn't
+ * wait for it.  tdx_enable() serializes on tdx_module_lock, so a caller
+ * racing with the kthread waits for it to finish and gets its result.
+ */
+static bool tdx_async_init __initdata;
+
+static int __init tdx_async_init_setup(char *s)
+{
+	tdx_async_init = true;
+	return 1;
+}
+__setup("tdx_async_init", tdx_async_init_setup);
+
+static int tdx_enable_thread(void *data)
+{
+	int ret;
+
+	ret = tdx_enable();
+	if (ret)
+		pr_err("asynchronous module initialization failed (%d)\n", ret);
+
+	return 0;
+}
+
+static int __init tdx_async_enable(void)
+{
+	struct task_struct *t;
+
+	if (!tdx_async_init || !platform_tdx_enabled())
+		return 0;
+
+	t = kthread_run(tdx_enable_thread, NULL, "tdx_init");
+	if (IS_ERR(t))
+		pr_warn("failed to start asynchronous module initialization (%ld)\n",
+			PTR_ERR(t));
+
+	return 0;
+}
+late_initcall(tdx_async_enable);
+
 /* Return whether the BIOS has enabled TDX */
 bool platform_tdx_enabled(void)
 {
@@ -1779,6 +2344,10 @@ static ssize_t tdx_module_status_show(struct kobject *kobj, struct kobj_attribut
 	};
 	const char *status = "unknown";
 
+	/* Don't wait for the module initialization holding the lock. */
+	if (READ_ONCE(tdx_module_initializing))
+		return sprintf(buf, "%s", "initializing");
+
 	mutex_lock(&tdx_module_lock);
 	if (tdx_module_status < ARRAY_SIZE(names))
 		status = names[tdx_module_status];
@@ -1888,7 +2457,62 @@ static ssize_t tdx_metadata_cpuid_values_show(struct file *filp, struct kobject
 
 TDX_METADATA_ATTR(cpuid_values, TDX_METADATA_CPUID_VALUES_NAME, 0);
 
+/* One page so that it can be mapped to userspace.  Never freed. */
+static struct tdx_sysinfo_blob *tdx_sysinfo_blob;
+
+static ssize_t tdx_metadata_sysinfo_show(struct file *filp, struct kobject *kobj,
+					 struct bin_attribute *bin_attr, char *buf,
+					 loff_t offset, size_t count)
+{
+	return memory_read_from_buffer(buf, count, &offset, tdx_sysinfo_blob,
+				       sizeof(*tdx_sysinfo_blob));
+}
+
+static int tdx_metadata_sysinfo_mmap(struct file *filp, struct kobject *kobj,
+				     struct bin_attribute *bin_attr,
+				     struct vm_area_struct *vma)
+{
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start > PAGE_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	vm_flags_clear(vma, VM_MAYWRITE);
+	return remap_pfn_range(vma, vma->vm_start,
+			       PHYS_PFN(__pa(tdx_sysinfo_blob)),
+			       vma->vm_end - vma->vm_start, vma->vm_page_prot);
+}
+
+static struct bin_attribute tdx_metadata_sysinfo = {
+	.attr = {
+		.name = TDX_SYSINFO_BLOB_NAME,
+		.mode = 0444,
+	},
+	.size = sizeof(struct tdx_sysinfo_blob),
+	.read = tdx_metadata_sysinfo_show,
+	.mmap = tdx_metadata_sysinfo_mmap,
+};
+
+static int tdx_sysinfo_blob_init(void)
+{
+	BUILD_BUG_ON(sizeof(struct tdx_sysinfo_blob) > PAGE_SIZE);
+	BUILD_BUG_ON(TDX_SYSINFO_BLOB_TDSYSINFO_SIZE != TDSYSINFO_STRUCT_SIZE);
+
+	if (!tdx_sysinfo_blob)
+		tdx_sysinfo_blob = (struct tdx_sysinfo_blob *)get_zeroed_page(GFP_KERNEL);
+	if (!tdx_sysinfo_blob)
+		return -ENOMEM;
+
+	tdx_sysinfo_blob->version = TDX_SYSINFO_BLOB_VERSION;
+	tdx_sysinfo_blob->size = sizeof(*tdx_sysinfo_blob);
+	tdx_sysinfo_blob->nr_guest_keyids = tdx_nr_guest_keyids;
+	memcpy(tdx_sysinfo_blob->tdsysinfo, sysinfo, TDSYSINFO_STRUCT_SIZE);
+
+	return 0;
+}
+
 static struct bin_attribute *tdx_metadata_attrs[] = {
+	&tdx_metadata_sysinfo,
 	&tdx_metadata_attributes_fixed0,
 	&tdx_metadata_attributes_fixed1,
 	&tdx_metadata_xfam_fixed0,
@@ -1921,7 +2545,36 @@ TDX_MODULE_ATTR_SHOW(build_num, "0x%08x");
 TDX_MODULE_ATTR_SHOW(minor_version, "0x%08x");
 TDX_MODULE_ATTR_SHOW(major_version, "0x%08x");
 
+/* Initialized and total bytes of the TDMRs during the module initialization */
+static ssize_t tdx_module_tdmr_init_progress_show(struct kobject *kobj,
+						  struct kobj_attribute *attr,
+						  char *buf)
+{
+	return sprintf(buf, "%llu/%llu",
+		       (u64)atomic64_read(&tdmr_init_done_bytes),
+		       READ_ONCE(tdmr_init_total_bytes));
+}
+
+static struct kobj_attribute tdx_module_tdmr_init_progress = {
+	.attr = { .name = "tdmr_init_progress", .mode = 0444 },
+	.show = tdx_module_tdmr_init_progress_show,
+};
+
+static ssize_t tdx_module_update_pause_us_show(struct kobject *kobj,
+					       struct kobj_attribute *attr,
+					       char *buf)
+{
+	return sprintf(buf, "%llu", READ_ONCE(tdx_update_pause_ns) / NSEC_PER_USEC);
+}
+
+static struct kobj_attribute tdx_module_update_pause_us = {
+	.attr = { .name = "update_pause_us", .mode = 0444 },
+	.show = tdx_module_update_pause_us_show,
+};
+
 static struct attribute *tdx_module_attrs[] = {
+	&tdx_module_tdmr_init_progress.attr,
+	&tdx_module_update_pause_us.attr,
 	&tdx_module_attributes.attr,
 	&tdx_module_vendor_id.attr,
 	&tdx_module_build_date.attr,
@@ -1982,6 +2635,11 @@ static int tdx_sysfs_init(void)
 		sizeof(struct tdx_cpuid_config_leaf);
 	tdx_metadata_cpuid_values.size = sysinfo->num_cpuid_config *
 		sizeof(struct tdx_cpuid_config_value);
+	ret = tdx_sysinfo_blob_init();
+	if (ret) {
+		pr_err("Sysfs exporting tdx sysinfo failed %d\n", ret);
+		return ret;
+	}
 	ret = sysfs_create_group(tdx_metadata_kobj, &tdx_metadata_attr_group);
 	if (ret)
 		pr_err("Sysfs exporting tdx module attributes failed %d\n", ret);
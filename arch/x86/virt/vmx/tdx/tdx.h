@@ -24,6 +24,8 @@
 #define TDH_SYS_LP_INIT		35
 #define TDH_SYS_TDMR_INIT	36
 #define TDH_SYS_CONFIG		45
+#define TDH_SYS_SHUTDOWN	52
+#define TDH_SYS_UPDATE		53
 
 /* TDX page types */
 #define	PT_NDA		0x0
@@ -67,6 +69,7 @@ struct tdmr_info {
  * TDX module metadata identifiers
  */
 #define TDX_MD_FEATURES0			0x0A00000300000008
+#define TDX_MD_MODULE_HV			0x8900000100000003
 
 /*
  * Do not put any hardware-defined TDX structure representations below
@@ -117,4 +120,7 @@ struct tdmr_info_list {
 #define TDX_METADATA_CPUID_LEAVES_NAME		"9900000300000400"
 #define TDX_METADATA_CPUID_VALUES_NAME		"9900000300000500"
 
+/* struct tdx_sysinfo_blob, see <uapi/asm/tdx.h> */
+#define TDX_SYSINFO_BLOB_NAME			"sysinfo"
+
 #endif
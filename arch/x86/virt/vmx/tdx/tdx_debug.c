@@ -2,6 +2,8 @@
 #include <linux/kvm_host.h>
 #include <linux/init.h>
 #include <linux/debugfs.h>
+#include <linux/uaccess.h>
+#include <linux/poll.h>
 
 #include <asm/page.h>
 #include <asm/tdx.h>
@@ -267,6 +269,129 @@ static const struct seq_operations buffer_sops = {
 
 DEFINE_SEQ_ATTRIBUTE(buffer);
 
+/*
+ * Consuming reader of the external trace buffer, for leaving the module trace
+ * on without the cost of the serial port.  The module fills the entries of
+ * the buffer in order and wraps around, so read from where the last read
+ * stopped up to the first empty entry, and empty the entries that were read
+ * for the module to refill.
+ *
+ * The module doesn't tell when it writes an entry, so while the file is open
+ * a work polls the buffer and wakes up the readers waiting for an entry.
+ */
+#define TRACE_PIPE_POLL_INTERVAL	(HZ / 10)
+
+static unsigned int trace_pipe_pos;
+static unsigned int trace_pipe_readers;
+static DEFINE_MUTEX(trace_pipe_lock);
+static DECLARE_WAIT_QUEUE_HEAD(trace_pipe_wait);
+
+static bool trace_pipe_has_data(void)
+{
+	return READ_ONCE(buffer_trace[MAX_PRINT_LENGTH *
+				      READ_ONCE(trace_pipe_pos)]);
+}
+
+static void trace_pipe_poll_work_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(trace_pipe_poll_work, trace_pipe_poll_work_fn);
+
+static void trace_pipe_poll_work_fn(struct work_struct *work)
+{
+	if (trace_pipe_has_data())
+		wake_up_interruptible(&trace_pipe_wait);
+
+	if (READ_ONCE(trace_pipe_readers))
+		schedule_delayed_work(&trace_pipe_poll_work,
+				      TRACE_PIPE_POLL_INTERVAL);
+}
+
+static int trace_pipe_open(struct inode *inode, struct file *file)
+{
+	mutex_lock(&trace_pipe_lock);
+	if (!trace_pipe_readers++)
+		schedule_delayed_work(&trace_pipe_poll_work,
+				      TRACE_PIPE_POLL_INTERVAL);
+	mutex_unlock(&trace_pipe_lock);
+
+	return nonseekable_open(inode, file);
+}
+
+static int trace_pipe_release(struct inode *inode, struct file *file)
+{
+	mutex_lock(&trace_pipe_lock);
+	if (!--trace_pipe_readers)
+		cancel_delayed_work_sync(&trace_pipe_poll_work);
+	mutex_unlock(&trace_pipe_lock);
+
+	return 0;
+}
+
+static ssize_t trace_pipe_read(struct file *file, char __user *ubuf,
+			       size_t count, loff_t *ppos)
+{
+	ssize_t copied = 0;
+	char *entry;
+	size_t len;
+	int ret;
+
+	/* Reads return whole entries, make room for the longest one. */
+	if (count < MAX_PRINT_LENGTH)
+		return -EINVAL;
+
+	for (;;) {
+		ret = mutex_lock_interruptible(&trace_pipe_lock);
+		if (ret)
+			return ret;
+		if (trace_pipe_has_data())
+			break;
+		mutex_unlock(&trace_pipe_lock);
+
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		ret = wait_event_interruptible(trace_pipe_wait,
+					       trace_pipe_has_data());
+		if (ret)
+			return ret;
+	}
+
+	while (copied < count) {
+		entry = &buffer_trace[MAX_PRINT_LENGTH * trace_pipe_pos];
+		len = strnlen(entry, MAX_PRINT_LENGTH);
+		if (!len || len > count - copied)
+			break;
+
+		if (copy_to_user(ubuf + copied, entry, len)) {
+			if (!copied)
+				copied = -EFAULT;
+			break;
+		}
+		memset(entry, 0, MAX_PRINT_LENGTH);
+		WRITE_ONCE(trace_pipe_pos,
+			   (trace_pipe_pos + 1) % TRACE_BUFFER_SIZE);
+		copied += len;
+	}
+	mutex_unlock(&trace_pipe_lock);
+
+	return copied;
+}
+
+static __poll_t trace_pipe_poll(struct file *file, poll_table *wait)
+{
+	poll_wait(file, &trace_pipe_wait, wait);
+
+	return trace_pipe_has_data() ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+static const struct file_operations trace_pipe_fops = {
+	.owner = THIS_MODULE,
+	.open = trace_pipe_open,
+	.release = trace_pipe_release,
+	.read = trace_pipe_read,
+	.poll = trace_pipe_poll,
+	.llseek = no_llseek,
+};
+
 static struct dentry *tdx_seam;
 
 static int __init tdx_debugfs_init(void)
@@ -299,6 +424,8 @@ static int __init tdx_debugfs_init(void)
 			    tdx_seam, NULL, &dump_fops);
 	debugfs_create_file("buffer_trace", 0400,
 			    tdx_seam, buffer_trace, &buffer_fops);
+	debugfs_create_file("trace_pipe", 0400,
+			    tdx_seam, NULL, &trace_pipe_fops);
 	debugfs_create_file("buffer_dump", 0400,
 			    tdx_seam, buffer_dump, &buffer_fops);
 	debugfs_create_file("buffer_emergency", 0400,
@@ -325,6 +452,7 @@ static void __exit tdx_debugfs_exit(void)
 
 	debugfs_remove_recursive(tdx_seam);
 	tdx_seam = NULL;
+	cancel_delayed_work_sync(&trace_pipe_poll_work);
 }
 module_exit(tdx_debugfs_exit);
 
@@ -353,6 +481,8 @@ MODULE_LICENSE("GPL");
  *
  * - tdx_seam/buffer_trace
  *   read the buffer for trace
+ * - tdx_seam/trace_pipe
+ *   read and consume the new entries of the buffer for trace
  * - tdx_seam/buffer_dump
  *   read the buffer dumped from buffer internal to TDX module
  * - tdx_seam/buffer_emergency
@@ -366,6 +496,9 @@ MODULE_LICENSE("GPL");
  *   echo 2 > /sys/kernel/debug/tdx_seam/trace_target
  *   cat /sys/kernel/debug/tdx_seam/buffer_trace
  *
+ *   # or stream it while the module keeps tracing
+ *   cat /sys/kernel/debug/tdx_seam/trace_pipe
+ *
  *   # make tdx module to record in its internal buffer
  *   # and dump it into KVM buffer
  *   echo 0 > /sys/kernel/debug/tdx_seam/trace_target
@@ -110,8 +110,9 @@ static char tdx_module_name[128] __initdata = "intel-seam/libtdx.so";
 static char tdx_sigstruct_name[128] __initdata = "intel-seam/libtdx.so.sigstruct";
 
 /*
- * runtime update of TDX module is future task.  Track state of TDX module as
- * preliminary and export the state via sysfs for admin.
+ * Track state of TDX module as preliminary and export the state via sysfs for
+ * admin.  The TD-preserving runtime update tracks its own state in
+ * tdx_module_update().
  */
 enum TDX_MODULE_STATE {
 	TDX_MODULE_NOT_LOADED = 0,
@@ -308,6 +309,73 @@ static int tdx_load_module(const void *module, unsigned long module_size, const
 	return ret;
 }
 
+static const char tdx_update_module_name[] = "intel-seam/libtdx.so";
+static const char tdx_update_sigstruct_name[] = "intel-seam/libtdx.so.sigstruct";
+
+static int tdx_update_install_cpu(void *data)
+{
+	return seamldr_install(__pa(data));
+}
+
+/*
+ * Writing 1 to /sys/devices/platform/tdx-seamldr/update installs the TDX
+ * module and sigstruct in /lib/firmware in place of the running one,
+ * preserving TDs.
+ */
+static ssize_t update_store(struct device *dev, struct device_attribute *attr,
+			    const char *buf, size_t count)
+{
+	const struct firmware *module, *sigstruct;
+	struct seamldr_params *params;
+	bool val;
+	int ret;
+
+	if (kstrtobool(buf, &val) || !val)
+		return -EINVAL;
+
+	ret = request_firmware(&module, tdx_update_module_name, dev);
+	if (ret)
+		return ret;
+	ret = request_firmware(&sigstruct, tdx_update_sigstruct_name, dev);
+	if (ret)
+		goto out_module;
+
+	params = alloc_seamldr_params(module->data, module->size,
+				      sigstruct->data, sigstruct->size,
+				      SEAMLDR_SCENARIO_UPDATE);
+	if (IS_ERR(params)) {
+		ret = PTR_ERR(params);
+		goto out_sigstruct;
+	}
+
+	mutex_lock(&tdx_mutex);
+	ret = tdx_module_update(tdx_update_install_cpu, params);
+	mutex_unlock(&tdx_mutex);
+
+	free_seamldr_params(params);
+out_sigstruct:
+	release_firmware(sigstruct);
+out_module:
+	release_firmware(module);
+	return ret ?: count;
+}
+static DEVICE_ATTR_WO(update);
+
+static int __init tdx_update_init(void)
+{
+	struct platform_device *pdev;
+
+	if (!found_seam)
+		return 0;
+
+	pdev = platform_device_register_simple("tdx-seamldr", -1, NULL, 0);
+	if (IS_ERR(pdev))
+		return PTR_ERR(pdev);
+
+	return device_create_file(&pdev->dev, &dev_attr_update);
+}
+device_initcall(tdx_update_init);
+
 static int __init tdx_load_module_boot(void)
 {
 	struct cpio_data module, sigstruct;
@@ -107,6 +107,7 @@ void pr_seamcall_ex_ret_info(u64 op, u64 error_code,
 
 struct tdsysinfo_struct;
 const struct tdsysinfo_struct *tdx_get_sysinfo(void);
+int tdx_module_update(int (*install)(void *data), void *data);
 
 int tdx_seamcall_on_each_pkg(int (*fn)(void *), void *param);
 
@@ -142,6 +143,11 @@ static inline const struct tdsysinfo_struct *tdx_get_sysinfo(void)
 	return NULL;
 }
 
+static inline int tdx_module_update(int (*install)(void *data), void *data)
+{
+	return -ENODEV;
+}
+
 static inline int tdx_seamcall_on_each_pkg(int (*fn)(void *), void *param)
 {
 	return 0;
@@ -0,0 +1,325 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * SEAMCALL latency and contention profiling.  Off by default; when enabled,
+ * every SEAMCALL issued via seamcall() or KVM's tdx_seamcall() updates
+ * per-CPU, per-leaf counters and a log2 latency histogram.  Each retry of a
+ * busy or interrupted SEAMCALL is accounted separately.
+ *
+ * - tdx_seamcall/enable: 1 to start profiling, 0 to stop
+ * - tdx_seamcall/reset:  write anything to zero the counters
+ * - tdx_seamcall/stats:  per leaf calls, busy, resumable and total time, and
+ *                        the histogram, bucket N counting calls in
+ *                        [2^(N+6), 2^(N+7)) ns, bucket 0 also the faster ones
+ *
+ * TDH.VP.ENTER isn't included, the TD exit histograms in the KVM vCPU stats
+ * cover it.
+ *
+ * A micro-benchmark of the SEAMCALLs that need no TD is also provided, to
+ * tell the cost of the SEAMCALL round trip from the cost of the leaves:
+ *
+ * - tdx_seamcall/bench_cpu: the CPU the benchmark runs on
+ * - tdx_seamcall/bench:     reading it runs each leaf in a tight loop, and
+ *                           prints calls, errors, min and mean cycles, and a
+ *                           histogram, bucket N counting calls in
+ *                           [2^(N+6), 2^(N+7)) cycles
+ *
+ * The CPU must be in VMX operation, i.e. kvm_intel loaded, or all calls fail.
+ */
+#include <linux/init.h>
+#include <linux/debugfs.h>
+#include <linux/gfp.h>
+#include <linux/log2.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/smp.h>
+
+#include <asm/msr.h>
+#include <asm/tdx.h>
+
+#include "tdx.h"
+
+#undef pr_fmt
+#define pr_fmt(fmt) "tdx: " fmt
+
+/* All leaf numbers are below this, the version in bits 23:16 is ignored. */
+#define TDX_PROF_NR_LEAVES	128
+#define TDX_PROF_NR_BUCKETS	20
+#define TDX_PROF_BUCKET_SHIFT	7
+
+#define TDX_PROF_STATUS_MASK			0xFFFFFFFF00000000ULL
+#define TDX_PROF_INTERRUPTED_RESUMABLE		0x8000000300000000ULL
+
+struct tdx_seamcall_prof_leaf {
+	u64 calls;
+	u64 busy;
+	u64 resumable;
+	u64 total_ns;
+	u64 hist[TDX_PROF_NR_BUCKETS];
+};
+
+struct tdx_seamcall_prof {
+	struct tdx_seamcall_prof_leaf leaves[TDX_PROF_NR_LEAVES];
+};
+
+DEFINE_STATIC_KEY_FALSE(tdx_seamcall_prof_key);
+EXPORT_SYMBOL_GPL(tdx_seamcall_prof_key);
+
+/* Allocated on the first enabling, never freed as callers may be in flight. */
+static struct tdx_seamcall_prof __percpu *tdx_prof;
+static DEFINE_MUTEX(tdx_prof_lock);
+
+static unsigned int tdx_prof_bucket(u64 ns)
+{
+	unsigned int b;
+
+	if (ns < BIT_ULL(TDX_PROF_BUCKET_SHIFT))
+		return 0;
+
+	b = ilog2(ns) - (TDX_PROF_BUCKET_SHIFT - 1);
+	return min_t(unsigned int, b, TDX_PROF_NR_BUCKETS - 1);
+}
+
+/* this_cpu ops, as SEAMCALLs are made with and without preemption. */
+void __tdx_seamcall_prof(u64 fn, u64 ns, u64 ret)
+{
+	u64 leaf = fn & 0xFFFF;
+
+	if (leaf >= TDX_PROF_NR_LEAVES)
+		return;
+
+	this_cpu_inc(tdx_prof->leaves[leaf].calls);
+	this_cpu_add(tdx_prof->leaves[leaf].total_ns, ns);
+	this_cpu_inc(tdx_prof->leaves[leaf].hist[tdx_prof_bucket(ns)]);
+
+	if (TDX_SEAMCALL_ERR_RECOVERABLE(ret))
+		this_cpu_inc(tdx_prof->leaves[leaf].busy);
+	else if ((ret & TDX_PROF_STATUS_MASK) == TDX_PROF_INTERRUPTED_RESUMABLE)
+		this_cpu_inc(tdx_prof->leaves[leaf].resumable);
+}
+EXPORT_SYMBOL_GPL(__tdx_seamcall_prof);
+
+static int tdx_prof_enable_get(void *data, u64 *val)
+{
+	*val = static_key_enabled(&tdx_seamcall_prof_key);
+	return 0;
+}
+
+static int tdx_prof_enable_set(void *data, u64 val)
+{
+	int ret = 0;
+
+	mutex_lock(&tdx_prof_lock);
+	if (val) {
+		if (!tdx_prof)
+			tdx_prof = alloc_percpu(struct tdx_seamcall_prof);
+		if (tdx_prof)
+			static_branch_enable(&tdx_seamcall_prof_key);
+		else
+			ret = -ENOMEM;
+	} else {
+		static_branch_disable(&tdx_seamcall_prof_key);
+	}
+	mutex_unlock(&tdx_prof_lock);
+
+	return ret;
+}
+
+DEFINE_DEBUGFS_ATTRIBUTE(tdx_prof_enable_fops, tdx_prof_enable_get,
+			 tdx_prof_enable_set, "%llu\n");
+
+static int tdx_prof_reset_set(void *data, u64 val)
+{
+	int cpu;
+
+	mutex_lock(&tdx_prof_lock);
+	if (tdx_prof) {
+		for_each_possible_cpu(cpu)
+			memset(per_cpu_ptr(tdx_prof, cpu), 0,
+			       sizeof(struct tdx_seamcall_prof));
+	}
+	mutex_unlock(&tdx_prof_lock);
+
+	return 0;
+}
+
+DEFINE_DEBUGFS_ATTRIBUTE(tdx_prof_reset_fops, NULL, tdx_prof_reset_set,
+			 "%llu\n");
+
+static int tdx_prof_stats_show(struct seq_file *m, void *v)
+{
+	struct tdx_seamcall_prof_leaf sum, *p;
+	int leaf, cpu, i;
+
+	mutex_lock(&tdx_prof_lock);
+	if (!tdx_prof)
+		goto out;
+
+	seq_puts(m, "leaf calls busy resumable total_ns hist\n");
+	for (leaf = 0; leaf < TDX_PROF_NR_LEAVES; leaf++) {
+		memset(&sum, 0, sizeof(sum));
+		for_each_possible_cpu(cpu) {
+			p = &per_cpu_ptr(tdx_prof, cpu)->leaves[leaf];
+			sum.calls += READ_ONCE(p->calls);
+			sum.busy += READ_ONCE(p->busy);
+			sum.resumable += READ_ONCE(p->resumable);
+			sum.total_ns += READ_ONCE(p->total_ns);
+			for (i = 0; i < TDX_PROF_NR_BUCKETS; i++)
+				sum.hist[i] += READ_ONCE(p->hist[i]);
+		}
+		if (!sum.calls)
+			continue;
+
+		seq_printf(m, "%d %llu %llu %llu %llu", leaf, sum.calls,
+			   sum.busy, sum.resumable, sum.total_ns);
+		for (i = 0; i < TDX_PROF_NR_BUCKETS; i++)
+			seq_printf(m, " %llu", sum.hist[i]);
+		seq_putc(m, '\n');
+	}
+out:
+	mutex_unlock(&tdx_prof_lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(tdx_prof_stats);
+
+#define TDX_BENCH_ITERS		10000
+
+static unsigned int tdx_bench_cpu;
+
+struct tdx_bench {
+	const char *name;
+	u64 (*fn)(u64 pa);
+	u64 errors;
+	u64 last_err;
+	u64 min;
+	u64 total;
+	u64 hist[TDX_PROF_NR_BUCKETS];
+};
+
+static u64 tdx_bench_sys_rd(u64 pa)
+{
+	struct tdx_module_args args = { .rdx = TDX_MD_FEATURES0 };
+
+	return __seamcall_ret(TDH_SYS_RD, &args);
+}
+
+static u64 tdx_bench_sys_rd_lean(u64 pa)
+{
+	struct tdx_module_args args;
+
+	return __seamcall_lean_ret(TDH_SYS_RD, 0, TDX_MD_FEATURES0, 0, &args);
+}
+
+static u64 tdx_bench_page_rdmd(u64 pa)
+{
+	struct tdx_module_args args = { .rcx = pa };
+
+	return __seamcall_ret(TDH_PHYMEM_PAGE_RDMD, &args);
+}
+
+/* Runs on tdx_bench_cpu, with preemption left on as KVM does. */
+static int tdx_bench_one(void *data)
+{
+	struct tdx_bench *b = data;
+	struct page *page;
+	u64 pa, start, cycles, err;
+	int i;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
+	pa = page_to_phys(page);
+
+	b->min = U64_MAX;
+	for (i = 0; i < TDX_BENCH_ITERS; i++) {
+		start = rdtsc_ordered();
+		err = b->fn(pa);
+		cycles = rdtsc_ordered() - start;
+
+		if (err) {
+			b->errors++;
+			b->last_err = err;
+			continue;
+		}
+		b->min = min(b->min, cycles);
+		b->total += cycles;
+		b->hist[tdx_prof_bucket(cycles)]++;
+		cond_resched();
+	}
+
+	__free_page(page);
+	return 0;
+}
+
+static int tdx_bench_show(struct seq_file *m, void *v)
+{
+	struct tdx_bench benches[] = {
+		{ .name = "TDH.SYS.RD", .fn = tdx_bench_sys_rd },
+		{ .name = "TDH.SYS.RD(lean)", .fn = tdx_bench_sys_rd_lean },
+		{ .name = "TDH.PHYMEM.PAGE.RDMD", .fn = tdx_bench_page_rdmd },
+	};
+	unsigned int cpu = READ_ONCE(tdx_bench_cpu);
+	struct tdx_bench *b;
+	u64 ok;
+	int i, r;
+
+	seq_printf(m, "cpu %u, %d calls per leaf\n", cpu, TDX_BENCH_ITERS);
+	seq_puts(m, "leaf errors min_cycles mean_cycles hist\n");
+	for (b = benches; b < benches + ARRAY_SIZE(benches); b++) {
+		r = smp_call_on_cpu(cpu, tdx_bench_one, b, true);
+		if (r)
+			return r;
+
+		ok = TDX_BENCH_ITERS - b->errors;
+		if (!ok) {
+			seq_printf(m, "%s: failed, err=%llx\n", b->name,
+				   b->last_err);
+			continue;
+		}
+
+		seq_printf(m, "%s %llu %llu %llu", b->name, b->errors, b->min,
+			   div64_u64(b->total, ok));
+		for (i = 0; i < TDX_PROF_NR_BUCKETS; i++)
+			seq_printf(m, " %llu", b->hist[i]);
+		seq_putc(m, '\n');
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(tdx_bench);
+
+static int tdx_bench_cpu_get(void *data, u64 *val)
+{
+	*val = READ_ONCE(tdx_bench_cpu);
+	return 0;
+}
+
+static int tdx_bench_cpu_set(void *data, u64 val)
+{
+	if (val >= nr_cpu_ids || !cpu_online(val))
+		return -EINVAL;
+
+	WRITE_ONCE(tdx_bench_cpu, val);
+	return 0;
+}
+
+DEFINE_DEBUGFS_ATTRIBUTE(tdx_bench_cpu_fops, tdx_bench_cpu_get,
+			 tdx_bench_cpu_set, "%llu\n");
+
+static int __init tdx_prof_init(void)
+{
+	struct dentry *dir;
+
+	if (!platform_tdx_enabled())
+		return 0;
+
+	dir = debugfs_create_dir("tdx_seamcall", NULL);
+	debugfs_create_file("enable", 0600, dir, NULL, &tdx_prof_enable_fops);
+	debugfs_create_file("reset", 0200, dir, NULL, &tdx_prof_reset_fops);
+	debugfs_create_file("stats", 0400, dir, NULL, &tdx_prof_stats_fops);
+	debugfs_create_file("bench_cpu", 0600, dir, NULL, &tdx_bench_cpu_fops);
+	debugfs_create_file("bench", 0400, dir, NULL, &tdx_bench_fops);
+
+	return 0;
+}
+late_initcall(tdx_prof_init);
@@ -235,6 +235,8 @@ struct tdx_tpm_session {
  * @chip: Reference to TPM Chip.
  * @req: Buffer used to send TPM request.
  * @resp: Buffer used to receive TPM response.
+ * @priv: Private buffer holding the plain SPDM application data, so that
+ *	  only cipher text is ever written to or read from @req and @resp.
  * @session: ACPI TDTK session info.
  * @service: Service node used to save active TPM request.
  * @tpm_req_lock: Lock to streamline TPM requests.
@@ -246,6 +248,7 @@ struct tdx_tpm_dev {
 	struct tpm_chip *chip;
 	struct tdx_tpm_msg_req *req;
 	struct tdx_tpm_msg_resp *resp;
+	struct spdm_data *priv;
 	struct tdx_tpm_session session;
 	struct tdx_service_node service;
 	struct mutex tpm_req_lock;
@@ -368,25 +371,23 @@ static int tdx_tpm_service_cmd(struct tdx_tpm_dev *tdev)
 {
 	struct tdx_tpm_msg_req *req = tdev->req;
 	struct tdx_tpm_msg_resp *resp = tdev->resp;
+	struct irq_data *irqd = irq_get_irq_data(tdev->irq);
 	cpumask_t saved_cpumask;
 	int ret, cpu;
 	u64 vector;
 
-	cpu = smp_processor_id();
-
 	/*
 	 * The VMM always notifies the TDX guest via the same CPU that
-	 * calls the TDVMCALL Service command. Use the same CPU for
-	 * callback IRQ and TDVMCALL.
+	 * calls the TDVMCALL Service command.  Call it on the CPU the
+	 * shared event notification IRQ targets.
 	 */
+	cpu = cpumask_first(irq_data_get_effective_affinity_mask(irqd));
 
 	cpumask_copy(&saved_cpumask, current->cpus_ptr);
 
 	set_cpus_allowed_ptr(current, cpumask_of(cpu));
 
-	irq_set_affinity(tdev->irq, cpumask_of(cpu));
-
-	vector = irqd_cfg(irq_get_irq_data(tdev->irq))->vector;
+	vector = irqd_cfg(irqd)->vector;
 
 	reinit_completion(&tdev->service.compl);
 
@@ -412,13 +413,46 @@ static int tdx_tpm_service_cmd(struct tdx_tpm_dev *tdev)
 }
 
 
+/*
+ * aead_crypt_sg() - Encrypt or decrypt @cryptlen bytes from @src to @dst.
+ * Both lists start with the TDX_AEAD_AAD_LEN bytes of AAD; they can describe
+ * the caller's buffer and the shared pages directly, so that no extra copy is
+ * needed.  @src and @dst must describe either the same buffers or disjoint
+ * ones, including the AAD.  "gcm(aes)" resolves to the AES-NI/VAES
+ * implementation when the CPU supports it.
+ */
+static int aead_crypt_sg(struct tdx_tpm_crypto *crypto,
+			 struct scatterlist *src, struct scatterlist *dst,
+			 size_t cryptlen, bool enc)
+{
+	DECLARE_CRYPTO_WAIT(wait);
+	struct aead_request *req;
+	int ret;
+
+	req = aead_request_alloc(crypto->tfm, GFP_KERNEL);
+	if (!req)
+		return -ENOMEM;
+
+	aead_request_set_ad(req, TDX_AEAD_AAD_LEN);
+	aead_request_set_tfm(req, crypto->tfm);
+	aead_request_set_callback(req, 0, crypto_req_done, &wait);
+
+	aead_request_set_crypt(req, src, dst, cryptlen, crypto->new_iv);
+	ret = crypto_wait_req(enc ? crypto_aead_encrypt(req) : crypto_aead_decrypt(req), &wait);
+
+	aead_request_free(req);
+
+	return ret;
+}
+
 /*
  * enc_dec_msg() - Encrypt the data in sbuf and copy the result to dbuf.
  * @tdev - Reference to struct tdx_tpm_dev object.
  * @crypto - struct tdx_tpm_crypto object used in encryption/decryption
  * 	     process.
- * @aad - Associated data used in AEAD encryption.
+ * @saad - Associated data used in AEAD encryption.
  * @sbuf - Soure buffer with data (plain text or ciper text).
+ * @daad - Destination of the associated data, @saad for in place.
  * @dbuf - Destination buffer to store the result.
  * @len - Length of the plain text or ciper text from @src.
  * @cryptlen - Number of bytes to process from @src (Including ATAG).
@@ -426,38 +460,22 @@ static int tdx_tpm_service_cmd(struct tdx_tpm_dev *tdev)
  */
 static int enc_dec_msg(struct tdx_tpm_dev *tdev,
 		       struct tdx_tpm_crypto *crypto,
-		       u8 *aad, u8 *sbuf, u8 *dbuf, size_t len,
+		       u8 *saad, u8 *sbuf, u8 *daad, u8 *dbuf, size_t len,
 		       size_t new_len, bool enc)
 {
 	struct scatterlist src[3], dst[3];
-	DECLARE_CRYPTO_WAIT(wait);
-	struct aead_request *req;
-	int ret;
-
-	req = aead_request_alloc(crypto->tfm, GFP_KERNEL);
-	if (!req)
-		return -ENOMEM;
 
 	sg_init_table(src, 3);
-	sg_set_buf(&src[0], aad, TDX_AEAD_AAD_LEN);
+	sg_set_buf(&src[0], saad, TDX_AEAD_AAD_LEN);
 	sg_set_buf(&src[1], sbuf, len);
 	sg_set_buf(&src[2], &sbuf[len], crypto->atag_len);
 
 	sg_init_table(dst, 3);
-	sg_set_buf(&dst[0], aad, TDX_AEAD_AAD_LEN);
+	sg_set_buf(&dst[0], daad, TDX_AEAD_AAD_LEN);
 	sg_set_buf(&dst[1], dbuf, len);
 	sg_set_buf(&dst[2], &dbuf[len], crypto->atag_len);
 
-	aead_request_set_ad(req, TDX_AEAD_AAD_LEN);
-	aead_request_set_tfm(req, crypto->tfm);
-	aead_request_set_callback(req, 0, crypto_req_done, &wait);
-
-	aead_request_set_crypt(req, src, dst, new_len, crypto->new_iv);
-	ret = crypto_wait_req(enc ? crypto_aead_encrypt(req) : crypto_aead_decrypt(req), &wait);
-
-	aead_request_free(req);
-
-	return ret;
+	return aead_crypt_sg(crypto, src, dst, new_len, enc);
 }
 
 static void spdm_recalc_iv(struct tdx_tpm_crypto *crypto)
@@ -478,16 +496,22 @@ static int tdx_tpm_send(struct tpm_chip *chip, u8 *buf, size_t len)
 	struct tdx_tpm_msg_resp *resp = tdev->resp;
 	struct tdx_tpm_crypto *crypto = &tdev->session.send_crypto;
 	u32 data_len, tot_data_len = len + crypto->atag_len;
+	struct spdm_data *priv = tdev->priv;
+	struct spdm_aad aad;
 	int ret;
 
-	if (len > tdev->msg_len - sizeof(*req))
+	if (len > tdev->msg_len - sizeof(*req) - crypto->atag_len)
 		return -EINVAL;
 
 	/* Use locking to streamline TPM requests to the VMM */
 	mutex_lock(&tdev->tpm_req_lock);
 
-	memset(req, 0, tdev->msg_len);
-	memset(resp, 0, tdev->msg_len);
+	/*
+	 * Only the headers need clearing, the payload is overwritten by the
+	 * encryption below and, for the response, by the VMM.
+	 */
+	memset(req, 0, sizeof(*req));
+	memset(resp, 0, sizeof(*resp));
 
 	/* Initialize TDVMCALL header */
 	memcpy(req->guid, &tpm_guid, sizeof(tpm_guid));
@@ -500,19 +524,19 @@ static int tdx_tpm_send(struct tpm_chip *chip, u8 *buf, size_t len)
 	req->spdm.mtype = TDX_SPDM_MSG_TYPE_DSP0277;
 	req->spdm.mlen = MSG_REQ_SIZE_FROM(spdm.mlen) + tot_data_len;
 
-	/* Initialize AAD header */
-	req->aad.tlen = MSG_REQ_SIZE_FROM(aad.tlen) + tot_data_len;
-	req->aad.seq_no = crypto->seq_no;
-	req->aad.sess_id = tdev->session.sess_id;
-
-	/* Initialize SPDM data header */
-	req->app_data.dlen = MSG_REQ_SIZE_FROM(app_data.dlen) + len;
-	req->app_data.data_type = TDX_SPDM_MSG_TYPE_TPM;
+	/*
+	 * Initialize AAD header.  Encrypt from a private copy, the AAD in the
+	 * shared buffer is the destination.
+	 */
+	aad.tlen = MSG_REQ_SIZE_FROM(aad.tlen) + tot_data_len;
+	aad.seq_no = crypto->seq_no;
+	aad.sess_id = tdev->session.sess_id;
+	req->aad = aad;
 
-	/* Initialize src buf */
-	memcpy(req->app_data.data, buf, len);
-	memcpy(&req->app_data.data[len], crypto->atag, crypto->atag_len);
-	data_len = sizeof(req->app_data) + len;
+	/* Initialize SPDM data header, in the private buffer */
+	priv->dlen = MSG_REQ_SIZE_FROM(app_data.dlen) + len;
+	priv->data_type = TDX_SPDM_MSG_TYPE_TPM;
+	data_len = sizeof(*priv) + len;
 
 	/* Initialize resp buf */
 	memcpy(resp->guid, &tpm_guid, sizeof(tpm_guid));
@@ -533,9 +557,29 @@ static int tdx_tpm_send(struct tpm_chip *chip, u8 *buf, size_t len)
 	print_req_msg("Send Msg: Req: Before enc", req);
 #endif
 
-	/* Encrypt the TPM SPDM message */
-	ret = enc_dec_msg(tdev, crypto, (u8 *)&req->aad, (u8 *)&req->app_data,
-			  (u8 *)&req->app_data, data_len, data_len, 1);
+	/*
+	 * Encrypt the TPM SPDM message into the shared buffer, straight from
+	 * the caller's buffer unless it isn't in the linear map.
+	 */
+	if (virt_addr_valid(buf)) {
+		struct scatterlist src[3], dst[2];
+
+		sg_init_table(src, 3);
+		sg_set_buf(&src[0], &aad, TDX_AEAD_AAD_LEN);
+		sg_set_buf(&src[1], priv, sizeof(*priv));
+		sg_set_buf(&src[2], buf, len);
+
+		sg_init_table(dst, 2);
+		sg_set_buf(&dst[0], &req->aad, TDX_AEAD_AAD_LEN);
+		sg_set_buf(&dst[1], &req->app_data, tot_data_len + sizeof(*priv));
+
+		ret = aead_crypt_sg(crypto, src, dst, data_len, 1);
+	} else {
+		memcpy(priv->data, buf, len);
+		ret = enc_dec_msg(tdev, crypto, (u8 *)&aad, (u8 *)priv,
+				  (u8 *)&req->aad, (u8 *)&req->app_data,
+				  data_len, data_len, 1);
+	}
 	if (ret) {
 		dev_err(tdev->dev, "Send msg: encryption failed\n");
 		goto send_msg_failed;
@@ -582,6 +626,8 @@ static int tdx_tpm_recv(struct tpm_chip *chip, u8 *buf, size_t len)
 	struct tdx_tpm_msg_req *req = tdev->req;
 	struct tdx_tpm_msg_resp *resp = tdev->resp;
 	struct tdx_tpm_crypto *crypto = &tdev->session.recv_crypto;
+	struct spdm_data *priv = tdev->priv;
+	struct spdm_aad aad;
 	int msg_size, ret;
 
 	if (len > tdev->msg_len - sizeof(*req))
@@ -590,8 +636,9 @@ static int tdx_tpm_recv(struct tpm_chip *chip, u8 *buf, size_t len)
 	/* Use locking to streamline TPM requests to the VMM */
 	mutex_lock(&tdev->tpm_req_lock);
 
-	memset(req, 0, tdev->msg_len);
-	memset(resp, 0, tdev->msg_len);
+	/* See tdx_tpm_send(), only the headers need clearing. */
+	memset(req, 0, sizeof(*req));
+	memset(resp, 0, sizeof(*resp));
 
 	/* Initialize req buf */
 	memcpy(req->guid, &tpm_guid, sizeof(tpm_guid));
@@ -633,9 +680,33 @@ static int tdx_tpm_recv(struct tpm_chip *chip, u8 *buf, size_t len)
 	print_resp_msg("Recv Msg: Resp: Before dec", resp);
 #endif
 
-	ret = enc_dec_msg(tdev, crypto, (u8 *)&resp->aad, (u8 *)&resp->app_data,
-			  (u8 *)&resp->app_data, resp->aad.tlen - crypto->atag_len,
-			  resp->aad.tlen, 0);
+	/*
+	 * Snapshot the AAD and decrypt into the private buffer, the VMM can
+	 * change the shared response at any time.
+	 */
+	aad = resp->aad;
+	if (aad.tlen < sizeof(*priv) + crypto->atag_len ||
+	    aad.tlen > tdev->msg_len - offsetof(struct tdx_tpm_msg_resp, app_data)) {
+		dev_err(tdev->dev, "Recv msg: Invalid tlen:%d\n", aad.tlen);
+		ret = -EIO;
+		goto recv_msg_failed;
+	}
+
+	/*
+	 * Copy the cipher text and tag into @priv before verifying them, the
+	 * tag check is worthless if the VMM can rewrite the shared buffer
+	 * while it is being decrypted.
+	 */
+	memcpy(priv, &resp->app_data, aad.tlen);
+
+	/*
+	 * Decrypt @priv in place.  The AEAD source and destination must be
+	 * either the same buffers or disjoint, splitting the destination
+	 * between the @priv header and the caller's buffer would overlap the
+	 * source partially.
+	 */
+	ret = enc_dec_msg(tdev, crypto, (u8 *)&aad, (u8 *)priv, (u8 *)&aad,
+			  (u8 *)priv, aad.tlen - crypto->atag_len, aad.tlen, 0);
 	if (ret) {
 		dev_err(tdev->dev, "Recv msg: decryption failed %d\n", ret);
 		goto recv_msg_failed;
@@ -648,7 +719,7 @@ static int tdx_tpm_recv(struct tpm_chip *chip, u8 *buf, size_t len)
 	/* Increment the seq_no */
 	crypto->seq_no++;
 
-	msg_size = resp->app_data.dlen - sizeof(resp->app_data.data_type);
+	msg_size = priv->dlen - sizeof(priv->data_type);
 
 	if (msg_size < 0) {
 		dev_err(tdev->dev, "Recv msg: Invalid resp size:%d\n", msg_size);
@@ -663,7 +734,13 @@ static int tdx_tpm_recv(struct tpm_chip *chip, u8 *buf, size_t len)
 		goto recv_msg_failed;
 	}
 
-	memcpy(buf, resp->app_data.data, msg_size);
+	if (msg_size > aad.tlen - crypto->atag_len - sizeof(*priv)) {
+		dev_err(tdev->dev, "Recv msg: Invalid data size:%d\n", msg_size);
+		ret = -EIO;
+		goto recv_msg_failed;
+	}
+
+	memcpy(buf, priv->data, msg_size);
 
 	tdev->service.valid = false;
 	mutex_unlock(&tdev->tpm_req_lock);
@@ -863,8 +940,11 @@ static void *alloc_shared_pages(size_t len)
 
 static void tdx_tpm_free_buf(struct tdx_tpm_dev *tdev)
 {
-	free_shared_pages((void *)tdev->req, tdev->msg_len);
-	free_shared_pages((void *)tdev->resp, tdev->msg_len);
+	if (tdev->req)
+		free_shared_pages((void *)tdev->req, tdev->msg_len);
+	if (tdev->resp)
+		free_shared_pages((void *)tdev->resp, tdev->msg_len);
+	kfree_sensitive(tdev->priv);
 }
 
 static int tdx_tpm_alloc_buf(struct tdx_tpm_dev *tdev)
@@ -879,6 +959,10 @@ static int tdx_tpm_alloc_buf(struct tdx_tpm_dev *tdev)
 	if (!tdev->resp)
 		goto alloc_failed;
 
+	tdev->priv = kmalloc(tdev->msg_len, GFP_KERNEL);
+	if (!tdev->priv)
+		goto alloc_failed;
+
 	return 0;
 
 alloc_failed:
@@ -889,27 +973,25 @@ static int tdx_tpm_alloc_buf(struct tdx_tpm_dev *tdev)
 
 static int tdx_tpm_alloc_irq(struct tdx_tpm_dev *tdev)
 {
-	int ret, irq;
+	int ret;
 
-	/* Allocate an IRQ vector for service callback */
-	irq = tdx_alloc_event_irq();
-	if (irq <= 0)
+	if (tdx_notify_irq < 0)
 		return -EIO;
 
 	/*
-	 * VMM will use the same CPU that makes the TDX service call for
-	 * event notification. Set the IRQ with IRQF_NOBALANCING to prevent
-	 * its affinity from being changed.
+	 * Share the event notification IRQ with the other TDX services, e.g.
+	 * attestation.  tdx_service_irq_handler() only claims the interrupt
+	 * once the VMM has completed the in-flight command.
 	 */
-	ret = request_irq(irq, tdx_service_irq_handler, IRQF_NOBALANCING | IRQF_SHARED,
-                          "tdx_service_irq", tdev);
-        if (ret) {
-                pr_err("Event notification IRQ request failed ret:%d\n", ret);
-                return -EIO;
-        }
-
+	ret = request_irq(tdx_notify_irq, tdx_service_irq_handler,
+			  IRQF_NOBALANCING | IRQF_SHARED, "tdx_service_irq",
+			  tdev);
+	if (ret) {
+		pr_err("Event notification IRQ request failed ret:%d\n", ret);
+		return -EIO;
+	}
 
-	tdev->irq = irq;
+	tdev->irq = tdx_notify_irq;
 
 	return ret;
 }
@@ -920,7 +1002,6 @@ static void tdx_tpm_free_irq(struct tdx_tpm_dev *tdev)
 		return;
 
 	free_irq(tdev->irq, tdev);
-	tdx_free_event_irq(tdev->irq);
 }
 
 static int tdx_tpm_probe(struct platform_device *pdev)
@@ -1,13 +1,120 @@
 // SPDX-License-Identifier: GPL-2.0-only
 
 #include <linux/efi.h>
+#include <linux/delay.h>
+#include <linux/kthread.h>
 #include <linux/memblock.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <asm/unaccepted_memory.h>
 
 /* Protects unaccepted memory bitmap */
 static DEFINE_SPINLOCK(unaccepted_memory_lock);
 
+/*
+ * Background acceptance: with unaccepted_memory.background_accept=1, a kthread
+ * per node accepts the memory of the node left unaccepted at boot ahead of the
+ * allocations.  It accepts up to background_chunk_mb at a time, 1G aligned for
+ * 1G accepts, and sleeps background_interval_ms between the chunks.  Within a
+ * chunk, interrupts are only disabled for one arch_accept_memory_align() block
+ * at a time.
+ *
+ * The range being accepted by a kthread stays set in the bitmap, so that
+ * range_contains_unaccepted_memory() is still true for it, and is published
+ * in background_inflight[] for accept_memory() to wait for.
+ */
+static bool background_accept;
+module_param(background_accept, bool, 0444);
+#define BACKGROUND_CHUNK_MAX_MB	1024
+static unsigned int background_chunk_mb = BACKGROUND_CHUNK_MAX_MB;
+module_param(background_chunk_mb, uint, 0644);
+static unsigned int background_interval_ms;
+module_param(background_interval_ms, uint, 0644);
+/* Progress, in MB accepted by the kthreads. */
+static unsigned long background_accepted_mb;
+module_param(background_accepted_mb, ulong, 0444);
+
+/*
+ * Huge acceptance: with unaccepted_memory.huge_accept=1, accept_memory()
+ * widens the range to the enclosing blocks of arch_accept_memory_align(),
+ * e.g. 1G for a TD whose VMM maps private memory with 1G pages, when they are
+ * entirely unaccepted.  Accepting them whole lets the platform keep its huge
+ * mappings, at the cost of a longer accept_memory() on the first touch.
+ */
+static bool huge_accept;
+module_param(huge_accept, bool, 0644);
+
+struct accept_range {
+	/* Unit indices in the bitmap, [start, end) */
+	unsigned long start;
+	unsigned long end;
+};
+
+/*
+ * Units eligible for background acceptance, i.e. unaccepted at boot and not
+ * made shared since by unaccept_memory().
+ */
+static unsigned long *background_bitmap;
+static struct accept_range *background_inflight;
+static atomic_t background_nr_inflight;
+static u64 background_accepted;
+
+/* Called with unaccepted_memory_lock held. */
+static bool range_is_inflight(unsigned long start, unsigned long end)
+{
+	int nid;
+
+	if (!atomic_read(&background_nr_inflight))
+		return false;
+
+	for_each_node(nid) {
+		struct accept_range *r = &background_inflight[nid];
+
+		if (r->start < r->end && start < r->end && r->start < end)
+			return true;
+	}
+
+	return false;
+}
+
+/* Called with unaccepted_memory_lock held, @start is relative to phys_base. */
+static bool block_is_unaccepted(struct efi_unaccepted_memory *unaccepted,
+				phys_addr_t start, u64 size)
+{
+	unsigned long first = start / unaccepted->unit_size;
+	unsigned long last = first + size / unaccepted->unit_size;
+
+	return find_next_zero_bit(unaccepted->bitmap, last, first) >= last;
+}
+
+/*
+ * Widen [@start, @end), relative to phys_base, to the head and tail blocks
+ * of arch_accept_memory_align() if they are entirely unaccepted.  Called with
+ * unaccepted_memory_lock held.
+ */
+static void huge_accept_widen(struct efi_unaccepted_memory *unaccepted,
+			      phys_addr_t *start, phys_addr_t *end)
+{
+	u64 limit = unaccepted->size * unaccepted->unit_size * BITS_PER_BYTE;
+	phys_addr_t base = unaccepted->phys_base;
+	u64 align = arch_accept_memory_align();
+	phys_addr_t s, e;
+
+	if (align <= unaccepted->unit_size)
+		return;
+
+	s = ALIGN_DOWN(base + *start, align);
+	if (s >= base && s - base + align <= limit &&
+	    block_is_unaccepted(unaccepted, s - base, align))
+		*start = s - base;
+
+	e = ALIGN(base + *end, align);
+	if (e >= base + align && e - base <= limit &&
+	    block_is_unaccepted(unaccepted, e - align - base, align))
+		*end = e - base;
+}
+
 /*
  * accept_memory() -- Consult bitmap and accept the memory if needed.
  *
@@ -78,9 +185,17 @@ void accept_memory(phys_addr_t start, phys_addr_t end)
 	if (end > unaccepted->size * unit_size * BITS_PER_BYTE)
 		end = unaccepted->size * unit_size * BITS_PER_BYTE;
 
+	spin_lock_irqsave(&unaccepted_memory_lock, flags);
+	if (READ_ONCE(huge_accept))
+		huge_accept_widen(unaccepted, &start, &end);
 	range_start = start / unit_size;
 
-	spin_lock_irqsave(&unaccepted_memory_lock, flags);
+	/* Wait for a background kthread accepting a part of the range. */
+	while (range_is_inflight(range_start, DIV_ROUND_UP(end, unit_size))) {
+		spin_unlock_irqrestore(&unaccepted_memory_lock, flags);
+		cpu_relax();
+		spin_lock_irqsave(&unaccepted_memory_lock, flags);
+	}
 	for_each_set_bitrange_from(range_start, range_end, unaccepted->bitmap,
 				   DIV_ROUND_UP(end, unit_size)) {
 		unsigned long phys_start, phys_end;
@@ -95,6 +210,20 @@ void accept_memory(phys_addr_t start, phys_addr_t end)
 	spin_unlock_irqrestore(&unaccepted_memory_lock, flags);
 }
 
+/*
+ * Accept memory that isn't described by the unaccepted table, e.g. plugged by
+ * virtio-mem after boot, on the platforms that have unaccepted memory.  The
+ * platform decides, whether or not the firmware left any memory unaccepted
+ * at boot.  May sleep, unlike accept_memory() no lock is held.
+ */
+void accept_hotplug_memory(phys_addr_t start, phys_addr_t end)
+{
+	might_sleep();
+
+	arch_accept_hotplug_memory(start, end);
+}
+EXPORT_SYMBOL_GPL(accept_hotplug_memory);
+
 bool unaccept_memory(phys_addr_t start, phys_addr_t end)
 {
 	struct efi_unaccepted_memory *unaccepted;
@@ -140,6 +269,8 @@ bool unaccept_memory(phys_addr_t start, phys_addr_t end)
 		phys_end = range_end * unit_size + unaccepted->phys_base;
 
 		arch_unaccept_memory(phys_start, phys_end);
+		if (background_bitmap)
+			bitmap_clear(background_bitmap, range_start, len);
 		accepted += len;
 		pr_err("IO TLB: found %lx-%lx accepted\n", phys_start, phys_end);
 		bitmap_set(unaccepted->bitmap, range_start, len);
@@ -218,3 +349,158 @@ bool range_contains_unaccepted_memory(phys_addr_t start, phys_addr_t end)
 
 	return ret;
 }
+
+/*
+ * Find the first run of units in [*pos, end) that are eligible for background
+ * acceptance and publish it as in flight for @nid.  The run doesn't cross a
+ * block of arch_accept_memory_align(), which bounds the time it is accepted
+ * with interrupts disabled.
+ */
+static bool background_claim(struct efi_unaccepted_memory *unaccepted, int nid,
+			     unsigned long *pos, unsigned long end)
+{
+	struct accept_range *r = &background_inflight[nid];
+	u64 block = max_t(u64, arch_accept_memory_align(), unaccepted->unit_size);
+	unsigned long start, stop, flags;
+	bool found = false;
+
+	spin_lock_irqsave(&unaccepted_memory_lock, flags);
+	for (start = *pos; start < end; start++) {
+		if (test_bit(start, unaccepted->bitmap) &&
+		    test_bit(start, background_bitmap)) {
+			found = true;
+			break;
+		}
+	}
+	if (found) {
+		end = min_t(unsigned long, end,
+			    roundup(start + 1, block / unaccepted->unit_size));
+		for (stop = start + 1; stop < end; stop++) {
+			if (!test_bit(stop, unaccepted->bitmap) ||
+			    !test_bit(stop, background_bitmap))
+				break;
+		}
+		r->start = start;
+		r->end = stop;
+		atomic_inc(&background_nr_inflight);
+		*pos = stop;
+	}
+	spin_unlock_irqrestore(&unaccepted_memory_lock, flags);
+
+	return found;
+}
+
+static void background_accept_range(struct efi_unaccepted_memory *unaccepted,
+				    int nid)
+{
+	struct accept_range *r = &background_inflight[nid];
+	u64 unit_size = unaccepted->unit_size;
+	unsigned long flags;
+
+	/*
+	 * accept_memory() waits for the range with interrupts disabled, so
+	 * don't let it run on this CPU meanwhile, from an interrupt or by
+	 * preemption.  Only the lock isn't held, that lets the other CPUs
+	 * accept the other ranges.
+	 */
+	local_irq_save(flags);
+	arch_accept_memory(r->start * unit_size + unaccepted->phys_base,
+			   r->end * unit_size + unaccepted->phys_base);
+	local_irq_restore(flags);
+
+	spin_lock_irqsave(&unaccepted_memory_lock, flags);
+	bitmap_clear(unaccepted->bitmap, r->start, r->end - r->start);
+	bitmap_clear(background_bitmap, r->start, r->end - r->start);
+	background_accepted += (r->end - r->start) * unit_size;
+	WRITE_ONCE(background_accepted_mb, background_accepted >> 20);
+	r->start = r->end = 0;
+	atomic_dec(&background_nr_inflight);
+	spin_unlock_irqrestore(&unaccepted_memory_lock, flags);
+}
+
+static int background_accept_thread(void *data)
+{
+	struct efi_unaccepted_memory *unaccepted = efi_get_unaccepted_table();
+	u64 unit_size = unaccepted->unit_size;
+	int nid = (long)data;
+	unsigned long pos, end, chunk, limit, nbits;
+	phys_addr_t start_pa, end_pa;
+
+	nbits = unaccepted->size * BITS_PER_BYTE;
+	start_pa = max_t(phys_addr_t, PFN_PHYS(node_start_pfn(nid)),
+			 unaccepted->phys_base);
+	end_pa = PFN_PHYS(node_end_pfn(nid));
+	if (end_pa <= start_pa)
+		return 0;
+
+	pos = (start_pa - unaccepted->phys_base) / unit_size;
+	end = min(DIV_ROUND_UP(end_pa - unaccepted->phys_base, unit_size), nbits);
+
+	while (pos < end && !kthread_should_stop()) {
+		chunk = clamp_t(unsigned int, READ_ONCE(background_chunk_mb),
+				1, BACKGROUND_CHUNK_MAX_MB);
+		chunk = max_t(unsigned long, 1, (u64)chunk * SZ_1M / unit_size);
+		/* Stop at a chunk boundary, which keeps 1G chunks 1G aligned. */
+		limit = min(roundup(pos + 1, chunk), end);
+
+		/* Interrupts are enabled and the lock free between the blocks. */
+		while (background_claim(unaccepted, nid, &pos, limit)) {
+			background_accept_range(unaccepted, nid);
+			cond_resched();
+		}
+		pos = limit;
+
+		if (READ_ONCE(background_interval_ms))
+			msleep_interruptible(READ_ONCE(background_interval_ms));
+		else
+			cond_resched();
+	}
+
+	pr_info("Node %d: background acceptance done, %lu MB accepted in total\n",
+		nid, READ_ONCE(background_accepted_mb));
+	return 0;
+}
+
+static int __init background_accept_init(void)
+{
+	struct efi_unaccepted_memory *unaccepted;
+	struct task_struct *t;
+	unsigned long flags, nbits;
+	int nid;
+
+	unaccepted = efi_get_unaccepted_table();
+	if (!background_accept || !unaccepted)
+		return 0;
+
+	nbits = unaccepted->size * BITS_PER_BYTE;
+	background_inflight = kcalloc(nr_node_ids, sizeof(*background_inflight),
+				      GFP_KERNEL);
+	background_bitmap = bitmap_zalloc(nbits, GFP_KERNEL);
+	if (!background_inflight || !background_bitmap) {
+		kfree(background_inflight);
+		bitmap_free(background_bitmap);
+		background_bitmap = NULL;
+		return -ENOMEM;
+	}
+
+	spin_lock_irqsave(&unaccepted_memory_lock, flags);
+	bitmap_copy(background_bitmap, unaccepted->bitmap, nbits);
+	spin_unlock_irqrestore(&unaccepted_memory_lock, flags);
+
+	for_each_node_state(nid, N_MEMORY) {
+		t = kthread_create_on_node(background_accept_thread,
+					   (void *)(long)nid, nid, "kaccept/%d",
+					   nid);
+		if (IS_ERR(t)) {
+			pr_warn("Failed to start background acceptance on node %d\n",
+				nid);
+			continue;
+		}
+		if (!cpumask_empty(cpumask_of_node(nid)))
+			kthread_bind_mask(t, cpumask_of_node(nid));
+		wake_up_process(t);
+	}
+
+	return 0;
+}
+late_initcall(background_accept_init);
@@ -18,6 +18,7 @@
 #include <linux/uio.h>
 #include <linux/interrupt.h>
 #include <linux/set_memory.h>
+#include <linux/sizes.h>
 #include <asm/page.h>
 #include <asm/mshyperv.h>
 
@@ -146,16 +147,94 @@ void vmbus_setevent(struct vmbus_channel *channel)
 }
 EXPORT_SYMBOL_GPL(vmbus_setevent);
 
+/*
+ * In an isolated VM, decrypting a ring buffer for its GPADL when the channel
+ * opens and encrypting it back when it closes costs a hypercall and a TLB
+ * flush on all CPUs each.  The ring buffers are rather decrypted once, and
+ * recycled across channel close and open by NUMA node and size, up to
+ * VMBUS_RING_POOL_PAGES kept.
+ */
+#define VMBUS_RING_POOL_PAGES	(SZ_32M >> PAGE_SHIFT)
+
+static LIST_HEAD(vmbus_ring_pool);
+static unsigned long vmbus_ring_pool_pages;
+static DEFINE_SPINLOCK(vmbus_ring_pool_lock);
+
+static struct page *vmbus_ring_pool_get(int node, int order)
+{
+	struct page *page;
+
+	spin_lock(&vmbus_ring_pool_lock);
+	list_for_each_entry(page, &vmbus_ring_pool, lru) {
+		if (page_private(page) == order &&
+		    (node == NUMA_NO_NODE || page_to_nid(page) == node)) {
+			list_del(&page->lru);
+			vmbus_ring_pool_pages -= 1 << order;
+			spin_unlock(&vmbus_ring_pool_lock);
+
+			set_page_private(page, 0);
+			return page;
+		}
+	}
+	spin_unlock(&vmbus_ring_pool_lock);
+
+	return NULL;
+}
+
+static void vmbus_ring_pool_free(struct page *page, int order)
+{
+	/* It's better to leak the pages if the encryption fails. */
+	if (set_memory_encrypted((unsigned long)page_address(page), 1 << order))
+		pr_warn("Fail to set mem host visibility of ring buffer\n");
+	else
+		__free_pages(page, order);
+}
+
+static void vmbus_ring_pool_put(struct page *page, int order)
+{
+	spin_lock(&vmbus_ring_pool_lock);
+	if (vmbus_ring_pool_pages + (1 << order) <= VMBUS_RING_POOL_PAGES) {
+		set_page_private(page, order);
+		list_add(&page->lru, &vmbus_ring_pool);
+		vmbus_ring_pool_pages += 1 << order;
+		page = NULL;
+	}
+	spin_unlock(&vmbus_ring_pool_lock);
+
+	if (page)
+		vmbus_ring_pool_free(page, order);
+}
+
+/* vmbus_ring_pool_drain - free the pool of ring buffers, on vmbus unload */
+void vmbus_ring_pool_drain(void)
+{
+	struct page *page;
+	int order;
+
+	while ((page = list_first_entry_or_null(&vmbus_ring_pool, struct page,
+						lru))) {
+		order = page_private(page);
+		list_del(&page->lru);
+		vmbus_ring_pool_pages -= 1 << order;
+		set_page_private(page, 0);
+		vmbus_ring_pool_free(page, order);
+	}
+}
+
 /* vmbus_free_ring - drop mapping of ring buffer */
 void vmbus_free_ring(struct vmbus_channel *channel)
 {
+	int order;
+
 	hv_ringbuffer_cleanup(&channel->outbound);
 	hv_ringbuffer_cleanup(&channel->inbound);
 
 	if (channel->ringbuffer_page) {
-		__free_pages(channel->ringbuffer_page,
-			     get_order(channel->ringbuffer_pagecount
-				       << PAGE_SHIFT));
+		order = get_order(channel->ringbuffer_pagecount << PAGE_SHIFT);
+		if (channel->ringbuffer_pooled)
+			vmbus_ring_pool_put(channel->ringbuffer_page, order);
+		else
+			__free_pages(channel->ringbuffer_page, order);
 		channel->ringbuffer_page = NULL;
 	}
 }
@@ -165,7 +244,9 @@ EXPORT_SYMBOL_GPL(vmbus_free_ring);
 int vmbus_alloc_ring(struct vmbus_channel *newchannel,
 		     u32 send_size, u32 recv_size)
 {
-	struct page *page;
+	int node = cpu_to_node(newchannel->target_cpu);
+	bool pooled = hv_is_isolation_supported();
+	struct page *page = NULL;
 	int order;
 
 	if (send_size % PAGE_SIZE || recv_size % PAGE_SIZE)
@@ -173,16 +254,35 @@ int vmbus_alloc_ring(struct vmbus_channel *newchannel,
 
 	/* Allocate the ring buffer */
 	order = get_order(send_size + recv_size);
-	page = alloc_pages_node(cpu_to_node(newchannel->target_cpu),
-				GFP_KERNEL|__GFP_ZERO, order);
+	if (pooled) {
+		page = vmbus_ring_pool_get(node, order);
+		if (page)
+			memset(page_address(page), 0, PAGE_SIZE << order);
+	}
 
-	if (!page)
-		page = alloc_pages(GFP_KERNEL|__GFP_ZERO, order);
+	if (!page) {
+		page = alloc_pages_node(node, GFP_KERNEL|__GFP_ZERO, order);
 
-	if (!page)
-		return -ENOMEM;
+		if (!page)
+			page = alloc_pages(GFP_KERNEL|__GFP_ZERO, order);
+
+		if (!page)
+			return -ENOMEM;
+
+		if (pooled) {
+			if (set_memory_decrypted((unsigned long)page_address(page),
+						 1 << order)) {
+				/* Just leak the pages, it's unsafe to free them. */
+				return -ENOMEM;
+			}
+
+			/* The contents don't survive the decryption. */
+			memset(page_address(page), 0, PAGE_SIZE << order);
+		}
+	}
 
 	newchannel->ringbuffer_page = page;
+	newchannel->ringbuffer_pooled = pooled;
 	newchannel->ringbuffer_pagecount = (send_size + recv_size) >> PAGE_SHIFT;
 	newchannel->ringbuffer_send_offset = send_size >> PAGE_SHIFT;
 
@@ -475,13 +575,17 @@ static int __vmbus_establish_gpadl(struct vmbus_channel *channel,
 	if (ret)
 		return ret;
 
-	ret = set_memory_decrypted((unsigned long)kbuffer,
-				   PFN_UP(size));
-	if (ret) {
-		dev_warn(&channel->device_obj->device,
-			 "Failed to set host visibility for new GPADL %d.\n",
-			 ret);
-		return ret;
+	/* A pooled ring buffer is decrypted already. */
+	gpadl->decrypted = type != HV_GPADL_RING || !channel->ringbuffer_pooled;
+	if (gpadl->decrypted) {
+		ret = set_memory_decrypted((unsigned long)kbuffer,
+					   PFN_UP(size));
+		if (ret) {
+			dev_warn(&channel->device_obj->device,
+				 "Failed to set host visibility for new GPADL %d.\n",
+				 ret);
+			return ret;
+		}
 	}
 
 	init_completion(&msginfo->waitevent);
@@ -563,7 +667,7 @@ static int __vmbus_establish_gpadl(struct vmbus_channel *channel,
 
 	kfree(msginfo);
 
-	if (ret)
+	if (ret && gpadl->decrypted)
 		set_memory_encrypted((unsigned long)kbuffer,
 				     PFN_UP(size));
 
@@ -881,10 +985,12 @@ int vmbus_teardown_gpadl(struct vmbus_channel *channel, struct vmbus_gpadl *gpad
 
 	kfree(info);
 
-	ret = set_memory_encrypted((unsigned long)gpadl->buffer,
-				   PFN_UP(gpadl->size));
-	if (ret)
-		pr_warn("Fail to set mem host visibility in GPADL teardown %d.\n", ret);
+	if (gpadl->decrypted) {
+		ret = set_memory_encrypted((unsigned long)gpadl->buffer,
+					   PFN_UP(gpadl->size));
+		if (ret)
+			pr_warn("Fail to set mem host visibility in GPADL teardown %d.\n", ret);
+	}
 
 	return ret;
 }
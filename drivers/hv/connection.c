@@ -223,20 +223,21 @@ int vmbus_connect(void)
 
 	/*
 	 * Setup the monitor notification facility. The 1st page for
-	 * parent->child and the 2nd page for child->parent
+	 * parent->child and the 2nd page for child->parent.  They are
+	 * contiguous, to be decrypted at once.
 	 */
-	vmbus_connection.monitor_pages[0] = hv_alloc_hyperv_page();
-	vmbus_connection.monitor_pages[1] = hv_alloc_hyperv_page();
-	if ((vmbus_connection.monitor_pages[0] == NULL) ||
-	    (vmbus_connection.monitor_pages[1] == NULL)) {
+	vmbus_connection.monitor_pages[0] = (void *)__get_free_pages(GFP_KERNEL,
+					get_order(HV_MONITOR_PAGES_SIZE));
+	if (vmbus_connection.monitor_pages[0] == NULL) {
 		ret = -ENOMEM;
 		goto cleanup;
 	}
+	vmbus_connection.monitor_pages[1] = (void *)
+		vmbus_connection.monitor_pages[0] + HV_HYP_PAGE_SIZE;
 
 	ret = set_memory_decrypted((unsigned long)
-				vmbus_connection.monitor_pages[0], 1);
-	ret |= set_memory_decrypted((unsigned long)
-				vmbus_connection.monitor_pages[1], 1);
+				vmbus_connection.monitor_pages[0],
+				DIV_ROUND_UP(HV_MONITOR_PAGES_SIZE, PAGE_SIZE));
 	if (ret)
 		goto cleanup;
 
@@ -337,11 +338,12 @@ void vmbus_disconnect(void)
 		vmbus_connection.int_page = NULL;
 	}
 
-	set_memory_encrypted((unsigned long)vmbus_connection.monitor_pages[0], 1);
-	set_memory_encrypted((unsigned long)vmbus_connection.monitor_pages[1], 1);
-
-	hv_free_hyperv_page(vmbus_connection.monitor_pages[0]);
-	hv_free_hyperv_page(vmbus_connection.monitor_pages[1]);
+	if (vmbus_connection.monitor_pages[0]) {
+		set_memory_encrypted((unsigned long)vmbus_connection.monitor_pages[0],
+				     DIV_ROUND_UP(HV_MONITOR_PAGES_SIZE, PAGE_SIZE));
+		free_pages((unsigned long)vmbus_connection.monitor_pages[0],
+			   get_order(HV_MONITOR_PAGES_SIZE));
+	}
 	vmbus_connection.monitor_pages[0] = NULL;
 	vmbus_connection.monitor_pages[1] = NULL;
 }
@@ -143,47 +143,34 @@ int hv_synic_alloc(void)
 		/*
 		 * Synic message and event pages are allocated by paravisor.
 		 * Skip these pages allocation here.
+		 *
+		 * Otherwise the event page follows the message page, so that
+		 * an isolated VM converts both with one call, i.e. one
+		 * hypercall and one TLB flush.
 		 */
 		if (!ms_hyperv.paravisor_present && !hv_root_partition) {
 			hv_cpu->synic_message_page =
-				(void *)get_zeroed_page(GFP_ATOMIC);
+				(void *)__get_free_pages(GFP_ATOMIC | __GFP_ZERO,
+							 HV_SYNIC_PAGES_ORDER);
 			if (hv_cpu->synic_message_page == NULL) {
-				pr_err("Unable to allocate SYNIC message page\n");
+				pr_err("Unable to allocate SYNIC message and event pages\n");
 				goto err;
 			}
 
 			hv_cpu->synic_event_page =
-				(void *)get_zeroed_page(GFP_ATOMIC);
-			if (hv_cpu->synic_event_page == NULL) {
-				pr_err("Unable to allocate SYNIC event page\n");
-
-				free_page((unsigned long)hv_cpu->synic_message_page);
-				hv_cpu->synic_message_page = NULL;
-				goto err;
-			}
+				hv_cpu->synic_message_page + PAGE_SIZE;
 		}
 
 		if (!ms_hyperv.paravisor_present &&
 		    (hv_isolation_type_snp() || hv_isolation_type_tdx())) {
 			ret = set_memory_decrypted((unsigned long)
-				hv_cpu->synic_message_page, 1);
+				hv_cpu->synic_message_page,
+				1 << HV_SYNIC_PAGES_ORDER);
 			if (ret) {
-				pr_err("Failed to decrypt SYNIC msg page: %d\n", ret);
+				pr_err("Failed to decrypt SYNIC msg and event pages: %d\n",
+				       ret);
+				/* Just leak the pages, as it's unsafe to free them. */
 				hv_cpu->synic_message_page = NULL;
-
-				/*
-				 * Free the event page here so that hv_synic_free()
-				 * won't later try to re-encrypt it.
-				 */
-				free_page((unsigned long)hv_cpu->synic_event_page);
-				hv_cpu->synic_event_page = NULL;
-				goto err;
-			}
-
-			ret = set_memory_decrypted((unsigned long)
-				hv_cpu->synic_event_page, 1);
-			if (ret) {
-				pr_err("Failed to decrypt SYNIC event page: %d\n", ret);
 				hv_cpu->synic_event_page = NULL;
 				goto err;
 			}
@@ -228,26 +215,20 @@ void hv_synic_free(void)
 		    (hv_isolation_type_snp() || hv_isolation_type_tdx())) {
 			if (hv_cpu->synic_message_page) {
 				ret = set_memory_encrypted((unsigned long)
-					hv_cpu->synic_message_page, 1);
+					hv_cpu->synic_message_page,
+					1 << HV_SYNIC_PAGES_ORDER);
 				if (ret) {
-					pr_err("Failed to encrypt SYNIC msg page: %d\n", ret);
+					pr_err("Failed to encrypt SYNIC msg and event pages: %d\n",
+					       ret);
 					hv_cpu->synic_message_page = NULL;
 				}
 			}
-
-			if (hv_cpu->synic_event_page) {
-				ret = set_memory_encrypted((unsigned long)
-					hv_cpu->synic_event_page, 1);
-				if (ret) {
-					pr_err("Failed to encrypt SYNIC event page: %d\n", ret);
-					hv_cpu->synic_event_page = NULL;
-				}
-			}
 		}
 
 		free_page((unsigned long)hv_cpu->post_msg_page);
-		free_page((unsigned long)hv_cpu->synic_event_page);
-		free_page((unsigned long)hv_cpu->synic_message_page);
+		/* The event page is allocated with the message page. */
+		free_pages((unsigned long)hv_cpu->synic_message_page,
+			   HV_SYNIC_PAGES_ORDER);
 	}
 
 	kfree(hv_context.hv_numa_map);
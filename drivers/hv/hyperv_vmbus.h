@@ -116,6 +116,9 @@ enum {
 	VMBUS_MESSAGE_SINT		= 2,
 };
 
+/* The synic event page follows the message page, in the same allocation */
+#define HV_SYNIC_PAGES_ORDER		1
+
 /*
  * Per cpu state for channel handling
  */
@@ -245,8 +248,9 @@ struct vmbus_connection {
 
 	/*
 	 * 2 pages - 1st page for parent->child notification and 2nd
-	 * is child->parent notification
+	 * is child->parent notification, allocated together
 	 */
+#define HV_MONITOR_PAGES_SIZE	(2 * HV_HYP_PAGE_SIZE)
 	struct hv_monitor_page *monitor_pages[2];
 	struct list_head chn_msg_list;
 	spinlock_t channelmsg_lock;
@@ -358,6 +362,7 @@ void vmbus_channel_unmap_relid(struct vmbus_channel *channel);
 struct vmbus_channel *relid2channel(u32 relid);
 
 void vmbus_free_channels(void);
+void vmbus_ring_pool_drain(void);
 
 /* Connection interface */
 
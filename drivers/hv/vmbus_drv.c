@@ -2696,6 +2696,7 @@ static void __exit vmbus_exit(void)
 	hv_debug_rm_all_dir();
 
 	vmbus_free_channels();
+	vmbus_ring_pool_drain();
 	kfree(vmbus_connection.channels);
 
 	/*
@@ -32,12 +32,24 @@ module_param(csum, bool, 0444);
 module_param(gso, bool, 0444);
 module_param(napi_tx, bool, 0644);
 
+/* Receive into pages shared with the host in confidential guests, see
+ * virtnet_rq_frag_refill(). The host can read and rewrite the packets until
+ * the stack is done with them, so this is only for workloads not relying on
+ * the confidentiality or integrity of their network traffic.
+ */
+static bool shared_rx;
+module_param(shared_rx, bool, 0444);
+MODULE_PARM_DESC(shared_rx, "Receive directly into host shared pages in confidential guests");
+
 /* FIXME: MTU in config. */
 #define GOOD_PACKET_LEN (ETH_HLEN + VLAN_HLEN + ETH_DATA_LEN)
 #define GOOD_COPY_LEN	128
 
 #define VIRTNET_RX_PAD (NET_IP_ALIGN + NET_SKB_PAD)
 
+/* Shared pages per receive queue, each of 32K as the page frags */
+#define VIRTNET_SHARED_RX_PAGES	64
+
 /* Amount of XDP headroom to prepend to packets for use by xdp_adjust_head */
 #define VIRTIO_XDP_HEADROOM 256
 
@@ -137,7 +149,17 @@ struct virtnet_rq_dma {
 	dma_addr_t addr;
 	u32 ref;
 	u16 len;
-	u16 need_sync;
+	u8 need_sync;
+	/* The pages are shared with the device, there is no mapping */
+	u8 shared;
+};
+
+/* A page frag shared with the device, see virtnet_rq_frag_refill(). */
+struct virtnet_rq_shared_page {
+	struct page *page;
+	dma_addr_t addr;
+	/* The dma info of the page, kept out of reach of the device */
+	struct virtnet_rq_dma dma;
 };
 
 /* Internal representation of a send virtqueue */
@@ -195,10 +217,18 @@ struct receive_queue {
 	struct xdp_rxq_info xdp_rxq;
 
 	/* Record the last dma info to free after new pages is allocated. */
-	struct virtnet_rq_dma *last_dma;
+	void *last_dma;
 
 	/* Do dma by self */
 	bool do_dma;
+
+	/* Pool of shared page frags, NULL if not receiving into shared pages */
+	struct virtnet_rq_shared_page *shared_pages;
+	unsigned int nr_shared_pages;
+	unsigned int shared_next;
+
+	/* The shared page in alloc_frag, NULL if it is a private one */
+	struct virtnet_rq_shared_page *shared_cur;
 };
 
 /* This structure can contain rss message with maximum settings for indirection table and keysize
@@ -524,8 +554,11 @@ static struct sk_buff *page_to_skb(struct virtnet_info *vi,
 
 	shinfo_size = SKB_DATA_ALIGN(sizeof(struct skb_shared_info));
 
-	/* copy small packet so we can reuse these pages */
-	if (!NET_IP_ALIGN && len > GOOD_COPY_LEN && tailroom >= shinfo_size) {
+	/* copy small packet so we can reuse these pages, never build the skb
+	 * in a shared page: the device could rewrite its skb_shared_info.
+	 */
+	if (!NET_IP_ALIGN && len > GOOD_COPY_LEN && tailroom >= shinfo_size &&
+	    !virtnet_rq_page_shared(rq, page)) {
 		skb = virtnet_build_skb(buf, truesize, p - buf, len);
 		if (unlikely(!skb))
 			return NULL;
@@ -594,6 +627,30 @@ static struct sk_buff *page_to_skb(struct virtnet_info *vi,
 	return skb;
 }
 
+/*
+ * The dma info of @page. Shared pages point to their pool entry in the page's
+ * private field and keep it there, as the device can rewrite the head of the
+ * page at any time. Pages of premapped queues have no other use for it.
+ */
+static struct virtnet_rq_dma *virtnet_rq_page_dma(struct receive_queue *rq,
+						  struct page *page)
+{
+	struct virtnet_rq_shared_page *sp;
+
+	if (rq->shared_pages) {
+		sp = (struct virtnet_rq_shared_page *)page_private(page);
+		if (sp)
+			return &sp->dma;
+	}
+
+	return page_address(page);
+}
+
+static bool virtnet_rq_page_shared(struct receive_queue *rq, struct page *page)
+{
+	return rq->shared_pages && page_private(page);
+}
+
 static void virtnet_rq_unmap(struct receive_queue *rq, void *buf, u32 len)
 {
 	struct page *page = virt_to_head_page(buf);
@@ -603,7 +660,7 @@ static void virtnet_rq_unmap(struct receive_queue *rq, void *buf, u32 len)
 
 	head = page_address(page);
 
-	dma = head;
+	dma = virtnet_rq_page_dma(rq, page);
 
 	--dma->ref;
 
@@ -618,8 +675,10 @@ static void virtnet_rq_unmap(struct receive_queue *rq, void *buf, u32 len)
 		return;
 	}
 
-	virtqueue_dma_unmap_single_attrs(rq->vq, dma->addr, dma->len,
-					 DMA_FROM_DEVICE, DMA_ATTR_SKIP_CPU_SYNC);
+	if (!dma->shared)
+		virtqueue_dma_unmap_single_attrs(rq->vq, dma->addr, dma->len,
+						 DMA_FROM_DEVICE,
+						 DMA_ATTR_SKIP_CPU_SYNC);
 	put_page(page);
 }
 
@@ -657,11 +716,11 @@ static void virtnet_rq_init_one_sg(struct receive_queue *rq, void *buf, u32 len)
 		return;
 	}
 
-	head = page_address(rq->alloc_frag.page);
+	head = page_address(virt_to_head_page(buf));
 
 	offset = buf - head;
 
-	dma = head;
+	dma = virtnet_rq_page_dma(rq, virt_to_head_page(buf));
 
 	addr = dma->addr - sizeof(*dma) + offset;
 
@@ -670,6 +729,52 @@ static void virtnet_rq_init_one_sg(struct receive_queue *rq, void *buf, u32 len)
 	rq->sg[0].length = len;
 }
 
+/*
+ * In a confidential guest, premapped buffers in private pages are bounced by
+ * the DMA API, costing a copy of every packet received. With shared_rx, the
+ * page frags are taken from a per-queue pool of pages shared with the device
+ * which the network stack is given directly. The pool keeps a reference to
+ * each page, so a page is free to be reused once that's the only one left and
+ * never goes back to the page allocator while shared. Fall back to private
+ * pages if all shared pages are still in use.
+ */
+static bool virtnet_rq_frag_refill(struct receive_queue *rq, u32 size, gfp_t gfp)
+{
+	struct page_frag *alloc_frag = &rq->alloc_frag;
+	struct virtnet_rq_shared_page *sp;
+	unsigned int i;
+
+	if (!rq->shared_pages)
+		return skb_page_frag_refill(size, alloc_frag, gfp);
+
+	if (alloc_frag->page) {
+		if (alloc_frag->offset + size <= alloc_frag->size)
+			return true;
+
+		put_page(alloc_frag->page);
+		alloc_frag->page = NULL;
+	}
+
+	for (i = 0; i < rq->nr_shared_pages; i++) {
+		sp = &rq->shared_pages[rq->shared_next];
+		if (++rq->shared_next == rq->nr_shared_pages)
+			rq->shared_next = 0;
+
+		if (page_ref_count(sp->page) != 1)
+			continue;
+
+		get_page(sp->page);
+		alloc_frag->page = sp->page;
+		alloc_frag->offset = 0;
+		alloc_frag->size = PAGE_SIZE << SKB_FRAG_PAGE_ORDER;
+		rq->shared_cur = sp;
+		return true;
+	}
+
+	rq->shared_cur = NULL;
+	return skb_page_frag_refill(size, alloc_frag, gfp);
+}
+
 static void *virtnet_rq_alloc(struct receive_queue *rq, u32 size, gfp_t gfp)
 {
 	struct page_frag *alloc_frag = &rq->alloc_frag;
@@ -677,13 +782,13 @@ static void *virtnet_rq_alloc(struct receive_queue *rq, u32 size, gfp_t gfp)
 	void *buf, *head;
 	dma_addr_t addr;
 
-	if (unlikely(!skb_page_frag_refill(size, alloc_frag, gfp)))
+	if (unlikely(!virtnet_rq_frag_refill(rq, size, gfp)))
 		return NULL;
 
 	head = page_address(alloc_frag->page);
 
 	if (rq->do_dma) {
-		dma = head;
+		dma = virtnet_rq_page_dma(rq, alloc_frag->page);
 
 		/* new pages */
 		if (!alloc_frag->offset) {
@@ -698,13 +803,20 @@ static void *virtnet_rq_alloc(struct receive_queue *rq, u32 size, gfp_t gfp)
 
 			dma->len = alloc_frag->size - sizeof(*dma);
 
-			addr = virtqueue_dma_map_single_attrs(rq->vq, dma + 1,
-							      dma->len, DMA_FROM_DEVICE, 0);
-			if (virtqueue_dma_mapping_error(rq->vq, addr))
-				return NULL;
-
-			dma->addr = addr;
-			dma->need_sync = virtqueue_dma_need_sync(rq->vq, addr);
+			if (rq->shared_cur) {
+				dma->addr = rq->shared_cur->addr + sizeof(*dma);
+				dma->need_sync = false;
+				dma->shared = true;
+			} else {
+				addr = virtqueue_dma_map_single_attrs(rq->vq, dma + 1,
+								      dma->len, DMA_FROM_DEVICE, 0);
+				if (virtqueue_dma_mapping_error(rq->vq, addr))
+					return NULL;
+
+				dma->addr = addr;
+				dma->need_sync = virtqueue_dma_need_sync(rq->vq, addr);
+				dma->shared = false;
+			}
 
 			/* Add a reference to dma to prevent the entire dma from
 			 * being released during error handling. This reference
@@ -714,7 +826,8 @@ static void *virtnet_rq_alloc(struct receive_queue *rq, u32 size, gfp_t gfp)
 			dma->ref = 1;
 			alloc_frag->offset = sizeof(*dma);
 
-			rq->last_dma = dma;
+			/* The head of the pages, see virtnet_rq_page_dma() */
+			rq->last_dma = head;
 		}
 
 		++dma->ref;
@@ -728,6 +841,61 @@ static void *virtnet_rq_alloc(struct receive_queue *rq, u32 size, gfp_t gfp)
 	return buf;
 }
 
+static void virtnet_rq_alloc_shared_pages(struct receive_queue *rq)
+{
+	struct virtnet_rq_shared_page *sp;
+	unsigned int i;
+
+	rq->shared_pages = kcalloc(VIRTNET_SHARED_RX_PAGES,
+				   sizeof(*rq->shared_pages), GFP_KERNEL);
+	if (!rq->shared_pages)
+		return;
+
+	for (i = 0; i < VIRTNET_SHARED_RX_PAGES; i++) {
+		sp = &rq->shared_pages[i];
+		sp->page = virtqueue_dma_alloc_shared_pages(rq->vq,
+							    SKB_FRAG_PAGE_ORDER,
+							    &sp->addr,
+							    GFP_KERNEL);
+		if (!sp->page)
+			break;
+
+		set_page_private(sp->page, (unsigned long)sp);
+	}
+
+	rq->nr_shared_pages = i;
+	rq->shared_next = 0;
+	rq->shared_cur = NULL;
+	if (!i) {
+		kfree(rq->shared_pages);
+		rq->shared_pages = NULL;
+	}
+}
+
+/* Called with the device reset and alloc_frag released. */
+static void virtnet_rq_free_shared_pages(struct receive_queue *rq)
+{
+	struct virtnet_rq_shared_page *sp;
+	unsigned int i;
+
+	if (!rq->shared_pages)
+		return;
+
+	for (i = 0; i < rq->nr_shared_pages; i++) {
+		sp = &rq->shared_pages[i];
+		set_page_private(sp->page, 0);
+		/* Leak the pages the stack still has, they must stay shared. */
+		if (page_ref_count(sp->page) == 1)
+			virtqueue_dma_free_shared_pages(rq->vq, sp->page,
+							SKB_FRAG_PAGE_ORDER);
+	}
+
+	kfree(rq->shared_pages);
+	rq->shared_pages = NULL;
+	rq->nr_shared_pages = 0;
+	rq->shared_cur = NULL;
+}
+
 static void virtnet_rq_set_premapped(struct virtnet_info *vi)
 {
 	int i;
@@ -741,6 +909,9 @@ static void virtnet_rq_set_premapped(struct virtnet_info *vi)
 			continue;
 
 		vi->rq[i].do_dma = true;
+
+		if (shared_rx)
+			virtnet_rq_alloc_shared_pages(&vi->rq[i]);
 	}
 }
 
@@ -1155,6 +1326,27 @@ static struct sk_buff *receive_small_build_skb(struct virtnet_info *vi,
 	return skb;
 }
 
+/* Copy a small packet out of a shared page, see page_to_skb(). */
+static struct sk_buff *receive_small_copy(struct virtnet_info *vi,
+					  struct receive_queue *rq,
+					  unsigned int xdp_headroom,
+					  void *buf,
+					  unsigned int len)
+{
+	struct sk_buff *skb;
+
+	skb = napi_alloc_skb(&rq->napi, len);
+	if (unlikely(!skb))
+		return NULL;
+
+	buf += VIRTNET_RX_PAD + xdp_headroom;
+	memcpy(skb_vnet_common_hdr(skb), buf, vi->hdr_len);
+	skb_put_data(skb, buf + vi->hdr_len, len);
+	put_page(virt_to_head_page(buf));
+
+	return skb;
+}
+
 static struct sk_buff *receive_small_xdp(struct net_device *dev,
 					 struct virtnet_info *vi,
 					 struct receive_queue *rq,
@@ -1279,7 +1471,10 @@ static struct sk_buff *receive_small(struct net_device *dev,
 		rcu_read_unlock();
 	}
 
-	skb = receive_small_build_skb(vi, xdp_headroom, buf, len);
+	if (virtnet_rq_page_shared(rq, page))
+		skb = receive_small_copy(vi, rq, xdp_headroom, buf, len);
+	else
+		skb = receive_small_build_skb(vi, xdp_headroom, buf, len);
 	if (likely(skb))
 		return skb;
 
@@ -1618,6 +1813,7 @@ static struct sk_buff *receive_mergeable(struct net_device *dev,
 {
 	struct virtio_net_hdr_mrg_rxbuf *hdr = buf;
 	int num_buf = virtio16_to_cpu(vi->vdev, hdr->num_buffers);
+	int nr_bufs = num_buf;
 	struct page *page = virt_to_head_page(buf);
 	int offset = buf - page_address(page);
 	struct sk_buff *head_skb, *curr_skb;
@@ -1661,9 +1857,7 @@ static struct sk_buff *receive_mergeable(struct net_device *dev,
 		buf = virtnet_rq_get_buf(rq, &len, &ctx);
 		if (unlikely(!buf)) {
 			pr_debug("%s: rx error: %d buffers out of %d missing\n",
-				 dev->name, num_buf,
-				 virtio16_to_cpu(vi->vdev,
-						 hdr->num_buffers));
+				 dev->name, num_buf, nr_bufs);
 			dev->stats.rx_length_errors++;
 			goto err_buf;
 		}
@@ -3707,6 +3901,14 @@ static int virtnet_xdp_set(struct net_device *dev, struct bpf_prog *prog,
 		return -EINVAL;
 	}
 
+	/* XDP frames keep their metadata in the buffer, which mustn't be
+	 * shared with the device.
+	 */
+	if (prog && shared_rx && vi->rq[0].do_dma) {
+		NL_SET_ERR_MSG_MOD(extack, "XDP is not supported with shared_rx");
+		return -EOPNOTSUPP;
+	}
+
 	if (prog && !prog->aux->xdp_has_frags && dev->mtu > max_sz) {
 		NL_SET_ERR_MSG_MOD(extack, "MTU too large to enable XDP without frags");
 		netdev_warn(dev, "single-buffer XDP requires MTU less than %u\n", max_sz);
@@ -3979,12 +4181,15 @@ static void free_receive_bufs(struct virtnet_info *vi)
 static void free_receive_page_frags(struct virtnet_info *vi)
 {
 	int i;
-	for (i = 0; i < vi->max_queue_pairs; i++)
+	for (i = 0; i < vi->max_queue_pairs; i++) {
 		if (vi->rq[i].alloc_frag.page) {
 			if (vi->rq[i].do_dma && vi->rq[i].last_dma)
 				virtnet_rq_unmap(&vi->rq[i], vi->rq[i].last_dma, 0);
 			put_page(vi->rq[i].alloc_frag.page);
+			vi->rq[i].alloc_frag.page = NULL;
 		}
+		virtnet_rq_free_shared_pages(&vi->rq[i]);
+	}
 }
 
 static void virtnet_sq_free_unused_buf(struct virtqueue *vq, void *buf)
@@ -338,6 +338,36 @@ static struct vfio_pfn *vfio_find_vpfn(struct vfio_dma *dma, dma_addr_t iova)
 	return NULL;
 }
 
+/* Count the externally pinned pages in [iova, iova + npage * PAGE_SIZE). */
+static long vpfn_pages(struct vfio_dma *dma, dma_addr_t iova, long npage)
+{
+	dma_addr_t end = iova + npage * PAGE_SIZE;
+	struct rb_node *node = dma->pfn_list.rb_node, *first = NULL;
+	struct vfio_pfn *vpfn;
+	long ret = 0;
+
+	/* Find the first vpfn at or above @iova, then walk up to @end. */
+	while (node) {
+		vpfn = rb_entry(node, struct vfio_pfn, node);
+
+		if (iova <= vpfn->iova) {
+			first = node;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+
+	for (node = first; node; node = rb_next(node)) {
+		vpfn = rb_entry(node, struct vfio_pfn, node);
+		if (vpfn->iova >= end)
+			break;
+		ret++;
+	}
+
+	return ret;
+}
+
 static void vfio_link_pfn(struct vfio_dma *dma,
 			  struct vfio_pfn *new)
 {
@@ -726,14 +756,27 @@ static long vfio_unpin_pages_remote(struct vfio_dma *dma, dma_addr_t iova,
 				    bool do_accounting)
 {
 	long unlocked = 0, locked = 0;
-	long i;
+	long i, run;
 
-	for (i = 0; i < npage; i++, iova += PAGE_SIZE) {
-		if (put_pfn(pfn++, dma->prot)) {
-			unlocked++;
-			if (vfio_find_vpfn(dma, iova))
-				locked++;
+	/*
+	 * The pfns are contiguous.  Unpin each run of non-reserved ones at
+	 * once, which takes one reference drop per folio rather than per page,
+	 * and count its externally pinned pages in one walk of pfn_list.
+	 */
+	for (i = 0; i < npage; i += run) {
+		if (is_invalid_reserved_pfn(pfn + i)) {
+			run = 1;
+			continue;
 		}
+
+		for (run = 1; i + run < npage; run++)
+			if (is_invalid_reserved_pfn(pfn + i + run))
+				break;
+
+		unpin_user_page_range_dirty_lock(pfn_to_page(pfn + i), run,
+						 dma->prot & IOMMU_WRITE);
+		unlocked += run;
+		locked += vpfn_pages(dma, iova + i * PAGE_SIZE, run);
 	}
 
 	if (do_accounting)
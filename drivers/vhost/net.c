@@ -40,6 +40,11 @@ module_param(experimental_zcopytx, int, 0444);
 MODULE_PARM_DESC(experimental_zcopytx, "Enable Zero Copy TX;"
 		                       " 1 -Enable; 0 - Disable");
 
+static bool busyloop_adaptive;
+module_param(busyloop_adaptive, bool, 0644);
+MODULE_PARM_DESC(busyloop_adaptive, "Adapt the busy polling time to how long "
+		 "polling takes to find work, up to the vring busyloop timeout");
+
 /* Max number of bytes transferred before requeueing the job.
  * Using this limit prevents one virtqueue from starving others. */
 #define VHOST_NET_WEIGHT 0x80000
@@ -127,6 +132,8 @@ struct vhost_net_virtqueue {
 	struct vhost_net_buf rxq;
 	/* Batched XDP buffs */
 	struct xdp_buff *xdp;
+	/* Current busy polling time with busyloop_adaptive, 0 if not set */
+	unsigned long busyloop_budget;
 };
 
 struct vhost_net {
@@ -312,6 +319,7 @@ static void vhost_net_vq_reset(struct vhost_net *n)
 		n->vqs[i].ubufs = NULL;
 		n->vqs[i].vhost_hlen = 0;
 		n->vqs[i].sock_hlen = 0;
+		n->vqs[i].busyloop_budget = 0;
 		vhost_net_buf_init(&n->vqs[i].rxq);
 	}
 
@@ -518,16 +526,55 @@ static void vhost_net_busy_poll_try_queue(struct vhost_net *net,
 	}
 }
 
+/* Floor of the adaptive busy polling time, in busy_clock() units */
+#define VHOST_NET_BUSYLOOP_MIN 8
+
+/*
+ * The busy polling time to use, up to @timeout.  With busyloop_adaptive, it
+ * doubles each time polling finds work and halves each time it times out, as
+ * halt polling does, so that vqs with a steady stream of work keep polling
+ * with guest notifications disabled.  That matters most for guests whose
+ * kicks are expensive, e.g. TDX guests whose MMIO kicks take a TDVMCALL.
+ */
+static unsigned long vhost_net_busy_poll_budget(struct vhost_net_virtqueue *nvq,
+						unsigned long timeout)
+{
+	if (!READ_ONCE(busyloop_adaptive))
+		return timeout;
+
+	if (!nvq->busyloop_budget || nvq->busyloop_budget > timeout)
+		nvq->busyloop_budget = timeout;
+
+	return nvq->busyloop_budget;
+}
+
+static void vhost_net_busy_poll_adjust(struct vhost_net_virtqueue *nvq,
+				       unsigned long timeout, bool found)
+{
+	if (!READ_ONCE(busyloop_adaptive))
+		return;
+
+	if (found)
+		nvq->busyloop_budget = min(nvq->busyloop_budget * 2, timeout);
+	else
+		nvq->busyloop_budget = max_t(unsigned long,
+					     nvq->busyloop_budget / 2,
+					     min_t(unsigned long, timeout,
+						   VHOST_NET_BUSYLOOP_MIN));
+}
+
 static void vhost_net_busy_poll(struct vhost_net *net,
 				struct vhost_virtqueue *rvq,
 				struct vhost_virtqueue *tvq,
 				bool *busyloop_intr,
 				bool poll_rx)
 {
+	struct vhost_net_virtqueue *nvq;
 	unsigned long busyloop_timeout;
 	unsigned long endtime;
 	struct socket *sock;
 	struct vhost_virtqueue *vq = poll_rx ? tvq : rvq;
+	bool found = false;
 
 	/* Try to hold the vq mutex of the paired virtqueue. We can't
 	 * use mutex_lock() here since we could not guarantee a
@@ -541,24 +588,33 @@ static void vhost_net_busy_poll(struct vhost_net *net,
 
 	busyloop_timeout = poll_rx ? rvq->busyloop_timeout:
 				     tvq->busyloop_timeout;
+	nvq = container_of(poll_rx ? rvq : tvq, struct vhost_net_virtqueue, vq);
 
 	preempt_disable();
-	endtime = busy_clock() + busyloop_timeout;
+	endtime = busy_clock() + vhost_net_busy_poll_budget(nvq,
+							    busyloop_timeout);
 
 	while (vhost_can_busy_poll(endtime)) {
 		if (vhost_vq_has_work(vq)) {
 			*busyloop_intr = true;
+			found = true;
 			break;
 		}
 
 		if ((sock_has_rx_data(sock) &&
 		     !vhost_vq_avail_empty(&net->dev, rvq)) ||
-		    !vhost_vq_avail_empty(&net->dev, tvq))
+		    !vhost_vq_avail_empty(&net->dev, tvq)) {
+			found = true;
 			break;
+		}
 
 		cpu_relax();
 	}
 
+	/* Only a timeout says the budget was too long, not a reschedule */
+	if (found || time_after(busy_clock(), endtime))
+		vhost_net_busy_poll_adjust(nvq, busyloop_timeout, found);
+
 	preempt_enable();
 
 	if (poll_rx || sock_has_rx_data(sock))
@@ -1340,6 +1396,7 @@ static int vhost_net_open(struct inode *inode, struct file *f)
 		n->vqs[i].vhost_hlen = 0;
 		n->vqs[i].sock_hlen = 0;
 		n->vqs[i].rx_ring = NULL;
+		n->vqs[i].busyloop_budget = 0;
 		vhost_net_buf_init(&n->vqs[i].rxq);
 	}
 	vhost_dev_init(dev, vqs, VHOST_NET_VQ_MAX,
@@ -338,6 +338,7 @@ static void __vhost_vq_meta_reset(struct vhost_virtqueue *vq)
 
 	for (j = 0; j < VHOST_NUM_ADDRS; j++)
 		vq->meta_iotlb[j] = NULL;
+	vq->xlat_map = NULL;
 }
 
 static void vhost_vq_meta_reset(struct vhost_dev *d)
@@ -1765,6 +1766,7 @@ static long vhost_set_memory(struct vhost_dev *d, struct vhost_memory __user *m)
 	for (i = 0; i < d->nvqs; ++i) {
 		mutex_lock(&d->vqs[i]->mutex);
 		d->vqs[i]->umem = newumem;
+		d->vqs[i]->xlat_map = NULL;
 		mutex_unlock(&d->vqs[i]->mutex);
 	}
 
@@ -2348,15 +2350,26 @@ static int translate_desc(struct vhost_virtqueue *vq, u64 addr, u32 len,
 			break;
 		}
 
-		map = vhost_iotlb_itree_first(umem, addr, last);
-		if (map == NULL || map->start > addr) {
-			if (umem != dev->iotlb) {
-				ret = -EFAULT;
+		/*
+		 * Buffers mostly come from a few long-lived regions, e.g. the
+		 * memory a TD guest converted to shared once for its bounce
+		 * buffers, so try the map of the previous translation first.
+		 */
+		map = vq->xlat_map;
+		if (!map || map->start > addr || addr > map->last) {
+			map = vhost_iotlb_itree_first(umem, addr, last);
+			if (map == NULL || map->start > addr) {
+				if (umem != dev->iotlb) {
+					ret = -EFAULT;
+					break;
+				}
+				ret = -EAGAIN;
 				break;
 			}
-			ret = -EAGAIN;
-			break;
-		} else if (!(map->perm & access)) {
+			vq->xlat_map = map;
+		}
+
+		if (!(map->perm & access)) {
 			ret = -EPERM;
 			break;
 		}
@@ -87,6 +87,8 @@ struct vhost_virtqueue {
 	vring_avail_t __user *avail;
 	vring_used_t __user *used;
 	const struct vhost_iotlb_map *meta_iotlb[VHOST_NUM_ADDRS];
+	/* Map of the last translate_desc(), reset with meta_iotlb. */
+	const struct vhost_iotlb_map *xlat_map;
 	struct file *kick;
 	struct vhost_vring_call call_ctx;
 	struct eventfd_ctx *error_ctx;
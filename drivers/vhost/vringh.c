@@ -34,8 +34,13 @@ static __printf(1,2) __cold void vringh_bad(const char *fmt, ...)
 	}
 }
 
-/* Returns vring->num if empty, -ve on error. */
-static inline int __vringh_get_head(const struct vringh *vrh,
+/*
+ * Returns vring->num if empty, -ve on error.
+ *
+ * The avail index is only read again once the entries seen at the last read
+ * are consumed, i.e. once per burst, unless the caller moved last_avail_idx.
+ */
+static inline int __vringh_get_head(struct vringh *vrh,
 				    int (*getu16)(const struct vringh *vrh,
 						  u16 *val, const __virtio16 *p),
 				    u16 *last_avail_idx)
@@ -43,18 +48,29 @@ static inline int __vringh_get_head(const struct vringh *vrh,
 	u16 avail_idx, i, head;
 	int err;
 
-	err = getu16(vrh, &avail_idx, &vrh->vring.avail->idx);
-	if (err) {
-		vringh_bad("Failed to access avail idx at %p",
-			   &vrh->vring.avail->idx);
-		return err;
-	}
+	if (*last_avail_idx != vrh->avail_idx_next ||
+	    *last_avail_idx == vrh->avail_idx_shadow) {
+		err = getu16(vrh, &avail_idx, &vrh->vring.avail->idx);
+		if (err) {
+			vringh_bad("Failed to access avail idx at %p",
+				   &vrh->vring.avail->idx);
+			return err;
+		}
 
-	if (*last_avail_idx == avail_idx)
-		return vrh->vring.num;
+		if ((u16)(avail_idx - *last_avail_idx) > vrh->vring.num) {
+			vringh_bad("Guest moved avail index from %u to %u",
+				   *last_avail_idx, avail_idx);
+			return -EINVAL;
+		}
+
+		vrh->avail_idx_shadow = avail_idx;
+		vrh->avail_idx_next = *last_avail_idx;
+		if (*last_avail_idx == avail_idx)
+			return vrh->vring.num;
 
-	/* Only get avail ring entries after they have been exposed by guest. */
-	virtio_rmb(vrh->weak_barriers);
+		/* Only get avail ring entries after they have been exposed by guest. */
+		virtio_rmb(vrh->weak_barriers);
+	}
 
 	i = *last_avail_idx & (vrh->vring.num - 1);
 
@@ -71,7 +87,7 @@ static inline int __vringh_get_head(const struct vringh *vrh,
 		return -EINVAL;
 	}
 
-	(*last_avail_idx)++;
+	vrh->avail_idx_next = ++(*last_avail_idx);
 	return head;
 }
 
@@ -660,6 +676,8 @@ int vringh_init_user(struct vringh *vrh, u64 features,
 	vrh->weak_barriers = weak_barriers;
 	vrh->completed = 0;
 	vrh->last_avail_idx = 0;
+	vrh->avail_idx_shadow = 0;
+	vrh->avail_idx_next = 0;
 	vrh->last_used_idx = 0;
 	vrh->vring.num = num;
 	/* vring expects kernel addresses, but only used via accessors. */
@@ -934,6 +952,8 @@ int vringh_init_kern(struct vringh *vrh, u64 features,
 	vrh->weak_barriers = weak_barriers;
 	vrh->completed = 0;
 	vrh->last_avail_idx = 0;
+	vrh->avail_idx_shadow = 0;
+	vrh->avail_idx_next = 0;
 	vrh->last_used_idx = 0;
 	vrh->vring.num = num;
 	vrh->vring.desc = desc;
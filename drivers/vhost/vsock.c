@@ -28,6 +28,8 @@
  * small pkts.
  */
 #define VHOST_VSOCK_PKT_WEIGHT 256
+/* Max number of used buffers returned to the guest at once. */
+#define VHOST_VSOCK_BATCH 64
 
 enum {
 	VHOST_VSOCK_FEATURES = VHOST_FEATURES |
@@ -86,12 +88,29 @@ static struct vhost_vsock *vhost_vsock_get(u32 guest_cid)
 	return NULL;
 }
 
+static void vhost_vsock_flush_used(struct vhost_virtqueue *vq, int *nheads)
+{
+	if (*nheads)
+		vhost_add_used_n(vq, vq->heads, *nheads);
+	*nheads = 0;
+}
+
+/* Queue a used buffer in vq->heads, they are added to the used ring by batch. */
+static void vhost_vsock_add_used(struct vhost_virtqueue *vq, int *nheads,
+				 unsigned int head, int len)
+{
+	vq->heads[*nheads].id = cpu_to_vhost32(vq, head);
+	vq->heads[*nheads].len = cpu_to_vhost32(vq, len);
+	if (++*nheads == VHOST_VSOCK_BATCH)
+		vhost_vsock_flush_used(vq, nheads);
+}
+
 static void
 vhost_transport_do_send_pkt(struct vhost_vsock *vsock,
 			    struct vhost_virtqueue *vq)
 {
 	struct vhost_virtqueue *tx_vq = &vsock->vqs[VSOCK_VQ_TX];
-	int pkts = 0, total_len = 0;
+	int pkts = 0, total_len = 0, nheads = 0;
 	bool added = false;
 	bool restart_tx = false;
 
@@ -209,7 +228,7 @@ vhost_transport_do_send_pkt(struct vhost_vsock *vsock,
 		 */
 		virtio_transport_deliver_tap_pkt(skb);
 
-		vhost_add_used(vq, head, sizeof(*hdr) + payload_len);
+		vhost_vsock_add_used(vq, &nheads, head, sizeof(*hdr) + payload_len);
 		added = true;
 
 		skb_pull(skb, payload_len);
@@ -243,6 +262,7 @@ vhost_transport_do_send_pkt(struct vhost_vsock *vsock,
 			consume_skb(skb);
 		}
 	} while(likely(!vhost_exceeds_weight(vq, ++pkts, total_len)));
+	vhost_vsock_flush_used(vq, &nheads);
 	if (added)
 		vhost_signal(&vsock->dev, vq);
 
@@ -467,7 +487,7 @@ static void vhost_vsock_handle_tx_kick(struct vhost_work *work)
 						  poll.work);
 	struct vhost_vsock *vsock = container_of(vq->dev, struct vhost_vsock,
 						 dev);
-	int head, pkts = 0, total_len = 0;
+	int head, pkts = 0, total_len = 0, nheads = 0;
 	unsigned int out, in;
 	struct sk_buff *skb;
 	bool added = false;
@@ -526,11 +546,12 @@ static void vhost_vsock_handle_tx_kick(struct vhost_work *work)
 		else
 			kfree_skb(skb);
 
-		vhost_add_used(vq, head, 0);
+		vhost_vsock_add_used(vq, &nheads, head, 0);
 		added = true;
 	} while(likely(!vhost_exceeds_weight(vq, ++pkts, total_len)));
 
 no_more_replies:
+	vhost_vsock_flush_used(vq, &nheads);
 	if (added)
 		vhost_signal(&vsock->dev, vq);
 
@@ -858,6 +879,14 @@ static long vhost_vsock_dev_ioctl(struct file *f, unsigned int ioctl,
 			return -EOPNOTSUPP;
 		vhost_set_backend_features(&vsock->dev, features);
 		return 0;
+	case VHOST_NEW_WORKER:
+	case VHOST_FREE_WORKER:
+	case VHOST_ATTACH_VRING_WORKER:
+	case VHOST_GET_VRING_WORKER:
+		mutex_lock(&vsock->dev.mutex);
+		r = vhost_worker_ioctl(&vsock->dev, ioctl, argp);
+		mutex_unlock(&vsock->dev.mutex);
+		return r;
 	default:
 		mutex_lock(&vsock->dev.mutex);
 		r = vhost_dev_ioctl(&vsock->dev, ioctl, argp);
@@ -13,10 +13,13 @@
 #include <linux/string.h>
 #include <linux/uaccess.h>
 #include <linux/platform_device.h>
+#include <linux/poll.h>
+#include <linux/sizes.h>
 #include <linux/interrupt.h>
 #include <linux/irq.h>
 #include <linux/acpi.h>
 #include <linux/dma-mapping.h>
+#include <crypto/hash.h>
 #include <crypto/sha2.h>
 #include <linux/tpm.h>
 
@@ -68,6 +71,21 @@ struct spec_id_event {
 	struct spec_id_head sid_head;
 } __packed;
 
+/* Maximum number of TDX_CMD_SUBMIT_QUOTE requests in flight per file */
+#define QUOTE_ASYNC_MAX		64
+
+/* Per open file state of asynchronous GetQuote requests */
+struct tdx_guest_ctx {
+	/* Lock to protect entries, nr_entries and next_id */
+	spinlock_t lock;
+	/* Submitted, not yet collected requests */
+	struct list_head entries;
+	unsigned int nr_entries;
+	u64 next_id;
+	/* Woken up, under quote_lock, as requests complete */
+	wait_queue_head_t wq;
+};
+
 /* List entry of quote_list */
 struct quote_entry {
 	/* Flag to check validity of the GetQuote request */
@@ -78,9 +96,18 @@ struct quote_entry {
 	size_t buf_len;
 	/* DMA handle for buf memory allocation */
 	dma_addr_t handle;
+	/* buf belongs to quote_pool and is returned there when freed */
+	bool pooled;
 	/* Completion object to track completion of GetQuote request */
 	struct completion compl;
 	struct list_head list;
+	/* Owner of an asynchronous request, NULL for TDX_CMD_GET_QUOTE */
+	struct tdx_guest_ctx *ctx;
+	struct list_head ctx_list;
+	u64 id;
+	/* User buffer the Quote is copied to */
+	u64 ubuf;
+	u64 ulen;
 };
 
 /*
@@ -92,6 +119,12 @@ static LIST_HEAD(quote_list);
 /* Lock to protect quote_list */
 static DEFINE_MUTEX(quote_lock);
 
+/*
+ * GetQuote requests submitted and not deleted yet.  The notification IRQ is
+ * shared with the other TDX services, don't kick quote_work for theirs.
+ */
+static atomic_t nr_quote_requests;
+
 /*
  * Workqueue to handle Quote data after Quote generation
  * notification from VMM.
@@ -99,14 +132,110 @@ static DEFINE_MUTEX(quote_lock);
 static struct workqueue_struct *quote_wq;
 static struct work_struct quote_work;
 
+/*
+ * Pre-allocated shared buffers, so that a GetQuote request that fits
+ * quote_pool_len doesn't pay for converting memory to shared and back.
+ * Larger requests and requests issued while the pool is empty allocate a
+ * buffer of their own.
+ */
+static unsigned int quote_pool_nr = 4;
+module_param(quote_pool_nr, uint, 0444);
+MODULE_PARM_DESC(quote_pool_nr, "Number of pre-allocated GetQuote buffers");
+
+static unsigned int quote_pool_len = SZ_16K;
+module_param(quote_pool_len, uint, 0444);
+MODULE_PARM_DESC(quote_pool_len, "Size of each pre-allocated GetQuote buffer");
+
+static LIST_HEAD(quote_pool);
+static DEFINE_SPINLOCK(quote_pool_lock);
+
+/*
+ * Recently generated TDREPORTs, keyed by REPORTDATA.  An entry is reused
+ * for report_cache_ms at most and only while no RTMR has been extended
+ * since it was generated, see tdx_rtmr_seq().  0 disables the cache.
+ */
+#define REPORT_CACHE_NR		8
+
+struct report_cache_entry {
+	u8 reportdata[TDX_REPORTDATA_LEN];
+	u8 tdreport[TDX_REPORT_LEN];
+	u64 rtmr_seq;
+	unsigned long expires;
+	bool valid;
+};
+
+static unsigned int report_cache_ms = 1000;
+module_param(report_cache_ms, uint, 0644);
+MODULE_PARM_DESC(report_cache_ms, "Lifetime of cached TDREPORTs in ms, 0 to disable");
+
+static struct report_cache_entry report_cache[REPORT_CACHE_NR];
+static unsigned int report_cache_next;
+static DEFINE_MUTEX(report_cache_lock);
+
+/*
+ * Recently verified REPORTMACSTRUCTs.  Service TDs verify the same peer
+ * reports over and over, one for each session they set up with the peer.
+ * Only reports that passed are cached, each one for verify_cache_ms at
+ * most, and the whole REPORTMACSTRUCT is compared as the MAC alone says
+ * nothing about the rest of the struct until verified.  0 disables the
+ * cache.
+ */
+#define VERIFY_CACHE_NR		32
+
+struct verify_cache_entry {
+	u8 reportmac[TDX_REPORTMACSTRUCT_LEN];
+	unsigned long expires;
+	bool valid;
+};
+
+static unsigned int verify_cache_ms = 1000;
+module_param(verify_cache_ms, uint, 0644);
+MODULE_PARM_DESC(verify_cache_ms, "Lifetime of cached verified reports in ms, 0 to disable");
+
+static struct verify_cache_entry verify_cache[VERIFY_CACHE_NR];
+static unsigned int verify_cache_next;
+static DEFINE_MUTEX(verify_cache_lock);
+
 static struct platform_device *tdx_dev;
 
 static struct spec_id_algo_node *algo_list;
 static void *next_event;
 static void __iomem *ccel_addr;
+static phys_addr_t ccel_phys;
 static u64 ccel_len;
 static u16 algo_count;
 
+/*
+ * Offsets of the events in the log, indexed by their sequence number, so that
+ * TDX_CMD_GET_EVENTLOG finds the events since a given one without walking the
+ * log.  Appended to under rtmr_lock, along with the log.
+ */
+static u32 *ccel_index;
+static u32 ccel_nr_events;
+static u32 ccel_index_size;
+static bool ccel_index_broken;
+
+static void ccel_index_add(u64 offset)
+{
+	u32 *index;
+
+	if (ccel_index_broken)
+		return;
+
+	if (ccel_nr_events == ccel_index_size) {
+		index = krealloc_array(ccel_index, max(2 * ccel_index_size, 64U),
+				       sizeof(*index), GFP_KERNEL);
+		if (!index) {
+			ccel_index_broken = true;
+			return;
+		}
+		ccel_index = index;
+		ccel_index_size = max(2 * ccel_index_size, 64U);
+	}
+
+	ccel_index[ccel_nr_events++] = offset;
+}
+
 static u64 parse_spec_id_event(void *data)
 {
 	struct spec_id_event *event = data;
@@ -171,6 +300,7 @@ static void* acpi_ccel_next_event(void)
 	data = acpi_os_map_iomem(ccel->log_area_start_address, ccel->log_area_minimum_length);
 
 	ccel_addr = data;
+	ccel_phys = ccel->log_area_start_address;
 	ccel_len = ccel->log_area_minimum_length;
 
 	while (index < ccel->log_area_minimum_length) {
@@ -180,7 +310,13 @@ static void* acpi_ccel_next_event(void)
 		if (evhead->mr_idx == CC_INVALID_RTMR_IDX)
 	                break;
 
-		if (evhead->event_type == EV_NO_ACTION)
+		ccel_index_add(start);
+
+		/*
+		 * Only the first event is the Spec ID one, later EV_NO_ACTION
+		 * ones are batch members, see tdx_extend_rtmr_batch().
+		 */
+		if (evhead->event_type == EV_NO_ACTION && !start)
 			index += parse_spec_id_event(evhead);
 		else
 			index += parse_cc_event(evhead);
@@ -193,23 +329,47 @@ static void* acpi_ccel_next_event(void)
 
 static void acpi_ccel_release(void)
 {
+	kfree(ccel_index);
+
 	if (!ccel_addr)
 		return;
 
 	acpi_os_unmap_iomem(ccel_addr, ccel_len);
 }
 
-static void ccel_record_eventlog(void *data, u8 index)
+static const char ccel_extend_data[] = "Runtime RTMR event log extend success";
+static const char ccel_batch_data[] = "Runtime RTMR batch event";
+
+/* Serializes RTMR extensions and the matching event log appends */
+static DEFINE_MUTEX(rtmr_lock);
+
+/* Log space needed to record an event with @len bytes of data */
+static size_t ccel_event_size(size_t len)
+{
+	return sizeof(struct cc_sha384_event) + len;
+}
+
+/* Whether @size more bytes of events still fit the log */
+static bool ccel_has_room(size_t size)
+{
+	void *end = (void __force *)ccel_addr + ccel_len;
+
+	return !next_event || end - next_event >= size;
+}
+
+static void __ccel_record_event(void *data, u8 index, u32 type,
+				const char *event_data)
 {
 	struct cc_sha384_event *event = next_event;
-	char event_data[] = "Runtime RTMR event log extend success";
 
-	if (!event)
+	if (!event || !ccel_has_room(ccel_event_size(strlen(event_data))))
 		return;
 
+	ccel_index_add((void *)event - (void __force *)ccel_addr);
+
 	/* Setup Evenlog header */
 	event->head.mr_idx = index + 1;
-	event->head.event_type = EV_EVENT_TAG;
+	event->head.event_type = type;
 	event->head.count = 1;
 	event->algo_id = TPM_ALG_SHA384;
 	memcpy(event->digest, data, SHA384_DIGEST_SIZE);
@@ -220,10 +380,37 @@ static void ccel_record_eventlog(void *data, u8 index)
 	next_event += (sizeof(*event) + event->data.size);
 }
 
-static struct quote_entry *alloc_quote_entry(u64 buf_len)
+static void ccel_record_eventlog(void *data, u8 index)
+{
+	__ccel_record_event(data, index, EV_EVENT_TAG, ccel_extend_data);
+}
+
+static struct quote_entry *get_pool_quote_entry(size_t len)
 {
 	struct quote_entry *entry = NULL;
-	size_t new_len = PAGE_ALIGN(buf_len);
+
+	if (len > quote_pool_len)
+		return NULL;
+
+	spin_lock(&quote_pool_lock);
+	entry = list_first_entry_or_null(&quote_pool, struct quote_entry, list);
+	if (entry)
+		list_del(&entry->list);
+	spin_unlock(&quote_pool_lock);
+
+	if (entry) {
+		reinit_completion(&entry->compl);
+		entry->valid = true;
+		entry->ctx = NULL;
+	}
+
+	return entry;
+}
+
+/* Allocate a new entry and its shared buffer, bypassing the pool. */
+static struct quote_entry *__alloc_quote_entry(size_t new_len)
+{
+	struct quote_entry *entry;
 
 	entry = kmalloc(sizeof(*entry), GFP_KERNEL);
 	if (!entry)
@@ -238,24 +425,73 @@ static struct quote_entry *alloc_quote_entry(u64 buf_len)
 	}
 
 	entry->buf_len = new_len;
+	entry->pooled = false;
 	init_completion(&entry->compl);
 	entry->valid = true;
+	entry->ctx = NULL;
 
 	return entry;
 }
 
+static struct quote_entry *alloc_quote_entry(u64 buf_len)
+{
+	size_t new_len = PAGE_ALIGN(buf_len);
+	struct quote_entry *entry;
+
+	entry = get_pool_quote_entry(new_len);
+	if (entry)
+		return entry;
+
+	return __alloc_quote_entry(new_len);
+}
+
 static void free_quote_entry(struct quote_entry *entry)
 {
+	if (entry->pooled) {
+		spin_lock(&quote_pool_lock);
+		list_add(&entry->list, &quote_pool);
+		spin_unlock(&quote_pool_lock);
+		return;
+	}
+
 	dma_free_coherent(&tdx_dev->dev, entry->buf_len, entry->buf,
 			  entry->handle);
 	kfree(entry);
 }
 
+static void quote_pool_destroy(void)
+{
+	struct quote_entry *entry, *next;
+
+	list_for_each_entry_safe(entry, next, &quote_pool, list) {
+		list_del(&entry->list);
+		entry->pooled = false;
+		free_quote_entry(entry);
+	}
+}
+
+static void quote_pool_init(void)
+{
+	struct quote_entry *entry;
+	unsigned int i;
+
+	quote_pool_len = PAGE_ALIGN(quote_pool_len);
+
+	for (i = 0; i < quote_pool_nr; i++) {
+		entry = __alloc_quote_entry(quote_pool_len);
+		if (!entry)
+			break;
+		entry->pooled = true;
+		free_quote_entry(entry);
+	}
+}
+
 /* Must be called with quote_lock held */
 static void _del_quote_entry(struct quote_entry *entry)
 {
 	list_del(&entry->list);
 	free_quote_entry(entry);
+	atomic_dec(&nr_quote_requests);
 }
 
 static void del_quote_entry(struct quote_entry *entry)
@@ -290,8 +526,19 @@ static void terminate_quote_request(struct quote_entry *entry)
 	mutex_unlock(&quote_lock);
 }
 
+/* Must be called with quote_lock held */
+static void complete_quote_entry(struct quote_entry *entry)
+{
+	complete(&entry->compl);
+	if (entry->ctx)
+		wake_up_interruptible(&entry->ctx->wq);
+}
+
 static irqreturn_t attestation_callback_handler(int irq, void *dev_id)
 {
+	if (!atomic_read(&nr_quote_requests))
+		return IRQ_NONE;
+
 	queue_work(quote_wq, &quote_work);
 	return IRQ_HANDLED;
 }
@@ -313,17 +560,67 @@ static void quote_callback_handler(struct work_struct *work)
 		 * is still valid, mark it complete.
 		 */
 		if (entry->valid)
-			complete(&entry->compl);
+			complete_quote_entry(entry);
 		else
 			_del_quote_entry(entry);
 	}
 	mutex_unlock(&quote_lock);
 }
 
+static bool report_cache_lookup(u8 *reportdata, u8 *tdreport)
+{
+	struct report_cache_entry *e;
+	u64 seq = tdx_rtmr_seq();
+	bool hit = false;
+	int i;
+
+	mutex_lock(&report_cache_lock);
+	for (i = 0; i < REPORT_CACHE_NR; i++) {
+		e = &report_cache[i];
+		if (!e->valid || e->rtmr_seq != seq ||
+		    time_after(jiffies, e->expires) ||
+		    memcmp(e->reportdata, reportdata, TDX_REPORTDATA_LEN))
+			continue;
+		memcpy(tdreport, e->tdreport, TDX_REPORT_LEN);
+		hit = true;
+		break;
+	}
+	mutex_unlock(&report_cache_lock);
+
+	return hit;
+}
+
+static void report_cache_insert(u8 *reportdata, u8 *tdreport, u64 seq)
+{
+	struct report_cache_entry *e;
+
+	mutex_lock(&report_cache_lock);
+	e = &report_cache[report_cache_next];
+	report_cache_next = (report_cache_next + 1) % REPORT_CACHE_NR;
+	memcpy(e->reportdata, reportdata, TDX_REPORTDATA_LEN);
+	memcpy(e->tdreport, tdreport, TDX_REPORT_LEN);
+	e->rtmr_seq = seq;
+	e->expires = jiffies + msecs_to_jiffies(report_cache_ms);
+	e->valid = true;
+	mutex_unlock(&report_cache_lock);
+}
+
+static void report_cache_flush(void)
+{
+	int i;
+
+	mutex_lock(&report_cache_lock);
+	for (i = 0; i < REPORT_CACHE_NR; i++)
+		memzero_explicit(&report_cache[i], sizeof(report_cache[i]));
+	mutex_unlock(&report_cache_lock);
+}
+
 static long tdx_get_report0(struct tdx_report_req __user *req)
 {
+	unsigned int cache_ms = READ_ONCE(report_cache_ms);
 	u8 *reportdata, *tdreport;
-	long ret;
+	long ret = 0;
+	u64 seq;
 
 	reportdata = kmalloc(TDX_REPORTDATA_LEN, GFP_KERNEL);
 	if (!reportdata)
@@ -340,11 +637,19 @@ static long tdx_get_report0(struct tdx_report_req __user *req)
 		goto out;
 	}
 
+	if (cache_ms && report_cache_lookup(reportdata, tdreport))
+		goto copy;
+
 	/* Generate TDREPORT0 using "TDG.MR.REPORT" TDCALL */
+	seq = tdx_rtmr_seq();
 	ret = tdx_mcall_get_report0(reportdata, tdreport);
 	if (ret)
 		goto out;
 
+	if (cache_ms)
+		report_cache_insert(reportdata, tdreport, seq);
+
+copy:
 	if (copy_to_user(req->tdreport, tdreport, TDX_REPORT_LEN))
 		ret = -EFAULT;
 
@@ -355,6 +660,58 @@ static long tdx_get_report0(struct tdx_report_req __user *req)
 	return ret;
 }
 
+static bool verify_cache_lookup(u8 *reportmac)
+{
+	struct verify_cache_entry *e;
+	bool hit = false;
+	int i;
+
+	mutex_lock(&verify_cache_lock);
+	for (i = 0; i < VERIFY_CACHE_NR; i++) {
+		e = &verify_cache[i];
+		if (!e->valid || time_after(jiffies, e->expires) ||
+		    memcmp(e->reportmac, reportmac, TDX_REPORTMACSTRUCT_LEN))
+			continue;
+		hit = true;
+		break;
+	}
+	mutex_unlock(&verify_cache_lock);
+
+	return hit;
+}
+
+static void verify_cache_insert(u8 *reportmac)
+{
+	struct verify_cache_entry *e;
+
+	mutex_lock(&verify_cache_lock);
+	e = &verify_cache[verify_cache_next];
+	verify_cache_next = (verify_cache_next + 1) % VERIFY_CACHE_NR;
+	memcpy(e->reportmac, reportmac, TDX_REPORTMACSTRUCT_LEN);
+	e->expires = jiffies + msecs_to_jiffies(verify_cache_ms);
+	e->valid = true;
+	mutex_unlock(&verify_cache_lock);
+}
+
+/*
+ * Verify REPORTMACSTRUCT using "TDG.MR.VERIFYREPORT" TDCALL, unless it was
+ * verified recently.  @reportmac must be 256B aligned for the TDCALL.
+ */
+static u64 tdx_verify_reportmac(u8 *reportmac)
+{
+	unsigned int cache_ms = READ_ONCE(verify_cache_ms);
+	u64 err;
+
+	if (cache_ms && verify_cache_lookup(reportmac))
+		return 0;
+
+	err = tdx_mcall_verify_report(reportmac);
+	if (!err && cache_ms)
+		verify_cache_insert(reportmac);
+
+	return err;
+}
+
 static long tdx_verify_report(struct tdx_verify_report_req __user *req)
 {
 	u8 *reportmac;
@@ -370,8 +727,7 @@ static long tdx_verify_report(struct tdx_verify_report_req __user *req)
 		goto out;
 	}
 
-	/* Verify REPORTMACSTRUCT using "TDG.MR.VERIFYREPORT" TDCALL */
-	err = tdx_mcall_verify_report(reportmac);
+	err = tdx_verify_reportmac(reportmac);
 	if (err)
 		ret = -EIO;
 
@@ -383,6 +739,57 @@ static long tdx_verify_report(struct tdx_verify_report_req __user *req)
 	return ret;
 }
 
+static long tdx_verify_report_batch(struct tdx_verify_report_batch_req __user *ureq)
+{
+	struct tdx_verify_report_batch_req req;
+	u8 *reports, *reportmac;
+	u64 *err_codes;
+	unsigned int i;
+	long ret = 0;
+
+	if (copy_from_user(&req, ureq, sizeof(req)))
+		return -EFAULT;
+
+	if (!req.nr || req.nr > TDX_VERIFY_REPORT_BATCH_MAX)
+		return -EINVAL;
+
+	reports = memdup_user(u64_to_user_ptr(req.reports),
+			      (size_t)req.nr * TDX_REPORTMACSTRUCT_LEN);
+	if (IS_ERR(reports))
+		return PTR_ERR(reports);
+
+	err_codes = kcalloc(req.nr, sizeof(*err_codes), GFP_KERNEL);
+	/* The array isn't guaranteed to be 256B aligned, verify from a copy */
+	reportmac = kmalloc(TDX_REPORTMACSTRUCT_LEN, GFP_KERNEL);
+	if (!err_codes || !reportmac) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	req.nr_failed = 0;
+	for (i = 0; i < req.nr; i++) {
+		memcpy(reportmac, reports + i * TDX_REPORTMACSTRUCT_LEN,
+		       TDX_REPORTMACSTRUCT_LEN);
+		err_codes[i] = tdx_verify_reportmac(reportmac);
+		if (err_codes[i])
+			req.nr_failed++;
+		cond_resched();
+	}
+
+	if (copy_to_user(u64_to_user_ptr(req.err_codes), err_codes,
+			 req.nr * sizeof(*err_codes)) ||
+	    copy_to_user(&ureq->nr_failed, &req.nr_failed,
+			 sizeof(req.nr_failed)))
+		ret = -EFAULT;
+
+out:
+	kfree(reportmac);
+	kfree(err_codes);
+	kfree(reports);
+
+	return ret;
+}
+
 static long tdx_extend_rtmr(struct tdx_extend_rtmr_req __user *req)
 {
 	u8 *data, index;
@@ -408,60 +815,173 @@ static long tdx_extend_rtmr(struct tdx_extend_rtmr_req __user *req)
 		goto out;
 	}
 
-	/* Extend RTMR registers using "TDG.MR.RTMR.EXTEND" TDCALL */
+	/*
+	 * Extend RTMR registers using "TDG.MR.RTMR.EXTEND" TDCALL.  The
+	 * cached TDREPORTs become stale through tdx_rtmr_seq(), drop them
+	 * eagerly anyway.
+	 */
+	mutex_lock(&rtmr_lock);
 	ret = tdx_mcall_extend_rtmr(data, index);
+	report_cache_flush();
 
 	if (!ret)
 		ccel_record_eventlog(data, index);
+	mutex_unlock(&rtmr_lock);
 out:
 	kfree(data);
 
 	return ret;
 }
 
-static long tdx_get_quote(struct tdx_quote_req __user *ureq)
+static long tdx_extend_rtmr_batch(struct tdx_extend_rtmr_batch_req __user *ureq)
 {
-	struct tdx_quote_req req;
-	struct quote_entry *entry;
+	u8 buf[2 * SHA384_DIGEST_SIZE];
+	struct tdx_extend_rtmr_batch_req req;
+	struct crypto_shash *tfm;
+	u8 *events, *chain;
+	unsigned int i;
 	long ret;
 
 	if (copy_from_user(&req, ureq, sizeof(req)))
 		return -EFAULT;
 
+	/* Same restriction as TDX_CMD_EXTEND_RTMR */
+	if (req.index < 2)
+		return -EPERM;
+
+	if (!req.nr || req.nr > TDX_EXTEND_RTMR_BATCH_MAX ||
+	    memchr_inv(req.reserved, 0, sizeof(req.reserved)))
+		return -EINVAL;
+
+	events = vmemdup_user(u64_to_user_ptr(req.events),
+			      (size_t)req.nr * TDX_EXTEND_RTMR_DATA_LEN);
+	if (IS_ERR(events))
+		return PTR_ERR(events);
+
+	/* TDG.MR.RTMR.EXTEND TDCALL expects buffer to be 64B aligned */
+	chain = kzalloc(ALIGN(TDX_EXTEND_RTMR_DATA_LEN, 64), GFP_KERNEL);
+	if (!chain) {
+		ret = -ENOMEM;
+		goto out_events;
+	}
+
+	tfm = crypto_alloc_shash("sha384", 0, 0);
+	if (IS_ERR(tfm)) {
+		ret = PTR_ERR(tfm);
+		goto out_chain;
+	}
+
+	for (i = 0; i < req.nr; i++) {
+		memcpy(buf, chain, SHA384_DIGEST_SIZE);
+		memcpy(buf + SHA384_DIGEST_SIZE,
+		       events + i * TDX_EXTEND_RTMR_DATA_LEN,
+		       TDX_EXTEND_RTMR_DATA_LEN);
+		ret = crypto_shash_tfm_digest(tfm, buf, sizeof(buf), chain);
+		if (ret)
+			goto out_tfm;
+	}
+
+	mutex_lock(&rtmr_lock);
+	/* Don't extend what can't be recorded, the log couldn't be replayed */
+	if (!ccel_has_room(req.nr * ccel_event_size(strlen(ccel_batch_data)) +
+			   ccel_event_size(strlen(ccel_extend_data)))) {
+		mutex_unlock(&rtmr_lock);
+		ret = -ENOSPC;
+		goto out_tfm;
+	}
+
+	ret = tdx_mcall_extend_rtmr(chain, req.index);
+	report_cache_flush();
+
+	if (!ret) {
+		for (i = 0; i < req.nr; i++)
+			__ccel_record_event(events + i * TDX_EXTEND_RTMR_DATA_LEN,
+					    req.index, EV_NO_ACTION,
+					    ccel_batch_data);
+		ccel_record_eventlog(chain, req.index);
+	}
+	mutex_unlock(&rtmr_lock);
+
+out_tfm:
+	crypto_free_shash(tfm);
+out_chain:
+	kfree(chain);
+out_events:
+	kvfree(events);
+
+	return ret;
+}
+
+/* Allocate and submit a GetQuote request, owned by @ctx if not NULL */
+static struct quote_entry *submit_quote_request(u64 ubuf, u64 len,
+						struct tdx_guest_ctx *ctx)
+{
+	struct quote_entry *entry;
+	long ret;
+
 	/* Make sure the length is valid */
-	if (!req.len) {
+	if (!len) {
 		pr_err("Invalid Quote buffer length\n");
-		return -EINVAL;
+		return ERR_PTR(-EINVAL);
 	}
 
-	entry = alloc_quote_entry(req.len);
+	entry = alloc_quote_entry(len);
 	if (!entry) {
 		pr_err("Quote entry allocation failed\n");
-		return -ENOMEM;
+		return ERR_PTR(-ENOMEM);
 	}
 
 	/* Copy data (with TDREPORT) from user buffer to kernel Quote buffer */
-	if (copy_from_user(entry->buf, (void __user *)req.buf, req.len)) {
+	if (copy_from_user(entry->buf, (void __user *)ubuf, len)) {
 		free_quote_entry(entry);
-		return -EFAULT;
+		return ERR_PTR(-EFAULT);
 	}
 
-	mutex_lock(&quote_lock);
+	entry->ubuf = ubuf;
+	entry->ulen = len;
+	entry->ctx = ctx;
 
-	/* Submit GetQuote Request */
+	/*
+	 * Submit GetQuote Request.  This is done outside quote_lock, so that
+	 * concurrent requests only serialize on the list insertion.
+	 */
+	atomic_inc(&nr_quote_requests);
 	ret = tdx_hcall_get_quote(entry->buf, entry->buf_len);
 	if (ret) {
-		mutex_unlock(&quote_lock);
 		pr_err("GetQuote hypercall failed, status:%lx\n", ret);
+		atomic_dec(&nr_quote_requests);
 		free_quote_entry(entry);
-		return -EIO;
+		return ERR_PTR(-EIO);
 	}
 
-	/* Add current quote entry to quote_list to track active requests */
+	/*
+	 * Add current quote entry to quote_list to track active requests.
+	 * The VMM may have already completed the request and the callback
+	 * may have run before the entry was on the list, complete it here in
+	 * that case.
+	 */
+	mutex_lock(&quote_lock);
 	list_add_tail(&entry->list, &quote_list);
-
+	if (((struct tdx_quote_hdr *)entry->buf)->status != GET_QUOTE_IN_FLIGHT)
+		complete_quote_entry(entry);
 	mutex_unlock(&quote_lock);
 
+	return entry;
+}
+
+static long tdx_get_quote(struct tdx_quote_req __user *ureq)
+{
+	struct tdx_quote_req req;
+	struct quote_entry *entry;
+	long ret;
+
+	if (copy_from_user(&req, ureq, sizeof(req)))
+		return -EFAULT;
+
+	entry = submit_quote_request(req.buf, req.len, NULL);
+	if (IS_ERR(entry))
+		return PTR_ERR(entry);
+
 	/* Wait for attestation completion */
 	ret = wait_for_completion_interruptible(&entry->compl);
 	if (ret < 0) {
@@ -486,6 +1006,177 @@ static long tdx_get_quote(struct tdx_quote_req __user *ureq)
 	return 0;
 }
 
+static long tdx_submit_quote(struct tdx_guest_ctx *ctx,
+			     struct tdx_quote_async_req __user *ureq)
+{
+	struct tdx_quote_async_req req;
+	struct quote_entry *entry;
+
+	if (copy_from_user(&req, ureq, sizeof(req)))
+		return -EFAULT;
+
+	spin_lock(&ctx->lock);
+	if (ctx->nr_entries >= QUOTE_ASYNC_MAX) {
+		spin_unlock(&ctx->lock);
+		return -EBUSY;
+	}
+	ctx->nr_entries++;
+	req.id = ++ctx->next_id;
+	spin_unlock(&ctx->lock);
+
+	entry = submit_quote_request(req.buf, req.len, ctx);
+	if (IS_ERR(entry)) {
+		spin_lock(&ctx->lock);
+		ctx->nr_entries--;
+		spin_unlock(&ctx->lock);
+		return PTR_ERR(entry);
+	}
+
+	entry->id = req.id;
+	spin_lock(&ctx->lock);
+	list_add_tail(&entry->ctx_list, &ctx->entries);
+	spin_unlock(&ctx->lock);
+
+	/*
+	 * The VMM may have completed the request before it was published in
+	 * ctx->entries, and the wake up found nothing for tdx_guest_poll() to
+	 * report.  Wake the pollers again now that it's visible.
+	 */
+	if (completion_done(&entry->compl))
+		wake_up_interruptible(&ctx->wq);
+
+	if (copy_to_user(&ureq->id, &req.id, sizeof(req.id)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static long tdx_collect_quote(struct tdx_guest_ctx *ctx,
+			      struct tdx_quote_async_req __user *ureq)
+{
+	struct quote_entry *entry, *found = NULL;
+	struct tdx_quote_async_req req;
+	long ret = -ENOENT;
+
+	if (copy_from_user(&req, ureq, sizeof(req)))
+		return -EFAULT;
+
+	spin_lock(&ctx->lock);
+	list_for_each_entry(entry, &ctx->entries, ctx_list) {
+		if (req.id && entry->id != req.id)
+			continue;
+		ret = -EAGAIN;
+		if (completion_done(&entry->compl)) {
+			found = entry;
+			list_del(&entry->ctx_list);
+			ctx->nr_entries--;
+			break;
+		}
+		if (req.id)
+			break;
+	}
+	spin_unlock(&ctx->lock);
+
+	if (!found)
+		return ret;
+
+	ret = 0;
+	if (copy_to_user((void __user *)found->ubuf, found->buf, found->ulen) ||
+	    copy_to_user(&ureq->id, &found->id, sizeof(found->id)))
+		ret = -EFAULT;
+
+	del_quote_entry(found);
+
+	return ret;
+}
+
+static int tdx_guest_open(struct inode *inode, struct file *file)
+{
+	struct tdx_guest_ctx *ctx;
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		return -ENOMEM;
+
+	spin_lock_init(&ctx->lock);
+	INIT_LIST_HEAD(&ctx->entries);
+	init_waitqueue_head(&ctx->wq);
+	file->private_data = ctx;
+
+	return 0;
+}
+
+static int tdx_guest_release(struct inode *inode, struct file *file)
+{
+	struct tdx_guest_ctx *ctx = file->private_data;
+	struct quote_entry *entry, *next;
+
+	/*
+	 * No new requests can be added, only the callback can still look at
+	 * the entries.  terminate_quote_request() either frees the entry or
+	 * marks it invalid under quote_lock, after which ctx isn't touched.
+	 */
+	list_for_each_entry_safe(entry, next, &ctx->entries, ctx_list) {
+		list_del(&entry->ctx_list);
+		terminate_quote_request(entry);
+	}
+	kfree(ctx);
+
+	return 0;
+}
+
+static __poll_t tdx_guest_poll(struct file *file, poll_table *wait)
+{
+	struct tdx_guest_ctx *ctx = file->private_data;
+	struct quote_entry *entry;
+	__poll_t mask = 0;
+
+	poll_wait(file, &ctx->wq, wait);
+
+	spin_lock(&ctx->lock);
+	list_for_each_entry(entry, &ctx->entries, ctx_list) {
+		if (completion_done(&entry->compl)) {
+			mask = EPOLLIN | EPOLLRDNORM;
+			break;
+		}
+	}
+	spin_unlock(&ctx->lock);
+
+	return mask;
+}
+
+static long tdx_get_eventlog(struct tdx_eventlog_req __user *ureq)
+{
+	struct tdx_eventlog_req req;
+	long ret = 0;
+
+	if (copy_from_user(&req, ureq, sizeof(req)))
+		return -EFAULT;
+
+	if (!ccel_addr)
+		return -ENODEV;
+
+	mutex_lock(&rtmr_lock);
+	if (ccel_index_broken) {
+		ret = -ENOMEM;
+	} else if (req.seq > ccel_nr_events) {
+		ret = -EINVAL;
+	} else {
+		u64 end = next_event - (void __force *)ccel_addr;
+		u64 start = req.seq < ccel_nr_events ? ccel_index[req.seq] : end;
+
+		req.nr = ccel_nr_events - req.seq;
+		req.offset = offset_in_page(ccel_phys) + start;
+		req.len = end - start;
+	}
+	mutex_unlock(&rtmr_lock);
+
+	if (!ret && copy_to_user(ureq, &req, sizeof(req)))
+		ret = -EFAULT;
+
+	return ret;
+}
+
 static long tdx_guest_ioctl(struct file *file, unsigned int cmd,
 			    unsigned long arg)
 {
@@ -494,17 +1185,53 @@ static long tdx_guest_ioctl(struct file *file, unsigned int cmd,
 		return tdx_get_report0((struct tdx_report_req __user *)arg);
 	case TDX_CMD_VERIFY_REPORT:
 		return tdx_verify_report((struct tdx_verify_report_req __user *)arg);
+	case TDX_CMD_VERIFY_REPORT_BATCH:
+		return tdx_verify_report_batch((struct tdx_verify_report_batch_req __user *)arg);
 	case TDX_CMD_EXTEND_RTMR:
 		return tdx_extend_rtmr((struct tdx_extend_rtmr_req __user *)arg);
+	case TDX_CMD_EXTEND_RTMR_BATCH:
+		return tdx_extend_rtmr_batch((struct tdx_extend_rtmr_batch_req __user *)arg);
 	case TDX_CMD_GET_QUOTE:
 		return tdx_get_quote((struct tdx_quote_req *)arg);
+	case TDX_CMD_SUBMIT_QUOTE:
+		return tdx_submit_quote(file->private_data,
+					(struct tdx_quote_async_req __user *)arg);
+	case TDX_CMD_COLLECT_QUOTE:
+		return tdx_collect_quote(file->private_data,
+					 (struct tdx_quote_async_req __user *)arg);
+	case TDX_CMD_GET_EVENTLOG:
+		return tdx_get_eventlog((struct tdx_eventlog_req __user *)arg);
 	default:
 		return -ENOTTY;
 	}
 }
 
+/* Read-only view of the event log, from the page it starts in. */
+static int tdx_guest_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	if (!ccel_addr)
+		return -ENODEV;
+
+	if (vma->vm_pgoff ||
+	    size > PAGE_ALIGN(offset_in_page(ccel_phys) + ccel_len))
+		return -EINVAL;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vm_flags_clear(vma, VM_MAYWRITE);
+
+	return remap_pfn_range(vma, vma->vm_start, PHYS_PFN(ccel_phys), size,
+			       vma->vm_page_prot);
+}
+
 static const struct file_operations tdx_guest_fops = {
 	.owner = THIS_MODULE,
+	.open = tdx_guest_open,
+	.release = tdx_guest_release,
+	.poll = tdx_guest_poll,
+	.mmap = tdx_guest_mmap,
 	.unlocked_ioctl = tdx_guest_ioctl,
 	.llseek = no_llseek,
 };
@@ -529,6 +1256,9 @@ static int tdx_guest_probe(struct platform_device *pdev)
 
 	INIT_WORK(&quote_work, quote_callback_handler);
 
+	tdx_dev = pdev;
+	quote_pool_init();
+
 	/*
 	 * Register event notification IRQ to get Quote completion
 	 * notification. Since tdx_notify_irq is not specific to the
@@ -540,6 +1270,7 @@ static int tdx_guest_probe(struct platform_device *pdev)
 				IRQF_NOBALANCING | IRQF_SHARED,
 				"tdx_quote_irq", &tdx_misc_dev)) {
 		pr_err("notify IRQ request failed\n");
+		quote_pool_destroy();
 		destroy_workqueue(quote_wq);
 		return -EIO;
 	}
@@ -551,6 +1282,7 @@ static int tdx_guest_remove(struct platform_device *pdev)
 {
 	acpi_ccel_release();
 	misc_deregister(&tdx_misc_dev);
+	quote_pool_destroy();
 	return 0;
 }
 
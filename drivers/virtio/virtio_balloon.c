@@ -18,6 +18,9 @@
 #include <linux/wait.h>
 #include <linux/mm.h>
 #include <linux/page_reporting.h>
+#include <linux/cc_platform.h>
+#include <linux/list_sort.h>
+#include <linux/set_memory.h>
 
 /*
  * Balloon device works in 4K page units.  So each page is pointed to by
@@ -201,12 +204,79 @@ static void set_page_pfns(struct virtio_balloon *vb,
 					  page_to_balloon_pfn(page) + i);
 }
 
+static int balloon_page_pfn_cmp(void *priv, const struct list_head *a,
+				const struct list_head *b)
+{
+	return page_to_pfn(list_entry(a, struct page, lru)) >
+	       page_to_pfn(list_entry(b, struct page, lru));
+}
+
+static int balloon_page_set_shared(struct page *page, int nr, bool shared)
+{
+	unsigned long addr = (unsigned long)page_address(page);
+	int err;
+
+	if (!cc_platform_has(CC_ATTR_GUEST_MEM_ENCRYPT))
+		return 0;
+
+	if (shared)
+		err = set_memory_decrypted(addr, nr);
+	else
+		err = set_memory_encrypted(addr, nr);
+	if (err)
+		pr_warn_ratelimited("virtio_balloon: leaking %d pages that failed conversion: %d\n",
+				    nr, err);
+	return err;
+}
+
+/*
+ * In a confidential guest, the host can't reclaim the private memory behind
+ * a balloon page, e.g. a TDX private page stays mapped in the Secure EPT.
+ * Convert inflated pages to shared, so that the host releases their private
+ * memory, and back to private, i.e. accept them again, on deflate.  The pages
+ * are converted with one set_memory_{de,en}crypted() per physically
+ * contiguous run, i.e. one MapGPA for TDX.  The state of pages that failed
+ * the conversion is unknown, they are moved to @failed to be leaked.
+ */
+static void balloon_pages_set_shared(struct list_head *pages, bool shared,
+				     struct list_head *failed)
+{
+	struct page *page, *next, *first;
+	int nr;
+
+	if (!cc_platform_has(CC_ATTR_GUEST_MEM_ENCRYPT) || list_empty(pages))
+		return;
+
+	list_sort(NULL, pages, balloon_page_pfn_cmp);
+
+	first = list_first_entry(pages, struct page, lru);
+	while (!list_entry_is_head(first, pages, lru)) {
+		nr = 1;
+		page = first;
+		list_for_each_entry_continue(page, pages, lru) {
+			if (page_to_pfn(page) != page_to_pfn(first) + nr)
+				break;
+			nr++;
+		}
+
+		/* @page is the first page of the next run. */
+		if (balloon_page_set_shared(first, nr, shared)) {
+			for (; first != page; first = next) {
+				next = list_next_entry(first, lru);
+				list_move_tail(&first->lru, failed);
+			}
+		}
+		first = page;
+	}
+}
+
 static unsigned int fill_balloon(struct virtio_balloon *vb, size_t num)
 {
 	unsigned int num_allocated_pages;
 	unsigned int num_pfns;
 	struct page *page;
 	LIST_HEAD(pages);
+	LIST_HEAD(failed);
 
 	/* We can only do one array worth at a time. */
 	num = min(num, ARRAY_SIZE(vb->pfns));
@@ -227,6 +297,8 @@ static unsigned int fill_balloon(struct virtio_balloon *vb, size_t num)
 		balloon_page_push(&pages, page);
 	}
 
+	balloon_pages_set_shared(&pages, true, &failed);
+
 	mutex_lock(&vb->balloon_lock);
 
 	vb->num_pfns = 0;
@@ -271,6 +343,7 @@ static unsigned int leak_balloon(struct virtio_balloon *vb, size_t num)
 	struct page *page;
 	struct balloon_dev_info *vb_dev_info = &vb->vb_dev_info;
 	LIST_HEAD(pages);
+	LIST_HEAD(failed);
 
 	/* We can only do one array worth at a time. */
 	num = min(num, ARRAY_SIZE(vb->pfns));
@@ -296,6 +369,7 @@ static unsigned int leak_balloon(struct virtio_balloon *vb, size_t num)
 	 */
 	if (vb->num_pfns != 0)
 		tell_host(vb, vb->deflate_vq);
+	balloon_pages_set_shared(&pages, false, &failed);
 	release_pages_balloon(vb, &pages);
 	mutex_unlock(&vb->balloon_lock);
 	return num_freed_pages;
@@ -749,6 +823,7 @@ static int virtballoon_migratepage(struct balloon_dev_info *vb_dev_info,
 	struct virtio_balloon *vb = container_of(vb_dev_info,
 			struct virtio_balloon, vb_dev_info);
 	unsigned long flags;
+	int leak;
 
 	/*
 	 * In order to avoid lock contention while migrating pages concurrently
@@ -761,6 +836,13 @@ static int virtballoon_migratepage(struct balloon_dev_info *vb_dev_info,
 	if (!mutex_trylock(&vb->balloon_lock))
 		return -EAGAIN;
 
+	if (balloon_page_set_shared(newpage, 1, true)) {
+		/* Leak it, see balloon_pages_set_shared(). */
+		get_page(newpage);
+		mutex_unlock(&vb->balloon_lock);
+		return -EAGAIN;
+	}
+
 	get_page(newpage); /* balloon reference */
 
 	/*
@@ -792,9 +874,12 @@ static int virtballoon_migratepage(struct balloon_dev_info *vb_dev_info,
 	set_page_pfns(vb, vb->pfns, page);
 	tell_host(vb, vb->deflate_vq);
 
+	leak = balloon_page_set_shared(page, 1, false);
+
 	mutex_unlock(&vb->balloon_lock);
 
-	put_page(page); /* balloon reference */
+	if (!leak)
+		put_page(page); /* balloon reference */
 
 	return MIGRATEPAGE_SUCCESS;
 }
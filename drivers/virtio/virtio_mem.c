@@ -1411,6 +1411,11 @@ static int virtio_mem_send_plug_request(struct virtio_mem *vm, uint64_t addr,
 	switch (virtio_mem_send_request(vm, &req)) {
 	case VIRTIO_MEM_RESP_ACK:
 		vm->plugged_size += size;
+		/*
+		 * Plugged memory of e.g. a TD must be accepted before it's
+		 * touched, accept all of it at once rather than page by page.
+		 */
+		accept_hotplug_memory(addr, addr + size);
 		return 0;
 	case VIRTIO_MEM_RESP_NACK:
 		rc = -EAGAIN;
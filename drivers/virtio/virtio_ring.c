@@ -12,6 +12,10 @@
 #include <linux/nospec.h>
 #include <linux/hrtimer.h>
 #include <linux/dma-mapping.h>
+#include <linux/dma-direct.h>
+#include <linux/dma-map-ops.h>
+#include <linux/highmem.h>
+#include <linux/set_memory.h>
 #include <linux/kmsan.h>
 #include <linux/spinlock.h>
 #include <linux/cc_platform.h>
@@ -101,6 +105,12 @@ struct vring_virtqueue_split {
 	 */
 	u16 avail_idx_shadow;
 
+	/*
+	 * Last read value of used->idx in guest byte order, checked
+	 * against the buffers in flight.
+	 */
+	u16 used_idx_shadow;
+
 	/* Per-descriptor state. */
 	struct vring_desc_state_split *desc_state;
 	struct vring_desc_extra *desc_extra;
@@ -153,6 +163,35 @@ struct vring_virtqueue_packed {
 	size_t event_size_in_bytes;
 };
 
+/*
+ * Per-virtqueue pool of bounce slots in memory that is shared with the device
+ * once (e.g. decrypted in a confidential guest) at virtqueue creation, used
+ * instead of the DMA API's bounce buffering for buffers fitting a slot.
+ * Callers serialize all operations on a virtqueue, so does the pool.
+ */
+#define VRING_BOUNCE_SLOT_SIZE	PAGE_SIZE
+
+struct vring_bounce_slot {
+	struct page *page;
+	unsigned int offset;
+	/* Length mapped, the most copied back whatever the device reports */
+	unsigned int len;
+};
+
+struct vring_bounce {
+	void *buf;
+	dma_addr_t dma;
+	unsigned int nslots;
+	unsigned int hint;
+	unsigned long *map;
+	struct vring_bounce_slot *slots;
+};
+
+static unsigned int bounce_slots;
+module_param(bounce_slots, uint, 0444);
+MODULE_PARM_DESC(bounce_slots,
+		 "Pre-shared bounce slots per virtqueue in confidential guests");
+
 struct vring_virtqueue {
 	struct virtqueue vq;
 
@@ -215,6 +254,9 @@ struct vring_virtqueue {
 	/* Device used for doing DMA */
 	struct device *dma_dev;
 
+	/* Pre-shared bounce slots, if any */
+	struct vring_bounce *bounce;
+
 #ifdef DEBUG
 	/* They're supposed to lock for us. */
 	unsigned int in_use;
@@ -364,6 +406,123 @@ static struct device *vring_dma_dev(const struct vring_virtqueue *vq)
 	return vq->dma_dev;
 }
 
+static struct vring_bounce *vring_bounce_alloc(struct vring_virtqueue *vq)
+{
+	struct vring_bounce *b;
+
+	if (!bounce_slots || !vq->do_unmap ||
+	    !cc_platform_has(CC_ATTR_GUEST_MEM_ENCRYPT))
+		return NULL;
+
+	b = kzalloc(sizeof(*b), GFP_KERNEL);
+	if (!b)
+		return NULL;
+
+	b->nslots = bounce_slots;
+	b->map = bitmap_zalloc(b->nslots, GFP_KERNEL);
+	b->slots = kcalloc(b->nslots, sizeof(*b->slots), GFP_KERNEL);
+	b->buf = dma_alloc_coherent(vring_dma_dev(vq),
+				    (size_t)b->nslots * VRING_BOUNCE_SLOT_SIZE,
+				    &b->dma, GFP_KERNEL);
+	if (!b->map || !b->slots || !b->buf) {
+		dev_warn(&vq->vq.vdev->dev, "%s: no bounce slots\n",
+			 vq->vq.name);
+		if (b->buf)
+			dma_free_coherent(vring_dma_dev(vq),
+					  (size_t)b->nslots * VRING_BOUNCE_SLOT_SIZE,
+					  b->buf, b->dma);
+		kfree(b->slots);
+		bitmap_free(b->map);
+		kfree(b);
+		return NULL;
+	}
+
+	return b;
+}
+
+static void vring_bounce_free(struct vring_virtqueue *vq)
+{
+	struct vring_bounce *b = vq->bounce;
+
+	if (!b)
+		return;
+
+	dma_free_coherent(vring_dma_dev(vq),
+			  (size_t)b->nslots * VRING_BOUNCE_SLOT_SIZE,
+			  b->buf, b->dma);
+	kfree(b->slots);
+	bitmap_free(b->map);
+	kfree(b);
+}
+
+/* Bounce @sg through a free slot, if it fits one and one is free. */
+static int vring_bounce_map(struct vring_bounce *b, struct scatterlist *sg,
+			    enum dma_data_direction direction, dma_addr_t *addr)
+{
+	unsigned int slot;
+
+	if (sg->offset + sg->length > PAGE_SIZE)
+		return -E2BIG;
+
+	slot = find_next_zero_bit(b->map, b->nslots, b->hint);
+	if (slot >= b->nslots) {
+		slot = find_first_zero_bit(b->map, b->nslots);
+		if (slot >= b->nslots)
+			return -ENOSPC;
+	}
+	__set_bit(slot, b->map);
+	b->hint = slot + 1;
+
+	b->slots[slot].page = sg_page(sg);
+	b->slots[slot].offset = sg->offset;
+	b->slots[slot].len = sg->length;
+
+	/*
+	 * Also for DMA_FROM_DEVICE, as the device may write less than the
+	 * whole buffer, which is copied back in full.
+	 */
+	memcpy_from_page(b->buf + slot * VRING_BOUNCE_SLOT_SIZE, sg_page(sg),
+			 sg->offset, sg->length);
+	*addr = b->dma + slot * VRING_BOUNCE_SLOT_SIZE;
+
+	return 0;
+}
+
+static bool vring_bounce_unmap(struct vring_bounce *b, dma_addr_t addr,
+			       u32 len, enum dma_data_direction direction)
+{
+	struct vring_bounce_slot *s;
+	unsigned int slot;
+
+	if (addr < b->dma ||
+	    addr >= b->dma + (dma_addr_t)b->nslots * VRING_BOUNCE_SLOT_SIZE)
+		return false;
+
+	slot = (addr - b->dma) / VRING_BOUNCE_SLOT_SIZE;
+	if (WARN_ON_ONCE(addr != b->dma + slot * VRING_BOUNCE_SLOT_SIZE ||
+			 !test_bit(slot, b->map)))
+		return true;
+
+	/* @len may come from the device, never copy past the buffer. */
+	s = &b->slots[slot];
+	if (direction == DMA_FROM_DEVICE)
+		memcpy_to_page(s->page, s->offset,
+			       b->buf + slot * VRING_BOUNCE_SLOT_SIZE,
+			       min(len, s->len));
+	__clear_bit(slot, b->map);
+
+	return true;
+}
+
+static void vring_unmap_page(const struct vring_virtqueue *vq, dma_addr_t addr,
+			     u32 len, enum dma_data_direction direction)
+{
+	if (vq->bounce && vring_bounce_unmap(vq->bounce, addr, len, direction))
+		return;
+
+	dma_unmap_page(vring_dma_dev(vq), addr, len, direction);
+}
+
 /* Map one sg entry. */
 static int vring_map_one_sg(const struct vring_virtqueue *vq, struct scatterlist *sg,
 			    enum dma_data_direction direction, dma_addr_t *addr)
@@ -384,6 +543,9 @@ static int vring_map_one_sg(const struct vring_virtqueue *vq, struct scatterlist
 		return 0;
 	}
 
+	if (vq->bounce && !vring_bounce_map(vq->bounce, sg, direction, addr))
+		return 0;
+
 	/*
 	 * We can't use dma_map_sg, because we don't use scatterlists in
 	 * the way it expects (we don't guarantee that the scatterlist
@@ -452,11 +614,10 @@ static void vring_unmap_one_split_indirect(const struct vring_virtqueue *vq,
 
 	flags = virtio16_to_cpu(vq->vq.vdev, desc->flags);
 
-	dma_unmap_page(vring_dma_dev(vq),
-		       virtio64_to_cpu(vq->vq.vdev, desc->addr),
-		       virtio32_to_cpu(vq->vq.vdev, desc->len),
-		       (flags & VRING_DESC_F_WRITE) ?
-		       DMA_FROM_DEVICE : DMA_TO_DEVICE);
+	vring_unmap_page(vq, virtio64_to_cpu(vq->vq.vdev, desc->addr),
+			 virtio32_to_cpu(vq->vq.vdev, desc->len),
+			 (flags & VRING_DESC_F_WRITE) ?
+			 DMA_FROM_DEVICE : DMA_TO_DEVICE);
 }
 
 static unsigned int vring_unmap_one_split(const struct vring_virtqueue *vq,
@@ -480,11 +641,9 @@ static unsigned int vring_unmap_one_split(const struct vring_virtqueue *vq,
 		if (!vq->do_unmap)
 			goto out;
 
-		dma_unmap_page(vring_dma_dev(vq),
-			       extra[i].addr,
-			       extra[i].len,
-			       (flags & VRING_DESC_F_WRITE) ?
-			       DMA_FROM_DEVICE : DMA_TO_DEVICE);
+		vring_unmap_page(vq, extra[i].addr, extra[i].len,
+				 (flags & VRING_DESC_F_WRITE) ?
+				 DMA_FROM_DEVICE : DMA_TO_DEVICE);
 	}
 
 out:
@@ -822,6 +981,35 @@ static bool more_used_split(const struct vring_virtqueue *vq)
 			vq->split.vring.used->idx);
 }
 
+/*
+ * Like more_used_split(), for the driver consuming the used ring: read
+ * used->idx from the device only once the entries it published last are
+ * consumed, and check the whole burst at once.  The device can't publish
+ * more buffers than the descriptors in flight.
+ */
+static bool more_used_split_get(struct vring_virtqueue *vq)
+{
+	u16 used_idx;
+
+	if (vq->last_used_idx != vq->split.used_idx_shadow)
+		return true;
+
+	used_idx = virtio16_to_cpu(vq->vq.vdev,
+				   READ_ONCE(vq->split.vring.used->idx));
+	if (used_idx == vq->last_used_idx)
+		return false;
+
+	if (unlikely((u16)(used_idx - vq->last_used_idx) >
+		     vq->split.vring.num - vq->vq.num_free)) {
+		BAD_RING(vq, "used idx %u beyond the %u descriptors in flight\n",
+			 used_idx, vq->split.vring.num - vq->vq.num_free);
+		return false;
+	}
+
+	vq->split.used_idx_shadow = used_idx;
+	return true;
+}
+
 static void *virtqueue_get_buf_ctx_split(struct virtqueue *_vq,
 					 unsigned int *len,
 					 void **ctx)
@@ -838,7 +1026,7 @@ static void *virtqueue_get_buf_ctx_split(struct virtqueue *_vq,
 		return NULL;
 	}
 
-	if (!more_used_split(vq)) {
+	if (!more_used_split_get(vq)) {
 		pr_debug("No more buffers in queue\n");
 		END_USE(vq);
 		return NULL;
@@ -1012,6 +1200,7 @@ static void virtqueue_vring_init_split(struct vring_virtqueue_split *vring_split
 
 	vring_split->avail_flags_shadow = 0;
 	vring_split->avail_idx_shadow = 0;
+	vring_split->used_idx_shadow = 0;
 
 	/* No callback?  Tell other side not to bother us. */
 	if (!vq->vq.callback) {
@@ -1244,10 +1433,9 @@ static void vring_unmap_extra_packed(const struct vring_virtqueue *vq,
 		if (!vq->do_unmap)
 			return;
 
-		dma_unmap_page(vring_dma_dev(vq),
-			       extra->addr, extra->len,
-			       (flags & VRING_DESC_F_WRITE) ?
-			       DMA_FROM_DEVICE : DMA_TO_DEVICE);
+		vring_unmap_page(vq, extra->addr, extra->len,
+				 (flags & VRING_DESC_F_WRITE) ?
+				 DMA_FROM_DEVICE : DMA_TO_DEVICE);
 	}
 }
 
@@ -1261,11 +1449,9 @@ static void vring_unmap_desc_packed(const struct vring_virtqueue *vq,
 
 	flags = le16_to_cpu(desc->flags);
 
-	dma_unmap_page(vring_dma_dev(vq),
-		       le64_to_cpu(desc->addr),
-		       le32_to_cpu(desc->len),
-		       (flags & VRING_DESC_F_WRITE) ?
-		       DMA_FROM_DEVICE : DMA_TO_DEVICE);
+	vring_unmap_page(vq, le64_to_cpu(desc->addr), le32_to_cpu(desc->len),
+			 (flags & VRING_DESC_F_WRITE) ?
+			 DMA_FROM_DEVICE : DMA_TO_DEVICE);
 }
 
 static struct vring_packed_desc *alloc_indirect_packed(unsigned int total_sg,
@@ -2113,6 +2299,7 @@ static struct virtqueue *vring_create_virtqueue_packed(
 
 	virtqueue_init(vq, num);
 	virtqueue_vring_attach_packed(vq, &vring_packed);
+	vq->bounce = vring_bounce_alloc(vq);
 
 	spin_lock(&vdev->vqs_list_lock);
 	list_add_tail(&vq->vq.list, &vdev->vqs);
@@ -2660,6 +2847,7 @@ static struct virtqueue *__vring_new_virtqueue(unsigned int index,
 
 	virtqueue_init(vq, vring_split->vring.num);
 	virtqueue_vring_attach_split(vq, vring_split);
+	vq->bounce = vring_bounce_alloc(vq);
 
 	spin_lock(&vdev->vqs_list_lock);
 	list_add_tail(&vq->vq.list, &vdev->vqs);
@@ -2923,6 +3111,7 @@ void vring_del_virtqueue(struct virtqueue *_vq)
 	spin_unlock(&vq->vq.vdev->vqs_list_lock);
 
 	vring_free(_vq);
+	vring_bounce_free(vq);
 
 	kfree(vq);
 }
@@ -3266,4 +3455,73 @@ void virtqueue_dma_sync_single_range_for_device(struct virtqueue *_vq,
 }
 EXPORT_SYMBOL_GPL(virtqueue_dma_sync_single_range_for_device);
 
+/**
+ * virtqueue_dma_alloc_shared_pages - allocate pages shared with the device
+ * @_vq: the struct virtqueue we're talking about.
+ * @order: the page order of the allocation
+ * @addr: returns the DMA address of the pages
+ * @gfp: how to do memory allocations
+ *
+ * In a confidential guest, allocate a compound page and convert it to shared
+ * (decrypted), so the device can DMA into it directly rather than through the
+ * DMA API's bounce buffers. The pages may be passed to the network stack, but
+ * the caller must keep a reference until virtqueue_dma_free_shared_pages():
+ * they must never return to the page allocator while still shared.
+ *
+ * Everything in the pages is visible to and modifiable by the host.
+ *
+ * Returns NULL if the vq doesn't use the DMA API, guest memory isn't
+ * encrypted, the DMA device isn't direct mapped or the allocation failed.
+ */
+struct page *virtqueue_dma_alloc_shared_pages(struct virtqueue *_vq,
+					      unsigned int order,
+					      dma_addr_t *addr, gfp_t gfp)
+{
+	struct vring_virtqueue *vq = to_vvq(_vq);
+	struct device *dev = vring_dma_dev(vq);
+	size_t size = PAGE_SIZE << order;
+	struct page *page;
+
+	if (!vq->use_dma_api || get_dma_ops(dev) ||
+	    !cc_platform_has(CC_ATTR_GUEST_MEM_ENCRYPT))
+		return NULL;
+
+	page = alloc_pages(gfp | __GFP_COMP | __GFP_ZERO, order);
+	if (!page)
+		return NULL;
+
+	/* The conversion state is unknown on failure, leak the pages. */
+	if (set_memory_decrypted((unsigned long)page_address(page), 1 << order))
+		return NULL;
+
+	*addr = phys_to_dma_unencrypted(dev, page_to_phys(page));
+	if (!dma_capable(dev, *addr, size, true)) {
+		virtqueue_dma_free_shared_pages(_vq, page, order);
+		return NULL;
+	}
+
+	return page;
+}
+EXPORT_SYMBOL_GPL(virtqueue_dma_alloc_shared_pages);
+
+/**
+ * virtqueue_dma_free_shared_pages - free pages shared with the device
+ * @_vq: the struct virtqueue we're talking about.
+ * @page: the pages returned by virtqueue_dma_alloc_shared_pages()
+ * @order: the page order of the allocation
+ *
+ * Converts the pages back to private and drops the caller's reference, which
+ * must be the last one. Flush the device's access to the pages, e.g. by
+ * resetting it, before calling.
+ */
+void virtqueue_dma_free_shared_pages(struct virtqueue *_vq, struct page *page,
+				     unsigned int order)
+{
+	if (set_memory_encrypted((unsigned long)page_address(page), 1 << order))
+		return;
+
+	put_page(page);
+}
+EXPORT_SYMBOL_GPL(virtqueue_dma_free_shared_pages);
+
 MODULE_LICENSE("GPL");
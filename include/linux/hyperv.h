@@ -812,6 +812,8 @@ struct vmbus_gpadl {
 	u32 gpadl_handle;
 	u32 size;
 	void *buffer;
+	/* Decrypted for the GPADL, to be encrypted back on teardown */
+	bool decrypted;
 };
 
 struct vmbus_channel {
@@ -839,6 +841,8 @@ struct vmbus_channel {
 	struct page *ringbuffer_page;
 	u32 ringbuffer_pagecount;
 	u32 ringbuffer_send_offset;
+	/* From the pool of decrypted ring buffers of an isolated VM */
+	bool ringbuffer_pooled;
 	struct hv_ring_buffer_info outbound;	/* send to parent */
 	struct hv_ring_buffer_info inbound;	/* receive from parent */
 
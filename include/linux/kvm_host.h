@@ -221,6 +221,8 @@ enum kvm_bus {
 
 int kvm_io_bus_write(struct kvm_vcpu *vcpu, enum kvm_bus bus_idx, gpa_t addr,
 		     int len, const void *val);
+int kvm_io_bus_write_coalesced(struct kvm_vcpu *vcpu, enum kvm_bus bus_idx,
+			       gpa_t addr, int len, const void *val);
 int kvm_io_bus_write_cookie(struct kvm_vcpu *vcpu, enum kvm_bus bus_idx,
 			    gpa_t addr, int len, const void *val, long cookie);
 int kvm_io_bus_read(struct kvm_vcpu *vcpu, enum kvm_bus bus_idx, gpa_t addr,
@@ -244,12 +246,17 @@ struct kvm_async_pf {
 	struct kvm_arch_async_pf arch;
 	bool   wakeup_all;
 	bool notpresent_injected;
+	/* Private, guest_memfd backed, fault of @gfn instead of @addr. */
+	bool private;
+	gfn_t gfn;
 };
 
 void kvm_clear_async_pf_completion_queue(struct kvm_vcpu *vcpu);
 void kvm_check_async_pf_completion(struct kvm_vcpu *vcpu);
 bool kvm_setup_async_pf(struct kvm_vcpu *vcpu, gpa_t cr2_or_gpa,
 			unsigned long hva, struct kvm_arch_async_pf *arch);
+bool kvm_setup_async_pf_private(struct kvm_vcpu *vcpu, gpa_t cr2_or_gpa,
+				gfn_t gfn, struct kvm_arch_async_pf *arch);
 int kvm_async_pf_wakeup_all(struct kvm_vcpu *vcpu);
 #endif
 
@@ -820,6 +827,11 @@ struct kvm {
 		struct mutex      resampler_lock;
 	} irqfds;
 	struct list_head ioeventfds;
+	/*
+	 * Wildcard MMIO ioeventfds by address, for exact (addr, len) matches
+	 * without the bus search.  Updated under slots_lock, read with srcu.
+	 */
+	DECLARE_HASHTABLE(ioeventfd_hash, 8);
 #endif
 	struct kvm_vm_stat stat;
 	struct kvm_arch arch;
@@ -867,6 +879,15 @@ struct kvm {
 #endif
 #ifdef CONFIG_KVM_GENERIC_MEMORY_ATTRIBUTES
 	struct xarray mem_attr_array;
+	/*
+	 * Attribute changes hold mem_attr_rwsem for read, memslot changes for
+	 * write.  Changes of overlapping ranges wait for each other through
+	 * mem_attr_ranges, the ranges being changed.
+	 */
+	struct rw_semaphore mem_attr_rwsem;
+	spinlock_t mem_attr_lock;
+	struct list_head mem_attr_ranges;
+	wait_queue_head_t mem_attr_wq;
 #endif
 	char stats_id[KVM_STATS_NAME_SIZE];
 #ifdef __KVM_HAVE_READONLY_MEM
@@ -1198,6 +1219,7 @@ static inline bool kvm_memslot_iter_is_valid(struct kvm_memslot_iter *iter, gfn_
  * - modify an existing memory slot
  *   -- move it in the guest physical memory space
  *   -- just change its flags
+ *   -- grow or shrink a private slot in place (same base and hva)
  *
  * Since flags can be changed by some of these operations, the following
  * differentiation is the best we can do for __kvm_set_memory_region():
@@ -1207,6 +1229,7 @@ enum kvm_mr_change {
 	KVM_MR_DELETE,
 	KVM_MR_MOVE,
 	KVM_MR_FLAGS_ONLY,
+	KVM_MR_RESIZE,
 };
 
 int kvm_set_memory_region(struct kvm *kvm,
@@ -2097,6 +2120,8 @@ int kvm_send_userspace_msi(struct kvm *kvm, struct kvm_msi *msi);
 
 void kvm_eventfd_init(struct kvm *kvm);
 int kvm_ioeventfd(struct kvm *kvm, struct kvm_ioeventfd *args);
+int kvm_ioeventfd_signal(struct kvm *kvm, enum kvm_bus bus_idx, gpa_t addr,
+			 int len);
 
 #ifdef CONFIG_HAVE_KVM_IRQFD
 int kvm_irqfd(struct kvm *kvm, struct kvm_irqfd *args);
@@ -2143,6 +2168,12 @@ static inline int kvm_ioeventfd(struct kvm *kvm, struct kvm_ioeventfd *args)
 	return -ENOSYS;
 }
 
+static inline int kvm_ioeventfd_signal(struct kvm *kvm, enum kvm_bus bus_idx,
+				       gpa_t addr, int len)
+{
+	return -EOPNOTSUPP;
+}
+
 #endif /* CONFIG_HAVE_KVM_EVENTFD */
 
 void kvm_arch_irq_routing_update(struct kvm *kvm);
@@ -2406,6 +2437,25 @@ static inline unsigned long kvm_get_memory_attributes(struct kvm *kvm, gfn_t gfn
 	return xa_to_value(xa_load(&kvm->mem_attr_array, gfn));
 }
 
+bool kvm_range_has_memory_attributes(struct kvm *kvm, gfn_t start, gfn_t end,
+				     unsigned long attrs);
+int kvm_reserve_mem_attributes(struct kvm *kvm, gfn_t start, gfn_t end,
+			       unsigned long attributes);
+
+/* A range whose attributes are being changed, see kvm->mem_attr_ranges. */
+struct kvm_mem_attr_range {
+	struct list_head list;
+	gfn_t start;
+	gfn_t end;
+};
+
+void kvm_mem_attr_range_lock(struct kvm *kvm, struct kvm_mem_attr_range *range);
+void kvm_mem_attr_range_unlock(struct kvm *kvm,
+			       struct kvm_mem_attr_range *range);
+void kvm_store_mem_attributes(struct kvm *kvm, gfn_t start, gfn_t end,
+			      unsigned long attributes);
+int kvm_vm_set_mem_attributes(struct kvm *kvm, unsigned long attributes,
+			      gfn_t start, gfn_t end);
 bool kvm_arch_post_set_memory_attributes(struct kvm *kvm,
 					 struct kvm_gfn_range *range);
 
@@ -2424,7 +2474,15 @@ static inline bool kvm_mem_is_private(struct kvm *kvm, gfn_t gfn)
 #ifdef CONFIG_KVM_PRIVATE_MEM
 int kvm_gmem_get_pfn(struct kvm *kvm, struct kvm_memory_slot *slot,
 			      gfn_t gfn, kvm_pfn_t *pfn, int *max_order);
+int kvm_gmem_get_pfn_nowait(struct kvm *kvm, struct kvm_memory_slot *slot,
+			    gfn_t gfn, kvm_pfn_t *pfn, int *max_order);
+unsigned long kvm_gmem_nr_populated(struct kvm_memory_slot *slot, gfn_t gfn,
+				    unsigned long nr);
 void kvm_arch_gmem_invalidate(struct kvm *kvm, kvm_pfn_t start, kvm_pfn_t end);
+bool kvm_arch_gmem_needs_clear(struct kvm *kvm);
+bool kvm_arch_gmem_relocatable(struct kvm *kvm);
+int kvm_arch_gmem_relocate(struct kvm *kvm, struct kvm_memory_slot *slot,
+			   gfn_t gfn, kvm_pfn_t old_pfn, kvm_pfn_t new_pfn);
 #else
 static inline int kvm_gmem_get_pfn(struct kvm *kvm,
 				   struct kvm_memory_slot *slot, gfn_t gfn,
@@ -2434,6 +2492,20 @@ static inline int kvm_gmem_get_pfn(struct kvm *kvm,
 	return -EIO;
 }
 
+static inline int kvm_gmem_get_pfn_nowait(struct kvm *kvm,
+					  struct kvm_memory_slot *slot, gfn_t gfn,
+					  kvm_pfn_t *pfn, int *max_order)
+{
+	KVM_BUG_ON(1, kvm);
+	return -EIO;
+}
+
+static inline unsigned long kvm_gmem_nr_populated(struct kvm_memory_slot *slot,
+						  gfn_t gfn, unsigned long nr)
+{
+	return 0;
+}
+
 static inline void kvm_arch_gmem_invalidate(struct kvm *kvm, kvm_pfn_t start, kvm_pfn_t end) { }
 #endif /* CONFIG_KVM_PRIVATE_MEM */
 
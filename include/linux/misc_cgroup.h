@@ -21,6 +21,8 @@ enum misc_res_type {
 #ifdef CONFIG_INTEL_TDX_HOST
 	/* Intel TDX HKIDs resource */
 	MISC_CG_RES_TDX,
+	/* Intel TDX HKIDs of destroyed TDs, until they are reclaimed */
+	MISC_CG_RES_TDX_RECLAIM,
 #endif
 	MISC_CG_RES_TYPES
 };
@@ -226,4 +226,10 @@ void virtqueue_dma_sync_single_range_for_cpu(struct virtqueue *_vq, dma_addr_t a
 void virtqueue_dma_sync_single_range_for_device(struct virtqueue *_vq, dma_addr_t addr,
 						unsigned long offset, size_t size,
 						enum dma_data_direction dir);
+
+struct page *virtqueue_dma_alloc_shared_pages(struct virtqueue *_vq,
+					      unsigned int order,
+					      dma_addr_t *addr, gfp_t gfp);
+void virtqueue_dma_free_shared_pages(struct virtqueue *_vq, struct page *page,
+				     unsigned int order);
 #endif /* _LINUX_VIRTIO_H */
@@ -38,6 +38,12 @@ struct vringh {
 	/* Last available index we saw (ie. where we're up to). */
 	u16 last_avail_idx;
 
+	/* Avail index read at the start of the current burst. */
+	u16 avail_idx_shadow;
+
+	/* last_avail_idx as left by the last __vringh_get_head(). */
+	u16 avail_idx_next;
+
 	/* Last index we used. */
 	u16 last_used_idx;
 
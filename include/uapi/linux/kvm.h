@@ -116,6 +116,7 @@ struct kvm_userspace_memory_region2 {
 #define KVM_MEM_LOG_DIRTY_PAGES	(1UL << 0)
 #define KVM_MEM_READONLY	(1UL << 1)
 #define KVM_MEM_PRIVATE		(1UL << 2)
+#define KVM_MEM_KERNEL_CONVERT	(1UL << 3)
 
 /* for KVM_IRQ_LINE */
 struct kvm_irq_level {
@@ -615,6 +616,7 @@ struct kvm_run {
 		/* KVM_EXIT_MEMORY_FAULT */
 		struct {
 #define KVM_MEMORY_EXIT_FLAG_PRIVATE	(1ULL << 3)
+#define KVM_MEMORY_EXIT_FLAG_POSTCOPY	(1ULL << 4)
 			__u64 flags;
 			__u64 gpa;
 			__u64 size;
@@ -2397,6 +2399,7 @@ struct kvm_memory_attributes {
 #define KVM_CREATE_GUEST_MEMFD	_IOWR(KVMIO,  0xd4, struct kvm_create_guest_memfd)
 
 #define KVM_GUEST_MEMFD_ALLOW_HUGEPAGE		(1ULL << 0)
+#define KVM_GUEST_MEMFD_HUGE_POOL		(1ULL << 1)
 
 struct kvm_create_guest_memfd {
 	__u64 size;
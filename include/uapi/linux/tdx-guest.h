@@ -55,6 +55,30 @@ struct tdx_verify_report_req {
 	__u64 err_code;
 };
 
+/* Maximum number of REPORTMACSTRUCTs of a TDX_CMD_VERIFY_REPORT_BATCH request */
+#define TDX_VERIFY_REPORT_BATCH_MAX	64
+
+/**
+ * struct tdx_verify_report_batch_req - Request struct for
+ *					TDX_CMD_VERIFY_REPORT_BATCH IOCTL.
+ *
+ * @reports: User address of an array of @nr REPORTMACSTRUCTs of
+ *           TDX_REPORTMACSTRUCT_LEN bytes each.
+ * @err_codes: User address of an array of @nr __u64, filled with the
+ *             TDG.MR.VERIFYREPORT TDCALL return error code of each report.
+ * @nr: Number of reports, at most TDX_VERIFY_REPORT_BATCH_MAX.
+ * @nr_failed: Number of reports that failed verification.
+ *
+ * Each report is verified as with TDX_CMD_VERIFY_REPORT, a failing one
+ * doesn't stop the verification of the following ones.
+ */
+struct tdx_verify_report_batch_req {
+	__u64 reports;
+	__u64 err_codes;
+	__u32 nr;
+	__u32 nr_failed;
+};
+
 /**
  * struct tdx_extend_rtmr_req - Request struct for TDX_CMD_EXTEND_RTMR IOCTL.
  *
@@ -68,6 +92,31 @@ struct tdx_extend_rtmr_req {
 	__u8 index;
 };
 
+/* Maximum number of digests of a TDX_CMD_EXTEND_RTMR_BATCH request */
+#define TDX_EXTEND_RTMR_BATCH_MAX	1024
+
+/**
+ * struct tdx_extend_rtmr_batch_req - Request struct for
+ *				      TDX_CMD_EXTEND_RTMR_BATCH IOCTL.
+ *
+ * @events: User address of an array of @nr digests of
+ *          TDX_EXTEND_RTMR_DATA_LEN bytes each.
+ * @nr: Number of digests, at most TDX_EXTEND_RTMR_BATCH_MAX.
+ * @index: Index of RTMR register to be extended, as for TDX_CMD_EXTEND_RTMR.
+ * @reserved: Reserved entries to pad to 64bit boundary, must be zero.
+ *
+ * The RTMR is extended once, with the chain digest C(nr), where C(0) is all
+ * zeroes and C(i) = SHA384(C(i - 1) || events[i - 1]).  Each digest is
+ * recorded in the event log as an EV_NO_ACTION event, followed by the
+ * extend of the chain digest, so that the log can be replayed.
+ */
+struct tdx_extend_rtmr_batch_req {
+	__u64 events;
+	__u32 nr;
+	__u8 index;
+	__u8 reserved[3];
+};
+
 /*
  * Format of Quote data header. More details can be found in TDX
  * Guest-Host Communication Interface (GHCI) for Intel TDX 1.0,
@@ -98,6 +147,41 @@ struct tdx_quote_req {
 	__u64 len;
 };
 
+/* struct tdx_quote_async_req: Request struct for TDX_CMD_SUBMIT_QUOTE and
+ *                            TDX_CMD_COLLECT_QUOTE IOCTLs.
+ *
+ * @buf         : Address of user buffer that includes TDREPORT (submit).
+ *                The Quote is copied back to the same buffer on collect.
+ * @len         : Length of the Quote buffer (submit).
+ * @id          : Request id, returned on submit.  On collect, the id of the
+ *                request to collect, or 0 for any completed request and
+ *                the id of the collected request on return.
+ */
+struct tdx_quote_async_req {
+	__u64 buf;
+	__u64 len;
+	__u64 id;
+};
+
+/* struct tdx_eventlog_req: Request struct for TDX_CMD_GET_EVENTLOG IOCTL.
+ *
+ * @seq         : Sequence number of the first event wanted, 0 being the
+ *                first event of the log.
+ * @nr          : Number of events from @seq to the end of the log.
+ * @offset      : Offset of event @seq in the read-only view of the event
+ *                log that mmap() of the device at offset 0 maps.
+ * @len         : Length of the events from @seq to the end of the log.
+ *
+ * An agent that processed @nr events so far asks for the events since
+ * sequence @nr next, i.e. only reads the events appended since.
+ */
+struct tdx_eventlog_req {
+	__u32 seq;
+	__u32 nr;
+	__u64 offset;
+	__u64 len;
+};
+
 /*
  * TDX_CMD_GET_REPORT0 - Get TDREPORT0 (a.k.a. TDREPORT subtype 0) using
  *                       TDCALL[TDG.MR.REPORT]
@@ -132,4 +216,49 @@ struct tdx_quote_req {
  */
 #define TDX_CMD_GET_QUOTE		_IOWR('T', 4, struct tdx_quote_req)
 
+/*
+ * TDX_CMD_SUBMIT_QUOTE - Submit a GetQuote request without waiting for it.
+ *			  The file becomes readable (poll) once any request
+ *			  submitted through it has completed.
+ *
+ * Returns 0 on success, and standard errono on other failures.
+ */
+#define TDX_CMD_SUBMIT_QUOTE		_IOWR('T', 5, struct tdx_quote_async_req)
+
+/*
+ * TDX_CMD_COLLECT_QUOTE - Collect the Quote of a completed request submitted
+ *			   with TDX_CMD_SUBMIT_QUOTE.
+ *
+ * Returns 0 on success, -EAGAIN if the request hasn't completed yet, -ENOENT
+ * for an unknown id, and standard errono on other failures.
+ */
+#define TDX_CMD_COLLECT_QUOTE		_IOWR('T', 6, struct tdx_quote_async_req)
+
+/*
+ * TDX_CMD_EXTEND_RTMR_BATCH - Extend an RTMR register with a batch of
+ *			       digests using a single TDG.MR.RTMR.EXTEND TDCALL.
+ *
+ * Returns 0 on success, -ENOSPC if the event log is full, and standard
+ * errono on other failures.
+ */
+#define TDX_CMD_EXTEND_RTMR_BATCH	_IOW('T', 7, struct tdx_extend_rtmr_batch_req)
+
+/*
+ * TDX_CMD_GET_EVENTLOG - Locate the event log events since a given sequence
+ *			  number, in the view of the log mmap() maps.
+ *
+ * Returns 0 on success, -EINVAL if @seq is past the last event, -ENODEV
+ * without an event log, and standard errono on other failures.
+ */
+#define TDX_CMD_GET_EVENTLOG		_IOWR('T', 8, struct tdx_eventlog_req)
+
+/*
+ * TDX_CMD_VERIFY_REPORT_BATCH - Verify a batch of REPORTMACSTRUCTs using
+ *				 TDG.MR.VERIFYREPORT TDCALL.
+ *
+ * Returns 0 once all the reports have been verified, whether they passed or
+ * not, see @nr_failed, and standard errono on other failures.
+ */
+#define TDX_CMD_VERIFY_REPORT_BATCH	_IOWR('T', 9, struct tdx_verify_report_batch_req)
+
 #endif /* _UAPI_LINUX_TDX_GUEST_H_ */
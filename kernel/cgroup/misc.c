@@ -27,6 +27,8 @@ static const char *const misc_res_name[] = {
 #ifdef CONFIG_INTEL_TDX_HOST
 	/* Intel TDX HKIDs resource */
 	"tdx",
+	/* Intel TDX HKIDs of destroyed TDs, until they are reclaimed */
+	"tdx_reclaim",
 #endif
 };
 
@@ -0,0 +1,248 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Measure the round trip of each TDVMCALL class in guest TSC cycles.  Classes
+ * handled by KVM measure the TD exit and TDH.VP.ENTER, the ones forwarded to
+ * userspace add the exit to userspace.  TDG.VP.INFO is a TDCALL without a TD
+ * exit, i.e. the baseline cost of calling into the TDX module.
+ *
+ * Output is one line per class:
+ *   tdx_exit_latency model=<family>:<model>:<stepping> class=<class>
+ *	iterations=<n> cycles=<average>
+ */
+#include <linux/kvm.h>
+#include <stdint.h>
+
+#include "kvm_util_base.h"
+#include "processor.h"
+#include "tdx/tdcall.h"
+#include "tdx/tdx.h"
+#include "tdx/tdx_util.h"
+#include "tdx/test_util.h"
+#include "test_util.h"
+
+#define TDX_EXIT_LATENCY_PORT		0x87
+#define TDX_EXIT_LATENCY_MMIO_ADDR	0x200000000
+#define TDX_EXIT_LATENCY_GVA		(0x80000000)
+#define TDX_EXIT_LATENCY_WARMUP		100
+
+#ifndef TDG_VP_VMCALL_GET_QUOTE
+#define TDG_VP_VMCALL_GET_QUOTE		0x10002
+#endif
+
+enum {
+	TDX_EXIT_LATENCY_TDCALL,
+	TDX_EXIT_LATENCY_CPUID,
+	TDX_EXIT_LATENCY_RDMSR,
+	TDX_EXIT_LATENCY_WRMSR,
+	TDX_EXIT_LATENCY_IO,
+	TDX_EXIT_LATENCY_MMIO,
+	TDX_EXIT_LATENCY_MAP_GPA,
+	TDX_EXIT_LATENCY_GET_QUOTE,
+	TDX_EXIT_LATENCY_NR_CLASSES,
+};
+
+static const char * const tdx_exit_latency_names[] = {
+	[TDX_EXIT_LATENCY_TDCALL] = "tdcall",
+	[TDX_EXIT_LATENCY_CPUID] = "cpuid",
+	[TDX_EXIT_LATENCY_RDMSR] = "rdmsr",
+	[TDX_EXIT_LATENCY_WRMSR] = "wrmsr",
+	[TDX_EXIT_LATENCY_IO] = "io",
+	[TDX_EXIT_LATENCY_MMIO] = "mmio",
+	[TDX_EXIT_LATENCY_MAP_GPA] = "map_gpa",
+	[TDX_EXIT_LATENCY_GET_QUOTE] = "get_quote",
+};
+
+/*
+ * Shared variables between guest and host
+ */
+static uint64_t test_iterations;
+static uint64_t test_mem_private_gpa;
+static uint64_t test_mem_shared_gpa;
+
+/* TDG.VP.VMCALL<GetQuote> has no wrapper, the buffer is @gpa, shared. */
+static uint64_t tdg_vp_vmcall_get_quote(uint64_t gpa, uint64_t size)
+{
+	register uint64_t r10 asm("r10") = 0;
+	register uint64_t r11 asm("r11") = TDG_VP_VMCALL_GET_QUOTE;
+	register uint64_t r12 asm("r12") = gpa;
+	register uint64_t r13 asm("r13") = size;
+	uint64_t rax = 0;
+
+	/* TDCALL, exposing R10-R13 to the VMM. */
+	asm volatile(".byte 0x66, 0x0f, 0x01, 0xcc"
+		     : "+a"(rax), "+r"(r10), "+r"(r11), "+r"(r12), "+r"(r13)
+		     : "c"(0x3c00UL)
+		     : "memory");
+	return rax ? rax : r10;
+}
+
+static uint64_t guest_run_one(int class, uint64_t i)
+{
+	uint64_t eax, ebx, ecx, edx, r8, r9, r10, r11;
+	uint64_t data = 0, failed_gpa;
+
+	switch (class) {
+	case TDX_EXIT_LATENCY_TDCALL:
+		return tdg_vp_info(&ecx, &edx, &r8, &r9, &r10, &r11);
+	case TDX_EXIT_LATENCY_CPUID:
+		return tdg_vp_vmcall_instruction_cpuid(1, 0, &eax, &ebx, &ecx,
+						       &edx);
+	case TDX_EXIT_LATENCY_RDMSR:
+		return tdg_vp_vmcall_instruction_rdmsr(MSR_IA32_MISC_ENABLE,
+						       &data);
+	case TDX_EXIT_LATENCY_WRMSR:
+		return tdg_vp_vmcall_instruction_wrmsr(MSR_IA32_POWER_CTL, 0);
+	case TDX_EXIT_LATENCY_IO:
+		return tdg_vp_vmcall_instruction_io(TDX_EXIT_LATENCY_PORT, 4,
+						    TDG_VP_VMCALL_INSTRUCTION_IO_WRITE,
+						    &data);
+	case TDX_EXIT_LATENCY_MMIO:
+		return tdg_vp_vmcall_ve_request_mmio_write(TDX_EXIT_LATENCY_MMIO_ADDR,
+							   8, i);
+	case TDX_EXIT_LATENCY_MAP_GPA:
+		/* Alternate the direction, the page starts private. */
+		return tdg_vp_vmcall_map_gpa((i & 1) ? test_mem_private_gpa :
+						       test_mem_shared_gpa,
+					     PAGE_SIZE, &failed_gpa);
+	case TDX_EXIT_LATENCY_GET_QUOTE:
+		return tdg_vp_vmcall_get_quote(test_mem_shared_gpa, PAGE_SIZE);
+	}
+	return 0;
+}
+
+static void guest_code(void)
+{
+	uint64_t i, n, start, cycles, ret;
+	int class;
+
+	for (class = 0; class < TDX_EXIT_LATENCY_NR_CLASSES; class++) {
+		for (i = 0; i < TDX_EXIT_LATENCY_WARMUP; i++) {
+			ret = guest_run_one(class, i);
+			if (ret)
+				tdx_test_fatal_with_data(ret, class);
+		}
+
+		n = test_iterations;
+		/* End MapGPA with the page shared, for GetQuote. */
+		if (class == TDX_EXIT_LATENCY_MAP_GPA)
+			n |= 1;
+
+		start = rdtsc();
+		for (i = 0; i < n; i++)
+			guest_run_one(class, i);
+		cycles = (rdtsc() - start) / n;
+
+		ret = tdx_test_report_64bit_to_user_space(cycles);
+		if (ret)
+			tdx_test_fatal(ret);
+	}
+
+	tdx_test_success();
+}
+
+/* Run until the guest reports the result of a class, serving its exits. */
+static uint64_t run_until_report(struct kvm_vm *vm, struct kvm_vcpu *vcpu)
+{
+	struct kvm_tdx_vmcall *vmcall_info = &vcpu->run->tdx.u.vmcall;
+	uint64_t gpa;
+
+	for (;;) {
+		vcpu_run(vcpu);
+		TDX_TEST_CHECK_GUEST_FAILURE(vcpu);
+
+		if (vcpu->run->exit_reason == KVM_EXIT_IO &&
+		    vcpu->run->io.port == TDX_EXIT_LATENCY_PORT)
+			continue;
+		if (vcpu->run->exit_reason == KVM_EXIT_MMIO &&
+		    vcpu->run->mmio.phys_addr == TDX_EXIT_LATENCY_MMIO_ADDR)
+			continue;
+		if (vcpu->run->exit_reason != KVM_EXIT_TDX ||
+		    vcpu->run->tdx.type != KVM_EXIT_TDX_VMCALL)
+			break;
+
+		if (vmcall_info->subfunction == TDG_VP_VMCALL_MAP_GPA) {
+			gpa = vmcall_info->in_r12 & ~vm->arch.s_bit;
+			handle_memory_conversion(vm, gpa, vmcall_info->in_r13,
+						 !(vm->arch.s_bit & vmcall_info->in_r12));
+			vmcall_info->status_code = 0;
+			continue;
+		}
+		if (vmcall_info->subfunction == TDG_VP_VMCALL_GET_QUOTE) {
+			vmcall_info->status_code = 0;
+			continue;
+		}
+		break;
+	}
+
+	return tdx_test_read_64bit_report_from_guest(vcpu);
+}
+
+static void help(char *name)
+{
+	puts("");
+	printf("usage: %s [-h] [-i iterations]\n", name);
+	printf(" -i: specify the number of round trips measured per class.\n"
+	       "     Default: 10000\n");
+	puts("");
+	exit(0);
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t iterations = 10000;
+	struct kvm_vcpu *vcpu;
+	vm_vaddr_t gva;
+	struct kvm_vm *vm;
+	uint64_t cycles;
+	int opt, class;
+
+	if (!is_tdx_enabled()) {
+		printf("TDX is not supported by the KVM\n"
+		       "Skipping the TDX tests.\n");
+		return 0;
+	}
+
+	while ((opt = getopt(argc, argv, "hi:")) != -1) {
+		switch (opt) {
+		case 'i':
+			iterations = atoi_positive("Number of iterations", optarg);
+			break;
+		case 'h':
+		default:
+			help(argv[0]);
+			break;
+		}
+	}
+
+	/* Disable stdout buffering */
+	setbuf(stdout, NULL);
+
+	vm = td_create();
+	td_initialize(vm, VM_MEM_SRC_ANONYMOUS, 0);
+	vcpu = td_vcpu_add(vm, 0, guest_code);
+
+	/* The page converted by MapGPA and used as GetQuote buffer. */
+	gva = vm_vaddr_alloc(vm, vm->page_size, TDX_EXIT_LATENCY_GVA);
+	test_mem_private_gpa = addr_gva2gpa(vm, gva);
+	test_mem_shared_gpa = test_mem_private_gpa | vm->arch.s_bit;
+	test_iterations = iterations;
+	sync_global_to_guest(vm, test_iterations);
+	sync_global_to_guest(vm, test_mem_private_gpa);
+	sync_global_to_guest(vm, test_mem_shared_gpa);
+
+	td_finalize(vm);
+
+	for (class = 0; class < TDX_EXIT_LATENCY_NR_CLASSES; class++) {
+		cycles = run_until_report(vm, vcpu);
+		printf("tdx_exit_latency model=%u:%u:%u class=%s iterations=%lu cycles=%lu\n",
+		       this_cpu_family(), this_cpu_model(),
+		       this_cpu_fms() & 0xf,
+		       tdx_exit_latency_names[class], iterations, cycles);
+	}
+
+	td_vcpu_run(vcpu);
+	TDX_TEST_ASSERT_SUCCESS(vcpu);
+
+	kvm_vm_free(vm);
+	return 0;
+}
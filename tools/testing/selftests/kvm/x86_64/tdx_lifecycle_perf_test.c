@@ -0,0 +1,216 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Create, finalize, run and destroy many TDs at the same time, one process
+ * per TD like real VMMs, and report the latency of each phase:
+ *
+ * - init:     KVM_TDX_INIT_VM, i.e. HKID allocation and key configuration
+ * - vcpus:    vCPU creation and KVM_TDX_INIT_VCPU
+ * - finalize: KVM_TDX_INIT_MEM_REGION of all memory and KVM_TDX_FINALIZE_VM
+ * - run:      first entry of each vCPU until it reports success
+ * - destroy:  HKID release with its cache write back, and page reclaim
+ *
+ * TDs failing a phase, e.g. when running out of HKIDs or over the misc cgroup
+ * limit, are counted per phase.
+ */
+#include <linux/kvm.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kvm_util_base.h"
+#include "processor.h"
+#include "tdx/tdcall.h"
+#include "tdx/tdx.h"
+#include "tdx/tdx_util.h"
+#include "tdx/test_util.h"
+#include "test_util.h"
+
+#define TDX_LIFECYCLE_TEST_GPA		(1ULL << 32)
+#define TDX_LIFECYCLE_TEST_SLOT		3
+#define TDX_LIFECYCLE_MAX_VCPUS		64
+
+enum {
+	TDX_LIFECYCLE_INIT,
+	TDX_LIFECYCLE_VCPUS,
+	TDX_LIFECYCLE_FINALIZE,
+	TDX_LIFECYCLE_RUN,
+	TDX_LIFECYCLE_DESTROY,
+	TDX_LIFECYCLE_NR_PHASES,
+};
+
+static const char * const tdx_lifecycle_names[] = {
+	[TDX_LIFECYCLE_INIT] = "init",
+	[TDX_LIFECYCLE_VCPUS] = "vcpus",
+	[TDX_LIFECYCLE_FINALIZE] = "finalize",
+	[TDX_LIFECYCLE_RUN] = "run",
+	[TDX_LIFECYCLE_DESTROY] = "destroy",
+};
+
+/* Written by each TD's process, in memory shared with the parent. */
+struct td_result {
+	int64_t ns[TDX_LIFECYCLE_NR_PHASES];
+	int nr_done;
+};
+
+static int nr_vcpus = 1;
+static uint64_t td_mem_bytes = 64 << 20;
+
+static void guest_code(void)
+{
+	tdx_test_success();
+}
+
+static void phase_done(struct td_result *r, struct timespec *start)
+{
+	r->ns[r->nr_done++] = timespec_to_ns(timespec_elapsed(*start));
+	clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+static void run_td(struct td_result *r)
+{
+	struct kvm_vcpu *vcpus[TDX_LIFECYCLE_MAX_VCPUS];
+	struct timespec start;
+	struct kvm_vm *vm;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	vm = td_create();
+	td_initialize(vm, VM_MEM_SRC_ANONYMOUS, 0);
+	phase_done(r, &start);
+
+	for (i = 0; i < nr_vcpus; i++)
+		vcpus[i] = td_vcpu_add(vm, i, guest_code);
+	phase_done(r, &start);
+
+	if (td_mem_bytes) {
+		vm_userspace_mem_region_add(vm, VM_MEM_SRC_ANONYMOUS,
+					    TDX_LIFECYCLE_TEST_GPA,
+					    TDX_LIFECYCLE_TEST_SLOT,
+					    td_mem_bytes / vm->page_size,
+					    KVM_MEM_PRIVATE);
+		virt_map(vm, TDX_LIFECYCLE_TEST_GPA, TDX_LIFECYCLE_TEST_GPA,
+			 td_mem_bytes / vm->page_size);
+	}
+	td_finalize(vm);
+	phase_done(r, &start);
+
+	for (i = 0; i < nr_vcpus; i++) {
+		td_vcpu_run(vcpus[i]);
+		TDX_TEST_ASSERT_SUCCESS(vcpus[i]);
+	}
+	phase_done(r, &start);
+
+	kvm_vm_free(vm);
+	phase_done(r, &start);
+}
+
+static void print_results(struct td_result *results, int nr_tds)
+{
+	int64_t min, max, sum;
+	int phase, i, nr, nr_started = nr_tds;
+
+	for (phase = 0; phase < TDX_LIFECYCLE_NR_PHASES; phase++) {
+		min = INT64_MAX;
+		max = sum = 0;
+		nr = 0;
+		for (i = 0; i < nr_tds; i++) {
+			if (results[i].nr_done <= phase)
+				continue;
+			min = min(min, results[i].ns[phase]);
+			max = max(max, results[i].ns[phase]);
+			sum += results[i].ns[phase];
+			nr++;
+		}
+
+		printf("tdx_lifecycle phase=%s tds=%d failed=%d", tdx_lifecycle_names[phase],
+		       nr_started, nr_started - nr);
+		if (nr)
+			printf(" min_us=%ld avg_us=%ld max_us=%ld", min / 1000,
+			       sum / nr / 1000, max / 1000);
+		printf("\n");
+
+		/*
+		 * TDs that failed a phase don't take part in the later ones,
+		 * they can be anywhere in @results.
+		 */
+		nr_started = nr;
+	}
+}
+
+static void help(char *name)
+{
+	puts("");
+	printf("usage: %s [-h] [-n tds] [-b memory] [-v vcpus]\n", name);
+	printf(" -n: specify the number of TDs created at the same time.\n"
+	       "     Default: 8\n");
+	printf(" -b: specify the size of the private memory added to each TD,\n"
+	       "     in addition to its boot memory. e.g. 10M or 3G.\n"
+	       "     Default: 64M\n");
+	printf(" -v: specify the number of vCPUs of each TD.\n");
+	puts("");
+	exit(0);
+}
+
+int main(int argc, char **argv)
+{
+	struct td_result *results;
+	int nr_tds = 8;
+	pid_t pid;
+	int opt, i;
+
+	if (!is_tdx_enabled()) {
+		printf("TDX is not supported by the KVM\n"
+		       "Skipping the TDX tests.\n");
+		return 0;
+	}
+
+	while ((opt = getopt(argc, argv, "hn:b:v:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_tds = atoi_positive("Number of TDs", optarg);
+			break;
+		case 'b':
+			td_mem_bytes = parse_size(optarg);
+			break;
+		case 'v':
+			nr_vcpus = atoi_positive("Number of vCPUs", optarg);
+			TEST_ASSERT(nr_vcpus <= TDX_LIFECYCLE_MAX_VCPUS,
+				    "Invalid number of vcpus, must be between 1 and %d",
+				    TDX_LIFECYCLE_MAX_VCPUS);
+			break;
+		case 'h':
+		default:
+			help(argv[0]);
+			break;
+		}
+	}
+
+	TEST_ASSERT(!(td_mem_bytes % PAGE_SIZE),
+		    "Memory size must be a multiple of the page size");
+
+	/* Disable stdout buffering */
+	setbuf(stdout, NULL);
+
+	results = mmap(NULL, nr_tds * sizeof(*results), PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	TEST_ASSERT(results != MAP_FAILED, "mmap() failed");
+	memset(results, 0, nr_tds * sizeof(*results));
+
+	/* A TD failing a phase asserts, which only ends its own process. */
+	for (i = 0; i < nr_tds; i++) {
+		pid = fork();
+		TEST_ASSERT(pid >= 0, "fork() failed");
+		if (!pid) {
+			run_td(&results[i]);
+			exit(0);
+		}
+	}
+	while (wait(NULL) > 0)
+		;
+
+	print_results(results, nr_tds);
+	munmap(results, nr_tds * sizeof(*results));
+	return 0;
+}
@@ -0,0 +1,628 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Live migrate a TD to another TD on the same host through N pairs of
+ * tdx_mig_stream devices, and measure:
+ *
+ * - export and import throughput of each stream, i.e. GiB/s spent in
+ *   KVM_TDX_MIG_EXPORT_MEM and KVM_TDX_MIG_IMPORT_MEM
+ * - write blocking, i.e. the dirty log ioctls doing TDH.EXPORT.BLOCKW, and the
+ *   epoch stats of each pre-copy round
+ * - epoch overhead, i.e. KVM_TDX_MIG_EXPORT_TRACK and KVM_TDX_MIG_IMPORT_TRACK
+ * - downtime, from KVM_TDX_MIG_EXPORT_PAUSE to KVM_TDX_MIG_IMPORT_END
+ *
+ * The source TD writes a working set of its private memory at a given rate
+ * during pre-copy.  The migration session key is negotiated by the MigTDs
+ * bound to the two TDs, which aren't part of the test: launch them first,
+ * e.g. with a VMM, and pass their pids.
+ */
+#include <linux/bitmap.h>
+#include <linux/kvm.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kvm_util_base.h"
+#include "processor.h"
+#include "tdx/tdcall.h"
+#include "tdx/tdx.h"
+#include "tdx/tdx_util.h"
+#include "tdx/test_util.h"
+#include "test_util.h"
+
+#define TDX_MIG_TEST_GPA		(1ULL << 32)
+#define TDX_MIG_TEST_SLOT		3
+#define TDX_MIG_TEST_MAX_STREAMS	16
+/* The guest exits to userspace after this many writes, to be stopped. */
+#define TDX_MIG_TEST_REPORT_WRITES	512
+
+/* Same layout as the GPA list entries of the TDX module. */
+union tdx_mig_gpa_list_entry {
+	uint64_t val;
+	struct {
+		uint64_t level		: 2;
+		uint64_t pending	: 1;
+		uint64_t reserved_0	: 4;
+		uint64_t l2_map		: 3;
+		uint64_t mig_type	: 2;
+		uint64_t gfn		: 40;
+#define GPA_LIST_OP_EXPORT	1
+		uint64_t operation	: 2;
+		uint64_t reserved_1	: 2;
+		uint64_t status		: 5;
+		uint64_t reserved_2	: 3;
+	};
+};
+
+struct mig_stream {
+	int fd;
+	/* The MBMD, the GPA list, the MAC lists and then the buffers */
+	void *map;
+	uint32_t buf_pages;
+};
+
+#define mig_stream_page(s, offset)	((s)->map + (offset) * PAGE_SIZE)
+
+struct mig_stream_pair {
+	struct mig_stream src;
+	struct mig_stream dst;
+	pthread_t thread;
+	/* The GFNs to migrate in the current round */
+	uint64_t *gfns;
+	uint64_t nr_gfns;
+	uint64_t nr_pages;
+	uint64_t export_ns;
+	uint64_t import_ns;
+};
+
+/*
+ * Shared variables between guest and host
+ */
+static uint64_t test_ws_pages;
+static uint64_t test_write_delay;
+
+static int nr_streams = 1;
+static struct mig_stream_pair streams[TDX_MIG_TEST_MAX_STREAMS];
+static bool vcpu_stop;
+
+static void guest_code(void)
+{
+	uint64_t n, start;
+
+	for (n = 0;; n++) {
+		if (test_ws_pages)
+			*(volatile uint64_t *)(TDX_MIG_TEST_GPA +
+					       (n % test_ws_pages) * PAGE_SIZE) = n;
+
+		start = rdtsc();
+		while (rdtsc() - start < test_write_delay)
+			asm volatile("pause");
+
+		if (!(n % TDX_MIG_TEST_REPORT_WRITES))
+			tdx_test_report_to_user_space(0);
+	}
+}
+
+static void *vcpu_thread_main(void *data)
+{
+	struct kvm_vcpu *vcpu = data;
+
+	while (!READ_ONCE(vcpu_stop)) {
+		vcpu_run(vcpu);
+		TDX_TEST_CHECK_GUEST_FAILURE(vcpu);
+		TDX_TEST_ASSERT_IO(vcpu, TDX_TEST_REPORT_PORT, TDX_TEST_REPORT_SIZE,
+				   TDG_VP_VMCALL_INSTRUCTION_IO_WRITE);
+	}
+
+	return NULL;
+}
+
+static uint64_t elapsed_ns(struct timespec start)
+{
+	return timespec_to_ns(timespec_elapsed(start));
+}
+
+static void tdx_vm_cmd(struct kvm_vm *vm, uint32_t id, uint32_t flags,
+		       void *data)
+{
+	struct kvm_tdx_cmd cmd = {
+		.id = id,
+		.flags = flags,
+		.data = (uint64_t)data,
+	};
+
+	vm_ioctl(vm, KVM_MEMORY_ENCRYPT_OP, &cmd);
+}
+
+static void mig_stream_cmd(struct mig_stream *s, uint32_t id, void *data)
+{
+	struct kvm_tdx_cmd cmd = {
+		.id = id,
+		.data = (uint64_t)data,
+	};
+	int ret;
+
+	ret = ioctl(s->fd, KVM_MEMORY_ENCRYPT_OP, &cmd);
+	TEST_ASSERT(!ret,
+		    "tdx_mig_stream command %u failed, rc: %i errno: %i (%s) error: 0x%llx",
+		    id, ret, errno, strerror(errno), cmd.error);
+}
+
+static void mig_stream_create(struct kvm_vm *vm, struct mig_stream *s)
+{
+	struct kvm_dev_tdx_mig_attr attr = {
+		.version = KVM_DEV_TDX_MIG_ATTR_VERSION,
+		.buf_list_pages = TDX_MIG_BUF_LIST_PAGES_MAX,
+	};
+
+	s->fd = kvm_create_device(vm, KVM_DEV_TYPE_TDX_MIG_STREAM);
+	kvm_device_attr_set(s->fd, KVM_DEV_TDX_MIG_ATTR, sizeof(attr), &attr);
+	kvm_device_attr_get(s->fd, KVM_DEV_TDX_MIG_ATTR, sizeof(attr), &attr);
+	s->buf_pages = attr.buf_list_pages;
+
+	s->map = mmap(NULL,
+		      (TDX_MIG_STREAM_BUF_LIST_MAP_OFFSET + s->buf_pages) * PAGE_SIZE,
+		      PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+	TEST_ASSERT(s->map != MAP_FAILED, "mmap() of tdx_mig_stream failed");
+}
+
+/* "Send" pages of the source stream, i.e. copy them to the destination. */
+static void mig_stream_send(struct mig_stream_pair *p, uint64_t offset,
+			    uint64_t npages)
+{
+	memcpy(mig_stream_page(&p->dst, offset),
+	       mig_stream_page(&p->src, offset), npages * PAGE_SIZE);
+}
+
+/* Send the MBMD and the state pages of a TD-scope or vCPU-scope export. */
+static void mig_stream_send_state(struct mig_stream_pair *p, uint64_t npages)
+{
+	mig_stream_send(p, TDX_MIG_STREAM_MBMD_MAP_OFFSET, 1);
+	mig_stream_send(p, TDX_MIG_STREAM_BUF_LIST_MAP_OFFSET, npages);
+}
+
+static void mig_stream_migrate_mem(struct mig_stream_pair *p, uint64_t *gfns,
+				   uint64_t nr_gfns)
+{
+	union tdx_mig_gpa_list_entry *gpa_list =
+		mig_stream_page(&p->src, TDX_MIG_STREAM_GPA_LIST_MAP_OFFSET);
+	struct timespec start;
+	uint64_t i, npages;
+
+	memset(gpa_list, 0, nr_gfns * sizeof(*gpa_list));
+	for (i = 0; i < nr_gfns; i++) {
+		gpa_list[i].gfn = gfns[i];
+		gpa_list[i].operation = GPA_LIST_OP_EXPORT;
+	}
+
+	npages = nr_gfns;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	mig_stream_cmd(&p->src, KVM_TDX_MIG_EXPORT_MEM, &npages);
+	p->export_ns += elapsed_ns(start);
+	p->nr_pages += npages;
+
+	mig_stream_send(p, TDX_MIG_STREAM_MBMD_MAP_OFFSET, 1);
+	mig_stream_send(p, TDX_MIG_STREAM_GPA_LIST_MAP_OFFSET, 1);
+	mig_stream_send(p, TDX_MIG_STREAM_MAC_LIST_MAP_OFFSET,
+			p->src.buf_pages > 256 ? 2 : 1);
+	mig_stream_send(p, TDX_MIG_STREAM_BUF_LIST_MAP_OFFSET, npages);
+
+	npages = nr_gfns;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	mig_stream_cmd(&p->dst, KVM_TDX_MIG_IMPORT_MEM, &npages);
+	p->import_ns += elapsed_ns(start);
+}
+
+static void *mig_stream_thread_main(void *data)
+{
+	struct mig_stream_pair *p = data;
+	uint64_t i, n;
+
+	for (i = 0; i < p->nr_gfns; i += n) {
+		n = min_t(uint64_t, p->nr_gfns - i, p->src.buf_pages);
+		mig_stream_migrate_mem(p, &p->gfns[i], n);
+	}
+
+	return NULL;
+}
+
+/* Migrate the GFNs with all the streams in parallel. */
+static void migrate_gfns(uint64_t *gfns, uint64_t nr_gfns)
+{
+	uint64_t per_stream = DIV_ROUND_UP(nr_gfns, nr_streams);
+	uint64_t offset = 0;
+	int i;
+
+	for (i = 0; i < nr_streams; i++) {
+		streams[i].gfns = &gfns[offset];
+		streams[i].nr_gfns = min_t(uint64_t, per_stream, nr_gfns - offset);
+		offset += streams[i].nr_gfns;
+		pthread_create(&streams[i].thread, NULL, mig_stream_thread_main,
+			       &streams[i]);
+	}
+	for (i = 0; i < nr_streams; i++)
+		pthread_join(streams[i].thread, NULL);
+}
+
+/* End the epoch on both sides, @in_order for the start token. */
+static uint64_t migrate_track(uint64_t in_order)
+{
+	struct mig_stream_pair *p = &streams[0];
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	mig_stream_cmd(&p->src, KVM_TDX_MIG_EXPORT_TRACK, &in_order);
+	mig_stream_send(p, TDX_MIG_STREAM_MBMD_MAP_OFFSET, 1);
+	mig_stream_cmd(&p->dst, KVM_TDX_MIG_IMPORT_TRACK, NULL);
+	return elapsed_ns(start);
+}
+
+#define for_each_private_region(vm, bkt, region)			\
+	hash_for_each((vm)->regions.slot_hash, bkt, region, slot_node)	\
+		if (region->region.flags & KVM_MEM_PRIVATE)
+
+/*
+ * Collect the GFNs of all the private memory with @all, otherwise the dirty
+ * ones, which write blocks them, in @blockw_ns.  Returns the number of GFNs.
+ */
+static uint64_t collect_gfns(struct kvm_vm *vm, uint64_t *gfns, bool all,
+			     uint64_t *blockw_ns)
+{
+	struct userspace_mem_region *region;
+	unsigned long *bitmap;
+	struct timespec start;
+	uint64_t i, npages, base, nr = 0;
+	int bkt;
+
+	if (!all)
+		*blockw_ns = 0;
+	for_each_private_region(vm, bkt, region) {
+		npages = region->region.memory_size / vm->page_size;
+		base = region->region.guest_phys_addr / vm->page_size;
+
+		if (all) {
+			for (i = 0; i < npages; i++)
+				gfns[nr++] = base + i;
+			continue;
+		}
+
+		bitmap = bitmap_zalloc(npages);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		kvm_vm_get_dirty_log(vm, region->region.slot, bitmap);
+		*blockw_ns += elapsed_ns(start);
+
+		for (i = 0; i < npages; i++) {
+			if (test_bit(i, bitmap))
+				gfns[nr++] = base + i;
+		}
+		free(bitmap);
+	}
+
+	return nr;
+}
+
+/* Write blocks all the private pages. */
+static uint64_t enable_dirty_logging(struct kvm_vm *vm)
+{
+	struct userspace_mem_region *region;
+	struct timespec start;
+	int bkt;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for_each_private_region(vm, bkt, region)
+		vm_mem_region_set_flags(vm, region->region.slot,
+					region->region.flags | KVM_MEM_LOG_DIRTY_PAGES);
+	return elapsed_ns(start);
+}
+
+static void bind_migtd(struct kvm_vm *vm, pid_t pid, bool is_src,
+		       uint32_t vsock_port)
+{
+	struct kvm_tdx_servtd servtd = {
+		.version = KVM_TDX_SERVTD_VERSION,
+		.type = KVM_TDX_SERVTD_TYPE_MIGTD,
+		.pid = pid,
+	};
+	struct kvm_tdx_set_migration_info info = {
+		.version = KVM_TDX_SET_MIGRATION_INFO_VERSION,
+		.is_src = is_src,
+		.vsock_port = vsock_port,
+	};
+
+	tdx_vm_cmd(vm, KVM_TDX_SERVTD_BIND, 0, &servtd);
+	tdx_vm_cmd(vm, KVM_TDX_SET_MIGRATION_INFO, 0, &info);
+}
+
+/* Wait for the MigTD to set up the migration session key. */
+static void wait_premig_done(struct kvm_vm *vm)
+{
+	struct kvm_tdx_get_migration_info info = {
+		.version = KVM_TDX_GET_MIGRATION_INFO_VERSION,
+	};
+
+	for (;;) {
+		tdx_vm_cmd(vm, KVM_TDX_GET_MIGRATION_INFO, 0, &info);
+		if (info.premig_done)
+			break;
+		usleep(1000);
+	}
+}
+
+/*
+ * The destination TD has the memslots of the source TD, and is initialized
+ * from the imported state instead of by KVM_TDX_INIT_VCPU and
+ * KVM_TDX_FINALIZE_VM.
+ */
+static struct kvm_vm *td_create_destination(struct kvm_vm *src,
+					    struct kvm_vcpu **vcpu)
+{
+	const struct kvm_cpuid2 *cpuid = kvm_get_supported_cpuid();
+	struct userspace_mem_region *region;
+	struct kvm_tdx_init_vm *init_vm;
+	struct kvm_vm *vm;
+	int bkt;
+
+	vm = td_create();
+	hash_for_each(src->regions.slot_hash, bkt, region, slot_node)
+		vm_userspace_mem_region_add(vm, region->backing_src_type,
+					    region->region.guest_phys_addr,
+					    region->region.slot,
+					    region->region.memory_size / vm->page_size,
+					    region->region.flags & ~KVM_MEM_LOG_DIRTY_PAGES);
+
+	init_vm = calloc(1, sizeof(*init_vm) +
+			    cpuid->nent * sizeof(cpuid->entries[0]));
+	TEST_ASSERT(init_vm, "Could not allocate memory for INIT_VM");
+	memcpy(&init_vm->cpuid, cpuid, sizeof(*cpuid) +
+	       cpuid->nent * sizeof(cpuid->entries[0]));
+	tdx_vm_cmd(vm, KVM_TDX_INIT_VM, KVM_TDX_INIT_VM_F_POST_INIT, init_vm);
+	free(init_vm);
+
+	*vcpu = __vm_vcpu_add(vm, 0);
+	vcpu_init_cpuid(*vcpu, cpuid);
+	return vm;
+}
+
+/* Copy the shared memory, which isn't migrated by the TDX module. */
+static void copy_shared_memory(struct kvm_vm *src, struct kvm_vm *dst)
+{
+	struct userspace_mem_region *region;
+	int bkt;
+
+	hash_for_each(src->regions.slot_hash, bkt, region, slot_node) {
+		if (region->region.flags & KVM_MEM_PRIVATE)
+			continue;
+		memcpy(addr_gpa2hva(dst, region->region.guest_phys_addr),
+		       region->host_mem, region->region.memory_size);
+	}
+}
+
+static double gib_per_sec(uint64_t pages, uint64_t ns)
+{
+	if (!ns)
+		return 0;
+	return (double)pages * PAGE_SIZE / (1ULL << 30) / (ns / 1000000000.0);
+}
+
+static void help(char *name)
+{
+	puts("");
+	printf("usage: %s [-h] -m pid -M pid [-p port] [-b memory] [-n streams]\n"
+	       "          [-w working set] [-d delay] [-i rounds] [-t pages]\n",
+	       name);
+	printf(" -m: specify the pid of the MigTD of the source TD.\n");
+	printf(" -M: specify the pid of the MigTD of the destination TD.\n");
+	printf(" -p: specify the vsock port the MigTDs connect on.\n"
+	       "     Default: 18001\n");
+	printf(" -b: specify the size of the private memory added to the TD,\n"
+	       "     in addition to its boot memory. e.g. 10M or 3G.\n"
+	       "     Default: 1G\n");
+	printf(" -n: specify the number of migration streams.\n"
+	       "     Default: 1\n");
+	printf(" -w: specify the size of the memory written by the TD during\n"
+	       "     pre-copy. e.g. 10M.\n"
+	       "     Default: 64M\n");
+	printf(" -d: specify the delay between two writes of the TD, in TSC\n"
+	       "     cycles, i.e. the dirty rate.\n"
+	       "     Default: 0\n");
+	printf(" -i: specify the maximum number of pre-copy rounds.\n"
+	       "     Default: 8\n");
+	printf(" -t: specify the number of dirty pages below which pre-copy\n"
+	       "     stops.\n"
+	       "     Default: 512\n");
+	puts("");
+	exit(0);
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t mem_bytes = 1ULL << 30, ws_bytes = 64 << 20, write_delay = 0;
+	uint64_t nr_gfns, nr_pages, blockw_ns, track_ns, npages;
+	int max_rounds = 8, stop_pages = 512, round, opt, i;
+	struct kvm_tdx_mig_epoch_stats stats;
+	struct kvm_vcpu *src_vcpu, *dst_vcpu;
+	pid_t src_migtd = 0, dst_migtd = 0;
+	struct userspace_mem_region *region;
+	struct kvm_vm *src_vm, *dst_vm;
+	uint32_t vsock_port = 18001;
+	struct timespec downtime;
+	pthread_t vcpu_thread;
+	uint64_t *gfns;
+	int bkt;
+
+	if (!is_tdx_enabled()) {
+		printf("TDX is not supported by the KVM\n"
+		       "Skipping the TDX tests.\n");
+		return 0;
+	}
+
+	while ((opt = getopt(argc, argv, "hm:M:p:b:n:w:d:i:t:")) != -1) {
+		switch (opt) {
+		case 'm':
+			src_migtd = atoi_positive("Source MigTD pid", optarg);
+			break;
+		case 'M':
+			dst_migtd = atoi_positive("Destination MigTD pid", optarg);
+			break;
+		case 'p':
+			vsock_port = atoi_positive("vsock port", optarg);
+			break;
+		case 'b':
+			mem_bytes = parse_size(optarg);
+			break;
+		case 'n':
+			nr_streams = atoi_positive("Number of streams", optarg);
+			TEST_ASSERT(nr_streams <= TDX_MIG_TEST_MAX_STREAMS,
+				    "Invalid number of streams, must be between 1 and %d",
+				    TDX_MIG_TEST_MAX_STREAMS);
+			break;
+		case 'w':
+			ws_bytes = parse_size(optarg);
+			break;
+		case 'd':
+			write_delay = atoi_non_negative("Write delay", optarg);
+			break;
+		case 'i':
+			max_rounds = atoi_positive("Number of rounds", optarg);
+			break;
+		case 't':
+			stop_pages = atoi_non_negative("Dirty pages", optarg);
+			break;
+		case 'h':
+		default:
+			help(argv[0]);
+			break;
+		}
+	}
+
+	if (!src_migtd || !dst_migtd) {
+		printf("The MigTDs are not specified, see -h\n"
+		       "Skipping the TDX migration test.\n");
+		return 0;
+	}
+
+	TEST_ASSERT(mem_bytes && !(mem_bytes % PAGE_SIZE),
+		    "Memory size must be a multiple of the page size");
+	TEST_ASSERT(ws_bytes <= mem_bytes,
+		    "The working set must fit in the memory");
+
+	/* Disable stdout buffering */
+	setbuf(stdout, NULL);
+
+	src_vm = td_create();
+	td_initialize(src_vm, VM_MEM_SRC_ANONYMOUS, 0);
+	src_vcpu = td_vcpu_add(src_vm, 0, guest_code);
+
+	vm_userspace_mem_region_add(src_vm, VM_MEM_SRC_ANONYMOUS,
+				    TDX_MIG_TEST_GPA, TDX_MIG_TEST_SLOT,
+				    mem_bytes / src_vm->page_size,
+				    KVM_MEM_PRIVATE);
+	virt_map(src_vm, TDX_MIG_TEST_GPA, TDX_MIG_TEST_GPA,
+		 mem_bytes / src_vm->page_size);
+
+	test_ws_pages = ws_bytes / PAGE_SIZE;
+	test_write_delay = write_delay;
+	sync_global_to_guest(src_vm, test_ws_pages);
+	sync_global_to_guest(src_vm, test_write_delay);
+
+	bind_migtd(src_vm, src_migtd, true, vsock_port);
+	td_finalize(src_vm);
+
+	dst_vm = td_create_destination(src_vm, &dst_vcpu);
+	bind_migtd(dst_vm, dst_migtd, false, vsock_port);
+
+	wait_premig_done(src_vm);
+	wait_premig_done(dst_vm);
+
+	for (i = 0; i < nr_streams; i++) {
+		mig_stream_create(src_vm, &streams[i].src);
+		mig_stream_create(dst_vm, &streams[i].dst);
+	}
+
+	npages = 0;
+	mig_stream_cmd(&streams[0].src, KVM_TDX_MIG_EXPORT_STATE_IMMUTABLE,
+		       &npages);
+	mig_stream_send_state(&streams[0], npages);
+	mig_stream_cmd(&streams[0].dst, KVM_TDX_MIG_IMPORT_STATE_IMMUTABLE,
+		       &npages);
+
+	nr_pages = 0;
+	for_each_private_region(src_vm, bkt, region)
+		nr_pages += region->region.memory_size / src_vm->page_size;
+	gfns = calloc(nr_pages, sizeof(*gfns));
+	TEST_ASSERT(gfns, "Could not allocate memory for the GFNs");
+
+	pr_info("Migrating %lu MiB of private memory, %lu MiB written at a delay of %lu cycles, %d streams\n",
+		nr_pages * PAGE_SIZE >> 20, ws_bytes >> 20, write_delay,
+		nr_streams);
+
+	pthread_create(&vcpu_thread, NULL, vcpu_thread_main, src_vcpu);
+
+	/* Pre-copy, the first round migrates all the private memory. */
+	blockw_ns = enable_dirty_logging(src_vm);
+	nr_gfns = collect_gfns(src_vm, gfns, true, NULL);
+	for (round = 0;; round++) {
+		migrate_gfns(gfns, nr_gfns);
+
+		/* A page is exported at most once per epoch. */
+		track_ns = migrate_track(0);
+		mig_stream_cmd(&streams[0].src, KVM_TDX_MIG_GET_EPOCH_STATS,
+			       &stats);
+		printf("tdx_mig round=%d pages=%lu blockw_us=%lu track_us=%lu epoch_us=%llu pages_blocked=%llu pages_redirtied=%llu pages_exported=%llu\n",
+		       round, nr_gfns, blockw_ns / 1000, track_ns / 1000,
+		       stats.duration_ns / 1000, stats.pages_blocked,
+		       stats.pages_redirtied, stats.pages_exported);
+
+		nr_gfns = collect_gfns(src_vm, gfns, false, &blockw_ns);
+		if (round + 1 >= max_rounds || nr_gfns < stop_pages)
+			break;
+	}
+
+	/* Stop-and-copy */
+	WRITE_ONCE(vcpu_stop, true);
+	pthread_join(vcpu_thread, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &downtime);
+	mig_stream_cmd(&streams[0].src, KVM_TDX_MIG_EXPORT_PAUSE, NULL);
+
+	/* The pages written since the last round, up to the pause. */
+	nr_gfns = collect_gfns(src_vm, gfns, false, &blockw_ns);
+	migrate_gfns(gfns, nr_gfns);
+	copy_shared_memory(src_vm, dst_vm);
+
+	npages = 0;
+	mig_stream_cmd(&streams[0].src, KVM_TDX_MIG_EXPORT_STATE_TD, &npages);
+	mig_stream_send_state(&streams[0], npages);
+	mig_stream_cmd(&streams[0].dst, KVM_TDX_MIG_IMPORT_STATE_TD, &npages);
+
+	npages = 0;
+	mig_stream_cmd(&streams[0].src, KVM_TDX_MIG_EXPORT_STATE_VP, &npages);
+	mig_stream_send_state(&streams[0], npages);
+	mig_stream_cmd(&streams[0].dst, KVM_TDX_MIG_IMPORT_STATE_VP, &npages);
+
+	/* The start token, the destination TD can run once it's imported. */
+	track_ns = migrate_track(1);
+	mig_stream_cmd(&streams[0].dst, KVM_TDX_MIG_IMPORT_END, NULL);
+
+	printf("tdx_mig downtime_us=%lu final_pages=%lu blockw_us=%lu track_us=%lu\n",
+	       elapsed_ns(downtime) / 1000, nr_gfns, blockw_ns / 1000,
+	       track_ns / 1000);
+	for (i = 0; i < nr_streams; i++)
+		printf("tdx_mig stream=%d pages=%lu export_gibps=%.3f import_gibps=%.3f\n",
+		       i, streams[i].nr_pages,
+		       gib_per_sec(streams[i].nr_pages, streams[i].export_ns),
+		       gib_per_sec(streams[i].nr_pages, streams[i].import_ns));
+
+	/* The migrated TD keeps writing, until its next report. */
+	vcpu_run(dst_vcpu);
+	TDX_TEST_CHECK_GUEST_FAILURE(dst_vcpu);
+	TDX_TEST_ASSERT_IO(dst_vcpu, TDX_TEST_REPORT_PORT, TDX_TEST_REPORT_SIZE,
+			   TDG_VP_VMCALL_INSTRUCTION_IO_WRITE);
+
+	free(gfns);
+	kvm_vm_free(dst_vm);
+	kvm_vm_free(src_vm);
+	return 0;
+}
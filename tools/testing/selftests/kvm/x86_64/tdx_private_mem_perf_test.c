@@ -0,0 +1,261 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Measure the cost of TD private memory: each vCPU converts its own region of
+ * private memory to shared and back, then accepts it page by page, i.e. via
+ * TDH.MEM.PAGE.AUG on the EPT violation of each TDG.MEM.PAGE.ACCEPT, and the
+ * TD is torn down at the end.  All vCPUs start each phase together, the time
+ * of a phase is the time of its slowest vCPU.
+ */
+#include <linux/kvm.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "kvm_util_base.h"
+#include "processor.h"
+#include "tdx/tdcall.h"
+#include "tdx/tdx.h"
+#include "tdx/tdx_util.h"
+#include "tdx/test_util.h"
+#include "test_util.h"
+
+#define TDX_PERF_TEST_GPA	(1ULL << 32)
+#define TDX_PERF_TEST_SLOT	3
+#define TDX_PERF_TEST_MAX_VCPUS	64
+
+#define MEM_PAGE_ACCEPT_LEVEL_4K 0
+
+enum {
+	TDX_PERF_STAGE_TO_SHARED = 1,
+	TDX_PERF_STAGE_TO_PRIVATE,
+	TDX_PERF_STAGE_ACCEPT,
+	TDX_PERF_NR_STAGES,
+};
+
+static const char * const tdx_perf_stage_names[] = {
+	[TDX_PERF_STAGE_TO_SHARED] = "convert to shared",
+	[TDX_PERF_STAGE_TO_PRIVATE] = "convert to private",
+	[TDX_PERF_STAGE_ACCEPT] = "accept (AUG)",
+};
+
+/*
+ * Shared variables between guest and host.  TDs can't take arguments in
+ * registers, each vCPU picks its region by the order it starts in.
+ */
+static uint64_t test_s_bit;
+static uint64_t test_percpu_bytes;
+static uint32_t test_next_vcpu;
+
+static int nr_vcpus = 1;
+static pthread_barrier_t stage_barrier;
+static struct timespec stage_time[TDX_PERF_TEST_MAX_VCPUS][TDX_PERF_NR_STAGES];
+
+#define TDX_PERF_TEST_ASSERT(x)				\
+	do {						\
+		if (!(x))				\
+			tdx_test_fatal(__LINE__);	\
+	} while (0)
+
+static void guest_code(void)
+{
+	uint32_t idx = __atomic_fetch_add(&test_next_vcpu, 1, __ATOMIC_RELAXED);
+	uint64_t gpa = TDX_PERF_TEST_GPA + idx * test_percpu_bytes;
+	uint64_t failed_gpa;
+	uint64_t offset;
+
+	TDX_PERF_TEST_ASSERT(!tdg_vp_vmcall_map_gpa(gpa | test_s_bit,
+						    test_percpu_bytes,
+						    &failed_gpa));
+	tdx_test_report_to_user_space(TDX_PERF_STAGE_TO_SHARED);
+
+	TDX_PERF_TEST_ASSERT(!tdg_vp_vmcall_map_gpa(gpa, test_percpu_bytes,
+						    &failed_gpa));
+	tdx_test_report_to_user_space(TDX_PERF_STAGE_TO_PRIVATE);
+
+	/* The GVA of the test region is identity mapped. */
+	for (offset = 0; offset < test_percpu_bytes; offset += PAGE_SIZE) {
+		TDX_PERF_TEST_ASSERT(!tdg_mem_page_accept(gpa + offset,
+							  MEM_PAGE_ACCEPT_LEVEL_4K));
+		*(volatile uint64_t *)(gpa + offset) = offset;
+	}
+	tdx_test_report_to_user_space(TDX_PERF_STAGE_ACCEPT);
+
+	tdx_test_success();
+}
+
+static void run_until_report(struct kvm_vm *vm, struct kvm_vcpu *vcpu,
+			     uint32_t stage)
+{
+	struct kvm_tdx_vmcall *vmcall_info = &vcpu->run->tdx.u.vmcall;
+	uint64_t gpa;
+
+	for (;;) {
+		vcpu_run(vcpu);
+		if (vcpu->run->exit_reason != KVM_EXIT_TDX ||
+		    vcpu->run->tdx.type != KVM_EXIT_TDX_VMCALL ||
+		    vmcall_info->subfunction != TDG_VP_VMCALL_MAP_GPA)
+			break;
+
+		gpa = vmcall_info->in_r12 & ~vm->arch.s_bit;
+		handle_memory_conversion(vm, gpa, vmcall_info->in_r13,
+					 !(vm->arch.s_bit & vmcall_info->in_r12));
+		if (vm->arch.s_bit & vmcall_info->in_r12)
+			vm_guest_mem_punch_hole(vm, gpa, vmcall_info->in_r13);
+		vmcall_info->status_code = 0;
+	}
+
+	TDX_TEST_CHECK_GUEST_FAILURE(vcpu);
+	TDX_TEST_ASSERT_IO(vcpu, TDX_TEST_REPORT_PORT, TDX_TEST_REPORT_SIZE,
+			   TDG_VP_VMCALL_INSTRUCTION_IO_WRITE);
+	TEST_ASSERT_EQ(*(uint32_t *)((void *)vcpu->run + vcpu->run->io.data_offset),
+		       stage);
+}
+
+struct vcpu_thread {
+	struct kvm_vm *vm;
+	struct kvm_vcpu *vcpu;
+	int idx;
+	pthread_t thread;
+};
+
+static void *vcpu_thread_main(void *data)
+{
+	struct vcpu_thread *t = data;
+	struct timespec start;
+	uint32_t stage;
+
+	for (stage = TDX_PERF_STAGE_TO_SHARED; stage < TDX_PERF_NR_STAGES;
+	     stage++) {
+		pthread_barrier_wait(&stage_barrier);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		run_until_report(t->vm, t->vcpu, stage);
+		stage_time[t->idx][stage] = timespec_elapsed(start);
+	}
+
+	vcpu_run(t->vcpu);
+	TDX_TEST_CHECK_GUEST_FAILURE(t->vcpu);
+	TDX_TEST_ASSERT_SUCCESS(t->vcpu);
+	return NULL;
+}
+
+static void print_rate(const char *name, struct timespec ts, uint64_t bytes)
+{
+	double secs = timespec_to_ns(ts) / 1000000000.0;
+	double gib = (double)bytes / (1ULL << 30);
+
+	pr_info("%-20s %ld.%.9lds, %.3f s/GiB, %.0f pages/s\n", name,
+		ts.tv_sec, ts.tv_nsec, secs / gib,
+		(bytes / PAGE_SIZE) / secs);
+}
+
+static void run_test(uint64_t percpu_bytes, enum vm_mem_backing_src_type src_type)
+{
+	uint64_t bytes = percpu_bytes * nr_vcpus;
+	struct vcpu_thread threads[TDX_PERF_TEST_MAX_VCPUS];
+	struct timespec start, ts;
+	uint32_t stage;
+	struct kvm_vm *vm;
+	int i;
+
+	vm = td_create();
+	td_initialize(vm, VM_MEM_SRC_ANONYMOUS, 0);
+	for (i = 0; i < nr_vcpus; i++) {
+		threads[i].vm = vm;
+		threads[i].idx = i;
+		threads[i].vcpu = td_vcpu_add(vm, i, guest_code);
+	}
+
+	vm_userspace_mem_region_add(vm, src_type, TDX_PERF_TEST_GPA,
+				    TDX_PERF_TEST_SLOT, bytes / vm->page_size,
+				    KVM_MEM_PRIVATE);
+	virt_map(vm, TDX_PERF_TEST_GPA, TDX_PERF_TEST_GPA,
+		 bytes / vm->page_size);
+
+	test_s_bit = vm->arch.s_bit;
+	test_percpu_bytes = percpu_bytes;
+	sync_global_to_guest(vm, test_s_bit);
+	sync_global_to_guest(vm, test_percpu_bytes);
+
+	td_finalize(vm);
+
+	pr_info("Testing %d vCPUs, %lu MiB of private memory each\n",
+		nr_vcpus, percpu_bytes >> 20);
+
+	pthread_barrier_init(&stage_barrier, NULL, nr_vcpus);
+	for (i = 0; i < nr_vcpus; i++)
+		pthread_create(&threads[i].thread, NULL, vcpu_thread_main,
+			       &threads[i]);
+	for (i = 0; i < nr_vcpus; i++)
+		pthread_join(threads[i].thread, NULL);
+	pthread_barrier_destroy(&stage_barrier);
+
+	for (stage = TDX_PERF_STAGE_TO_SHARED; stage < TDX_PERF_NR_STAGES;
+	     stage++) {
+		ts = stage_time[0][stage];
+		for (i = 1; i < nr_vcpus; i++) {
+			if (timespec_to_ns(stage_time[i][stage]) > timespec_to_ns(ts))
+				ts = stage_time[i][stage];
+		}
+		print_rate(tdx_perf_stage_names[stage], ts, bytes);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	kvm_vm_free(vm);
+	print_rate("teardown", timespec_elapsed(start), bytes);
+}
+
+static void help(char *name)
+{
+	puts("");
+	printf("usage: %s [-h] [-b memory] [-s type] [-v vcpus]\n", name);
+	printf(" -b: specify the size of the private memory region of each\n"
+	       "     vCPU. e.g. 10M or 3G.\n"
+	       "     Default: 256M\n");
+	backing_src_help("-s");
+	printf(" -v: specify the number of vCPUs to run.\n");
+	puts("");
+	exit(0);
+}
+
+int main(int argc, char **argv)
+{
+	enum vm_mem_backing_src_type src_type = DEFAULT_VM_MEM_SRC;
+	uint64_t percpu_bytes = 256 << 20;
+	int opt;
+
+	if (!is_tdx_enabled()) {
+		printf("TDX is not supported by the KVM\n"
+		       "Skipping the TDX tests.\n");
+		return 0;
+	}
+
+	while ((opt = getopt(argc, argv, "hb:s:v:")) != -1) {
+		switch (opt) {
+		case 'b':
+			percpu_bytes = parse_size(optarg);
+			break;
+		case 's':
+			src_type = parse_backing_src_type(optarg);
+			break;
+		case 'v':
+			nr_vcpus = atoi_positive("Number of vCPUs", optarg);
+			TEST_ASSERT(nr_vcpus <= TDX_PERF_TEST_MAX_VCPUS,
+				    "Invalid number of vcpus, must be between 1 and %d",
+				    TDX_PERF_TEST_MAX_VCPUS);
+			break;
+		case 'h':
+		default:
+			help(argv[0]);
+			break;
+		}
+	}
+
+	TEST_ASSERT(percpu_bytes && !(percpu_bytes % PAGE_SIZE),
+		    "Memory size must be a multiple of the page size");
+
+	/* Disable stdout buffering */
+	setbuf(stdout, NULL);
+
+	run_test(percpu_bytes, src_type);
+	return 0;
+}
@@ -42,6 +42,21 @@ void kvm_async_pf_vcpu_init(struct kvm_vcpu *vcpu)
 	spin_lock_init(&vcpu->async_pf.lock);
 }
 
+/* Wait for the guest_memfd page of @gfn to be populated, then drop it. */
+static void async_pf_execute_private(struct kvm *kvm, gfn_t gfn)
+{
+	struct kvm_memory_slot *slot;
+	kvm_pfn_t pfn;
+	int idx;
+
+	idx = srcu_read_lock(&kvm->srcu);
+	slot = gfn_to_memslot(kvm, gfn);
+	if (slot && kvm_slot_can_be_private(slot) &&
+	    !kvm_gmem_get_pfn(kvm, slot, gfn, &pfn, NULL))
+		kvm_release_pfn_clean(pfn);
+	srcu_read_unlock(&kvm->srcu, idx);
+}
+
 static void async_pf_execute(struct work_struct *work)
 {
 	struct kvm_async_pf *apf =
@@ -55,15 +70,19 @@ static void async_pf_execute(struct work_struct *work)
 
 	might_sleep();
 
-	/*
-	 * This work is run asynchronously to the task which owns
-	 * mm and might be done in another context, so we must
-	 * access remotely.
-	 */
-	mmap_read_lock(mm);
-	get_user_pages_remote(mm, addr, 1, FOLL_WRITE, NULL, &locked);
-	if (locked)
-		mmap_read_unlock(mm);
+	if (apf->private) {
+		async_pf_execute_private(vcpu->kvm, apf->gfn);
+	} else {
+		/*
+		 * This work is run asynchronously to the task which owns
+		 * mm and might be done in another context, so we must
+		 * access remotely.
+		 */
+		mmap_read_lock(mm);
+		get_user_pages_remote(mm, addr, 1, FOLL_WRITE, NULL, &locked);
+		if (locked)
+			mmap_read_unlock(mm);
+	}
 
 	if (IS_ENABLED(CONFIG_KVM_ASYNC_PF_SYNC))
 		kvm_arch_async_page_present(vcpu, apf);
@@ -159,18 +178,15 @@ void kvm_check_async_pf_completion(struct kvm_vcpu *vcpu)
  * Try to schedule a job to handle page fault asynchronously. Returns 'true' on
  * success, 'false' on failure (page fault has to be handled synchronously).
  */
-bool kvm_setup_async_pf(struct kvm_vcpu *vcpu, gpa_t cr2_or_gpa,
-			unsigned long hva, struct kvm_arch_async_pf *arch)
+static bool __kvm_setup_async_pf(struct kvm_vcpu *vcpu, gpa_t cr2_or_gpa,
+				 unsigned long hva, bool private, gfn_t gfn,
+				 struct kvm_arch_async_pf *arch)
 {
 	struct kvm_async_pf *work;
 
 	if (vcpu->async_pf.queued >= ASYNC_PF_PER_VCPU)
 		return false;
 
-	/* Arch specific code should not do async PF in this case */
-	if (unlikely(kvm_is_error_hva(hva)))
-		return false;
-
 	/*
 	 * do alloc nowait since if we are going to sleep anyway we
 	 * may as well sleep faulting in page
@@ -183,6 +199,8 @@ bool kvm_setup_async_pf(struct kvm_vcpu *vcpu, gpa_t cr2_or_gpa,
 	work->vcpu = vcpu;
 	work->cr2_or_gpa = cr2_or_gpa;
 	work->addr = hva;
+	work->private = private;
+	work->gfn = gfn;
 	work->arch = *arch;
 	work->mm = current->mm;
 	mmget(work->mm);
@@ -199,6 +217,27 @@ bool kvm_setup_async_pf(struct kvm_vcpu *vcpu, gpa_t cr2_or_gpa,
 	return true;
 }
 
+bool kvm_setup_async_pf(struct kvm_vcpu *vcpu, gpa_t cr2_or_gpa,
+			unsigned long hva, struct kvm_arch_async_pf *arch)
+{
+	/* Arch specific code should not do async PF in this case */
+	if (unlikely(kvm_is_error_hva(hva)))
+		return false;
+
+	return __kvm_setup_async_pf(vcpu, cr2_or_gpa, hva, false, 0, arch);
+}
+
+/*
+ * Same as kvm_setup_async_pf(), for a fault on private memory, which has no
+ * hva: the job waits for the guest_memfd page of @gfn instead.
+ */
+bool kvm_setup_async_pf_private(struct kvm_vcpu *vcpu, gpa_t cr2_or_gpa,
+				gfn_t gfn, struct kvm_arch_async_pf *arch)
+{
+	return __kvm_setup_async_pf(vcpu, cr2_or_gpa, KVM_HVA_ERR_BAD, true,
+				    gfn, arch);
+}
+
 int kvm_async_pf_wakeup_all(struct kvm_vcpu *vcpu)
 {
 	struct kvm_async_pf *work;
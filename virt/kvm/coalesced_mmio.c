@@ -107,6 +107,11 @@ static const struct kvm_io_device_ops coalesced_mmio_ops = {
 	.destructor = coalesced_mmio_destructor,
 };
 
+bool kvm_is_coalesced_mmio_dev(struct kvm_io_device *dev)
+{
+	return dev->ops == &coalesced_mmio_ops;
+}
+
 int kvm_coalesced_mmio_init(struct kvm *kvm)
 {
 	struct page *page;
@@ -28,11 +28,16 @@ int kvm_vm_ioctl_register_coalesced_mmio(struct kvm *kvm,
 					struct kvm_coalesced_mmio_zone *zone);
 int kvm_vm_ioctl_unregister_coalesced_mmio(struct kvm *kvm,
 					struct kvm_coalesced_mmio_zone *zone);
+bool kvm_is_coalesced_mmio_dev(struct kvm_io_device *dev);
 
 #else
 
 static inline int kvm_coalesced_mmio_init(struct kvm *kvm) { return 0; }
 static inline void kvm_coalesced_mmio_free(struct kvm *kvm) { }
+static inline bool kvm_is_coalesced_mmio_dev(struct kvm_io_device *dev)
+{
+	return false;
+}
 
 #endif
 
@@ -538,6 +538,7 @@ kvm_eventfd_init(struct kvm *kvm)
 	mutex_init(&kvm->irqfds.resampler_lock);
 #endif
 	INIT_LIST_HEAD(&kvm->ioeventfds);
+	hash_init(kvm->ioeventfd_hash);
 }
 
 #ifdef CONFIG_HAVE_KVM_IRQFD
@@ -708,6 +709,8 @@ void kvm_irqfd_exit(void)
 
 struct _ioeventfd {
 	struct list_head     list;
+	struct hlist_node    hnode;
+	struct kvm          *kvm;
 	u64                  addr;
 	int                  length;
 	struct eventfd_ctx  *eventfd;
@@ -723,9 +726,28 @@ to_ioeventfd(struct kvm_io_device *dev)
 	return container_of(dev, struct _ioeventfd, dev);
 }
 
+/* Wildcard MMIO ioeventfds, i.e. virtio notifications, are also hashed. */
+static bool
+ioeventfd_hashed(struct _ioeventfd *p)
+{
+	return p->wildcard &&
+	       (p->bus_idx == KVM_MMIO_BUS || p->bus_idx == KVM_FAST_MMIO_BUS);
+}
+
 static void
 ioeventfd_release(struct _ioeventfd *p)
 {
+	/*
+	 * kvm_deassign_ioeventfd_idx() unhashes the ioeventfd before the bus
+	 * synchronizes srcu.  Only a bus that failed to shrink, destroyed
+	 * with all its devices, gets here with lookups possibly in flight.
+	 * The VM being destroyed has none.
+	 */
+	if (!hlist_unhashed(&p->hnode)) {
+		hash_del_rcu(&p->hnode);
+		if (refcount_read(&p->kvm->users_count))
+			synchronize_srcu_expedited(&p->kvm->srcu);
+	}
 	eventfd_ctx_put(p->eventfd);
 	list_del(&p->list);
 	kfree(p);
@@ -854,6 +876,8 @@ static int kvm_assign_ioeventfd_idx(struct kvm *kvm,
 	}
 
 	INIT_LIST_HEAD(&p->list);
+	INIT_HLIST_NODE(&p->hnode);
+	p->kvm     = kvm;
 	p->addr    = args->addr;
 	p->bus_idx = bus_idx;
 	p->length  = args->len;
@@ -882,6 +906,8 @@ static int kvm_assign_ioeventfd_idx(struct kvm *kvm,
 
 	kvm_get_bus(kvm, bus_idx)->ioeventfd_count++;
 	list_add_tail(&p->list, &kvm->ioeventfds);
+	if (ioeventfd_hashed(p))
+		hash_add_rcu(kvm->ioeventfd_hash, &p->hnode, p->addr);
 
 	mutex_unlock(&kvm->slots_lock);
 
@@ -926,6 +952,7 @@ kvm_deassign_ioeventfd_idx(struct kvm *kvm, enum kvm_bus bus_idx,
 		if (!p->wildcard && p->datamatch != args->datamatch)
 			continue;
 
+		hash_del_rcu(&p->hnode);
 		kvm_io_bus_unregister_dev(kvm, bus_idx, &p->dev);
 		bus = kvm_get_bus(kvm, bus_idx);
 		if (bus)
@@ -1004,6 +1031,30 @@ kvm_assign_ioeventfd(struct kvm *kvm, struct kvm_ioeventfd *args)
 	return ret;
 }
 
+/*
+ * Signal the wildcard MMIO ioeventfd of @addr on @bus_idx, if any, without
+ * searching the bus.  Must be called with kvm->srcu held.  Returns 0 if an
+ * ioeventfd was signaled, -EOPNOTSUPP otherwise, in which case the write must
+ * go to the bus as usual.
+ */
+int kvm_ioeventfd_signal(struct kvm *kvm, enum kvm_bus bus_idx, gpa_t addr,
+			 int len)
+{
+	struct _ioeventfd *p;
+
+	hash_for_each_possible_rcu(kvm->ioeventfd_hash, p, hnode, addr,
+				   srcu_read_lock_held(&kvm->srcu)) {
+		if (p->bus_idx == bus_idx && p->addr == addr &&
+		    (!p->length || p->length == len)) {
+			eventfd_signal(p->eventfd, 1);
+			return 0;
+		}
+	}
+
+	return -EOPNOTSUPP;
+}
+EXPORT_SYMBOL_GPL(kvm_ioeventfd_signal);
+
 int
 kvm_ioeventfd(struct kvm *kvm, struct kvm_ioeventfd *args)
 {
@@ -2,6 +2,8 @@
 #include <linux/backing-dev.h>
 #include <linux/falloc.h>
 #include <linux/kvm_host.h>
+#include <linux/mempolicy.h>
+#include <linux/migrate.h>
 #include <linux/pagemap.h>
 #include <linux/pseudo_fs.h>
 
@@ -11,12 +13,291 @@
 
 static struct vfsmount *kvm_gmem_mnt;
 
+/*
+ * Internal flag in i_private, next to the KVM_CREATE_GUEST_MEMFD flags: the
+ * folios are initialized when they are mapped into the guest, see
+ * kvm_arch_gmem_needs_clear().
+ */
+#define KVM_GMEM_NO_CLEAR	BIT(BITS_PER_LONG - 1)
+
 struct kvm_gmem {
 	struct kvm *kvm;
 	struct xarray bindings;
 	struct list_head entry;
+	/* Punched folios kept for reuse, see kvm_gmem_recycle(). */
+	struct xarray recycled;
+	unsigned long nr_recycled;
+	struct inode *inode;
+	struct list_head recycle_entry;
+};
+
+/*
+ * guest_memfd can't be mmap()ed, so mbind() can't reach it, and the memory
+ * would otherwise land on the node of whichever thread faulted it in.  Instead,
+ * the memory policy of the task creating the file is taken over by the file,
+ * in the mapping's private_data.  Interleaving spreads the file by its offset,
+ * binding to differing nodes is done with one file per node range.
+ */
+struct kvm_gmem_numa {
+	unsigned short mode;
+	nodemask_t nodes;
+};
+
+#ifdef CONFIG_NUMA
+static struct kvm_gmem_numa *kvm_gmem_numa_create(void)
+{
+	struct kvm_gmem_numa *numa;
+	struct mempolicy *pol;
+	bool used = false;
+
+	numa = kzalloc(sizeof(*numa), GFP_KERNEL_ACCOUNT);
+	if (!numa)
+		return NULL;
+
+	task_lock(current);
+	pol = current->mempolicy;
+	if (pol && !nodes_empty(pol->nodes) &&
+	    (pol->mode == MPOL_INTERLEAVE || pol->mode == MPOL_BIND ||
+	     pol->mode == MPOL_PREFERRED)) {
+		numa->mode = pol->mode;
+		numa->nodes = pol->nodes;
+		used = true;
+	}
+	task_unlock(current);
+
+	if (!used) {
+		kfree(numa);
+		return NULL;
+	}
+	return numa;
+}
+
+static int kvm_gmem_interleave_nid(struct kvm_gmem_numa *numa, pgoff_t n)
+{
+	unsigned int target = n % nodes_weight(numa->nodes);
+	int nid = first_node(numa->nodes);
+
+	while (target--)
+		nid = next_node(nid, numa->nodes);
+	return nid;
+}
+
+static int kvm_gmem_folio_nid(struct inode *inode, pgoff_t index,
+			      unsigned int order)
+{
+	struct kvm_gmem_numa *numa = inode->i_mapping->private_data;
+	int nid = numa_node_id();
+
+	if (!numa)
+		return nid;
+
+	switch (numa->mode) {
+	case MPOL_INTERLEAVE:
+		return kvm_gmem_interleave_nid(numa, index >> order);
+	case MPOL_BIND:
+		return node_isset(nid, numa->nodes) ? nid : first_node(numa->nodes);
+	default:
+		return first_node(numa->nodes);
+	}
+}
+
+static struct folio *kvm_gmem_alloc_folio(struct inode *inode, pgoff_t index,
+					  unsigned int order)
+{
+	struct kvm_gmem_numa *numa = inode->i_mapping->private_data;
+	gfp_t gfp = mapping_gfp_mask(inode->i_mapping);
+	int nid;
+
+	if (!numa)
+		return filemap_alloc_folio(gfp, order);
+
+	nid = kvm_gmem_folio_nid(inode, index, order);
+	if (numa->mode == MPOL_BIND)
+		return __folio_alloc(gfp, order, nid, &numa->nodes);
+	return __folio_alloc_node(gfp, order, nid);
+}
+#else
+static inline struct kvm_gmem_numa *kvm_gmem_numa_create(void)
+{
+	return NULL;
+}
+
+static inline int kvm_gmem_folio_nid(struct inode *inode, pgoff_t index,
+				     unsigned int order)
+{
+	return numa_node_id();
+}
+
+static struct folio *kvm_gmem_alloc_folio(struct inode *inode, pgoff_t index,
+					  unsigned int order)
+{
+	return filemap_alloc_folio(mapping_gfp_mask(inode->i_mapping), order);
+}
+#endif
+
+/* Like filemap_grab_folio(), but allocating by the file's memory policy. */
+static struct folio *kvm_gmem_grab_folio(struct inode *inode, pgoff_t index)
+{
+	struct address_space *mapping = inode->i_mapping;
+	struct folio *folio;
+	int r;
+
+	if (!mapping->private_data)
+		return filemap_grab_folio(mapping, index);
+
+	do {
+		folio = __filemap_get_folio(mapping, index, FGP_LOCK, 0);
+		if (!IS_ERR(folio))
+			return folio;
+
+		folio = kvm_gmem_alloc_folio(inode, index, 0);
+		if (!folio)
+			return ERR_PTR(-ENOMEM);
+
+		r = filemap_add_folio(mapping, folio, index,
+				      mapping_gfp_mask(mapping));
+		if (!r)
+			return folio;
+		folio_put(folio);
+	} while (r == -EEXIST);
+
+	return ERR_PTR(r);
+}
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+/*
+ * Reserve of PMD-sized folios for files created with KVM_GUEST_MEMFD_HUGE_POOL.
+ * The reserve is taken when KVM is loaded, before host memory gets fragmented,
+ * as gmem_huge_pool folios on each node with memory, and is topped up again in
+ * the background whenever folios are handed out.  Truncated folios go back to
+ * the page allocator as usual, the refill only has to win them back while they
+ * are still contiguous.
+ */
+static unsigned int gmem_huge_pool;
+module_param(gmem_huge_pool, uint, 0444);
+
+struct kvm_gmem_pool {
+	spinlock_t lock;
+	struct list_head folios;
+	unsigned int nr;
 };
 
+static struct kvm_gmem_pool *kvm_gmem_pools;
+
+static bool kvm_gmem_pool_enabled(void)
+{
+	return !!kvm_gmem_pools;
+}
+
+static void kvm_gmem_pool_fill_node(int nid)
+{
+	struct kvm_gmem_pool *pool = &kvm_gmem_pools[nid];
+	gfp_t gfp = GFP_HIGHUSER | __GFP_THISNODE | __GFP_RETRY_MAYFAIL |
+		    __GFP_NOWARN;
+	struct folio *folio;
+
+	while (READ_ONCE(pool->nr) < gmem_huge_pool) {
+		folio = __folio_alloc_node(gfp, HPAGE_PMD_ORDER, nid);
+		if (!folio)
+			break;
+
+		spin_lock(&pool->lock);
+		list_add(&folio->lru, &pool->folios);
+		pool->nr++;
+		spin_unlock(&pool->lock);
+	}
+}
+
+static void kvm_gmem_pool_refill(struct work_struct *work)
+{
+	int nid;
+
+	for_each_node_state(nid, N_MEMORY)
+		kvm_gmem_pool_fill_node(nid);
+}
+
+static DECLARE_WORK(kvm_gmem_pool_work, kvm_gmem_pool_refill);
+
+static struct folio *kvm_gmem_pool_take(int nid)
+{
+	struct kvm_gmem_pool *pool = &kvm_gmem_pools[nid];
+	struct folio *folio;
+
+	spin_lock(&pool->lock);
+	folio = list_first_entry_or_null(&pool->folios, struct folio, lru);
+	if (folio) {
+		list_del(&folio->lru);
+		pool->nr--;
+	}
+	spin_unlock(&pool->lock);
+
+	if (folio)
+		queue_work(system_unbound_wq, &kvm_gmem_pool_work);
+	return folio;
+}
+
+static int kvm_gmem_pool_init(void)
+{
+	int nid;
+
+	if (!gmem_huge_pool)
+		return 0;
+
+	kvm_gmem_pools = kcalloc(nr_node_ids, sizeof(*kvm_gmem_pools),
+				 GFP_KERNEL);
+	if (!kvm_gmem_pools)
+		return -ENOMEM;
+
+	for_each_node(nid) {
+		spin_lock_init(&kvm_gmem_pools[nid].lock);
+		INIT_LIST_HEAD(&kvm_gmem_pools[nid].folios);
+	}
+
+	kvm_gmem_pool_refill(NULL);
+
+	for_each_node_state(nid, N_MEMORY) {
+		if (kvm_gmem_pools[nid].nr < gmem_huge_pool)
+			pr_warn("kvm: guest_memfd: reserved %u of %u huge folios on node %d\n",
+				kvm_gmem_pools[nid].nr, gmem_huge_pool, nid);
+	}
+	return 0;
+}
+
+static void kvm_gmem_pool_exit(void)
+{
+	struct folio *folio, *tmp;
+	int nid;
+
+	if (!kvm_gmem_pools)
+		return;
+
+	cancel_work_sync(&kvm_gmem_pool_work);
+
+	for_each_node(nid) {
+		list_for_each_entry_safe(folio, tmp, &kvm_gmem_pools[nid].folios, lru) {
+			list_del(&folio->lru);
+			folio_put(folio);
+		}
+	}
+	kfree(kvm_gmem_pools);
+	kvm_gmem_pools = NULL;
+}
+#else
+static inline bool kvm_gmem_pool_enabled(void)
+{
+	return false;
+}
+
+static inline int kvm_gmem_pool_init(void)
+{
+	return 0;
+}
+
+static inline void kvm_gmem_pool_exit(void)
+{
+}
+#endif
+
 static struct folio *kvm_gmem_get_huge_folio(struct inode *inode, pgoff_t index)
 {
 #ifdef CONFIG_TRANSPARENT_HUGEPAGE
@@ -29,11 +310,20 @@ static struct folio *kvm_gmem_get_huge_folio(struct inode *inode, pgoff_t index)
 	if (!(flags & KVM_GUEST_MEMFD_ALLOW_HUGEPAGE))
 		return NULL;
 
+	/* Don't allocate a huge folio that extends past the end of the file. */
+	if ((huge_index + HPAGE_PMD_NR) << PAGE_SHIFT > i_size_read(inode))
+		return NULL;
+
 	if (filemap_range_has_page(mapping, huge_index << PAGE_SHIFT,
 				   (huge_index + HPAGE_PMD_NR - 1) << PAGE_SHIFT))
 		return NULL;
 
-	folio = filemap_alloc_folio(gfp, HPAGE_PMD_ORDER);
+	folio = NULL;
+	if (flags & KVM_GUEST_MEMFD_HUGE_POOL)
+		folio = kvm_gmem_pool_take(kvm_gmem_folio_nid(inode, huge_index,
+							      HPAGE_PMD_ORDER));
+	if (!folio)
+		folio = kvm_gmem_alloc_folio(inode, huge_index, HPAGE_PMD_ORDER);
 	if (!folio)
 		return NULL;
 
@@ -48,32 +338,55 @@ static struct folio *kvm_gmem_get_huge_folio(struct inode *inode, pgoff_t index)
 #endif
 }
 
+/* The folio is in use again, stop tracking it as a punched one. */
+static void kvm_gmem_unrecycle(struct inode *inode, struct folio *folio)
+{
+	struct kvm_gmem *gmem;
+	void *val;
+
+	list_for_each_entry(gmem, &inode->i_mapping->private_list, entry) {
+		if (!READ_ONCE(gmem->nr_recycled))
+			continue;
+
+		xa_lock(&gmem->recycled);
+		val = __xa_erase(&gmem->recycled, folio->index);
+		if (val)
+			gmem->nr_recycled -= xa_to_value(val);
+		xa_unlock(&gmem->recycled);
+	}
+}
+
 static struct folio *kvm_gmem_get_folio(struct inode *inode, pgoff_t index)
 {
 	struct folio *folio;
 
 	folio = kvm_gmem_get_huge_folio(inode, index);
 	if (IS_ERR_OR_NULL(folio)) {
-		folio = filemap_grab_folio(inode->i_mapping, index);
+		folio = kvm_gmem_grab_folio(inode, index);
 		if (IS_ERR_OR_NULL(folio))
 			return NULL;
 	}
 
+	kvm_gmem_unrecycle(inode, folio);
+
 	/*
 	 * Use the up-to-date flag to track whether or not the memory has been
 	 * zeroed before being handed off to the guest.  There is no backing
 	 * storage for the memory, so the folio will remain up-to-date until
 	 * it's removed.
 	 *
-	 * TODO: Skip clearing pages when trusted firmware will do it when
-	 * assigning memory to the guest.
+	 * Skip clearing pages when trusted firmware will do it when assigning
+	 * memory to the guest.
 	 */
 	if (!folio_test_uptodate(folio)) {
+		unsigned long flags = (unsigned long)inode->i_private;
 		unsigned long nr_pages = folio_nr_pages(folio);
 		unsigned long i;
 
-		for (i = 0; i < nr_pages; i++)
-			clear_highpage(folio_page(folio, i));
+		if (!(flags & KVM_GMEM_NO_CLEAR)) {
+			for (i = 0; i < nr_pages; i++)
+				clear_highpage(folio_page(folio, i));
+		}
 
 		folio_mark_uptodate(folio);
 	}
@@ -133,6 +446,22 @@ void __weak kvm_arch_gmem_invalidate(struct kvm *kvm, kvm_pfn_t start, kvm_pfn_t
 {
 }
 
+bool __weak kvm_arch_gmem_needs_clear(struct kvm *kvm)
+{
+	return true;
+}
+
+bool __weak kvm_arch_gmem_relocatable(struct kvm *kvm)
+{
+	return false;
+}
+
+int __weak kvm_arch_gmem_relocate(struct kvm *kvm, struct kvm_memory_slot *slot,
+				  gfn_t gfn, kvm_pfn_t old_pfn, kvm_pfn_t new_pfn)
+{
+	return -EOPNOTSUPP;
+}
+
 /* Handle arch-specific hooks needed before releasing guarded pages. */
 static void kvm_gmem_issue_arch_invalidate(struct kvm *kvm, struct inode *inode,
 					   pgoff_t start, pgoff_t end)
@@ -144,7 +473,6 @@ static void kvm_gmem_issue_arch_invalidate(struct kvm *kvm, struct inode *inode,
 
 	while (index < end) {
 		struct folio *folio;
-		unsigned int order;
 		struct page *page;
 		kvm_pfn_t pfn;
 
@@ -157,9 +485,9 @@ static void kvm_gmem_issue_arch_invalidate(struct kvm *kvm, struct inode *inode,
 
 		page = folio_file_page(folio, index);
 		pfn = page_to_pfn(page);
-		order = folio_order(folio);
 
-		kvm_arch_gmem_invalidate(kvm, pfn, pfn + min((1ul << order), end - index));
+		kvm_arch_gmem_invalidate(kvm, pfn,
+					 pfn + min(folio_next_index(folio), end) - index);
 
 		index = folio_next_index(folio);
 		folio_unlock(folio);
@@ -169,12 +497,153 @@ static void kvm_gmem_issue_arch_invalidate(struct kvm *kvm, struct inode *inode,
 	}
 }
 
-static long kvm_gmem_punch_hole(struct inode *inode, loff_t offset, loff_t len)
+/*
+ * Punching a hole into a file whose memory is initialized by trusted firmware
+ * when it's mapped into the guest (KVM_GMEM_NO_CLEAR, e.g. TDX) writes back
+ * and clears the memory in kvm_arch_gmem_invalidate().  Guests converting a
+ * range back and forth between private and shared get the very same range
+ * added right back, and initialized again, by the same VM.  Keep up to
+ * gmem_recycle_pages pages of punched folios in the file instead of writing
+ * back, clearing and freeing them: a later fault or allocation reuses them as
+ * is, and only the folios evicted to make room for others, or left over when
+ * the file is released, go through kvm_arch_gmem_invalidate().
+ *
+ * The punched memory stays allocated, so this is off by default, and the kept
+ * folios are given up on memory pressure by kvm_gmem_recycle_shrinker.  They
+ * aren't migrated either, see kvm_gmem_migrate_folio().
+ */
+static unsigned long gmem_recycle_pages;
+module_param(gmem_recycle_pages, ulong, 0644);
+
+static void kvm_gmem_unrecycle_range(struct kvm_gmem *gmem, pgoff_t start,
+				     pgoff_t end)
+{
+	unsigned long index;
+	void *val;
+
+	xa_lock(&gmem->recycled);
+	xa_for_each_range(&gmem->recycled, index, val, start, end - 1) {
+		__xa_erase(&gmem->recycled, index);
+		gmem->nr_recycled -= xa_to_value(val);
+	}
+	xa_unlock(&gmem->recycled);
+}
+
+static bool kvm_gmem_recycle(struct inode *inode, pgoff_t start, pgoff_t end)
+{
+	unsigned long flags = (unsigned long)inode->i_private;
+	struct address_space *mapping = inode->i_mapping;
+	struct kvm_gmem *gmem;
+	struct folio *folio;
+	pgoff_t index;
+	int r;
+
+	if (!(flags & KVM_GMEM_NO_CLEAR) ||
+	    !list_is_singular(&mapping->private_list) ||
+	    end - start > READ_ONCE(gmem_recycle_pages))
+		return false;
+
+	gmem = list_first_entry(&mapping->private_list, struct kvm_gmem, entry);
+
+	/* Folios partially in the hole need truncation anyway. */
+	for (index = start; index < end; ) {
+		folio = filemap_get_folio(mapping, index);
+		if (IS_ERR(folio)) {
+			index++;
+			continue;
+		}
+
+		index = folio_next_index(folio);
+		if (folio->index < start || index > end) {
+			folio_put(folio);
+			return false;
+		}
+		folio_put(folio);
+	}
+
+	for (index = start; index < end; ) {
+		folio = filemap_get_folio(mapping, index);
+		if (IS_ERR(folio)) {
+			index++;
+			continue;
+		}
+
+		index = folio_next_index(folio);
+		xa_lock(&gmem->recycled);
+		r = __xa_insert(&gmem->recycled, folio->index,
+				xa_mk_value(folio_nr_pages(folio)), GFP_KERNEL);
+		if (!r)
+			gmem->nr_recycled += folio_nr_pages(folio);
+		xa_unlock(&gmem->recycled);
+		folio_put(folio);
+
+		/* -EBUSY: punched again, it's already kept. */
+		if (r == -ENOMEM)
+			return false;
+	}
+
+	return true;
+}
+
+static void __kvm_gmem_punch_hole(struct inode *inode, pgoff_t start,
+				  pgoff_t end, bool recycle)
 {
 	struct list_head *gmem_list = &inode->i_mapping->private_list;
+	struct kvm_gmem *gmem;
+
+	list_for_each_entry(gmem, gmem_list, entry)
+		kvm_gmem_invalidate_begin(gmem, start, end);
+
+	if (!recycle || !kvm_gmem_recycle(inode, start, end)) {
+		list_for_each_entry(gmem, gmem_list, entry)
+			kvm_gmem_unrecycle_range(gmem, start, end);
+
+		kvm_gmem_issue_arch_invalidate(gmem->kvm, inode, start, end);
+		truncate_inode_pages_range(inode->i_mapping,
+					   (loff_t)start << PAGE_SHIFT,
+					   ((loff_t)end << PAGE_SHIFT) - 1);
+	}
+
+	list_for_each_entry(gmem, gmem_list, entry)
+		kvm_gmem_invalidate_end(gmem, start, end);
+}
+
+/*
+ * Really punch kept folios, lowest offsets first, until no more than @limit
+ * pages are left.  Called with the invalidate lock held for write.
+ */
+static void kvm_gmem_recycle_evict(struct inode *inode, unsigned long limit)
+{
+	struct list_head *gmem_list = &inode->i_mapping->private_list;
+	unsigned long index = 0;
+	struct kvm_gmem *gmem;
+	void *val;
+
+	if (!list_is_singular(gmem_list))
+		return;
+
+	gmem = list_first_entry(gmem_list, struct kvm_gmem, entry);
+	while (READ_ONCE(gmem->nr_recycled) > limit) {
+		xa_lock(&gmem->recycled);
+		val = xa_find(&gmem->recycled, &index, ULONG_MAX, XA_PRESENT);
+		if (val) {
+			__xa_erase(&gmem->recycled, index);
+			gmem->nr_recycled -= xa_to_value(val);
+		}
+		xa_unlock(&gmem->recycled);
+		if (!val)
+			break;
+
+		__kvm_gmem_punch_hole(inode, index, index + xa_to_value(val),
+				      false);
+		cond_resched();
+	}
+}
+
+static long kvm_gmem_punch_hole(struct inode *inode, loff_t offset, loff_t len)
+{
 	pgoff_t start = offset >> PAGE_SHIFT;
 	pgoff_t end = (offset + len) >> PAGE_SHIFT;
-	struct kvm_gmem *gmem;
 
 	/*
 	 * Bindings must stable across invalidation to ensure the start+end
@@ -182,20 +651,70 @@ static long kvm_gmem_punch_hole(struct inode *inode, loff_t offset, loff_t len)
 	 */
 	filemap_invalidate_lock(inode->i_mapping);
 
-	list_for_each_entry(gmem, gmem_list, entry)
-		kvm_gmem_invalidate_begin(gmem, start, end);
-
-	kvm_gmem_issue_arch_invalidate(gmem->kvm, inode, start, end);
-	truncate_inode_pages_range(inode->i_mapping, offset, offset + len - 1);
-
-	list_for_each_entry(gmem, gmem_list, entry)
-		kvm_gmem_invalidate_end(gmem, start, end);
+	__kvm_gmem_punch_hole(inode, start, end, true);
+	kvm_gmem_recycle_evict(inode, READ_ONCE(gmem_recycle_pages));
 
 	filemap_invalidate_unlock(inode->i_mapping);
 
 	return 0;
 }
 
+/* All the files, for the shrinker to find the kept folios. */
+static LIST_HEAD(kvm_gmem_recycle_list);
+static DEFINE_MUTEX(kvm_gmem_recycle_lock);
+
+static unsigned long kvm_gmem_recycle_count(struct shrinker *shrink,
+					    struct shrink_control *sc)
+{
+	unsigned long count = 0;
+	struct kvm_gmem *gmem;
+
+	mutex_lock(&kvm_gmem_recycle_lock);
+	list_for_each_entry(gmem, &kvm_gmem_recycle_list, recycle_entry)
+		count += READ_ONCE(gmem->nr_recycled);
+	mutex_unlock(&kvm_gmem_recycle_lock);
+
+	return count ?: SHRINK_EMPTY;
+}
+
+static unsigned long kvm_gmem_recycle_scan(struct shrinker *shrink,
+					   struct shrink_control *sc)
+{
+	struct address_space *mapping;
+	unsigned long freed = 0, nr;
+	struct kvm_gmem *gmem;
+
+	if (!mutex_trylock(&kvm_gmem_recycle_lock))
+		return SHRINK_STOP;
+
+	list_for_each_entry(gmem, &kvm_gmem_recycle_list, recycle_entry) {
+		mapping = gmem->inode->i_mapping;
+
+		/* The allocation may come from under the invalidate lock. */
+		if (!READ_ONCE(gmem->nr_recycled) ||
+		    !down_write_trylock(&mapping->invalidate_lock))
+			continue;
+
+		nr = gmem->nr_recycled;
+		kvm_gmem_recycle_evict(gmem->inode,
+				       nr - min(nr, sc->nr_to_scan - freed));
+		freed += nr - gmem->nr_recycled;
+		up_write(&mapping->invalidate_lock);
+
+		if (freed >= sc->nr_to_scan)
+			break;
+	}
+	mutex_unlock(&kvm_gmem_recycle_lock);
+
+	return freed;
+}
+
+static struct shrinker kvm_gmem_recycle_shrinker = {
+	.count_objects = kvm_gmem_recycle_count,
+	.scan_objects = kvm_gmem_recycle_scan,
+	.seeks = DEFAULT_SEEKS * 10,
+};
+
 static long kvm_gmem_allocate(struct inode *inode, loff_t offset, loff_t len)
 {
 	struct address_space *mapping = inode->i_mapping;
@@ -274,6 +793,11 @@ static int kvm_gmem_release(struct inode *inode, struct file *file)
 	struct kvm *kvm = gmem->kvm;
 	unsigned long index;
 
+	/* The kept folios are invalidated below with all the others. */
+	mutex_lock(&kvm_gmem_recycle_lock);
+	list_del(&gmem->recycle_entry);
+	mutex_unlock(&kvm_gmem_recycle_lock);
+
 	/*
 	 * Prevent concurrent attempts to *unbind* a memslot.  This is the last
 	 * reference to the file and thus no new bindings can be created, but
@@ -306,8 +830,13 @@ static int kvm_gmem_release(struct inode *inode, struct file *file)
 	mutex_unlock(&kvm->slots_lock);
 
 	xa_destroy(&gmem->bindings);
+	xa_destroy(&gmem->recycled);
 	kfree(gmem);
 
+	/* Nothing can allocate anymore, the inode dies with this file. */
+	kfree(inode->i_mapping->private_data);
+	inode->i_mapping->private_data = NULL;
+
 	kvm_put_kvm(kvm);
 
 	return 0;
@@ -334,13 +863,80 @@ static const struct file_operations kvm_gmem_fops = {
 	.fallocate	= kvm_gmem_fallocate,
 };
 
+#ifdef CONFIG_MIGRATION
+/*
+ * Not mapped by the guest.  Unless the memory is initialized by the firmware,
+ * it holds no guest data.  Otherwise it may be a kept punched folio, or have
+ * been mapped before, and still be dirty with the guest's key: it's written
+ * back only when punched or when the file is released, don't free it.
+ */
+static int kvm_gmem_migrate_unmapped(struct address_space *mapping,
+				     struct folio *dst, struct folio *src,
+				     enum migrate_mode mode)
+{
+	if ((unsigned long)mapping->host->i_private & KVM_GMEM_NO_CLEAR)
+		return -EBUSY;
+
+	return migrate_folio(mapping, dst, src, mode);
+}
+
+/*
+ * Only reached if the arch can relocate the guest's memory, the mapping is
+ * unmovable otherwise.  The contents of a page mapped by the guest are moved
+ * by the arch, together with its references to the page, as the kernel can't
+ * copy them.  Racing faults wait for the lock of @src, and would hold a
+ * reference to it that fails the migration.
+ */
 static int kvm_gmem_migrate_folio(struct address_space *mapping,
 				  struct folio *dst, struct folio *src,
 				  enum migrate_mode mode)
 {
-	WARN_ON_ONCE(1);
-	return -EINVAL;
+	kvm_pfn_t src_pfn = folio_pfn(src), dst_pfn = folio_pfn(dst);
+	struct kvm_memory_slot *slot = NULL;
+	struct kvm_gmem *gmem;
+	gfn_t gfn;
+	int r;
+
+	/* Relocating takes TLB shootdowns of the guest, don't do it async. */
+	if (folio_test_large(src) || mode == MIGRATE_ASYNC)
+		return -EBUSY;
+
+	/* Keep the bindings stable, the lock nests outside of the folio. */
+	if (!down_read_trylock(&mapping->invalidate_lock))
+		return -EAGAIN;
+
+	gmem = list_first_entry_or_null(&mapping->private_list,
+					struct kvm_gmem, entry);
+	if (gmem)
+		slot = xa_load(&gmem->bindings, src->index);
+	if (!slot) {
+		r = kvm_gmem_migrate_unmapped(mapping, dst, src, mode);
+		goto out;
+	}
+
+	gfn = slot->base_gfn + src->index - slot->gmem.pgoff;
+	r = kvm_arch_gmem_relocate(gmem->kvm, slot, gfn, src_pfn, dst_pfn);
+	if (r == -ENOENT) {
+		r = kvm_gmem_migrate_unmapped(mapping, dst, src, mode);
+		goto out;
+	}
+	if (r)
+		goto out;
+
+	r = folio_migrate_mapping(mapping, dst, src, 0);
+	if (r == MIGRATEPAGE_SUCCESS) {
+		folio_migrate_flags(dst, src);
+		goto out;
+	}
+
+	/* Someone else holds a reference to @src, move the data back. */
+	WARN_ON_ONCE(kvm_arch_gmem_relocate(gmem->kvm, slot, gfn, dst_pfn,
+					    src_pfn));
+out:
+	up_read(&mapping->invalidate_lock);
+	return r;
 }
+#endif
 
 static int kvm_gmem_error_page(struct address_space *mapping, struct page *page)
 {
@@ -427,6 +1023,9 @@ static int __kvm_gmem_create(struct kvm *kvm, loff_t size, u64 flags,
 	if (err)
 		goto err_inode;
 
+	if (!kvm_arch_gmem_needs_clear(kvm))
+		flags |= KVM_GMEM_NO_CLEAR;
+
 	inode->i_private = (void *)(unsigned long)flags;
 	inode->i_op = &kvm_gmem_iops;
 	inode->i_mapping->a_ops = &kvm_gmem_aops;
@@ -435,7 +1034,9 @@ static int __kvm_gmem_create(struct kvm *kvm, loff_t size, u64 flags,
 	mapping_set_gfp_mask(inode->i_mapping, GFP_HIGHUSER);
 	mapping_set_large_folios(inode->i_mapping);
 	mapping_set_unevictable(inode->i_mapping);
-	mapping_set_unmovable(inode->i_mapping);
+	if (!kvm_arch_gmem_relocatable(kvm))
+		mapping_set_unmovable(inode->i_mapping);
+	inode->i_mapping->private_data = kvm_gmem_numa_create();
 
 	fd = get_unused_fd_flags(0);
 	if (fd < 0) {
@@ -460,7 +1061,13 @@ static int __kvm_gmem_create(struct kvm *kvm, loff_t size, u64 flags,
 
 	kvm_get_kvm(kvm);
 	gmem->kvm = kvm;
+	gmem->inode = inode;
 	xa_init(&gmem->bindings);
+	xa_init(&gmem->recycled);
+
+	mutex_lock(&kvm_gmem_recycle_lock);
+	list_add(&gmem->recycle_entry, &kvm_gmem_recycle_list);
+	mutex_unlock(&kvm_gmem_recycle_lock);
 
 	file->private_data = gmem;
 
@@ -474,6 +1081,7 @@ static int __kvm_gmem_create(struct kvm *kvm, loff_t size, u64 flags,
 err_fd:
 	put_unused_fd(fd);
 err_inode:
+	kfree(inode->i_mapping->private_data);
 	iput(inode);
 	return err;
 }
@@ -500,10 +1108,16 @@ int kvm_gmem_create(struct kvm *kvm, struct kvm_create_guest_memfd *args)
 
 	if (IS_ENABLED(CONFIG_TRANSPARENT_HUGEPAGE))
 		valid_flags |= KVM_GUEST_MEMFD_ALLOW_HUGEPAGE;
+	if (kvm_gmem_pool_enabled())
+		valid_flags |= KVM_GUEST_MEMFD_HUGE_POOL;
 
 	if (flags & ~valid_flags)
 		return -EINVAL;
 
+	if ((flags & KVM_GUEST_MEMFD_HUGE_POOL) &&
+	    !(flags & KVM_GUEST_MEMFD_ALLOW_HUGEPAGE))
+		return -EINVAL;
+
 	if (!kvm_gmem_is_valid_size(size, flags))
 		return -EINVAL;
 
@@ -598,8 +1212,82 @@ void kvm_gmem_unbind(struct kvm_memory_slot *slot)
 	fput(file);
 }
 
-int kvm_gmem_get_pfn(struct kvm *kvm, struct kvm_memory_slot *slot,
-		     gfn_t gfn, kvm_pfn_t *pfn, int *max_order)
+/*
+ * Resizing a slot in place keeps the mappings of the range it has in common
+ * with @old, so @new must use the same file at the same offset.  Check that,
+ * and that the range added to the file's bindings is free, without changing
+ * anything: the resize can still fail, kvm_gmem_rebind() moves the binding
+ * once it can't.  Called with slots_lock held, which keeps the bindings and
+ * the file of @old stable.
+ */
+int kvm_gmem_check_rebind(struct kvm_memory_slot *old,
+			  struct kvm_memory_slot *new, unsigned int fd,
+			  loff_t offset)
+{
+	loff_t size = new->npages << PAGE_SHIFT;
+	struct file *file, *old_file;
+	unsigned long start, end;
+	struct kvm_gmem *gmem;
+	struct inode *inode;
+	int r = -EINVAL;
+
+	old_file = kvm_gmem_get_file(old);
+	if (!old_file)
+		return -EINVAL;
+
+	file = fget(fd);
+	if (file != old_file || offset != (loff_t)old->gmem.pgoff << PAGE_SHIFT)
+		goto out;
+
+	inode = file_inode(file);
+	if (!kvm_gmem_is_valid_size(size, (unsigned long)inode->i_private) ||
+	    offset + size > i_size_read(inode))
+		goto out;
+
+	gmem = file->private_data;
+	start = old->gmem.pgoff + old->npages;
+	end = old->gmem.pgoff + new->npages;
+	if (start < end && xa_find(&gmem->bindings, &start, end - 1, XA_PRESENT))
+		goto out;
+
+	r = 0;
+out:
+	if (file)
+		fput(file);
+	fput(old_file);
+	return r;
+}
+
+/* Move the binding of @old over to @new, see kvm_gmem_check_rebind(). */
+void kvm_gmem_rebind(struct kvm_memory_slot *old, struct kvm_memory_slot *new)
+{
+	unsigned long start = old->gmem.pgoff;
+	struct file *file = kvm_gmem_get_file(old);
+	struct kvm_gmem *gmem;
+
+	if (WARN_ON_ONCE(!file))
+		return;
+
+	gmem = file->private_data;
+
+	filemap_invalidate_lock(file->f_mapping);
+	xa_store_range(&gmem->bindings, start, start + new->npages - 1, new,
+		       GFP_KERNEL);
+	if (old->npages > new->npages)
+		xa_store_range(&gmem->bindings, start + new->npages,
+			       start + old->npages - 1, NULL, GFP_KERNEL);
+	rcu_assign_pointer(new->gmem.file, file);
+	new->gmem.pgoff = start;
+	rcu_assign_pointer(old->gmem.file, NULL);
+	synchronize_rcu();
+	filemap_invalidate_unlock(file->f_mapping);
+
+	fput(file);
+}
+
+static int __kvm_gmem_get_pfn(struct kvm *kvm, struct kvm_memory_slot *slot,
+			      gfn_t gfn, kvm_pfn_t *pfn, int *max_order,
+			      bool nowait)
 {
 	pgoff_t index = gfn - slot->base_gfn + slot->gmem.pgoff;
 	struct kvm_gmem *gmem;
@@ -618,6 +1306,23 @@ int kvm_gmem_get_pfn(struct kvm *kvm, struct kvm_memory_slot *slot,
 		return -EIO;
 	}
 
+	/*
+	 * A locked folio is being populated, e.g. allocated and cleared by
+	 * fallocate() or by another fault, or migrated.  Don't wait for it.
+	 */
+	if (nowait) {
+		folio = filemap_get_folio(file_inode(file)->i_mapping, index);
+		if (!IS_ERR(folio)) {
+			bool locked = folio_test_locked(folio);
+
+			folio_put(folio);
+			if (locked) {
+				fput(file);
+				return -EAGAIN;
+			}
+		}
+	}
+
 	folio = kvm_gmem_get_folio(file_inode(file), index);
 	if (!folio) {
 		fput(file);
@@ -627,16 +1332,83 @@ int kvm_gmem_get_pfn(struct kvm *kvm, struct kvm_memory_slot *slot,
 	page = folio_file_page(folio, index);
 
 	*pfn = page_to_pfn(page);
-	if (max_order)
-		*max_order = compound_order(compound_head(page));
+	if (max_order) {
+		int order = folio_order(folio);
+		gfn_t huge_gfn = round_down(gfn, 1ul << order);
+
+		/*
+		 * The folio can be mapped as a huge page only if the GFN and
+		 * the file offset are equally aligned and the huge page is
+		 * fully covered by the memslot.
+		 */
+		if (order &&
+		    (((slot->base_gfn ^ slot->gmem.pgoff) & ((1ul << order) - 1)) ||
+		     huge_gfn < slot->base_gfn ||
+		     huge_gfn + (1ul << order) > slot->base_gfn + slot->npages))
+			order = 0;
+		*max_order = order;
+	}
 
 	folio_unlock(folio);
 	fput(file);
 
 	return 0;
 }
+
+int kvm_gmem_get_pfn(struct kvm *kvm, struct kvm_memory_slot *slot,
+		     gfn_t gfn, kvm_pfn_t *pfn, int *max_order)
+{
+	return __kvm_gmem_get_pfn(kvm, slot, gfn, pfn, max_order, false);
+}
 EXPORT_SYMBOL_GPL(kvm_gmem_get_pfn);
 
+/*
+ * Returns how many of the up to @nr pages from @gfn on are already allocated
+ * and initialized in the file, i.e. can be mapped without populating them.
+ */
+unsigned long kvm_gmem_nr_populated(struct kvm_memory_slot *slot, gfn_t gfn,
+				    unsigned long nr)
+{
+	pgoff_t start = gfn - slot->base_gfn + slot->gmem.pgoff;
+	pgoff_t index = start;
+	struct folio *folio;
+	struct file *file;
+
+	nr = min_t(unsigned long, nr, slot->base_gfn + slot->npages - gfn);
+
+	file = kvm_gmem_get_file(slot);
+	if (!file)
+		return 0;
+
+	while (index < start + nr) {
+		folio = filemap_get_folio(file->f_mapping, index);
+		if (IS_ERR(folio))
+			break;
+
+		if (folio_test_locked(folio) || !folio_test_uptodate(folio)) {
+			folio_put(folio);
+			break;
+		}
+		index = folio_next_index(folio);
+		folio_put(folio);
+	}
+	fput(file);
+
+	return min_t(unsigned long, index - start, nr);
+}
+EXPORT_SYMBOL_GPL(kvm_gmem_nr_populated);
+
+/*
+ * Like kvm_gmem_get_pfn(), but fail with -EAGAIN instead of waiting for a page
+ * that is being populated, so that the fault can be completed asynchronously.
+ */
+int kvm_gmem_get_pfn_nowait(struct kvm *kvm, struct kvm_memory_slot *slot,
+			    gfn_t gfn, kvm_pfn_t *pfn, int *max_order)
+{
+	return __kvm_gmem_get_pfn(kvm, slot, gfn, pfn, max_order, true);
+}
+EXPORT_SYMBOL_GPL(kvm_gmem_get_pfn_nowait);
+
 static int kvm_gmem_init_fs_context(struct fs_context *fc)
 {
 	if (!init_pseudo(fc, GUEST_MEMORY_MAGIC))
@@ -653,6 +1425,8 @@ static struct file_system_type kvm_gmem_fs = {
 
 int kvm_gmem_init(void)
 {
+	int r;
+
 	kvm_gmem_mnt = kern_mount(&kvm_gmem_fs);
 	if (IS_ERR(kvm_gmem_mnt))
 		return PTR_ERR(kvm_gmem_mnt);
@@ -660,11 +1434,28 @@ int kvm_gmem_init(void)
 	/* For giggles.  Userspace can never map this anyways. */
 	kvm_gmem_mnt->mnt_flags |= MNT_NOEXEC;
 
+	r = kvm_gmem_pool_init();
+	if (r)
+		goto err_unmount;
+
+	r = register_shrinker(&kvm_gmem_recycle_shrinker, "kvm-gmem-recycle");
+	if (r)
+		goto err_pool;
+
 	return 0;
+
+err_pool:
+	kvm_gmem_pool_exit();
+err_unmount:
+	kern_unmount(kvm_gmem_mnt);
+	kvm_gmem_mnt = NULL;
+	return r;
 }
 
 void kvm_gmem_exit(void)
 {
+	unregister_shrinker(&kvm_gmem_recycle_shrinker);
+	kvm_gmem_pool_exit();
 	kern_unmount(kvm_gmem_mnt);
 	kvm_gmem_mnt = NULL;
 }
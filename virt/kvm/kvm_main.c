@@ -1248,6 +1248,10 @@ static struct kvm *kvm_create_vm(unsigned long type, const char *fdname)
 	xa_init(&kvm->vcpu_array);
 #ifdef CONFIG_KVM_GENERIC_MEMORY_ATTRIBUTES
 	xa_init(&kvm->mem_attr_array);
+	init_rwsem(&kvm->mem_attr_rwsem);
+	spin_lock_init(&kvm->mem_attr_lock);
+	INIT_LIST_HEAD(&kvm->mem_attr_ranges);
+	init_waitqueue_head(&kvm->mem_attr_wq);
 #endif
 
 	INIT_LIST_HEAD(&kvm->gpc_list);
@@ -1640,7 +1644,7 @@ static int check_memory_region_flags(struct kvm *kvm,
 		valid_flags |= KVM_MEM_LOG_DIRTY_PAGES;
 
 	if (kvm_arch_has_private_mem(kvm))
-		valid_flags |= KVM_MEM_PRIVATE;
+		valid_flags |= KVM_MEM_PRIVATE | KVM_MEM_KERNEL_CONVERT;
 
 #ifdef __KVM_HAVE_READONLY_MEM
 	if (!kvm->readonly_mem_unsupported)
@@ -1650,6 +1654,11 @@ static int check_memory_region_flags(struct kvm *kvm,
 	if (mem->flags & ~valid_flags)
 		return -EINVAL;
 
+	/* The guest can only convert memory that has a private backing. */
+	if ((mem->flags & KVM_MEM_KERNEL_CONVERT) &&
+	    !(mem->flags & KVM_MEM_PRIVATE))
+		return -EINVAL;
+
 	return 0;
 }
 
@@ -1764,6 +1773,8 @@ static void kvm_commit_memory_region(struct kvm *kvm,
 		kvm->nr_memslot_pages -= old->npages;
 	else if (change == KVM_MR_CREATE)
 		kvm->nr_memslot_pages += new->npages;
+	else if (change == KVM_MR_RESIZE)
+		kvm->nr_memslot_pages += new->npages - old->npages;
 
 	if ((old_flags ^ new_flags) & KVM_MEM_LOG_DIRTY_PAGES) {
 		int change = (new_flags & KVM_MEM_LOG_DIRTY_PAGES) ? 1 : -1;
@@ -1783,6 +1794,7 @@ static void kvm_commit_memory_region(struct kvm *kvm,
 		break;
 	case KVM_MR_MOVE:
 	case KVM_MR_FLAGS_ONLY:
+	case KVM_MR_RESIZE:
 		/*
 		 * Free the dirty bitmap as needed; the below check encompasses
 		 * both the flags and whether a ring buffer is being used)
@@ -1926,10 +1938,57 @@ static void kvm_update_flags_memslot(struct kvm *kvm,
 	kvm_activate_memslot(kvm, old, new);
 }
 
-static int kvm_set_memslot(struct kvm *kvm,
-			   struct kvm_memory_slot *old,
-			   struct kvm_memory_slot *new,
-			   enum kvm_mr_change change)
+static void kvm_resize_memslot(struct kvm *kvm,
+			       struct kvm_memory_slot *old,
+			       struct kvm_memory_slot *new)
+{
+	gfn_t start = new->base_gfn + new->npages;
+	gfn_t end = old->base_gfn + old->npages;
+	struct kvm_gfn_range range = {
+		.start = start,
+		.end = end,
+		.slot = old,
+		.may_block = true,
+		.only_private = true,
+		.only_shared = true,
+	};
+	bool shrink = new->npages < old->npages;
+
+	/*
+	 * Unlike MOVE, the mappings for the range that is common to the old
+	 * and the new slot stay valid, so there is no INVALID intermediate
+	 * slot and no kvm_arch_flush_shadow_memslot().  When growing, nothing
+	 * can be mapped in the added range yet.  When shrinking, zap only the
+	 * removed tail and keep faults on it from installing new mappings via
+	 * the still active old slot until the new slot is visible.
+	 */
+	if (shrink) {
+		KVM_MMU_LOCK(kvm);
+		kvm_mmu_invalidate_begin(kvm);
+		kvm_mmu_invalidate_range_add(kvm, start, end);
+		if (kvm_mmu_unmap_gfn_range(kvm, &range))
+			kvm_flush_remote_tlbs_range(kvm, start, end - start);
+		KVM_MMU_UNLOCK(kvm);
+	}
+
+	/* Nothing can fail anymore, move the guest_memfd binding over. */
+	kvm_gmem_rebind(old, new);
+
+	kvm_replace_memslot(kvm, old, new);
+	kvm_activate_memslot(kvm, old, new);
+
+	if (shrink) {
+		KVM_MMU_LOCK(kvm);
+		kvm_mmu_invalidate_end(kvm);
+		KVM_MMU_UNLOCK(kvm);
+		kvm_arch_guest_memory_reclaimed(kvm);
+	}
+}
+
+static int __kvm_set_memslot(struct kvm *kvm,
+			     struct kvm_memory_slot *old,
+			     struct kvm_memory_slot *new,
+			     enum kvm_mr_change change)
 {
 	struct kvm_memory_slot *invalid_slot;
 	int r;
@@ -2004,6 +2063,8 @@ static int kvm_set_memslot(struct kvm *kvm,
 		kvm_move_memslot(kvm, old, new, invalid_slot);
 	else if (change == KVM_MR_FLAGS_ONLY)
 		kvm_update_flags_memslot(kvm, old, new);
+	else if (change == KVM_MR_RESIZE)
+		kvm_resize_memslot(kvm, old, new);
 	else
 		BUG();
 
@@ -2021,6 +2082,28 @@ static int kvm_set_memslot(struct kvm *kvm,
 	return 0;
 }
 
+static int kvm_set_memslot(struct kvm *kvm,
+			   struct kvm_memory_slot *old,
+			   struct kvm_memory_slot *new,
+			   enum kvm_mr_change change)
+{
+	int r;
+
+	/*
+	 * Attribute changes walk the memslots and update their arch data, e.g.
+	 * the hugepage tracking of x86, keep them out while the memslots and
+	 * that data are being set up.
+	 */
+#ifdef CONFIG_KVM_GENERIC_MEMORY_ATTRIBUTES
+	down_write(&kvm->mem_attr_rwsem);
+#endif
+	r = __kvm_set_memslot(kvm, old, new, change);
+#ifdef CONFIG_KVM_GENERIC_MEMORY_ATTRIBUTES
+	up_write(&kvm->mem_attr_rwsem);
+#endif
+	return r;
+}
+
 static bool kvm_check_memslot_overlap(struct kvm_memslots *slots, int id,
 				      gfn_t start, gfn_t end)
 {
@@ -2113,9 +2196,30 @@ int __kvm_set_memory_region(struct kvm *kvm,
 		 */
 		if ((kvm->nr_memslot_pages + npages) < kvm->nr_memslot_pages)
 			return -EINVAL;
+	} else if (npages != old->npages) { /* Resize an existing slot. */
+		/*
+		 * Only private slots can be resized in place, to spare VMMs
+		 * that hotplug or unplug guest memory a full teardown of the
+		 * Secure-EPT.  Everything but the size must stay the same, the
+		 * slot must not be dirty logged (the bitmap is sized by npages)
+		 * and the resized boundary must be huge page aligned so that
+		 * no huge mapping straddles the added or removed range.
+		 */
+		if (!(mem->flags & KVM_MEM_PRIVATE) ||
+		    (mem->flags & KVM_MEM_LOG_DIRTY_PAGES) ||
+		    mem->flags != old->flags ||
+		    mem->userspace_addr != old->userspace_addr ||
+		    base_gfn != old->base_gfn ||
+		    !IS_ALIGNED(base_gfn + min(npages, old->npages),
+				PMD_SIZE >> PAGE_SHIFT))
+			return -EINVAL;
+
+		if ((kvm->nr_memslot_pages + npages) < kvm->nr_memslot_pages)
+			return -EINVAL;
+
+		change = KVM_MR_RESIZE;
 	} else { /* Modify an existing slot. */
 		if ((mem->userspace_addr != old->userspace_addr) ||
-		    (npages != old->npages) ||
 		    ((mem->flags ^ old->flags) & KVM_MEM_READONLY))
 			return -EINVAL;
 
@@ -2127,7 +2231,8 @@ int __kvm_set_memory_region(struct kvm *kvm,
 			return 0;
 	}
 
-	if ((change == KVM_MR_CREATE || change == KVM_MR_MOVE) &&
+	if ((change == KVM_MR_CREATE || change == KVM_MR_MOVE ||
+	     change == KVM_MR_RESIZE) &&
 	    kvm_check_memslot_overlap(slots, id, base_gfn, base_gfn + npages))
 		return -EEXIST;
 
@@ -2151,7 +2256,16 @@ int __kvm_set_memory_region(struct kvm *kvm,
 		r = kvm_memslot_gmem_fget(new, mem->gmem_fd);
 		if (r)
 			goto out;
-		r = kvm_gmem_bind(kvm, new, mem->gmem_fd, mem->gmem_offset);
+		/*
+		 * A resize keeps the binding of the old slot until it can't
+		 * fail anymore, see kvm_resize_memslot().
+		 */
+		if (change == KVM_MR_RESIZE)
+			r = kvm_gmem_check_rebind(old, new, mem->gmem_fd,
+						  mem->gmem_offset);
+		else
+			r = kvm_gmem_bind(kvm, new, mem->gmem_fd,
+					  mem->gmem_offset);
 		if (r)
 			goto out;
 	}
@@ -2163,7 +2277,7 @@ int __kvm_set_memory_region(struct kvm *kvm,
 	return 0;
 
 out_restricted:
-	if (mem->flags & KVM_MEM_PRIVATE)
+	if ((mem->flags & KVM_MEM_PRIVATE) && change != KVM_MR_RESIZE)
 		kvm_gmem_unbind(new);
 out:
 	kvm_memslot_gmem_fput(new);
@@ -2472,6 +2586,43 @@ static u64 kvm_supported_mem_attributes(struct kvm *kvm)
 	return 0;
 }
 
+/*
+ * Returns true if all of [start, end) has exactly @attrs, e.g. to tell that a
+ * conversion is a nop.
+ */
+bool kvm_range_has_memory_attributes(struct kvm *kvm, gfn_t start, gfn_t end,
+				     unsigned long attrs)
+{
+	XA_STATE(xas, &kvm->mem_attr_array, start);
+	unsigned long index;
+	bool has_attrs;
+	void *entry;
+
+	rcu_read_lock();
+
+	if (!attrs) {
+		has_attrs = !xas_find(&xas, end - 1);
+		goto out;
+	}
+
+	has_attrs = true;
+	for (index = start; index < end; index++) {
+		do {
+			entry = xas_next(&xas);
+		} while (xas_retry(&xas, entry));
+
+		if (xas.xa_index != index || xa_to_value(entry) != attrs) {
+			has_attrs = false;
+			break;
+		}
+	}
+
+out:
+	rcu_read_unlock();
+	return has_attrs;
+}
+EXPORT_SYMBOL_GPL(kvm_range_has_memory_attributes);
+
 static __always_inline void kvm_handle_gfn_range(struct kvm *kvm,
 						 struct kvm_mmu_notifier_range *range)
 {
@@ -2523,8 +2674,110 @@ static __always_inline void kvm_handle_gfn_range(struct kvm *kvm,
 	}
 }
 
-static int kvm_vm_set_mem_attributes(struct kvm *kvm, unsigned long attributes,
-				     gfn_t start, gfn_t end)
+/*
+ * Store @entry in [start, end) of the attributes array in one walk under one
+ * lock, instead of a walk and a lock round trip per GFN, so that converting
+ * all of a big VM's memory doesn't take minutes.  With @reserve, only make
+ * sure that storing there can't fail, i.e. reserve the slots that are empty.
+ */
+static int __kvm_store_mem_attributes(struct kvm *kvm, gfn_t start, gfn_t end,
+				      void *entry, bool reserve)
+{
+	XA_STATE(xas, &kvm->mem_attr_array, start);
+	void *curr;
+
+	do {
+		xas_lock(&xas);
+		for (;;) {
+			/* Loads xa_index itself after a restart or a pause. */
+			curr = xas_next(&xas);
+			if (xas.xa_index >= end)
+				break;
+
+			if (reserve ? !curr : curr != entry) {
+				xas_store(&xas, reserve ? XA_ZERO_ENTRY : entry);
+				if (xas_error(&xas))
+					break;
+			}
+
+			if (need_resched()) {
+				xas_pause(&xas);
+				xas_unlock(&xas);
+				cond_resched();
+				xas_lock(&xas);
+			}
+		}
+		xas_unlock(&xas);
+	} while (xas_nomem(&xas, GFP_KERNEL_ACCOUNT));
+
+	return xas_error(&xas);
+}
+
+/*
+ * Reserve memory ahead of time to avoid having to deal with failures partway
+ * through setting new attributes.  Clearing attributes never allocates.
+ */
+int kvm_reserve_mem_attributes(struct kvm *kvm, gfn_t start, gfn_t end,
+			       unsigned long attributes)
+{
+	if (!attributes)
+		return 0;
+	return __kvm_store_mem_attributes(kvm, start, end, NULL, true);
+}
+
+void kvm_store_mem_attributes(struct kvm *kvm, gfn_t start, gfn_t end,
+			      unsigned long attributes)
+{
+	void *entry = attributes ? xa_mk_value(attributes) : NULL;
+
+	KVM_BUG_ON(__kvm_store_mem_attributes(kvm, start, end, entry, false),
+		   kvm);
+}
+
+static bool kvm_mem_attr_range_busy(struct kvm *kvm, gfn_t start, gfn_t end)
+{
+	struct kvm_mem_attr_range *range;
+
+	lockdep_assert_held(&kvm->mem_attr_lock);
+
+	list_for_each_entry(range, &kvm->mem_attr_ranges, list) {
+		if (range->start < end && start < range->end)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Changes of disjoint ranges, e.g. the MapGPAs of different vCPUs, run
+ * concurrently, only overlapping ones wait for each other.
+ */
+void kvm_mem_attr_range_lock(struct kvm *kvm, struct kvm_mem_attr_range *range)
+{
+	spin_lock(&kvm->mem_attr_lock);
+	wait_event_cmd(kvm->mem_attr_wq,
+		       !kvm_mem_attr_range_busy(kvm, range->start, range->end),
+		       spin_unlock(&kvm->mem_attr_lock),
+		       spin_lock(&kvm->mem_attr_lock));
+	list_add(&range->list, &kvm->mem_attr_ranges);
+	spin_unlock(&kvm->mem_attr_lock);
+}
+
+void kvm_mem_attr_range_unlock(struct kvm *kvm,
+			       struct kvm_mem_attr_range *range)
+{
+	spin_lock(&kvm->mem_attr_lock);
+	list_del(&range->list);
+	spin_unlock(&kvm->mem_attr_lock);
+	wake_up_all(&kvm->mem_attr_wq);
+}
+
+/*
+ * Also called by the arch code on behalf of the guest, e.g. for a TDX MapGPA
+ * on a memslot with KVM_MEM_KERNEL_CONVERT.  Memslot changes synchronize SRCU
+ * with mem_attr_rwsem held, vCPUs must drop kvm->srcu before calling this.
+ */
+int kvm_vm_set_mem_attributes(struct kvm *kvm, unsigned long attributes,
+			      gfn_t start, gfn_t end)
 {
 	struct kvm_mmu_notifier_range unmap_range = {
 		.start = start,
@@ -2546,39 +2799,48 @@ static int kvm_vm_set_mem_attributes(struct kvm *kvm, unsigned long attributes,
 		.on_unlock = (void *)kvm_null_fn,
 		.may_block = true,
 	};
-	unsigned long i;
-	void *entry;
-	int r;
-
-	entry = attributes ? xa_mk_value(attributes) : NULL;
+	struct kvm_mem_attr_range range = {
+		.start = start,
+		.end = end,
+	};
+	int idx, r;
 
-	mutex_lock(&kvm->slots_lock);
+	down_read(&kvm->mem_attr_rwsem);
+	kvm_mem_attr_range_lock(kvm, &range);
+	idx = srcu_read_lock(&kvm->srcu);
 
 	/*
-	 * Reserve memory ahead of time to avoid having to deal with failures
-	 * partway through setting the new attributes.
+	 * Nothing to do if the attributes don't change, e.g. a guest MapGPA
+	 * confirming that its bounce buffers are shared.  Don't zap, so that
+	 * the range keeps its (huge) mappings.
 	 */
-	for (i = start; i < end; i++) {
-		r = xa_reserve(&kvm->mem_attr_array, i, GFP_KERNEL_ACCOUNT);
-		if (r)
-			goto out_unlock;
-	}
+	r = 0;
+	if (kvm_range_has_memory_attributes(kvm, start, end, attributes))
+		goto out_unlock;
+
+	r = kvm_reserve_mem_attributes(kvm, start, end, attributes);
+	if (r)
+		goto out_unlock;
 
 	kvm_handle_gfn_range(kvm, &unmap_range);
 
-	for (i = start; i < end; i++) {
-		r = xa_err(xa_store(&kvm->mem_attr_array, i, entry,
-				    GFP_KERNEL_ACCOUNT));
-		KVM_BUG_ON(r, kvm);
-	}
+	kvm_store_mem_attributes(kvm, start, end, attributes);
+
+	if (attributes & KVM_MEMORY_ATTRIBUTE_PRIVATE)
+		gfn_to_pfn_cache_invalidate_gpa(kvm, gfn_to_gpa(start),
+						gfn_to_gpa(end));
 
 	kvm_handle_gfn_range(kvm, &post_set_range);
 
 out_unlock:
-	mutex_unlock(&kvm->slots_lock);
+	srcu_read_unlock(&kvm->srcu, idx);
+	kvm_mem_attr_range_unlock(kvm, &range);
+	up_read(&kvm->mem_attr_rwsem);
 
 	return r;
 }
+EXPORT_SYMBOL_GPL(kvm_vm_set_mem_attributes);
+
 static int kvm_vm_ioctl_set_mem_attributes(struct kvm *kvm,
 					   struct kvm_memory_attributes *attrs)
 {
@@ -5837,6 +6099,50 @@ int kvm_io_bus_write(struct kvm_vcpu *vcpu, enum kvm_bus bus_idx, gpa_t addr,
 }
 EXPORT_SYMBOL_GPL(kvm_io_bus_write);
 
+/*
+ * kvm_io_bus_write_coalesced - like kvm_io_bus_write(), but only to coalesced
+ * MMIO/PIO zones.  These only take a spinlock to fill the ring, i.e. can be
+ * written with IRQs disabled, e.g. from an exit fastpath.  Fails if any other
+ * device, e.g. an ioeventfd, overlaps the range: the slow path may offer it
+ * the write first, so leave the write to it.
+ */
+int kvm_io_bus_write_coalesced(struct kvm_vcpu *vcpu, enum kvm_bus bus_idx,
+			       gpa_t addr, int len, const void *val)
+{
+	struct kvm_io_bus *bus;
+	struct kvm_io_range range;
+	int first, idx;
+
+	range = (struct kvm_io_range) {
+		.addr = addr,
+		.len = len,
+	};
+
+	bus = srcu_dereference(vcpu->kvm->buses[bus_idx], &vcpu->kvm->srcu);
+	if (!bus)
+		return -ENOMEM;
+
+	first = kvm_io_bus_get_first_dev(bus, addr, len);
+	if (first < 0)
+		return -EOPNOTSUPP;
+
+	for (idx = first; idx < bus->dev_count &&
+	     kvm_io_bus_cmp(&range, &bus->range[idx]) == 0; idx++) {
+		if (!kvm_is_coalesced_mmio_dev(bus->range[idx].dev))
+			return -EOPNOTSUPP;
+	}
+
+	for (idx = first; idx < bus->dev_count &&
+	     kvm_io_bus_cmp(&range, &bus->range[idx]) == 0; idx++) {
+		if (!kvm_iodevice_write(vcpu, bus->range[idx].dev, addr, len,
+					val))
+			return 0;
+	}
+
+	return -EOPNOTSUPP;
+}
+EXPORT_SYMBOL_GPL(kvm_io_bus_write_coalesced);
+
 /* kvm_io_bus_write_cookie - called under kvm->slots_lock */
 int kvm_io_bus_write_cookie(struct kvm_vcpu *vcpu, enum kvm_bus bus_idx,
 			    gpa_t addr, int len, const void *val, long cookie)
@@ -6655,6 +6961,7 @@ int kvm_vm_create_worker_thread(struct kvm *kvm, kvm_vm_thread_fn_t thread_fn,
 
 	return init_context.err;
 }
+EXPORT_SYMBOL_GPL(kvm_vm_create_worker_thread);
 
 void kvm_hardware_enable_lock(void)
 {
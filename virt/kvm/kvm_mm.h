@@ -28,6 +28,7 @@ void gfn_to_pfn_cache_invalidate_start(struct kvm *kvm,
 				       unsigned long start,
 				       unsigned long end,
 				       bool may_block);
+void gfn_to_pfn_cache_invalidate_gpa(struct kvm *kvm, gpa_t start, gpa_t end);
 #else
 static inline void gfn_to_pfn_cache_invalidate_start(struct kvm *kvm,
 						     unsigned long start,
@@ -35,6 +36,11 @@ static inline void gfn_to_pfn_cache_invalidate_start(struct kvm *kvm,
 						     bool may_block)
 {
 }
+
+static inline void gfn_to_pfn_cache_invalidate_gpa(struct kvm *kvm,
+						   gpa_t start, gpa_t end)
+{
+}
 #endif /* HAVE_KVM_PFNCACHE */
 
 #ifdef CONFIG_KVM_PRIVATE_MEM
@@ -44,6 +50,10 @@ int kvm_gmem_create(struct kvm *kvm, struct kvm_create_guest_memfd *args);
 int kvm_gmem_bind(struct kvm *kvm, struct kvm_memory_slot *slot,
 		  unsigned int fd, loff_t offset);
 void kvm_gmem_unbind(struct kvm_memory_slot *slot);
+int kvm_gmem_check_rebind(struct kvm_memory_slot *old,
+			  struct kvm_memory_slot *new, unsigned int fd,
+			  loff_t offset);
+void kvm_gmem_rebind(struct kvm_memory_slot *old, struct kvm_memory_slot *new);
 #else
 static inline int kvm_gmem_init(void)
 {
@@ -73,6 +83,20 @@ static inline void kvm_gmem_unbind(struct kvm_memory_slot *slot)
 {
 	WARN_ON_ONCE(1);
 }
+
+static inline int kvm_gmem_check_rebind(struct kvm_memory_slot *old,
+					struct kvm_memory_slot *new,
+					unsigned int fd, loff_t offset)
+{
+	WARN_ON_ONCE(1);
+	return -EIO;
+}
+
+static inline void kvm_gmem_rebind(struct kvm_memory_slot *old,
+				   struct kvm_memory_slot *new)
+{
+	WARN_ON_ONCE(1);
+}
 #endif /* CONFIG_KVM_PRIVATE_MEM */
 
 #endif /* __KVM_MM_H__ */
@@ -19,23 +19,23 @@
 
 #include "kvm_mm.h"
 
-/*
- * MMU notifier 'invalidate_range_start' hook.
- */
-void gfn_to_pfn_cache_invalidate_start(struct kvm *kvm, unsigned long start,
-				       unsigned long end, bool may_block)
+/* Invalidate the caches of the [@start, @end) range of uHVAs, or of GPAs. */
+static void __gfn_to_pfn_cache_invalidate(struct kvm *kvm, u64 start, u64 end,
+					  bool by_gpa, bool may_block)
 {
 	DECLARE_BITMAP(vcpu_bitmap, KVM_MAX_VCPUS);
 	struct gfn_to_pfn_cache *gpc;
 	bool evict_vcpus = false;
+	u64 addr;
 
 	spin_lock(&kvm->gpc_lock);
 	list_for_each_entry(gpc, &kvm->gpc_list, list) {
 		write_lock_irq(&gpc->lock);
 
 		/* Only a single page so no need to care about length */
+		addr = by_gpa ? gpc->gpa : gpc->uhva;
 		if (gpc->valid && !is_error_noslot_pfn(gpc->pfn) &&
-		    gpc->uhva >= start && gpc->uhva < end) {
+		    addr >= start && addr < end) {
 			gpc->valid = false;
 
 			/*
@@ -76,6 +76,26 @@ void gfn_to_pfn_cache_invalidate_start(struct kvm *kvm, unsigned long start,
 	}
 }
 
+/*
+ * MMU notifier 'invalidate_range_start' hook.
+ */
+void gfn_to_pfn_cache_invalidate_start(struct kvm *kvm, unsigned long start,
+				       unsigned long end, bool may_block)
+{
+	__gfn_to_pfn_cache_invalidate(kvm, start, end, false, may_block);
+}
+
+/*
+ * Called when the [@start, @end) range of GPAs is converted to private.  The
+ * uHVA of a private GPA doesn't map guest memory anymore, only its shared half
+ * can be cached.  hva_to_pfn_retry() checks the attributes with gpc->lock held,
+ * which orders the check with the invalidation.
+ */
+void gfn_to_pfn_cache_invalidate_gpa(struct kvm *kvm, gpa_t start, gpa_t end)
+{
+	__gfn_to_pfn_cache_invalidate(kvm, start, end, true, true);
+}
+
 bool kvm_gpc_check(struct gfn_to_pfn_cache *gpc, unsigned long len)
 {
 	struct kvm_memslots *slots = kvm_memslots(gpc->kvm);
@@ -217,6 +237,14 @@ static kvm_pfn_t hva_to_pfn_retry(struct gfn_to_pfn_cache *gpc)
 		WARN_ON_ONCE(gpc->valid);
 	} while (mmu_notifier_retry_cache(gpc->kvm, mmu_seq));
 
+	if (kvm_mem_is_private(gpc->kvm, gpa_to_gfn(gpc->gpa))) {
+		write_unlock_irq(&gpc->lock);
+		if (new_khva != old_khva)
+			gpc_unmap_khva(new_pfn, new_khva);
+		kvm_release_pfn_clean(new_pfn);
+		goto out_error;
+	}
+
 	gpc->valid = true;
 	gpc->pfn = new_pfn;
 	gpc->khva = new_khva + (gpc->gpa & ~PAGE_MASK);